@@ -41,6 +41,9 @@ struct bk_polling_io;
 struct bk_ring;
 struct bk_stat_list;
 struct bk_stat_node;
+struct bk_metrics_server;
+struct bk_profile;
+struct bk_profile_thread;
 struct bk_threadlist;
 struct bk_threadnode;
 
@@ -281,7 +284,8 @@ struct bk_version
 // @{
 #define BK_DEBUG_KEY "debug"			///< The default key to look up debugging levels in the configuration file
 #define BK_DEBUG_DEFAULTLEVEL "*DEFAULT*"	///< The name of the default "function" which will set the debug level of all functions
-#define bk_debug_and(B,l) (BK_GENERAL_FLAG_ISDEBUGON(B) && BK_BT_CURFUN(B) && (BK_BT_CURFUN(B)->bf_debuglevel & (l))) ///< Test to see if this function has a particular per-function debugging bit set
+#define bk_debug_and(B,l) (BK_GENERAL_FLAG_ISDEBUGON(B) && BK_BT_CURFUN(B) && (BK_FUN_DEBUGLEVEL(B,BK_BT_CURFUN(B)) & (l))) ///< Test to see if this function has a particular per-function debugging bit set
+#define BK_FUN_DEBUGLEVEL(B,fh) (((fh)->bf_debuggen == BkDebugGeneration)?(fh)->bf_debuglevel:bk_fun_debug_refresh(B,fh)) ///< Debug level of a function frame, refreshed if debug levels have changed since it was computed
 #define bk_debug_vprintf_and(B,l,f,ap) (bk_debug_and(B,l)?bk_debug_vprintf(B,f,ap):1) ///< Perform a debugging vprintf if a particular per-function debugging bit is set
 #define bk_debug_printf_and(B,l,f,args...) (bk_debug_and(B,l)?bk_debug_printf(B,f,##args):1) ///< Perform a debugging printf if a particular per-function debugging bit is set
 #define bk_debug_printbuf_and(B,l,i,p,v) (bk_debug_and(B,l)?bk_debug_printbuf(B,i,p,v):1) ///< Perform a debugging printbuf if a particular per-function debugging bit is set
@@ -332,6 +336,7 @@ struct bk_general
   struct bk_proctitle	*bg_proctitle;		///< Process title info
   struct bk_config	*bg_config;		///< Configuration info
   struct bk_child	*bg_child;		///< Tracked child info
+  struct bk_profile	*bg_profile;		///< Sampling profiler (new threads join)
   time_t		bg_start_time;		///< Time process started
   char			*bg_funstatfile;	///< Filename to output funperfstats
   char			*bg_program;		///< Name of program
@@ -355,6 +360,7 @@ struct bk_general
 #define BK_GENERAL_FUNSTATFILE(B) (*((B) ? &((B)->bt_general->bg_funstatfile):(char **)&bk_nullptr)) ///< Access the bk_general function statistics output filename
 #define BK_GENERAL_START_TIME(B) ((B) ? ((B)->bt_general->bg_start_time):(time_t)-1) ///< Access the bk_general start time info
 #define BK_GENERAL_CONFIG(B)	(*((B) ? &((B)->bt_general->bg_config):(struct bk_config **)&bk_nullptr)) ///< Access the bk_general config info
+#define BK_GENERAL_PROFILE(B)	(*((B) ? &((B)->bt_general->bg_profile):(struct bk_profile **)&bk_nullptr)) ///< Access the bk_general sampling profiler
 #define BK_GENERAL_PROGRAM(B)	(*((B) ? &((B)->bt_general->bg_program):(char **)&bk_nullptr)) ///< Access the bk_general program name
 #define BK_GENERAL_FLAGS(B)	(*((B) ? &((B)->bt_general->bg_flags):(unsigned *)&bk_zerouint)) ///< Access the bk_general flags
 #define BK_GENERAL_ISFLAG(B,flag) ((B) ? BK_FLAG_ISSET((B)->bt_general->bg_flags, flag):0) ///< Test the bk_general flags
@@ -450,6 +456,20 @@ typedef union
 
 
 
+/**
+ * Per-thread cache of the date and time prefix last formatted by
+ * bk_time_iso_format, so that only the fields which change are redone.
+ */
+struct bk_time_cache
+{
+  time_t		btc_day;		///< Day since the epoch of btc_prefix
+  time_t		btc_minute;		///< Minute since the epoch of btc_prefix
+  char			btc_prefix[17];		///< "YYYY-mm-ddTHH:MM:"
+  int			btc_valid;		///< btc_prefix has been formatted
+};
+
+
+
 /**
  * @name bk_thread structure, accessors, and flags
  */
@@ -466,6 +486,8 @@ typedef struct __bk_thread
   struct bk_general    *bt_general;		///< Common program state
   struct bk_stat_list  *bt_funstats;		///< Function performance stats
   clockid_t		bt_cpu_clock;		///< CPU clock id
+  struct bk_profile_thread *bt_profile;		///< Sampling profiler state (shadow stack)
+  struct bk_time_cache	bt_timecache;		///< Last ISO time formatted
   bk_flags		bt_flags;		///< Flags for the future
 } *bk_s;
 #define BK_BT_FUNSTATS(B) (*((B) ? &((B)->bt_funstats):(struct bk_stat_list **)&bk_nullptr)) ///< Access the bk_general function statistics state
@@ -476,6 +498,8 @@ typedef struct __bk_thread
 #define BK_BT_GENERAL(B)	((B)->bt_general)    ///< Access the global shared info
 #define BK_BT_CPU_CLOCK(B)	((B)->bt_cpu_clock)  ///< Access thread-specific CPU clock
 #define BK_BT_FLAGS(B)		((B)->bt_flags)      ///< Access thread-specific flags
+#define BK_BT_PROFILE(B)	((B)->bt_profile)    ///< Access thread-specific sampling profiler state
+#define BK_BT_TIMECACHE(B)	(&(B)->bt_timecache) ///< Access thread-specific ISO time format cache
 
 #define BK_B_FLAG_SSL_INITIALIZED	0x1	///< Set if ssl_env_init has already been called.
 // @}
@@ -860,8 +884,8 @@ struct bk_addrgroup
  * @brief Normal method to let function tracing know you have entered
  * function--if function tracing is enabled
  */
-#define BK_ENTRY(B, fun, pkg, grp) struct bk_funinfo *__bk_funinfo = (!B || !BK_GENERAL_FLAG_ISFUNON(B)?NULL:bk_fun_entry(B, fun, pkg, grp))
-#define BK_ENTRY_MAIN(B, fun, pkg, grp) struct bk_funinfo *__bk_funinfo = bk_fun_entry(B, fun, pkg, grp)
+#define BK_ENTRY(B, fun, pkg, grp) static struct bk_debug_cache __bk_debugcache; struct bk_funinfo *__bk_funinfo = (!B || !BK_GENERAL_FLAG_ISFUNON(B)?NULL:bk_fun_entry_cached(B, fun, pkg, grp, &__bk_debugcache))
+#define BK_ENTRY_MAIN(B, fun, pkg, grp) static struct bk_debug_cache __bk_debugcache; struct bk_funinfo *__bk_funinfo = bk_fun_entry_cached(B, fun, pkg, grp, &__bk_debugcache)
 
 
 
@@ -877,7 +901,7 @@ struct bk_addrgroup
  * stack, but the gcc-4 optimizer is too smart and optimizes the hack away, so
  * we must use the volatile declaration correctly.</TRICKY>
  */
-#define BK_ENTRY_VOLATILE(B, fun, pkg, grp) struct bk_funinfo *volatile __bk_funinfo = (!B || !BK_GENERAL_FLAG_ISFUNON(B)?NULL:bk_fun_entry(B, fun, pkg, grp))
+#define BK_ENTRY_VOLATILE(B, fun, pkg, grp) static struct bk_debug_cache __bk_debugcache; struct bk_funinfo *volatile __bk_funinfo = (!B || !BK_GENERAL_FLAG_ISFUNON(B)?NULL:bk_fun_entry_cached(B, fun, pkg, grp, &__bk_debugcache))
 
 
 
@@ -1262,7 +1286,23 @@ struct bk_funinfo
   const char *bf_pkgname;			///< Package name
   const char *bf_grpname;			///< Group name
   u_int32_t bf_debuglevel;			///< Per-function debug level
+  u_int32_t bf_debuggen;			///< BkDebugGeneration @a bf_debuglevel was computed at
+  struct bk_debug_cache *bf_debugcache;		///< Call site debug level cache (may be NULL)
   struct timeval bf_starttime;			///< If function stats on...
+  u_int bf_profdepth;				///< Sampling profiler shadow stack depth at entry
+};
+
+
+
+/**
+ * Per-call-site cache of the debug level for one function/package/group.
+ * One of these lives (statically) in every function using BK_ENTRY, so
+ * that the three string lookups of @a bk_debug_query only happen once per
+ * function per change of debug levels.
+ */
+struct bk_debug_cache
+{
+  u_int64_t bdc_state;				///< Generation (high 32 bits) and level (low 32 bits)
 };
 
 
@@ -1445,6 +1485,8 @@ struct bk_url
 #define BK_URL_FLAG_FRAGMENT		0x10	///< Fragment section set.
 #define BK_URL_FLAG_HOST		0x20	///< Host authority section set.
 #define BK_URL_FLAG_SERV		0x40	///< Service authority section set.
+#define BK_URL_FLAG_USER		0x80	///< User authority section set (spans only).
+#define BK_URL_FLAG_PASS		0x100	///< Password authority section set (spans only).
 #define BK_URL_FLAG_ALL (BK_URL_FLAG_SCHEME | BK_URL_FLAG_AUTHORITY | BK_URL_FLAG_PATH | BK_URL_FLAG_QUERY | BK_URL_FLAG_FRAGMENT) ///< Convenience "sections" flag for bk_url_reconstruct
   bk_url_parse_mode_e		bu_mode;	///< Mode of URL
   char *			bu_url;		///< Entire URL
@@ -1494,6 +1536,42 @@ struct bk_url_authority
   char *	bua_port;			///< port
   bk_flags	bua_flags;			///< Everyone needs flags
 };
+
+
+
+/**
+ * Where one part of a URL is in the string given to bk_url_parse_spans.
+ */
+struct bk_url_span
+{
+  u_int32_t	bup_off;			///< Offset of part in URL
+  u_int32_t	bup_len;			///< Length of part
+};
+
+
+
+/**
+ * Breakdown of a URL as offsets into the URL string, which is neither
+ * copied nor changed.  Parts which were not found are zero (and their
+ * bus_flags clear), except that an empty authority, as in "file:///",
+ * has the nonzero offset where it would have started.
+ */
+struct bk_url_spans
+{
+  bk_flags		bus_flags;		///< BK_URL_FLAG_* for the parts found
+  struct bk_url_span	bus_scheme;		///< Scheme specification
+  struct bk_url_span	bus_authority;		///< Authority specification
+  struct bk_url_span	bus_path;		///< Path specification
+  struct bk_url_span	bus_query;		///< Query specification
+  struct bk_url_span	bus_fragment;		///< Fragment specification
+  struct bk_url_span	bus_user;		///< User (auth. subset) specification
+  struct bk_url_span	bus_pass;		///< Password (auth. subset) specification
+  struct bk_url_span	bus_host;		///< Host (auth. subset) specification
+  struct bk_url_span	bus_serv;		///< Service (auth. subset) specification
+};
+
+#define BK_URL_SPAN_DATA(url, span) ((url) + (span).bup_off) ///< Start of a part of the URL
+#define BK_URL_SPAN_LEN(span) ((span).bup_len)	///< Length of a part of the URL
 // @}
 
 
@@ -1592,6 +1670,40 @@ typedef struct
 // @}
 
 
+/**
+ * @name bk_string_tokenize_spans
+ * Tokens found by bk_string_tokenize_spans, and the state which keeps
+ * their storage between calls so a tokenizing loop need not allocate.
+ */
+// @{
+/**
+ * One token.  It points into the source string, or into the arena of
+ * its bk_strtok if unquoting changed its text, and is not NUL terminated.
+ */
+struct bk_strspan
+{
+  const char *		bss_ptr;		///< Token text
+  size_t		bss_len;		///< Length of token text
+};
+
+
+/**
+ * Reusable tokenizer state.  Zero it before first use and release it
+ * with bk_string_tokenize_spans_free.
+ */
+struct bk_strtok
+{
+  struct bk_strspan *	bst_tokens;		///< Tokens from the last call
+  u_int			bst_count;		///< Number of tokens
+  u_int			bst_size;		///< Allocated token slots
+  char *		bst_arena;		///< Text of tokens which were unquoted
+  size_t		bst_arenasize;		///< Allocated arena size
+  struct bk_strtok_scan *bst_scan;		///< Character classes kept from the last call
+};
+// @}
+
+
+
 /**
  * @name BAKA String Registry
  * Maps string to a uniq identifier for purposes of quick compare and perfect hashing.
@@ -1637,6 +1749,7 @@ struct bk_vault_node
 typedef dict_h bk_vault_t;			///< Abbreviation for some vague notion of abstraction...
 typedef dict_h bk_bstvault_t;			///< Abbreviation for some vague notion of abstraction...
 typedef dict_h bk_dllvault_t;			///< Abbreviation for some vague notion of abstraction...
+typedef struct bk_flatvault *bk_flatvault_t;	///< Open addressed vault (see bk_flatvault_create)
 // @}
 
 
@@ -1697,16 +1810,28 @@ extern u_int bk_bitcount(bk_s B, u_int word);
 
 /* b_cksum.c */
 extern int bk_in_cksum(bk_s B, bk_vptr *m, int len);
+extern u_int16_t bk_in_cksum_update(u_int16_t cksum, const void *oldval, const void *newval, size_t len);
+extern u_int16_t bk_in_cksum_update32(u_int16_t cksum, u_int32_t oldval, u_int32_t newval);
 
 
 
 /* b_crc.c */
 extern u_int32_t bk_crc32(u_int32_t crc, void *buf, int len);
+extern u_int32_t bk_crc32c(u_int32_t crc, const void *buf, size_t len);
+extern bk_flags bk_crc_methods(bk_flags flags);
+extern u_int32_t bk_crc_method(u_int32_t crc, const void *buf, size_t len, bk_flags flags);
+#define BK_CRC_METHOD_BYTE	0x01		///< One table lookup per byte
+#define BK_CRC_METHOD_SLICE8	0x02		///< Eight bytes per step, eight tables
+#define BK_CRC_METHOD_SLICE16	0x04		///< Sixteen bytes per step, sixteen tables
+#define BK_CRC_METHOD_CLMUL	0x08		///< x86 PCLMULQDQ folding (CRC-32 only)
+#define BK_CRC_METHOD_HW	0x10		///< x86 SSE4.2 crc32 instruction (CRC-32C only)
+#define BK_CRC_32C		0x100		///< CRC-32C instead of CRC-32
 
 
 
 /* b_config.c */
 extern struct bk_config *bk_config_init(bk_s B, const char *filename, struct bk_config_user_pref *bcup, bk_flags flags);
+#define BK_CONFIG_INIT_NOSNAPSHOT	0x01	///< Do not compile lookup snapshots (lookups walk the parse tree)
 extern int bk_config_get(bk_s B, struct bk_config *config, const char **filename, struct bk_config_user_pref **bcup, bk_flags *getflags);
 extern int bk_config_reinit(bk_s B, struct bk_config *config);
 extern void bk_config_destroy(bk_s B, struct bk_config *config);
@@ -1716,6 +1841,12 @@ extern char *bk_config_getnext(bk_s B, struct bk_config *ibc, const char *key, c
 extern int bk_config_delete_key(bk_s B, struct bk_config *ibc, const char *key);
 extern int bk_config_delete_value(bk_s B, struct bk_config *ibc, const char *key, const char *value);
 extern void bk_config_print(bk_s B, struct bk_config *ibc, FILE *fp);
+extern u_int32_t bk_config_generation(bk_s B, struct bk_config *ibc);
+extern int bk_config_reclaim(bk_s B, struct bk_config *ibc, bk_flags flags);
+extern int bk_config_watch(bk_s B, struct bk_config *ibc, struct bk_run *run, bk_flags flags);
+#define BK_CONFIG_WATCH_SIGHUP		0x01	///< Reinit configuration on SIGHUP
+#define BK_CONFIG_WATCH_FILES		0x02	///< Reinit configuration when its files change (linux)
+extern void bk_config_unwatch(bk_s B, struct bk_config *ibc);
 
 
 
@@ -1724,6 +1855,8 @@ extern struct bk_debug *bk_debug_init(bk_s B, bk_flags flags);
 extern void bk_debug_destroy(bk_s B, struct bk_debug *bd);
 extern void bk_debug_reinit(bk_s B, struct bk_debug *bd);
 extern u_int32_t bk_debug_query(bk_s B, struct bk_debug *bdinfo, const char *funname, const char *pkgname, const char *group, bk_flags flags);
+extern u_int32_t bk_debug_query_cached(bk_s B, struct bk_debug *bdinfo, struct bk_debug_cache *cache, const char *funname, const char *pkgname, const char *group, bk_flags flags);
+extern volatile u_int32_t BkDebugGeneration;	///< Bumped whenever any debug level may have changed
 extern int bk_debug_set(bk_s B, struct bk_debug *bdinfo, const char *name, u_int32_t level);
 extern int bk_debug_setconfig(bk_s B, struct bk_debug *bdinfo, struct bk_config *config, const char *program);
 extern void bk_debug_config(bk_s B, struct bk_debug *bdinfo, FILE *fh, int sysloglevel, bk_flags flags);
@@ -1766,6 +1899,8 @@ extern void bk_error_irepeater_flush(bk_s B, struct bk_error *beinfo, bk_flags f
 extern dict_h bk_fun_init(void);
 extern void bk_fun_destroy(dict_h funstack);
 extern struct bk_funinfo *bk_fun_entry(bk_s B, const char *func, const char *package, const char *group);
+extern struct bk_funinfo *bk_fun_entry_cached(bk_s B, const char *func, const char *package, const char *group, struct bk_debug_cache *cache);
+extern u_int32_t bk_fun_debug_refresh(bk_s B, struct bk_funinfo *fh);
 extern void bk_fun_exit(bk_s B, struct bk_funinfo *fh);
 extern void bk_fun_reentry_i(bk_s B, struct bk_funinfo *fh);
 extern void bk_fun_trace(bk_s B, FILE *out, int sysloglevel, bk_flags flags);
@@ -1776,6 +1911,18 @@ extern const char *bk_fun_funname(bk_s B, int ancestordepth, bk_flags flags);
 extern int bk_fun_reset_debug(bk_s B, bk_flags flags);
 
 
+/* b_profile.c */
+extern struct bk_profile *bk_profile_create(bk_s B, u_int hz, u_int nsamples, bk_flags flags);
+#define BK_PROFILE_WALLCLOCK	0x01		///< Sample on elapsed rather than thread CPU time
+#define BK_PROFILE_PERTHREAD	0x02		///< Keep stacks per thread (thread name is the root frame)
+extern void bk_profile_destroy(bk_s B, struct bk_profile *bp);
+extern int bk_profile_thread_start(bk_s B, struct bk_profile *bp, bk_flags flags);
+extern void bk_profile_thread_stop(bk_s B);
+extern int bk_profile_collect(bk_s B, struct bk_profile *bp, bk_flags flags);
+extern int bk_profile_dump(bk_s B, struct bk_profile *bp, FILE *out, bk_flags flags);
+#define BK_PROFILE_DUMP_RESET	0x01		///< Forget the aggregated samples once dumped
+
+
 /* b_funlist.c */
 extern struct bk_funlist *bk_funlist_init(bk_s B, bk_flags flags);
 extern void bk_funlist_destroy(bk_s B, struct bk_funlist *funlist);
@@ -1787,6 +1934,7 @@ extern int bk_funlist_delete(bk_s B, struct bk_funlist *funlist, void (*bf_fun)(
 /* b_memx.c */
 extern const size_t bk_memx_size;
 extern struct bk_memx *bk_memx_create(bk_s B, size_t objsize, u_int start_hint, u_int incr_hint, bk_flags flags);
+#define BK_MEMX_SEGMENTED	  1		///< Grow by adding chunks, never moving elements
 extern void bk_memx_destroy(bk_s B, struct bk_memx *bm, bk_flags flags);
 #define BK_MEMX_PRESERVE_ARRAY    1		///< Don't destroy created array in @a bk_memx_destroy
 extern void *bk_memx_get(bk_s B, struct bk_memx *bm, u_int count, u_int *curused, bk_flags flags);
@@ -1797,6 +1945,8 @@ extern int bk_memx_trunc(bk_s B, struct bk_memx *bm, u_int count, bk_flags flags
 extern int bk_memx_lop(bk_s B, struct bk_memx *bm, u_int count, bk_flags flags);
 extern int bk_memx_append(bk_s B, struct bk_memx *bm, const void *data, u_int count, bk_flags flags);
 extern int bk_memx_info(bk_s B, struct bk_memx *bm, void **arrayp, size_t *unitesizep, size_t *curallocp, size_t *curusedp, u_int *incrp, bk_flags *flagsp, bk_flags flags);
+extern void *bk_memx_segment(bk_s B, struct bk_memx *bm, u_int segno, u_int *countp, bk_flags flags);
+extern int bk_memx_iovec(bk_s B, struct bk_memx *bm, struct iovec *iov, int iovcnt, bk_flags flags);
 
 /* b_run.c */
 extern struct bk_run *bk_run_init(bk_s B, bk_flags flags);
@@ -1990,6 +2140,15 @@ extern char *bk_gethostname(bk_s B);
 /* b_strcode.c */
 extern char *bk_encode_base64(bk_s B, const bk_vptr *str, const char *eolseq);
 extern bk_vptr *bk_decode_base64(bk_s B, const char *str);
+extern struct bk_base64 *bk_base64_create(bk_s B, const char *eolseq, bk_flags flags);
+#define BK_BASE64_DECODE	0x1		///< Decode rather than encode
+extern void bk_base64_destroy(bk_s B, struct bk_base64 *b64);
+extern size_t bk_base64_outlen(bk_s B, struct bk_base64 *b64, size_t inlen);
+extern ssize_t bk_base64_update(bk_s B, struct bk_base64 *b64, const void *in, size_t inlen, void *out, size_t outlen);
+extern ssize_t bk_base64_final(bk_s B, struct bk_base64 *b64, void *out, size_t outlen);
+extern int bk_base64_ioh_filter(bk_s B, struct bk_ioh *ioh, const char *eolseq, bk_flags flags);
+#define BK_BASE64_FILTER_WRITE	0x1		///< Encode data written
+#define BK_BASE64_FILTER_READ	0x2		///< Decode data read
 extern char *bk_string_str2xml(bk_s B, const char *str, bk_flags flags);
 #define BK_STRING_STR2XML_FLAG_ALLOW_NON_PRINT	0x1 ///< Allow non printable chars in output xml string.
 #define BK_STRING_STR2XML_FLAG_ENCODE_WHITESPACE 0x2 ///< Encode whitespace other than space (\040).
@@ -2016,6 +2175,9 @@ extern int bk_string_atod(bk_s B, const char *string, double *value, bk_flags fl
 extern int bk_string_atof(bk_s B, const char *string, float *value, bk_flags flags);
 #define BK_STRING_ATOF_FLAG_ALLOW_INF BK_STRING_ATOD_FLAG_ALLOW_INF
 #define BK_STRING_ATOF_FLAG_ALLOW_NAN BK_STRING_ATOD_FLAG_ALLOW_NAN
+extern ssize_t bk_string_atou64_batch(bk_s B, const char *buf, size_t len, int delim, u_int64_t *values, size_t count, size_t *used, bk_flags flags);
+extern ssize_t bk_string_atoi64_batch(bk_s B, const char *buf, size_t len, int delim, int64_t *values, size_t count, size_t *used, bk_flags flags);
+extern ssize_t bk_string_atod_batch(bk_s B, const char *buf, size_t len, int delim, double *values, size_t count, size_t *used, bk_flags flags);
 
 #if SIZEOF_INT == 4
 #define BK_STRING_ATOI bk_string_atoi32
@@ -2060,6 +2222,7 @@ extern u_int bk_strhash(const char *a, bk_flags flags);
 #define BK_HASH_MODULUS		0x04		///< Modulus by large prime
 #define BK_HASH_V1		0x08		///< K&R hash -- slowish, not so great
 #define BK_HASH_V3		0x10		///< murmurhash -- fast, good distribution
+#define BK_HASH_V4		0x20		///< wyhash-style multiply hash -- fastest, good distribution, single pass over strings
 extern u_int bk_bufhash(const bk_vptr *b, bk_flags flags);
 #define BK_HASH_STRING		0x01		///< String hash if len=1/2/4/8 (UNUSED AND DEPRECATED!!!!)
 
@@ -2083,6 +2246,8 @@ extern char **bk_string_tokenize_split(bk_s B, const char *src, u_int limit, con
 #define BK_STRING_TOKENIZE_NORMAL	(BK_STRING_TOKENIZE_MULTISPLIT|BK_STRING_TOKENIZE_DOUBLEQUOTE)
 #define BK_STRING_TOKENIZE_CONFIG	(BK_STRING_TOKENIZE_DOUBLEQUOTE)
 extern void bk_string_tokenize_destroy(bk_s B, char **tokenized);
+extern int bk_string_tokenize_spans(bk_s B, struct bk_strtok *bst, const char *src, size_t len, u_int limit, const char *spliton, bk_flags flags);
+extern void bk_string_tokenize_spans_free(bk_s B, struct bk_strtok *bst);
 extern char *bk_string_printbuf(bk_s B, const char *intro, const char *prefix, const bk_vptr *buf, bk_flags flags);
 extern char *bk_string_rip(bk_s B, char *string, const char *terminators, bk_flags flags);
 extern char *bk_string_quote(bk_s B, const char *src, const char *needquote, bk_flags flags);
@@ -2112,10 +2277,25 @@ extern const char *bk_string_registry_register_by_id(bk_s B, bk_str_registry_t h
 extern int bk_string_registry_delete_str(bk_s B, bk_str_registry_t handle, const char *str, bk_flags flags);
 extern int bk_string_registry_delete_id(bk_s B, bk_str_registry_t handle, bk_str_id_t id, bk_flags flags);
 extern bk_str_id_t bk_string_registry_idbystr(bk_s B, bk_str_registry_t handle, const char *str, bk_flags flags);
+extern const char *bk_string_registry_strbyid(bk_s B, bk_str_registry_t handle, bk_str_id_t id, bk_flags flags);
 extern char *bk_string_expand(bk_s B, char *src, const dict_h kvht_vardb, const char **envdb, bk_flags flags);
 #define BK_STRING_EXPAND_FREE 1
 extern int bk_string_csv_quote(bk_s B, const char *in_str, int in_len, char *out_str, int out_len, const char *quote_str, bk_flags flags);
 
+/* b_csv.c */
+typedef int (*bk_csv_record_f)(bk_s B, void *opaque, const struct bk_strspan *fields, u_int nfields); ///< Called with each CSV record (fields valid only during call, NULL at end of input); negative return stops parsing
+extern struct bk_csv *bk_csv_create(bk_s B, int delim, bk_csv_record_f callback, void *opaque, bk_flags flags);
+#define BK_CSV_PORTABLE			0x2	///< Use only portable C code (no AVX2), mostly for testing
+extern void bk_csv_destroy(bk_s B, struct bk_csv *csv);
+extern int bk_csv_parse(bk_s B, struct bk_csv *csv, const void *data, size_t len, bk_flags flags);
+#define BK_CSV_FINAL			0x1	///< No more input follows
+extern void bk_csv_ioh_handler(bk_s B, bk_vptr *data, void *opaque, struct bk_ioh *ioh, bk_ioh_status_e status);
+extern int bk_csv_polling_read(bk_s B, struct bk_csv *csv, struct bk_polling_io *bpi, bk_ioh_status_e *status, time_t timeout, bk_flags flags);
+extern struct bk_csv_writer *bk_csv_writer_create(bk_s B, struct bk_ioh *ioh, struct bk_polling_io *bpi, int fd, int delim, size_t bufsize, bk_flags flags);
+extern void bk_csv_writer_destroy(bk_s B, struct bk_csv_writer *csw);
+extern int bk_csv_write(bk_s B, struct bk_csv_writer *csw, const struct bk_strspan *fields, u_int nfields, bk_flags flags);
+extern int bk_csv_writer_flush(bk_s B, struct bk_csv_writer *csw, bk_flags flags);
+
 /* b_murmur.c */
 extern void murmurhash3_x86_32(const void *key, int len, uint32_t seed, void *out);
 extern void murmurhash3_x86_128(const void *key, const int len, uint32_t seed, void *out);
@@ -2125,10 +2305,27 @@ extern void murmurhash3_x64_128(const void *key, const int len, const uint32_t s
 extern struct bk_bloomfilter *bk_bloomfilter_create(bk_s B, int32_t hashes, int64_t bits, const char *filename, bk_flags flags);
 #define BK_BLOOMFILTER_WRITABLE		0x1
 #define BK_BLOOMFILTER_CREATABLE	0x2	// Implies write
+#define BK_BLOOMFILTER_BLOCKED		0x4	// Cache-blocked layout (not Cassandra compatible)
 extern void bk_bloomfilter_destroy(bk_s B, struct bk_bloomfilter *bf);
 extern int bk_bloomfilter_add(bk_s B, struct bk_bloomfilter *bf, const void *key, const int len);
 extern int bk_bloomfilter_is_present(bk_s B, struct bk_bloomfilter *bf, const void *key, const int len);
 extern void bk_bloomfilter_printkey(bk_s B, struct bk_bloomfilter *bf, const void *key, const int len, FILE *fh);
+extern int bk_bloomfilter_add_batch(bk_s B, struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int n);
+extern int bk_bloomfilter_is_present_batch(bk_s B, struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int n, u_char *results);
+extern int bk_bloomfilter_add_bulk(bk_s B, struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int64_t n, int nthreads, bk_flags flags);
+extern int bk_bloomfilter_union(bk_s B, struct bk_bloomfilter *dst, struct bk_bloomfilter *src);
+extern int bk_bloomfilter_intersect(bk_s B, struct bk_bloomfilter *dst, struct bk_bloomfilter *src);
+extern int64_t bk_bloomfilter_popcount(bk_s B, struct bk_bloomfilter *bf);
+extern struct bk_countingbloom *bk_countingbloom_create(bk_s B, int32_t hashes, int64_t counters, const char *filename, bk_flags flags);
+extern void bk_countingbloom_destroy(bk_s B, struct bk_countingbloom *cb);
+extern int bk_countingbloom_add(bk_s B, struct bk_countingbloom *cb, const void *key, const int len);
+extern int bk_countingbloom_remove(bk_s B, struct bk_countingbloom *cb, const void *key, const int len);
+extern int bk_countingbloom_is_present(bk_s B, struct bk_countingbloom *cb, const void *key, const int len);
+extern struct bk_scalablebloom *bk_scalablebloom_create(bk_s B, int64_t capacity, double fprate, const char *filename, bk_flags flags);
+extern void bk_scalablebloom_destroy(bk_s B, struct bk_scalablebloom *sb);
+extern int bk_scalablebloom_add(bk_s B, struct bk_scalablebloom *sb, const void *key, const int len);
+extern int bk_scalablebloom_is_present(bk_s B, struct bk_scalablebloom *sb, const void *key, const int len);
+extern int64_t bk_scalablebloom_count(bk_s B, struct bk_scalablebloom *sb);
 
 /* b_sprintf.c */
 extern char *bk_string_alloc_sprintf(bk_s B, u_int chunk, bk_flags flags, const char *fmt, ...) __attribute__ ((format (printf, 4, 5)));
@@ -2286,6 +2483,8 @@ extern int bk_fileutils_match_extension(bk_s B, const char *path, const char * c
 extern int bk_fileutils_is_true_pipe(bk_s B, int fd, bk_flags flags);
 extern bk_vptr *bk_slurp(bk_s B, FILE *FH, int fd, const char *filename, int maxwastage, bk_flags flags);
 #define BK_SLURP_NULL_TERMINATE			0x01 ///< Ask for returned data to be null terminated
+#define BK_SLURP_MMAP				0x02 ///< Map a regular file read-only instead of reading it
+extern void bk_slurp_free(bk_s B, bk_vptr *data);
 
 
 
@@ -2296,7 +2495,9 @@ extern size_t bk_time_iso_format(bk_s B, char *str, size_t max, const struct tim
 #define BK_TIME_FORMAT_NO_ERROR			0x2 ///< We don't hear about errors.
 // "out" flags
 #define BK_TIME_FORMAT_OUTFLAG_TRUNCATED	0x1 ///< Insufficient input space to save converted time.
+extern ssize_t bk_time_iso_format_batch(bk_s B, char *buf, size_t max, const struct timespec *times, size_t count, int delim, size_t *used, bk_flags flags);
 extern int bk_time_iso_parse(bk_s B, const char *src, struct timespec *dst, bk_flags flags);
+extern ssize_t bk_time_iso_parse_batch(bk_s B, const char *buf, size_t len, int delim, struct timespec *times, size_t count, size_t *used, bk_flags flags);
 extern time_t bk_timegm(bk_s B, struct tm *timeptr, bk_flags flags);
 #define BK_TIMEGM_FLAG_NORMALIZE	0x1	///< Normalize struct tm fields
 extern int bk_time_duration_parse(bk_s B, const char *string, time_t *duration, bk_flags flags);
@@ -2315,7 +2516,10 @@ extern char *bk_url_unescape_len(bk_s B, const char *component, size_t len);
 extern int bk_url_getparam(bk_s B, char **pathp, char * const *tokens, char **valuep);
 extern struct bk_url_authority *bk_url_parse_authority(bk_s B, const char *auth_str, bk_flags flags);
 extern void bk_url_authority_destroy(bk_s B, struct bk_url_authority *auth);
+extern int bk_url_parse_spans(bk_s B, const char *url, size_t len, struct bk_url_spans *bus, bk_flags flags);
+extern size_t bk_url_unescape_inplace(bk_s B, char *component, size_t len);
 extern char *bk_url_reconstruct(bk_s B, struct bk_url *bu, bk_flags sections, bk_flags flags);
+extern char *bk_url_reconstruct_spans(bk_s B, const char *url, const struct bk_url_spans *bus, bk_flags sections, bk_flags flags);
 
 
 /* b_nvmap.c */
@@ -2385,6 +2589,21 @@ extern void bk_MD5Update (bk_s B, bk_MD5_CTX *mdContext, const unsigned char *in
 extern void bk_MD5Final (bk_s B, bk_MD5_CTX *mdContext);
 extern int bk_MD5_extract_printable(bk_s B, char *str, bk_MD5_CTX *ctx, bk_flags flags);
 
+/* b_digest.c */
+extern struct bk_digest *bk_digest_create(bk_s B, int alg, bk_flags flags);
+#define BK_DIGEST_MD5		1		///< MD5 (RFC 1321), 16 bytes
+#define BK_DIGEST_SHA256	2		///< SHA-256 (FIPS 180-4), 32 bytes
+#define BK_DIGEST_BLAKE3	3		///< BLAKE3 tree hash, 32 bytes
+#define BK_DIGEST_MAXLEN	32		///< Longest digest of any algorithm
+#define BK_DIGEST_PORTABLE	0x1		///< Use only portable C code (no vector lanes or special instructions)
+extern void bk_digest_destroy(bk_s B, struct bk_digest *bd);
+extern int bk_digest_length(bk_s B, int alg);
+extern int bk_digest_update(bk_s B, struct bk_digest *bd, const void *data, size_t len);
+extern int bk_digest_final(bk_s B, struct bk_digest *bd, u_char *digest);
+extern int bk_digest_buffer(bk_s B, int alg, const void *data, size_t len, u_char *digest, bk_flags flags);
+extern int bk_digest_multi(bk_s B, int alg, const bk_vptr *bufs, u_int count, u_char *digests, bk_flags flags);
+extern int bk_digest_ioh_filter(bk_s B, struct bk_ioh *ioh, struct bk_digest *readdigest, struct bk_digest *writedigest, bk_flags flags);
+
 /* b_stdsock.c */
 extern int bk_stdsock_multicast(bk_s B, int fd, u_char ttl, struct bk_netaddr *maddrgroup, bk_flags flags);
 #define BK_MULTICAST_WANTLOOP		0x01	///< Want multicasts to loop to local machine
@@ -2479,6 +2698,26 @@ extern int bk_dllvault_destroyhelp(bk_vault_t V);
 #define bk_dllvault_nextobj(h,i)	dll_nextobj((h),(i))
 #define bk_dllvault_iterate_done(h,i)	dll_iterate_done((h),(i))
 #define bk_dllvault_error_reason(h,i)	dll_error_reason((h),(i))
+extern bk_flatvault_t bk_flatvault_create(bk_s B, int table_entries, bk_flags flags);
+extern void bk_flatvault_destroy(bk_flatvault_t V);
+extern int bk_flatvault_insert(bk_flatvault_t V, dict_obj obj);
+extern int bk_flatvault_insert_uniq(bk_flatvault_t V, dict_obj obj, dict_obj *oldobj);
+extern dict_obj bk_flatvault_search(bk_flatvault_t V, dict_key key);
+extern int bk_flatvault_delete(bk_flatvault_t V, dict_obj obj);
+extern dict_obj bk_flatvault_minimum(bk_flatvault_t V);
+extern dict_obj bk_flatvault_maximum(bk_flatvault_t V);
+extern dict_obj bk_flatvault_successor(bk_flatvault_t V, dict_obj obj);
+extern dict_obj bk_flatvault_predecessor(bk_flatvault_t V, dict_obj obj);
+extern dict_iter bk_flatvault_iterate(bk_flatvault_t V, enum dict_direction dir);
+extern dict_obj bk_flatvault_nextobj(bk_flatvault_t V, dict_iter it);
+extern void bk_flatvault_iterate_done(bk_flatvault_t V, dict_iter it);
+extern char *bk_flatvault_error_reason(bk_flatvault_t V, int *errnop);
+extern int bk_flatvault_inserthelp(bk_flatvault_t V, const char *string, void *ptr);
+extern void *bk_flatvault_searchhelp(bk_flatvault_t V, const char *string);
+extern int bk_flatvault_deletehelp(bk_flatvault_t V, const char *string);
+extern int bk_flatvault_destroyhelp(bk_flatvault_t V);
+#define bk_flatvault_append(h,o)	bk_flatvault_insert((h),(o))
+#define bk_flatvault_append_uniq(h,n,o)	bk_flatvault_insert_uniq((h),(n),(o))
 
 
 /* b_stats.c */
@@ -2505,6 +2744,13 @@ extern void bk_stat_add(bk_s B, struct bk_stat_list *blist, const char *name1, c
 //#define BK_STATS_NO_LOCKS_NEEDED		0x100
 extern void bk_stat_node_add(bk_s B, struct bk_stat_node *bnode, u_quad_t usec, bk_flags flags);
 //#define BK_STATS_NO_LOCKS_NEEDED		0x100
+/**
+ * OpenMetrics exposition sink: receives @a len bytes of exposition text.
+ * Return 0 to continue, 1 to stop generation (e.g. size budget reached), -1 on error.
+ */
+typedef int (*bk_metrics_output_f)(bk_s B, void *opaque, const char *buf, size_t len, bk_flags flags);
+extern int bk_stat_openmetrics(bk_s B, struct bk_stat_list *blist, const char *prefix, bk_metrics_output_f output, void *opaque, bk_flags flags);
+//#define BK_STATS_NO_LOCKS_NEEDED		0x100
 
 /* b_thread.c */
 extern struct bk_threadlist *bk_threadlist_create(bk_s B, bk_flags flags);
@@ -3137,9 +3383,12 @@ extern int bk_dynamic_stat_attr_update(bk_s B, bk_dynamic_stats_h stats_list, co
 #define BK_DYNAMIC_STAT_UPDATE_FLAG_DESTROY_CALLBACK	0x11
 #define BK_DYNAMIC_STAT_UPDATE_FLAG_DESTROY_OPAQUE	0x12
 extern int bk_dynamic_stat_increment(bk_s B, bk_dynamic_stats_h *stats_list, const char *name, long discriminator, bk_flags flags, ...);
+extern int bk_dynamic_stat_handle_increment(bk_s B, bk_dynamic_stat_h dyn_stat, bk_flags flags, ...);
+extern int bk_dynamic_stat_handle_set(bk_s B, bk_dynamic_stat_h dyn_stat, bk_flags flags, ...);
 extern int bk_dynamic_stats_getnext(bk_s B, bk_dynamic_stats_h stats_list, bk_dynamic_stat_h *statp, u_int priority, bk_dynamic_stats_value_type_e *typep, bk_dynamic_stat_value_u *valuep, bk_flags flags);
 extern char *bk_dynamic_stats_XML_create(bk_s B, bk_dynamic_stats_h stats_list, u_int priority, const char *prefix, bk_flags flags);
 extern void bk_dynamic_stats_XML_destroy(bk_s B, const char *xml_str, bk_flags flags);
+extern int bk_dynamic_stats_openmetrics(bk_s B, bk_dynamic_stats_h stats_list, u_int priority, const char *prefix, bk_metrics_output_f output, void *opaque, bk_flags flags);
 extern int bk_dynamic_stat_convert(bk_s B, bk_dynamic_stats_h stats_list, const char *name, long discriminator, bk_flags flags);
 extern int bk_global_dynamic_stats_register(bk_s B, bk_dynamic_stats_h stats_list, bk_flags flags);
 extern int bk_dynamic_stats_demand_update(bk_s B, bk_dynamic_stats_h stats_list, bk_flags flags);
@@ -3157,8 +3406,18 @@ extern int bk_dynamic_stat_set_threadid(bk_s B, bk_dynamic_stat_h dstat, u_long
 #endif /* BK_USING_PTHREADS */
 
 
+// b_metrics.c
+extern int bk_metrics_name(bk_s B, char *buf, size_t len, const char *prefix, const char *name, const char *suffix);
+extern char *bk_metrics_label_escape(bk_s B, const char *value, bk_flags flags);
+extern const char *bk_metrics_double(bk_s B, char *buf, size_t len, double value);
+extern int bk_metrics_emit(bk_s B, bk_metrics_output_f output, void *opaque, const char *fmt, ...) __attribute__ ((format (printf, 4, 5)));
+extern struct bk_metrics_server *bk_metrics_server_create(bk_s B, struct bk_run *run, const char *url, const char *defurl, bk_dynamic_stats_h stats_list, u_int priority, struct bk_stat_list *blist, const char *prefix, u_int32_t maxbytes, bk_flags flags);
+extern void bk_metrics_server_destroy(bk_s B, struct bk_metrics_server *bms);
+
+
 // b_patricia/radix (triesh) which handles bit patters, strings, and ipv4/v6 addresses
 extern struct bk_pnode *bk_patricia_create(bk_s B);
+extern struct bk_pnode *bk_patricia_create_arena(bk_s B, size_t chunksize, bk_flags flags);
 extern int bk_patricia_insert(bk_s B, struct bk_pnode *tree, u_char *key, u_short keyblen, void *data, void **olddata);
 extern void *bk_patricia_search(bk_s B, struct bk_pnode *tree, u_char *key, u_short keyblen, bk_flags flags);
 #define BK_PATRICIA_REVERSE	0x1		///< Pretend (u_char multiple length) key is in reverse order
@@ -3169,6 +3428,21 @@ extern void bk_patricia_delete(bk_s B, struct bk_pnode *tree, u_char *key, u_sho
 extern void bk_patricia_vdelete(bk_s B, struct bk_pnode *tree, void *value);
 extern void bk_patricia_print(bk_s B, struct bk_pnode *tree, FILE *F, int level);
 extern void bk_patricia_destroy(struct bk_pnode *tree, void (*freefun)(void *));
+extern void *bk_patricia_serialize(bk_s B, struct bk_pnode *tree, u_int64_t (*encode)(void *data, void *opaque), void *opaque, size_t *lenp, bk_flags flags);
+extern struct bk_pnode *bk_patricia_deserialize(bk_s B, const void *buf, size_t len, void *(*decode)(u_int64_t value, void *opaque), void *opaque, bk_flags flags);
+extern struct bk_pcompiled *bk_patricia_compile(bk_s B, struct bk_pnode *tree, u_short keyblen, bk_flags flags);
+extern void *bk_patricia_compiled_search(bk_s B, struct bk_pcompiled *bpc, const u_char *key);
+extern int bk_patricia_compiled_search_batch(bk_s B, struct bk_pcompiled *bpc, const u_char * const *keys, int n, void **results);
+extern void bk_patricia_compiled_destroy(bk_s B, struct bk_pcompiled *bpc);
+extern struct bk_prcu *bk_patricia_rcu_create(bk_s B, bk_flags flags);
+extern void bk_patricia_rcu_destroy(bk_s B, struct bk_prcu *bpr, void (*freefun)(void *));
+extern struct bk_prcu_reader *bk_patricia_rcu_reader_register(bk_s B, struct bk_prcu *bpr);
+extern void bk_patricia_rcu_reader_unregister(bk_s B, struct bk_prcu *bpr, struct bk_prcu_reader *bprr);
+extern struct bk_pnode *bk_patricia_rcu_read_enter(struct bk_prcu *bpr, struct bk_prcu_reader *bprr);
+extern void bk_patricia_rcu_read_exit(struct bk_prcu *bpr, struct bk_prcu_reader *bprr);
+extern void *bk_patricia_rcu_search(bk_s B, struct bk_prcu *bpr, struct bk_prcu_reader *bprr, u_char *key, u_short keyblen, bk_flags flags);
+extern int bk_patricia_rcu_insert(bk_s B, struct bk_prcu *bpr, u_char *key, u_short keyblen, void *data, void **olddata);
+extern void bk_patricia_rcu_delete(bk_s B, struct bk_prcu *bpr, u_char *key, u_short keyblen);
 
 
 
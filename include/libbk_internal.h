@@ -104,6 +104,32 @@ struct bk_ioh
 
 
 
+
+
+#define BK_PROFILE_MAXDEPTH	64		///< Deepest stack the sampling profiler records
+/**
+ * Per-thread sampling profiler state.  The shadow stack is maintained by
+ * b_fun.c (BK_ENTRY/BK_RETURN) using only plain stores, so the SIGPROF
+ * handler in b_profile.c, which runs on the same thread, can copy it at
+ * any instant.
+ */
+struct bk_profile_thread
+{
+  volatile u_int	bpt_depth;		///< Current depth (may exceed BK_PROFILE_MAXDEPTH)
+  const char * volatile	bpt_stack[BK_PROFILE_MAXDEPTH]; ///< Function names, outermost first
+  struct bk_profile    *bpt_profile;		///< Profile we belong to (NULL if orphaned)
+  char		       *bpt_threadname;		///< Copy of the thread name
+  int			bpt_id;			///< Slot identifier carried by our signals
+  timer_t		bpt_timer;		///< Per-thread sampling timer
+  u_int			bpt_nsamples;		///< Sample ring size (power of two)
+  volatile u_int	bpt_head;		///< Next slot the signal handler fills
+  volatile u_int	bpt_tail;		///< Next slot the collector drains
+  volatile u_int	bpt_dropped;		///< Samples dropped because the ring was full
+  struct bk_profile_sample *bpt_samples;	///< Sample ring
+};
+
+
+
 #ifdef BK_USING_PTHREADS
 extern pthread_mutex_t BkGlobalSignalLock;
 #endif /* BK_USING_PTHREADS */
@@ -471,4 +471,40 @@ static inline size_t strnlen(const char *s, size_t maxlen)
 #define POPT_TABLEEND { NULL, '\0', 0, 0, 0, NULL, NULL }
 #endif /* POPT_TABLEEND */
 
+/*
+ * Lock-free operations on naturally aligned integers and pointers.  Prefer
+ * the gcc 4.7+ __atomic builtins (which let counters use relaxed ordering);
+ * fall back to the older __sync builtins, which are always full barriers.
+ * Loads are acquire and stores are release so these may also be used to
+ * publish pointers to initialized structures.
+ */
+#if defined(__GNUC__) && !defined(__INSURE__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 7)))
+#define BK_ATOMIC_ADD(p,v)	(__atomic_add_fetch((p),(v),__ATOMIC_RELAXED))	///< Add and return new value
+#define BK_ATOMIC_OR(p,v)	(__atomic_or_fetch((p),(v),__ATOMIC_RELAXED))	///< Or and return new value
+#define BK_ATOMIC_LOAD(p)	(__atomic_load_n((p),__ATOMIC_ACQUIRE))		///< Load
+#define BK_ATOMIC_STORE(p,v)	(__atomic_store_n((p),(v),__ATOMIC_RELEASE))	///< Store
+#define BK_ATOMIC_XCHG(p,v)	(__atomic_exchange_n((p),(v),__ATOMIC_ACQ_REL))	///< Store and return old value
+#define BK_ATOMIC_CAS(p,o,n)	(__sync_bool_compare_and_swap((p),(o),(n)))	///< Swap if still old value, return true on success
+#define BK_ATOMIC_FENCE()	(__atomic_thread_fence(__ATOMIC_SEQ_CST))	///< Full memory barrier
+#else
+#define BK_ATOMIC_ADD(p,v)	(__sync_add_and_fetch((p),(v)))
+#define BK_ATOMIC_OR(p,v)	(__sync_or_and_fetch((p),(v)))
+#define BK_ATOMIC_LOAD(p)	(__sync_fetch_and_add((p),0))
+#define BK_ATOMIC_STORE(p,v)	do { __sync_synchronize(); *(volatile typeof(*(p)) *)(p) = (v); __sync_synchronize(); } while (0)
+#define BK_ATOMIC_XCHG(p,v)	({ typeof(*(p)) __bk_old; do { __bk_old = *(volatile typeof(*(p)) *)(p); } while (!__sync_bool_compare_and_swap((p),__bk_old,(v))); __bk_old; })
+#define BK_ATOMIC_CAS(p,o,n)	(__sync_bool_compare_and_swap((p),(o),(n)))
+#define BK_ATOMIC_FENCE()	(__sync_synchronize())
+#endif /* __atomic builtins */
+
+/*
+ * Hint that memory will be read (w=0) or written (w=1) soon.  Batch
+ * lookups issue these for every element before touching any of them, so
+ * the cache misses overlap instead of being taken one at a time.
+ */
+#if defined(__GNUC__) && !defined(__INSURE__)
+#define BK_PREFETCH(p,w)	(__builtin_prefetch((p),(w),3))	///< Prefetch into all cache levels
+#else
+#define BK_PREFETCH(p,w)	((void)(p))
+#endif /* __GNUC__ && !__INSURE__ */
+
 #endif /* _libbk_oscompat_h_ */
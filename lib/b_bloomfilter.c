@@ -23,9 +23,21 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
  * @file
  * Bloom Filter implementation, intended to be compatible with the java
  * implementation in Apache Cassandra.
+ *
+ * A second, cache-blocked layout (BK_BLOOMFILTER_BLOCKED) is also
+ * available.  It is not Cassandra compatible: every bit for a key falls
+ * within a single 64-byte block, so a lookup costs one cache miss (and at
+ * most one TLB miss) no matter how many hash functions are used, at the
+ * price of a slightly higher false positive rate for the same size.  The
+ * block is chosen from the high half of the murmur hash with a
+ * multiply-shift reduction instead of a modulo, and the bit positions
+ * within the block come from the two 32-bit halves of the low half.
  */
 
 #include <libbk.h>
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif /* __AVX2__ || __SSE4_1__ */
 
 
 /**
@@ -36,18 +48,141 @@ struct bk_bloomfilter
   int32_t	bf_hash_count;			///< Number of hash functions used.
   int64_t	bf_words;			///< Number of 64-bit words in bloom filter.
   int64_t	bf_bits;			///< Number of bits in bloom filter.
+  int64_t	bf_blocks;			///< Number of 64-byte blocks (blocked layout only)
   uint64_t     *bf_bitset;			///< The bitfield containing the data.
   int	        bf_fd;				///< fd of mmapped file
   bk_flags	bf_flags;			///< Flags
 #define BF_FLAG_ALLOCATED	0x01		///< bitset was allocated (as opposed to mmap'd)
 #define BF_FLAG_MMAPPED		0x02		///< bitset was mmaped
 #define BF_FLAG_WRITABLE	0x04		///< bitset can be written to
+#define BF_FLAG_BLOCKED		0x08		///< cache-blocked layout
+};
+
+
+
+/**
+ * Counting bloom filter structure: packed 4-bit counters
+ */
+struct bk_countingbloom
+{
+  int32_t	cb_hash_count;			///< Number of hash functions used.
+  int64_t	cb_counters;			///< Number of counters.
+  int64_t	cb_words;			///< Number of 64-bit words of counters.
+  uint64_t     *cb_counts;			///< The counters
+  int		cb_fd;				///< fd of mmapped file
+  bk_flags	cb_flags;			///< BF_FLAG_* flags
+};
+#define CB_PER_WORD		16		///< Counters in a 64-bit word
+#define CB_MAX			15		///< Saturated counter value
+#define CB_SHIFT(idx)		(((idx) % CB_PER_WORD) * 4) ///< Shift of counter within its word
+#define CB_ONE(idx)		(1ULL << CB_SHIFT(idx))	///< One in a counter's position
+#define CB_GET(cb,idx)		((u_int)(((cb)->cb_counts[(idx) / CB_PER_WORD] >> CB_SHIFT(idx)) & 0xf)) ///< Counter value
+
+
+
+#define SB_MAGIC		"bksb"		///< Scalable bloom filter file magic
+#define SB_VERSION		1		///< Scalable bloom filter file version
+#define SB_MAXSTAGES		32		///< Size of sh_stage
+#define SB_ALIGN		65536		///< Stage alignment in file (multiple of any page size)
+#define SB_GROWTH_SHIFT		1		///< Each stage holds twice the keys of the last
+#define SB_TIGHTEN		0.85		///< Each stage has this times the false positive rate of the last
+
+
+
+/**
+ * Scalable bloom filter stage description, as stored in the file header
+ */
+struct sbloom_stage
+{
+  u_int64_t	ss_offset;			///< Offset of bitset in file
+  u_int64_t	ss_bits;			///< Bits in the stage
+  u_int64_t	ss_capacity;			///< Keys the stage should hold
+  u_int64_t	ss_count;			///< Keys the stage does hold
+  u_int32_t	ss_hashes;			///< Hash functions used
+  u_int32_t	ss_pad;				///< Explicit padding
+};
+
+
+
+/**
+ * Scalable bloom filter header (first SB_ALIGN bytes of the file, host
+ * byte order)
+ */
+struct sbloom_header
+{
+  char		sh_magic[4];			///< SB_MAGIC
+  u_int32_t	sh_version;			///< SB_VERSION
+  u_int32_t	sh_nstages;			///< Stages in use
+  u_int32_t	sh_blocked;			///< Stages use the cache-blocked layout
+  u_int64_t	sh_capacity;			///< Capacity of first stage
+  double	sh_fprate;			///< Target false positive rate
+  struct sbloom_stage sh_stage[SB_MAXSTAGES];		///< Stages
+};
+
+
+
+/**
+ * Scalable bloom filter structure: a chain of ordinary filters
+ */
+struct bk_scalablebloom
+{
+  struct sbloom_header	*sb_header;		///< Header (mapped from file, or allocated)
+  struct bk_bloomfilter	*sb_stage[SB_MAXSTAGES]; ///< The stages
+  int			sb_fd;			///< fd of file holding everything
+  bk_flags		sb_flags;		///< BF_FLAG_* flags
 };
 
 
 
+#define BF_BLOCK_WORDS		8		///< 64-bit words in a cache block
+#define BF_BLOCK_BITS		512		///< Bits in a cache block
+#define BF_BLOCK_ALIGN		64		///< Byte alignment of the bitset
+#define BF_BATCH		16		///< Keys hashed and prefetched ahead in batch operations
+
+
+
 inline static void set_bit(uint64_t *bits, int64_t length, int64_t idx);
 inline static uint8_t get_bit(uint64_t *bits, int64_t length, int64_t idx);
+inline static uint64_t *block_locate(struct bk_bloomfilter *bf, const int64_t *hash, uint64_t *mask);
+inline static int block_test(const uint64_t *blk, const uint64_t *mask);
+inline static void block_set(uint64_t *blk, const uint64_t *mask);
+inline static void bloom_set_hashed(struct bk_bloomfilter *bf, const int64_t *hash);
+inline static int bloom_test_hashed(struct bk_bloomfilter *bf, const int64_t *hash);
+static void bloom_geometry(struct bk_bloomfilter *bf, int32_t hashes, int64_t bits, bk_flags flags);
+static void *bloom_file_map(bk_s B, const char *filename, size_t len, bk_flags flags, int *fdp);
+static int sbloom_stage_add(bk_s B, struct bk_scalablebloom *sb);
+static int sbloom_stage_open(bk_s B, struct bk_scalablebloom *sb, u_int s);
+static void bloom_add_range(struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int64_t start, int64_t end, int atomic);
+static int bloom_compatible(bk_s B, struct bk_bloomfilter *a, struct bk_bloomfilter *b);
+#ifdef BK_USING_PTHREADS
+struct bloom_bulk_job;
+static void bloom_bulk_worker(struct bloom_bulk_job *bbj);
+static void *bloom_bulk_thread(bk_s B, void *opaque);
+#endif /* BK_USING_PTHREADS */
+
+
+
+#ifdef BK_USING_PTHREADS
+/**
+ * Work shared between the threads of a bulk load.  Each thread claims
+ * slices of the keys and adds them with atomic OR into the shared bitset.
+ * Threads are detached; the caller waits for bbj_running to drop to zero
+ * rather than joining, since libbk reclaims thread nodes as soon as the
+ * thread exits.
+ */
+struct bloom_bulk_job
+{
+  struct bk_bloomfilter	*bbj_bf;		///< Filter being loaded
+  const void * const	*bbj_keys;		///< All keys
+  const int		*bbj_lens;		///< All key lengths
+  int64_t		bbj_n;			///< Number of keys
+  int			bbj_nslices;		///< Number of slices (threads including caller)
+  int			bbj_next;		///< Next slice to hand out
+  int			bbj_running;		///< Helper threads not yet finished
+  pthread_mutex_t	bbj_lock;		///< Protects bbj_next and bbj_running
+  pthread_cond_t	bbj_cond;		///< Signalled when bbj_running reaches zero
+};
+#endif /* BK_USING_PTHREADS */
 
 
 
@@ -60,6 +195,8 @@ inline static uint8_t get_bit(uint64_t *bits, int64_t length, int64_t idx);
  * @param filename If non-null, contains a filename of a file containing the bitset, which will be mmapped
  * @param flags BK_BLOOMFILTER_WRITABLE Allow writability
  * @param flags BK_BLOOMFILTER_CREATABLE Allow bloom filter creation (implies writable)
+ * @param flags BK_BLOOMFILTER_BLOCKED Use the cache-blocked layout (bits rounded up to a multiple of 512).
+ * The layout is not recorded in the file, so a blocked filter must always be reopened with this flag.
  * @return <i>new bloomfilter</i> on success
  * @return <i>NULL</i> on failure
  */
@@ -79,79 +216,33 @@ struct bk_bloomfilter *bk_bloomfilter_create(bk_s B, int32_t hashes, int64_t bit
     bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for bloom filter metadata.\n");
     goto error;
   }
-  bf->bf_fd = -1;
-
-  bf->bf_hash_count = hashes;
-  bf->bf_bits = bits;
-  bf->bf_words = ((bits - 1) >> 6) + 1;
-
-  if (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_WRITABLE) ||
-      BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
-    BK_FLAG_SET(bf->bf_flags, BF_FLAG_WRITABLE);
+  bloom_geometry(bf, hashes, bits, flags);
 
-  if (!filename)
+  if (!filename && BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_BLOCKED))
   {
-    if (!BK_CALLOC_LEN(bf->bf_bitset, bf->bf_words * sizeof(uint64_t)))
+    // Blocks must not straddle cache lines (mmap is already page aligned)
+    if ((errno = posix_memalign((void **)&bf->bf_bitset, BF_BLOCK_ALIGN, bf->bf_words * sizeof(uint64_t))))
     {
-      bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for bloom filter.\n");
+      bf->bf_bitset = NULL;
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for bloom filter: %s\n", strerror(errno));
       goto error;
     }
+    memset(bf->bf_bitset, 0, bf->bf_words * sizeof(uint64_t));
     BK_FLAG_SET(bf->bf_flags, BF_FLAG_ALLOCATED);
   }
-  else
+  else if (!filename)
   {
-    int fdflags = O_RDONLY;
-    struct stat buf;
-
-    if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_WRITABLE))
-    {
-      fdflags = O_RDWR;
-      if (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
-      {
-	fdflags |= O_CREAT;
-      }
-    }
-
-    if ((bf->bf_fd = open(filename, fdflags, 0666)) < 0)
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Error opening bloom filter file: %s\n", strerror(errno));
-      goto error;
-    }
-
-    if (fstat(bf->bf_fd, &buf) < 0)
+    if (!BK_CALLOC_LEN(bf->bf_bitset, bf->bf_words * sizeof(uint64_t)))
     {
-      bk_error_printf(B, BK_ERR_ERR, "Could not stat bloom filter we just opened: %s\n", strerror(errno));
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for bloom filter.\n");
       goto error;
     }
-
-    if (buf.st_size != bf->bf_words*8)
-    {
-      if (buf.st_size == 0 && BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
-      {
-	lseek(bf->bf_fd, bf->bf_words*8-1, SEEK_SET);
-	if (write(bf->bf_fd, "", 1) != 1)
-	{
-	  bk_error_printf(B, BK_ERR_ERR, "Could not fill out bloomfilter: %s\n", strerror(errno));
-	  goto error;
-	}
-      }
-      else
-      {
-	bk_error_printf(B, BK_ERR_ERR, "Bloom filter size difference (%lld expected, %lld actual)\n", (long long)bf->bf_words*8, (long long)buf.st_size);
-	goto error;
-      }
-    }
-
-
-    fdflags = PROT_READ;
-    if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_WRITABLE))
-      fdflags |= PROT_WRITE;
-
-    if ((bf->bf_bitset = mmap(0, bf->bf_words * sizeof(uint64_t), fdflags, MAP_SHARED, bf->bf_fd, 0)) == MAP_FAILED)
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Error mapping bloom filter file: %s\n", strerror(errno));
+    BK_FLAG_SET(bf->bf_flags, BF_FLAG_ALLOCATED);
+  }
+  else
+  {
+    if (!(bf->bf_bitset = bloom_file_map(B, filename, bf->bf_words * sizeof(uint64_t), flags, &bf->bf_fd)))
       goto error;
-    }
     BK_FLAG_SET(bf->bf_flags, BF_FLAG_MMAPPED);
   }
 
@@ -201,6 +292,113 @@ void bk_bloomfilter_destroy(bk_s B, struct bk_bloomfilter *bf)
 
 
 
+/**
+ * Fill in the size, hash count and layout of a new filter.
+ *
+ * @param bf the bloom filter
+ * @param hashes number of hash functions to use
+ * @param bits length of the filter in bits (may be rounded up)
+ * @param flags BK_BLOOMFILTER_* flags as for bk_bloomfilter_create
+ */
+static void bloom_geometry(struct bk_bloomfilter *bf, int32_t hashes, int64_t bits, bk_flags flags)
+{
+  bf->bf_fd = -1;
+
+  bf->bf_hash_count = hashes;
+
+  if (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_BLOCKED))
+  {
+    BK_FLAG_SET(bf->bf_flags, BF_FLAG_BLOCKED);
+    bf->bf_blocks = ((bits - 1) / BF_BLOCK_BITS) + 1;
+    bits = bf->bf_blocks * BF_BLOCK_BITS;
+  }
+
+  bf->bf_bits = bits;
+  bf->bf_words = ((bits - 1) >> 6) + 1;
+
+  if (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_WRITABLE) ||
+      BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
+    BK_FLAG_SET(bf->bf_flags, BF_FLAG_WRITABLE);
+}
+
+
+
+/**
+ * Open (possibly creating) and map a headerless filter file of a fixed
+ * size, as used by both the classic and counting filters.
+ *
+ * @param B BAKA Thread/global state
+ * @param filename The file
+ * @param len Expected size of the file in bytes
+ * @param flags BK_BLOOMFILTER_WRITABLE and BK_BLOOMFILTER_CREATABLE as for bk_bloomfilter_create
+ * @param fdp Copy-out file descriptor (which caller must close; -1 on failure)
+ * @return <i>mapping</i> on success
+ * @return <i>NULL</i> on failure
+ */
+static void *bloom_file_map(bk_s B, const char *filename, size_t len, bk_flags flags, int *fdp)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int writable = BK_FLAG_ISSET(flags, BK_BLOOMFILTER_WRITABLE) || BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE);
+  int fdflags = O_RDONLY;
+  struct stat buf;
+  void *map;
+
+  if (writable)
+  {
+    fdflags = O_RDWR;
+    if (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
+    {
+      fdflags |= O_CREAT;
+    }
+  }
+
+  if ((*fdp = open(filename, fdflags, 0666)) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Error opening bloom filter file: %s\n", strerror(errno));
+    goto error;
+  }
+
+  if (fstat(*fdp, &buf) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not stat bloom filter we just opened: %s\n", strerror(errno));
+    goto error;
+  }
+
+  if (buf.st_size != (off_t)len)
+  {
+    if (buf.st_size == 0 && BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
+    {
+      lseek(*fdp, len-1, SEEK_SET);
+      if (write(*fdp, "", 1) != 1)
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not fill out bloomfilter: %s\n", strerror(errno));
+	goto error;
+      }
+    }
+    else
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Bloom filter size difference (%lld expected, %lld actual)\n", (long long)len, (long long)buf.st_size);
+      goto error;
+    }
+  }
+
+  if ((map = mmap(0, len, PROT_READ|(writable?PROT_WRITE:0), MAP_SHARED, *fdp, 0)) == MAP_FAILED)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Error mapping bloom filter file: %s\n", strerror(errno));
+    goto error;
+  }
+
+  BK_RETURN(B, map);
+
+ error:
+  if (*fdp > -1)
+    close(*fdp);
+  *fdp = -1;
+  BK_RETURN(B, NULL);
+}
+
+
+
 /**
  * Set a bit in a bitset.
  *
@@ -252,6 +450,174 @@ inline static uint8_t get_bit(uint64_t *bits, int64_t length, int64_t idx)
 
 
 
+/**
+ * High 64 bits of a 64x64-bit product.  Must give identical answers with
+ * and without compiler 128-bit support, since it decides where keys live
+ * in filters which may be shared between programs through a file.
+ *
+ * @param a multiplicand
+ * @param b multiplier
+ * @return <i>(a*b)>>64</i>
+ */
+inline static uint64_t mulhi64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  return((uint64_t)(((unsigned __int128)a * b) >> 64));
+#else
+  uint64_t alo = a & 0xffffffffULL, ahi = a >> 32;
+  uint64_t blo = b & 0xffffffffULL, bhi = b >> 32;
+  uint64_t lolo = alo * blo;
+  uint64_t hilo = ahi * blo;
+  uint64_t lohi = alo * bhi;
+  uint64_t cross = (lolo >> 32) + (hilo & 0xffffffffULL) + lohi;
+
+  return((ahi * bhi) + (hilo >> 32) + (cross >> 32));
+#endif /* __SIZEOF_INT128__ */
+}
+
+
+
+/**
+ * Find the cache block for a key in a blocked filter and build the mask of
+ * bits the key sets within it.  The block is a multiply-shift reduction of
+ * hash[0]; bit i is the top nine bits of lo+i*hi, where lo and hi are the
+ * 32-bit halves of hash[1].
+ *
+ * @param bf the (blocked) bloom filter
+ * @param hash murmurhash3_x64_128 of the key
+ * @param mask copy-out BF_BLOCK_WORDS word bitmask
+ * @return <i>first word of the block</i>
+ */
+inline static uint64_t *block_locate(struct bk_bloomfilter *bf, const int64_t *hash, uint64_t *mask)
+{
+  uint32_t lo = (uint32_t)hash[1];
+  uint32_t hi = (uint32_t)((uint64_t)hash[1] >> 32);
+  int32_t i;
+  int w;
+
+  for (w = 0; w < BF_BLOCK_WORDS; w++)
+    mask[w] = 0;
+
+  for (i = 0; i < bf->bf_hash_count; i++)
+  {
+    uint32_t bit = (lo + (uint32_t)i * hi) >> 23;
+    mask[bit >> 6] |= 1ULL << (bit & 0x3f);
+  }
+
+  return(bf->bf_bitset + mulhi64((uint64_t)hash[0], (uint64_t)bf->bf_blocks) * BF_BLOCK_WORDS);
+}
+
+
+
+/**
+ * Test whether every bit of mask is set in a block.
+ *
+ * @param blk the 64-byte aligned block
+ * @param mask BF_BLOCK_WORDS word bitmask
+ * @return <i>1</i> if all bits are set
+ * @return <i>0</i> otherwise
+ */
+inline static int block_test(const uint64_t *blk, const uint64_t *mask)
+{
+#if defined(__AVX2__)
+  __m256i b0 = _mm256_load_si256((const __m256i *)blk);
+  __m256i b1 = _mm256_load_si256((const __m256i *)(blk + 4));
+  __m256i m0 = _mm256_loadu_si256((const __m256i *)mask);
+  __m256i m1 = _mm256_loadu_si256((const __m256i *)(mask + 4));
+
+  return(_mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1));
+#elif defined(__SSE4_1__)
+  int w, ret = 1;
+
+  for (w = 0; w < BF_BLOCK_WORDS; w += 2)
+    ret &= _mm_testc_si128(_mm_load_si128((const __m128i *)(blk + w)), _mm_loadu_si128((const __m128i *)(mask + w)));
+  return(ret);
+#else
+  uint64_t missing = 0;
+  int w;
+
+  // Branch free so the compiler can vectorize it
+  for (w = 0; w < BF_BLOCK_WORDS; w++)
+    missing |= mask[w] & ~blk[w];
+  return(missing == 0);
+#endif /* __AVX2__ */
+}
+
+
+
+/**
+ * Set every bit of mask in a block.
+ *
+ * @param blk the 64-byte aligned block
+ * @param mask BF_BLOCK_WORDS word bitmask
+ */
+inline static void block_set(uint64_t *blk, const uint64_t *mask)
+{
+  int w;
+
+  for (w = 0; w < BF_BLOCK_WORDS; w++)
+    blk[w] |= mask[w];
+}
+
+
+
+/**
+ * Set the bits for an already hashed key.
+ *
+ * @param bf the (writable) bloom filter
+ * @param hash murmurhash3_x64_128 of the key
+ */
+inline static void bloom_set_hashed(struct bk_bloomfilter *bf, const int64_t *hash)
+{
+  int32_t i;
+
+  if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_BLOCKED))
+  {
+    uint64_t mask[BF_BLOCK_WORDS];
+
+    block_set(block_locate(bf, hash, mask), mask);
+    return;
+  }
+
+  for (i=0; i<bf->bf_hash_count; i++)
+  {
+    set_bit(bf->bf_bitset, bf->bf_words, llabs((hash[0] + ((int64_t)i) * hash[1]) % bf->bf_bits));
+  }
+}
+
+
+
+/**
+ * Test the bits for an already hashed key.
+ *
+ * @param bf the bloom filter
+ * @param hash murmurhash3_x64_128 of the key
+ * @return <i>1</i> if the key may be present
+ * @return <i>0</i> if the key is not present
+ */
+inline static int bloom_test_hashed(struct bk_bloomfilter *bf, const int64_t *hash)
+{
+  int32_t i;
+
+  if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_BLOCKED))
+  {
+    uint64_t mask[BF_BLOCK_WORDS];
+    uint64_t *blk = block_locate(bf, hash, mask);
+
+    return(block_test(blk, mask));
+  }
+
+  for (i=0; i<bf->bf_hash_count; i++)
+  {
+    if (!get_bit(bf->bf_bitset, bf->bf_words, llabs((hash[0] + ((int64_t)i) * hash[1]) % bf->bf_bits)))
+      return(0);
+  }
+
+  return(1);
+}
+
+
+
 /**
  * Add a key to a bloom filter.
  *
@@ -266,7 +632,6 @@ int bk_bloomfilter_add(bk_s B, struct bk_bloomfilter *bf, const void *key, const
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
   int64_t hash[2];
-  int32_t i;
 
   if (!bf || !bf->bf_bitset || !key || !len)
   {
@@ -282,10 +647,7 @@ int bk_bloomfilter_add(bk_s B, struct bk_bloomfilter *bf, const void *key, const
 
 
   murmurhash3_x64_128(key, len, 0L, &hash);
-  for (i=0; i<bf->bf_hash_count; i++)
-  {
-    set_bit(bf->bf_bitset, bf->bf_words, llabs((hash[0] + ((int64_t)i) * hash[1]) % bf->bf_bits));
-  }
+  bloom_set_hashed(bf, hash);
 
   BK_RETURN(B, 0);
 }
@@ -307,7 +669,6 @@ int bk_bloomfilter_is_present(bk_s B, struct bk_bloomfilter *bf, const void *key
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
   int64_t hash[2];
-  int32_t i;
 
   if (!bf || !bf->bf_bitset || !key || !len)
   {
@@ -316,13 +677,8 @@ int bk_bloomfilter_is_present(bk_s B, struct bk_bloomfilter *bf, const void *key
   }
 
   murmurhash3_x64_128(key, len, 0L, &hash);
-  for (i=0; i<bf->bf_hash_count; i++)
-  {
-    if (!get_bit(bf->bf_bitset, bf->bf_words, llabs((hash[0] + ((int64_t)i) * hash[1]) % bf->bf_bits)))
-      BK_RETURN(B, 0);
-  }
 
-  BK_RETURN(B, 1);
+  BK_RETURN(B, bloom_test_hashed(bf, hash));
 }
 
 
@@ -349,10 +705,1194 @@ void bk_bloomfilter_printkey(bk_s B, struct bk_bloomfilter *bf, const void *key,
   }
 
   murmurhash3_x64_128(key, len, 0L, &hash);
-  for (i=0; i<bf->bf_hash_count; i++)
+
+  if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_BLOCKED))
   {
-    fprintf(fh, "%lld%s", llabs((hash[0] + ((int64_t)i) * hash[1]) % bf->bf_bits), (i+1 >= bf->bf_hash_count)?".":", ");
-  }
+    uint64_t mask[BF_BLOCK_WORDS];
+    int64_t base = (block_locate(bf, hash, mask) - bf->bf_bitset) * 64;
+    int bit, first = 1;
 
-  BK_VRETURN(B);
+    // Bits are printed as absolute bit numbers, like the classic layout
+    for (bit = 0; bit < BF_BLOCK_BITS; bit++)
+    {
+      if (mask[bit >> 6] & (1ULL << (bit & 0x3f)))
+      {
+	fprintf(fh, "%s%lld", first?"":", ", (long long)(base + bit));
+	first = 0;
+      }
+    }
+    fprintf(fh, ".");
+    BK_VRETURN(B);
+  }
+
+  for (i=0; i<bf->bf_hash_count; i++)
+  {
+    fprintf(fh, "%lld%s", llabs((hash[0] + ((int64_t)i) * hash[1]) % bf->bf_bits), (i+1 >= bf->bf_hash_count)?".":", ");
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Add many keys to a bloom filter.  All keys in a batch are hashed and
+ * their cache lines prefetched before any bits are set, so the memory
+ * latency of the (usually random) probes overlaps.
+ *
+ * @param B BAKA Thread/global state
+ * @param bf the bloom filter
+ * @param keys array of keys to hash
+ * @param lens array of key lengths in bytes
+ * @param n number of keys
+ * @return <i>0</i> on success
+ * @return <i>-1</i> on failure
+ */
+int bk_bloomfilter_add_batch(bk_s B, struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int n)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int j;
+
+  if (!bf || !bf->bf_bitset || (n && (!keys || !lens)) || n < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(bf->bf_flags, BF_FLAG_WRITABLE))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filter not configurated for writability\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (j = 0; j < n; j++)
+  {
+    if (!keys[j] || !lens[j])
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid key %d in batch\n", j);
+      BK_RETURN(B, -1);
+    }
+  }
+
+  bloom_add_range(bf, keys, lens, 0, n, 0);
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Check for many keys in a bloom filter.  All keys in a batch are hashed
+ * and their cache lines prefetched before any are tested, so the memory
+ * latency of the (usually random) probes overlaps.
+ *
+ * @param B BAKA Thread/global state
+ * @param bf the bloom filter
+ * @param keys array of keys to hash
+ * @param lens array of key lengths in bytes
+ * @param n number of keys
+ * @param results copy-out array of n presence indicators (1 present, 0 not)
+ * @return <i>number of keys present</i> on success
+ * @return <i>-1</i> on failure
+ */
+int bk_bloomfilter_is_present_batch(bk_s B, struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int n, u_char *results)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t hash[BF_BATCH][2];
+  int base, cnt, j;
+  int present = 0;
+
+  if (!bf || !bf->bf_bitset || (n && (!keys || !lens || !results)) || n < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (j = 0; j < n; j++)
+  {
+    if (!keys[j] || !lens[j])
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid key %d in batch\n", j);
+      BK_RETURN(B, -1);
+    }
+  }
+
+  for (base = 0; base < n; base += BF_BATCH)
+  {
+    cnt = MIN(BF_BATCH, n - base);
+
+    for (j = 0; j < cnt; j++)
+    {
+      murmurhash3_x64_128(keys[base+j], lens[base+j], 0L, &hash[j]);
+      if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_BLOCKED))
+      {
+	BK_PREFETCH(bf->bf_bitset + mulhi64((uint64_t)hash[j][0], (uint64_t)bf->bf_blocks) * BF_BLOCK_WORDS, 0);
+      }
+      else
+      {
+	// Prefetching every probe wastes bandwidth on keys which miss early
+	BK_PREFETCH(bf->bf_bitset + (llabs(hash[j][0] % bf->bf_bits) >> 6), 0);
+      }
+    }
+
+    for (j = 0; j < cnt; j++)
+    {
+      u_char hit = bloom_test_hashed(bf, hash[j]);
+
+      results[base+j] = hit;
+      present += hit;
+    }
+  }
+
+  BK_RETURN(B, present);
+}
+
+
+
+/**
+ * Add a range of keys, BF_BATCH at a time: hash and prefetch every key in
+ * the batch, then set its bits.  With atomic set, bits are merged with
+ * atomic OR so several threads may load the same filter; words which
+ * already contain all of their bits are not written at all, which keeps
+ * popular cache lines shared rather than bouncing between CPUs.
+ *
+ * @param bf the bloom filter
+ * @param keys array of keys to hash
+ * @param lens array of key lengths in bytes
+ * @param start first key to add
+ * @param end one past the last key to add
+ * @param atomic nonzero if other threads may be writing the bitset
+ */
+static void bloom_add_range(struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int64_t start, int64_t end, int atomic)
+{
+  int64_t hash[BF_BATCH][2];
+  int64_t base;
+  int cnt, j, w;
+  int32_t i;
+
+  for (base = start; base < end; base += BF_BATCH)
+  {
+    cnt = MIN(BF_BATCH, end - base);
+
+    for (j = 0; j < cnt; j++)
+    {
+      murmurhash3_x64_128(keys[base+j], lens[base+j], 0L, &hash[j]);
+      if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_BLOCKED))
+      {
+	BK_PREFETCH(bf->bf_bitset + mulhi64((uint64_t)hash[j][0], (uint64_t)bf->bf_blocks) * BF_BLOCK_WORDS, 1);
+      }
+      else
+      {
+	for (i=0; i<bf->bf_hash_count; i++)
+	  BK_PREFETCH(bf->bf_bitset + (llabs((hash[j][0] + ((int64_t)i) * hash[j][1]) % bf->bf_bits) >> 6), 1);
+      }
+    }
+
+    for (j = 0; j < cnt; j++)
+    {
+      if (BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_BLOCKED))
+      {
+	uint64_t mask[BF_BLOCK_WORDS];
+	uint64_t *blk = block_locate(bf, hash[j], mask);
+
+	if (!atomic)
+	{
+	  block_set(blk, mask);
+	  continue;
+	}
+
+	for (w = 0; w < BF_BLOCK_WORDS; w++)
+	  if ((blk[w] & mask[w]) != mask[w])
+	    BK_ATOMIC_OR(&blk[w], mask[w]);
+      }
+      else
+      {
+	for (i=0; i<bf->bf_hash_count; i++)
+	{
+	  int64_t idx = llabs((hash[j][0] + ((int64_t)i) * hash[j][1]) % bf->bf_bits);
+	  uint64_t bitmask = 1ULL << (idx & 0x3f);
+
+	  if (!atomic)
+	    set_bit(bf->bf_bitset, bf->bf_words, idx);
+	  else if ((idx >> 6) < bf->bf_words && !(bf->bf_bitset[idx >> 6] & bitmask))
+	    BK_ATOMIC_OR(&bf->bf_bitset[idx >> 6], bitmask);
+	}
+      }
+    }
+  }
+}
+
+
+
+#ifdef BK_USING_PTHREADS
+/**
+ * Bulk load worker: claim and load slices until none are left.  The
+ * calling thread runs this too, so a load makes progress even if no
+ * helper thread could be started.
+ *
+ * THREADS: MT-SAFE
+ *
+ * @param bbj The bulk load job
+ */
+static void bloom_bulk_worker(struct bloom_bulk_job *bbj)
+{
+  int slice;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&bbj->bbj_lock);
+    slice = bbj->bbj_next < bbj->bbj_nslices ? bbj->bbj_next++ : -1;
+    pthread_mutex_unlock(&bbj->bbj_lock);
+
+    if (slice < 0)
+      break;
+
+    bloom_add_range(bbj->bbj_bf, bbj->bbj_keys, bbj->bbj_lens,
+		    bbj->bbj_n * slice / bbj->bbj_nslices,
+		    bbj->bbj_n * (slice + 1) / bbj->bbj_nslices, 1);
+  }
+}
+
+
+
+/**
+ * Bulk load helper thread.  The job lives on the caller's stack, so it
+ * must not be touched after bbj_running is decremented.
+ *
+ * THREADS: MT-SAFE
+ *
+ * @param B BAKA Thread/global state
+ * @param opaque The bulk load job
+ * @return <i>NULL</i> always
+ */
+static void *bloom_bulk_thread(bk_s B, void *opaque)
+{
+  struct bloom_bulk_job *bbj = opaque;
+
+  bloom_bulk_worker(bbj);
+
+  pthread_mutex_lock(&bbj->bbj_lock);
+  if (--bbj->bbj_running == 0)
+    pthread_cond_broadcast(&bbj->bbj_cond);
+  pthread_mutex_unlock(&bbj->bbj_lock);
+
+  return(NULL);
+}
+#endif /* BK_USING_PTHREADS */
+
+
+
+/**
+ * Add a large number of keys to a bloom filter, spreading the work over
+ * several threads which merge into the shared bitset with atomic OR.  The
+ * result is bit-identical to adding the keys one at a time.  Without
+ * thread support (or with nthreads < 2) the keys are loaded in the calling
+ * thread, still in prefetching batches.
+ *
+ * THREADS: MT-SAFE (as long as nobody else writes bf concurrently without atomics)
+ *
+ * @param B BAKA Thread/global state
+ * @param bf the bloom filter
+ * @param keys array of keys to hash
+ * @param lens array of key lengths in bytes
+ * @param n number of keys
+ * @param nthreads number of threads to use, including the caller (0 for one per CPU)
+ * @param flags Fun for the future
+ * @return <i>0</i> on success
+ * @return <i>-1</i> on failure
+ */
+int bk_bloomfilter_add_bulk(bk_s B, struct bk_bloomfilter *bf, const void * const *keys, const int *lens, int64_t n, int nthreads, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t j;
+#ifdef BK_USING_PTHREADS
+  struct bloom_bulk_job bbj;
+  char name[32];
+  int t;
+#endif /* BK_USING_PTHREADS */
+
+  if (!bf || !bf->bf_bitset || (n && (!keys || !lens)) || n < 0 || nthreads < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(bf->bf_flags, BF_FLAG_WRITABLE))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filter not configurated for writability\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (j = 0; j < n; j++)
+  {
+    if (!keys[j] || !lens[j])
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid key %lld in bulk load\n", (long long)j);
+      BK_RETURN(B, -1);
+    }
+  }
+
+#ifdef BK_USING_PTHREADS
+  if (!nthreads)
+    nthreads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+  // Not worth starting threads for less than a few batches each
+  nthreads = MIN(nthreads, MAX(1, n / (BF_BATCH * 64)));
+
+  if (nthreads > 1)
+  {
+    memset(&bbj, 0, sizeof(bbj));
+    bbj.bbj_bf = bf;
+    bbj.bbj_keys = keys;
+    bbj.bbj_lens = lens;
+    bbj.bbj_n = n;
+    // Several slices per thread so a slow thread does not hold up the end
+    bbj.bbj_nslices = nthreads * 4;
+    pthread_mutex_init(&bbj.bbj_lock, NULL);
+    pthread_cond_init(&bbj.bbj_cond, NULL);
+
+    for (t = 1; t < nthreads; t++)
+    {
+      snprintf(name, sizeof(name), "bloom-bulk-%d", t);
+      pthread_mutex_lock(&bbj.bbj_lock);
+      bbj.bbj_running++;
+      pthread_mutex_unlock(&bbj.bbj_lock);
+      if (!bk_general_thread_create(B, name, bloom_bulk_thread, &bbj, 0))
+      {
+	// Remaining slices are picked up by whoever is running
+	bk_error_printf(B, BK_ERR_WARN, "Could not start bloom filter bulk load thread %d\n", t);
+	pthread_mutex_lock(&bbj.bbj_lock);
+	bbj.bbj_running--;
+	pthread_mutex_unlock(&bbj.bbj_lock);
+	break;
+      }
+    }
+
+    bloom_bulk_worker(&bbj);
+
+    pthread_mutex_lock(&bbj.bbj_lock);
+    while (bbj.bbj_running > 0)
+      pthread_cond_wait(&bbj.bbj_cond, &bbj.bbj_lock);
+    pthread_mutex_unlock(&bbj.bbj_lock);
+
+    pthread_cond_destroy(&bbj.bbj_cond);
+    pthread_mutex_destroy(&bbj.bbj_lock);
+    BK_RETURN(B, 0);
+  }
+#endif /* BK_USING_PTHREADS */
+
+  bloom_add_range(bf, keys, lens, 0, n, 0);
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Check that two filters have the same geometry, so that their bitsets
+ * may be combined word by word.
+ *
+ * @param B BAKA Thread/global state
+ * @param a one bloom filter
+ * @param b another bloom filter
+ * @return <i>1</i> if compatible
+ * @return <i>0</i> if not
+ */
+static int bloom_compatible(bk_s B, struct bk_bloomfilter *a, struct bk_bloomfilter *b)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (a->bf_bits != b->bf_bits || a->bf_hash_count != b->bf_hash_count ||
+      BK_FLAG_ISSET(a->bf_flags, BF_FLAG_BLOCKED) != BK_FLAG_ISSET(b->bf_flags, BF_FLAG_BLOCKED))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filters are not compatible (%lld/%d vs %lld/%d bits/hashes)\n",
+		    (long long)a->bf_bits, a->bf_hash_count, (long long)b->bf_bits, b->bf_hash_count);
+    BK_RETURN(B, 0);
+  }
+
+  BK_RETURN(B, 1);
+}
+
+
+
+/**
+ * Merge another filter into this one, so dst then reports every key
+ * present in either.  The filters must have been created with the same
+ * size, hash count and layout.  Either may be mmapped.
+ *
+ * @param B BAKA Thread/global state
+ * @param dst the (writable) bloom filter to merge into
+ * @param src the bloom filter to merge from
+ * @return <i>0</i> on success
+ * @return <i>-1</i> on failure
+ */
+int bk_bloomfilter_union(bk_s B, struct bk_bloomfilter *dst, struct bk_bloomfilter *src)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t w = 0;
+
+  if (!dst || !src || !dst->bf_bitset || !src->bf_bitset)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(dst->bf_flags, BF_FLAG_WRITABLE))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filter not configurated for writability\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (!bloom_compatible(B, dst, src))
+    BK_RETURN(B, -1);
+
+#if defined(__AVX2__)
+  for (; w + 4 <= dst->bf_words; w += 4)
+    _mm256_storeu_si256((__m256i *)(dst->bf_bitset + w), _mm256_or_si256(_mm256_loadu_si256((__m256i *)(dst->bf_bitset + w)), _mm256_loadu_si256((__m256i *)(src->bf_bitset + w))));
+#endif /* __AVX2__ */
+  for (; w < dst->bf_words; w++)
+    dst->bf_bitset[w] |= src->bf_bitset[w];
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Intersect another filter with this one, so dst then only reports keys
+ * which both report.  (The result may have more false positives than a
+ * filter built from the intersection of the key sets.)  The filters must
+ * have been created with the same size, hash count and layout.  Either
+ * may be mmapped.
+ *
+ * @param B BAKA Thread/global state
+ * @param dst the (writable) bloom filter to intersect into
+ * @param src the bloom filter to intersect with
+ * @return <i>0</i> on success
+ * @return <i>-1</i> on failure
+ */
+int bk_bloomfilter_intersect(bk_s B, struct bk_bloomfilter *dst, struct bk_bloomfilter *src)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t w = 0;
+
+  if (!dst || !src || !dst->bf_bitset || !src->bf_bitset)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(dst->bf_flags, BF_FLAG_WRITABLE))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filter not configurated for writability\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (!bloom_compatible(B, dst, src))
+    BK_RETURN(B, -1);
+
+#if defined(__AVX2__)
+  for (; w + 4 <= dst->bf_words; w += 4)
+    _mm256_storeu_si256((__m256i *)(dst->bf_bitset + w), _mm256_and_si256(_mm256_loadu_si256((__m256i *)(dst->bf_bitset + w)), _mm256_loadu_si256((__m256i *)(src->bf_bitset + w))));
+#endif /* __AVX2__ */
+  for (; w < dst->bf_words; w++)
+    dst->bf_bitset[w] &= src->bf_bitset[w];
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Count the bits set in a bloom filter.  Together with the size and hash
+ * count this gives an estimate of the number of keys added, or of the
+ * false positive rate ((popcount/bits)^hashes for the classic layout).
+ *
+ * @param B BAKA Thread/global state
+ * @param bf the bloom filter
+ * @return <i>number of set bits</i> on success
+ * @return <i>-1</i> on failure
+ */
+int64_t bk_bloomfilter_popcount(bk_s B, struct bk_bloomfilter *bf)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+  int64_t w = 0;
+
+  if (!bf || !bf->bf_bitset)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  // Independent accumulators so popcnt instructions can issue in parallel
+  for (; w + 4 <= bf->bf_words; w += 4)
+  {
+    c0 += __builtin_popcountll(bf->bf_bitset[w]);
+    c1 += __builtin_popcountll(bf->bf_bitset[w+1]);
+    c2 += __builtin_popcountll(bf->bf_bitset[w+2]);
+    c3 += __builtin_popcountll(bf->bf_bitset[w+3]);
+  }
+  for (; w < bf->bf_words; w++)
+    c0 += __builtin_popcountll(bf->bf_bitset[w]);
+
+  BK_RETURN(B, c0 + c1 + c2 + c3);
+}
+
+
+
+/**
+ * Create a counting bloom filter.  Each position is a packed 4-bit
+ * counter rather than a bit, so keys may be removed as well as added.
+ * Probes use the same murmur double hashing as the classic filter.
+ * Counters which reach 15 stick there (they can no longer be safely
+ * decremented), so a heavily overloaded filter degrades towards a
+ * classic one rather than producing false negatives.
+ *
+ * The file format, if a filename is given, is the raw counter array
+ * (counters/16 64-bit words, host byte order) with no header.
+ *
+ * @param B BAKA Thread/global state
+ * @param hashes number of hash functions to use
+ * @param counters number of counters (may be rounded up)
+ * @param filename If non-null, contains a filename of a file containing the counters, which will be mmapped
+ * @param flags BK_BLOOMFILTER_WRITABLE Allow writability
+ * @param flags BK_BLOOMFILTER_CREATABLE Allow filter creation (implies writable)
+ * @return <i>new counting bloom filter</i> on success
+ * @return <i>NULL</i> on failure
+ */
+struct bk_countingbloom *bk_countingbloom_create(bk_s B, int32_t hashes, int64_t counters, const char *filename, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_countingbloom *cb = NULL;
+
+  if ((hashes < 1) || (counters < 1))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid bloom filter parameters.\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!BK_CALLOC(cb))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for counting bloom filter metadata.\n");
+    goto error;
+  }
+  cb->cb_fd = -1;
+  cb->cb_hash_count = hashes;
+  cb->cb_counters = counters;
+  cb->cb_words = ((counters - 1) / CB_PER_WORD) + 1;
+
+  if (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_WRITABLE) ||
+      BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
+    BK_FLAG_SET(cb->cb_flags, BF_FLAG_WRITABLE);
+
+  if (!filename)
+  {
+    if (!BK_CALLOC_LEN(cb->cb_counts, cb->cb_words * sizeof(uint64_t)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for counting bloom filter.\n");
+      goto error;
+    }
+    BK_FLAG_SET(cb->cb_flags, BF_FLAG_ALLOCATED);
+  }
+  else
+  {
+    if (!(cb->cb_counts = bloom_file_map(B, filename, cb->cb_words * sizeof(uint64_t), flags, &cb->cb_fd)))
+      goto error;
+    BK_FLAG_SET(cb->cb_flags, BF_FLAG_MMAPPED);
+  }
+
+  BK_RETURN(B, cb);
+
+ error:
+  if (cb)
+    bk_countingbloom_destroy(B, cb);
+
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Destroy a counting bloom filter
+ *
+ * @param B BAKA Thread/global state
+ * @param cb the counting bloom filter
+ */
+void bk_countingbloom_destroy(bk_s B, struct bk_countingbloom *cb)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (cb)
+  {
+    if (cb->cb_counts)
+    {
+      if (BK_FLAG_ISSET(cb->cb_flags, BF_FLAG_ALLOCATED))
+	free(cb->cb_counts);
+      else if (BK_FLAG_ISSET(cb->cb_flags, BF_FLAG_MMAPPED))
+	munmap(cb->cb_counts, cb->cb_words * sizeof(uint64_t));
+    }
+
+    if (cb->cb_fd > -1)
+      close(cb->cb_fd);
+
+    free(cb);
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Add a key to a counting bloom filter.
+ *
+ * @param B BAKA Thread/global state
+ * @param cb the counting bloom filter
+ * @param key string to hash
+ * @param len length of key in bytes
+ * @return <i>0</i> on success
+ * @return <i>-1</i> on failure
+ */
+int bk_countingbloom_add(bk_s B, struct bk_countingbloom *cb, const void *key, const int len)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t hash[2];
+  int32_t i;
+
+  if (!cb || !cb->cb_counts || !key || !len)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(cb->cb_flags, BF_FLAG_WRITABLE))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filter not configurated for writability\n");
+    BK_RETURN(B, -1);
+  }
+
+  murmurhash3_x64_128(key, len, 0L, &hash);
+  for (i=0; i<cb->cb_hash_count; i++)
+  {
+    int64_t idx = llabs((hash[0] + ((int64_t)i) * hash[1]) % cb->cb_counters);
+
+    if (CB_GET(cb, idx) < CB_MAX)
+      cb->cb_counts[idx / CB_PER_WORD] += CB_ONE(idx);
+  }
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Remove a key from a counting bloom filter.  The key is only removed if
+ * the filter believes it is present, but removing a key which was never
+ * added (a false positive) will cause false negatives for other keys.
+ *
+ * @param B BAKA Thread/global state
+ * @param cb the counting bloom filter
+ * @param key string to hash
+ * @param len length of key in bytes
+ * @return <i>1</i> on success and key was removed
+ * @return <i>0</i> on success and key was not present
+ * @return <i>-1</i> on failure
+ */
+int bk_countingbloom_remove(bk_s B, struct bk_countingbloom *cb, const void *key, const int len)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t hash[2];
+  int32_t i;
+
+  if (!cb || !cb->cb_counts || !key || !len)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(cb->cb_flags, BF_FLAG_WRITABLE))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filter not configurated for writability\n");
+    BK_RETURN(B, -1);
+  }
+
+  murmurhash3_x64_128(key, len, 0L, &hash);
+  for (i=0; i<cb->cb_hash_count; i++)
+  {
+    if (!CB_GET(cb, llabs((hash[0] + ((int64_t)i) * hash[1]) % cb->cb_counters)))
+      BK_RETURN(B, 0);
+  }
+
+  for (i=0; i<cb->cb_hash_count; i++)
+  {
+    int64_t idx = llabs((hash[0] + ((int64_t)i) * hash[1]) % cb->cb_counters);
+    u_int val = CB_GET(cb, idx);
+
+    // Saturated counters have lost count of how many keys they hold
+    if (val > 0 && val < CB_MAX)
+      cb->cb_counts[idx / CB_PER_WORD] -= CB_ONE(idx);
+  }
+
+  BK_RETURN(B, 1);
+}
+
+
+
+/**
+ * Check for a key in a counting bloom filter.
+ *
+ * @param B BAKA Thread/global state
+ * @param cb the counting bloom filter
+ * @param key string to hash
+ * @param len length of key in bytes
+ * @return <i>1</i> on success and key was present
+ * @return <i>0</i> on success and key was not present
+ * @return <i>-1</i> on failure
+ */
+int bk_countingbloom_is_present(bk_s B, struct bk_countingbloom *cb, const void *key, const int len)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t hash[2];
+  int32_t i;
+
+  if (!cb || !cb->cb_counts || !key || !len)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  murmurhash3_x64_128(key, len, 0L, &hash);
+  for (i=0; i<cb->cb_hash_count; i++)
+  {
+    if (!CB_GET(cb, llabs((hash[0] + ((int64_t)i) * hash[1]) % cb->cb_counters)))
+      BK_RETURN(B, 0);
+  }
+
+  BK_RETURN(B, 1);
+}
+
+
+
+/**
+ * Create (or reopen) a scalable bloom filter.  This is a chain of ordinary
+ * bloom filters ("stages"), each holding SB_GROWTH times as many keys as
+ * the last at a tighter false positive rate, so that the rate for the
+ * whole chain stays under the target however many keys are added.  A
+ * key is hashed once and the same hash is probed against every stage.
+ *
+ * If a filename is given the whole chain lives in that one file: a
+ * header page describing the stages followed by each stage's bitset at
+ * an SB_ALIGN boundary.  The file grows as stages are added.  When an
+ * existing file is reopened, capacity and fprate come from the file and
+ * the arguments are ignored.
+ *
+ * @param B BAKA Thread/global state
+ * @param capacity number of keys the first stage should hold
+ * @param fprate target false positive rate (e.g. 0.01)
+ * @param filename If non-null, file to keep the filter in
+ * @param flags BK_BLOOMFILTER_WRITABLE Allow writability
+ * @param flags BK_BLOOMFILTER_CREATABLE Allow filter creation (implies writable)
+ * @param flags BK_BLOOMFILTER_BLOCKED Use the cache-blocked layout for new stages
+ * @return <i>new scalable bloom filter</i> on success
+ * @return <i>NULL</i> on failure
+ */
+struct bk_scalablebloom *bk_scalablebloom_create(bk_s B, int64_t capacity, double fprate, const char *filename, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_scalablebloom *sb = NULL;
+  struct stat buf;
+  int fdflags = O_RDONLY;
+  u_int s;
+
+  if (capacity < 1 || fprate <= 0.0 || fprate >= 1.0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid bloom filter parameters.\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!BK_CALLOC(sb))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for scalable bloom filter metadata.\n");
+    goto error;
+  }
+  sb->sb_fd = -1;
+
+  if (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_WRITABLE) ||
+      BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
+    BK_FLAG_SET(sb->sb_flags, BF_FLAG_WRITABLE);
+
+  if (!filename)
+  {
+    if (!BK_CALLOC(sb->sb_header))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for scalable bloom filter.\n");
+      goto error;
+    }
+    BK_FLAG_SET(sb->sb_flags, BF_FLAG_ALLOCATED);
+  }
+  else
+  {
+    if (BK_FLAG_ISSET(sb->sb_flags, BF_FLAG_WRITABLE))
+      fdflags = O_RDWR | (BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE)?O_CREAT:0);
+
+    if ((sb->sb_fd = open(filename, fdflags, 0666)) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Error opening bloom filter file: %s\n", strerror(errno));
+      goto error;
+    }
+
+    if (fstat(sb->sb_fd, &buf) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not stat bloom filter we just opened: %s\n", strerror(errno));
+      goto error;
+    }
+
+    if (buf.st_size == 0 && BK_FLAG_ISSET(flags, BK_BLOOMFILTER_CREATABLE))
+    {
+      if (ftruncate(sb->sb_fd, SB_ALIGN) < 0)
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not fill out bloomfilter: %s\n", strerror(errno));
+	goto error;
+      }
+    }
+    else if (buf.st_size < SB_ALIGN)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Scalable bloom filter file is truncated (%lld bytes)\n", (long long)buf.st_size);
+      goto error;
+    }
+
+    if ((sb->sb_header = mmap(0, SB_ALIGN, PROT_READ|(BK_FLAG_ISSET(sb->sb_flags, BF_FLAG_WRITABLE)?PROT_WRITE:0), MAP_SHARED, sb->sb_fd, 0)) == MAP_FAILED)
+    {
+      sb->sb_header = NULL;
+      bk_error_printf(B, BK_ERR_ERR, "Error mapping bloom filter file: %s\n", strerror(errno));
+      goto error;
+    }
+    BK_FLAG_SET(sb->sb_flags, BF_FLAG_MMAPPED);
+  }
+
+  if (sb->sb_header->sh_nstages)
+  {
+    // Reopening an existing filter
+    if (memcmp(sb->sb_header->sh_magic, SB_MAGIC, sizeof(sb->sb_header->sh_magic)) ||
+	sb->sb_header->sh_version != SB_VERSION || sb->sb_header->sh_nstages > SB_MAXSTAGES)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "%s is not a scalable bloom filter\n", filename);
+      goto error;
+    }
+
+    for (s = 0; s < sb->sb_header->sh_nstages; s++)
+    {
+      if (sbloom_stage_open(B, sb, s) < 0)
+	goto error;
+    }
+  }
+  else
+  {
+    if (BK_FLAG_ISCLEAR(sb->sb_flags, BF_FLAG_WRITABLE))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Scalable bloom filter is empty and not writable\n");
+      goto error;
+    }
+
+    memcpy(sb->sb_header->sh_magic, SB_MAGIC, sizeof(sb->sb_header->sh_magic));
+    sb->sb_header->sh_version = SB_VERSION;
+    sb->sb_header->sh_capacity = capacity;
+    sb->sb_header->sh_fprate = fprate;
+    sb->sb_header->sh_blocked = BK_FLAG_ISSET(flags, BK_BLOOMFILTER_BLOCKED)?1:0;
+
+    if (sbloom_stage_add(B, sb) < 0)
+      goto error;
+  }
+
+  BK_RETURN(B, sb);
+
+ error:
+  if (sb)
+    bk_scalablebloom_destroy(B, sb);
+
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Destroy a scalable bloom filter
+ *
+ * @param B BAKA Thread/global state
+ * @param sb the scalable bloom filter
+ */
+void bk_scalablebloom_destroy(bk_s B, struct bk_scalablebloom *sb)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  u_int s;
+
+  if (sb)
+  {
+    for (s = 0; s < SB_MAXSTAGES; s++)
+    {
+      if (sb->sb_stage[s])
+	bk_bloomfilter_destroy(B, sb->sb_stage[s]);
+    }
+
+    if (sb->sb_header)
+    {
+      if (BK_FLAG_ISSET(sb->sb_flags, BF_FLAG_ALLOCATED))
+	free(sb->sb_header);
+      else if (BK_FLAG_ISSET(sb->sb_flags, BF_FLAG_MMAPPED))
+	munmap(sb->sb_header, SB_ALIGN);
+    }
+
+    if (sb->sb_fd > -1)
+      close(sb->sb_fd);
+
+    free(sb);
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Add a key to a scalable bloom filter, starting a new stage first if the
+ * current one is full.  Keys which are (probably) already present are not
+ * added again, so they do not use up capacity.
+ *
+ * @param B BAKA Thread/global state
+ * @param sb the scalable bloom filter
+ * @param key string to hash
+ * @param len length of key in bytes
+ * @return <i>1</i> on success and key was already present
+ * @return <i>0</i> on success and key was added
+ * @return <i>-1</i> on failure
+ */
+int bk_scalablebloom_add(bk_s B, struct bk_scalablebloom *sb, const void *key, const int len)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct sbloom_header *sh;
+  int64_t hash[2];
+  int s;
+
+  if (!sb || !(sh = sb->sb_header) || !key || !len)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(sb->sb_flags, BF_FLAG_WRITABLE))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Bloom filter not configurated for writability\n");
+    BK_RETURN(B, -1);
+  }
+
+  murmurhash3_x64_128(key, len, 0L, &hash);
+
+  for (s = sh->sh_nstages - 1; s >= 0; s--)
+  {
+    if (bloom_test_hashed(sb->sb_stage[s], hash))
+      BK_RETURN(B, 1);
+  }
+
+  s = sh->sh_nstages - 1;
+  if (sh->sh_stage[s].ss_count >= sh->sh_stage[s].ss_capacity)
+  {
+    if (sh->sh_nstages < SB_MAXSTAGES)
+    {
+      if (sbloom_stage_add(B, sb) < 0)
+	BK_RETURN(B, -1);
+      s++;
+    }
+    else if (sh->sh_stage[s].ss_count == sh->sh_stage[s].ss_capacity)
+    {
+      bk_error_printf(B, BK_ERR_WARN, "Scalable bloom filter is out of stages, false positive rate will rise\n");
+    }
+  }
+
+  bloom_set_hashed(sb->sb_stage[s], hash);
+  sh->sh_stage[s].ss_count++;
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Check for a key in a scalable bloom filter.
+ *
+ * @param B BAKA Thread/global state
+ * @param sb the scalable bloom filter
+ * @param key string to hash
+ * @param len length of key in bytes
+ * @return <i>1</i> on success and key was present
+ * @return <i>0</i> on success and key was not present
+ * @return <i>-1</i> on failure
+ */
+int bk_scalablebloom_is_present(bk_s B, struct bk_scalablebloom *sb, const void *key, const int len)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t hash[2];
+  int s;
+
+  if (!sb || !sb->sb_header || !key || !len)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  murmurhash3_x64_128(key, len, 0L, &hash);
+
+  // Newest stages are the largest, so most likely to hold the key
+  for (s = sb->sb_header->sh_nstages - 1; s >= 0; s--)
+  {
+    if (bloom_test_hashed(sb->sb_stage[s], hash))
+      BK_RETURN(B, 1);
+  }
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Number of distinct keys added to a scalable bloom filter (keys which
+ * were false positives when added are not counted).
+ *
+ * @param B BAKA Thread/global state
+ * @param sb the scalable bloom filter
+ * @return <i>key count</i> on success
+ * @return <i>-1</i> on failure
+ */
+int64_t bk_scalablebloom_count(bk_s B, struct bk_scalablebloom *sb)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int64_t count = 0;
+  u_int s;
+
+  if (!sb || !sb->sb_header)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Internal error: invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (s = 0; s < sb->sb_header->sh_nstages; s++)
+    count += sb->sb_header->sh_stage[s].ss_count;
+
+  BK_RETURN(B, count);
+}
+
+
+
+/**
+ * Append a new stage to a scalable bloom filter, sized for SB_GROWTH
+ * times the keys of the last at SB_TIGHTEN times its false positive rate.
+ * Summed over all stages the rate converges to at most the target.
+ *
+ * @param B BAKA Thread/global state
+ * @param sb the scalable bloom filter
+ * @return <i>0</i> on success
+ * @return <i>-1</i> on failure
+ */
+static int sbloom_stage_add(bk_s B, struct bk_scalablebloom *sb)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct sbloom_header *sh = sb->sb_header;
+  struct sbloom_stage *ss = &sh->sh_stage[sh->sh_nstages];
+  double p = sh->sh_fprate * (1.0 - SB_TIGHTEN) * pow(SB_TIGHTEN, sh->sh_nstages);
+  u_int shift = sh->sh_nstages * SB_GROWTH_SHIFT;
+  u_int64_t bytes;
+
+  if (shift >= 64 || sh->sh_capacity > (UINT64_MAX >> shift))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Scalable bloom filter stage %u capacity overflows\n", sh->sh_nstages);
+    BK_RETURN(B, -1);
+  }
+
+  ss->ss_capacity = sh->sh_capacity << shift;
+  // Optimal sizing: m = -n ln(p) / ln(2)^2, k = -log2(p)
+  ss->ss_bits = (u_int64_t)ceil(ss->ss_capacity * -log(p) / (M_LN2 * M_LN2));
+  ss->ss_bits = ((ss->ss_bits - 1) / BF_BLOCK_BITS + 1) * BF_BLOCK_BITS;
+  ss->ss_hashes = MAX(1, (u_int32_t)ceil(-log(p) / M_LN2));
+  ss->ss_count = 0;
+
+  if (sh->sh_nstages == 0)
+  {
+    ss->ss_offset = SB_ALIGN;
+  }
+  else
+  {
+    struct sbloom_stage *prev = ss - 1;
+
+    bytes = prev->ss_bits / 8;
+    ss->ss_offset = ((prev->ss_offset + bytes + SB_ALIGN - 1) / SB_ALIGN) * SB_ALIGN;
+  }
+
+  if (sb->sb_fd > -1)
+  {
+    bytes = ss->ss_bits / 8;
+    if (ftruncate(sb->sb_fd, ss->ss_offset + bytes) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not extend scalable bloom filter: %s\n", strerror(errno));
+      BK_RETURN(B, -1);
+    }
+  }
+
+  if (sbloom_stage_open(B, sb, sh->sh_nstages) < 0)
+    BK_RETURN(B, -1);
+
+  // Only now is the stage visible to anyone reopening the file
+  sh->sh_nstages++;
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Attach the bitset for one stage of a scalable bloom filter, either by
+ * mapping its region of the file or by allocating it.
+ *
+ * @param B BAKA Thread/global state
+ * @param sb the scalable bloom filter
+ * @param s the stage
+ * @return <i>0</i> on success
+ * @return <i>-1</i> on failure
+ */
+static int sbloom_stage_open(bk_s B, struct bk_scalablebloom *sb, u_int s)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct sbloom_stage *ss = &sb->sb_header->sh_stage[s];
+  bk_flags flags = 0;
+  struct bk_bloomfilter *bf;
+
+  if (BK_FLAG_ISSET(sb->sb_flags, BF_FLAG_WRITABLE))
+    BK_FLAG_SET(flags, BK_BLOOMFILTER_WRITABLE);
+  if (sb->sb_header->sh_blocked)
+    BK_FLAG_SET(flags, BK_BLOOMFILTER_BLOCKED);
+
+  if (sb->sb_fd < 0)
+  {
+    if (!(sb->sb_stage[s] = bk_bloomfilter_create(B, ss->ss_hashes, ss->ss_bits, NULL, flags)))
+      BK_RETURN(B, -1);
+    BK_RETURN(B, 0);
+  }
+
+  if (!BK_CALLOC(bf))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for bloom filter metadata.\n");
+    BK_RETURN(B, -1);
+  }
+  bloom_geometry(bf, ss->ss_hashes, ss->ss_bits, flags);
+
+  if ((bf->bf_bitset = mmap(0, bf->bf_words * sizeof(uint64_t), PROT_READ|(BK_FLAG_ISSET(bf->bf_flags, BF_FLAG_WRITABLE)?PROT_WRITE:0), MAP_SHARED, sb->sb_fd, ss->ss_offset)) == MAP_FAILED)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Error mapping bloom filter stage %u: %s\n", s, strerror(errno));
+    free(bf);
+    BK_RETURN(B, -1);
+  }
+  // The fd is shared between stages and closed by bk_scalablebloom_destroy
+  BK_FLAG_SET(bf->bf_flags, BF_FLAG_MMAPPED);
+  sb->sb_stage[s] = bf;
+
+  BK_RETURN(B, 0);
 }
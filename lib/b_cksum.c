@@ -18,191 +18,253 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 /**
  * @file
  * Checksum routine(s).
+ *
+ * The Internet checksum is the ones' complement of the ones' complement
+ * sum of the data taken as 16-bit words (RFC 1071).  That sum does not
+ * care about byte order or how wide the adds are, as long as the
+ * carries are folded back in at the end, so the data is summed as
+ * 32-bit words into a 64-bit accumulator (or eight of them with AVX2)
+ * in host order, and the total folded down to 16 bits.  A buffer which
+ * starts at an odd offset into the packet has its partial sum
+ * byte-swapped before it is added in.
+ *
+ * Because everything stays in host order, a checksum field can be read
+ * from or stored into a packet as-is, without ntohs/htons.
  */
 
 #include <libbk.h>
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define CKSUM_X86					///< Can select x86 instructions at run time
+#include <immintrin.h>
+#endif /* x86 */
 
 
 
-#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
-#define REDUCE do {l_util.l = sum; sum = l_util.s[0] + l_util.s[1]; ADDCARRY(sum);} while(0)
+static u_int64_t cksum_sum(const u_char *buf, size_t len);
+static u_int64_t cksum_sum_scalar(const u_char *buf, size_t len);
+#ifdef CKSUM_X86
+static u_int64_t cksum_sum_avx2(const u_char *buf, size_t len);
+#endif /* CKSUM_X86 */
+static u_int16_t cksum_fold(u_int64_t sum);
 
 
 
 /**
- * Checksum routine for Internet Protocol family headers (Portable Version).
- *
- * This routine is very heavily used in the network
- * code and should be modified for each CPU to be as fast as possible.
- *
- * Copyright: This function is from Net4 BSD, and is NOT licensed under LGPL.
- *
- * Copyright (c) 1993 The Regents of the University of California.
- * All rights reserved.
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions are
- * met:
- *
- *    1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- *
- *    2. Redistributions in binary form must reproduce the above
- *    copyright notice, this list of conditions and the following
- *    disclaimer in the documentation and/or other materials provided
- *    with the distribution.
- *
- *    3. All advertising materials mentioning features or use of this
- *    software must display the following acknowledgement: This product
- *    includes software developed by the University of California,
- *    Berkeley and its contributors.
- *
- *    4. Neither the name of the University nor the names of its
- *    contributors may be used to endorse or promote products derived
- *    from this software without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS''
- * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
- * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
- * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS
- * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
- * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
- * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
- * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
- * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
- * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
- * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
- *
+ * Checksum routine for Internet Protocol family headers.
  *
  * THREADS: MT-SAFE
  *
- *	@param m Null terminated array of vectored pointers to data
+ *	@param B BAKA thread/global state.
+ *	@param m Array of vectored pointers to data, terminated by a zero length entry
  *	@param len Length of data in m that should be checksummed
  *	@return 16-bit <i>checksum</i> of data
  */
 int bk_in_cksum(bk_s B, bk_vptr *m, int len)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  u_short *w;
-  int sum = 0;
-  int mlen = 0;
-  int byte_swapped = 0;
+  u_int64_t sum = 0;
+  u_int16_t part;
+  size_t mlen;
+  int odd = 0;
 
-  union
-  {
-    char    c[2];
-    u_short s;
-  } s_util;
-
-  union
-  {
-    u_short s[2];
-    long    l;
-  } l_util;
-
-  for (;m && len; m++)
+  for (;m && len > 0; m++)
   {
     if (m->len == 0)
       break;
-    w = m->ptr;
 
-    if (mlen == -1)
+    mlen = MIN(m->len, (u_int)len);
+    len -= mlen;
+
+    // Bytes at odd offsets belong in the other half of each word
+    if (odd)
     {
-      /*
-       * The first byte of this mbuf is the continuation
-       * of a word spanning between this mbuf and the
-       * last mbuf.
-       *
-       * s_util.c[0] is already saved when scanning previous
-       * mbuf.
-       */
-      s_util.c[1] = *(char *)w;
-      sum += s_util.s;
-      w = (u_short *)((char *)w + 1);
-      mlen = m->len - 1;
-      len--;
+      part = cksum_fold(cksum_sum(m->ptr, mlen));
+      sum += (u_int16_t)((part << 8) | (part >> 8));
     }
     else
-      mlen = m->len;
+      sum += cksum_sum(m->ptr, mlen);
+    odd ^= mlen & 1;
+  }
 
-    if (len < mlen)
-      mlen = len;
-    len -= mlen;
+  if (len > 0)
+    bk_error_printf(B, BK_ERR_ERR, "cksum: out of data\n");
 
-    /*
-     * Force to even boundary.
-     */
-    if ((1 & (long)w) && (mlen > 0))
-    {
-      REDUCE;
-      sum <<= 8;
-      s_util.c[0] = *(u_char *)w;
-      w = (u_short *)((char *)w + 1);
-      mlen--;
-      byte_swapped = 1;
-    }
+  BK_RETURN(B, ~cksum_fold(sum) & 0xffff);
+}
 
-    /*
-     * Unroll the loop to make overhead from
-     * branches &c small.
-     */
-    while ((mlen -= 32) >= 0)
-    {
-      sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-      sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-      sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
-      sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-      w += 16;
-    }
-    mlen += 32;
 
-    while ((mlen -= 8) >= 0)
-    {
-      sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-      w += 4;
-    }
-    mlen += 8;
 
-    if (mlen == 0 && byte_swapped == 0)
-      continue;
-    REDUCE;
+/**
+ * Adjust an Internet checksum for a change to part of the data it
+ * covers, without looking at the rest (RFC 1624, eqn. 3).  The changed
+ * field must start at an even offset and have an even length.  Both the
+ * checksum and the field are as they appear in the packet.
+ *
+ * The result is what recomputing the checksum would give.  For UDP,
+ * remember that a checksum of 0 in the packet means there is none (so
+ * leave it alone) and a computed 0 is sent as 0xffff.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param cksum Checksum before the change
+ *	@param oldval Field before the change
+ *	@param newval Field after the change
+ *	@param len Length of field in bytes
+ *	@return 16-bit <i>checksum</i> after change
+ */
+u_int16_t bk_in_cksum_update(u_int16_t cksum, const void *oldval, const void *newval, size_t len)
+{
+  u_int64_t sum = (u_int16_t)~cksum;
 
-    while ((mlen -= 2) >= 0)
-    {
-      sum += *w++;
-    }
+  // Adding ~m is subtracting m: sum the old words and complement
+  sum += (u_int16_t)~cksum_fold(cksum_sum(oldval, len));
+  sum += cksum_fold(cksum_sum(newval, len));
 
-    if (byte_swapped)
-    {
-      REDUCE;
-      sum <<= 8;
-      byte_swapped = 0;
-      if (mlen == -1)
-      {
-	s_util.c[1] = *(char *)w;
-	sum += s_util.s;
-	mlen = 0;
-      }
-      else
-	mlen = -1;
-    }
-    else
-      if (mlen == -1)
-	s_util.c[0] = *(char *)w;
+  return ~cksum_fold(sum);
+}
+
+
+
+/**
+ * Adjust an Internet checksum for a changed 32-bit field, such as an
+ * IPv4 address; see bk_in_cksum_update().
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param cksum Checksum before the change
+ *	@param oldval Field before the change, as it appears in the packet
+ *	@param newval Field after the change, as it appears in the packet
+ *	@return 16-bit <i>checksum</i> after change
+ */
+u_int16_t bk_in_cksum_update32(u_int16_t cksum, u_int32_t oldval, u_int32_t newval)
+{
+  u_int64_t sum = (u_int16_t)~cksum;
+
+  sum += (u_int32_t)~oldval;
+  sum += newval;
+
+  return ~cksum_fold(sum);
+}
+
+
+
+/**
+ * Sum a buffer as 32-bit words, as though it started on an even offset.
+ * An odd final byte is padded with a zero.
+ *
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>unfolded sum</i>
+ */
+static u_int64_t cksum_sum(const u_char *buf, size_t len)
+{
+#ifdef CKSUM_X86
+  if (len >= 128 && __builtin_cpu_supports("avx2"))
+    return cksum_sum_avx2(buf, len);
+#endif /* CKSUM_X86 */
+
+  return cksum_sum_scalar(buf, len);
+}
+
+
+
+/**
+ * Sum a buffer a 64-bit word at a time, adding each half into its own
+ * 64-bit accumulator, which cannot overflow for any buffer that fits in
+ * memory.
+ *
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>unfolded sum</i>
+ */
+static u_int64_t cksum_sum_scalar(const u_char *buf, size_t len)
+{
+  u_int64_t s0 = 0, s1 = 0, w0, w1;
+  u_int32_t w;
+  u_int16_t h;
+  u_char last[2];
+
+  for (; len >= 16; len -= 16, buf += 16)
+  {
+    memcpy(&w0, buf, sizeof(w0));
+    memcpy(&w1, buf + 8, sizeof(w1));
+    s0 += (w0 & 0xffffffff) + (w1 & 0xffffffff);
+    s1 += (w0 >> 32) + (w1 >> 32);
   }
 
-  if (len)
-    bk_error_printf(B, BK_ERR_ERR, "cksum: out of data\n");
+  for (; len >= 4; len -= 4, buf += 4)
+  {
+    memcpy(&w, buf, sizeof(w));
+    s0 += w;
+  }
 
-  if (mlen == -1)
+  if (len & 2)
   {
-    /* The last mbuf has odd # of bytes. Follow the
-       standard (the odd byte may be shifted left by 8 bits
-       or not as determined by endian-ness of the machine) */
-    s_util.c[1] = 0;
-    sum += s_util.s;
+    memcpy(&h, buf, sizeof(h));
+    s0 += h;
+    buf += 2;
   }
 
-  REDUCE;
-  BK_RETURN(B, ~sum & 0xffff);
+  // The odd byte is the first half of a word whose second half is zero
+  if (len & 1)
+  {
+    last[0] = *buf;
+    last[1] = 0;
+    memcpy(&h, last, sizeof(h));
+    s0 += h;
+  }
+
+  return s0 + s1;
+}
+
+
+
+#ifdef CKSUM_X86
+/**
+ * Sum a buffer 64 bytes at a time with AVX2, zero extending each 32-bit
+ * word into a 64-bit lane.
+ *
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>unfolded sum</i>
+ */
+__attribute__((target("avx2")))
+static u_int64_t cksum_sum_avx2(const u_char *buf, size_t len)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i a0 = zero, a1 = zero, v0, v1;
+  u_int64_t lanes[4];
+
+  for (; len >= 64; len -= 64, buf += 64)
+  {
+    v0 = _mm256_loadu_si256((const __m256i *)buf);
+    v1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+    a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v0, zero));
+    a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v0, zero));
+    a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v1, zero));
+    a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v1, zero));
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(a0, a1));
+
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + cksum_sum_scalar(buf, len);
+}
+#endif /* CKSUM_X86 */
+
+
+
+/**
+ * Fold a 64-bit sum down to a 16-bit ones' complement sum.
+ *
+ *	@param sum Unfolded sum
+ *	@return <i>16-bit sum</i>
+ */
+static u_int16_t cksum_fold(u_int64_t sum)
+{
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+
+  return sum;
 }
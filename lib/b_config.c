@@ -23,7 +23,19 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
  * '=', though there may be one optional space before and after the
  * equal sign.
  *
- * <TODO>Implement reconfig</TODO>
+ * Once a configuration has been parsed, it is compiled into a flat,
+ * read-only, hash-indexed image (a "snapshot") living in a shared
+ * anonymous mapping, so forked children inherit the very same pages.
+ * Lookups go through the current snapshot without taking any locks.
+ * bk_config_reinit() reparses the files and atomically swaps in a new
+ * snapshot.  Replaced snapshots stay mapped, so value pointers handed
+ * out before any number of changes stay valid, until the program says
+ * it is done with them by calling bk_config_reclaim() (readers announce
+ * themselves in a counter while they look at a snapshot, so that one is
+ * never unmapped under them).  If no snapshot can be made, lookups use
+ * the parse tree instead, and a parse tree replaced by reinit is kept in
+ * the same way.  bk_config_watch() can drive reinit from SIGHUP and/or
+ * (on linux) inotify on the configuration files.
  *
  * The format of these files is intended to be not totally
  * incompatible with the java.util.Properties load/store file format
@@ -123,7 +135,13 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 #include <libbk.h>
 #include "libbk_internal.h"
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif /* __linux__ */
 
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif /* !MAP_ANONYMOUS */
 
 #define SET_CONFIG(b,B,c) do { if (!(c)) { (b)=BK_GENERAL_CONFIG(B); } else { (b)=(c); } } while (0) ///< Set the configuration database to use--either from BAKA or from passed-in
 #define LINELEN 8192				///< Initial size of one configuration line
@@ -132,6 +150,9 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 #define BK_CONFIG_SEPARATORS	"="		///< Default configuration separator
 #define BK_CONFIG_COMMENTCHARS	"#!"		///< Default configuration comments
 #define BK_CONFIG_INCLUDE_TAG	"#include "	///< Default include-command key
+#define BK_CONFIG_IMAGE_MAGIC	0x626b6366	///< Snapshot image magic ("bkcf")
+#define BK_CONFIG_IMAGE_MINBUCKETS 8		///< Smallest snapshot hash table
+#define BK_CONFIG_WATCH_EVENTS	(IN_CLOSE_WRITE|IN_MOVE_SELF|IN_DELETE_SELF|IN_ATTRIB) ///< inotify events which trigger reinit
 
 
 
@@ -141,9 +162,73 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 struct bk_config
 {
   bk_flags			bc_flags;	///< Everyone needs flags
+  bk_flags			bc_intflags;	///< Internal state
+#define BC_INTFLAG_WATCH_SIGHUP	0x1		///< We own the SIGHUP handler of bc_watchrun
   struct bk_config_fileinfo *	bc_bcf;		///< Files of conf data
   dict_h			bc_kv;		///< Hash of value dlls
   struct bk_config_user_pref	bc_bcup;	///< User prefrences
+  struct bk_config_snapshot *	bc_snapshot;	///< Current compiled image (atomic)
+  struct bk_config_snapshot *	bc_retired;	///< Replaced images, newest first
+  u_int32_t			bc_readers;	///< Readers inside a snapshot (atomic)
+  u_int32_t			bc_generation;	///< Bumped on every change (atomic)
+  struct bk_run *		bc_watchrun;	///< Run environment we are watching from
+  int				bc_watchfd;	///< inotify descriptor, or -1
+  int *				bc_watchwds;	///< inotify watch descriptors
+  u_int				bc_watchnwds;	///< Number of watch descriptors
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_t		bc_wrlock;	///< Serialize writers (readers are lock-free)
+#endif /* BK_USING_PTHREADS */
+};
+
+
+
+/**
+ * Header of a compiled configuration image.  All locations are byte
+ * offsets from the start of the image, so the image is position
+ * independent.
+ */
+struct bk_config_image
+{
+  u_int32_t			bci_magic;	///< BK_CONFIG_IMAGE_MAGIC
+  u_int32_t			bci_generation;	///< Generation this image was built for
+  u_int32_t			bci_len;	///< Total image length
+  u_int32_t			bci_nkeys;	///< Number of keys
+  u_int32_t			bci_nvalues;	///< Number of values
+  u_int32_t			bci_nbuckets;	///< Hash buckets (power of two)
+  u_int32_t			bci_buckets;	///< Bucket array (key index+1, 0 empty)
+  u_int32_t			bci_keys;	///< Key array
+  u_int32_t			bci_values;	///< Value array (string offsets)
+  u_int32_t			bci_strings;	///< String pool
+};
+
+
+
+/**
+ * A key in a compiled configuration image.
+ */
+struct bk_config_image_key
+{
+  u_int32_t			bcik_hash;	///< bk_strhash of key
+  u_int32_t			bcik_key;	///< Key string (string pool offset)
+  u_int32_t			bcik_value;	///< Index of first value
+  u_int32_t			bcik_nvalues;	///< Number of values (always >0)
+};
+
+
+
+/**
+ * A published (or retired) compiled configuration image.  Never modified
+ * once published, except for bcs_next, which is only touched by writers.
+ */
+struct bk_config_snapshot
+{
+  struct bk_config_snapshot *	bcs_next;	///< Next older retired snapshot
+  const struct bk_config_image *bcs_image;	///< Read-only mapped image
+  dict_h			bcs_kv;		///< Or: replaced parse tree which lookups used
+  const u_int32_t *		bcs_buckets;	///< Hash buckets
+  const struct bk_config_image_key *bcs_keys;	///< Keys
+  const u_int32_t *		bcs_values;	///< Values
+  const char *			bcs_strings;	///< String pool
 };
 
 
@@ -198,6 +283,22 @@ static struct bk_config_value *bcv_create(bk_s B, const char *value, u_int linen
 static void bcv_destroy(bk_s B, struct bk_config_value *bcv);
 static int config_manage(bk_s B, struct bk_config *bc, const char *key, const char *value, const char *ovalue, u_int lineno);
 static int check_for_double_include(bk_s B, struct bk_config *bc, struct bk_config_fileinfo *cur_bcf, struct bk_config_fileinfo *new_bcf);
+static void kv_nuke(bk_s B, dict_h kv);
+static struct bk_config_snapshot *bcs_create(bk_s B, struct bk_config *bc, u_int32_t generation);
+static void bcs_destroy(bk_s B, struct bk_config_snapshot *bcs);
+static const struct bk_config_image_key *bcs_search(bk_s B, const struct bk_config_snapshot *bcs, const char *key);
+static const char *bcs_getnext(bk_s B, const struct bk_config_snapshot *bcs, const char *key, const char *ovalue);
+static int config_compile(bk_s B, struct bk_config *bc, struct bk_config *src, struct bk_config_snapshot **bcsp);
+static void config_publish(bk_s B, struct bk_config *bc, struct bk_config_snapshot *bcs);
+static void config_retire(struct bk_config *bc, struct bk_config_snapshot *bcs);
+static int config_reclaim(bk_s B, struct bk_config *bc);
+static void config_reader_done(bk_s B, struct bk_config *bc);
+static void config_watch_signal(bk_s B, struct bk_run *run, int signum, void *opaque);
+#ifdef __linux__
+static void config_watch_handler(bk_s B, struct bk_run *run, int fd, u_int gottypes, void *opaque, const struct timeval *starttime);
+static int config_watch_files(bk_s B, struct bk_config *bc, struct bk_config_fileinfo *bcf);
+static void config_unwatch_files(bk_s B, struct bk_config *bc);
+#endif /* __linux__ */
 
 
 
@@ -270,7 +371,7 @@ static int bcv_ko_cmp(void *a, void *bck2);
  *	@param B BAKA thread/global state
  *	@param filename The file from which to read the data.
  *	@param bcup BAKA configure user preferences (see libbk.h for fields)
- *	@param flags reserved for future use
+ *	@param flags BK_CONFIG_INIT_NOSNAPSHOT to serve lookups from the parse tree
  *	@return <i>NULL</i> on call or allocation failure, other fatal error.
  *	@return <br><i>baka config structure</i> if successful.
  */
@@ -280,6 +381,7 @@ bk_config_init(bk_s B, const char *filename, struct bk_config_user_pref *bcup, b
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
   struct bk_config *bc=NULL;
   struct bk_config_fileinfo *bcf=NULL;
+  struct bk_config_snapshot *bcs;
   char *separators;
   char *commentchars;
   char *include_tag;
@@ -296,6 +398,11 @@ bk_config_init(bk_s B, const char *filename, struct bk_config_user_pref *bcup, b
     BK_RETURN(B, NULL);
   }
   bk_debug_printf_and(B, 128, "bc allocate: %p\n", bc);
+  bc->bc_flags = flags;
+  bc->bc_watchfd = -1;
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_init(&bc->bc_wrlock, NULL);
+#endif /* BK_USING_PTHREADS */
 
   /* Create kv clc */
   if (!(bc->bc_kv=config_kv_create(kv_oo_cmp, kv_ko_cmp, DICT_UNORDERED|bk_thread_safe_if_thread_ready, &kv_args)))
@@ -359,6 +466,11 @@ bk_config_init(bk_s B, const char *filename, struct bk_config_user_pref *bcup, b
     /* Non-fatal */
   }
 
+  // Without a snapshot, lookups simply use the parse tree
+  if (config_compile(B, bc, bc, &bcs) < 0)
+    bk_error_printf(B, BK_ERR_WARN, "Using configuration from %s without a snapshot\n", filename);
+  config_publish(B, bc, bcs);
+
   BK_RETURN(B,bc);
 
  error:
@@ -390,13 +502,15 @@ bk_config_destroy(bk_s B, struct bk_config *obc)
     BK_VRETURN(B);
   }
 
-  if (bc->bc_kv)
-  {
-    struct bk_config_key *bck;
+  if (bc->bc_watchrun)
+    bk_config_unwatch(B, bc);
 
-    DICT_NUKE_CONTENTS(bc->bc_kv, config_kv, bck, bk_error_printf(B, BK_ERR_ERR, "Could not delete minimum from list: %s",config_kv_error_reason(bc->bc_kv, NULL)), bk_debug_printf_and(B,128,"KV free: %p (%s)\n", bc->bc_kv, bck->bck_key); bck_destroy(B, bck) );
-    config_kv_destroy(bc->bc_kv);
-  }
+  if (bc->bc_snapshot)
+    bcs_destroy(B, bc->bc_snapshot);
+  config_reclaim(B, bc);
+
+  if (bc->bc_kv)
+    kv_nuke(B, bc->bc_kv);
 
   if (bc->bc_bcup.bcup_separators) free (bc->bc_bcup.bcup_separators);
   if (bc->bc_bcup.bcup_commentchars) free (bc->bc_bcup.bcup_commentchars);
@@ -413,6 +527,10 @@ bk_config_destroy(bk_s B, struct bk_config *obc)
     BK_GENERAL_CONFIG(B)=NULL;
   }
 
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_destroy(&bc->bc_wrlock);
+#endif /* BK_USING_PTHREADS */
+
   bk_debug_printf_and(B,128,"bc free: %p\n", bc);
   free(bc);
 
@@ -492,9 +610,10 @@ load_config_from_file(bk_s B, struct bk_config *bc, struct bk_config_fileinfo *b
   {
     char *start = line;
     char *rest, *endofkey;
+    size_t len = strlen(line);
 
     // Check to see if we didn't read the entire line (presumably due to line length limitations)
-    while (!memchr(line,'\n', linelen))
+    while (len > 0 && line[len-1] != '\n' && !feof(fp))
     {
       if (!(start = realloc(line, linelen + LINELEN)))
       {
@@ -505,10 +624,11 @@ load_config_from_file(bk_s B, struct bk_config *bc, struct bk_config_fileinfo *b
 
       // Readjust and read the next part of the line
       line = start;
-      start = line + strlen(line);
+      start = line + len;
       linelen += LINELEN;
-      if (fgets(start, LINELEN, fp) == NULL)
+      if (fgets(start, linelen - len, fp) == NULL)
 	break;
+      len += strlen(start);
     }
     start = line;
 
@@ -814,9 +934,14 @@ int bk_config_get(bk_s B, struct bk_config *ibc, const char **filename, struct b
 
 /**
  * Retrieve a value based on the key.  If @a ovalue is NULL, then get first
- * value, else get successor of @a ovalue.
+ * value, else get successor of @a ovalue.  @a ovalue is normally the
+ * pointer returned by the previous call, but a value from an older
+ * snapshot is located by string comparison, so iteration survives a
+ * concurrent reinit.  The value returned stays valid across the next
+ * change to the configuration, but not the one after; copy it if it
+ * must live longer.
  *
- * THREADS: MT-SAFE (as long as there is no reconfig or manual maintenance)
+ * THREADS: MT-SAFE (lock-free when a snapshot is published)
  *
  *	@param B BAKA thread/global state.
  *	@param ibc The baka config structure to use. If NULL, the structure
@@ -833,6 +958,8 @@ bk_config_getnext(bk_s B, struct bk_config *ibc, const char *key, const char *ov
   struct bk_config *bc;
   struct bk_config_key *bck;
   struct bk_config_value *bcv=NULL;
+  struct bk_config_snapshot *bcs;
+  const char *value;
 
   if (!key)
   {
@@ -848,6 +975,18 @@ bk_config_getnext(bk_s B, struct bk_config *ibc, const char *key, const char *ov
     BK_RETURN(B,NULL);
   }
 
+  // Announce ourselves before looking, so the snapshot cannot be unmapped under us
+  BK_ATOMIC_ADD(&bc->bc_readers, 1);
+  BK_ATOMIC_FENCE();
+
+  if ((bcs = BK_ATOMIC_LOAD(&bc->bc_snapshot)))
+  {
+    value = bcs_getnext(B, bcs, key, ovalue);
+    config_reader_done(B, bc);
+    BK_RETURN(B, (char *)value);
+  }
+  config_reader_done(B, bc);
+
   if (!(bck=config_kv_search(bc->bc_kv, (char *)key)))
   {
     // just too noisy and stupid for WARN level logging
@@ -890,8 +1029,10 @@ bk_config_getnext(bk_s B, struct bk_config *ibc, const char *key, const char *ov
 /**
  * Delete a key and all its values.
  *
- * THREADS: EVIL (will cause other config routines to be evil as well,
- *	since while the DS are safe, searched value used past config control)
+ * THREADS: MT-SAFE (when snapshots are in use; values of the deleted key
+ *	handed out earlier remain valid until bk_config_reclaim())
+ * THREADS: EVIL (with BK_CONFIG_INIT_NOSNAPSHOT, since while the DS are
+ *	safe, searched value used past config control)
  *
  *	@param B BAKA thread/global state.
  *	@param ibc The baka config structure to use. If NULL, the structure
@@ -905,6 +1046,7 @@ bk_config_delete_key(bk_s B, struct bk_config *ibc, const char *key)
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
   struct bk_config *bc;
   struct bk_config_key *bck;
+  struct bk_config_snapshot *bcs;
 
   if (!key)
   {
@@ -922,6 +1064,8 @@ bk_config_delete_key(bk_s B, struct bk_config *ibc, const char *key)
 
 
 
+  BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
+
   if (!(bck=config_kv_search(bc->bc_kv, (char *)key)))
   {
     bk_error_printf(B, BK_ERR_WARN, "Attempt do delete nonexistent key: %s\n", key);
@@ -932,16 +1076,338 @@ bk_config_delete_key(bk_s B, struct bk_config *ibc, const char *key)
   {
     bk_error_printf(B, BK_ERR_ERR, "Could not delete %s from key list: %s\n", key, config_kv_error_reason(bc->bc_kv,NULL));
   }
+
+  // Readers keep the current snapshot unless the new one can be built
+  if (config_compile(B, bc, bc, &bcs) < 0)
+  {
+    config_kv_insert(bc->bc_kv, bck);
+    goto error;
+  }
   bck_destroy(B, bck);
 
+  config_publish(B, bc, bcs);
+
+  BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+  BK_RETURN(B, 0);
+
+ error:
+  BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+  BK_RETURN(B, -1);
+}
+
+
+
+
+/**
+ * Reread the configuration files and atomically replace the current
+ * configuration with the result.  If the files cannot be (re)loaded the
+ * current configuration is left untouched.  Readers never block: they
+ * either see the old snapshot or the new one, and values obtained from
+ * the old one stay valid until bk_config_reclaim().
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param ibc The baka config structure to use. If NULL, the structure
+ *	is extracted from @a B.
+ *	@return <i>-1</i> on call failure, load failure (config unchanged).
+ *	@return <br><i>0</i> on success.
+ */
+int
+bk_config_reinit(bk_s B, struct bk_config *ibc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config *bc;
+  struct bk_config nbc;
+  dict_h okv;
+  struct bk_config_fileinfo *obcf;
+  struct bk_config_snapshot *bcs, *obcs;
+  int treeused;
+
+  SET_CONFIG(bc, B, ibc);
+
+  if (!bc || !bc->bc_bcf)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not locate config structure\n");
+    BK_RETURN(B, -1);
+  }
+
+  // Parse into a private shell so that a broken file cannot damage bc
+  memset(&nbc, 0, sizeof(nbc));
+  nbc.bc_bcup = bc->bc_bcup;
+
+  if (!(nbc.bc_kv = config_kv_create(kv_oo_cmp, kv_ko_cmp, DICT_UNORDERED|bk_thread_safe_if_thread_ready, &kv_args)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create config values clc\n");
+    goto error;
+  }
+
+  if (!(nbc.bc_bcf = bcf_create(B, bc->bc_bcf->bcf_filename, NULL)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create fileinfo entry for %s\n", bc->bc_bcf->bcf_filename);
+    goto error;
+  }
+
+  if (load_config_from_file(B, &nbc, nbc.bc_bcf) < 0)
+  {
+    bk_error_printf(B, BK_ERR_WARN, "Could not reload config from %s (keeping previous)\n", nbc.bc_bcf->bcf_filename);
+    goto error;
+  }
+
+  BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
+  if (config_compile(B, bc, &nbc, &bcs) < 0)
+  {
+    BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+    bk_error_printf(B, BK_ERR_WARN, "Could not compile reloaded config from %s (keeping previous)\n", nbc.bc_bcf->bcf_filename);
+    goto error;
+  }
+  okv = bc->bc_kv;
+  obcf = bc->bc_bcf;
+  treeused = !bc->bc_snapshot;
+  bc->bc_kv = nbc.bc_kv;
+  bc->bc_bcf = nbc.bc_bcf;
+  config_publish(B, bc, bcs);
+
+  // Values were handed out of the old parse tree, so it is kept like a snapshot
+  if (treeused && BK_CALLOC(obcs))
+  {
+    obcs->bcs_kv = okv;
+    okv = NULL;
+    config_retire(bc, obcs);
+  }
+#ifdef __linux__
+  if (bc->bc_watchfd >= 0)
+  {
+    config_unwatch_files(B, bc);
+    config_watch_files(B, bc, bc->bc_bcf);
+  }
+#endif /* __linux__ */
+  BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+
+  if (okv)
+    kv_nuke(B, okv);
+  bcf_destroy(B, obcf);
+
+  bk_debug_printf_and(B, 1, "Reloaded %s (generation %u)\n", bc->bc_bcf->bcf_filename, bk_config_generation(B, bc));
+  BK_RETURN(B, 0);
+
+ error:
+  if (nbc.bc_kv) kv_nuke(B, nbc.bc_kv);
+  if (nbc.bc_bcf) bcf_destroy(B, nbc.bc_bcf);
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Return the configuration generation, which changes every time the
+ * configuration does (reinit, key deletion).  Cheap enough to poll from
+ * code which caches values derived from the configuration.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param ibc The baka config structure to use. If NULL, the structure
+ *	is extracted from @a B.
+ *	@return <i>0</i> on call failure.
+ *	@return <br><i>generation</i> on success.
+ */
+u_int32_t
+bk_config_generation(bk_s B, struct bk_config *ibc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config *bc;
+
+  SET_CONFIG(bc, B, ibc);
+
+  if (!bc)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not locate config structure\n");
+    BK_RETURN(B, 0);
+  }
+
+  BK_RETURN(B, BK_ATOMIC_LOAD(&bc->bc_generation));
+}
+
+
+
+/**
+ * Unmap every snapshot (or parse tree) which has been replaced by reinit
+ * or key deletion.  Replaced snapshots are kept until this is called, so
+ * that value pointers handed out before a change stay valid; programs
+ * which reinit often should call this whenever they know no thread is
+ * still using a value pointer obtained before the most recent change.
+ * Nothing is released while a reader may be inside a snapshot.
+ *
+ * THREADS: EVIL (see above)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param ibc The baka config structure to use. If NULL, the structure
+ *	is extracted from @a B.
+ *	@param flags Fun for the future.
+ *	@return <i>-1</i> on call failure.
+ *	@return <br><i>number of snapshots released</i> on success.
+ */
+int
+bk_config_reclaim(bk_s B, struct bk_config *ibc, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config *bc;
+  int cnt;
+
+  SET_CONFIG(bc, B, ibc);
+
+  if (!bc)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not locate config structure\n");
+    BK_RETURN(B, -1);
+  }
+
+  BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
+  cnt = config_reclaim(B, bc);
+  BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+
+  BK_RETURN(B, cnt);
+}
+
+
+
+/**
+ * Arrange for the configuration to be reinitialized automatically from
+ * within @a run: on SIGHUP (BK_CONFIG_WATCH_SIGHUP) and/or whenever one
+ * of the files making up the configuration changes (BK_CONFIG_WATCH_FILES,
+ * linux only).  Call bk_config_unwatch() before destroying @a run.
+ *
+ * THREADS: MT-SAFE (different bc)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param ibc The baka config structure to use. If NULL, the structure
+ *	is extracted from @a B.
+ *	@param run The run environment which will deliver the triggers.
+ *	@param flags BK_CONFIG_WATCH_SIGHUP, BK_CONFIG_WATCH_FILES
+ *	@return <i>-1</i> on call failure, setup failure.
+ *	@return <br><i>0</i> on success.
+ */
+int
+bk_config_watch(bk_s B, struct bk_config *ibc, struct bk_run *run, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config *bc;
+
+  SET_CONFIG(bc, B, ibc);
+
+  if (!bc || !run || (bc->bc_watchrun && bc->bc_watchrun != run))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  bc->bc_watchrun = run;
+
+  if (BK_FLAG_ISSET(flags, BK_CONFIG_WATCH_SIGHUP) && BK_FLAG_ISCLEAR(bc->bc_intflags, BC_INTFLAG_WATCH_SIGHUP))
+  {
+    if (bk_run_signal(B, run, SIGHUP, config_watch_signal, bc, BK_RUN_SIGNAL_RESTART) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not install SIGHUP handler\n");
+      goto error;
+    }
+    BK_FLAG_SET(bc->bc_intflags, BC_INTFLAG_WATCH_SIGHUP);
+  }
+
+  if (BK_FLAG_ISSET(flags, BK_CONFIG_WATCH_FILES) && bc->bc_watchfd < 0)
+  {
+#ifdef __linux__
+    int fd;
+
+    if ((fd = inotify_init()) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not create inotify descriptor: %s\n", strerror(errno));
+      goto error;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    bk_fileutils_modify_fd_flags(B, fd, O_NONBLOCK, BkFileutilsModifyFdFlagsActionAdd);
+
+    BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
+    bc->bc_watchfd = fd;
+    config_watch_files(B, bc, bc->bc_bcf);
+    BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+
+    if (bk_run_handle(B, run, fd, config_watch_handler, bc, BK_RUN_WANTREAD, 0) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not register inotify descriptor with run\n");
+      BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
+      config_unwatch_files(B, bc);
+      bc->bc_watchfd = -1;
+      BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+      close(fd);
+      goto error;
+    }
+#else /* __linux__ */
+    bk_error_printf(B, BK_ERR_ERR, "File change notification is not supported on this platform\n");
+    goto error;
+#endif /* __linux__ */
+  }
+
   BK_RETURN(B, 0);
 
  error:
+  if (BK_FLAG_ISCLEAR(bc->bc_intflags, BC_INTFLAG_WATCH_SIGHUP) && bc->bc_watchfd < 0)
+    bc->bc_watchrun = NULL;
   BK_RETURN(B, -1);
 }
 
 
 
+/**
+ * Stop reinitializing the configuration on the triggers established by
+ * bk_config_watch().
+ *
+ * THREADS: MT-SAFE (different bc)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param ibc The baka config structure to use. If NULL, the structure
+ *	is extracted from @a B.
+ */
+void
+bk_config_unwatch(bk_s B, struct bk_config *ibc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config *bc;
+
+  SET_CONFIG(bc, B, ibc);
+
+  if (!bc || !bc->bc_watchrun)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  if (BK_FLAG_ISSET(bc->bc_intflags, BC_INTFLAG_WATCH_SIGHUP))
+  {
+    bk_run_signal(B, bc->bc_watchrun, SIGHUP, NULL, NULL, 0);
+    BK_FLAG_CLEAR(bc->bc_intflags, BC_INTFLAG_WATCH_SIGHUP);
+  }
+
+#ifdef __linux__
+  if (bc->bc_watchfd >= 0)
+  {
+    int fd = bc->bc_watchfd;
+
+    bk_run_close(B, bc->bc_watchrun, fd, BK_RUN_CLOSE_FLAG_NO_HANDLER);
+    BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
+    config_unwatch_files(B, bc);
+    bc->bc_watchfd = -1;
+    BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+    close(fd);
+  }
+#endif /* __linux__ */
+
+  bc->bc_watchrun = NULL;
+  BK_VRETURN(B);
+}
+
+
+
 /**
  * Create a fileinfo structure for filename.
  *
@@ -1238,6 +1704,8 @@ bk_config_print(bk_s B, struct bk_config *ibc, FILE *fp)
     BK_VRETURN(B);
   }
 
+  // Reinit may replace the parse tree while we walk it
+  BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
 
   for (bck=config_kv_minimum(bc->bc_kv);
        bck;
@@ -1255,6 +1723,8 @@ bk_config_print(bk_s B, struct bk_config *ibc, FILE *fp)
 	fprintf (fp, "%s=%s\n", bck->bck_key, bcv->bcv_value);
       }
   }
+
+  BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
   BK_VRETURN(B);
 }
 
@@ -1315,6 +1785,602 @@ check_for_double_include(bk_s B, struct bk_config *bc, struct bk_config_fileinfo
 
 
 
+
+/**
+ * Destroy a key-value CLC and all keys and values within it.
+ *
+ * THREADS: MT-SAFE (different kv)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param kv The kv CLC to destroy.
+ */
+static void
+kv_nuke(bk_s B, dict_h kv)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config_key *bck;
+
+  if (!kv)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  DICT_NUKE_CONTENTS(kv, config_kv, bck, bk_error_printf(B, BK_ERR_ERR, "Could not delete minimum from list: %s",config_kv_error_reason(kv, NULL)), bk_debug_printf_and(B,128,"KV free: %p (%s)\n", kv, bck->bck_key); bck_destroy(B, bck) );
+  config_kv_destroy(kv);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Compile the parse tree of a configuration into a flat read-only image:
+ * a header, an open-addressed hash table of key indices, the key array,
+ * the value array and a string pool, all in one shared anonymous mapping
+ * (which forked children therefore share with us).  Keys without values
+ * are omitted, which gives them the same "not found" semantics as the
+ * parse tree lookup.
+ *
+ * THREADS: MT-SAFE (bc writer lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bc The configuration to compile.
+ *	@param generation The generation to stamp into the image.
+ *	@return <i>NULL</i> on call failure, allocation failure, oversize image.
+ *	@return <br><i>snapshot</i> on success.
+ */
+static struct bk_config_snapshot *
+bcs_create(bk_s B, struct bk_config *bc, u_int32_t generation)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config_snapshot *bcs = NULL;
+  struct bk_config_image *bci;
+  struct bk_config_image_key *bcik;
+  struct bk_config_key *bck;
+  struct bk_config_value *bcv;
+  u_int32_t *buckets, *values;
+  char *base = MAP_FAILED;
+  char *strings;
+  size_t len, strbytes = 0;
+  u_int32_t nkeys = 0, nvalues = 0, nbuckets, mask, keyidx, valueidx, stroff, nv, bucket;
+
+  if (!bc)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  for (bck = config_kv_minimum(bc->bc_kv); bck; bck = config_kv_successor(bc->bc_kv, bck))
+  {
+    for (nv = 0, bcv = config_values_minimum(bck->bck_values); bcv; bcv = config_values_successor(bck->bck_values, bcv))
+    {
+      strbytes += strlen(bcv->bcv_value) + 1;
+      nv++;
+    }
+    if (!nv)
+      continue;
+    strbytes += strlen(bck->bck_key) + 1;
+    nvalues += nv;
+    nkeys++;
+  }
+
+  for (nbuckets = BK_CONFIG_IMAGE_MINBUCKETS; nbuckets < nkeys * 2; nbuckets <<= 1)
+    ;
+  mask = nbuckets - 1;
+
+  len = sizeof(*bci) + nbuckets * sizeof(*buckets) + nkeys * sizeof(*bcik) + nvalues * sizeof(*values) + strbytes;
+  if (len > UINT32_MAX)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Configuration too large to compile (%llu bytes)\n", (unsigned long long)len);
+    goto error;
+  }
+
+  if (!BK_CALLOC(bcs))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate snapshot: %s\n", strerror(errno));
+    goto error;
+  }
+
+  if ((base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not map %llu byte configuration image: %s\n", (unsigned long long)len, strerror(errno));
+    goto error;
+  }
+
+  // Anonymous mappings are zero filled, so all buckets start empty
+  bci = (struct bk_config_image *)base;
+  bci->bci_magic = BK_CONFIG_IMAGE_MAGIC;
+  bci->bci_generation = generation;
+  bci->bci_len = len;
+  bci->bci_nkeys = nkeys;
+  bci->bci_nvalues = nvalues;
+  bci->bci_nbuckets = nbuckets;
+  bci->bci_buckets = sizeof(*bci);
+  bci->bci_keys = bci->bci_buckets + nbuckets * sizeof(*buckets);
+  bci->bci_values = bci->bci_keys + nkeys * sizeof(*bcik);
+  bci->bci_strings = bci->bci_values + nvalues * sizeof(*values);
+
+  buckets = (u_int32_t *)(base + bci->bci_buckets);
+  bcik = (struct bk_config_image_key *)(base + bci->bci_keys);
+  values = (u_int32_t *)(base + bci->bci_values);
+  strings = base + bci->bci_strings;
+
+  keyidx = valueidx = stroff = 0;
+  for (bck = config_kv_minimum(bc->bc_kv); bck; bck = config_kv_successor(bc->bc_kv, bck))
+  {
+    if (!(bcv = config_values_minimum(bck->bck_values)))
+      continue;
+
+    bcik[keyidx].bcik_hash = bk_strhash(bck->bck_key, BK_HASH_V3);
+    bcik[keyidx].bcik_key = stroff;
+    bcik[keyidx].bcik_value = valueidx;
+    len = strlen(bck->bck_key) + 1;
+    memcpy(strings + stroff, bck->bck_key, len);
+    stroff += len;
+
+    for (; bcv; bcv = config_values_successor(bck->bck_values, bcv))
+    {
+      values[valueidx++] = stroff;
+      len = strlen(bcv->bcv_value) + 1;
+      memcpy(strings + stroff, bcv->bcv_value, len);
+      stroff += len;
+    }
+    bcik[keyidx].bcik_nvalues = valueidx - bcik[keyidx].bcik_value;
+
+    for (bucket = bcik[keyidx].bcik_hash & mask; buckets[bucket]; bucket = (bucket + 1) & mask)
+      ;
+    buckets[bucket] = ++keyidx;
+  }
+
+  if (mprotect(base, bci->bci_len, PROT_READ) < 0)
+  {
+    bk_error_printf(B, BK_ERR_WARN, "Could not write protect configuration image: %s\n", strerror(errno));
+    // Continue anyway, nobody writes to it
+  }
+
+  bcs->bcs_image = bci;
+  bcs->bcs_buckets = buckets;
+  bcs->bcs_keys = bcik;
+  bcs->bcs_values = values;
+  bcs->bcs_strings = strings;
+
+  BK_RETURN(B, bcs);
+
+ error:
+  if (base != MAP_FAILED)
+    munmap(base, len);
+  if (bcs)
+    free(bcs);
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Destroy a snapshot and unmap its image.
+ *
+ * THREADS: EVIL (nobody may still be reading it)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bcs The snapshot to destroy.
+ */
+static void
+bcs_destroy(bk_s B, struct bk_config_snapshot *bcs)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!bcs)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  if (bcs->bcs_image)
+    munmap((void *)bcs->bcs_image, bcs->bcs_image->bci_len);
+  if (bcs->bcs_kv)
+    kv_nuke(B, bcs->bcs_kv);
+  free(bcs);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Locate a key in a snapshot.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bcs The snapshot to search.
+ *	@param key The key to find.
+ *	@return <i>NULL</i> if the key is not present.
+ *	@return <br><i>image key</i> on success.
+ */
+static const struct bk_config_image_key *
+bcs_search(bk_s B, const struct bk_config_snapshot *bcs, const char *key)
+{
+  const struct bk_config_image_key *bcik;
+  u_int32_t hash = bk_strhash(key, BK_HASH_V3);
+  u_int32_t mask = bcs->bcs_image->bci_nbuckets - 1;
+  u_int32_t bucket, slot;
+
+  for (bucket = hash & mask; (slot = bcs->bcs_buckets[bucket]); bucket = (bucket + 1) & mask)
+  {
+    bcik = bcs->bcs_keys + slot - 1;
+    if (bcik->bcik_hash == hash && BK_STREQ(bcs->bcs_strings + bcik->bcik_key, key))
+      return(bcik);
+  }
+
+  return(NULL);
+}
+
+
+
+/**
+ * Find the first value of a key in a snapshot, or the value after
+ * @a ovalue (see bk_config_getnext()).
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bcs The snapshot to search.
+ *	@param key The key in question.
+ *	@param ovalue The previous value or NULL.
+ *	@return <i>value string</i> on success.
+ *	@return <br><i>NULL</i> on failure or no more values.
+ */
+static const char *
+bcs_getnext(bk_s B, const struct bk_config_snapshot *bcs, const char *key, const char *ovalue)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const struct bk_config_image_key *bcik;
+  const u_int32_t *value, *end;
+
+  if (!(bcik = bcs_search(B, bcs, key)))
+  {
+    bk_error_printf(B, BK_ERR_NOTICE, "Could not locate key: %s\n", key);
+    BK_RETURN(B, NULL);
+  }
+
+  value = bcs->bcs_values + bcik->bcik_value;
+  end = value + bcik->bcik_nvalues;
+
+  if (!ovalue)
+    BK_RETURN(B, bcs->bcs_strings + *value);
+
+  for (; value < end; value++)
+  {
+    if (bcs->bcs_strings + *value == ovalue)
+      break;
+  }
+
+  if (value == end)
+  {
+    // Not from this image (reinit happened under us); fall back to contents
+    for (value = bcs->bcs_values + bcik->bcik_value; value < end; value++)
+    {
+      if (BK_STREQ(bcs->bcs_strings + *value, ovalue))
+	break;
+    }
+  }
+
+  if (value == end)
+  {
+    bk_error_printf(B, BK_ERR_WARN, "Could not locate '%s' as a value of %s in order to get its successor\n", ovalue, key);
+    BK_RETURN(B, NULL);
+  }
+
+  if (++value == end)
+    BK_RETURN(B, NULL);
+
+  BK_RETURN(B, bcs->bcs_strings + *value);
+}
+
+
+
+/**
+ * Compile a snapshot of a parse tree, for publication in @a bc as its
+ * next generation.
+ *
+ * THREADS: MT-SAFE (bc writer lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bc The configuration the snapshot is for.
+ *	@param src The configuration holding the parse tree (usually @a bc).
+ *	@param bcsp Copy-out snapshot (NULL when snapshots are disabled).
+ *	@return <i>-1</i> on failure.
+ *	@return <br><i>0</i> on success.
+ */
+static int
+config_compile(bk_s B, struct bk_config *bc, struct bk_config *src, struct bk_config_snapshot **bcsp)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  *bcsp = NULL;
+
+  if (BK_FLAG_ISSET(bc->bc_flags, BK_CONFIG_INIT_NOSNAPSHOT))
+    BK_RETURN(B, 0);
+
+  if (!(*bcsp = bcs_create(B, src, bc->bc_generation + 1)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not compile configuration snapshot\n");
+    BK_RETURN(B, -1);
+  }
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Publish a snapshot made by config_compile(), retiring the previous one.
+ *
+ * THREADS: MT-SAFE (bc writer lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bc The configuration to publish.
+ *	@param bcs The new snapshot (NULL when snapshots are disabled).
+ */
+static void
+config_publish(bk_s B, struct bk_config *bc, struct bk_config_snapshot *bcs)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config_snapshot *obcs;
+
+  if ((obcs = BK_ATOMIC_XCHG(&bc->bc_snapshot, bcs)))
+    config_retire(bc, obcs);
+  BK_ATOMIC_STORE(&bc->bc_generation, bc->bc_generation + 1);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Keep a replaced snapshot until bk_config_reclaim().
+ *
+ * THREADS: MT-SAFE (bc writer lock held)
+ *
+ *	@param bc The configuration.
+ *	@param bcs The snapshot, no longer published.
+ */
+static void
+config_retire(struct bk_config *bc, struct bk_config_snapshot *bcs)
+{
+  bcs->bcs_next = bc->bc_retired;
+  bc->bc_retired = bcs;
+}
+
+
+
+/**
+ * Unmap all retired snapshots, if no reader is inside any snapshot.  A
+ * reader counts itself before loading
+ * the snapshot pointer, and every retired snapshot was unpublished before
+ * we look at the count, so a count of zero means nobody can reach them.
+ *
+ * THREADS: MT-SAFE (bc writer lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bc The configuration.
+ *	@return <i>number of snapshots released</i>
+ */
+static int
+config_reclaim(bk_s B, struct bk_config *bc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config_snapshot *bcs, *next;
+  int cnt = 0;
+
+  BK_ATOMIC_FENCE();
+  if (BK_ATOMIC_LOAD(&bc->bc_readers))
+    BK_RETURN(B, 0);
+
+  bcs = bc->bc_retired;
+  bc->bc_retired = NULL;
+
+  for (; bcs; bcs = next)
+  {
+    next = bcs->bcs_next;
+    bcs_destroy(B, bcs);
+    cnt++;
+  }
+
+  BK_RETURN(B, cnt);
+}
+
+
+
+/**
+ * A reader is finished with the snapshot, so bk_config_reclaim() may
+ * unmap retired snapshots again once nobody else is inside one.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bc The configuration.
+ */
+static void
+config_reader_done(bk_s B, struct bk_config *bc)
+{
+  BK_ATOMIC_FENCE();
+  BK_ATOMIC_ADD(&bc->bc_readers, -1);
+}
+
+
+
+/**
+ * bk_run signal handler: SIGHUP means reinit.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param run The run environment.
+ *	@param signum The signal.
+ *	@param opaque The configuration.
+ */
+static void
+config_watch_signal(bk_s B, struct bk_run *run, int signum, void *opaque)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config *bc = opaque;
+
+  bk_error_printf(B, BK_ERR_NOTICE, "Received signal %d, reloading configuration\n", signum);
+  bk_config_reinit(B, bc);
+
+  BK_VRETURN(B);
+}
+
+
+
+#ifdef __linux__
+/**
+ * bk_run handler for the inotify descriptor: drain events and reinit.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param run The run environment.
+ *	@param fd The inotify descriptor.
+ *	@param gottypes What happened.
+ *	@param opaque The configuration.
+ *	@param starttime Unused.
+ */
+static void
+config_watch_handler(bk_s B, struct bk_run *run, int fd, u_int gottypes, void *opaque, const struct timeval *starttime)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config *bc = opaque;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+
+  if (BK_FLAG_ISSET(gottypes, BK_RUN_DESTROY|BK_RUN_CLOSE))
+  {
+    // Run is going away underneath us
+    BK_SIMPLE_LOCK(B, &bc->bc_wrlock);
+    config_unwatch_files(B, bc);
+    bc->bc_watchfd = -1;
+    BK_SIMPLE_UNLOCK(B, &bc->bc_wrlock);
+    close(fd);
+    if (BK_FLAG_ISSET(gottypes, BK_RUN_DESTROY))
+    {
+      BK_FLAG_CLEAR(bc->bc_intflags, BC_INTFLAG_WATCH_SIGHUP);
+      bc->bc_watchrun = NULL;
+    }
+    BK_VRETURN(B);
+  }
+
+  if (BK_FLAG_ISCLEAR(gottypes, BK_RUN_READREADY))
+    BK_VRETURN(B);
+
+  // Editors generate bursts of events; collapse them into one reload
+  while (read(fd, buf, sizeof(buf)) > 0)
+    changed++;
+
+  if (changed)
+  {
+    bk_error_printf(B, BK_ERR_NOTICE, "Configuration file changed, reloading\n");
+    bk_config_reinit(B, bc);
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Add inotify watches for a file and everything it includes.  Watches are
+ * per inode, so they are rebuilt after every reinit to follow files
+ * replaced by rename.
+ *
+ * THREADS: MT-SAFE (bc writer lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bc The configuration.
+ *	@param bcf The file to watch.
+ *	@return <i>-1</i> on failure.
+ *	@return <br><i>0</i> on success.
+ */
+static int
+config_watch_files(bk_s B, struct bk_config *bc, struct bk_config_fileinfo *bcf)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_config_fileinfo *ibcf;
+  int *wds;
+  int wd;
+  int ret = 0;
+
+  if (!bc || !bcf)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if ((wd = inotify_add_watch(bc->bc_watchfd, bcf->bcf_filename, BK_CONFIG_WATCH_EVENTS)) < 0)
+  {
+    bk_error_printf(B, BK_ERR_WARN, "Could not watch %s: %s\n", bcf->bcf_filename, strerror(errno));
+    ret = -1;
+  }
+  else
+  {
+    if (!(wds = realloc(bc->bc_watchwds, (bc->bc_watchnwds + 1) * sizeof(*wds))))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not extend watch list: %s\n", strerror(errno));
+      inotify_rm_watch(bc->bc_watchfd, wd);
+      BK_RETURN(B, -1);
+    }
+    bc->bc_watchwds = wds;
+    bc->bc_watchwds[bc->bc_watchnwds++] = wd;
+  }
+
+  for (ibcf = dll_minimum(bcf->bcf_includes); ibcf; ibcf = dll_successor(bcf->bcf_includes, ibcf))
+  {
+    if (config_watch_files(B, bc, ibcf) < 0)
+      ret = -1;
+  }
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * Remove all inotify watches.
+ *
+ * THREADS: MT-SAFE (bc writer lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bc The configuration.
+ */
+static void
+config_unwatch_files(bk_s B, struct bk_config *bc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  u_int cnt;
+
+  if (!bc)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  // Watches on deleted files are already gone; ignore EINVAL
+  for (cnt = 0; cnt < bc->bc_watchnwds; cnt++)
+    inotify_rm_watch(bc->bc_watchfd, bc->bc_watchwds[cnt]);
+
+  if (bc->bc_watchwds)
+    free(bc->bc_watchwds);
+  bc->bc_watchwds = NULL;
+  bc->bc_watchnwds = 0;
+
+  BK_VRETURN(B);
+}
+#endif /* __linux__ */
+
+
+
 /*
  * CLC key-side comparison routines
  */
@@ -25,9 +25,60 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
  *
  * The table lookup technique was adapted from the algorithm described
  * by Avram Perez, Byte-wise CRC Calculations, IEEE Micro 3, 40 (1983).
+ *
+ * Longer buffers are processed 8 or 16 bytes per step using "slicing"
+ * tables derived from the byte table (table k gives the CRC of a byte
+ * followed by k zero bytes), so the result is identical.  On x86 the
+ * CPU is checked on first use: with PCLMULQDQ, buffers of 64 bytes or
+ * more are folded 64 bytes at a time by carry-less multiplication and
+ * reduced with a Barrett step (Gopal et al., "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009).
+ *
+ * bk_crc32c() computes CRC-32C (Castagnoli, as used by iSCSI, SCTP, and
+ * ext4) the same way, using the SSE4.2 crc32 instruction when present.
  */
 
 #include <libbk.h>
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define CRC_X86						///< Can select x86 instructions at run time
+#include <immintrin.h>
+#endif /* x86 */
+
+
+
+#define CRC32C_POLYNOMIAL	0x82f63b78		///< Castagnoli, reflected
+#define CRC_CLMUL_MIN		64			///< Smallest buffer worth folding
+#define CRC_READY		2			///< Tables built and methods chosen
+
+
+
+/**
+ * The tables for one polynomial
+ */
+struct crc_tables
+{
+  u_int32_t	ct_slice[16][256];			///< [0] is the byte table, [k] shifts k more bytes
+};
+
+static struct crc_tables crc32_tables, crc32c_tables;
+static u_int32_t (*crc32_best)(u_int32_t crc, const u_char *buf, size_t len);
+static u_int32_t (*crc32c_best)(u_int32_t crc, const u_char *buf, size_t len);
+static bk_flags crc_available;
+static int crc_state;
+
+
+
+static void crc_init(void);
+static void crc_gen_slices(struct crc_tables *ct);
+static u_int32_t crc_byte(const struct crc_tables *ct, u_int32_t crc, const u_char *buf, size_t len);
+static u_int32_t crc_slice8(const struct crc_tables *ct, u_int32_t crc, const u_char *buf, size_t len);
+static u_int32_t crc_slice16(const struct crc_tables *ct, u_int32_t crc, const u_char *buf, size_t len);
+static u_int32_t crc32_sw(u_int32_t crc, const u_char *buf, size_t len);
+static u_int32_t crc32c_sw(u_int32_t crc, const u_char *buf, size_t len);
+#ifdef CRC_X86
+static u_int32_t crc32_clmul(u_int32_t crc, const u_char *buf, size_t len);
+static u_int32_t crc32c_hw(u_int32_t crc, const u_char *buf, size_t len);
+#endif /* CRC_X86 */
 
 
 static u_int32_t crc_table[256] =
@@ -160,13 +211,384 @@ static void gen_crc_table(void)
  */
 u_int32_t bk_crc32(u_int32_t crc, void *buf, int len)
 {
-  u_int32_t c = crc;
-  int n;
+  if (len <= 0)
+    return crc;
+
+  if (BK_ATOMIC_LOAD(&crc_state) != CRC_READY)
+    crc_init();
+
+  return (*crc32_best)(crc, buf, len);
+}
+
+
+
+/**
+ * CRC-32C (Castagnoli) routine for iSCSI, SCTP, ext4, and others.  As
+ * with bk_crc32(), start with 0xffffffff and complement the final value.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param crc CRC-32C return from previous data (0xffffffffL initially)
+ *	@param buf Pointer to data
+ *	@param len Length of data in buf
+ *	@return 32-bit <i>crc</i> of data
+ */
+u_int32_t bk_crc32c(u_int32_t crc, const void *buf, size_t len)
+{
+  if (BK_ATOMIC_LOAD(&crc_state) != CRC_READY)
+    crc_init();
+
+  return (*crc32c_best)(crc, buf, len);
+}
+
+
+
+/**
+ * Find out which CRC methods this CPU can use.  BK_CRC_METHOD_BYTE,
+ * BK_CRC_METHOD_SLICE8, and BK_CRC_METHOD_SLICE16 are always available.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param flags BK_CRC_32C to ask about CRC-32C rather than CRC-32
+ *	@return <i>bitmask</i> of usable BK_CRC_METHOD_* values
+ */
+bk_flags bk_crc_methods(bk_flags flags)
+{
+  bk_flags ret = BK_CRC_METHOD_BYTE | BK_CRC_METHOD_SLICE8 | BK_CRC_METHOD_SLICE16;
+
+  if (BK_ATOMIC_LOAD(&crc_state) != CRC_READY)
+    crc_init();
+
+  if (BK_FLAG_ISSET(flags, BK_CRC_32C))
+    ret |= crc_available & BK_CRC_METHOD_HW;
+  else
+    ret |= crc_available & BK_CRC_METHOD_CLMUL;
+
+  return ret;
+}
+
+
+
+/**
+ * Compute a CRC-32 or CRC-32C with a particular method, for testing and
+ * benchmarking.  The result is the same as bk_crc32() or bk_crc32c().
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param crc CRC return from previous data (0xffffffffL initially)
+ *	@param buf Pointer to data
+ *	@param len Length of data in buf
+ *	@param flags One BK_CRC_METHOD_* value, plus BK_CRC_32C for CRC-32C
+ *	@return 32-bit <i>crc</i> of data; methods this CPU lacks fall back to software
+ */
+u_int32_t bk_crc_method(u_int32_t crc, const void *buf, size_t len, bk_flags flags)
+{
+  const struct crc_tables *ct;
+  int c32c = BK_FLAG_ISSET(flags, BK_CRC_32C);
+
+  if (BK_ATOMIC_LOAD(&crc_state) != CRC_READY)
+    crc_init();
+
+  ct = c32c ? &crc32c_tables : &crc32_tables;
+
+#ifdef CRC_X86
+  if (!c32c && BK_FLAG_ISSET(flags & crc_available, BK_CRC_METHOD_CLMUL))
+    return crc32_clmul(crc, buf, len);
+  if (c32c && BK_FLAG_ISSET(flags & crc_available, BK_CRC_METHOD_HW))
+    return crc32c_hw(crc, buf, len);
+#endif /* CRC_X86 */
+
+  if (BK_FLAG_ISSET(flags, BK_CRC_METHOD_BYTE))
+    return crc_byte(ct, crc, buf, len);
+  if (BK_FLAG_ISSET(flags, BK_CRC_METHOD_SLICE8))
+    return crc_slice8(ct, crc, buf, len);
+  return crc_slice16(ct, crc, buf, len);
+}
+
+
+
+/**
+ * Build the slicing tables and pick the fastest method for each
+ * polynomial.  Whoever gets here first does the work; anyone else waits
+ * for it to finish.
+ *
+ * THREADS: MT-SAFE
+ */
+static void crc_init(void)
+{
+  u_int32_t c;
+  int n, k;
+
+  if (!BK_ATOMIC_CAS(&crc_state, 0, 1))
+  {
+    while (BK_ATOMIC_LOAD(&crc_state) != CRC_READY)
+      sched_yield();
+    return;
+  }
+
+  memcpy(crc32_tables.ct_slice[0], crc_table, sizeof(crc_table));
+  for (n = 0; n < 256; n++)
+  {
+    c = n;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? CRC32C_POLYNOMIAL ^ (c >> 1) : c >> 1;
+    crc32c_tables.ct_slice[0][n] = c;
+  }
+  crc_gen_slices(&crc32_tables);
+  crc_gen_slices(&crc32c_tables);
+
+  crc32_best = crc32_sw;
+  crc32c_best = crc32c_sw;
+
+#ifdef CRC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+  {
+    crc_available |= BK_CRC_METHOD_CLMUL;
+    crc32_best = crc32_clmul;
+  }
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    crc_available |= BK_CRC_METHOD_HW;
+    crc32c_best = crc32c_hw;
+  }
+#endif /* CRC_X86 */
+
+  BK_ATOMIC_STORE(&crc_state, CRC_READY);
+}
+
+
+
+/**
+ * Derive the slicing tables from the byte table: entry k of n is the
+ * CRC of byte n followed by k zero bytes.
+ *
+ *	@param ct Tables, with ct_slice[0] filled in
+ */
+static void crc_gen_slices(struct crc_tables *ct)
+{
+  int n, k;
+
+  for (n = 0; n < 256; n++)
+    for (k = 1; k < 16; k++)
+      ct->ct_slice[k][n] = (ct->ct_slice[k-1][n] >> 8) ^ ct->ct_slice[0][ct->ct_slice[k-1][n] & 0xff];
+}
+
+
+
+/**
+ * The classic one table lookup per byte CRC.
+ *
+ *	@param ct Tables for polynomial
+ *	@param crc CRC so far
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>crc</i> including data
+ */
+static u_int32_t crc_byte(const struct crc_tables *ct, u_int32_t crc, const u_char *buf, size_t len)
+{
+  while (len--)
+    crc = ct->ct_slice[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+
+
+/**
+ * CRC eight bytes per step: the CRC is folded into the first four
+ * bytes, and each byte is then looked up in the table which accounts
+ * for the bytes which follow it.
+ *
+ *	@param ct Tables for polynomial
+ *	@param crc CRC so far
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>crc</i> including data
+ */
+static u_int32_t crc_slice8(const struct crc_tables *ct, u_int32_t crc, const u_char *buf, size_t len)
+{
+  const u_int32_t (*t)[256] = ct->ct_slice;
+
+  for (; len >= 8; len -= 8, buf += 8)
+  {
+    crc ^= buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((u_int32_t)buf[3] << 24);
+    crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+      t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]];
+  }
+
+  return crc_byte(ct, crc, buf, len);
+}
+
+
+
+/**
+ * CRC sixteen bytes per step; see crc_slice8().
+ *
+ *	@param ct Tables for polynomial
+ *	@param crc CRC so far
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>crc</i> including data
+ */
+static u_int32_t crc_slice16(const struct crc_tables *ct, u_int32_t crc, const u_char *buf, size_t len)
+{
+  const u_int32_t (*t)[256] = ct->ct_slice;
+
+  for (; len >= 16; len -= 16, buf += 16)
+  {
+    crc ^= buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((u_int32_t)buf[3] << 24);
+    crc = t[15][crc & 0xff] ^ t[14][(crc >> 8) & 0xff] ^ t[13][(crc >> 16) & 0xff] ^ t[12][crc >> 24] ^
+      t[11][buf[4]] ^ t[10][buf[5]] ^ t[9][buf[6]] ^ t[8][buf[7]] ^
+      t[7][buf[8]] ^ t[6][buf[9]] ^ t[5][buf[10]] ^ t[4][buf[11]] ^
+      t[3][buf[12]] ^ t[2][buf[13]] ^ t[1][buf[14]] ^ t[0][buf[15]];
+  }
+
+  return crc_slice8(ct, crc, buf, len);
+}
+
+
+
+/**
+ * Software CRC-32.
+ *
+ *	@param crc CRC so far
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>crc</i> including data
+ */
+static u_int32_t crc32_sw(u_int32_t crc, const u_char *buf, size_t len)
+{
+  return crc_slice16(&crc32_tables, crc, buf, len);
+}
+
+
+
+/**
+ * Software CRC-32C.
+ *
+ *	@param crc CRC so far
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>crc</i> including data
+ */
+static u_int32_t crc32c_sw(u_int32_t crc, const u_char *buf, size_t len)
+{
+  return crc_slice16(&crc32c_tables, crc, buf, len);
+}
+
+
+
+#ifdef CRC_X86
+/**
+ * CRC-32 by carry-less multiplication.  Four 128-bit accumulators are
+ * each folded forward over 64 bytes (x^(512+-32) mod P), combined into
+ * one, folded 16 bytes at a time, then reduced 128 -> 64 -> 32 bits,
+ * the last by Barrett reduction.  Whatever is left over after the last
+ * 16 byte block goes to the table code.
+ *
+ *	@param crc CRC so far
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>crc</i> including data
+ */
+__attribute__((target("pclmul,sse4.1")))
+static u_int32_t crc32_clmul(u_int32_t crc, const u_char *buf, size_t len)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  if (len < CRC_CLMUL_MIN)
+    return crc_slice16(&crc32_tables, crc, buf, len);
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf), _mm_cvtsi32_si128(crc));
+  x2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+  x3 = _mm_loadu_si128((const __m128i *)(buf + 32));
+  x4 = _mm_loadu_si128((const __m128i *)(buf + 48));
+  buf += 64;
+  len -= 64;
+
+  for (; len >= 64; len -= 64, buf += 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)buf));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 48)));
+  }
+
+  // Fold the four accumulators into one
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+  for (; len >= 16; len -= 16, buf += 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i *)buf)), x5);
+  }
+
+  // 128 -> 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), x2);
+
+  // Barrett reduction 64 -> 32 bits
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  crc = _mm_extract_epi32(_mm_xor_si128(x1, x2), 1);
+
+  return crc_slice16(&crc32_tables, crc, buf, len);
+}
+
+
+
+/**
+ * CRC-32C with the SSE4.2 crc32 instruction, a word at a time.
+ *
+ *	@param crc CRC so far
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>crc</i> including data
+ */
+__attribute__((target("sse4.2")))
+static u_int32_t crc32c_hw(u_int32_t crc, const u_char *buf, size_t len)
+{
+  u_int32_t v;
+#ifdef __x86_64__
+  u_int64_t c = crc, w;
+
+  for (; len >= 8; len -= 8, buf += 8)
+  {
+    memcpy(&w, buf, sizeof(w));
+    c = _mm_crc32_u64(c, w);
+  }
+  crc = c;
+#endif /* __x86_64__ */
 
-  for (n = 0; n < len; n++)
+  for (; len >= 4; len -= 4, buf += 4)
   {
-    c = crc_table[(c ^ ((unsigned char *)buf)[n]) & 0xff] ^ (c >> 8);
+    memcpy(&v, buf, sizeof(v));
+    crc = _mm_crc32_u32(crc, v);
   }
+  while (len--)
+    crc = _mm_crc32_u8(crc, *buf++);
 
-  return c;
+  return crc;
 }
+#endif /* CRC_X86 */
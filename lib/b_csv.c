@@ -0,0 +1,1158 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2002-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2002-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ * CSV (comma separated value) reading and writing.
+ *
+ * The reader is a push parser: data is fed to bk_csv_parse() in pieces
+ * of any size, as it arrives from an ioh or polling io, and each
+ * complete record is handed to a callback as an array of field spans.
+ * Fields point into the data fed in wherever possible; only a record
+ * split across two pieces, or a field whose text is changed by
+ * unquoting, is copied.
+ *
+ * Data is classified 64 bytes at a time into bitmasks of quotes,
+ * delimiters and newlines (with AVX2 where the CPU has it, a word at a
+ * time otherwise).  A prefix XOR of the quote mask marks the bytes which
+ * are inside quotes, so the delimiters and newlines which end fields and
+ * records are found without looking at the bytes one by one.  As in RFC
+ * 4180, a doubled quote inside quotes stands for one quote; a quote
+ * anywhere else simply starts or ends quoting.  Records may end in CRLF,
+ * and empty lines are skipped.
+ *
+ * The writer quotes fields which need it with bk_string_csv_quote() and
+ * collects records in a large buffer, which is written to an ioh,
+ * polling io or file descriptor as it fills.
+ */
+
+#include <libbk.h>
+#include "libbk_internal.h"
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define CSV_X86						///< Can select x86 instructions at run time
+#include <immintrin.h>
+#endif /* x86 */
+
+
+
+#define CSV_QUOTE		'"'		///< Quote character
+#define CSV_BLOCK		64		///< Bytes classified at once
+#define CSV_FIELDS_FIRST	16		///< Field slots to start with
+#define CSV_CARRY_FIRST		4096		///< Carry buffer to start with
+#define CSV_WRITER_BUFSIZE	65536		///< Default size of writer buffer
+#define CSV_LOWS		0x7f7f7f7f7f7f7f7fULL ///< Low seven bits of each byte
+#define CSV_HIGHS		0x8080808080808080ULL ///< High bit of each byte
+#define CSV_GATHER		0x0102040810204080ULL ///< Multiplier to gather the low bit of each byte into the top byte
+
+
+
+/**
+ * CSV reader state
+ */
+struct bk_csv
+{
+  bk_flags		csv_flags;		///< Everyone needs flags
+#define CSV_FLAG_AVX2		0x1		///< Classify with AVX2
+#define CSV_FLAG_FAILED		0x2		///< Callback failed: ignore input until the end
+  char			csv_delim;		///< Field delimiter
+  bk_csv_record_f	csv_callback;		///< Called with each record
+  void *		csv_opaque;		///< Data for callback
+  char *		csv_carry;		///< Start of a record not yet complete
+  size_t		csv_carrylen;		///< Bytes in csv_carry
+  size_t		csv_carrysize;		///< Allocated size of csv_carry
+  u_int64_t		csv_inquote;		///< All ones if the end of csv_carry is inside quotes
+  struct bk_strspan *	csv_fields;		///< Fields of record being parsed
+  u_char *		csv_quoted;		///< Whether each field has quotes in it
+  u_int			csv_nfields;		///< Fields in record so far
+  u_int			csv_fieldsize;		///< Allocated field slots
+  char *		csv_arena;		///< Text of unquoted fields
+  size_t		csv_arenasize;		///< Allocated arena size
+};
+
+
+
+/**
+ * CSV writer state
+ */
+struct bk_csv_writer
+{
+  bk_flags		csw_flags;		///< Everyone needs flags
+#define CSW_FLAG_FULL		0x1		///< Output reported full at the last flush
+  struct bk_ioh *	csw_ioh;		///< Output ioh, or
+  struct bk_polling_io *csw_bpi;		///< Output polling io, or
+  int			csw_fd;			///< Output file descriptor
+  char			csw_delim;		///< Field delimiter
+  char *		csw_buf;		///< Records not yet written
+  size_t		csw_len;		///< Bytes in csw_buf
+  size_t		csw_size;		///< Allocated size of csw_buf
+  size_t		csw_bufsize;		///< Size of buffer to collect before writing
+  u_char		csw_special[256];	///< Bytes which make a field need quoting
+};
+
+
+
+/**
+ * Classification of one block: bit n is for byte n.
+ */
+struct csv_masks
+{
+  u_int64_t		cm_quote;		///< Quotes
+  u_int64_t		cm_delim;		///< Delimiters
+  u_int64_t		cm_nl;			///< Newlines
+};
+
+
+
+static ssize_t csv_records(bk_s B, struct bk_csv *csv, const char *buf, size_t len, int final, u_int64_t *inquote);
+static int csv_record_end(struct bk_csv *csv, const char *buf, size_t len, size_t *end);
+static int csv_field(bk_s B, struct bk_csv *csv, const char *ptr, size_t len, int quoted);
+static int csv_fields_grow(bk_s B, struct bk_csv *csv);
+static int csv_deliver(bk_s B, struct bk_csv *csv);
+static size_t csv_unquote(const char *in, size_t len, char *out);
+static int csv_carry(bk_s B, struct bk_csv *csv, const char *data, size_t len);
+static void csv_reset(struct bk_csv *csv);
+static void csv_classify(const struct bk_csv *csv, const char *p, size_t n, struct csv_masks *cm);
+static void csv_classify_swar(const u_char *p, char delim, struct csv_masks *cm);
+#ifdef CSV_X86
+static void csv_classify_avx2(const u_char *p, char delim, struct csv_masks *cm);
+#endif /* CSV_X86 */
+static u_int64_t csv_inside(u_int64_t quotes, u_int64_t *inquote);
+static int csv_writer_reserve(bk_s B, struct bk_csv_writer *csw, size_t need);
+
+
+
+/**
+ * Create a CSV reader.  Feed it data with bk_csv_parse(), directly or
+ * through bk_csv_ioh_handler() or bk_csv_polling_read().
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state
+ *	@param delim Field delimiter (not a quote, CR or newline)
+ *	@param callback Function to call with each record
+ *	@param opaque Data for @a callback
+ *	@param flags BK_CSV_PORTABLE to classify without AVX2 even where the CPU has it
+ *	@return <i>NULL</i> on call failure, allocation failure
+ *	@return <br><i>CSV reader</i> on success
+ */
+struct bk_csv *bk_csv_create(bk_s B, int delim, bk_csv_record_f callback, void *opaque, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_csv *csv;
+
+  if (!callback || delim == CSV_QUOTE || delim == '\n' || delim == '\r')
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!BK_CALLOC(csv))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate CSV reader: %s\n", strerror(errno));
+    BK_RETURN(B, NULL);
+  }
+
+  csv->csv_delim = delim;
+  csv->csv_callback = callback;
+  csv->csv_opaque = opaque;
+
+#ifdef CSV_X86
+  if (BK_FLAG_ISCLEAR(flags, BK_CSV_PORTABLE) && __builtin_cpu_supports("avx2"))
+    BK_FLAG_SET(csv->csv_flags, CSV_FLAG_AVX2);
+#endif /* CSV_X86 */
+
+  BK_RETURN(B, csv);
+}
+
+
+
+/**
+ * Destroy a CSV reader.  Any incomplete record is discarded; parse with
+ * BK_CSV_FINAL first to get it.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ */
+void bk_csv_destroy(bk_s B, struct bk_csv *csv)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!csv)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_VRETURN(B);
+  }
+
+  if (csv->csv_carry)
+    free(csv->csv_carry);
+  if (csv->csv_fields)
+    free(csv->csv_fields);
+  if (csv->csv_quoted)
+    free(csv->csv_quoted);
+  if (csv->csv_arena)
+    free(csv->csv_arena);
+  free(csv);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Parse the next piece of CSV input, calling the reader's callback with
+ * each record it completes.  The fields passed to the callback point into
+ * @a data or into the reader, and are valid only until the callback
+ * returns.  If the callback returns a negative number, the rest of the
+ * input (up to BK_CSV_FINAL) is ignored and this returns -1.
+ *
+ * With BK_CSV_FINAL, the last record need not end in a newline, and
+ * after it the callback is called once more with no fields, to mark the
+ * end of the input.  The reader may then be used for new input.
+ *
+ * THREADS: MT-SAFE (as long as csv is thread private)
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ *	@param data Next piece of input
+ *	@param len Length of @a data
+ *	@param flags BK_CSV_FINAL if there is no more input
+ *	@return <i>-1</i> on call failure, allocation failure, callback failure
+ *	@return <br><i>0</i> on success
+ */
+int bk_csv_parse(bk_s B, struct bk_csv *csv, const void *data, size_t len, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int final = BK_FLAG_ISSET(flags, BK_CSV_FINAL);
+  const char *buf = data;
+  u_int64_t inquote;
+  size_t end;
+  ssize_t used;
+  int found;
+
+  if (!csv || (!data && len))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISSET(csv->csv_flags, CSV_FLAG_FAILED))
+    goto error;
+
+  // Complete the record carried over from the last piece first
+  if (csv->csv_carrylen)
+  {
+    found = csv_record_end(csv, buf, len, &end);
+    if (csv_carry(B, csv, buf, found ? end + 1 : len) < 0)
+      goto error;
+    buf += found ? end + 1 : len;
+    len -= found ? end + 1 : len;
+
+    if (!found && !final)
+      BK_RETURN(B, 0);
+
+    if (csv_records(B, csv, csv->csv_carry, csv->csv_carrylen, final, &inquote) < 0)
+      goto error;
+    csv->csv_carrylen = 0;
+  }
+
+  if ((used = csv_records(B, csv, buf, len, final, &inquote)) < 0)
+    goto error;
+
+  // Keep the start of a record which is not complete yet
+  if ((size_t)used < len)
+  {
+    if (csv_carry(B, csv, buf + used, len - used) < 0)
+      goto error;
+    csv->csv_inquote = inquote;
+  }
+
+  if (final)
+  {
+    csv_reset(csv);
+    if ((*csv->csv_callback)(B, csv->csv_opaque, NULL, 0) < 0)
+      BK_RETURN(B, -1);
+  }
+
+  BK_RETURN(B, 0);
+
+ error:
+  BK_FLAG_SET(csv->csv_flags, CSV_FLAG_FAILED);
+  if (final)
+    csv_reset(csv);
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * An ioh handler which parses what the ioh reads with a CSV reader.
+ * Give it to bk_ioh_init() with the reader as its opaque data.  At EOF
+ * or a read error the input is finished (see BK_CSV_FINAL).  It also
+ * frees data written through the same ioh, for instance by a
+ * bk_csv_writer, once the ioh is done with it.
+ *
+ * THREADS: MT-SAFE (as long as the reader is private to the ioh)
+ *
+ *	@param B BAKA thread/global state
+ *	@param data Zero terminated array of data read, or the buffer written
+ *	@param opaque CSV reader
+ *	@param ioh The ioh
+ *	@param status What happened
+ */
+void bk_csv_ioh_handler(bk_s B, bk_vptr *data, void *opaque, struct bk_ioh *ioh, bk_ioh_status_e status)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_csv *csv = opaque;
+
+  if (!csv)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_VRETURN(B);
+  }
+
+  switch (status)
+  {
+  case BkIohStatusIncompleteRead:
+  case BkIohStatusReadComplete:
+    for (; data && data->ptr; data++)
+    {
+      if (bk_csv_parse(B, csv, data->ptr, data->len, 0) < 0)
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not parse CSV input\n");
+	break;
+      }
+    }
+    break;
+
+  case BkIohStatusIohReadEOF:
+  case BkIohStatusIohReadError:
+    if (bk_csv_parse(B, csv, NULL, 0, BK_CSV_FINAL) < 0)
+      bk_error_printf(B, BK_ERR_ERR, "Could not parse CSV input\n");
+    break;
+
+  case BkIohStatusWriteComplete:
+  case BkIohStatusWriteAborted:
+  case BkIohStatusIohWriteError:
+    if (data)
+    {
+      free(data->ptr);
+      free(data);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Read once from a polling io and parse what is read with a CSV reader.
+ * At EOF the input is finished (see BK_CSV_FINAL).
+ *
+ * THREADS: MT-SAFE (as long as csv is thread private)
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ *	@param bpi Polling io to read
+ *	@param status Status of the read (copyout), BkIohStatusIohReadEOF at the end
+ *	@param timeout Maximum time to wait in milliseconds (0->forever, -1->no wait)
+ *	@param flags flags for bk_polling_io_read
+ *	@return <i>-1</i> on failure, including parse failure
+ *	@return <br><i>0</i> on success (data parsed)
+ *	@return <br><i>positive</i> on no progress (including EOF)
+ */
+int bk_csv_polling_read(bk_s B, struct bk_csv *csv, struct bk_polling_io *bpi, bk_ioh_status_e *status, time_t timeout, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  bk_vptr *data = NULL;
+  int ret;
+
+  if (!csv || !bpi || !status)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  ret = bk_polling_io_read(B, bpi, &data, status, timeout, flags);
+
+  if (data)
+  {
+    if (bk_csv_parse(B, csv, data->ptr, data->len, 0) < 0)
+      ret = -1;
+    bk_polling_io_data_destroy(B, data);
+  }
+  else if (ret > 0 && *status == BkIohStatusIohReadEOF)
+  {
+    if (bk_csv_parse(B, csv, NULL, 0, BK_CSV_FINAL) < 0)
+      ret = -1;
+  }
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * Create a CSV writer, which sends its output to exactly one of an ioh,
+ * a polling io, or a file descriptor.  Data handed to an ioh is freed by
+ * the ioh's handler when written, as with bk_ioh_print(); see
+ * bk_csv_ioh_handler().
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state
+ *	@param ioh Output ioh, or NULL
+ *	@param bpi Output polling io, or NULL
+ *	@param fd Output file descriptor, or -1
+ *	@param delim Field delimiter (not a quote, CR or newline)
+ *	@param bufsize Output to collect before writing (0 for the default)
+ *	@param flags Fun for the future
+ *	@return <i>NULL</i> on call failure, allocation failure
+ *	@return <br><i>CSV writer</i> on success
+ */
+struct bk_csv_writer *bk_csv_writer_create(bk_s B, struct bk_ioh *ioh, struct bk_polling_io *bpi, int fd, int delim, size_t bufsize, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_csv_writer *csw;
+
+  if ((ioh != NULL) + (bpi != NULL) + (fd >= 0) != 1 ||
+      delim == CSV_QUOTE || delim == '\n' || delim == '\r')
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!BK_CALLOC(csw))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate CSV writer: %s\n", strerror(errno));
+    BK_RETURN(B, NULL);
+  }
+
+  csw->csw_ioh = ioh;
+  csw->csw_bpi = bpi;
+  csw->csw_fd = fd;
+  csw->csw_delim = delim;
+  csw->csw_bufsize = bufsize ? bufsize : CSV_WRITER_BUFSIZE;
+  csw->csw_special[(u_char)delim] = 1;
+  csw->csw_special[CSV_QUOTE] = 1;
+  csw->csw_special['\n'] = 1;
+  csw->csw_special['\r'] = 1;
+
+  BK_RETURN(B, csw);
+}
+
+
+
+/**
+ * Write out anything collected and destroy a CSV writer.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state
+ *	@param csw CSV writer
+ */
+void bk_csv_writer_destroy(bk_s B, struct bk_csv_writer *csw)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!csw)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_VRETURN(B);
+  }
+
+  if (bk_csv_writer_flush(B, csw, 0) != 0)
+    bk_error_printf(B, BK_ERR_WARN, "CSV output lost\n");
+
+  if (csw->csw_buf)
+    free(csw->csw_buf);
+  free(csw);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Add a record to a CSV writer's buffer, writing out the buffer when it
+ * fills.  Fields with delimiters, quotes, CRs or newlines in them are
+ * quoted.  If the output ioh or polling io will not take more data, the
+ * record is still collected, but the caller should let the output drain.
+ *
+ * THREADS: MT-SAFE (as long as csw is thread private)
+ *
+ *	@param B BAKA thread/global state
+ *	@param csw CSV writer
+ *	@param fields Fields of the record
+ *	@param nfields Number of fields (at least one)
+ *	@param flags Fun for the future
+ *	@return <i>-1</i> on call failure, allocation failure, write failure
+ *	@return <br><i>0</i> on success
+ *	@return <br><i>1</i> if the output is full
+ */
+int bk_csv_write(bk_s B, struct bk_csv_writer *csw, const struct bk_strspan *fields, u_int nfields, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const char *ptr;
+  size_t len, i;
+  int full = 0, ret, n;
+  u_int f;
+
+  if (!csw || !fields || !nfields)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (f = 0; f < nfields; f++)
+  {
+    ptr = fields[f].bss_ptr ? fields[f].bss_ptr : "";
+    len = fields[f].bss_len;
+
+    // Room for every byte doubled, the quotes, a delimiter and the newline
+    if (csw->csw_size - csw->csw_len < len * 2 + 4)
+    {
+      if ((ret = csv_writer_reserve(B, csw, len * 2 + 4)) < 0)
+	BK_RETURN(B, -1);
+      full |= ret;
+    }
+
+    if (f)
+      csw->csw_buf[csw->csw_len++] = csw->csw_delim;
+
+    for (i = 0; i < len && !csw->csw_special[(u_char)ptr[i]]; i++)
+      ; // Void
+
+    // A lone empty field is quoted so that it does not read back as an empty line
+    if (i < len || (nfields == 1 && !len))
+    {
+      csw->csw_buf[csw->csw_len++] = CSV_QUOTE;
+      if (!memchr(ptr + i, CSV_QUOTE, len - i))
+      {
+	memcpy(csw->csw_buf + csw->csw_len, ptr, len);
+	csw->csw_len += len;
+      }
+      else if ((n = bk_string_csv_quote(B, ptr, len, csw->csw_buf + csw->csw_len, csw->csw_size - csw->csw_len, "\"", 0)) >= 0)
+	csw->csw_len += n;
+      else
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not quote CSV field\n");
+	BK_RETURN(B, -1);
+      }
+      csw->csw_buf[csw->csw_len++] = CSV_QUOTE;
+    }
+    else
+    {
+      memcpy(csw->csw_buf + csw->csw_len, ptr, len);
+      csw->csw_len += len;
+    }
+  }
+
+  csw->csw_buf[csw->csw_len++] = '\n';
+
+  if (csw->csw_len >= csw->csw_bufsize)
+  {
+    if ((ret = bk_csv_writer_flush(B, csw, 0)) < 0)
+      BK_RETURN(B, -1);
+    full |= ret;
+  }
+
+  BK_RETURN(B, full);
+}
+
+
+
+/**
+ * Write out whatever a CSV writer has collected.
+ *
+ * THREADS: MT-SAFE (as long as csw is thread private)
+ *
+ *	@param B BAKA thread/global state
+ *	@param csw CSV writer
+ *	@param flags Fun for the future
+ *	@return <i>-1</i> on call failure, allocation failure, write failure
+ *	@return <br><i>0</i> on success
+ *	@return <br><i>1</i> if the output is full (the data is kept)
+ */
+int bk_csv_writer_flush(bk_s B, struct bk_csv_writer *csw, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  bk_vptr *data;
+  size_t off;
+  ssize_t n;
+  int ret;
+
+  if (!csw)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (!csw->csw_len)
+    BK_RETURN(B, 0);
+
+  if (csw->csw_fd >= 0)
+  {
+    for (off = 0; off < csw->csw_len; off += n)
+    {
+      if ((n = write(csw->csw_fd, csw->csw_buf + off, csw->csw_len - off)) < 0)
+      {
+	if (errno == EINTR)
+	{
+	  n = 0;
+	  continue;
+	}
+	bk_error_printf(B, BK_ERR_ERR, "Could not write CSV output: %s\n", strerror(errno));
+	BK_RETURN(B, -1);
+      }
+    }
+    csw->csw_len = 0;
+    BK_RETURN(B, 0);
+  }
+
+  // The buffer itself is handed over, and a new one started
+  if (!BK_MALLOC(data))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate output vptr: %s\n", strerror(errno));
+    BK_RETURN(B, -1);
+  }
+  data->ptr = csw->csw_buf;
+  data->len = csw->csw_len;
+
+  if (csw->csw_ioh)
+    ret = bk_ioh_write(B, csw->csw_ioh, data, 0);
+  else
+    ret = bk_polling_io_write(B, csw->csw_bpi, data, 0, 0);
+
+  if (ret < 0)
+  {
+    // The handler was already called with WriteAborted and freed the buffer
+    csw->csw_buf = NULL;
+    csw->csw_len = 0;
+    csw->csw_size = 0;
+    bk_error_printf(B, BK_ERR_ERR, "Could not write CSV output\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (ret > 0)
+  {
+    free(data);					// Buffer still owned by csw
+    BK_FLAG_SET(csw->csw_flags, CSW_FLAG_FULL);
+    BK_RETURN(B, 1);
+  }
+
+  BK_FLAG_CLEAR(csw->csw_flags, CSW_FLAG_FULL);
+  csw->csw_buf = NULL;
+  csw->csw_len = 0;
+  csw->csw_size = 0;
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Find the fields and records in a buffer, and call back with each
+ * complete record.
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ *	@param buf Data, starting at the start of a record
+ *	@param len Length of data
+ *	@param final The data ends with the last record
+ *	@param inquote All ones if the end of the data is inside quotes (copyout)
+ *	@return <i>-1</i> on allocation or callback failure
+ *	@return <br><i>bytes</i> of complete records, the rest being the start of an incomplete one
+ */
+static ssize_t csv_records(bk_s B, struct bk_csv *csv, const char *buf, size_t len, int final, u_int64_t *inquote)
+{
+  struct csv_masks cm;
+  u_int64_t inq = 0, ends, done;
+  size_t base, off, fieldstart = 0, recstart = 0;
+  int fieldq = 0, bit;
+
+  csv->csv_nfields = 0;
+
+  for (base = 0; base < len; base += CSV_BLOCK)
+  {
+    csv_classify(csv, buf + base, MIN(CSV_BLOCK, len - base), &cm);
+    ends = (cm.cm_delim | cm.cm_nl) & ~csv_inside(cm.cm_quote, &inq);
+    done = 0;
+
+    for (; ends; ends &= ends - 1)
+    {
+      bit = __builtin_ctzll(ends);
+      off = base + bit;
+
+      // csv_field(), without the call
+      if (csv->csv_nfields == csv->csv_fieldsize && csv_fields_grow(B, csv) < 0)
+	return(-1);
+      csv->csv_fields[csv->csv_nfields].bss_ptr = buf + fieldstart;
+      csv->csv_fields[csv->csv_nfields].bss_len = off - fieldstart;
+      csv->csv_quoted[csv->csv_nfields++] = fieldq || (cm.cm_quote & ~done & ((1ULL << bit) - 1));
+
+      if ((cm.cm_nl >> bit) & 1)
+      {
+	if (csv_deliver(B, csv) < 0)
+	  return(-1);
+	recstart = off + 1;
+      }
+
+      fieldstart = off + 1;
+      fieldq = 0;
+      done = (1ULL << bit) | ((1ULL << bit) - 1);
+    }
+
+    fieldq |= (cm.cm_quote & ~done) != 0;
+  }
+
+  *inquote = inq;
+
+  if (!final)
+    return(recstart);
+
+  if (fieldstart < len || csv->csv_nfields)
+  {
+    if (csv_field(B, csv, buf + fieldstart, len - fieldstart, fieldq) < 0 || csv_deliver(B, csv) < 0)
+      return(-1);
+  }
+
+  return(len);
+}
+
+
+
+/**
+ * Find the newline which ends the record carried over from the last
+ * piece of input, and keep track of quoting if it is not found.
+ *
+ *	@param csv CSV reader
+ *	@param buf New data
+ *	@param len Length of data
+ *	@param end Offset of newline (copyout)
+ *	@return <i>1</i> if found
+ *	@return <br><i>0</i> if not
+ */
+static int csv_record_end(struct bk_csv *csv, const char *buf, size_t len, size_t *end)
+{
+  struct csv_masks cm;
+  u_int64_t nl;
+  size_t base;
+
+  for (base = 0; base < len; base += CSV_BLOCK)
+  {
+    csv_classify(csv, buf + base, MIN(CSV_BLOCK, len - base), &cm);
+    if ((nl = cm.cm_nl & ~csv_inside(cm.cm_quote, &csv->csv_inquote)))
+    {
+      *end = base + __builtin_ctzll(nl);
+      return(1);
+    }
+  }
+
+  return(0);
+}
+
+
+
+/**
+ * Add a field to the record being parsed.
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ *	@param ptr Field text, as in the input
+ *	@param len Length of field
+ *	@param quoted Field has quotes in it
+ *	@return <i>-1</i> on allocation failure
+ *	@return <br><i>0</i> on success
+ */
+static int csv_field(bk_s B, struct bk_csv *csv, const char *ptr, size_t len, int quoted)
+{
+  if (csv->csv_nfields == csv->csv_fieldsize && csv_fields_grow(B, csv) < 0)
+    return(-1);
+
+  csv->csv_fields[csv->csv_nfields].bss_ptr = ptr;
+  csv->csv_fields[csv->csv_nfields].bss_len = len;
+  csv->csv_quoted[csv->csv_nfields] = quoted;
+  csv->csv_nfields++;
+
+  return(0);
+}
+
+
+
+/**
+ * Make room for more fields in a record.
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ *	@return <i>-1</i> on allocation failure
+ *	@return <br><i>0</i> on success
+ */
+static int csv_fields_grow(bk_s B, struct bk_csv *csv)
+{
+  struct bk_strspan *fields;
+  u_int size = csv->csv_fieldsize ? csv->csv_fieldsize * 2 : CSV_FIELDS_FIRST;
+  u_char *q;
+
+  if (!(fields = realloc(csv->csv_fields, size * sizeof(*fields))))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not extend CSV field array: %s\n", strerror(errno));
+    return(-1);
+  }
+  csv->csv_fields = fields;
+
+  if (!(q = realloc(csv->csv_quoted, size * sizeof(*q))))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not extend CSV field array: %s\n", strerror(errno));
+    return(-1);
+  }
+  csv->csv_quoted = q;
+  csv->csv_fieldsize = size;
+
+  return(0);
+}
+
+
+
+/**
+ * Unquote the fields of a complete record and hand it to the callback.
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ *	@return <i>-1</i> on allocation or callback failure
+ *	@return <br><i>0</i> on success
+ */
+static int csv_deliver(bk_s B, struct bk_csv *csv)
+{
+  struct bk_strspan *field = &csv->csv_fields[csv->csv_nfields - 1];
+  size_t need = 0;
+  char *out;
+  u_int f;
+  int ret;
+
+  // Lose the CR of a CRLF
+  if (field->bss_len && field->bss_ptr[field->bss_len - 1] == '\r')
+    field->bss_len--;
+
+  if (csv->csv_nfields == 1 && !field->bss_len && !csv->csv_quoted[0])
+  {
+    csv->csv_nfields = 0;
+    return(0);					// Empty line
+  }
+
+  for (f = 0; f < csv->csv_nfields; f++)
+    if (csv->csv_quoted[f])
+      need += csv->csv_fields[f].bss_len;
+
+  if (need > csv->csv_arenasize)
+  {
+    if (csv->csv_arena)
+      free(csv->csv_arena);
+    csv->csv_arenasize = MAX(need, csv->csv_arenasize * 2);
+    if (!(csv->csv_arena = malloc(csv->csv_arenasize)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate CSV field arena: %s\n", strerror(errno));
+      csv->csv_arenasize = 0;
+      return(-1);
+    }
+  }
+
+  for (out = csv->csv_arena, f = 0; f < csv->csv_nfields; f++)
+  {
+    if (!csv->csv_quoted[f])
+      continue;
+
+    field = &csv->csv_fields[f];
+
+    // A simply quoted field is its inside
+    if (field->bss_len >= 2 && field->bss_ptr[0] == CSV_QUOTE && field->bss_ptr[field->bss_len - 1] == CSV_QUOTE &&
+	!memchr(field->bss_ptr + 1, CSV_QUOTE, field->bss_len - 2))
+    {
+      field->bss_ptr++;
+      field->bss_len -= 2;
+      continue;
+    }
+
+    field->bss_len = csv_unquote(field->bss_ptr, field->bss_len, out);
+    field->bss_ptr = out;
+    out += field->bss_len;
+  }
+
+  ret = (*csv->csv_callback)(B, csv->csv_opaque, csv->csv_fields, csv->csv_nfields);
+  csv->csv_nfields = 0;
+
+  return(ret < 0 ? -1 : 0);
+}
+
+
+
+/**
+ * Remove the quoting from a field.
+ *
+ *	@param in Field text, as in the input
+ *	@param len Length of field
+ *	@param out Output, at least @a len bytes
+ *	@return <i>length</i> of output
+ */
+static size_t csv_unquote(const char *in, size_t len, char *out)
+{
+  const char *end = in + len;
+  char *start = out;
+  int inquote = 0;
+
+  for (; in < end; in++)
+  {
+    if (*in != CSV_QUOTE)
+      *out++ = *in;
+    else if (inquote && in + 1 < end && in[1] == CSV_QUOTE)
+      *out++ = *in++;
+    else
+      inquote = !inquote;
+  }
+
+  return(out - start);
+}
+
+
+
+/**
+ * Add data to the incomplete record carried between pieces of input.
+ *
+ *	@param B BAKA thread/global state
+ *	@param csv CSV reader
+ *	@param data Data
+ *	@param len Length of data
+ *	@return <i>-1</i> on allocation failure
+ *	@return <br><i>0</i> on success
+ */
+static int csv_carry(bk_s B, struct bk_csv *csv, const char *data, size_t len)
+{
+  size_t size;
+  char *carry;
+
+  if (!len)
+    return(0);
+
+  if (csv->csv_carrysize - csv->csv_carrylen < len)
+  {
+    size = MAX(csv->csv_carrysize ? csv->csv_carrysize * 2 : CSV_CARRY_FIRST, csv->csv_carrylen + len);
+    if (!(carry = realloc(csv->csv_carry, size)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not extend CSV record buffer: %s\n", strerror(errno));
+      return(-1);
+    }
+    csv->csv_carry = carry;
+    csv->csv_carrysize = size;
+  }
+
+  memcpy(csv->csv_carry + csv->csv_carrylen, data, len);
+  csv->csv_carrylen += len;
+
+  return(0);
+}
+
+
+
+/**
+ * Get ready for new input.
+ *
+ *	@param csv CSV reader
+ */
+static void csv_reset(struct bk_csv *csv)
+{
+  csv->csv_carrylen = 0;
+  csv->csv_inquote = 0;
+  csv->csv_nfields = 0;
+  BK_FLAG_CLEAR(csv->csv_flags, CSV_FLAG_FAILED);
+}
+
+
+
+/**
+ * Classify a block of up to 64 bytes.
+ *
+ *	@param csv CSV reader
+ *	@param p Data
+ *	@param n Length of data (at most CSV_BLOCK)
+ *	@param cm Masks (copyout)
+ */
+static void csv_classify(const struct bk_csv *csv, const char *p, size_t n, struct csv_masks *cm)
+{
+  u_char tmp[CSV_BLOCK];
+  u_int64_t valid;
+
+  if (n < CSV_BLOCK)
+  {
+    memset(tmp, 0, sizeof(tmp));
+    memcpy(tmp, p, n);
+    p = (const char *)tmp;
+  }
+
+#ifdef CSV_X86
+  if (BK_FLAG_ISSET(csv->csv_flags, CSV_FLAG_AVX2))
+    csv_classify_avx2((const u_char *)p, csv->csv_delim, cm);
+  else
+#endif /* CSV_X86 */
+    csv_classify_swar((const u_char *)p, csv->csv_delim, cm);
+
+  if (n < CSV_BLOCK)
+  {
+    valid = (1ULL << n) - 1;
+    cm->cm_quote &= valid;
+    cm->cm_delim &= valid;
+    cm->cm_nl &= valid;
+  }
+}
+
+
+
+/**
+ * Classify 64 bytes a word at a time.  A byte of x ^ pattern is zero
+ * exactly where x matches; adding 0x7f to its low bits carries into the
+ * high bit of every nonzero byte, so the high bits left clear mark the
+ * matches, and a multiply gathers them into one byte.
+ *
+ *	@param p Data
+ *	@param delim Field delimiter
+ *	@param cm Masks (copyout)
+ */
+static void csv_classify_swar(const u_char *p, char delim, struct csv_masks *cm)
+{
+  const u_int64_t quote = CSV_QUOTE * (CSV_HIGHS >> 7), nl = '\n' * (CSV_HIGHS >> 7);
+  const u_int64_t dl = (u_char)delim * (CSV_HIGHS >> 7);
+  u_int64_t w, t;
+  int i;
+
+#define CSV_MATCH(w, pat) (t = (w) ^ (pat), (((~(((t & CSV_LOWS) + CSV_LOWS) | t) & CSV_HIGHS) >> 7) * CSV_GATHER) >> 56)
+
+  cm->cm_quote = cm->cm_delim = cm->cm_nl = 0;
+
+  for (i = 0; i < CSV_BLOCK / 8; i++)
+  {
+    memcpy(&w, p + i * 8, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif /* big endian */
+    cm->cm_quote |= CSV_MATCH(w, quote) << (i * 8);
+    cm->cm_delim |= CSV_MATCH(w, dl) << (i * 8);
+    cm->cm_nl |= CSV_MATCH(w, nl) << (i * 8);
+  }
+
+#undef CSV_MATCH
+}
+
+
+
+#ifdef CSV_X86
+/**
+ * Classify 64 bytes with AVX2.
+ *
+ *	@param p Data
+ *	@param delim Field delimiter
+ *	@param cm Masks (copyout)
+ */
+__attribute__((target("avx2")))
+static void csv_classify_avx2(const u_char *p, char delim, struct csv_masks *cm)
+{
+  const __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+  const __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+  const __m256i quote = _mm256_set1_epi8(CSV_QUOTE), dl = _mm256_set1_epi8(delim), nl = _mm256_set1_epi8('\n');
+
+#define CSV_MATCH(pat) ((u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, (pat))) | \
+			(u_int64_t)(u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, (pat))) << 32)
+
+  cm->cm_quote = CSV_MATCH(quote);
+  cm->cm_delim = CSV_MATCH(dl);
+  cm->cm_nl = CSV_MATCH(nl);
+
+#undef CSV_MATCH
+}
+#endif /* CSV_X86 */
+
+
+
+/**
+ * Find the bytes inside quotes in a block: the prefix XOR of the quote
+ * mask, flipped if the block started inside quotes.  Opening quotes
+ * count as inside and closing ones as outside, which does not matter,
+ * since only delimiters and newlines are tested.
+ *
+ *	@param quotes Quote mask
+ *	@param inquote All ones if the block starts inside quotes; updated for the next block
+ *	@return <i>mask</i> of bytes inside quotes
+ */
+static u_int64_t csv_inside(u_int64_t quotes, u_int64_t *inquote)
+{
+  quotes ^= quotes << 1;
+  quotes ^= quotes << 2;
+  quotes ^= quotes << 4;
+  quotes ^= quotes << 8;
+  quotes ^= quotes << 16;
+  quotes ^= quotes << 32;
+  quotes ^= *inquote;
+
+  *inquote = (u_int64_t)((int64_t)quotes >> 63);
+
+  return(quotes);
+}
+
+
+
+/**
+ * Make room in a CSV writer's buffer, writing it out if there is
+ * anything in it and growing it if that is not enough.  Once the output
+ * has reported full, the buffer is only grown (by doubling) until the
+ * next record is done; bk_csv_write() tries the output again then.
+ *
+ *	@param B BAKA thread/global state
+ *	@param csw CSV writer
+ *	@param need Bytes needed
+ *	@return <i>-1</i> on allocation or write failure
+ *	@return <br><i>0</i> on success
+ *	@return <br><i>1</i> on success, but the output is full
+ */
+static int csv_writer_reserve(bk_s B, struct bk_csv_writer *csw, size_t need)
+{
+  int ret = 0;
+  size_t size;
+  char *buf;
+
+  if (BK_FLAG_ISSET(csw->csw_flags, CSW_FLAG_FULL))
+    ret = 1;
+  else if (csw->csw_len && (ret = bk_csv_writer_flush(B, csw, 0)) < 0)
+    return(-1);
+
+  if (csw->csw_size - csw->csw_len < need)
+  {
+    size = MAX(MAX(csw->csw_bufsize, csw->csw_size * 2), csw->csw_len + need);
+    if (!(buf = realloc(csw->csw_buf, size)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not extend CSV output buffer: %s\n", strerror(errno));
+      return(-1);
+    }
+    csw->csw_buf = buf;
+    csw->csw_size = size;
+  }
+
+  return(ret);
+}
@@ -89,6 +89,17 @@ static struct ht_args debug_args = { 127, 2, (ht_func)debug_obj_hash, (ht_func)d
 
 
 static int bk_debug_setconfig_i(bk_s B, struct bk_debug *bdinfo, struct bk_config *config, const char *program);
+static void debug_generation_bump(void);
+
+
+
+/**
+ * Debug level generation.  Any change which may alter the answer of
+ * bk_debug_query bumps this, invalidating every bk_debug_cache and every
+ * function frame's saved debug level.  Zero is never a valid generation
+ * so that zero-initialized caches always miss.
+ */
+volatile u_int32_t BkDebugGeneration = 1;
 
 
 
@@ -185,6 +196,7 @@ void bk_debug_reinit(bk_s B, struct bk_debug *bd)
 
   DICT_NUKE_CONTENTS(bd->bd_leveldb, debug, cur, bk_error_printf(B, BK_ERR_ERR,"Could not delete item from front of CLC: %s\n",debug_error_reason(bd->bd_leveldb,NULL)), if (cur->bd_name) free(cur->bd_name); free(cur));
   bk_debug_setconfig_i(B, bd, BK_GENERAL_CONFIG(B), BK_GENERAL_PROGRAM(B));
+  debug_generation_bump();
 
 #ifdef BK_USING_PTHREADS
   if (BK_GENERAL_FLAG_ISTHREADON(B) && pthread_rwlock_unlock(&bd->bd_rwlock) != 0)
@@ -256,6 +268,49 @@ u_int32_t bk_debug_query(bk_s B, struct bk_debug *bdinfo, const char *funname, c
 
 
 
+/**
+ * Discover the debug level for the current function/package/group,
+ * consulting (and refilling) a per-call-site cache first.  While debug
+ * levels are unchanged this is a single load and compare.
+ *
+ * The generation is read before the lookup and stored with the result,
+ * so a change racing with the lookup leaves a stale generation behind and
+ * simply causes another lookup next time.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/global state
+ *	@param bdinfo Debug handle
+ *	@param cache Call site cache (NULL to behave like @a bk_debug_query)
+ *	@param funname Function name we should look for
+ *	@param pkgname Package name we should look for
+ *	@param grp Group name we should look for
+ *	@param flags Fun for the future
+ *	@return <i>debug level</i> found for this particular function/package/group or the default debug level
+ */
+u_int32_t bk_debug_query_cached(bk_s B, struct bk_debug *bdinfo, struct bk_debug_cache *cache, const char *funname, const char *pkgname, const char *grp, bk_flags flags)
+{
+  u_int32_t generation = BK_ATOMIC_LOAD(&BkDebugGeneration);
+  u_int64_t state;
+  u_int32_t ret;
+
+  if (cache)
+  {
+    state = BK_ATOMIC_LOAD(&cache->bdc_state);
+    if ((u_int32_t)(state >> 32) == generation)
+      return((u_int32_t)state);
+  }
+
+  ret = bk_debug_query(B, bdinfo, funname, pkgname, grp, flags);
+
+  if (cache)
+    BK_ATOMIC_STORE(&cache->bdc_state, ((u_int64_t)generation << 32) | ret);
+
+  return(ret);
+}
+
+
+
 /**
  * Set an individual debug level
  *
@@ -329,6 +384,8 @@ int bk_debug_set(bk_s B, struct bk_debug *bdinfo, const char *name, u_int32_t le
     bdinfo->bd_defaultlevel = level;
 
  done:
+  debug_generation_bump();
+
 #ifdef BK_USING_PTHREADS
   if (BK_GENERAL_FLAG_ISTHREADON(B) && pthread_rwlock_unlock(&bdinfo->bd_rwlock) != 0)
     abort();
@@ -382,6 +439,7 @@ int bk_debug_setconfig(bk_s B, struct bk_debug *bdinfo, struct bk_config *config
 #endif /* BK_USING_PTHREADS */
 
   ret = bk_debug_setconfig_i(B, bdinfo, config, program);
+  debug_generation_bump();
 
 #ifdef BK_USING_PTHREADS
   if (BK_GENERAL_FLAG_ISTHREADON(B) && pthread_rwlock_unlock(&bdinfo->bd_rwlock) != 0)
@@ -507,6 +565,7 @@ void bk_debug_config(bk_s B, struct bk_debug *bdinfo, FILE *fh, int sysloglevel,
   bdinfo->bd_fh = fh;
   bdinfo->bd_sysloglevel = sysloglevel;
   bdinfo->bd_flags = flags;
+  debug_generation_bump();
 
 #ifdef BK_USING_PTHREADS
   if (BK_GENERAL_FLAG_ISTHREADON(B) && pthread_rwlock_unlock(&bdinfo->bd_rwlock) != 0)
@@ -698,6 +757,19 @@ bk_debug_istream(struct bk_debug *bdinfo)
 
 
 
+/**
+ * Invalidate all cached debug levels.
+ *
+ * THREADS: MT-SAFE
+ */
+static void debug_generation_bump(void)
+{
+  while (BK_ATOMIC_ADD(&BkDebugGeneration, 1) == 0)
+    ; // Zero is reserved for "never computed"
+}
+
+
+
 /** CLC helper functions and structures for debug_clc */
 static int debug_oo_cmp(struct bk_debugnode *a, struct bk_debugnode *b)
 {
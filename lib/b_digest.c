@@ -0,0 +1,1478 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2002-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2002-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ * Message digest engine: one interface to MD5, SHA-256, and BLAKE3.
+ *
+ * Each algorithm uses what the CPU offers, chosen at run time: SHA-256
+ * uses the SHA extensions, BLAKE3 hashes four or eight of its 1KB chunks
+ * at once in vector lanes, and bk_digest_multi() digests four or eight
+ * separate MD5 messages at once the same way.  The lanes are written
+ * with GCC vector extensions, so the four lane code works on any CPU
+ * and the eight lane code is the same source built for AVX2.
+ */
+
+#include <libbk.h>
+#include "libbk_internal.h"
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define DIGEST_X86					///< Can select x86 instructions at run time
+#include <immintrin.h>
+#endif /* x86 */
+
+
+
+#define MD5_LEN			16		///< Bytes in an MD5 digest
+#define SHA256_LEN		32		///< Bytes in a SHA-256 digest
+#define BLAKE3_LEN		32		///< Bytes in a (default length) BLAKE3 digest
+#define DIGEST_BLOCK		64		///< Block size of all the algorithms
+#define MAXLANES		8		///< Most messages or chunks digested at once
+#define BLAKE3_CHUNK		1024		///< Bytes in a BLAKE3 chunk (leaf of the tree)
+#define BLAKE3_MAXDEPTH		54		///< Chaining values held for 2^64 bytes of chunks
+#define BLAKE3_CHUNK_START	0x01		///< First block of a chunk
+#define BLAKE3_CHUNK_END	0x02		///< Last block of a chunk
+#define BLAKE3_PARENT		0x04		///< Parent (non-leaf) node
+#define BLAKE3_ROOT		0x08		///< Root node, whose output is the digest
+
+typedef u_int32_t digest_v4 __attribute__((vector_size(16)));	///< Four 32-bit lanes, any CPU
+#ifdef DIGEST_X86
+typedef u_int32_t digest_v8 __attribute__((vector_size(32)));	///< Eight 32-bit lanes, for AVX2
+#endif /* DIGEST_X86 */
+
+
+
+/**
+ * SHA-256 state
+ */
+struct sha256_state
+{
+  u_int32_t		ss_h[8];		///< Hash so far
+  u_int64_t		ss_count;		///< Bytes digested so far
+  u_char		ss_buf[DIGEST_BLOCK];	///< Partial block (ss_count % 64 bytes)
+};
+
+
+
+/**
+ * BLAKE3 state
+ */
+struct blake3_state
+{
+  u_int32_t		bs_cv[8];		///< Chaining value of current chunk
+  u_int64_t		bs_chunk;		///< Number of current chunk
+  u_int			bs_blocks;		///< Blocks of current chunk compressed
+  u_int			bs_buflen;		///< Bytes in bs_buf
+  u_char		bs_buf[DIGEST_BLOCK];	///< Block not yet compressed (may be the chunk's last)
+  u_int			bs_depth;		///< Entries in bs_stack
+  u_int32_t		bs_stack[BLAKE3_MAXDEPTH][8]; ///< Chaining values of complete subtrees
+};
+
+
+
+/**
+ * Message digest in progress
+ */
+struct bk_digest
+{
+  int			bd_alg;			///< BK_DIGEST_*
+  bk_flags		bd_flags;		///< BK_DIGEST_PORTABLE
+  union
+  {
+    bk_MD5_CTX		bdu_md5;		///< MD5 state
+    struct sha256_state	bdu_sha256;		///< SHA-256 state
+    struct blake3_state	bdu_blake3;		///< BLAKE3 state
+  }			bd_u;			///< Algorithm state
+};
+
+
+
+/**
+ * State of a digesting ioh filter
+ */
+struct digest_filter
+{
+  struct bk_digest     *df_read;		///< Digest of data read (if any)
+  struct bk_digest     *df_write;		///< Digest of data written (if any)
+  bk_iorfunc_f		df_readfun;		///< Underlying read function
+  bk_iowfunc_f		df_writefun;		///< Underlying write function
+  bk_iocfunc_f		df_closefun;		///< Underlying close function
+  void		       *df_opaque;		///< Underlying read/write/close opaque
+};
+
+
+
+/**
+ * One message being digested in a multi-buffer MD5 lane
+ */
+struct md5_lane
+{
+  int			ml_job;			///< Index of message (-1 for none)
+  const u_char	       *ml_ptr;			///< Next block of message (or of ml_tail)
+  size_t		ml_blocks;		///< Whole blocks of message left
+  u_int			ml_tailblocks;		///< Padded blocks left in ml_tail
+  u_char		ml_tail[2*DIGEST_BLOCK]; ///< End of message with padding and length
+};
+
+
+
+static const u_int32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+static const u_int32_t md5_k[64] =
+{
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const u_char md5_shift[4][4] = { { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 } };
+
+static const u_int32_t sha256_iv[8] =
+{
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const u_int32_t sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// BLAKE3 starts from the SHA-256 initial hash
+#define blake3_iv sha256_iv
+
+/// Message word used at each position in each BLAKE3 round
+static const u_char blake3_sched[7][16] =
+{
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+  {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+  { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+  { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+  {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+  { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+static const u_char digest_zero[DIGEST_BLOCK];	///< Input for idle lanes
+
+
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * The macros below work on plain words and on vectors of them alike.
+ */
+
+/// One MD5 step, rotating the roles of a, b, c, d as it goes
+#define MD5_STEP(f, a, b, c, d, x, s, k)			\
+  do {								\
+    f = f + a + (k) + (x);					\
+    a = d;							\
+    d = c;							\
+    c = b;							\
+    b = b + ROTL32(f, s);					\
+  } while (0)
+
+/// The BLAKE3 G function (quarter round)
+#define BLAKE3_G(a, b, c, d, x, y)				\
+  do {								\
+    a = a + b + (x);						\
+    d = ROTR32(d ^ a, 16);					\
+    c = c + d;							\
+    b = ROTR32(b ^ c, 12);					\
+    a = a + b + (y);						\
+    d = ROTR32(d ^ a, 8);					\
+    c = c + d;							\
+    b = ROTR32(b ^ c, 7);					\
+  } while (0)
+
+/// A BLAKE3 round: columns, then diagonals
+#define BLAKE3_ROUND(v, m, s)							\
+  do {										\
+    BLAKE3_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);			\
+    BLAKE3_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);			\
+    BLAKE3_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);			\
+    BLAKE3_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);			\
+    BLAKE3_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);			\
+    BLAKE3_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);			\
+    BLAKE3_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);			\
+    BLAKE3_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);			\
+  } while (0)
+
+
+
+static int digest_length(int alg);
+static void digest_reset(struct bk_digest *bd);
+static u_int32_t load_le32(const u_char *p);
+static void store_le32(u_char *p, u_int32_t v);
+static void md5_multi(const bk_vptr *bufs, u_int count, u_char *digests, u_int lanes, void (*blocks)(u_int32_t st[4][MAXLANES], const u_char **blk));
+static void md5_x4(u_int32_t st[4][MAXLANES], const u_char **blk);
+static void sha256_update(struct sha256_state *ss, const u_char *p, size_t len, bk_flags flags);
+static void sha256_final(struct sha256_state *ss, u_char *digest, bk_flags flags);
+static void sha256_blocks(u_int32_t h[8], const u_char *p, size_t n, bk_flags flags);
+static void sha256_blocks_scalar(u_int32_t h[8], const u_char *p, size_t n);
+static void blake3_update(struct blake3_state *bs, const u_char *p, size_t len, bk_flags flags);
+static void blake3_final(struct blake3_state *bs, u_char *digest);
+static void blake3_compress(const u_int32_t cv[8], const u_int32_t m[16], u_int64_t counter, u_int32_t len, u_int32_t flags, u_int32_t out[16]);
+static void blake3_compress_block(u_int32_t cv[8], const u_char *block, u_int64_t counter, u_int32_t len, u_int32_t flags);
+static void blake3_chunks(struct blake3_state *bs, const u_char *p, size_t n, bk_flags flags);
+static void blake3_push(struct blake3_state *bs, u_int32_t cv[8]);
+static void blake3_hash4(const u_char *p, u_int64_t counter, u_int32_t cvs[MAXLANES][8]);
+#ifdef DIGEST_X86
+static void md5_x8(u_int32_t st[4][MAXLANES], const u_char **blk);
+static void sha256_blocks_shani(u_int32_t h[8], const u_char *p, size_t n);
+static void blake3_hash8(const u_char *p, u_int64_t counter, u_int32_t cvs[MAXLANES][8]);
+#endif /* DIGEST_X86 */
+static int digest_filter_read(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, caddr_t buf, __SIZE_TYPE__ size, bk_flags flags);
+static int digest_filter_write(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, struct iovec *iov, __SIZE_TYPE__ size, bk_flags flags);
+static void digest_filter_close(bk_s B, struct bk_ioh *ioh, void *opaque, int fdin, int fdout, bk_flags flags);
+
+
+
+/**
+ * Create a message digest context.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param alg BK_DIGEST_MD5, BK_DIGEST_SHA256, or BK_DIGEST_BLAKE3
+ *	@param flags BK_DIGEST_PORTABLE to use only portable C code
+ *	@return <i>NULL</i> on failure
+ *	@return <br><i>context</i> on success
+ */
+struct bk_digest *bk_digest_create(bk_s B, int alg, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_digest *bd;
+
+  if (digest_length(alg) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Unknown digest algorithm %d\n", alg);
+    BK_RETURN(B, NULL);
+  }
+
+  if (!BK_MALLOC(bd))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate digest: %s\n", strerror(errno));
+    BK_RETURN(B, NULL);
+  }
+
+  bd->bd_alg = alg;
+  bd->bd_flags = flags;
+  digest_reset(bd);
+
+  BK_RETURN(B, bd);
+}
+
+
+
+/**
+ * Destroy a message digest context.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param bd Digest context
+ */
+void bk_digest_destroy(bk_s B, struct bk_digest *bd)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!bd)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid argument\n");
+    BK_VRETURN(B);
+  }
+
+  free(bd);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Length of the digest an algorithm produces.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param alg Digest algorithm
+ *	@return <i>-1</i> for an unknown algorithm
+ *	@return <br><i>bytes</i> of digest otherwise
+ */
+int bk_digest_length(bk_s B, int alg)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int len;
+
+  if ((len = digest_length(alg)) < 0)
+    bk_error_printf(B, BK_ERR_ERR, "Unknown digest algorithm %d\n", alg);
+
+  BK_RETURN(B, len);
+}
+
+
+
+/**
+ * Add data to a message digest.
+ *
+ * THREADS: MT-SAFE (assuming different bd)
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param bd Digest context
+ *	@param data Data to digest
+ *	@param len Length of data
+ *	@return <i>-1</i> on call failure
+ *	@return <br><i>0</i> on success
+ */
+int bk_digest_update(bk_s B, struct bk_digest *bd, const void *data, size_t len)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const u_char *p = data;
+  u_int n;
+
+  if (!bd || (len && !data))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  switch (bd->bd_alg)
+  {
+  case BK_DIGEST_MD5:
+    for (; len; p += n, len -= n)
+    {
+      n = MIN(len, (size_t)UINT_MAX & ~(DIGEST_BLOCK - 1));
+      bk_MD5Update(B, &bd->bd_u.bdu_md5, p, n);
+    }
+    break;
+
+  case BK_DIGEST_SHA256:
+    sha256_update(&bd->bd_u.bdu_sha256, p, len, bd->bd_flags);
+    break;
+
+  case BK_DIGEST_BLAKE3:
+    blake3_update(&bd->bd_u.bdu_blake3, p, len, bd->bd_flags);
+    break;
+  }
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Finish a message digest, and reset the context for a new message.
+ *
+ * THREADS: MT-SAFE (assuming different bd)
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param bd Digest context
+ *	@param digest Copy-out digest, bk_digest_length() bytes
+ *	@return <i>-1</i> on call failure
+ *	@return <br><i>length</i> of digest on success
+ */
+int bk_digest_final(bk_s B, struct bk_digest *bd, u_char *digest)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!bd || !digest)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  switch (bd->bd_alg)
+  {
+  case BK_DIGEST_MD5:
+    bk_MD5Final(B, &bd->bd_u.bdu_md5);
+    memcpy(digest, bd->bd_u.bdu_md5.digest, MD5_LEN);
+    break;
+
+  case BK_DIGEST_SHA256:
+    sha256_final(&bd->bd_u.bdu_sha256, digest, bd->bd_flags);
+    break;
+
+  case BK_DIGEST_BLAKE3:
+    blake3_final(&bd->bd_u.bdu_blake3, digest);
+    break;
+  }
+
+  digest_reset(bd);
+
+  BK_RETURN(B, digest_length(bd->bd_alg));
+}
+
+
+
+/**
+ * Digest a buffer in one call.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param alg Digest algorithm
+ *	@param data Data to digest
+ *	@param len Length of data
+ *	@param digest Copy-out digest, bk_digest_length() bytes
+ *	@param flags BK_DIGEST_PORTABLE
+ *	@return <i>-1</i> on call failure
+ *	@return <br><i>length</i> of digest on success
+ */
+int bk_digest_buffer(bk_s B, int alg, const void *data, size_t len, u_char *digest, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_digest bd;
+
+  if (digest_length(alg) < 0 || (len && !data) || !digest)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  // A private stack context, to avoid allocating one
+  bd.bd_alg = alg;
+  bd.bd_flags = flags;
+  digest_reset(&bd);
+
+  if (bk_digest_update(B, &bd, data, len) < 0)
+    BK_RETURN(B, -1);
+
+  BK_RETURN(B, bk_digest_final(B, &bd, digest));
+}
+
+
+
+/**
+ * Digest many separate messages, such as a batch of small objects.  For
+ * MD5 they are digested several at a time in vector lanes (eight with
+ * AVX2, four otherwise), with each lane taking the next message as soon
+ * as it finishes one; the others are digested one after another, which
+ * for BLAKE3 is already vectorized within large messages.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param alg Digest algorithm
+ *	@param bufs Messages
+ *	@param count Number of messages
+ *	@param digests Copy-out digests, count times bk_digest_length() bytes
+ *	@param flags BK_DIGEST_PORTABLE to use neither vector lanes nor special instructions
+ *	@return <i>-1</i> on call failure
+ *	@return <br><i>0</i> on success
+ */
+int bk_digest_multi(bk_s B, int alg, const bk_vptr *bufs, u_int count, u_char *digests, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int len;
+  u_int i;
+
+  if ((len = digest_length(alg)) < 0 || (count && (!bufs || !digests)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    if (bufs[i].len && !bufs[i].ptr)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Message %u has no data\n", i);
+      BK_RETURN(B, -1);
+    }
+  }
+
+  // A lone message would leave all but one lane idle
+  if (alg == BK_DIGEST_MD5 && count > 1 && BK_FLAG_ISCLEAR(flags, BK_DIGEST_PORTABLE))
+  {
+#ifdef DIGEST_X86
+    if (count > 4 && __builtin_cpu_supports("avx2"))
+      md5_multi(bufs, count, digests, 8, md5_x8);
+    else
+#endif /* DIGEST_X86 */
+      md5_multi(bufs, count, digests, 4, md5_x4);
+    BK_RETURN(B, 0);
+  }
+
+  for (i = 0; i < count; i++)
+    bk_digest_buffer(B, alg, bufs[i].ptr, bufs[i].len, digests + i * len, flags);
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Digest what an ioh reads and/or writes as it goes, on top of whatever
+ * read and write functions it already has.  The digests are the
+ * caller's: finish them with bk_digest_final() whenever convenient, but
+ * do not destroy them until the ioh has reported BkIohStatusIohClosing
+ * (with or without BK_IOH_DONTCLOSEFDS), which is also the time to
+ * finish them to get the digests of everything read or written.
+ *
+ * THREADS: MT-SAFE (assuming different ioh)
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh to filter
+ *	@param readdigest Digest of data read (NULL for none)
+ *	@param writedigest Digest of data written (NULL for none)
+ *	@param flags Fun for the future
+ *	@return <i>-1</i> on failure
+ *	@return <br><i>0</i> on success
+ */
+int bk_digest_ioh_filter(bk_s B, struct bk_ioh *ioh, struct bk_digest *readdigest, struct bk_digest *writedigest, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct digest_filter *df;
+
+  if (!ioh || (!readdigest && !writedigest))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (!BK_CALLOC(df))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate digest filter: %s\n", strerror(errno));
+    BK_RETURN(B, -1);
+  }
+
+  df->df_read = readdigest;
+  df->df_write = writedigest;
+
+  if (bk_ioh_get(B, ioh, NULL, NULL, &df->df_readfun, &df->df_writefun, &df->df_closefun, &df->df_opaque,
+		 NULL, NULL, NULL, NULL, NULL, NULL, NULL) < 0 ||
+      bk_ioh_update(B, ioh, digest_filter_read, digest_filter_write, digest_filter_close, df, NULL, NULL, 0, 0, 0, 0,
+		    BK_IOH_UPDATE_READFUN | BK_IOH_UPDATE_WRITEFUN | BK_IOH_UPDATE_CLOSEFUN |
+		    BK_IOH_UPDATE_IOFUNOPAQUE) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not install digest filter\n");
+    free(df);
+    BK_RETURN(B, -1);
+  }
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Length of the digest an algorithm produces.
+ *
+ *	@param alg Digest algorithm
+ *	@return <i>-1</i> for an unknown algorithm
+ *	@return <br><i>bytes</i> of digest otherwise
+ */
+static int digest_length(int alg)
+{
+  switch (alg)
+  {
+  case BK_DIGEST_MD5:
+    return MD5_LEN;
+  case BK_DIGEST_SHA256:
+    return SHA256_LEN;
+  case BK_DIGEST_BLAKE3:
+    return BLAKE3_LEN;
+  }
+
+  return -1;
+}
+
+
+
+/**
+ * Start a new message.
+ *
+ *	@param bd Digest context
+ */
+static void digest_reset(struct bk_digest *bd)
+{
+  switch (bd->bd_alg)
+  {
+  case BK_DIGEST_MD5:
+    bk_MD5Init(NULL, &bd->bd_u.bdu_md5);
+    break;
+
+  case BK_DIGEST_SHA256:
+    memcpy(bd->bd_u.bdu_sha256.ss_h, sha256_iv, sizeof(sha256_iv));
+    bd->bd_u.bdu_sha256.ss_count = 0;
+    break;
+
+  case BK_DIGEST_BLAKE3:
+    memcpy(bd->bd_u.bdu_blake3.bs_cv, blake3_iv, sizeof(bd->bd_u.bdu_blake3.bs_cv));
+    bd->bd_u.bdu_blake3.bs_chunk = 0;
+    bd->bd_u.bdu_blake3.bs_blocks = 0;
+    bd->bd_u.bdu_blake3.bs_buflen = 0;
+    bd->bd_u.bdu_blake3.bs_depth = 0;
+    break;
+  }
+}
+
+
+
+/**
+ * Load a little-endian word.
+ *
+ *	@param p Bytes
+ *	@return <i>word</i>
+ */
+static u_int32_t load_le32(const u_char *p)
+{
+  return (u_int32_t)p[0] | ((u_int32_t)p[1] << 8) | ((u_int32_t)p[2] << 16) | ((u_int32_t)p[3] << 24);
+}
+
+
+
+/**
+ * Store a little-endian word.
+ *
+ *	@param p Bytes
+ *	@param v Word
+ */
+static void store_le32(u_char *p, u_int32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+
+
+/**
+ * Digest many MD5 messages a block from each of several at a time.
+ * When a lane finishes its message it takes the next one, so messages
+ * of very different lengths still keep the lanes busy.
+ *
+ *	@param bufs Messages
+ *	@param count Number of messages
+ *	@param digests Copy-out digests
+ *	@param lanes Messages digested at once
+ *	@param blocks Digest one block in each lane
+ */
+static void md5_multi(const bk_vptr *bufs, u_int count, u_char *digests, u_int lanes, void (*blocks)(u_int32_t st[4][MAXLANES], const u_char **blk))
+{
+  struct md5_lane lane[MAXLANES];
+  u_int32_t st[4][MAXLANES];
+  const u_char *blk[MAXLANES];
+  u_int next = 0, busy, l, i, rest;
+  u_int64_t bits;
+
+  for (l = 0; l < lanes; l++)
+    lane[l].ml_job = -1;
+
+  for (;;)
+  {
+    busy = 0;
+    for (l = 0; l < lanes; l++)
+    {
+      struct md5_lane *ml = &lane[l];
+
+      // Load the next message, with its padded end ready to go
+      if (ml->ml_job < 0 && next < count)
+      {
+	ml->ml_job = next++;
+	ml->ml_blocks = bufs[ml->ml_job].len / DIGEST_BLOCK;
+	rest = bufs[ml->ml_job].len % DIGEST_BLOCK;
+	ml->ml_tailblocks = rest < DIGEST_BLOCK - 8 ? 1 : 2;
+	memset(ml->ml_tail, 0, sizeof(ml->ml_tail));
+	if (rest)
+	  memcpy(ml->ml_tail, (u_char *)bufs[ml->ml_job].ptr + ml->ml_blocks * DIGEST_BLOCK, rest);
+	ml->ml_tail[rest] = 0x80;
+	ml->ml_ptr = ml->ml_blocks ? bufs[ml->ml_job].ptr : ml->ml_tail;
+	bits = (u_int64_t)bufs[ml->ml_job].len << 3;
+	store_le32(ml->ml_tail + ml->ml_tailblocks * DIGEST_BLOCK - 8, bits);
+	store_le32(ml->ml_tail + ml->ml_tailblocks * DIGEST_BLOCK - 4, bits >> 32);
+	for (i = 0; i < 4; i++)
+	  st[i][l] = md5_iv[i];
+      }
+
+      blk[l] = ml->ml_job < 0 ? digest_zero : ml->ml_ptr;
+      busy += ml->ml_job >= 0;
+    }
+
+    if (!busy)
+      break;
+
+    (*blocks)(st, blk);
+
+    for (l = 0; l < lanes; l++)
+    {
+      struct md5_lane *ml = &lane[l];
+
+      if (ml->ml_job < 0)
+	continue;
+
+      // On to the padded end once the whole blocks are done
+      if (ml->ml_blocks)
+      {
+	ml->ml_ptr = --ml->ml_blocks ? ml->ml_ptr + DIGEST_BLOCK : ml->ml_tail;
+	continue;
+      }
+
+      ml->ml_ptr += DIGEST_BLOCK;
+      if (--ml->ml_tailblocks)
+	continue;
+
+      for (i = 0; i < 4; i++)
+	store_le32(digests + ml->ml_job * MD5_LEN + i * 4, st[i][l]);
+      ml->ml_job = -1;
+    }
+  }
+}
+
+
+
+/**
+ * The body of a multi-lane MD5 block function, for a vector type with
+ * the given number of lanes.
+ */
+#define MD5_LANES(vtype, lanes, st, blk)						\
+  do {											\
+    vtype x[16], a, b, c, d, f, aa, bb, cc, dd;						\
+    u_int32_t w[16][lanes];								\
+    u_int i, l;										\
+											\
+    for (l = 0; l < (lanes); l++)							\
+      for (i = 0; i < 16; i++)								\
+	w[i][l] = load_le32(blk[l] + i * 4);						\
+    memcpy(x, w, sizeof(x));								\
+    memcpy(&a, st[0], sizeof(a));							\
+    memcpy(&b, st[1], sizeof(b));							\
+    memcpy(&c, st[2], sizeof(c));							\
+    memcpy(&d, st[3], sizeof(d));							\
+    aa = a;										\
+    bb = b;										\
+    cc = c;										\
+    dd = d;										\
+											\
+    for (i = 0; i < 16; i++)								\
+    {											\
+      f = (b & c) | (~b & d);								\
+      MD5_STEP(f, a, b, c, d, x[i], md5_shift[0][i & 3], md5_k[i]);			\
+    }											\
+    for (i = 16; i < 32; i++)								\
+    {											\
+      f = (b & d) | (c & ~d);								\
+      MD5_STEP(f, a, b, c, d, x[(5 * i + 1) & 15], md5_shift[1][i & 3], md5_k[i]);	\
+    }											\
+    for (i = 32; i < 48; i++)								\
+    {											\
+      f = b ^ c ^ d;									\
+      MD5_STEP(f, a, b, c, d, x[(3 * i + 5) & 15], md5_shift[2][i & 3], md5_k[i]);	\
+    }											\
+    for (i = 48; i < 64; i++)								\
+    {											\
+      f = c ^ (b | ~d);									\
+      MD5_STEP(f, a, b, c, d, x[(7 * i) & 15], md5_shift[3][i & 3], md5_k[i]);		\
+    }											\
+											\
+    a += aa;										\
+    b += bb;										\
+    c += cc;										\
+    d += dd;										\
+    memcpy(st[0], &a, sizeof(a));							\
+    memcpy(st[1], &b, sizeof(b));							\
+    memcpy(st[2], &c, sizeof(c));							\
+    memcpy(st[3], &d, sizeof(d));							\
+  } while (0)
+
+
+
+/**
+ * Digest one MD5 block in each of four lanes.
+ *
+ *	@param st Hash state of each lane
+ *	@param blk Block for each lane
+ */
+static void md5_x4(u_int32_t st[4][MAXLANES], const u_char **blk)
+{
+  MD5_LANES(digest_v4, 4, st, blk);
+}
+
+
+
+#ifdef DIGEST_X86
+/**
+ * Digest one MD5 block in each of eight lanes with AVX2.
+ *
+ *	@param st Hash state of each lane
+ *	@param blk Block for each lane
+ */
+__attribute__((target("avx2")))
+static void md5_x8(u_int32_t st[4][MAXLANES], const u_char **blk)
+{
+  MD5_LANES(digest_v8, 8, st, blk);
+}
+#endif /* DIGEST_X86 */
+
+
+
+/**
+ * Add data to a SHA-256 digest.
+ *
+ *	@param ss SHA-256 state
+ *	@param p Data
+ *	@param len Length of data
+ *	@param flags BK_DIGEST_PORTABLE
+ */
+static void sha256_update(struct sha256_state *ss, const u_char *p, size_t len, bk_flags flags)
+{
+  u_int used = ss->ss_count % DIGEST_BLOCK;
+  size_t n;
+
+  ss->ss_count += len;
+
+  if (used)
+  {
+    n = MIN(DIGEST_BLOCK - used, len);
+    memcpy(ss->ss_buf + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < DIGEST_BLOCK)
+      return;
+    sha256_blocks(ss->ss_h, ss->ss_buf, 1, flags);
+  }
+
+  sha256_blocks(ss->ss_h, p, len / DIGEST_BLOCK, flags);
+  memcpy(ss->ss_buf, p + len / DIGEST_BLOCK * DIGEST_BLOCK, len % DIGEST_BLOCK);
+}
+
+
+
+/**
+ * Pad out a SHA-256 digest and extract it (big-endian).
+ *
+ *	@param ss SHA-256 state
+ *	@param digest Copy-out digest
+ *	@param flags BK_DIGEST_PORTABLE
+ */
+static void sha256_final(struct sha256_state *ss, u_char *digest, bk_flags flags)
+{
+  u_int used = ss->ss_count % DIGEST_BLOCK;
+  u_int64_t bits = ss->ss_count << 3;
+  int i;
+
+  ss->ss_buf[used++] = 0x80;
+  if (used > DIGEST_BLOCK - 8)
+  {
+    memset(ss->ss_buf + used, 0, DIGEST_BLOCK - used);
+    sha256_blocks(ss->ss_h, ss->ss_buf, 1, flags);
+    used = 0;
+  }
+  memset(ss->ss_buf + used, 0, DIGEST_BLOCK - 8 - used);
+  for (i = 0; i < 8; i++)
+    ss->ss_buf[DIGEST_BLOCK - 1 - i] = bits >> (i * 8);
+  sha256_blocks(ss->ss_h, ss->ss_buf, 1, flags);
+
+  for (i = 0; i < 8; i++)
+  {
+    digest[i * 4] = ss->ss_h[i] >> 24;
+    digest[i * 4 + 1] = ss->ss_h[i] >> 16;
+    digest[i * 4 + 2] = ss->ss_h[i] >> 8;
+    digest[i * 4 + 3] = ss->ss_h[i];
+  }
+}
+
+
+
+/**
+ * Digest whole SHA-256 blocks, with the SHA extensions if possible.
+ *
+ *	@param h Hash state
+ *	@param p Blocks
+ *	@param n Number of blocks
+ *	@param flags BK_DIGEST_PORTABLE
+ */
+static void sha256_blocks(u_int32_t h[8], const u_char *p, size_t n, bk_flags flags)
+{
+  if (!n)
+    return;
+
+#ifdef DIGEST_X86
+  if (BK_FLAG_ISCLEAR(flags, BK_DIGEST_PORTABLE) && __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+  {
+    sha256_blocks_shani(h, p, n);
+    return;
+  }
+#endif /* DIGEST_X86 */
+
+  sha256_blocks_scalar(h, p, n);
+}
+
+
+
+/**
+ * Digest whole SHA-256 blocks straight from FIPS 180-4.
+ *
+ *	@param h Hash state
+ *	@param p Blocks
+ *	@param n Number of blocks
+ */
+static void sha256_blocks_scalar(u_int32_t h[8], const u_char *p, size_t n)
+{
+  u_int32_t w[64], a, b, c, d, e, f, g, hh, t1, t2;
+  int i;
+
+  for (; n--; p += DIGEST_BLOCK)
+  {
+    for (i = 0; i < 16; i++)
+      w[i] = ((u_int32_t)p[i * 4] << 24) | ((u_int32_t)p[i * 4 + 1] << 16) | ((u_int32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    for (; i < 64; i++)
+      w[i] = w[i - 16] + (ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+	w[i - 7] + (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    e = h[4];
+    f = h[5];
+    g = h[6];
+    hh = h[7];
+
+    for (i = 0; i < 64; i++)
+    {
+      t1 = hh + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+  }
+}
+
+
+
+#ifdef DIGEST_X86
+/**
+ * Digest whole SHA-256 blocks with the SHA extensions.  The state is
+ * kept as ABEF and CDGH, the way SHA256RNDS2 wants it, and each group
+ * of four rounds extends the message schedule by four words.
+ *
+ *	@param h Hash state
+ *	@param p Blocks
+ *	@param n Number of blocks
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(u_int32_t h[8], const u_char *p, size_t n)
+{
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg, tmp, m0, m1, m2, m3;
+  int i;
+
+  // Four rounds using the given schedule words
+#define SHANI_ROUNDS(mw, r)							\
+  do {										\
+    msg = _mm_add_epi32(mw, _mm_loadu_si128((const __m128i *)(sha256_k + (r) * 4))); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);			\
+    msg = _mm_shuffle_epi32(msg, 0x0E);						\
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);			\
+  } while (0)
+
+  // Replace the oldest schedule words (a) with the next four
+#define SHANI_SCHEDULE(a, b, c, d)						\
+  do {										\
+    a = _mm_sha256msg1_epu32(a, b);						\
+    a = _mm_add_epi32(a, _mm_alignr_epi8(d, c, 4));				\
+    a = _mm_sha256msg2_epu32(a, d);						\
+  } while (0)
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xB1);	// CDAB
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1B);	// EFGH
+  state0 = _mm_alignr_epi8(tmp, state1, 8);					// ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);					// CDGH
+
+  for (; n--; p += DIGEST_BLOCK)
+  {
+    abef = state0;
+    cdgh = state1;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+    SHANI_ROUNDS(m0, 0);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), bswap);
+    SHANI_ROUNDS(m1, 1);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), bswap);
+    SHANI_ROUNDS(m2, 2);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), bswap);
+    SHANI_ROUNDS(m3, 3);
+
+    for (i = 4; i < 16; i += 4)
+    {
+      SHANI_SCHEDULE(m0, m1, m2, m3);
+      SHANI_ROUNDS(m0, i);
+      SHANI_SCHEDULE(m1, m2, m3, m0);
+      SHANI_ROUNDS(m1, i + 1);
+      SHANI_SCHEDULE(m2, m3, m0, m1);
+      SHANI_ROUNDS(m2, i + 2);
+      SHANI_SCHEDULE(m3, m0, m1, m2);
+      SHANI_ROUNDS(m3, i + 3);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+#undef SHANI_ROUNDS
+#undef SHANI_SCHEDULE
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);					// FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);					// DCHG
+  _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xF0));	// DCBA
+  _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));		// HGFE
+}
+#endif /* DIGEST_X86 */
+
+
+
+/**
+ * Add data to a BLAKE3 digest.  The input is split into 1KB chunks,
+ * each digested on its own and then combined pairwise up a binary
+ * tree.  Complete chunks are digested several at a time where the
+ * CPU allows.  The last block seen is always held back, since the
+ * last block of the message is compressed differently.
+ *
+ *	@param bs BLAKE3 state
+ *	@param p Data
+ *	@param len Length of data
+ *	@param flags BK_DIGEST_PORTABLE
+ */
+static void blake3_update(struct blake3_state *bs, const u_char *p, size_t len, bk_flags flags)
+{
+  u_int32_t start;
+  size_t n;
+
+  while (len)
+  {
+    start = bs->bs_blocks ? 0 : BLAKE3_CHUNK_START;
+
+    // More data, so a full chunk is not the last one: finish it
+    if (bs->bs_blocks == BLAKE3_CHUNK / DIGEST_BLOCK - 1 && bs->bs_buflen == DIGEST_BLOCK)
+    {
+      blake3_compress_block(bs->bs_cv, bs->bs_buf, bs->bs_chunk, DIGEST_BLOCK, start | BLAKE3_CHUNK_END);
+      blake3_push(bs, bs->bs_cv);
+      memcpy(bs->bs_cv, blake3_iv, sizeof(bs->bs_cv));
+      bs->bs_blocks = 0;
+      bs->bs_buflen = 0;
+      continue;
+    }
+
+    if (bs->bs_buflen == DIGEST_BLOCK)
+    {
+      blake3_compress_block(bs->bs_cv, bs->bs_buf, bs->bs_chunk, DIGEST_BLOCK, start);
+      bs->bs_blocks++;
+      bs->bs_buflen = 0;
+      continue;
+    }
+
+    if (bs->bs_buflen == 0)
+    {
+      // Whole chunks, straight from the caller's buffer
+      if (bs->bs_blocks == 0 && len > BLAKE3_CHUNK)
+      {
+	n = (len - 1) / BLAKE3_CHUNK;
+	blake3_chunks(bs, p, n, flags);
+	p += n * BLAKE3_CHUNK;
+	len -= n * BLAKE3_CHUNK;
+	continue;
+      }
+
+      // Whole blocks which are not the last of their chunk
+      if (len > DIGEST_BLOCK && bs->bs_blocks < BLAKE3_CHUNK / DIGEST_BLOCK - 1)
+      {
+	blake3_compress_block(bs->bs_cv, p, bs->bs_chunk, DIGEST_BLOCK, start);
+	bs->bs_blocks++;
+	p += DIGEST_BLOCK;
+	len -= DIGEST_BLOCK;
+	continue;
+      }
+    }
+
+    n = MIN(DIGEST_BLOCK - bs->bs_buflen, len);
+    memcpy(bs->bs_buf + bs->bs_buflen, p, n);
+    bs->bs_buflen += n;
+    p += n;
+    len -= n;
+  }
+}
+
+
+
+/**
+ * Finish a BLAKE3 digest: the last chunk's output is folded into each
+ * complete subtree on the stack in turn, and the last node compressed
+ * is the root.
+ *
+ *	@param bs BLAKE3 state
+ *	@param digest Copy-out digest
+ */
+static void blake3_final(struct blake3_state *bs, u_char *digest)
+{
+  u_int32_t cv[8], m[16], out[16], len, flags;
+  u_int i, depth;
+  u_int64_t chunk;
+
+  memcpy(cv, bs->bs_cv, sizeof(cv));
+  memset(bs->bs_buf + bs->bs_buflen, 0, DIGEST_BLOCK - bs->bs_buflen);
+  for (i = 0; i < 16; i++)
+    m[i] = load_le32(bs->bs_buf + i * 4);
+  chunk = bs->bs_chunk;
+  len = bs->bs_buflen;
+  flags = (bs->bs_blocks ? 0 : BLAKE3_CHUNK_START) | BLAKE3_CHUNK_END;
+
+  for (depth = bs->bs_depth; depth > 0; depth--)
+  {
+    blake3_compress(cv, m, chunk, len, flags, out);
+    memcpy(m, bs->bs_stack[depth - 1], sizeof(bs->bs_stack[0]));
+    memcpy(m + 8, out, 8 * sizeof(*m));
+    memcpy(cv, blake3_iv, sizeof(cv));
+    chunk = 0;
+    len = DIGEST_BLOCK;
+    flags = BLAKE3_PARENT;
+  }
+
+  // The root's counter numbers output blocks, not chunks
+  blake3_compress(cv, m, 0, len, flags | BLAKE3_ROOT, out);
+  for (i = 0; i < 8; i++)
+    store_le32(digest + i * 4, out[i]);
+}
+
+
+
+/**
+ * The BLAKE3 compression function.
+ *
+ *	@param cv Input chaining value
+ *	@param m Message block
+ *	@param counter Chunk (or output block) number
+ *	@param len Bytes of message in block
+ *	@param flags BLAKE3_CHUNK_START etc.
+ *	@param out Copy-out state, whose first eight words are the output chaining value
+ */
+static void blake3_compress(const u_int32_t cv[8], const u_int32_t m[16], u_int64_t counter, u_int32_t len, u_int32_t flags, u_int32_t out[16])
+{
+  u_int32_t v[16];
+  int r;
+
+  memcpy(v, cv, 8 * sizeof(*v));
+  memcpy(v + 8, blake3_iv, 4 * sizeof(*v));
+  v[12] = counter;
+  v[13] = counter >> 32;
+  v[14] = len;
+  v[15] = flags;
+
+  for (r = 0; r < 7; r++)
+    BLAKE3_ROUND(v, m, blake3_sched[r]);
+
+  for (r = 0; r < 8; r++)
+  {
+    out[r] = v[r] ^ v[r + 8];
+    out[r + 8] = v[r + 8] ^ cv[r];
+  }
+}
+
+
+
+/**
+ * Compress a block of a chunk in place.
+ *
+ *	@param cv Chaining value, updated
+ *	@param block Message block
+ *	@param counter Chunk number
+ *	@param len Bytes of message in block
+ *	@param flags BLAKE3_CHUNK_START etc.
+ */
+static void blake3_compress_block(u_int32_t cv[8], const u_char *block, u_int64_t counter, u_int32_t len, u_int32_t flags)
+{
+  u_int32_t m[16], out[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load_le32(block + i * 4);
+  blake3_compress(cv, m, counter, len, flags, out);
+  memcpy(cv, out, 8 * sizeof(*cv));
+}
+
+
+
+/**
+ * Digest whole chunks, eight or four at a time if possible, and add
+ * them to the tree.  None of them may be the last chunk of the message.
+ *
+ *	@param bs BLAKE3 state
+ *	@param p Chunks
+ *	@param n Number of chunks
+ *	@param flags BK_DIGEST_PORTABLE
+ */
+static void blake3_chunks(struct blake3_state *bs, const u_char *p, size_t n, bk_flags flags)
+{
+  u_int32_t cvs[MAXLANES][8];
+  u_int lanes, l, b;
+
+  while (n)
+  {
+    lanes = 1;
+    if (BK_FLAG_ISCLEAR(flags, BK_DIGEST_PORTABLE))
+    {
+#ifdef DIGEST_X86
+      if (n >= 8 && __builtin_cpu_supports("avx2"))
+      {
+	blake3_hash8(p, bs->bs_chunk, cvs);
+	lanes = 8;
+      }
+      else
+#endif /* DIGEST_X86 */
+      if (n >= 4)
+      {
+	blake3_hash4(p, bs->bs_chunk, cvs);
+	lanes = 4;
+      }
+    }
+
+    if (lanes == 1)
+    {
+      memcpy(cvs[0], blake3_iv, sizeof(cvs[0]));
+      for (b = 0; b < BLAKE3_CHUNK / DIGEST_BLOCK; b++)
+	blake3_compress_block(cvs[0], p + b * DIGEST_BLOCK, bs->bs_chunk, DIGEST_BLOCK,
+			      (b == 0 ? BLAKE3_CHUNK_START : 0) | (b == BLAKE3_CHUNK / DIGEST_BLOCK - 1 ? BLAKE3_CHUNK_END : 0));
+    }
+
+    for (l = 0; l < lanes; l++)
+      blake3_push(bs, cvs[l]);
+    p += lanes * BLAKE3_CHUNK;
+    n -= lanes;
+  }
+}
+
+
+
+/**
+ * Add a finished chunk to the tree, merging every subtree it completes.
+ * After chunk k, one merge is done for each trailing zero bit of k+1.
+ *
+ *	@param bs BLAKE3 state, whose bs_chunk is the chunk just finished
+ *	@param cv Chaining value of the chunk
+ */
+static void blake3_push(struct blake3_state *bs, u_int32_t cv[8])
+{
+  u_int32_t m[16], out[16];
+  u_int64_t total = ++bs->bs_chunk;
+  int i;
+
+  memcpy(m + 8, cv, sizeof(m) / 2);
+  for (; !(total & 1); total >>= 1)
+  {
+    memcpy(m, bs->bs_stack[--bs->bs_depth], sizeof(m) / 2);
+    blake3_compress(blake3_iv, m, 0, DIGEST_BLOCK, BLAKE3_PARENT, out);
+    memcpy(m + 8, out, 8 * sizeof(*m));
+  }
+
+  memcpy(bs->bs_stack[bs->bs_depth++], m + 8, sizeof(m) / 2);
+}
+
+
+
+/**
+ * The body of a multi-lane BLAKE3 chunk function, for a vector type
+ * with the given number of lanes: lane l digests the chunk at
+ * p + l * 1KB, numbered counter + l.
+ */
+#define BLAKE3_LANES(vtype, lanes, p, counter, cvs)				\
+  do {										\
+    vtype h[8], v[16], m[16], lo, hi;						\
+    u_int32_t w[16][lanes];							\
+    u_int b, i, l, r;								\
+										\
+    for (i = 0; i < 8; i++)							\
+      h[i] = (vtype){ 0 } + blake3_iv[i];						\
+    for (l = 0; l < (lanes); l++)						\
+    {										\
+      lo[l] = (counter) + l;							\
+      hi[l] = ((counter) + l) >> 32;						\
+    }										\
+										\
+    for (b = 0; b < BLAKE3_CHUNK / DIGEST_BLOCK; b++)				\
+    {										\
+      for (l = 0; l < (lanes); l++)						\
+	for (i = 0; i < 16; i++)						\
+	  w[i][l] = load_le32(p + l * BLAKE3_CHUNK + b * DIGEST_BLOCK + i * 4); \
+      memcpy(m, w, sizeof(m));							\
+										\
+      for (i = 0; i < 8; i++)							\
+	v[i] = h[i];								\
+      for (i = 0; i < 4; i++)							\
+	v[i + 8] = (vtype){ 0 } + blake3_iv[i];					\
+      v[12] = lo;								\
+      v[13] = hi;								\
+      v[14] = (vtype){ 0 } + DIGEST_BLOCK;						\
+      v[15] = (vtype){ 0 } + ((b == 0 ? BLAKE3_CHUNK_START : 0) |			\
+			   (b == BLAKE3_CHUNK / DIGEST_BLOCK - 1 ? BLAKE3_CHUNK_END : 0)); \
+										\
+      for (r = 0; r < 7; r++)							\
+	BLAKE3_ROUND(v, m, blake3_sched[r]);					\
+										\
+      for (i = 0; i < 8; i++)							\
+	h[i] = v[i] ^ v[i + 8];							\
+    }										\
+										\
+    for (l = 0; l < (lanes); l++)						\
+      for (i = 0; i < 8; i++)							\
+	cvs[l][i] = h[i][l];							\
+  } while (0)
+
+
+
+/**
+ * Digest four whole BLAKE3 chunks at once.
+ *
+ *	@param p Chunks
+ *	@param counter Number of first chunk
+ *	@param cvs Copy-out chaining values
+ */
+static void blake3_hash4(const u_char *p, u_int64_t counter, u_int32_t cvs[MAXLANES][8])
+{
+  BLAKE3_LANES(digest_v4, 4, p, counter, cvs);
+}
+
+
+
+#ifdef DIGEST_X86
+/**
+ * Digest eight whole BLAKE3 chunks at once with AVX2.
+ *
+ *	@param p Chunks
+ *	@param counter Number of first chunk
+ *	@param cvs Copy-out chaining values
+ */
+__attribute__((target("avx2")))
+static void blake3_hash8(const u_char *p, u_int64_t counter, u_int32_t cvs[MAXLANES][8])
+{
+  BLAKE3_LANES(digest_v8, 8, p, counter, cvs);
+}
+#endif /* DIGEST_X86 */
+
+
+
+/**
+ * ioh read function for the digest filter: digest whatever the
+ * underlying read function returned, if reads are being digested.
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh
+ *	@param opaque Filter state
+ *	@param fd File descriptor
+ *	@param buf Buffer for data
+ *	@param size Size of buf
+ *	@param flags Passed to underlying read function
+ *	@return Standard @a read() return codes
+ */
+static int digest_filter_read(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, caddr_t buf, __SIZE_TYPE__ size, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct digest_filter *df = opaque;
+  int ret;
+
+  if ((ret = (*df->df_readfun)(B, ioh, df->df_opaque, fd, buf, size, flags)) > 0 && df->df_read)
+    bk_digest_update(B, df->df_read, buf, ret);
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * ioh write function for the digest filter: digest whatever the
+ * underlying write function took, if writes are being digested.
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh
+ *	@param opaque Filter state
+ *	@param fd File descriptor
+ *	@param iov Data to write
+ *	@param size Number of iovec buffers
+ *	@param flags Passed to underlying write function
+ *	@return Standard @a writev() return codes
+ */
+static int digest_filter_write(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, struct iovec *iov, __SIZE_TYPE__ size, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct digest_filter *df = opaque;
+  size_t left, n;
+  __SIZE_TYPE__ i;
+  int ret;
+
+  if ((ret = (*df->df_writefun)(B, ioh, df->df_opaque, fd, iov, size, flags)) > 0 && df->df_write)
+  {
+    for (i = 0, left = ret; i < size && left; i++, left -= n)
+    {
+      n = MIN(iov[i].iov_len, left);
+      bk_digest_update(B, df->df_write, iov[i].iov_base, n);
+    }
+  }
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * ioh close function for the digest filter.  This is also called (with
+ * both descriptors -1) when the ioh is closed with BK_IOH_DONTCLOSEFDS.
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh
+ *	@param opaque Filter state
+ *	@param fdin Input file descriptor
+ *	@param fdout Output file descriptor
+ *	@param flags Passed to underlying close function
+ */
+static void digest_filter_close(bk_s B, struct bk_ioh *ioh, void *opaque, int fdin, int fdout, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct digest_filter *df = opaque;
+
+  (*df->df_closefun)(B, ioh, df->df_opaque, fdin, fdout, flags);
+  free(df);
+
+  BK_VRETURN(B);
+}
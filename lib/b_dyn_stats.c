@@ -41,6 +41,7 @@ struct bk_dynamic_stat
   void *				bds_opaque;		///< User defined private data
   bk_dynamic_stat_destroy_h		bds_destroy_callback;	///< Callback to destroy opaque data.
   bk_dynamic_stat_update_h		bds_update_callback;	///< Callback for on-demand updates
+  struct bk_dynamic_stats_list *	bds_bdsl;		///< List which owns this stat (for handle updates)
 #ifdef BK_USING_PTHREADS
   pthread_t				bds_tid; 		///< Used to note thread-specific stats.
 #endif /* BK_USING_PTHREADS */
@@ -489,6 +490,7 @@ bk_dynamic_stat_register_simple(bk_s B, bk_dynamic_stats_h stats_list, const cha
   bds->bds_opaque = opaque;
   bds->bds_update_callback = update_callback;
   bds->bds_destroy_callback = destroy_callback;
+  bds->bds_bdsl = bdsl;
 
   STATS_LIST_LOCK(bdsl, locked);
 
@@ -984,16 +986,16 @@ extract_value(bk_s B, struct bk_dynamic_stat *bds, void *buf, u_int len, bk_flag
   switch(bds->bds_value_type)
   {
   case DynamicStatsValueTypeInt32:
-    EXTRACT_BDS_VALUE(bds, buf, len, bds->bds_int32);
+    EXTRACT_BDS_VALUE(bds, buf, len, BK_ATOMIC_LOAD(&bds->bds_int32));
     break;
   case DynamicStatsValueTypeUInt32:
-    EXTRACT_BDS_VALUE(bds, buf, len, bds->bds_uint32);
+    EXTRACT_BDS_VALUE(bds, buf, len, BK_ATOMIC_LOAD(&bds->bds_uint32));
     break;
   case DynamicStatsValueTypeInt64:
-    EXTRACT_BDS_VALUE(bds, buf, len, bds->bds_int64);
+    EXTRACT_BDS_VALUE(bds, buf, len, BK_ATOMIC_LOAD(&bds->bds_int64));
     break;
   case DynamicStatsValueTypeUInt64:
-    EXTRACT_BDS_VALUE(bds, buf, len, bds->bds_uint64);
+    EXTRACT_BDS_VALUE(bds, buf, len, BK_ATOMIC_LOAD(&bds->bds_uint64));
     break;
   case DynamicStatsValueTypeFloat:
     EXTRACT_BDS_VALUE(bds, buf, len, bds->bds_float);
@@ -1163,16 +1165,16 @@ stat_set(bk_s B, struct bk_dynamic_stat *bds, void *data, bk_flags flags)
     switch(bds->bds_value_type)
     {
     case DynamicStatsValueTypeInt32:
-      bds->bds_int32 = *(int32_t*)data;
+      BK_ATOMIC_STORE(&bds->bds_int32, *(int32_t*)data);
       break;
     case DynamicStatsValueTypeUInt32:
-      bds->bds_uint32 = *(u_int32_t*)data;
+      BK_ATOMIC_STORE(&bds->bds_uint32, *(u_int32_t*)data);
       break;
     case DynamicStatsValueTypeInt64:
-      bds->bds_int64 = *(int64_t*)data;
+      BK_ATOMIC_STORE(&bds->bds_int64, *(int64_t*)data);
       break;
     case DynamicStatsValueTypeUInt64:
-      bds->bds_uint64 = *(u_int64_t*)data;
+      BK_ATOMIC_STORE(&bds->bds_uint64, *(u_int64_t*)data);
       break;
     case DynamicStatsValueTypeFloat:
       bds->bds_float = *(float*)data;
@@ -1262,16 +1264,16 @@ bk_dynamic_stat_set(bk_s B, bk_dynamic_stats_h stats_list, const char *name, lon
     switch(bds->bds_value_type)
     {
     case DynamicStatsValueTypeInt32:
-      bds->bds_int32 = va_arg(ap, int32_t);
+      BK_ATOMIC_STORE(&bds->bds_int32, va_arg(ap, int32_t));
       break;
     case DynamicStatsValueTypeUInt32:
-      bds->bds_uint32 = va_arg(ap, u_int32_t);
+      BK_ATOMIC_STORE(&bds->bds_uint32, va_arg(ap, u_int32_t));
       break;
     case DynamicStatsValueTypeInt64:
-      bds->bds_int64 = va_arg(ap, int64_t);
+      BK_ATOMIC_STORE(&bds->bds_int64, va_arg(ap, int64_t));
       break;
     case DynamicStatsValueTypeUInt64:
-      bds->bds_uint64 = va_arg(ap, u_int64_t);
+      BK_ATOMIC_STORE(&bds->bds_uint64, va_arg(ap, u_int64_t));
       break;
     case DynamicStatsValueTypeFloat:
       // Floats are (apparently) promoted to doubles when passed through stdargs
@@ -1440,16 +1442,16 @@ bk_dynamic_stat_increment(bk_s B, bk_dynamic_stats_h *stats_list, const char *na
   switch(bds->bds_value_type)
   {
   case DynamicStatsValueTypeInt32:
-    bds->bds_int32 += va_arg(ap, int32_t);
+    BK_ATOMIC_ADD(&bds->bds_int32, va_arg(ap, int32_t));
     break;
   case DynamicStatsValueTypeUInt32:
-    bds->bds_uint32 += va_arg(ap, u_int32_t);
+    BK_ATOMIC_ADD(&bds->bds_uint32, va_arg(ap, u_int32_t));
     break;
   case DynamicStatsValueTypeInt64:
-    bds->bds_int64 += va_arg(ap, int64_t);
+    BK_ATOMIC_ADD(&bds->bds_int64, va_arg(ap, int64_t));
     break;
   case DynamicStatsValueTypeUInt64:
-    bds->bds_uint64 += va_arg(ap, u_int64_t);
+    BK_ATOMIC_ADD(&bds->bds_uint64, va_arg(ap, u_int64_t));
     break;
   case DynamicStatsValueTypeFloat:
 	// Float is promoted to double when passed through stdargs
@@ -1482,6 +1484,192 @@ bk_dynamic_stat_increment(bk_s B, bk_dynamic_stats_h *stats_list, const char *na
 
 
 
+/**
+ * Increment a stat, located by handle rather than by name, by an integral
+ * value.  The increment must be the argument which immediately follows
+ * @a flags and must be the same type as the statistic value.  Integer
+ * statistics are updated with a single atomic add and neither search the
+ * list nor take its lock, so this is the version to use in fast paths.
+ * Floating point statistics still take the list lock.
+ *
+ * The handle is the C/O of bk_dynamic_stat_register() et al. or
+ * bk_dynamic_stat_get() and is only valid until the statistic is
+ * deregistered or the list is destroyed.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param dyn_stat The statistic to update.
+ *	@param flags Flags for future use.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+int
+bk_dynamic_stat_handle_increment(bk_s B, bk_dynamic_stat_h dyn_stat, bk_flags flags, ...)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_dynamic_stat *bds = (struct bk_dynamic_stat *)dyn_stat;
+  struct bk_dynamic_stats_list *bdsl;
+  va_list ap;
+  int locked = 0;
+
+  if (!bds)
+  {
+    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  bdsl = bds->bds_bdsl;
+
+  if (bds->bds_access_type == DynamicStatsAccessTypeIndirect)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Indirect stats should not use %s\n", __FUNCTION__);
+    BK_RETURN(B, -1);
+  }
+
+  va_start(ap, flags);
+
+  switch(bds->bds_value_type)
+  {
+  case DynamicStatsValueTypeInt32:
+    BK_ATOMIC_ADD(&bds->bds_int32, va_arg(ap, int32_t));
+    break;
+  case DynamicStatsValueTypeUInt32:
+    BK_ATOMIC_ADD(&bds->bds_uint32, va_arg(ap, u_int32_t));
+    break;
+  case DynamicStatsValueTypeInt64:
+    BK_ATOMIC_ADD(&bds->bds_int64, va_arg(ap, int64_t));
+    break;
+  case DynamicStatsValueTypeUInt64:
+    BK_ATOMIC_ADD(&bds->bds_uint64, va_arg(ap, u_int64_t));
+    break;
+  case DynamicStatsValueTypeFloat:
+  case DynamicStatsValueTypeDouble:
+    STATS_LIST_LOCK(bdsl, locked);
+    // Float is promoted to double when passed through stdargs
+    if (bds->bds_value_type == DynamicStatsValueTypeFloat)
+      bds->bds_float += va_arg(ap, double);
+    else
+      bds->bds_double += va_arg(ap, double);
+    STATS_LIST_UNLOCK(bdsl, locked);
+    break;
+  case DynamicStatsValueTypeString:
+    bk_error_printf(B, BK_ERR_ERR, "Incrementing a string value is not permitted\n");
+    goto error;
+    break;
+  default:
+    bk_error_printf(B, BK_ERR_ERR,"Unknown statistics value type: %d\n", bds->bds_value_type);
+    goto error;
+    break;
+  }
+
+  va_end(ap);
+
+  BK_RETURN(B, 0);
+
+ error:
+  va_end(ap);
+  STATS_LIST_UNLOCK(bdsl, locked);
+
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Set the value of a stat located by handle rather than by name.  The
+ * value must be the argument which immediately follows @a flags.  As with
+ * bk_dynamic_stat_handle_increment(), integer statistics are stored
+ * atomically without the list lock; other types take the lock.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param dyn_stat The statistic to update.
+ *	@param flags Flags for future use.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+int
+bk_dynamic_stat_handle_set(bk_s B, bk_dynamic_stat_h dyn_stat, bk_flags flags, ...)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_dynamic_stat *bds = (struct bk_dynamic_stat *)dyn_stat;
+  struct bk_dynamic_stats_list *bdsl;
+  bk_dynamic_stat_value_u bdsv;
+  va_list ap;
+  int locked = 0;
+
+  if (!bds)
+  {
+    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  bdsl = bds->bds_bdsl;
+
+  if (bds->bds_access_type == DynamicStatsAccessTypeIndirect)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Indirect stats should not use %s\n", __FUNCTION__);
+    BK_RETURN(B, -1);
+  }
+
+  va_start(ap, flags);
+
+  switch(bds->bds_value_type)
+  {
+  case DynamicStatsValueTypeInt32:
+    BK_ATOMIC_STORE(&bds->bds_int32, va_arg(ap, int32_t));
+    break;
+  case DynamicStatsValueTypeUInt32:
+    BK_ATOMIC_STORE(&bds->bds_uint32, va_arg(ap, u_int32_t));
+    break;
+  case DynamicStatsValueTypeInt64:
+    BK_ATOMIC_STORE(&bds->bds_int64, va_arg(ap, int64_t));
+    break;
+  case DynamicStatsValueTypeUInt64:
+    BK_ATOMIC_STORE(&bds->bds_uint64, va_arg(ap, u_int64_t));
+    break;
+  case DynamicStatsValueTypeFloat:
+    // Floats are (apparently) promoted to doubles when passed through stdargs
+    STATS_LIST_LOCK(bdsl, locked);
+    bds->bds_float = va_arg(ap, double);
+    STATS_LIST_UNLOCK(bdsl, locked);
+    break;
+  case DynamicStatsValueTypeDouble:
+    STATS_LIST_LOCK(bdsl, locked);
+    bds->bds_double = va_arg(ap, double);
+    STATS_LIST_UNLOCK(bdsl, locked);
+    break;
+  case DynamicStatsValueTypeString:
+    bdsv.bdsv_string = va_arg(ap, char *);
+    STATS_LIST_LOCK(bdsl, locked);
+    if (stat_set(B, bds, &bdsv, 0) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not set value\n");
+      goto error;
+    }
+    STATS_LIST_UNLOCK(bdsl, locked);
+    break;
+  default:
+    bk_error_printf(B, BK_ERR_ERR, "Unknown statistics value type: %d\n", bds->bds_value_type);
+    goto error;
+    break;
+  }
+
+  va_end(ap);
+
+  BK_RETURN(B, 0);
+
+ error:
+  va_end(ap);
+  STATS_LIST_UNLOCK(bdsl, locked);
+
+  BK_RETURN(B, -1);
+}
+
+
+
 /**
  * Get the next value from the statistics list. If *bdsp == NULL, then get the firist value.
  *
@@ -1734,16 +1922,16 @@ bk_dynamic_stats_XML_create(bk_s B, bk_dynamic_stats_h stats_list, u_int priorit
     switch(bds->bds_value_type)
     {
     case DynamicStatsValueTypeInt32:
-      STAT_XML_OUTPUT(bds, "%d", bds->bds_int32);
+      STAT_XML_OUTPUT(bds, "%d", BK_ATOMIC_LOAD(&bds->bds_int32));
       break;
     case DynamicStatsValueTypeUInt32:
-      STAT_XML_OUTPUT(bds, "%u", bds->bds_uint32);
+      STAT_XML_OUTPUT(bds, "%u", BK_ATOMIC_LOAD(&bds->bds_uint32));
       break;
     case DynamicStatsValueTypeInt64:
-      STAT_XML_OUTPUT(bds, "%lld", (long long int)bds->bds_int64);
+      STAT_XML_OUTPUT(bds, "%lld", (long long int)BK_ATOMIC_LOAD(&bds->bds_int64));
       break;
     case DynamicStatsValueTypeUInt64:
-      STAT_XML_OUTPUT(bds, "%llu", (long long unsigned int)bds->bds_uint64);
+      STAT_XML_OUTPUT(bds, "%llu", (long long unsigned int)BK_ATOMIC_LOAD(&bds->bds_uint64));
       break;
     case DynamicStatsValueTypeFloat:
       STAT_XML_OUTPUT(bds, "%.4f", bds->bds_float);
@@ -1803,6 +1991,160 @@ bk_dynamic_stats_XML_create(bk_s B, bk_dynamic_stats_h stats_list, u_int priorit
 
 
 
+#define STAT_OPENMETRICS_VALUE(bds, value) (((bds)->bds_access_type == DynamicStatsAccessTypeDirect)?(value):*(typeof(value) *)((bds)->bds_ptr))
+
+/**
+ * Stream all the statistics at or above a particular priority level in
+ * OpenMetrics text format.  Each line is handed to @a output as it is
+ * generated, so no copy of the entire exposition is ever made.  Numeric
+ * stats are exported as gauges, string stats as info metrics.  A non-zero
+ * discriminator becomes a "discriminator" label.  The terminating "# EOF"
+ * is left to the caller, who may be combining several sources.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param stats_list The stats list from which to extract the values
+ *	@param priority The priority filter.
+ *	@param prefix A fixed string to prepend to all metric names (may be NULL)
+ *	@param output Callback to receive the exposition text
+ *	@param opaque Data for @a output
+ *	@param flags Flags for future use.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.<br>
+ *	@return <i>1</i> if @a output asked us to stop.
+ */
+int
+bk_dynamic_stats_openmetrics(bk_s B, bk_dynamic_stats_h stats_list, u_int priority, const char *prefix, bk_metrics_output_f output, void *opaque, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_dynamic_stats_list *bdsl = (struct bk_dynamic_stats_list *)stats_list;
+  struct bk_dynamic_stat *bds = NULL;
+  char family[1024];
+  char lastfamily[1024];
+  char labels[64];
+  char dbuf[64];
+  char *escaped = NULL;
+  int ret;
+  int locked = 0;
+
+  if (!bdsl || !output)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  lastfamily[0] = '\0';
+
+#ifdef BK_USING_PTHREADS
+#ifndef NO_THREAD_CPU_STAT
+  if (manage_thread_stats(B, bdsl, 0) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not manage thread stats\n");
+    goto error;
+  }
+#endif /* NO_THREAD_CPU_STAT */
+#endif /* BK_USING_PTHREADS */
+
+  STATS_LIST_LOCK(bdsl, locked);
+
+  if (bk_dynamic_stats_demand_update(B, bdsl, 0) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not run the statistics demand update\n");
+    goto error;
+  }
+
+  while((ret = bdsl_getnext(B, bdsl, &bds, priority, NULL, NULL, 0)) == 1)
+  {
+    // A pointer stat with nothing to point at has no value to report
+    if ((bds->bds_access_type == DynamicStatsAccessTypeIndirect) && !bds->bds_ptr)
+      continue;
+
+    if (bk_metrics_name(B, family, sizeof(family), prefix, bds->bds_name, NULL) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not create metric name for %s\n", bds->bds_name);
+      goto error;
+    }
+
+    // Stats sharing a name are adjacent, so each family is announced once
+    if (!BK_STREQ(family, lastfamily))
+    {
+      if ((ret = bk_metrics_emit(B, output, opaque, "# TYPE %s %s\n", family, (bds->bds_value_type == DynamicStatsValueTypeString)?"info":"gauge")))
+	goto stop;
+      snprintf(lastfamily, sizeof(lastfamily), "%s", family);
+    }
+
+    if (bds->bds_discriminator)
+      snprintf(labels, sizeof(labels), "{discriminator=\"%ld\"}", bds->bds_discriminator);
+    else
+      labels[0] = '\0';
+
+    switch(bds->bds_value_type)
+    {
+    case DynamicStatsValueTypeInt32:
+      ret = bk_metrics_emit(B, output, opaque, "%s%s %d\n", family, labels, STAT_OPENMETRICS_VALUE(bds, BK_ATOMIC_LOAD(&bds->bds_int32)));
+      break;
+    case DynamicStatsValueTypeUInt32:
+      ret = bk_metrics_emit(B, output, opaque, "%s%s %u\n", family, labels, STAT_OPENMETRICS_VALUE(bds, BK_ATOMIC_LOAD(&bds->bds_uint32)));
+      break;
+    case DynamicStatsValueTypeInt64:
+      ret = bk_metrics_emit(B, output, opaque, "%s%s %lld\n", family, labels, (long long int)STAT_OPENMETRICS_VALUE(bds, BK_ATOMIC_LOAD(&bds->bds_int64)));
+      break;
+    case DynamicStatsValueTypeUInt64:
+      ret = bk_metrics_emit(B, output, opaque, "%s%s %llu\n", family, labels, (long long unsigned int)STAT_OPENMETRICS_VALUE(bds, BK_ATOMIC_LOAD(&bds->bds_uint64)));
+      break;
+    case DynamicStatsValueTypeFloat:
+      ret = bk_metrics_emit(B, output, opaque, "%s%s %s\n", family, labels, bk_metrics_double(B, dbuf, sizeof(dbuf), STAT_OPENMETRICS_VALUE(bds, bds->bds_float)));
+      break;
+    case DynamicStatsValueTypeDouble:
+      ret = bk_metrics_emit(B, output, opaque, "%s%s %s\n", family, labels, bk_metrics_double(B, dbuf, sizeof(dbuf), STAT_OPENMETRICS_VALUE(bds, bds->bds_double)));
+      break;
+    case DynamicStatsValueTypeString:
+      if (!(escaped = bk_metrics_label_escape(B, STAT_OPENMETRICS_VALUE(bds, bds->bds_string)?:"", 0)))
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not escape string statistic\n");
+	goto error;
+      }
+      if (bds->bds_discriminator)
+	ret = bk_metrics_emit(B, output, opaque, "%s_info{discriminator=\"%ld\",value=\"%s\"} 1\n", family, bds->bds_discriminator, escaped);
+      else
+	ret = bk_metrics_emit(B, output, opaque, "%s_info{value=\"%s\"} 1\n", family, escaped);
+      free(escaped);
+      escaped = NULL;
+      break;
+    default:
+      bk_error_printf(B, BK_ERR_ERR,"Unknown type: %d\n", bds->bds_value_type);
+      goto error;
+      break;
+    }
+
+    if (ret)
+      goto stop;
+  }
+
+  if (ret < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not extract the fisrt or next stats value\n");
+    goto error;
+  }
+
+ stop:
+  if (ret < 0)
+    goto error;
+
+  STATS_LIST_UNLOCK(bdsl, locked);
+
+  BK_RETURN(B, ret);
+
+ error:
+  STATS_LIST_UNLOCK(bdsl, locked);
+
+  if (escaped)
+    free(escaped);
+
+  BK_RETURN(B, -1);
+}
+
+
+
 /**
  * Destroy the string created by bk_dynamic_stats_XML_create.
  *
@@ -53,12 +53,25 @@ struct file_lock_admin
 
 
 
+/**
+ * Slurped data, and how to give it back
+ */
+struct slurp
+{
+  bk_vptr		sl_data;		///< Data returned to caller (must be first)
+  size_t		sl_maplen;		///< Length of mapping, 0 if allocated
+};
+
+
+
 static struct file_lock_admin *lock_admin_file(bk_s B, const char *ipath, const char *iadmin_ext, const char *ilock_ext);
 static void unlock_admin_file(bk_s B, struct file_lock_admin *fla);
 static struct file_lock *fl_create(bk_s B);
 static void fl_destroy(bk_s B, struct file_lock *fl);
 static struct file_lock_admin *fla_create(bk_s B);
 static void fla_destroy(bk_s B, struct file_lock_admin *fla);
+static int slurp_read(bk_s B, struct slurp *sl, size_t *size, FILE *FH, int fd, int maxwastage);
+static int slurp_map(bk_s B, struct slurp *sl, int fd, bk_flags flags);
 
 
 
@@ -833,6 +846,13 @@ bk_fileutils_is_true_pipe(bk_s B, int fd, bk_flags flags)
 /**
  * Slurp a file--read it into on continuous chunk of memory
  *
+ * Regular files are read into a single allocation of the right size;
+ * pipes and the like grow geometrically, and are trimmed to within
+ * maxwastage at the end.  With BK_SLURP_MMAP, a regular file given as
+ * the only source is mapped read-only instead of copied, so the data
+ * must not be written to, and changes to the file may show through.
+ * Release the result with bk_slurp_free().
+ *
  * THREADS: MT-SAFE
  *
  * @param B Baka thread/global environment
@@ -840,17 +860,17 @@ bk_fileutils_is_true_pipe(bk_s B, int fd, bk_flags flags)
  * @param fd File description in place of filename (-1 to ignore)
  * @param filename Name of file to read (NULL to ignore)
  * @param maxwastage Maximum number of bytes to "waste" above potential file size (-1 to use defaults)
- * @param flags BK_SLURP_NULL_TERMINATE
+ * @param flags BK_SLURP_NULL_TERMINATE, BK_SLURP_MMAP
  * @return <i>NULL</i> on call failure, allocation failure, I/O failure
  * @return <br><i>Allocate vptr to file</i> on success
  */
 bk_vptr *bk_slurp(bk_s B, FILE *FH, int fd, const char *filename, int maxwastage, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  bk_vptr *ret = NULL;
-  int size = 0;
+  struct slurp *sl = NULL;
+  size_t size = 0;
+  int canmap;
   void *tmp;
-  int bytes;
 
   if (!filename && !FH && fd < 0)
   {
@@ -863,60 +883,32 @@ bk_vptr *bk_slurp(bk_s B, FILE *FH, int fd, const char *filename, int maxwastage
   else
     maxwastage++;
 
-  if (!BK_MALLOC(ret))
+  // Sources are concatenated, so only a lone one can be mapped
+  canmap = BK_FLAG_ISSET(flags, BK_SLURP_MMAP) && !FH && ((fd >= 0) != !!filename);
+
+  if (!BK_CALLOC(sl))
   {
     bk_error_printf(B, BK_ERR_ERR, "Could not allocate return structure: %s\n", strerror(errno));
     goto error;
   }
-  ret->ptr = NULL;
-  ret->len = 0;
 
-  while (FH && !feof(FH))
+  if (FH)
   {
-    size += maxwastage - (size-ret->len);
-
-    if (!(tmp = realloc(ret->ptr, size)))
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Could not increase file size to %d: %s\n", size, strerror(errno));
-      goto error;
-    }
-    ret->ptr = tmp;
-
-    if ((bytes = fread((char *)ret->ptr+ret->len, 1, size-ret->len, FH)) < 0)
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Error reading FILE: %s\n", strerror(errno));
+    if (slurp_read(B, sl, &size, FH, -1, maxwastage) < 0)
       goto error;
-    }
-    ret->len += bytes;
-    if (!bytes)
-      break;
-  }
-  if (FH)
     fclose(FH);
+  }
 
  againfd:
-  while (fd >= 0)
+  if (fd >= 0)
   {
-    size += maxwastage - (size-ret->len);
-
-    if (!(tmp = realloc(ret->ptr, size)))
+    if (!canmap || !slurp_map(B, sl, fd, flags))
     {
-      bk_error_printf(B, BK_ERR_ERR, "Could not increase file size to %d: %s\n", size, strerror(errno));
-      goto error;
-    }
-    ret->ptr = tmp;
-
-    if ((bytes = read(fd, (char *)ret->ptr+ret->len, size-ret->len)) < 0)
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Error reading fd: %s\n", strerror(errno));
-      goto error;
+      if (slurp_read(B, sl, &size, NULL, fd, maxwastage) < 0)
+	goto error;
     }
-    ret->len += bytes;
-    if (!bytes)
-      break;
-  }
-  if (fd >= 0)
     close(fd);
+  }
 
   if (filename)
   {
@@ -929,28 +921,189 @@ bk_vptr *bk_slurp(bk_s B, FILE *FH, int fd, const char *filename, int maxwastage
     goto againfd;
   }
 
-  if (BK_FLAG_ISSET(flags, BK_SLURP_NULL_TERMINATE))
+  // Mapped data is already terminated by the zeros filling its last page
+  if (!sl->sl_maplen && (size - sl->sl_data.len > (size_t)maxwastage || BK_FLAG_ISSET(flags, BK_SLURP_NULL_TERMINATE)))
   {
-    if (size-ret->len < 1)
+    if (size - sl->sl_data.len > (size_t)maxwastage || size == sl->sl_data.len)
     {
-      if (!(tmp = realloc(ret->ptr, size+1)))
+      size = sl->sl_data.len + 1;
+      if (!(tmp = realloc(sl->sl_data.ptr, size)))
       {
-	bk_error_printf(B, BK_ERR_ERR, "Could not increase file size to %d: %s\n", size, strerror(errno));
+	bk_error_printf(B, BK_ERR_ERR, "Could not resize file buffer to %zu: %s\n", size, strerror(errno));
 	goto error;
       }
-      ret->ptr = tmp;
+      sl->sl_data.ptr = tmp;
     }
-    ((char *)ret->ptr)[ret->len] = 0;
+    ((char *)sl->sl_data.ptr)[sl->sl_data.len] = 0;
   }
 
-  BK_RETURN(B, ret);
+  BK_RETURN(B, &sl->sl_data);
 
  error:
-  if (ret)
+  if (sl)
+    bk_slurp_free(B, &sl->sl_data);
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Release data returned by bk_slurp(), whether it was allocated or mapped.
+ *
+ * THREADS: MT-SAFE
+ *
+ * @param B Baka thread/global environment
+ * @param data Slurped data
+ */
+void bk_slurp_free(bk_s B, bk_vptr *data)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct slurp *sl = (struct slurp *)data;
+
+  if (!sl)
   {
-    if (ret->ptr)
-      free(ret->ptr);
-    free(ret);
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_VRETURN(B);
   }
-  BK_RETURN(B, NULL);
+
+  if (sl->sl_maplen)
+    munmap(sl->sl_data.ptr, sl->sl_maplen);
+  else if (sl->sl_data.ptr)
+    free(sl->sl_data.ptr);
+  free(sl);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Read the rest of a stdio handle or descriptor onto the end of the
+ * slurped data.  A regular file says how much is left, so the buffer
+ * is sized once (plus a byte, so the end is seen without growing);
+ * anything else, or a file that grows while we read it, doubles.
+ *
+ * THREADS: MT-SAFE
+ *
+ * @param B Baka thread/global environment
+ * @param sl Slurped data, extended
+ * @param size Allocated size of sl's buffer, updated
+ * @param FH Stdio file handle to read (NULL to use fd)
+ * @param fd File descriptor to read
+ * @param maxwastage Smallest growth step
+ * @return <i>-1</i> on allocation or I/O failure
+ * @return <br><i>0</i> on success
+ */
+static int slurp_read(bk_s B, struct slurp *sl, size_t *size, FILE *FH, int fd, int maxwastage)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  size_t need, bytes;
+  struct stat st;
+  ssize_t got;
+  off_t pos;
+  void *tmp;
+
+  need = sl->sl_data.len + maxwastage;
+  if (fstat(FH ? fileno(FH) : fd, &st) == 0 && S_ISREG(st.st_mode))
+  {
+    pos = FH ? ftello(FH) : lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0 && st.st_size > pos)
+      need = sl->sl_data.len + (st.st_size - pos) + 1;
+  }
+
+  for (;;)
+  {
+    if (need > *size)
+    {
+      if (!(tmp = realloc(sl->sl_data.ptr, need)))
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not increase file size to %zu: %s\n", need, strerror(errno));
+	BK_RETURN(B, -1);
+      }
+      sl->sl_data.ptr = tmp;
+      *size = need;
+    }
+
+    if (FH)
+    {
+      bytes = fread((char *)sl->sl_data.ptr + sl->sl_data.len, 1, *size - sl->sl_data.len, FH);
+      if (!bytes && ferror(FH))
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Error reading FILE: %s\n", strerror(errno));
+	BK_RETURN(B, -1);
+      }
+    }
+    else
+    {
+      if ((got = read(fd, (char *)sl->sl_data.ptr + sl->sl_data.len, *size - sl->sl_data.len)) < 0)
+      {
+	if (errno == EINTR)
+	  continue;
+	bk_error_printf(B, BK_ERR_ERR, "Error reading fd: %s\n", strerror(errno));
+	BK_RETURN(B, -1);
+      }
+      bytes = got;
+    }
+
+    if (!bytes)
+      break;
+    sl->sl_data.len += bytes;
+
+    if (sl->sl_data.len == *size)
+      need = *size + MAX(*size, (size_t)maxwastage);
+  }
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Map a regular file for bk_slurp(), read-only and faulted in up front.
+ * A file which would need a terminator past its last page, or which is
+ * empty or not being read from the start, is left to be read instead.
+ *
+ * THREADS: MT-SAFE
+ *
+ * @param B Baka thread/global environment
+ * @param sl Slurped data, which must be empty
+ * @param fd File descriptor to map
+ * @param flags BK_SLURP_NULL_TERMINATE
+ * @return <i>0</i> if the file should be read instead
+ * @return <br><i>1</i> if the file was mapped
+ */
+static int slurp_map(bk_s B, struct slurp *sl, int fd, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  int mapflags = MAP_PRIVATE;
+  struct stat st;
+  void *map;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      (off_t)(size_t)st.st_size != st.st_size || lseek(fd, 0, SEEK_CUR) != 0)
+    BK_RETURN(B, 0);
+
+  if (BK_FLAG_ISSET(flags, BK_SLURP_NULL_TERMINATE) && st.st_size % sysconf(_SC_PAGESIZE) == 0)
+    BK_RETURN(B, 0);
+
+#ifdef MAP_POPULATE
+  // Caller wants all of it, so take the page faults now, in bulk
+  mapflags |= MAP_POPULATE;
+#endif /* MAP_POPULATE */
+
+  if ((map = mmap(NULL, st.st_size, PROT_READ, mapflags, fd, 0)) == MAP_FAILED)
+  {
+    bk_error_printf(B, BK_ERR_WARN, "Could not map file, reading it instead: %s\n", strerror(errno));
+    BK_RETURN(B, 0);
+  }
+
+#if !defined(MAP_POPULATE) && defined(MADV_WILLNEED)
+  madvise(map, st.st_size, MADV_WILLNEED);
+#endif /* !MAP_POPULATE && MADV_WILLNEED */
+
+  sl->sl_data.ptr = map;
+  sl->sl_data.len = st.st_size;
+  sl->sl_maplen = st.st_size;
+
+  BK_RETURN(B, 1);
 }
@@ -99,6 +99,27 @@ void bk_fun_destroy(dict_h funstack)
  *	@return <br><i>encoded function info</i> on success
  */
 struct bk_funinfo *bk_fun_entry(bk_s B, const char *func, const char *package, const char *grp)
+{
+  return(bk_fun_entry_cached(B, func, package, grp, NULL));
+}
+
+
+
+/**
+ * Entering a function--record infomation, using a call site cache to
+ * avoid looking up the function's debug level every time.
+ *
+ * THREADS: MT-SAFE (assumes B is thread private)
+ *
+ *	@param B BAKA Thread/global state
+ *	@param func The name of the function we are in
+ *	@param package The name of the package we are in (typically filename)
+ *	@param grp The name of the group we are in (typically library)
+ *	@param cache Debug level cache private to this call site (may be NULL)
+ *	@return <i>NULL</i> if function tracing is not enabled, or on allocation failure
+ *	@return <br><i>encoded function info</i> on success
+ */
+struct bk_funinfo *bk_fun_entry_cached(bk_s B, const char *func, const char *package, const char *grp, struct bk_debug_cache *cache)
 {
   struct bk_funinfo *fh = NULL;
 
@@ -119,6 +140,9 @@ struct bk_funinfo *bk_fun_entry(bk_s B, const char *func, const char *package, c
   fh->bf_pkgname = package;
   fh->bf_grpname = grp;
   fh->bf_debuglevel = 0;
+  fh->bf_debuggen = 0;
+  fh->bf_debugcache = cache;
+  fh->bf_profdepth = 0;
 
   if (BK_BT_ISFUNSTATSON(B))
   {
@@ -148,6 +172,7 @@ void bk_fun_exit(bk_s B, struct bk_funinfo *fh)
 {
   struct bk_funinfo *cur = NULL;
   int save_errno = errno;
+  u_int profdepth;
 
   if (!fh)
   {
@@ -177,6 +202,7 @@ void bk_fun_exit(bk_s B, struct bk_funinfo *fh)
 
   if (cur)
   {
+    profdepth = fh->bf_profdepth;
     for(;cur;cur=fh)
     {
       if (fh = (struct bk_funinfo *)funstack_predecessor(BK_BT_FUNSTACK(B), cur))
@@ -185,6 +211,10 @@ void bk_fun_exit(bk_s B, struct bk_funinfo *fh)
       free(cur);
     }
     BK_BT_CURFUN(B) = (struct bk_funinfo *)funstack_minimum(BK_BT_FUNSTACK(B));
+
+    // Pop the sampling profiler shadow stack (and any implicit exits)
+    if (BK_BT_PROFILE(B))
+      BK_BT_PROFILE(B)->bpt_depth = profdepth;
   }
   else
   {
@@ -212,15 +242,23 @@ void bk_fun_reentry_i(bk_s B, struct bk_funinfo *fh)
 {
   if (B && fh)
   {
-    if (BK_GENERAL_FLAG_ISDEBUGON(B))
-      fh->bf_debuglevel = bk_debug_query(B, BK_GENERAL_DEBUG(B), fh->bf_funname, fh->bf_pkgname, fh->bf_grpname, 0);
-    else
-      fh->bf_debuglevel = 0;
+    bk_fun_debug_refresh(B, fh);
 
     if (funstack_insert(BK_BT_FUNSTACK(B), fh) != DICT_OK)
       bk_error_printf(B, BK_ERR_WARN, "Could not insert function stack frame: %s\n",funstack_error_reason(BK_BT_FUNSTACK(B), NULL));
 
     BK_BT_CURFUN(B) = fh;
+
+    if (BK_BT_PROFILE(B))
+    {
+      struct bk_profile_thread *bpt = BK_BT_PROFILE(B);
+
+      // Name first, then depth: a sample taken in between just misses this frame
+      fh->bf_profdepth = bpt->bpt_depth;
+      if (fh->bf_profdepth < BK_PROFILE_MAXDEPTH)
+	bpt->bpt_stack[fh->bf_profdepth] = fh->bf_funname;
+      bpt->bpt_depth = fh->bf_profdepth + 1;
+    }
   }
 }
 
@@ -313,10 +351,7 @@ int bk_fun_reset_debug(bk_s B, bk_flags flags)
 
   for(cur = (struct bk_funinfo *)funstack_minimum(BK_BT_FUNSTACK(B)); cur; cur = (struct bk_funinfo *)funstack_successor(BK_BT_FUNSTACK(B), cur))
   {
-    if (BK_GENERAL_FLAG_ISDEBUGON(B))
-      cur->bf_debuglevel = bk_debug_query(B, BK_GENERAL_DEBUG(B), cur->bf_funname, cur->bf_pkgname, cur->bf_grpname, 0);
-    else
-      cur->bf_debuglevel = 0;
+    bk_fun_debug_refresh(B, cur);
   }
 
   return(0);
@@ -324,6 +359,40 @@ int bk_fun_reset_debug(bk_s B, bk_flags flags)
 
 
 
+/**
+ * Recompute the debug level of a function frame.  Normally reached
+ * through BK_FUN_DEBUGLEVEL (and so bk_debug_and) when the debug levels
+ * have changed since the frame last looked, which is what lets debug
+ * levels be changed at runtime and take effect even in functions (like
+ * the run loop) which never return.
+ *
+ * THREADS: MT-SAFE (assumes B is thread private)
+ *
+ *	@param B BAKA Thread/global state
+ *	@param fh Function frame to refresh
+ *	@return <i>debug level</i> now in effect for @a fh
+ */
+u_int32_t bk_fun_debug_refresh(bk_s B, struct bk_funinfo *fh)
+{
+  u_int32_t generation;
+
+  if (!B || !fh)
+    return(0);
+
+  generation = BK_ATOMIC_LOAD(&BkDebugGeneration);
+
+  if (BK_GENERAL_FLAG_ISDEBUGON(B))
+    fh->bf_debuglevel = bk_debug_query_cached(B, BK_GENERAL_DEBUG(B), fh->bf_debugcache, fh->bf_funname, fh->bf_pkgname, fh->bf_grpname, 0);
+  else
+    fh->bf_debuglevel = 0;
+
+  fh->bf_debuggen = generation;
+
+  return(fh->bf_debuglevel);
+}
+
+
+
 /**
  * Discover the function name of my nth ancestor in the function stack
  *
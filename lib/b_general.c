@@ -26,6 +26,7 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 static struct bk_proctitle *bk_general_proctitle_init(bk_s B, int argc, char ***argv, char ***envp, char **program, bk_flags flags);
 static void bk_general_proctitle_destroy(bk_s B, struct bk_proctitle *bkp, bk_flags flags);
+static void bk_general_config_reinit(bk_s B, void *opaque, u_int other);
 #if 0 /* GCC 4.2.2 dislikes this and we don't use BSD any more anyhow */
 #if #system(bsd) && !defined(HAVE_NSGETENVIRON)
 char **environ __attribute__ ((weak));
@@ -131,7 +132,8 @@ bk_s bk_general_init(int argc, char ***argv, char ***envp, const char *configfil
   // Config files should not be required, generally
   B->bt_general->bg_config = bk_config_init(B, configfile, bcup, 0);
 
-  // <TODO>Should register config with reinit</TODO>
+  if (bk_general_reinit_insert(B, bk_general_config_reinit, NULL) < 0)
+    goto error;
 
   if (!(B->bt_general->bg_proctitle = bk_general_proctitle_init(B, argc, argv, envp, &program, 0)))
     goto error;
@@ -187,6 +189,9 @@ void bk_general_destroy(bk_s B)
       bk_threadlist_destroy(B, BK_GENERAL_TLIST(B), 0);
 #endif /*BK_USING_PTHREADS*/
 
+      if (BK_GENERAL_PROFILE(B))
+	bk_profile_destroy(B, BK_GENERAL_PROFILE(B));
+
       if (BK_GENERAL_PROCTITLE(B))
 	bk_general_proctitle_destroy(B, BK_GENERAL_PROCTITLE(B), 0);
 
@@ -236,6 +241,28 @@ void bk_general_reinit(bk_s B)
 
 
 
+/**
+ * Reinit callback for the general configuration (reload config files).
+ * Values handed out before stay valid until bk_config_reclaim().
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/global information
+ *	@param opaque Unused
+ *	@param other Unused
+ */
+static void bk_general_config_reinit(bk_s B, void *opaque, u_int other)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (BK_GENERAL_CONFIG(B))
+    bk_config_reinit(B, BK_GENERAL_CONFIG(B));
+
+  BK_VRETURN(B);
+}
+
+
+
 /**
  * Add to the reinitialization database
  *
@@ -441,6 +468,9 @@ void bk_general_thread_destroy(bk_s B)
       BK_BT_FUNSTATS(B) = NULL;
     }
 
+    if (BK_BT_PROFILE(B))
+      bk_profile_thread_stop(B);
+
 
     if (BK_BT_FUNSTACK(B))
       bk_fun_destroy(BK_BT_FUNSTACK(B));
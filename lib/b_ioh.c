@@ -557,6 +557,7 @@ struct bk_ioh *bk_ioh_init_std(bk_s B, int fdin, int fdout, bk_iohhandler_f hand
  *	@param readfun The function to use to read data.
  *	@param writefun The function to use to write data
  *	@param closefun The function to use to close fds
+ *	       -- called with both fds -1 when the ioh is closed with BK_IOH_DONTCLOSEFDS, so it can release its state
  *	@param iofunopaque The opaque data for the I/O functions
  *	@param handler The user callback to notify on complete I/O or other events
  *	@param opaque The opaque data for the user callback.
@@ -1441,6 +1442,9 @@ static void bk_ioh_destroy(bk_s B, struct bk_ioh *ioh)
     {
       bk_ioh_fdctl(B, ioh->ioh_fdout, &ioh->ioh_fdout_savestate, IOH_FDCTL_RESET);
     }
+
+    // Let the close function release its state without closing anything
+    (*ioh->ioh_closefun)(B, ioh, ioh->ioh_iofunopaque, -1, -1, 0);
   }
 
   ioh_flush_queue(B, ioh, &ioh->ioh_readq, NULL, IOH_FLUSH_DESTROY);
@@ -81,6 +81,7 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 /* forward declaration */
 static void Transform (u_int32_t *buf, u_int32_t *in);
+static void Decode (u_int32_t *out, const unsigned char *in, unsigned int len);
 
 
 static const unsigned char PADDING[64] = {
@@ -176,7 +177,7 @@ void bk_MD5Update(bk_s B, bk_MD5_CTX *mdContext, const unsigned char *inBuf, uns
 {
   u_int32_t in[16];
   int mdi;
-  unsigned int i, ii;
+  unsigned int n;
 
   if (!mdContext || !inBuf)
   {
@@ -185,11 +186,6 @@ void bk_MD5Update(bk_s B, bk_MD5_CTX *mdContext, const unsigned char *inBuf, uns
     BK_VRETURN(B);
   }
 
-#ifdef __INSURE__
-  // Probably no longer needed with recent USE_MEM_ENTROPY changes to b_rand.c
-  memset(in, 0, sizeof(in));
-#endif
-
   /* compute number of bytes mod 64 */
   mdi = (int)((mdContext->i[0] >> 3) & 0x3F);
 
@@ -199,23 +195,27 @@ void bk_MD5Update(bk_s B, bk_MD5_CTX *mdContext, const unsigned char *inBuf, uns
   mdContext->i[0] += ((u_int32_t)inLen << 3);
   mdContext->i[1] += ((u_int32_t)inLen >> 29);
 
-  while (inLen--)
+  /* top up a partial block first */
+  if (mdi)
   {
-    /* add new character to buffer, increment mdi */
-    mdContext->in[mdi++] = *inBuf++;
-
-    /* transform if necessary */
-    if (mdi == 0x40)
-    {
-      for (i = 0, ii = 0; i < 16; i++, ii += 4)
-	in[i] = (((u_int32_t)mdContext->in[ii+3]) << 24) |
-	  (((u_int32_t)mdContext->in[ii+2]) << 16) |
-	  (((u_int32_t)mdContext->in[ii+1]) << 8) |
-	  ((u_int32_t)mdContext->in[ii]);
-      Transform (mdContext->buf, in);
-      mdi = 0;
-    }
+    n = MIN(0x40 - (unsigned int)mdi, inLen);
+    memcpy(mdContext->in + mdi, inBuf, n);
+    inBuf += n;
+    inLen -= n;
+    if (mdi + n < 0x40)
+      return;
+    Decode(in, mdContext->in, 16);
+    Transform(mdContext->buf, in);
   }
+
+  /* whole blocks straight from the caller's buffer */
+  for (; inLen >= 0x40; inBuf += 0x40, inLen -= 0x40)
+  {
+    Decode(in, inBuf, 16);
+    Transform(mdContext->buf, in);
+  }
+
+  memcpy(mdContext->in, inBuf, inLen);
 }
 
 
@@ -257,11 +257,7 @@ void bk_MD5Final(bk_s B, bk_MD5_CTX *mdContext)
   bk_MD5Update (B, mdContext, (unsigned char *)PADDING, padLen);
 
   /* append length in bits and transform */
-  for (i = 0, ii = 0; i < 14; i++, ii += 4)
-    in[i] = (((u_int32_t)mdContext->in[ii+3]) << 24) |
-      (((u_int32_t)mdContext->in[ii+2]) << 16) |
-      (((u_int32_t)mdContext->in[ii+1]) << 8) |
-      ((u_int32_t)mdContext->in[ii]);
+  Decode(in, mdContext->in, 14);
   Transform (mdContext->buf, in);
 
   /* store buffer in digest */
@@ -383,6 +379,21 @@ static void Transform(u_int32_t *buf, u_int32_t *in)
 
 
 
+/*
+ * Decodes input (unsigned char) into output (u_int32_t), little-endian
+ * whatever the host order.  len is in words.
+ */
+static void Decode(u_int32_t *out, const unsigned char *in, unsigned int len)
+{
+  unsigned int i;
+
+  for (i = 0; i < len; i++, in += 4)
+    out[i] = ((u_int32_t)in[0]) | (((u_int32_t)in[1]) << 8) |
+      (((u_int32_t)in[2]) << 16) | (((u_int32_t)in[3]) << 24);
+}
+
+
+
 /**
  * Extract an MD5 context into a printable string of binary digits.
  *
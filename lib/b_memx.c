@@ -22,6 +22,16 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
  * Alex sez: we need an accessor function for bm_curused(definitely) and bm_unitsize(maybe).
  *
  * Seth sez: we already have one (for curused at least).  See bk_memx_get.
+ *
+ * A memx created with BK_MEMX_SEGMENTED never moves its elements.  It
+ * grows by adding chunks of @a incr_hint elements (or more, for a larger
+ * request), and lopping from the front frees whole chunks instead of
+ * sliding the remainder down.  Each allocation is still contiguous, so a
+ * request which does not fit in the rest of the last chunk starts a new
+ * one; the elements as a whole are a list of segments which can be
+ * walked with bk_memx_segment() or handed to writev(2) with
+ * bk_memx_iovec().  Looking up an old element by index is a binary
+ * search of the segments rather than an array index.
  */
 
 #include <libbk.h>
@@ -29,6 +39,19 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 
 
+/**
+ * One chunk of a segmented memx
+ */
+struct bk_memx_seg
+{
+  char *	bms_base;			///< Chunk memory
+  size_t	bms_seq;			///< Sequence number (since creation) of first element
+  size_t	bms_used;			///< Elements stored in chunk
+  size_t	bms_alloc;			///< Elements chunk can hold
+};
+
+
+
 /**
  * Information about an extensible buffer being managed
  */
@@ -40,8 +63,23 @@ struct bk_memx
   size_t	bm_curused;			///< Current used
   u_int		bm_incr;			///< Increment amount
   bk_flags	bm_flags;			///< Fun for the future
+  struct bk_memx_seg *bm_segs;			///< Segment directory (segmented)
+  u_int		bm_seghead;			///< First live segment (segmented)
+  u_int		bm_segtail;			///< One past last live segment (segmented)
+  u_int		bm_segalloc;			///< Size of segment directory (segmented)
+  size_t	bm_headoff;			///< Elements lopped from first segment (segmented)
+  char		*bm_spare;			///< Free chunk of bm_incr elements kept for reuse (segmented)
 };
 
+#define BM_SEGMENTED(bm)	BK_FLAG_ISSET((bm)->bm_flags, BK_MEMX_SEGMENTED) ///< Is this a segmented memx
+#define BM_NSEGS(bm)		((bm)->bm_segtail - (bm)->bm_seghead) ///< Number of live segments
+
+
+
+static struct bk_memx_seg *memx_seg_add(bk_s B, struct bk_memx *bm, size_t count);
+static void memx_seg_free(struct bk_memx *bm, struct bk_memx_seg *seg);
+static struct bk_memx_seg *memx_seg_find(struct bk_memx *bm, size_t seq);
+
 
 const size_t bk_memx_size = sizeof(struct bk_memx);
 
@@ -54,7 +92,8 @@ const size_t bk_memx_size = sizeof(struct bk_memx);
  *	@param objsize Object size in bytes/octets
  *	@param start_hint Number of objects to start out with
  *	@param incr_hint Number of objects to grow when more are needed
- *	@param flags Fun for the future
+ *		(the chunk size for BK_MEMX_SEGMENTED)
+ *	@param flags BK_MEMX_SEGMENTED to grow by adding chunks instead of realloc
  *	@return <i>NULL</i> on call failure, allocation failure
  *	@return <br><i>Buffer handle</i> on success
  */
@@ -72,7 +111,7 @@ struct bk_memx *bk_memx_create(bk_s B, size_t unitsize, u_int start_hint, u_int
   if (start_hint < 1) start_hint = 1;
   if (incr_hint < 1) incr_hint = 1;
 
-  if (!(ret = malloc(sizeof *ret)))
+  if (!(ret = calloc(1, sizeof *ret)))
   {
     bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory manager: %s\n",strerror(errno));
     BK_RETURN(B, NULL);
@@ -82,6 +121,17 @@ struct bk_memx *bk_memx_create(bk_s B, size_t unitsize, u_int start_hint, u_int
   ret->bm_incr = incr_hint;
   ret->bm_flags = flags;
 
+  if (BM_SEGMENTED(ret))
+  {
+    if (!memx_seg_add(B, ret, start_hint))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate initial segment\n");
+      goto error;
+    }
+    ret->bm_array = ret->bm_segs[0].bms_base;
+    BK_RETURN(B, ret);
+  }
+
   if (!(ret->bm_array = malloc(unitsize * start_hint)))
   {
     bk_error_printf(B, BK_ERR_ERR, "Could not allocate initial memory: %s\n",strerror(errno));
@@ -108,7 +158,7 @@ struct bk_memx *bk_memx_create(bk_s B, size_t unitsize, u_int start_hint, u_int
  *	@param bm Buffer management handle
  *	@param flags BK_MEMX_PRESERVE_ARRAY if the allocated memory
  *		must live on (will be free'd later) but the dynamic buffer
- *		management side should still go away
+ *		management side should still go away (ignored if segmented)
  */
 void bk_memx_destroy(bk_s B, struct bk_memx *bm, bk_flags flags)
 {
@@ -120,7 +170,17 @@ void bk_memx_destroy(bk_s B, struct bk_memx *bm, bk_flags flags)
     BK_VRETURN(B);
   }
 
-  if (bm->bm_array && BK_FLAG_ISCLEAR(flags, BK_MEMX_PRESERVE_ARRAY))
+  if (BM_SEGMENTED(bm))
+  {
+    // There is no single array to preserve, so all of it goes
+    while (BM_NSEGS(bm))
+      memx_seg_free(bm, &bm->bm_segs[--bm->bm_segtail]);
+    if (bm->bm_spare)
+      free(bm->bm_spare);
+    if (bm->bm_segs)
+      free(bm->bm_segs);
+  }
+  else if (bm->bm_array && BK_FLAG_ISCLEAR(flags, BK_MEMX_PRESERVE_ARRAY))
     free(bm->bm_array);
   free(bm);
 
@@ -160,6 +220,42 @@ void *bk_memx_get(bk_s B, struct bk_memx *bm, u_int count, u_int *curused, bk_fl
     BK_RETURN(B, NULL);
   }
 
+  if (BM_SEGMENTED(bm))
+  {
+    struct bk_memx_seg *seg = BM_NSEGS(bm) ? &bm->bm_segs[bm->bm_segtail - 1] : NULL;
+
+    if (BK_FLAG_ISSET(flags, BK_MEMX_GETNEW))
+    {						/* Want "new" allocation */
+      if (!seg || seg->bms_alloc - seg->bms_used < count)
+      {
+	if (!(seg = memx_seg_add(B, bm, count)))
+	{
+	  bk_error_printf(B, BK_ERR_ERR, "Could not add segment: %s\n",strerror(errno));
+	  BK_RETURN(B, NULL);
+	}
+      }
+
+      ret = seg->bms_base + seg->bms_used * bm->bm_unitsize;
+      seg->bms_used += count;
+      bm->bm_curused += count;
+
+      if (curused) *curused = bm->bm_curused;
+    }
+    else if (count == bm->bm_curused)
+    {						/* One past the end */
+      ret = seg ? seg->bms_base + seg->bms_used * bm->bm_unitsize : NULL;
+    }
+    else
+    {						/* Want existing record */
+      size_t seq = bm->bm_segs[bm->bm_seghead].bms_seq + bm->bm_headoff + count;
+
+      seg = memx_seg_find(bm, seq);
+      ret = seg->bms_base + (seq - seg->bms_seq) * bm->bm_unitsize;
+    }
+
+    BK_RETURN(B,ret);
+  }
+
   if (BK_FLAG_ISSET(flags, BK_MEMX_GETNEW))
   {						/* Want "new" allocation */
     if (bm->bm_curused + count > bm->bm_curalloc)
@@ -214,8 +310,33 @@ int bk_memx_trunc(bk_s B, struct bk_memx *bm, u_int count, bk_flags flags)
     BK_RETURN(B, -1);
   }
 
-  if (count < bm->bm_curused)
-    bm->bm_curused = count;
+  if (count >= bm->bm_curused)
+    BK_RETURN(B, 0);
+
+  if (BM_SEGMENTED(bm))
+  {
+    size_t remove = bm->bm_curused - count;
+    struct bk_memx_seg *seg;
+
+    // Free whole segments off the end, keeping the first
+    while (remove)
+    {
+      seg = &bm->bm_segs[bm->bm_segtail - 1];
+      if (BM_NSEGS(bm) > 1 && remove >= seg->bms_used)
+      {
+	remove -= seg->bms_used;
+	memx_seg_free(bm, seg);
+	bm->bm_segtail--;
+      }
+      else
+      {
+	seg->bms_used -= remove;
+	remove = 0;
+      }
+    }
+  }
+
+  bm->bm_curused = count;
 
   BK_RETURN(B, 0);
 }
@@ -224,7 +345,8 @@ int bk_memx_trunc(bk_s B, struct bk_memx *bm, u_int count, bk_flags flags)
 
 
 /**
- * Lop off the front of a memx and slide the contents down. This is expensive.
+ * Lop off the front of a memx and slide the contents down. This is expensive,
+ * unless the memx is segmented, in which case consumed chunks are just freed.
  *
  * THREADS: MT-SAFE (as long as bm is thread-private)
  *
@@ -240,12 +362,39 @@ bk_memx_lop(bk_s B, struct bk_memx *bm, u_int count, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
 
-  if (!bm)
+  if (!bm || count > bm->bm_curused)
   {
     bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
     BK_RETURN(B, -1);
   }
 
+  if (BM_SEGMENTED(bm))
+  {
+    struct bk_memx_seg *seg;
+
+    bm->bm_headoff += count;
+    bm->bm_curused -= count;
+
+    // Free segments which have been entirely consumed, keeping the last
+    while (BM_NSEGS(bm) > 1 && bm->bm_headoff >= (seg = &bm->bm_segs[bm->bm_seghead])->bms_used)
+    {
+      bm->bm_headoff -= seg->bms_used;
+      memx_seg_free(bm, seg);
+      bm->bm_seghead++;
+    }
+
+    // Once everything is consumed the last segment starts over
+    if (!bm->bm_curused)
+    {
+      seg = &bm->bm_segs[bm->bm_seghead];
+      seg->bms_seq += seg->bms_used;
+      seg->bms_used = 0;
+      bm->bm_headoff = 0;
+    }
+
+    BK_RETURN(B,0);
+  }
+
   // if lopping off less than half the current used bytes, overlap will occur
   memmove(bm->bm_array, (char *)bm->bm_array + count * bm->bm_unitsize, (bm->bm_curused - count) * bm->bm_unitsize);
   bm->bm_curused -= count;
@@ -282,6 +431,12 @@ int bk_memx_addstr(bk_s B, struct bk_memx *bm, char *str, bk_flags flags)
     BK_RETURN(B, -1);
   }
 
+  if (BM_SEGMENTED(bm))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "A segmented memx cannot hold a single string\n");
+    BK_RETURN(B, -1);
+  }
+
   len = strlen(str);
 
   if (bm->bm_curused)
@@ -354,7 +509,7 @@ int bk_memx_append(bk_s B, struct bk_memx *bm, const void *data, u_int count, bk
  *
  *	@param B BAKA thread/global state.
  *	@param bm The memx from which to extract information.
- *	@param arrayp C/O array pointer
+ *	@param arrayp C/O array pointer (first segment if segmented)
  *	@param unitsizep C/O unit size.
  *	@param curallocp C/O current allocation.
  *	@param curused C/O current used.
@@ -375,7 +530,7 @@ bk_memx_info(bk_s B, struct bk_memx *bm, void **arrayp, size_t *unitesizep, size
     BK_RETURN(B, -1);
   }
 
-  if (arrayp) *arrayp = bm->bm_array;
+  if (arrayp) *arrayp = BM_SEGMENTED(bm) ? bk_memx_segment(B, bm, 0, NULL, 0) : bm->bm_array;
   if (unitesizep) *unitesizep = bm->bm_unitsize;
   if (curallocp) *curallocp = bm->bm_curalloc;
   if (curusedp) *curusedp = bm->bm_curused;
@@ -384,3 +539,204 @@ bk_memx_info(bk_s B, struct bk_memx *bm, void **arrayp, size_t *unitesizep, size
 
   BK_RETURN(B, 0);
 }
+
+
+
+/**
+ * Return one of the contiguous runs of elements making up a memx, in
+ * order.  An ordinary memx has just the one; a segmented memx has one
+ * per chunk in use.
+ *
+ * THREADS: MT-SAFE (as long as bm is thread-private)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bm Buffer management handle
+ *	@param segno Which segment, counting from 0
+ *	@param countp Optional copy-out of the number of elements in segment
+ *	@param flags Fun for the future
+ *	@return <i>NULL</i> on call failure or if there is no such segment.<br>
+ *	@return <i>first element of segment</i> on success.
+ */
+void *bk_memx_segment(bk_s B, struct bk_memx *bm, u_int segno, u_int *countp, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_memx_seg *seg;
+  size_t skip;
+
+  if (countp) *countp = 0;
+
+  if (!bm)
+  {
+    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!bm->bm_curused)
+    BK_RETURN(B, NULL);
+
+  if (!BM_SEGMENTED(bm))
+  {
+    if (segno)
+      BK_RETURN(B, NULL);
+    if (countp) *countp = bm->bm_curused;
+    BK_RETURN(B, bm->bm_array);
+  }
+
+  if (segno >= BM_NSEGS(bm))
+    BK_RETURN(B, NULL);
+
+  seg = &bm->bm_segs[bm->bm_seghead + segno];
+  skip = segno ? 0 : bm->bm_headoff;
+
+  if (countp) *countp = seg->bms_used - skip;
+  BK_RETURN(B, seg->bms_base + skip * bm->bm_unitsize);
+}
+
+
+
+/**
+ * Describe the contents of a memx as an iovec array for writev(2).
+ * Fewer entries than there are segments may be supplied, in which case
+ * only the first part of the memx is described.
+ *
+ * THREADS: MT-SAFE (as long as bm is thread-private)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bm Buffer management handle
+ *	@param iov Array to fill in
+ *	@param iovcnt Number of entries in iov
+ *	@param flags Fun for the future
+ *	@return <i>-1</i> on call failure.<br>
+ *	@return <i>number of iov entries used</i> on success.
+ */
+int bk_memx_iovec(bk_s B, struct bk_memx *bm, struct iovec *iov, int iovcnt, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  u_int count;
+  void *base;
+  int cnt;
+
+  if (!bm || !iov || iovcnt < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (cnt = 0; cnt < iovcnt && (base = bk_memx_segment(B, bm, cnt, &count, 0)); cnt++)
+  {
+    iov[cnt].iov_base = base;
+    iov[cnt].iov_len = count * bm->bm_unitsize;
+  }
+
+  BK_RETURN(B, cnt);
+}
+
+
+
+/**
+ * Add a chunk with room for at least count elements to the end of a
+ * segmented memx.  Chunks of the standard size are recycled.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bm Buffer management handle
+ *	@param count Elements needed
+ *	@return <i>NULL</i> on allocation failure.<br>
+ *	@return <i>new last segment</i> on success.
+ */
+static struct bk_memx_seg *memx_seg_add(bk_s B, struct bk_memx *bm, size_t count)
+{
+  struct bk_memx_seg *seg, *tmp;
+  size_t alloc = MAX(bm->bm_incr, count);
+  u_int nsegs = BM_NSEGS(bm);
+
+  if (bm->bm_segtail == bm->bm_segalloc)
+  {
+    if (bm->bm_seghead > bm->bm_segalloc / 2)
+    {
+      // Mostly lopped: slide the directory down rather than grow it
+      memmove(bm->bm_segs, bm->bm_segs + bm->bm_seghead, nsegs * sizeof(*bm->bm_segs));
+    }
+    else
+    {
+      if (!(tmp = realloc(bm->bm_segs, (bm->bm_segalloc * 2 + 8) * sizeof(*bm->bm_segs))))
+	return(NULL);
+      bm->bm_segs = tmp;
+      bm->bm_segalloc = bm->bm_segalloc * 2 + 8;
+      if (bm->bm_seghead)
+	memmove(bm->bm_segs, bm->bm_segs + bm->bm_seghead, nsegs * sizeof(*bm->bm_segs));
+    }
+    bm->bm_seghead = 0;
+    bm->bm_segtail = nsegs;
+  }
+
+  seg = &bm->bm_segs[bm->bm_segtail];
+
+  if (alloc == bm->bm_incr && bm->bm_spare)
+  {
+    seg->bms_base = bm->bm_spare;
+    bm->bm_spare = NULL;
+  }
+  else if (!(seg->bms_base = malloc(alloc * bm->bm_unitsize)))
+  {
+    return(NULL);
+  }
+
+  seg->bms_alloc = alloc;
+  seg->bms_used = 0;
+  seg->bms_seq = nsegs ? seg[-1].bms_seq + seg[-1].bms_used : 0;
+  bm->bm_curalloc += alloc;
+  bm->bm_segtail++;
+
+  return(seg);
+}
+
+
+
+/**
+ * Free the memory of a segment (keeping one standard chunk as a spare).
+ * The caller removes it from the directory.
+ *
+ *	@param bm Buffer management handle
+ *	@param seg Segment being removed
+ */
+static void memx_seg_free(struct bk_memx *bm, struct bk_memx_seg *seg)
+{
+  bm->bm_curalloc -= seg->bms_alloc;
+
+  if (seg->bms_alloc == bm->bm_incr && !bm->bm_spare)
+    bm->bm_spare = seg->bms_base;
+  else
+    free(seg->bms_base);
+
+  seg->bms_base = NULL;
+}
+
+
+
+/**
+ * Find the segment holding an element, by binary search.  The element
+ * must be in the memx.
+ *
+ *	@param bm Buffer management handle
+ *	@param seq Sequence number of element
+ *	@return <i>segment</i> holding element
+ */
+static struct bk_memx_seg *memx_seg_find(struct bk_memx *bm, size_t seq)
+{
+  u_int lo = bm->bm_seghead, hi = bm->bm_segtail - 1, mid;
+
+  // Appending and consuming mostly touch the ends
+  if (seq >= bm->bm_segs[hi].bms_seq)
+    return(&bm->bm_segs[hi]);
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo + 1) / 2;
+    if (bm->bm_segs[mid].bms_seq <= seq)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return(&bm->bm_segs[lo]);
+}
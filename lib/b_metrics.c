@@ -0,0 +1,971 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ * OpenMetrics (Prometheus) text exposition of dynamic statistics and
+ * performance statistics, plus a tiny HTTP/1.0 endpoint which runs on a
+ * bk_run loop and serves it.
+ *
+ * The response is never assembled as one string.  The serializers hand
+ * each line to an output callback, which packs lines into fixed size
+ * chunks and queues each chunk on the connection's ioh as soon as it
+ * fills.  The total response is capped (so a huge stats list cannot
+ * consume unbounded memory or CPU inside the run loop), and the cost of
+ * generating every response is tracked and exported with the rest of
+ * the metrics.
+ */
+
+#include <libbk.h>
+#include "libbk_internal.h"
+
+
+
+#define BK_METRICS_MAXLINE	4096		///< Largest single exposition line
+#define BK_METRICS_CHUNK	32768		///< Size of each buffer handed to the ioh output queue
+#define BK_METRICS_MAXREQUEST	8192		///< Largest HTTP request header we will accept
+#define BK_METRICS_DEFMAXBYTES	(1024*1024)	///< Default response size budget
+#define BK_METRICS_CONTENT_TYPE	"application/openmetrics-text; version=1.0.0; charset=utf-8" ///< What we serve
+#define BK_METRICS_PATH		"/metrics"	///< Where we serve it
+
+
+
+/**
+ * A metrics server
+ */
+struct bk_metrics_server
+{
+  struct bk_run	       *bms_run;		///< Run loop we live on
+  void		       *bms_server;		///< Listening server handle
+  bk_dynamic_stats_h	bms_stats;		///< Dynamic stats to export (optional)
+  struct bk_stat_list  *bms_blist;		///< Performance stats to export (optional)
+  char		       *bms_prefix;		///< Prefix for all metric names
+  u_int			bms_priority;		///< Dynamic stats priority filter
+  u_int32_t		bms_maxbytes;		///< Response size budget
+  struct bk_stat_node  *bms_scrape_stat;	///< Cost of generating each response
+  u_quad_t		bms_scrapes;		///< Responses generated
+  u_quad_t		bms_bytes;		///< Response bytes queued
+  u_quad_t		bms_truncations;	///< Responses which hit the budget
+  u_quad_t		bms_errors;		///< Bad requests and failed responses
+  dict_h		bms_conns;		///< Active connections
+  bk_flags		bms_flags;		///< Caller's flags
+  bk_flags		bms_intflags;		///< Internal state
+#define BMS_INTFLAG_DESTROYING	0x1		///< Server is being torn down
+};
+
+
+
+/**
+ * One client connection to a metrics server
+ */
+struct bk_metrics_conn
+{
+  struct bk_metrics_server *bmc_bms;		///< Owning server (NULL once server is gone)
+  struct bk_ioh	       *bmc_ioh;		///< Connection ioh
+  char		       *bmc_chunk;		///< Chunk currently being filled
+  u_int32_t		bmc_chunklen;		///< Amount of chunk filled
+  u_int32_t		bmc_sent;		///< Response bytes queued so far
+  u_int32_t		bmc_reqlen;		///< Amount of request header read
+  char			bmc_request[BK_METRICS_MAXREQUEST+1]; ///< Request header
+  bk_flags		bmc_flags;		///< Everyone needs flags
+#define BMC_FLAG_RESPONDED	0x1		///< Response has been queued
+#define BMC_FLAG_TRUNCATED	0x2		///< Response hit the size budget
+#define BMC_FLAG_CLOSING	0x4		///< ioh close has been requested
+};
+
+
+
+/**
+ * Flag to metrics_output: this text must be sent even if over budget
+ */
+#define BMC_OUTPUT_FORCE	0x10000
+
+
+
+/**
+ * @name Defines: bmsc_clc
+ * Active connection list CLC definitions
+ * to hide CLC choice.
+ */
+// @{
+#define bmsc_create(o,k,f)		dll_create((o),(k),(f))
+#define bmsc_destroy(h)			dll_destroy(h)
+#define bmsc_insert(h,o)		dll_insert((h),(o))
+#define bmsc_delete(h,o)		dll_delete((h),(o))
+#define bmsc_minimum(h)			dll_minimum(h)
+#define bmsc_successor(h,o)		dll_successor((h),(o))
+#define bmsc_error_reason(h,i)		dll_error_reason((h),(i))
+// @}
+
+
+
+static int metrics_accept(bk_s B, void *args, int sock, struct bk_addrgroup *bag, void *server_handle, bk_addrgroup_state_e state);
+static void metrics_iohhandler(bk_s B, bk_vptr *data, void *opaque, struct bk_ioh *ioh, bk_ioh_status_e state);
+static int metrics_request(bk_s B, struct bk_metrics_conn *bmc);
+static int metrics_respond(bk_s B, struct bk_metrics_conn *bmc, int head);
+static int metrics_output(bk_s B, void *opaque, const char *buf, size_t len, bk_flags flags);
+static int metrics_flush(bk_s B, struct bk_metrics_conn *bmc);
+static int metrics_self(bk_s B, struct bk_metrics_server *bms, struct bk_metrics_conn *bmc);
+static void metrics_close(bk_s B, struct bk_metrics_conn *bmc, bk_flags flags);
+static void bmc_destroy(bk_s B, struct bk_metrics_conn *bmc);
+
+
+
+/**
+ * Build a legal OpenMetrics metric name out of a prefix, an arbitrary
+ * stat name, and a suffix.  Characters which are illegal in a metric name
+ * are mapped to '_'.  Overly long names are truncated.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param buf Output buffer
+ *	@param len Size of @a buf
+ *	@param prefix Prefix (may be NULL)
+ *	@param name Base name
+ *	@param suffix Suffix (may be NULL)
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+int
+bk_metrics_name(bk_s B, char *buf, size_t len, const char *prefix, const char *name, const char *suffix)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const char *parts[3];
+  const char *cur;
+  size_t used = 0;
+  u_int cnt;
+
+  if (!buf || len < 2 || !name)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  parts[0] = prefix;
+  parts[1] = name;
+  parts[2] = suffix;
+
+  for (cnt = 0; cnt < 3; cnt++)
+  {
+    if (!parts[cnt])
+      continue;
+
+    for (cur = parts[cnt]; *cur && used < len - 1; cur++)
+    {
+      if (isalpha((u_char)*cur) || *cur == '_' || *cur == ':' || (used && isdigit((u_char)*cur)))
+	buf[used++] = *cur;
+      else if (!used && isdigit((u_char)*cur))
+      {						// Names may not start with a digit
+	buf[used++] = '_';
+	if (used < len - 1)
+	  buf[used++] = *cur;
+      }
+      else
+	buf[used++] = '_';
+    }
+  }
+
+  if (!used)
+    buf[used++] = '_';
+
+  buf[used] = '\0';
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Escape a string for use as an OpenMetrics label value.  Caller must free.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param value Raw label value
+ *	@param flags Flags for future use.
+ *	@return <i>NULL</i> on failure.<br>
+ *	@return <i>allocated escaped string</i> on success.
+ */
+char *
+bk_metrics_label_escape(bk_s B, const char *value, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  char *ret;
+  char *out;
+
+  if (!value)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!(ret = malloc(strlen(value) * 2 + 1)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate escaped label: %s\n", strerror(errno));
+    BK_RETURN(B, NULL);
+  }
+
+  for (out = ret; *value; value++)
+  {
+    switch (*value)
+    {
+    case '\\':
+    case '"':
+      *out++ = '\\';
+      *out++ = *value;
+      break;
+    case '\n':
+      *out++ = '\\';
+      *out++ = 'n';
+      break;
+    default:
+      *out++ = *value;
+      break;
+    }
+  }
+  *out = '\0';
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * Format a floating point sample value the way OpenMetrics wants it.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param buf Output buffer
+ *	@param len Size of @a buf
+ *	@param value Value to format
+ *	@return <i>buf</i>
+ */
+const char *
+bk_metrics_double(bk_s B, char *buf, size_t len, double value)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (isnan(value))
+    snprintf(buf, len, "NaN");
+  else if (isinf(value))
+    snprintf(buf, len, "%sInf", value < 0 ? "-" : "+");
+  else
+    snprintf(buf, len, "%.17g", value);
+
+  BK_RETURN(B, buf);
+}
+
+
+
+/**
+ * Format one exposition line and hand it to an output callback.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param output Output callback
+ *	@param opaque Output callback data
+ *	@param fmt printf style format
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.<br>
+ *	@return <i>1</i> if the output callback does not want any more.
+ */
+int
+bk_metrics_emit(bk_s B, bk_metrics_output_f output, void *opaque, const char *fmt, ...)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  char line[BK_METRICS_MAXLINE];
+  va_list ap;
+  int len;
+
+  if (!output || !fmt)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  va_start(ap, fmt);
+  len = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+
+  if (len < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not format metrics line\n");
+    BK_RETURN(B, -1);
+  }
+
+  if ((size_t)len >= sizeof(line))
+  {
+    // A chopped line would corrupt the exposition, so drop it instead
+    bk_error_printf(B, BK_ERR_WARN, "Metrics line too long--skipped\n");
+    BK_RETURN(B, 0);
+  }
+
+  BK_RETURN(B, (*output)(B, opaque, line, len, 0));
+}
+
+
+
+/**
+ * Start serving OpenMetrics text over HTTP on a run loop.
+ *
+ * Any request for /metrics receives the dynamic statistics at or above
+ * @a priority, the performance statistics in @a blist, and the server's
+ * own scrape statistics.  A response which would exceed @a maxbytes is
+ * cut off before the terminating "# EOF" so that scrapers reject it
+ * rather than silently ingesting half a scrape.  The response is
+ * generated in one pass, so @a maxbytes is also the output queue limit
+ * of each connection, and bounds the memory one scrape can hold.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param run The @a bk_run structure.
+ *	@param url The local endpoint specification (may be NULL).
+ *	@param defurl The <em>default</em> local endpoint specification (may be NULL).
+ *	@param stats_list Dynamic statistics to export (may be NULL).
+ *	@param priority Dynamic statistics priority filter.
+ *	@param blist Performance statistics to export (may be NULL).
+ *	@param prefix Prefix for every metric name (may be NULL).
+ *	@param maxbytes Per-response size budget (0 for default).
+ *	@param flags Flags for future use.
+ *	@return <i>NULL</i> on failure.<br>
+ *	@return <i>metrics server handle</i> on success.
+ */
+struct bk_metrics_server *
+bk_metrics_server_create(bk_s B, struct bk_run *run, const char *url, const char *defurl, bk_dynamic_stats_h stats_list, u_int priority, struct bk_stat_list *blist, const char *prefix, u_int32_t maxbytes, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_metrics_server *bms = NULL;
+
+  if (!run || !(url || defurl))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!BK_CALLOC(bms))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate metrics server: %s\n", strerror(errno));
+    goto error;
+  }
+
+  bms->bms_run = run;
+  bms->bms_stats = stats_list;
+  bms->bms_blist = blist;
+  bms->bms_priority = priority;
+  bms->bms_maxbytes = maxbytes?maxbytes:BK_METRICS_DEFMAXBYTES;
+  bms->bms_flags = flags;
+
+  if (!(bms->bms_prefix = strdup(prefix?prefix:"")))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not copy metrics prefix: %s\n", strerror(errno));
+    goto error;
+  }
+
+  if (!(bms->bms_scrape_stat = bk_stat_node_create(B, "metrics", "scrape", 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create scrape statistic\n");
+    goto error;
+  }
+
+  if (!(bms->bms_conns = bmsc_create(NULL, NULL, DICT_UNORDERED|bk_thread_safe_if_thread_ready)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create metrics connection list\n");
+    goto error;
+  }
+
+  if (bk_netutils_start_service(B, run, url, defurl, metrics_accept, bms, 0, 0) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not start metrics service\n");
+    goto error;
+  }
+
+  BK_RETURN(B, bms);
+
+ error:
+  if (bms)
+    bk_metrics_server_destroy(B, bms);
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Stop serving metrics.  Connections still in progress are aborted.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bms Metrics server to destroy.
+ */
+void
+bk_metrics_server_destroy(bk_s B, struct bk_metrics_server *bms)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_metrics_conn *bmc;
+
+  if (!bms)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  BK_FLAG_SET(bms->bms_intflags, BMS_INTFLAG_DESTROYING);
+
+  if (bms->bms_server)
+    bk_addrgroup_server_close(B, bms->bms_server);
+  bms->bms_server = NULL;
+
+  if (bms->bms_conns)
+  {
+    // Connections may outlive us (deferred close); cut them loose first
+    while ((bmc = bmsc_minimum(bms->bms_conns)))
+    {
+      bmsc_delete(bms->bms_conns, bmc);
+      bmc->bmc_bms = NULL;
+      metrics_close(B, bmc, BK_IOH_ABORT);
+    }
+    bmsc_destroy(bms->bms_conns);
+  }
+
+  if (bms->bms_scrape_stat)
+    bk_stat_node_destroy(B, bms->bms_scrape_stat);
+
+  if (bms->bms_prefix)
+    free(bms->bms_prefix);
+
+  free(bms);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Listening socket and new connection notifications
+ *
+ *	@param B BAKA thread/global state.
+ *	@param args The metrics server
+ *	@param sock The new socket.
+ *	@param bag The address group pair.
+ *	@param server_handle Handle for the listening server.
+ *	@param state What happened.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+static int
+metrics_accept(bk_s B, void *args, int sock, struct bk_addrgroup *bag, void *server_handle, bk_addrgroup_state_e state)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_metrics_server *bms = args;
+  struct bk_metrics_conn *bmc = NULL;
+
+  if (!bms)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  switch (state)
+  {
+  case BkAddrGroupStateReady:
+    bms->bms_server = server_handle;
+    break;
+
+  case BkAddrGroupStateClosing:
+    if (bms->bms_server == server_handle)
+      bms->bms_server = NULL;
+    break;
+
+  case BkAddrGroupStateSocket:
+    break;
+
+  case BkAddrGroupStateConnected:
+    if (BK_FLAG_ISSET(bms->bms_intflags, BMS_INTFLAG_DESTROYING))
+    {
+      close(sock);
+      break;
+    }
+
+    if (!BK_CALLOC(bmc))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate metrics connection: %s\n", strerror(errno));
+      close(sock);
+      goto error;
+    }
+    bmc->bmc_bms = bms;
+
+    // Leave room in the queue for the trailer, which is sent over budget
+    if (!(bmc->bmc_ioh = bk_ioh_init(B, NULL, sock, sock, metrics_iohhandler, bmc, 0, BK_METRICS_MAXREQUEST, bms->bms_maxbytes + BK_METRICS_MAXLINE, bms->bms_run, BK_IOH_RAW|BK_IOH_STREAM)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not create metrics connection ioh\n");
+      close(sock);
+      goto error;
+    }
+
+    if (bmsc_insert(bms->bms_conns, bmc) != DICT_OK)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not track metrics connection: %s\n", bmsc_error_reason(bms->bms_conns, NULL));
+      bmc->bmc_bms = NULL;
+      metrics_close(B, bmc, BK_IOH_ABORT);	// Handler will free bmc
+      bmc = NULL;
+      goto error;
+    }
+    break;
+
+  case BkAddrGroupStateSysError:
+  case BkAddrGroupStateRemoteError:
+  case BkAddrGroupStateLocalError:
+  case BkAddrGroupStateTimeout:
+    bk_error_printf(B, BK_ERR_ERR, "Metrics service failure (state %d)\n", state);
+    goto error;
+  }
+
+  BK_RETURN(B, 0);
+
+ error:
+  if (bmc && !bmc->bmc_ioh)
+    bmc_destroy(B, bmc);
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Connection I/O notifications
+ *
+ *	@param B BAKA thread/global state.
+ *	@param data Data read or written.
+ *	@param opaque The metrics connection.
+ *	@param ioh The connection ioh.
+ *	@param state What happened.
+ */
+static void
+metrics_iohhandler(bk_s B, bk_vptr *data, void *opaque, struct bk_ioh *ioh, bk_ioh_status_e state)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_metrics_conn *bmc = opaque;
+  u_int cnt;
+
+  if (!bmc)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  switch (state)
+  {
+  case BkIohStatusIncompleteRead:
+  case BkIohStatusReadComplete:
+    if (BK_FLAG_ISSET(bmc->bmc_flags, BMC_FLAG_RESPONDED))
+      break;					// We do not do pipelining or bodies
+
+    for (cnt = 0; data && data[cnt].ptr; cnt++)
+    {
+      if (bmc->bmc_reqlen + data[cnt].len > BK_METRICS_MAXREQUEST)
+      {
+	if (bmc->bmc_bms)
+	  bmc->bmc_bms->bms_errors++;
+	bk_error_printf(B, BK_ERR_WARN, "Metrics request too large\n");
+	metrics_close(B, bmc, BK_IOH_ABORT);
+	BK_VRETURN(B);
+      }
+      memcpy(bmc->bmc_request + bmc->bmc_reqlen, data[cnt].ptr, data[cnt].len);
+      bmc->bmc_reqlen += data[cnt].len;
+    }
+    bmc->bmc_request[bmc->bmc_reqlen] = '\0';
+
+    // Wait for the end of the header
+    if (!strstr(bmc->bmc_request, "\r\n\r\n") && !strstr(bmc->bmc_request, "\n\n"))
+      break;
+
+    if (metrics_request(B, bmc) < 0)
+    {
+      if (bmc->bmc_bms)
+	bmc->bmc_bms->bms_errors++;
+      metrics_close(B, bmc, BK_IOH_ABORT);
+      BK_VRETURN(B);
+    }
+    metrics_close(B, bmc, 0);			// Drain response, then close
+    break;
+
+  case BkIohStatusIohReadEOF:
+    if (BK_FLAG_ISCLEAR(bmc->bmc_flags, BMC_FLAG_RESPONDED))
+      metrics_close(B, bmc, BK_IOH_ABORT);
+    break;
+
+  case BkIohStatusIohReadError:
+  case BkIohStatusIohWriteError:
+    metrics_close(B, bmc, BK_IOH_ABORT);
+    break;
+
+  case BkIohStatusWriteComplete:
+  case BkIohStatusWriteAborted:
+    // Guarenteed just one buffer
+    free(data[0].ptr);
+    free(data);
+    break;
+
+  case BkIohStatusIohClosing:
+    bmc->bmc_ioh = NULL;
+    if (bmc->bmc_bms)
+      bmsc_delete(bmc->bmc_bms->bms_conns, bmc);
+    bmc_destroy(B, bmc);
+    break;
+
+  case BkIohStatusIohSeekSuccess:
+  case BkIohStatusIohSeekFailed:
+    bk_error_printf(B, BK_ERR_ERR, "I got seek notification. How could this happen\n");
+    break;
+
+  case BkIohStatusNoStatus:
+    bk_error_printf(B, BK_ERR_ERR, "Uninitialized status\n");
+    break;
+
+    // No default here so that compiler can catch missed state
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Parse a complete request header and queue the response.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bmc The metrics connection.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+static int
+metrics_request(bk_s B, struct bk_metrics_conn *bmc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  char *method, *path, *end;
+  size_t pathlen;
+  int head = 0;
+  const char *status = NULL;
+
+  BK_FLAG_SET(bmc->bmc_flags, BMC_FLAG_RESPONDED);
+
+  if (!bmc->bmc_bms)
+    BK_RETURN(B, -1);
+
+  // Request-Line = Method SP Request-URI SP HTTP-Version CRLF
+  method = bmc->bmc_request;
+  if (!(path = strchr(method, ' ')))
+  {
+    status = "400 Bad Request";
+  }
+  else
+  {
+    path++;
+    pathlen = strcspn(path, " ?\r\n");
+    end = path + pathlen;
+
+    if (!strncmp(method, "HEAD ", 5))
+      head = 1;
+    else if (strncmp(method, "GET ", 4))
+      status = "405 Method Not Allowed";
+
+    if (!status && (pathlen != strlen(BK_METRICS_PATH) || strncmp(path, BK_METRICS_PATH, pathlen)))
+      status = "404 Not Found";
+
+    *end = '\0';
+  }
+
+  if (status)
+  {
+    bmc->bmc_bms->bms_errors++;
+    if (bk_metrics_emit(B, metrics_output, bmc, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s\n", status, status) < 0 ||
+	metrics_flush(B, bmc) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not queue metrics error response\n");
+      BK_RETURN(B, -1);
+    }
+    BK_RETURN(B, 0);
+  }
+
+  BK_RETURN(B, metrics_respond(B, bmc, head));
+}
+
+
+
+/**
+ * Generate the exposition for one request, queueing it as we go.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bmc The metrics connection.
+ *	@param head Only send the HTTP header.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+static int
+metrics_respond(bk_s B, struct bk_metrics_conn *bmc, int head)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_metrics_server *bms = bmc->bmc_bms;
+  int ret = 0;
+  int flushed;
+
+  bk_stat_node_start(B, bms->bms_scrape_stat, 0);
+
+  if (bk_metrics_emit(B, metrics_output, bmc, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nConnection: close\r\n\r\n", BK_METRICS_CONTENT_TYPE) < 0)
+    goto error;
+
+  if (head)
+    goto done;
+
+  if (bms->bms_stats && (ret = bk_dynamic_stats_openmetrics(B, bms->bms_stats, bms->bms_priority, bms->bms_prefix, metrics_output, bmc, 0)) < 0)
+    goto error;
+
+  if (!ret && bms->bms_blist && (ret = bk_stat_openmetrics(B, bms->bms_blist, bms->bms_prefix, metrics_output, bmc, 0)) < 0)
+    goto error;
+
+  if (!ret && (ret = metrics_self(B, bms, bmc)) < 0)
+    goto error;
+
+  if (!ret && (ret = metrics_output(B, bmc, "# EOF\n", 6, BMC_OUTPUT_FORCE)) < 0)
+    goto error;
+
+ done:
+  if ((flushed = metrics_flush(B, bmc)) < 0)
+    goto error;
+
+  if (ret > 0 || flushed > 0)
+  {
+    bk_error_printf(B, BK_ERR_WARN, "Metrics response truncated after %u bytes\n", bmc->bmc_sent);
+    bms->bms_truncations++;
+  }
+
+  bk_stat_node_end(B, bms->bms_scrape_stat, 0);
+  bms->bms_scrapes++;
+  bms->bms_bytes += bmc->bmc_sent;
+
+  BK_RETURN(B, 0);
+
+ error:
+  bk_stat_node_end(B, bms->bms_scrape_stat, 0);
+  bk_error_printf(B, BK_ERR_ERR, "Could not generate metrics response\n");
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Export the server's own statistics.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bms The metrics server.
+ *	@param bmc The metrics connection.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.<br>
+ *	@return <i>1</i> if the response budget has been reached.
+ */
+static int
+metrics_self(bk_s B, struct bk_metrics_server *bms, struct bk_metrics_conn *bmc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  static const char *counters[] = { "metrics_scrapes", "metrics_response_bytes", "metrics_truncations", "metrics_errors" };
+  u_quad_t values[sizeof(counters)/sizeof(counters[0])];
+  u_quad_t minusec, maxusec, sumusec;
+  u_int count, cnt;
+  char family[1024];
+  char dbuf[64];
+  int ret;
+
+  bk_stat_node_info(B, bms->bms_scrape_stat, &minusec, &maxusec, &sumusec, &count, 0);
+
+  values[0] = bms->bms_scrapes;
+  values[1] = bms->bms_bytes;
+  values[2] = bms->bms_truncations;
+  values[3] = bms->bms_errors;
+
+  for (cnt = 0; cnt < sizeof(counters)/sizeof(counters[0]); cnt++)
+  {
+    if (bk_metrics_name(B, family, sizeof(family), bms->bms_prefix, counters[cnt], NULL) < 0)
+      BK_RETURN(B, -1);
+
+    if ((ret = bk_metrics_emit(B, metrics_output, bmc, "# TYPE %s counter\n%s_total %llu\n", family, family, BUG_LLU_CAST(values[cnt]))))
+      BK_RETURN(B, ret);
+  }
+
+  if (bk_metrics_name(B, family, sizeof(family), bms->bms_prefix, "metrics_scrape_duration_seconds", NULL) < 0)
+    BK_RETURN(B, -1);
+
+  if ((ret = bk_metrics_emit(B, metrics_output, bmc, "# TYPE %s summary\n# UNIT %s seconds\n%s_count %u\n", family, family, family, count)) ||
+      (ret = bk_metrics_emit(B, metrics_output, bmc, "%s_sum %s\n", family, bk_metrics_double(B, dbuf, sizeof(dbuf), (double)sumusec / 1000000.0))))
+    BK_RETURN(B, ret);
+
+  if (bk_metrics_name(B, family, sizeof(family), bms->bms_prefix, "metrics_scrape_duration_max_seconds", NULL) < 0)
+    BK_RETURN(B, -1);
+
+  if ((ret = bk_metrics_emit(B, metrics_output, bmc, "# TYPE %s gauge\n# UNIT %s seconds\n%s %s\n", family, family, family, bk_metrics_double(B, dbuf, sizeof(dbuf), (double)maxusec / 1000000.0))))
+    BK_RETURN(B, ret);
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Output callback: pack exposition text into chunks and queue each full
+ * chunk on the ioh.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param opaque The metrics connection.
+ *	@param buf Text to send.
+ *	@param len Length of @a buf.
+ *	@param flags BMC_OUTPUT_FORCE to ignore the response budget.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.<br>
+ *	@return <i>1</i> if the response budget has been reached.
+ */
+static int
+metrics_output(bk_s B, void *opaque, const char *buf, size_t len, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_metrics_conn *bmc = opaque;
+  size_t amount;
+  int ret;
+
+  if (!bmc || !buf || !bmc->bmc_bms)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISSET(bmc->bmc_flags, BMC_FLAG_TRUNCATED))
+    BK_RETURN(B, 1);
+
+  if (BK_FLAG_ISCLEAR(flags, BMC_OUTPUT_FORCE) &&
+      (u_quad_t)bmc->bmc_sent + bmc->bmc_chunklen + len > bmc->bmc_bms->bms_maxbytes)
+  {
+    BK_FLAG_SET(bmc->bmc_flags, BMC_FLAG_TRUNCATED);
+    BK_RETURN(B, 1);
+  }
+
+  while (len)
+  {
+    if (!bmc->bmc_chunk && !(bmc->bmc_chunk = malloc(BK_METRICS_CHUNK)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate metrics chunk: %s\n", strerror(errno));
+      BK_RETURN(B, -1);
+    }
+
+    amount = MIN(len, BK_METRICS_CHUNK - bmc->bmc_chunklen);
+    memcpy(bmc->bmc_chunk + bmc->bmc_chunklen, buf, amount);
+    bmc->bmc_chunklen += amount;
+    buf += amount;
+    len -= amount;
+
+    if (bmc->bmc_chunklen == BK_METRICS_CHUNK && (ret = metrics_flush(B, bmc)))
+      BK_RETURN(B, ret);
+  }
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Queue the current chunk (if any) on the connection ioh.  If the ioh
+ * queue is full the response is over budget, and is marked truncated.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bmc The metrics connection.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.<br>
+ *	@return <i>1</i> if the output queue is full.
+ */
+static int
+metrics_flush(bk_s B, struct bk_metrics_conn *bmc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  bk_vptr *vptr = NULL;
+  int ret;
+
+  if (!bmc->bmc_chunk || !bmc->bmc_chunklen)
+    BK_RETURN(B, 0);
+
+  if (!BK_MALLOC(vptr))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate metrics vptr: %s\n", strerror(errno));
+    BK_RETURN(B, -1);
+  }
+
+  vptr->ptr = bmc->bmc_chunk;
+  vptr->len = bmc->bmc_chunklen;
+
+  if ((ret = bk_ioh_write(B, bmc->bmc_ioh, vptr, 0)) < 0)
+  {
+    // The handler was already called with WriteAborted and freed the chunk
+    bmc->bmc_chunk = NULL;
+    bmc->bmc_chunklen = 0;
+    bk_error_printf(B, BK_ERR_ERR, "Could not queue metrics output\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (ret)
+  {
+    free(vptr);					// Chunk still owned by bmc
+    BK_FLAG_SET(bmc->bmc_flags, BMC_FLAG_TRUNCATED);
+    BK_RETURN(B, 1);
+  }
+
+  bmc->bmc_sent += bmc->bmc_chunklen;
+  bmc->bmc_chunk = NULL;
+  bmc->bmc_chunklen = 0;
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Close a metrics connection (once).
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bmc The metrics connection.
+ *	@param flags bk_ioh_close flags
+ */
+static void
+metrics_close(bk_s B, struct bk_metrics_conn *bmc, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!bmc->bmc_ioh || (BK_FLAG_ISSET(bmc->bmc_flags, BMC_FLAG_CLOSING) && BK_FLAG_ISCLEAR(flags, BK_IOH_ABORT)))
+    BK_VRETURN(B);
+
+  BK_FLAG_SET(bmc->bmc_flags, BMC_FLAG_CLOSING);
+  bk_ioh_close(B, bmc->bmc_ioh, flags);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Free a metrics connection
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bmc The metrics connection.
+ */
+static void
+bmc_destroy(bk_s B, struct bk_metrics_conn *bmc)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (bmc->bmc_chunk)
+    free(bmc->bmc_chunk);
+
+  free(bmc);
+
+  BK_VRETURN(B);
+}
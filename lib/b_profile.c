@@ -0,0 +1,808 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2001-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2001-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ * Sampling profiler over the BK_ENTRY function stacks.
+ *
+ * Every profiled thread gets a per-thread timer (thread CPU time by
+ * default) which sends it SIGPROF.  The handler copies the thread's
+ * shadow stack of function names (maintained by bk_fun_entry/exit while
+ * the thread is profiled) into a single-producer/single-consumer ring,
+ * without locks or allocation.  bk_profile_collect() drains the rings
+ * into folded-stack counts, and bk_profile_dump() writes those in the
+ * "frame;frame;frame count" format understood by flamegraph tools.
+ *
+ * Unlike function statistics, the cost is a handful of stores per
+ * function call plus the sampling itself, so it can be left on in
+ * production.  Function tracing must be on for stacks to be recorded.
+ */
+
+#include <libbk.h>
+#include "libbk_internal.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif /* __linux__ */
+
+#if defined(SIGEV_THREAD_ID) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid	///< Older glibc does not name the field
+#endif /* SIGEV_THREAD_ID && !sigev_notify_thread_id */
+
+
+#define BK_PROFILE_DEFAULT_HZ		97	///< Default samples/second (prime, to avoid lockstep)
+#define BK_PROFILE_DEFAULT_SAMPLES	512	///< Default ring size per thread
+#define BK_PROFILE_MAXTHREADS		256	///< Maximum simultaneously profiled threads (power of two)
+#define BK_PROFILE_TRUNCATED		"[truncated]" ///< Leaf frame marking a stack deeper than we record
+#define BK_PROFILE_NOFRAME		"[none]"	///< Frame for samples outside any BK_ENTRY function
+#define BP_FLAG_HANDLER			0x80000000	///< Our SIGPROF handler is installed
+
+
+
+/**
+ * Overall profiler state
+ */
+struct bk_profile
+{
+  bk_flags		bp_flags;		///< Everyone needs flags
+  u_int			bp_hz;			///< Samples per second per thread
+  u_int			bp_nsamples;		///< Ring size for new threads
+  dict_h		bp_threads;		///< Profiled threads
+  dict_h		bp_stacks;		///< Aggregated stacks
+  u_quad_t		bp_total;		///< Samples aggregated
+  u_quad_t		bp_dropped;		///< Samples lost to full rings
+  struct sigaction	bp_oldact;		///< SIGPROF disposition before we started
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_t	bp_lock;		///< Lock on threads and stacks
+#endif /* BK_USING_PTHREADS */
+};
+
+
+
+/**
+ * One sample, as copied by the signal handler
+ */
+struct bk_profile_sample
+{
+  u_int			bps_depth;		///< Depth of the stack when sampled
+  const char *		bps_stack[BK_PROFILE_MAXDEPTH]; ///< Function names, outermost first
+};
+
+
+
+/**
+ * One distinct stack and the number of times we have seen it
+ */
+struct bk_profile_stack
+{
+  ht_val		bpk_hash;		///< Hash of thread name and frames
+  const char *		bpk_thread;		///< Thread name (NULL if merged)
+  u_int			bpk_nframes;		///< Number of frames
+  const char **		bpk_frames;		///< Function names, outermost first
+  u_quad_t		bpk_count;		///< Samples of this stack
+};
+
+
+
+/**
+ * @name Defines: profthread_clc
+ * List of profiled threads CLC definitions
+ * to hide CLC choice.
+ */
+// @{
+#define profthread_create(o,k,f)	dll_create((o),(k),(f))
+#define profthread_destroy(h)		dll_destroy(h)
+#define profthread_insert(h,o)		dll_insert((h),(o))
+#define profthread_delete(h,o)		dll_delete((h),(o))
+#define profthread_minimum(h)		dll_minimum(h)
+#define profthread_successor(h,o)	dll_successor((h),(o))
+#define profthread_error_reason(h,i)	dll_error_reason((h),(i))
+// @}
+
+
+
+/**
+ * @name Defines: profstack_clc
+ * Aggregated stack CLC definitions
+ * to hide CLC choice.
+ */
+// @{
+#define profstack_create(o,k,f,a)	ht_create((o),(k),(f),(a))
+#define profstack_destroy(h)		ht_destroy(h)
+#define profstack_insert(h,o)		ht_insert((h),(o))
+#define profstack_search(h,k)		ht_search((h),(k))
+#define profstack_delete(h,o)		ht_delete((h),(o))
+#define profstack_minimum(h)		ht_minimum(h)
+#define profstack_successor(h,o)	ht_successor((h),(o))
+#define profstack_error_reason(h,i)	ht_error_reason((h),(i))
+static int profstack_oo_cmp(struct bk_profile_stack *a, struct bk_profile_stack *b);
+static ht_val profstack_obj_hash(struct bk_profile_stack *a);
+static struct ht_args profstack_args = { 1024, 3, (ht_func)profstack_obj_hash, (ht_func)profstack_obj_hash };
+// @}
+
+
+
+static void profile_sigprof(int signum, siginfo_t *si, void *context);
+static void profile_drain(bk_s B, struct bk_profile *bp, struct bk_profile_thread *bpt);
+static int profile_account(bk_s B, struct bk_profile *bp, const char *thread, const struct bk_profile_sample *sample);
+static void profile_stacks_nuke(bk_s B, struct bk_profile *bp);
+
+
+
+/**
+ * Signal handler lookup table.  Signals carry a slot identifier rather than
+ * a pointer, so that a SIGPROF still pending after a thread stopped
+ * profiling (and freed its state) is recognized as stale and ignored.
+ */
+static struct bk_profile_thread *ProfileSlots[BK_PROFILE_MAXTHREADS];
+static u_int ProfileSequence;
+
+
+
+/**
+ * Create a sampling profiler, make it the one new libbk threads join, and
+ * start profiling the calling thread.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param hz Samples per second per thread (0 for default).
+ *	@param nsamples Per-thread sample ring size, rounded up to a power of
+ *	two (0 for default).  Samples arriving while a ring is full are
+ *	dropped, so collect at least every @a nsamples / @a hz seconds.
+ *	@param flags BK_PROFILE_WALLCLOCK, BK_PROFILE_PERTHREAD
+ *	@return <i>NULL</i> on call failure, allocation failure, other failure.
+ *	@return <br><i>profiler</i> on success.
+ */
+struct bk_profile *
+bk_profile_create(bk_s B, u_int hz, u_int nsamples, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_profile *bp = NULL;
+  struct sigaction act;
+
+  if (!B)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!BK_GENERAL_FLAG_ISFUNON(B))
+    bk_error_printf(B, BK_ERR_WARN, "Function tracing is off; profile stacks will be empty\n");
+
+  if (!BK_CALLOC(bp))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate profiler: %s\n", strerror(errno));
+    BK_RETURN(B, NULL);
+  }
+
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_init(&bp->bp_lock, NULL);
+#endif /* BK_USING_PTHREADS */
+
+  bp->bp_flags = flags;
+  bp->bp_hz = hz?hz:BK_PROFILE_DEFAULT_HZ;
+  for (bp->bp_nsamples = 1; bp->bp_nsamples < (nsamples?nsamples:BK_PROFILE_DEFAULT_SAMPLES); bp->bp_nsamples <<= 1)
+    ; // Intentionally void
+
+  if (bp->bp_hz > 1000000)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Sampling rate %u is unreasonable\n", bp->bp_hz);
+    goto error;
+  }
+
+  if (!(bp->bp_threads = profthread_create(NULL, NULL, DICT_UNORDERED)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create thread list: %s\n", profthread_error_reason(NULL, NULL));
+    goto error;
+  }
+
+  if (!(bp->bp_stacks = profstack_create((dict_function)profstack_oo_cmp, (dict_function)profstack_oo_cmp, DICT_UNORDERED, &profstack_args)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create stack table: %s\n", profstack_error_reason(NULL, NULL));
+    goto error;
+  }
+
+  memset(&act, 0, sizeof(act));
+  act.sa_sigaction = profile_sigprof;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_SIGINFO|SA_RESTART;
+  if (sigaction(SIGPROF, &act, &bp->bp_oldact) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not install SIGPROF handler: %s\n", strerror(errno));
+    goto error;
+  }
+  BK_FLAG_SET(bp->bp_flags, BP_FLAG_HANDLER);
+
+  if (bk_profile_thread_start(B, bp, 0) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not profile initial thread\n");
+    goto error;
+  }
+
+  if (!BK_GENERAL_PROFILE(B))
+    BK_GENERAL_PROFILE(B) = bp;
+
+  BK_RETURN(B, bp);
+
+ error:
+  bk_profile_destroy(B, bp);
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Destroy a sampling profiler.  Other threads which are still profiled
+ * are disarmed and their state is released when they stop or exit, but
+ * this should only be called once they are quiescent.
+ *
+ * THREADS: EVIL (other profiled threads must not be exiting concurrently)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bp The profiler.
+ */
+void
+bk_profile_destroy(bk_s B, struct bk_profile *bp)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_profile_thread *bpt;
+
+  if (!bp)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  if (BK_GENERAL_PROFILE(B) == bp)
+    BK_GENERAL_PROFILE(B) = NULL;
+
+  if (B && BK_BT_PROFILE(B) && BK_BT_PROFILE(B)->bpt_profile == bp)
+    bk_profile_thread_stop(B);
+
+  if (bp->bp_threads)
+  {
+    BK_SIMPLE_LOCK(B, &bp->bp_lock);
+    while ((bpt = profthread_minimum(bp->bp_threads)))
+    {
+      bk_error_printf(B, BK_ERR_WARN, "Thread %s still profiled during profiler destruction\n", bpt->bpt_threadname);
+      timer_delete(bpt->bpt_timer);
+      BK_ATOMIC_STORE(&ProfileSlots[bpt->bpt_id & (BK_PROFILE_MAXTHREADS-1)], NULL);
+      bpt->bpt_profile = NULL;			// Owner frees on stop
+      profthread_delete(bp->bp_threads, bpt);
+    }
+    BK_SIMPLE_UNLOCK(B, &bp->bp_lock);
+    profthread_destroy(bp->bp_threads);
+  }
+
+  if (BK_FLAG_ISSET(bp->bp_flags, BP_FLAG_HANDLER))
+    sigaction(SIGPROF, &bp->bp_oldact, NULL);
+
+  if (bp->bp_stacks)
+  {
+    profile_stacks_nuke(B, bp);
+    profstack_destroy(bp->bp_stacks);
+  }
+
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_destroy(&bp->bp_lock);
+#endif /* BK_USING_PTHREADS */
+
+  free(bp);
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Start profiling the calling thread.  Called automatically for threads
+ * created with bk_thread_create while a general profiler exists.
+ *
+ * THREADS: MT-SAFE (B must belong to the calling thread)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bp The profiler.
+ *	@param flags Fun for the future.
+ *	@return <i>-1</i> on call failure, allocation failure, timer failure.
+ *	@return <br><i>0</i> on success.
+ */
+int
+bk_profile_thread_start(bk_s B, struct bk_profile *bp, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_profile_thread *bpt = NULL;
+  struct bk_funinfo *fh;
+  u_int slot;
+  int inserted = 0;
+  sigset_t mask;
+#ifdef SIGEV_THREAD_ID
+  struct sigevent sev;
+  struct itimerspec its;
+  int armed = 0;
+#endif /* SIGEV_THREAD_ID */
+
+  if (!B || !bp || BK_BT_PROFILE(B))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+#ifndef SIGEV_THREAD_ID
+  bk_error_printf(B, BK_ERR_ERR, "Per-thread sampling timers are not supported on this platform\n");
+  BK_RETURN(B, -1);
+#else /* SIGEV_THREAD_ID */
+
+  if (!BK_CALLOC(bpt))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate thread profile: %s\n", strerror(errno));
+    goto error;
+  }
+
+  bpt->bpt_profile = bp;
+  bpt->bpt_nsamples = bp->bp_nsamples;
+  bpt->bpt_id = -1;
+
+  if (!(bpt->bpt_samples = calloc(bpt->bpt_nsamples, sizeof(*bpt->bpt_samples))))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate %u sample ring: %s\n", bpt->bpt_nsamples, strerror(errno));
+    goto error;
+  }
+
+  if (!(bpt->bpt_threadname = strdup(BK_BT_THREADNAME(B)?BK_BT_THREADNAME(B):"?")))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not copy thread name: %s\n", strerror(errno));
+    goto error;
+  }
+
+  for (slot = 0; slot < BK_PROFILE_MAXTHREADS; slot++)
+  {
+    if (BK_ATOMIC_CAS(&ProfileSlots[slot], NULL, bpt))
+      break;
+  }
+  if (slot == BK_PROFILE_MAXTHREADS)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Too many profiled threads (%d)\n", BK_PROFILE_MAXTHREADS);
+    goto error;
+  }
+  bpt->bpt_id = (int)((slot | (BK_ATOMIC_ADD(&ProfileSequence, 1) * BK_PROFILE_MAXTHREADS)) & INT_MAX);
+
+  // Seed the shadow stack with the frames we are already inside of
+  for (fh = dll_maximum(BK_BT_FUNSTACK(B)); fh; fh = dll_predecessor(BK_BT_FUNSTACK(B), fh))
+  {
+    fh->bf_profdepth = bpt->bpt_depth;
+    if (bpt->bpt_depth < BK_PROFILE_MAXDEPTH)
+      bpt->bpt_stack[bpt->bpt_depth] = fh->bf_funname;
+    bpt->bpt_depth++;
+  }
+
+  BK_SIMPLE_LOCK(B, &bp->bp_lock);
+  if (profthread_insert(bp->bp_threads, bpt) != DICT_OK)
+  {
+    BK_SIMPLE_UNLOCK(B, &bp->bp_lock);
+    bk_error_printf(B, BK_ERR_ERR, "Could not insert thread profile: %s\n", profthread_error_reason(bp->bp_threads, NULL));
+    goto error;
+  }
+  inserted = 1;
+  BK_SIMPLE_UNLOCK(B, &bp->bp_lock);
+
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev.sigev_value.sival_int = bpt->bpt_id;
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (timer_create(BK_FLAG_ISSET(bp->bp_flags, BK_PROFILE_WALLCLOCK)?CLOCK_MONOTONIC:CLOCK_THREAD_CPUTIME_ID, &sev, &bpt->bpt_timer) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create sampling timer: %s\n", strerror(errno));
+    goto error;
+  }
+  armed = 1;
+
+  BK_BT_PROFILE(B) = bpt;
+
+  // libbk threads block everything by default
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPROF);
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+  // One hertz is a whole second, which tv_nsec cannot hold
+  its.it_interval.tv_sec = 1 / bp->bp_hz;
+  its.it_interval.tv_nsec = (1000000000 / bp->bp_hz) % 1000000000;
+  its.it_value = its.it_interval;
+  if (timer_settime(bpt->bpt_timer, 0, &its, NULL) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not arm sampling timer: %s\n", strerror(errno));
+    BK_BT_PROFILE(B) = NULL;
+    goto error;
+  }
+
+  BK_RETURN(B, 0);
+
+ error:
+  if (bpt)
+  {
+    if (armed)
+      timer_delete(bpt->bpt_timer);
+    if (bpt->bpt_id >= 0)
+      BK_ATOMIC_STORE(&ProfileSlots[bpt->bpt_id & (BK_PROFILE_MAXTHREADS-1)], NULL);
+    if (inserted)
+    {
+      BK_SIMPLE_LOCK(B, &bp->bp_lock);
+      profthread_delete(bp->bp_threads, bpt);
+      BK_SIMPLE_UNLOCK(B, &bp->bp_lock);
+    }
+    if (bpt->bpt_threadname)
+      free(bpt->bpt_threadname);
+    if (bpt->bpt_samples)
+      free(bpt->bpt_samples);
+    free(bpt);
+  }
+  BK_RETURN(B, -1);
+#endif /* SIGEV_THREAD_ID */
+}
+
+
+
+/**
+ * Stop profiling the calling thread, folding its outstanding samples
+ * into the profile.  Called automatically on libbk thread destruction.
+ *
+ * THREADS: MT-SAFE (B must belong to the calling thread)
+ *
+ *	@param B BAKA thread/global state.
+ */
+void
+bk_profile_thread_stop(bk_s B)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_profile_thread *bpt;
+  struct bk_profile *bp;
+  sigset_t mask, omask;
+
+  if (!B || !(bpt = BK_BT_PROFILE(B)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  // Keep SIGPROF out until our slot is cleared; a stale one will then be ignored
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &mask, &omask);
+
+  BK_BT_PROFILE(B) = NULL;
+
+  if ((bp = bpt->bpt_profile))
+  {
+    BK_SIMPLE_LOCK(B, &bp->bp_lock);
+    timer_delete(bpt->bpt_timer);
+    BK_ATOMIC_STORE(&ProfileSlots[bpt->bpt_id & (BK_PROFILE_MAXTHREADS-1)], NULL);
+    profile_drain(B, bp, bpt);
+    profthread_delete(bp->bp_threads, bpt);
+    BK_SIMPLE_UNLOCK(B, &bp->bp_lock);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+  free(bpt->bpt_threadname);
+  free(bpt->bpt_samples);
+  free(bpt);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Move the samples of all profiled threads into the aggregated stacks.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bp The profiler.
+ *	@param flags Fun for the future.
+ *	@return <i>-1</i> on call failure.
+ *	@return <br><i>0</i> on success.
+ */
+int
+bk_profile_collect(bk_s B, struct bk_profile *bp, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_profile_thread *bpt;
+
+  if (!bp)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  BK_SIMPLE_LOCK(B, &bp->bp_lock);
+  for (bpt = profthread_minimum(bp->bp_threads); bpt; bpt = profthread_successor(bp->bp_threads, bpt))
+    profile_drain(B, bp, bpt);
+  BK_SIMPLE_UNLOCK(B, &bp->bp_lock);
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Collect, then write the aggregated stacks in folded format, one
+ * "outer;...;inner count" line per distinct stack.  The output can be fed
+ * directly to flamegraph.pl and similar tools.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bp The profiler.
+ *	@param out Where to write.
+ *	@param flags BK_PROFILE_DUMP_RESET
+ *	@return <i>-1</i> on call failure, output failure.
+ *	@return <br><i>number of stacks written</i> on success.
+ */
+int
+bk_profile_dump(bk_s B, struct bk_profile *bp, FILE *out, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_profile_stack *bpk;
+  u_int cnt;
+  int ret = 0;
+
+  if (!bp || !out)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  bk_profile_collect(B, bp, 0);
+
+  BK_SIMPLE_LOCK(B, &bp->bp_lock);
+  for (bpk = profstack_minimum(bp->bp_stacks); bpk; bpk = profstack_successor(bp->bp_stacks, bpk))
+  {
+    if (bpk->bpk_thread)
+      fprintf(out, "%s;", bpk->bpk_thread);
+    for (cnt = 0; cnt < bpk->bpk_nframes; cnt++)
+      fprintf(out, "%s%s", cnt?";":"", bpk->bpk_frames[cnt]);
+    fprintf(out, " %llu\n", (unsigned long long)bpk->bpk_count);
+    ret++;
+  }
+
+  bk_debug_printf_and(B, 1, "Dumped %d stacks from %llu samples (%llu dropped)\n", ret, (unsigned long long)bp->bp_total, (unsigned long long)bp->bp_dropped);
+
+  if (BK_FLAG_ISSET(flags, BK_PROFILE_DUMP_RESET))
+  {
+    profile_stacks_nuke(B, bp);
+    bp->bp_total = 0;
+    bp->bp_dropped = 0;
+  }
+  BK_SIMPLE_UNLOCK(B, &bp->bp_lock);
+
+  if (ferror(out))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not write profile\n");
+    BK_RETURN(B, -1);
+  }
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * SIGPROF handler: copy the shadow stack of the interrupted thread into
+ * its sample ring.  Async-signal-safe: no locks, no allocation, no libbk
+ * calls.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param signum SIGPROF
+ *	@param si Signal information, carrying our slot identifier.
+ *	@param context Unused.
+ */
+static void
+profile_sigprof(int signum, siginfo_t *si, void *context)
+{
+  struct bk_profile_thread *bpt;
+  struct bk_profile_sample *sample;
+  u_int head, depth, cnt;
+  int id;
+
+  if (!si || si->si_code != SI_TIMER)
+    return;				// Not ours (kill(2), setitimer, ...)
+
+  id = si->si_value.sival_int;
+  bpt = BK_ATOMIC_LOAD(&ProfileSlots[id & (BK_PROFILE_MAXTHREADS-1)]);
+  if (!bpt || bpt->bpt_id != id)
+    return;				// Stale
+
+  head = bpt->bpt_head;
+  if (head - BK_ATOMIC_LOAD(&bpt->bpt_tail) >= bpt->bpt_nsamples)
+  {
+    bpt->bpt_dropped++;
+    return;
+  }
+
+  sample = &bpt->bpt_samples[head & (bpt->bpt_nsamples - 1)];
+  depth = bpt->bpt_depth;
+  sample->bps_depth = depth;
+  for (cnt = 0; cnt < depth && cnt < BK_PROFILE_MAXDEPTH; cnt++)
+    sample->bps_stack[cnt] = bpt->bpt_stack[cnt];
+
+  BK_ATOMIC_STORE(&bpt->bpt_head, head + 1);
+}
+
+
+
+/**
+ * Drain one thread's sample ring into the aggregated stacks.
+ *
+ * THREADS: MT-SAFE (bp lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bp The profiler.
+ *	@param bpt The thread.
+ */
+static void
+profile_drain(bk_s B, struct bk_profile *bp, struct bk_profile_thread *bpt)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  u_int head, tail, dropped;
+  const char *thread;
+
+  thread = BK_FLAG_ISSET(bp->bp_flags, BK_PROFILE_PERTHREAD)?bpt->bpt_threadname:NULL;
+  head = BK_ATOMIC_LOAD(&bpt->bpt_head);
+
+  for (tail = bpt->bpt_tail; tail != head; tail++)
+  {
+    if (profile_account(B, bp, thread, &bpt->bpt_samples[tail & (bpt->bpt_nsamples - 1)]) < 0)
+      bp->bp_dropped++;
+    else
+      bp->bp_total++;
+  }
+  BK_ATOMIC_STORE(&bpt->bpt_tail, tail);
+
+  // Only the handler increments this; we accept losing a count in the race
+  if ((dropped = bpt->bpt_dropped))
+  {
+    bpt->bpt_dropped = 0;
+    bp->bp_dropped += dropped;
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Count one sample against its stack, creating the stack if new.
+ *
+ * THREADS: MT-SAFE (bp lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bp The profiler.
+ *	@param thread Thread name to root the stack at (or NULL).
+ *	@param sample The sample.
+ *	@return <i>-1</i> on allocation failure.
+ *	@return <br><i>0</i> on success.
+ */
+static int
+profile_account(bk_s B, struct bk_profile *bp, const char *thread, const struct bk_profile_sample *sample)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const char *frames[BK_PROFILE_MAXDEPTH + 1];
+  struct bk_profile_stack key, *bpk = NULL;
+  u_int cnt;
+
+  key.bpk_thread = thread;
+  key.bpk_frames = frames;
+  key.bpk_nframes = MIN(sample->bps_depth, BK_PROFILE_MAXDEPTH);
+  memcpy(frames, sample->bps_stack, key.bpk_nframes * sizeof(*frames));
+  if (sample->bps_depth > BK_PROFILE_MAXDEPTH)
+    frames[key.bpk_nframes++] = BK_PROFILE_TRUNCATED;
+  else if (!sample->bps_depth)
+    frames[key.bpk_nframes++] = BK_PROFILE_NOFRAME;
+  key.bpk_hash = thread?bk_strhash(thread, 0):0;
+  for (cnt = 0; cnt < key.bpk_nframes; cnt++)
+    key.bpk_hash = key.bpk_hash * 31 + (ht_val)((u_long)frames[cnt] >> 3);
+
+  if ((bpk = profstack_search(bp->bp_stacks, &key)))
+  {
+    bpk->bpk_count++;
+    BK_RETURN(B, 0);
+  }
+
+  if (!BK_CALLOC(bpk) || !(bpk->bpk_frames = malloc(key.bpk_nframes * sizeof(*frames))) || (thread && !(bpk->bpk_thread = strdup(thread))))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate profile stack: %s\n", strerror(errno));
+    goto error;
+  }
+
+  bpk->bpk_hash = key.bpk_hash;
+  bpk->bpk_nframes = key.bpk_nframes;
+  for (cnt = 0; cnt < key.bpk_nframes; cnt++)
+    bpk->bpk_frames[cnt] = frames[cnt];
+  bpk->bpk_count = 1;
+
+  if (profstack_insert(bp->bp_stacks, bpk) != DICT_OK)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not insert profile stack: %s\n", profstack_error_reason(bp->bp_stacks, NULL));
+    goto error;
+  }
+
+  BK_RETURN(B, 0);
+
+ error:
+  if (bpk)
+  {
+    if (bpk->bpk_frames)
+      free(bpk->bpk_frames);
+    if (bpk->bpk_thread)
+      free((char *)bpk->bpk_thread);
+    free(bpk);
+  }
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Forget all aggregated stacks.
+ *
+ * THREADS: MT-SAFE (bp lock held)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bp The profiler.
+ */
+static void
+profile_stacks_nuke(bk_s B, struct bk_profile *bp)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_profile_stack *bpk;
+
+  while ((bpk = profstack_minimum(bp->bp_stacks)))
+  {
+    profstack_delete(bp->bp_stacks, bpk);
+    if (bpk->bpk_thread)
+      free((char *)bpk->bpk_thread);
+    free(bpk->bpk_frames);
+    free(bpk);
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/*
+ * CLC stack comparison and hash routines.  Function names are compared
+ * (and hashed, in profile_account) by pointer, since they all come from
+ * __FUNCTION__.
+ */
+static int profstack_oo_cmp(struct bk_profile_stack *a, struct bk_profile_stack *b)
+{
+  int ret;
+
+  if (a->bpk_hash != b->bpk_hash)
+    return(a->bpk_hash < b->bpk_hash?-1:1);
+  if (a->bpk_nframes != b->bpk_nframes)
+    return(a->bpk_nframes < b->bpk_nframes?-1:1);
+  if ((a->bpk_thread || b->bpk_thread) && (ret = strcmp(a->bpk_thread?a->bpk_thread:"", b->bpk_thread?b->bpk_thread:"")))
+    return(ret);
+  return(memcmp(a->bpk_frames, b->bpk_frames, a->bpk_nframes * sizeof(*a->bpk_frames)));
+}
+static ht_val profstack_obj_hash(struct bk_profile_stack *a)
+{
+  return(a->bpk_hash);
+}
@@ -599,6 +599,109 @@ char *bk_stat_dump(bk_s B, struct bk_stat_list *blist, bk_flags flags)
 
 
 
+/**
+ * Stream a performance list in OpenMetrics text format.  Three families
+ * are produced: a &lt;prefix&gt;stat_duration_seconds summary (count and
+ * sum), and &lt;prefix&gt;stat_duration_min_seconds and
+ * &lt;prefix&gt;stat_duration_max_seconds gauges, each labeled with the
+ * primary and secondary names.  Each line is handed to @a output as it is
+ * generated.  The terminating "# EOF" is left to the caller.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param blist Performance list to export
+ *	@param prefix A fixed string to prepend to all metric names (may be NULL)
+ *	@param output Callback to receive the exposition text
+ *	@param opaque Data for @a output
+ *	@param flags BK_STATS_NO_LOCKS_NEEDED
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.<br>
+ *	@return <i>1</i> if @a output asked us to stop.
+ */
+int bk_stat_openmetrics(bk_s B, struct bk_stat_list *blist, const char *prefix, bk_metrics_output_f output, void *opaque, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  static const char *suffix[] = { "stat_duration_seconds", "stat_duration_min_seconds", "stat_duration_max_seconds" };
+  static const char *type[] = { "summary", "gauge", "gauge" };
+  struct bk_stat_node *bnode;
+  char family[1024];
+  char dbuf[64];
+  char *name1 = NULL;
+  char *name2 = NULL;
+  u_quad_t minusec, maxusec, sumusec;
+  u_int count;
+  u_int pass;
+  int ret = 0;
+  char *funstatfilessave = BK_GENERAL_FUNSTATFILE(B);
+
+  if (!blist || !output)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  // See bk_stat_dump
+  BK_GENERAL_FUNSTATFILE(B) = NULL;
+
+  // One pass per family, since a family's samples must be contiguous
+  for (pass = 0; pass < sizeof(suffix)/sizeof(suffix[0]); pass++)
+  {
+    if (bk_metrics_name(B, family, sizeof(family), prefix, suffix[pass], NULL) < 0)
+      goto error;
+
+    if ((ret = bk_metrics_emit(B, output, opaque, "# TYPE %s %s\n# UNIT %s seconds\n", family, type[pass], family)))
+      goto done;
+
+    for (bnode = bsl_minimum(blist->bsl_list); bnode; bnode = bsl_successor(blist->bsl_list, bnode))
+    {
+      // Snapshot under the node lock; never call out with it held
+      bk_stat_node_info(B, bnode, &minusec, &maxusec, &sumusec, &count, flags);
+
+      if (!(name1 = bk_metrics_label_escape(B, bnode->bsn_name1?bnode->bsn_name1:"", 0)) ||
+	  !(name2 = bk_metrics_label_escape(B, bnode->bsn_name2?bnode->bsn_name2:"", 0)))
+	goto error;
+
+      switch (pass)
+      {
+      case 0:
+	if (!(ret = bk_metrics_emit(B, output, opaque, "%s_count{name1=\"%s\",name2=\"%s\"} %u\n", family, name1, name2, count)))
+	  ret = bk_metrics_emit(B, output, opaque, "%s_sum{name1=\"%s\",name2=\"%s\"} %s\n", family, name1, name2, bk_metrics_double(B, dbuf, sizeof(dbuf), (double)sumusec/1000000.0));
+	break;
+      case 1:
+	// bsn_minutime is a sentinel until the first sample
+	ret = bk_metrics_emit(B, output, opaque, "%s{name1=\"%s\",name2=\"%s\"} %s\n", family, name1, name2, bk_metrics_double(B, dbuf, sizeof(dbuf), count?(double)minusec/1000000.0:0.0));
+	break;
+      default:
+	ret = bk_metrics_emit(B, output, opaque, "%s{name1=\"%s\",name2=\"%s\"} %s\n", family, name1, name2, bk_metrics_double(B, dbuf, sizeof(dbuf), (double)maxusec/1000000.0));
+	break;
+      }
+
+      free(name1);
+      free(name2);
+      name1 = name2 = NULL;
+
+      if (ret)
+	goto done;
+    }
+  }
+
+ done:
+  BK_GENERAL_FUNSTATFILE(B) = funstatfilessave;
+  BK_RETURN(B, ret);
+
+ error:
+  bk_error_printf(B, BK_ERR_ERR, "Could not export performance statistics\n");
+  if (name1)
+    free(name1);
+  if (name2)
+    free(name2);
+  BK_GENERAL_FUNSTATFILE(B) = funstatfilessave;
+  BK_RETURN(B, -1);
+}
+
+
+
 /**
  * Return a performance interval
  *
@@ -22,6 +22,10 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 #include <libbk.h>
 #include "libbk_internal.h"
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define B64_X86						///< Can select x86 instructions at run time
+#include <immintrin.h>
+#endif /* x86 */
 
 
 
@@ -83,6 +87,66 @@ static const unsigned char index_64[256] = {
 
 
 
+/**
+ * State of a streaming base64 encoder or decoder
+ */
+struct bk_base64
+{
+  bk_flags	b64_flags;			///< BK_BASE64_DECODE, and state
+#define B64_DONE	0x10000			///< Decoder has seen the end of the data
+  char	       *b64_eol;			///< End of line sequence (encoding)
+  size_t	b64_eollen;			///< Length of b64_eol
+  u_int		b64_col;			///< Characters on current line (encoding)
+  u_int		b64_ncarry;			///< Bytes (encoding) or sextets (decoding) in partial group
+  u_char	b64_carry[4];			///< Partial group
+};
+
+
+
+/**
+ * State of a base64 ioh filter
+ */
+struct b64_filter
+{
+  struct bk_base64	*bf_enc;		///< Encoder for writes (if any)
+  struct bk_base64	*bf_dec;		///< Decoder for reads (if any)
+  bk_iorfunc_f		 bf_readfun;		///< Underlying read function
+  bk_iowfunc_f		 bf_writefun;		///< Underlying write function
+  bk_iocfunc_f		 bf_closefun;		///< Underlying close function
+  void			*bf_opaque;		///< Underlying read/write/close opaque
+  char			*bf_out;		///< Encoded output
+  size_t		 bf_outalloc;		///< Size of bf_out
+  size_t		 bf_outlen;		///< Encoded output waiting in bf_out
+  size_t		 bf_outoff;		///< Encoded output already written from bf_out
+  size_t		 bf_held;		///< Bytes of next write already in bf_out
+  char			*bf_in;			///< Encoded input
+  size_t		 bf_inalloc;		///< Size of bf_in
+  int			 bf_fd;			///< Descriptor encoded data was last written to
+};
+
+
+
+#define B64_GROUPS_PER_LINE	(MAX_LINE/4)	///< Input groups encoded on each output line
+
+
+
+static char *b64_enc_lines(struct bk_base64 *b64, const u_char *in, size_t len, size_t avail, char *r);
+static size_t b64_enc_groups(const u_char *in, size_t groups, size_t avail, char *r);
+static size_t b64_dec_fast(const u_char *in, size_t len, u_char *r, size_t outavail);
+static u_char *b64_dec_group(bk_s B, struct bk_base64 *b64, u_char *r);
+#ifdef B64_X86
+static size_t b64_enc_ssse3(const u_char *in, size_t groups, size_t avail, char *r);
+static size_t b64_enc_avx2(const u_char *in, size_t groups, size_t avail, char *r);
+static size_t b64_dec_ssse3(const u_char *in, size_t len, u_char *r, size_t outavail);
+static size_t b64_dec_avx2(const u_char *in, size_t len, u_char *r, size_t outavail);
+#endif /* B64_X86 */
+static int b64_filter_read(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, caddr_t buf, __SIZE_TYPE__ size, bk_flags flags);
+static int b64_filter_write(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, struct iovec *iov, __SIZE_TYPE__ size, bk_flags flags);
+static void b64_filter_close(bk_s B, struct bk_ioh *ioh, void *opaque, int fdin, int fdout, bk_flags flags);
+static void b64_filter_destroy(bk_s B, struct b64_filter *bf);
+
+
+
 /**
  * Encode a memory buffer into a base64 string.  The buffer will be broken
  * in to a series of lines 76 characters long, with the eol string used to
@@ -101,15 +165,10 @@ static const unsigned char index_64[256] = {
 char *bk_encode_base64(bk_s B, const bk_vptr *src, const char *eolseq)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  char *str;					// string to encode
-  ssize_t len;					// length of the string
-  const char *eol;				// end-of-line sequence
-  ssize_t eollen;				// length of the EOL sequence
-  char *r, *ret;				// result string
-  int32_t rlen;					// length of result string
-  uint64_t elen;
-  unsigned char c1, c2, c3;
-  int chunk;
+  struct bk_base64 b64;
+  char *ret;					// result string
+  int64_t rlen;					// length of result string
+  ssize_t len;
 
   if (!src)
   {
@@ -117,90 +176,33 @@ char *bk_encode_base64(bk_s B, const bk_vptr *src, const char *eolseq)
     BK_RETURN(B, NULL);
   }
 
-  str = src->ptr;
-  len = src->len;
-
-  /* set up EOL from the second argument if present, default to "\n" */
-  if (eolseq)
-  {
-    eol = eolseq;
-  }
-  else
-  {
-    eol = "\n";
-  }
-  eollen = strlen(eol);
+  // A private stack context, to avoid allocating one
+  memset(&b64, 0, sizeof(b64));
+  b64.b64_eol = (char *)(eolseq ? eolseq : "\n");
+  b64.b64_eollen = strlen(b64.b64_eol);
 
   /*
    * <WARNING>integer overflow security, be sure rlen is large enough: due to
    * complexity and multiplication of vptr len by eolseq len, we use 64-bit
    * math to check for 32-bit overflow.</WARNING>
    */
-  rlen = 4 * (1 + len / 3);			// encoded bytes
-  elen = ((rlen-1) / MAX_LINE + 1) * (int64_t) eollen;
-  if (rlen < 0 || rlen + elen + 1 > INT_MAX)
+  rlen = bk_base64_outlen(B, &b64, src->len);
+  if (rlen + 1 > INT_MAX)
   {
-    bk_error_printf(B, BK_ERR_ERR, "Overflow, length is %lld bytes\n",
-		    BUG_LLI_CAST(rlen + elen + 1));
+    bk_error_printf(B, BK_ERR_ERR, "Overflow, length is %lld bytes\n", BUG_LLI_CAST(rlen + 1));
     BK_RETURN(B, NULL);
   }
-  rlen += elen + 1;
 
   /* allocate a result buffer */
-  if (!(ret = BK_MALLOC_LEN(r, rlen)))
+  if (!(ret = malloc(rlen + 1)))
   {
     bk_error_printf(B, BK_ERR_ERR, "Could not allocate memory for result");
     BK_RETURN(B, NULL);
   }
 
-  /* encode */
-  for (chunk=0; len > 0; len -= 3, chunk++)
-  {
-    if (chunk == (MAX_LINE/4))
-    {
-      const char *c = eol;
-      const char *e = eol + eollen;
-      while (c < e)
-	*r++ = *c++;
-      chunk = 0;
-    }
-
-    c1 = *str++;
-    *r++ = basis_64[c1>>2];
-
-    if (len == 1)
-    {
-      *r++ = basis_64[(c1 & 0x3) << 4];
-      *r++ = '=';
-      *r++ = '=';
-    }
-    else
-    {
-      c2 = *str++;
-      *r++ = basis_64[((c1 & 0x3) << 4) | ((c2 & 0xF0) >> 4)];
-
-      if (len == 2)
-      {
-	*r++ = basis_64[(c2 & 0xF) << 2];
-	*r++ = '=';
-      }
-      else
-      {
-	c3 = *str++;
-	*r++ = basis_64[((c2 & 0xF) << 2) | ((c3 & 0xC0) >>6)];
-	*r++ = basis_64[c3 & 0x3F];
-      }
-    }
-  }
-
-  if (rlen)
-  {						// append eol to result string
-    const char *c = eol;
-    const char *e = eol + eollen;
-    while (c < e)
-      *r++ = *c++;
-  }
-  *r = '\0';					// NUL terminate
+  len = bk_base64_update(B, &b64, src->ptr, src->len, ret, rlen);
+  len += bk_base64_final(B, &b64, ret + len, rlen - len);
+  ret[len] = '\0';				// NUL terminate
 
   BK_RETURN(B, ret);
 }
@@ -208,13 +210,13 @@ char *bk_encode_base64(bk_s B, const bk_vptr *src, const char *eolseq)
 
 
 /**
- * Decode a base64 encoded buffer into memory buffer.
+ * Decode a base64 encoded buffer into memory buffer.  Characters which
+ * are not part of the base64 alphabet (such as line breaks) are ignored.
  *
  * THREADS: MT-SAFE
  *
  *	@param B BAKA Thread/Global state
- *	@param src Source memory to convert
- *	@param eolseq End of line sequence.
+ *	@param str Source string to convert
  *	@return <i>NULL</i> on error
  *	@return <br><i>decoded buffer</i> on success which caller must free
  *	(both bk_vptr and allocated buffer ptr)
@@ -222,11 +224,9 @@ char *bk_encode_base64(bk_s B, const bk_vptr *src, const char *eolseq)
 bk_vptr *bk_decode_base64(bk_s B, const char *str)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_base64 b64;
   ssize_t len;
-  const char *end;
-  char *r;
   ssize_t rlen;
-  unsigned char c[4];
   bk_vptr *ret;
 
   if (!str)
@@ -241,12 +241,15 @@ bk_vptr *bk_decode_base64(bk_s B, const char *str)
     BK_RETURN(B, NULL);
   }
 
+  memset(&b64, 0, sizeof(b64));
+  b64.b64_flags = BK_BASE64_DECODE;
+
   len = strlen(str);
   /*
    * <WARNING>integer overflow security, be sure rlen is large enough: divide
    * before multiply, round up, and 1 for NUL termination.</WARNING>
    */
-  rlen = 3 * (1 + len / 4) + 1;
+  rlen = bk_base64_outlen(B, &b64, len) + 1;
   if (rlen < 0)
   {
     bk_error_printf(B, BK_ERR_ERR, "Overflow, length is %lld bytes\n", BUG_LLI_CAST(rlen));
@@ -261,65 +264,865 @@ bk_vptr *bk_decode_base64(bk_s B, const char *str)
     BK_RETURN(B, NULL);
   }
 
-  len = strlen(str);
-  end = str + len;
-  r = ret->ptr;
-  ret->len = 0;
+  len = bk_base64_update(B, &b64, str, len, ret->ptr, rlen);
+  len += bk_base64_final(B, &b64, (char *)ret->ptr + len, rlen - len);
+  ret->len = len;
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * Create a streaming base64 encoder or decoder.  Data is fed through
+ * in pieces of any size with bk_base64_update(), and bk_base64_final()
+ * finishes it off; the result is the same as bk_encode_base64() or
+ * bk_decode_base64() on all of the data at once.  The context may then
+ * be used again.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param eolseq End of line sequence for encoding ("\n" if NULL)
+ *	@param flags BK_BASE64_DECODE to decode rather than encode
+ *	@return <i>NULL</i> on allocation failure
+ *	@return <br><i>context</i> on success
+ */
+struct bk_base64 *bk_base64_create(bk_s B, const char *eolseq, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_base64 *b64;
+
+  if (!BK_CALLOC(b64))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate base64 context: %s\n", strerror(errno));
+    BK_RETURN(B, NULL);
+  }
+
+  b64->b64_flags = flags & BK_BASE64_DECODE;
+
+  if (!(b64->b64_eol = strdup(eolseq ? eolseq : "\n")))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not copy end of line sequence: %s\n", strerror(errno));
+    free(b64);
+    BK_RETURN(B, NULL);
+  }
+  b64->b64_eollen = strlen(b64->b64_eol);
+
+  BK_RETURN(B, b64);
+}
+
 
-  while (str < end)
+
+/**
+ * Destroy a streaming base64 context.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param b64 Context
+ */
+void bk_base64_destroy(bk_s B, struct bk_base64 *b64)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!b64)
   {
-    int i = 0;
+    bk_error_printf(B, BK_ERR_ERR, "Invalid argument\n");
+    BK_VRETURN(B);
+  }
+
+  free(b64->b64_eol);
+  free(b64);
+
+  BK_VRETURN(B);
+}
 
-    do
+
+
+/**
+ * The most output bk_base64_update() followed by bk_base64_final() can
+ * produce from a given amount of input.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param b64 Context
+ *	@param inlen Bytes of input
+ *	@return <i>bytes</i> of output space needed
+ */
+size_t bk_base64_outlen(bk_s B, struct bk_base64 *b64, size_t inlen)
+{
+  if (BK_FLAG_ISSET(b64->b64_flags, BK_BASE64_DECODE))
+    return 3 * (inlen / 4 + 2);
+
+  // Two more groups for what is carried in and out, two more line ends for the partial lines
+  return 4 * (inlen / 3 + 2) + (inlen / (3 * B64_GROUPS_PER_LINE) + 2) * b64->b64_eollen;
+}
+
+
+
+/**
+ * Encode or decode some more data.  Whatever does not make up a full
+ * group is kept for the next call.
+ *
+ * THREADS: MT-SAFE (assuming different b64)
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param b64 Context
+ *	@param in Input data
+ *	@param inlen Length of input
+ *	@param out Output buffer
+ *	@param outlen Size of output buffer, at least bk_base64_outlen(inlen)
+ *	@return <i>-1</i> on call failure
+ *	@return <br><i>bytes of output</i> on success
+ */
+ssize_t bk_base64_update(bk_s B, struct bk_base64 *b64, const void *in, size_t inlen, void *out, size_t outlen)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const u_char *p = in, *end = p + inlen;
+  u_char *r = out;
+  size_t n;
+
+  if (!b64 || (inlen && (!in || !out)) || outlen < bk_base64_outlen(B, b64, inlen))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (BK_FLAG_ISCLEAR(b64->b64_flags, BK_BASE64_DECODE))
+  {
+    // Finish the partial group first
+    if (b64->b64_ncarry)
     {
-      unsigned char uc = index_64[*(unsigned char *)str++];
-      if (uc != INVALID)
-	c[i++] = uc;
+      n = MIN(3 - b64->b64_ncarry, inlen);
+      memcpy(b64->b64_carry + b64->b64_ncarry, p, n);
+      b64->b64_ncarry += n;
+      p += n;
+      if (b64->b64_ncarry < 3)
+	BK_RETURN(B, 0);
+      r = (u_char *)b64_enc_lines(b64, b64->b64_carry, 3, 3, (char *)r);
+      b64->b64_ncarry = 0;
+    }
 
-      if (str == end)
-      {
-	if (i < 4)
-	{
-	  if (i)
-	    bk_error_printf(B, BK_ERR_WARN, "Premature end of base64 data\n");
+    r = (u_char *)b64_enc_lines(b64, p, (end - p) / 3 * 3, end - p, (char *)r);
+    p += (end - p) / 3 * 3;
+
+    b64->b64_ncarry = end - p;
+    memcpy(b64->b64_carry, p, end - p);
 
-	  if (i < 2)
-	    goto done;				// break outer loop
+    BK_RETURN(B, r - (u_char *)out);
+  }
 
-	  if (i == 2)
-	    c[2] = EQ;
+  while (p < end && BK_FLAG_ISCLEAR(b64->b64_flags, B64_DONE))
+  {
+    u_char c;
 
-	  c[3] = EQ;
-	}
+    // Runs of whole groups go fast until something other than base64 shows up
+    if (!b64->b64_ncarry)
+    {
+      n = b64_dec_fast(p, end - p, r, (u_char *)out + outlen - r);
+      p += n;
+      r += n / 4 * 3;
+      if (p == end)
 	break;
+    }
+
+    if ((c = index_64[*p++]) == INVALID)
+      continue;
+
+    b64->b64_carry[b64->b64_ncarry++] = c;
+    if (b64->b64_ncarry == 4)
+      r = b64_dec_group(B, b64, r);
+  }
+
+  BK_RETURN(B, r - (u_char *)out);
+}
+
+
+
+/**
+ * Finish encoding or decoding: write out the partial group (padded, if
+ * encoding) and the final end of line sequence.  The context is reset
+ * for new data.
+ *
+ * THREADS: MT-SAFE (assuming different b64)
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param b64 Context
+ *	@param out Output buffer
+ *	@param outlen Size of output buffer, at least bk_base64_outlen(0)
+ *	@return <i>-1</i> on call failure
+ *	@return <br><i>bytes of output</i> on success
+ */
+ssize_t bk_base64_final(bk_s B, struct bk_base64 *b64, void *out, size_t outlen)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  char *r = out;
+  u_char *c;
+
+  if (!b64 || !out || outlen < bk_base64_outlen(B, b64, 0))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  c = b64->b64_carry;
+
+  if (BK_FLAG_ISSET(b64->b64_flags, BK_BASE64_DECODE))
+  {
+    if (b64->b64_ncarry && BK_FLAG_ISCLEAR(b64->b64_flags, B64_DONE))
+    {
+      bk_error_printf(B, BK_ERR_WARN, "Premature end of base64 data\n");
+
+      if (b64->b64_ncarry >= 2)
+      {
+	if (b64->b64_ncarry == 2)
+	  c[2] = EQ;
+	c[3] = EQ;
+	r = (char *)b64_dec_group(B, b64, (u_char *)r);
       }
-    } while (i < 4);
+    }
+  }
+  else
+  {
+    if (b64->b64_ncarry)
+    {
+      if (b64->b64_col == MAX_LINE)
+      {
+	memcpy(r, b64->b64_eol, b64->b64_eollen);
+	r += b64->b64_eollen;
+      }
+
+      *r++ = basis_64[c[0] >> 2];
+      if (b64->b64_ncarry == 1)
+      {
+	*r++ = basis_64[(c[0] & 0x3) << 4];
+	*r++ = '=';
+      }
+      else
+      {
+	*r++ = basis_64[((c[0] & 0x3) << 4) | ((c[1] & 0xF0) >> 4)];
+	*r++ = basis_64[(c[1] & 0xF) << 2];
+      }
+      *r++ = '=';
+    }
+
+    memcpy(r, b64->b64_eol, b64->b64_eollen);
+    r += b64->b64_eollen;
+  }
+
+  b64->b64_ncarry = 0;
+  b64->b64_col = 0;
+  BK_FLAG_CLEAR(b64->b64_flags, B64_DONE);
+
+  BK_RETURN(B, r - (char *)out);
+}
+
+
+
+/**
+ * Make an ioh base64 encode what it writes and decode what it reads,
+ * on top of whatever read and write functions it already has.  Any
+ * partial group left at the end is written out (with the final end of
+ * line) when the ioh is closed, even with BK_IOH_DONTCLOSEFDS.
+ *
+ * THREADS: MT-SAFE (assuming different ioh)
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh to filter
+ *	@param eolseq End of line sequence for encoding ("\n" if NULL)
+ *	@param flags BK_BASE64_FILTER_WRITE and/or BK_BASE64_FILTER_READ
+ *	@return <i>-1</i> on failure
+ *	@return <br><i>0</i> on success
+ */
+int bk_base64_ioh_filter(bk_s B, struct bk_ioh *ioh, const char *eolseq, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct b64_filter *bf = NULL;
+
+  if (!ioh || BK_FLAG_ISCLEAR(flags, BK_BASE64_FILTER_WRITE|BK_BASE64_FILTER_READ))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  if (!BK_CALLOC(bf))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate base64 filter: %s\n", strerror(errno));
+    goto error;
+  }
+
+  if ((BK_FLAG_ISSET(flags, BK_BASE64_FILTER_WRITE) && !(bf->bf_enc = bk_base64_create(B, eolseq, 0))) ||
+      (BK_FLAG_ISSET(flags, BK_BASE64_FILTER_READ) && !(bf->bf_dec = bk_base64_create(B, NULL, BK_BASE64_DECODE))))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create base64 context\n");
+    goto error;
+  }
+  bf->bf_fd = -1;
 
-    if (c[0] == EQ || c[1] == EQ)
+  if (bk_ioh_get(B, ioh, NULL, NULL, &bf->bf_readfun, &bf->bf_writefun, &bf->bf_closefun, &bf->bf_opaque,
+		 NULL, NULL, NULL, NULL, NULL, NULL, NULL) < 0 ||
+      bk_ioh_update(B, ioh, b64_filter_read, b64_filter_write, b64_filter_close, bf, NULL, NULL, 0, 0, 0, 0,
+		    BK_IOH_UPDATE_READFUN | BK_IOH_UPDATE_WRITEFUN | BK_IOH_UPDATE_CLOSEFUN |
+		    BK_IOH_UPDATE_IOFUNOPAQUE) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not install base64 filter\n");
+    goto error;
+  }
+
+  BK_RETURN(B, 0);
+
+ error:
+  if (bf)
+    b64_filter_destroy(B, bf);
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Encode whole groups, starting a new line every 76 characters.  A line
+ * end is only written when another group follows it.
+ *
+ *	@param b64 Encoding context
+ *	@param in Input
+ *	@param len Input to encode, a multiple of three
+ *	@param avail Input which may be read (at least len)
+ *	@param r Output
+ *	@return <i>end of output</i>
+ */
+static char *b64_enc_lines(struct bk_base64 *b64, const u_char *in, size_t len, size_t avail, char *r)
+{
+  size_t groups;
+
+  while (len)
+  {
+    if (b64->b64_col == MAX_LINE)
     {
-      bk_error_printf(B, BK_ERR_WARN, "Premature padding of base64 data\n");
-      break;
+      memcpy(r, b64->b64_eol, b64->b64_eollen);
+      r += b64->b64_eollen;
+      b64->b64_col = 0;
     }
 
-    bk_debug_printf_and(B, 1, "c0=%d,c1=%d,c2=%d,c3=%d\n", c[0],c[1],c[2],c[3]);
+    groups = MIN(len / 3, (MAX_LINE - b64->b64_col) / 4);
+    b64_enc_groups(in, groups, avail, r);
+    r += groups * 4;
+    b64->b64_col += groups * 4;
+    in += groups * 3;
+    len -= groups * 3;
+    avail -= groups * 3;
+  }
+
+  return r;
+}
+
+
+
+/**
+ * Encode groups of three bytes, with vector instructions if possible.
+ *
+ *	@param in Input
+ *	@param groups Groups to encode
+ *	@param avail Input which may be read (vector loads read past the last group)
+ *	@param r Output
+ *	@return <i>groups</i> encoded
+ */
+static size_t b64_enc_groups(const u_char *in, size_t groups, size_t avail, char *r)
+{
+  size_t done = 0;
+
+#ifdef B64_X86
+  // Not chained inside the AVX2 routine, which would skip its vzeroupper
+  if (groups >= 8 && __builtin_cpu_supports("avx2"))
+    done = b64_enc_avx2(in, groups, avail, r);
+  if (groups - done >= 4 && __builtin_cpu_supports("ssse3"))
+    done += b64_enc_ssse3(in + done * 3, groups - done, avail - done * 3, r + done * 4);
+  in += done * 3;
+  r += done * 4;
+#endif /* B64_X86 */
+
+  for (; done < groups; done++, in += 3, r += 4)
+  {
+    r[0] = basis_64[in[0] >> 2];
+    r[1] = basis_64[((in[0] & 0x3) << 4) | (in[1] >> 4)];
+    r[2] = basis_64[((in[1] & 0xF) << 2) | (in[2] >> 6)];
+    r[3] = basis_64[in[2] & 0x3F];
+  }
 
-    *r++ = (c[0] << 2) | ((c[1] & 0x30) >> 4);
-    ret->len++;
+  return groups;
+}
+
+
+
+/**
+ * Decode as many whole groups as possible from the start of the input
+ * with vector instructions, stopping at anything (including padding)
+ * which is not in the base64 alphabet.
+ *
+ *	@param in Input
+ *	@param len Length of input
+ *	@param r Output
+ *	@param outavail Space for output
+ *	@return <i>characters</i> of input consumed (a multiple of four)
+ */
+static size_t b64_dec_fast(const u_char *in, size_t len, u_char *r, size_t outavail)
+{
+  size_t done = 0;
+
+#ifdef B64_X86
+  if (len >= 32 && __builtin_cpu_supports("avx2"))
+    done = b64_dec_avx2(in, len, r, outavail);
+  if (len - done >= 16 && __builtin_cpu_supports("ssse3"))
+    done += b64_dec_ssse3(in + done, len - done, r + done / 4 * 3, outavail - done / 4 * 3);
+#endif /* B64_X86 */
+
+  return done;
+}
+
+
+
+/**
+ * Decode a complete group of four sextets (some may be padding).
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param b64 Decoding context, with the group in b64_carry
+ *	@param r Output
+ *	@return <i>end of output</i>
+ */
+static u_char *b64_dec_group(bk_s B, struct bk_base64 *b64, u_char *r)
+{
+  u_char *c = b64->b64_carry;
 
-    if (c[2] == EQ)
+  b64->b64_ncarry = 0;
+
+  if (c[0] == EQ || c[1] == EQ)
+  {
+    bk_error_printf(B, BK_ERR_WARN, "Premature padding of base64 data\n");
+    BK_FLAG_SET(b64->b64_flags, B64_DONE);
+    return r;
+  }
+
+  *r++ = (c[0] << 2) | ((c[1] & 0x30) >> 4);
+
+  if (c[2] == EQ)
+    goto done;
+  *r++ = ((c[1] & 0x0F) << 4) | ((c[2] & 0x3C) >> 2);
+
+  if (c[3] == EQ)
+    goto done;
+  *r++ = ((c[2] & 0x03) << 6) | c[3];
+
+  return r;
+
+ done:
+  BK_FLAG_SET(b64->b64_flags, B64_DONE);
+  return r;
+}
+
+
+
+#ifdef B64_X86
+/*
+ * The vector codecs follow Wojciech Muła and Daniel Lemire, "Faster
+ * Base64 Encoding and Decoding Using AVX2 Instructions", ACM TOW 2018.
+ * Encoding spreads each three bytes over four, isolates the sextets
+ * with multiplies, and maps them to ASCII by adding an offset picked by
+ * range; decoding reverses this, classifying characters by nibble to
+ * catch anything outside the alphabet.
+ */
+
+/**
+ * Encode 12 bytes per step with SSSE3.
+ *
+ *	@param in Input
+ *	@param groups Groups to encode
+ *	@param avail Input which may be read
+ *	@param r Output
+ *	@return <i>groups</i> encoded
+ */
+__attribute__((target("ssse3")))
+static size_t b64_enc_ssse3(const u_char *in, size_t groups, size_t avail, char *r)
+{
+  const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+  __m128i v, t0, t1, idx;
+  size_t done = 0;
+
+  // Each step reads 16 bytes but uses 12
+  for (; groups - done >= 4 && avail >= 16; done += 4, avail -= 12, in += 12, r += 16)
+  {
+    v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in), shuf);
+    t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+    t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+    v = _mm_or_si128(t0, t1);
+    idx = _mm_sub_epi8(_mm_subs_epu8(v, _mm_set1_epi8(51)), _mm_cmpgt_epi8(v, _mm_set1_epi8(25)));
+    _mm_storeu_si128((__m128i *)r, _mm_add_epi8(v, _mm_shuffle_epi8(lut, idx)));
+  }
+
+  return done;
+}
+
+
+
+/**
+ * Encode 24 bytes per step with AVX2, 12 in each lane.
+ *
+ *	@param in Input
+ *	@param groups Groups to encode
+ *	@param avail Input which may be read
+ *	@param r Output
+ *	@return <i>groups</i> encoded
+ */
+__attribute__((target("avx2")))
+static size_t b64_enc_avx2(const u_char *in, size_t groups, size_t avail, char *r)
+{
+  const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+				       10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+				       65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+  __m256i v, t0, t1, idx;
+  size_t done = 0;
+
+  // Each step reads 28 bytes but uses 24
+  for (; groups - done >= 8 && avail >= 28; done += 8, avail -= 24, in += 24, r += 32)
+  {
+    v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+				_mm_loadu_si128((const __m128i *)(in + 12)), 1);
+    v = _mm256_shuffle_epi8(v, shuf);
+    t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+    t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+    v = _mm256_or_si256(t0, t1);
+    idx = _mm256_sub_epi8(_mm256_subs_epu8(v, _mm256_set1_epi8(51)), _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+    _mm256_storeu_si256((__m256i *)r, _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, idx)));
+  }
+
+  return done;
+}
+
+
+
+/**
+ * Decode 16 characters per step with SSSE3.
+ *
+ *	@param in Input
+ *	@param len Length of input
+ *	@param r Output
+ *	@param outavail Space for output
+ *	@return <i>characters</i> consumed
+ */
+__attribute__((target("ssse3")))
+static size_t b64_dec_ssse3(const u_char *in, size_t len, u_char *r, size_t outavail)
+{
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+				       0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+				       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  __m128i v, hi_nib, lo_nib;
+  size_t done = 0;
+
+  // Each step writes 16 bytes but keeps 12
+  for (; len - done >= 16 && outavail >= 16; done += 16, outavail -= 12, in += 16, r += 12)
+  {
+    v = _mm_loadu_si128((const __m128i *)in);
+    hi_nib = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+    lo_nib = _mm_and_si128(v, mask_2f);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nib),
+							 _mm_shuffle_epi8(lut_hi, hi_nib)),
+					   _mm_setzero_si128())))
       break;
-    *r++ = ((c[1] & 0x0F) << 4) | ((c[2] & 0x3C) >> 2);
-    ret->len++;
 
-    if (c[3] == EQ)
+    v = _mm_add_epi8(v, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f), hi_nib)));
+    v = _mm_madd_epi16(_mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *)r, _mm_shuffle_epi8(v, pack));
+  }
+
+  return done;
+}
+
+
+
+/**
+ * Decode 32 characters per step with AVX2.
+ *
+ *	@param in Input
+ *	@param len Length of input
+ *	@param r Output
+ *	@param outavail Space for output
+ *	@return <i>characters</i> consumed
+ */
+__attribute__((target("avx2")))
+static size_t b64_dec_avx2(const u_char *in, size_t len, u_char *r, size_t outavail)
+{
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+					  0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+					  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+					  0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+					  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+					  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+					  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+					    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+					2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  __m256i v, hi_nib, lo_nib;
+  size_t done = 0;
+
+  // Each step writes 32 bytes but keeps 24
+  for (; len - done >= 32 && outavail >= 32; done += 32, outavail -= 24, in += 32, r += 24)
+  {
+    v = _mm256_loadu_si256((const __m256i *)in);
+    hi_nib = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+    lo_nib = _mm256_and_si256(v, mask_2f);
+    if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo_nib), _mm256_shuffle_epi8(lut_hi, hi_nib)))
       break;
-    *r++ = ((c[2] & 0x03) << 6) | c[3];
-    ret->len++;
+
+    v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask_2f), hi_nib)));
+    v = _mm256_madd_epi16(_mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, pack);
+    _mm256_storeu_si256((__m256i *)r, _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7)));
   }
 
- done:
+  return done;
+}
+#endif /* B64_X86 */
+
+
+
+/**
+ * ioh read function for the base64 filter: read encoded data with the
+ * underlying read function and decode it.  Reads pass straight through
+ * when only writes are filtered.
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh
+ *	@param opaque Filter state
+ *	@param fd File descriptor
+ *	@param buf Buffer for decoded data
+ *	@param size Size of buf
+ *	@param flags Passed to underlying read function
+ *	@return Standard @a read() return codes
+ */
+static int b64_filter_read(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, caddr_t buf, __SIZE_TYPE__ size, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct b64_filter *bf = opaque;
+  size_t want;
+  ssize_t ret;
+  char *tmp;
+
+  if (!bf->bf_dec)
+    BK_RETURN(B, (*bf->bf_readfun)(B, ioh, bf->bf_opaque, fd, buf, size, flags));
+
+  // Enough encoded input that the decoded output (with slop) fits
+  want = MAX(size / 3 * 4, 16) - 8;
+  if (want > bf->bf_inalloc)
+  {
+    if (!(tmp = realloc(bf->bf_in, want)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate base64 input buffer: %s\n", strerror(errno));
+      BK_RETURN(B, -1);
+    }
+    bf->bf_in = tmp;
+    bf->bf_inalloc = want;
+  }
+
+  if (size < bk_base64_outlen(B, bf->bf_dec, want))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Read buffer of %zu bytes is too small for base64 filter\n", (size_t)size);
+    errno = EINVAL;
+    BK_RETURN(B, -1);
+  }
+
+  // Line ends and the like decode to nothing, which must not look like EOF
+  do
+  {
+    if ((ret = (*bf->bf_readfun)(B, ioh, bf->bf_opaque, fd, bf->bf_in, want, flags)) < 0)
+      BK_RETURN(B, ret);
+
+    if (ret == 0)
+      ret = bk_base64_final(B, bf->bf_dec, buf, size);
+    else if ((ret = bk_base64_update(B, bf->bf_dec, bf->bf_in, ret, buf, size)) == 0)
+      ret = -1;
+  } while (ret < 0);
+
   BK_RETURN(B, ret);
 }
+
+
+
+/**
+ * ioh write function for the base64 filter: encode the data and write
+ * it with the underlying write function.  Encoded data the underlying
+ * function did not take is kept and written first next time.  While
+ * there is any, the last input byte is not reported as written, which
+ * keeps the ioh asking to write; that byte has already been encoded,
+ * so it is skipped when it is offered again.  Writes pass straight
+ * through when only reads are filtered.
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh
+ *	@param opaque Filter state
+ *	@param fd File descriptor
+ *	@param iov Data to write
+ *	@param size Number of iovec buffers
+ *	@param flags Passed to underlying write function
+ *	@return Standard @a writev() return codes
+ */
+static int b64_filter_write(bk_s B, struct bk_ioh *ioh, void *opaque, int fd, struct iovec *iov, __SIZE_TYPE__ size, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct b64_filter *bf = opaque;
+  struct iovec vec;
+  size_t total = 0, skip, need, len;
+  __SIZE_TYPE__ i;
+  ssize_t ret;
+  char *tmp;
+
+  if (!bf->bf_enc)
+    BK_RETURN(B, (*bf->bf_writefun)(B, ioh, bf->bf_opaque, fd, iov, size, flags));
+
+  bf->bf_fd = fd;
+
+  if (bf->bf_outoff < bf->bf_outlen)
+  {
+    vec.iov_base = bf->bf_out + bf->bf_outoff;
+    vec.iov_len = bf->bf_outlen - bf->bf_outoff;
+    if ((ret = (*bf->bf_writefun)(B, ioh, bf->bf_opaque, fd, &vec, 1, flags)) < 0)
+      BK_RETURN(B, ret);
+    bf->bf_outoff += ret;
+    if (bf->bf_outoff < bf->bf_outlen)
+      BK_RETURN(B, 0);
+  }
+
+  // Each piece is encoded separately, and may leave room it does not use
+  for (i = 0, need = 0; i < size; i++)
+  {
+    total += iov[i].iov_len;
+    need += bk_base64_outlen(B, bf->bf_enc, iov[i].iov_len);
+  }
+
+  if (need > bf->bf_outalloc)
+  {
+    if (!(tmp = realloc(bf->bf_out, need)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate base64 output buffer: %s\n", strerror(errno));
+      BK_RETURN(B, -1);
+    }
+    bf->bf_out = tmp;
+    bf->bf_outalloc = need;
+  }
+
+  bf->bf_outlen = 0;
+  bf->bf_outoff = 0;
+  skip = bf->bf_held;
+  bf->bf_held = 0;
+
+  for (i = 0; i < size; i++)
+  {
+    len = iov[i].iov_len;
+    if (skip >= len)
+    {
+      skip -= len;
+      continue;
+    }
+    bf->bf_outlen += bk_base64_update(B, bf->bf_enc, (char *)iov[i].iov_base + skip, len - skip,
+				      bf->bf_out + bf->bf_outlen, bf->bf_outalloc - bf->bf_outlen);
+    skip = 0;
+  }
+
+  if (bf->bf_outlen)
+  {
+    vec.iov_base = bf->bf_out;
+    vec.iov_len = bf->bf_outlen;
+    if ((ret = (*bf->bf_writefun)(B, ioh, bf->bf_opaque, fd, &vec, 1, flags)) > 0)
+      bf->bf_outoff = ret;
+    else if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      BK_RETURN(B, ret);
+  }
+
+  if (bf->bf_outoff < bf->bf_outlen && total)
+  {
+    bf->bf_held = 1;
+    total--;
+  }
+
+  BK_RETURN(B, total);
+}
+
+
+
+/**
+ * ioh close function for the base64 filter: write out the end of the
+ * encoded data, then close with the underlying function.  When the ioh
+ * is not closing its descriptors (both are -1), the end goes to the
+ * descriptor the encoded data was being written to.
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param ioh The ioh
+ *	@param opaque Filter state
+ *	@param fdin Input file descriptor
+ *	@param fdout Output file descriptor
+ *	@param flags Passed to underlying close function
+ */
+static void b64_filter_close(bk_s B, struct bk_ioh *ioh, void *opaque, int fdin, int fdout, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct b64_filter *bf = opaque;
+  struct iovec vec;
+  char *tmp;
+  ssize_t len, ret;
+  int out = fdout >= 0 ? fdout : bf->bf_fd;
+
+  if (bf->bf_enc && out >= 0)
+  {
+    len = bf->bf_outlen - bf->bf_outoff;
+    if ((tmp = malloc(len + bk_base64_outlen(B, bf->bf_enc, 0))))
+    {
+      memcpy(tmp, bf->bf_out + bf->bf_outoff, len);
+      len += bk_base64_final(B, bf->bf_enc, tmp + len, bk_base64_outlen(B, bf->bf_enc, 0));
+      vec.iov_base = tmp;
+      vec.iov_len = len;
+      while (vec.iov_len > 0 && (ret = (*bf->bf_writefun)(B, ioh, bf->bf_opaque, out, &vec, 1, 0)) > 0)
+      {
+	vec.iov_base = (char *)vec.iov_base + ret;
+	vec.iov_len -= ret;
+      }
+      if (vec.iov_len > 0)
+	bk_error_printf(B, BK_ERR_WARN, "Could not write end of base64 data\n");
+      free(tmp);
+    }
+  }
+
+  (*bf->bf_closefun)(B, ioh, bf->bf_opaque, fdin, fdout, flags);
+  b64_filter_destroy(B, bf);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Free base64 filter state.
+ *
+ *	@param B BAKA Thread/Global state
+ *	@param bf Filter state
+ */
+static void b64_filter_destroy(bk_s B, struct b64_filter *bf)
+{
+  if (bf->bf_enc)
+    bk_base64_destroy(B, bf->bf_enc);
+  if (bf->bf_dec)
+    bk_base64_destroy(B, bf->bf_dec);
+  free(bf->bf_out);
+  free(bf->bf_in);
+  free(bf);
+}
 // @}
 
 
@@ -22,6 +22,68 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 #include <libbk.h>
 #include "libbk_internal.h"
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define TOKENIZE_X86					///< Can select x86 instructions at run time
+#include <immintrin.h>
+#endif /* x86 */
+
+
+/**
+ * @name Defines: bk_str_registry
+ * Layout of the string registry.  Strings are indexed by hash in
+ * BSR_SHARDS independently locked open addressed tables, so threads
+ * interning different strings rarely contend.  Ids index a segmented
+ * array whose segments never move, so id to string lookup needs no lock.
+ */
+// @{
+#define BSR_SHARDS		64		///< Number of lock stripes (power of two)
+#define BSR_SHARD(h)		((h) >> 26)	///< Top hash bits select the shard
+#define BSR_MINSLOTS		64		///< Initial slots in each shard index
+#define BSR_SEG0_BITS		10		///< log2 of the size of the first id segment
+#define BSR_SEGS		23		///< Id segments, doubling, to cover every bk_str_id_t
+#define BSR_CHUNKSIZE		65536		///< String arena chunk size
+#define BSR_STRALIGN		16		///< String arena allocation granularity
+#define BSR_STRMAX		256		///< Longest copy (with NUL) carved from the arena
+#define BSR_STRCLASS(len)	(((len) - 1) / BSR_STRALIGN) ///< Arena size class of a copy
+#define BSR_HASH(s)		bk_strhash((s), BK_HASH_V4)
+// @}
+
+
+
+/**
+ * @name bsr_slot
+ * Entry in a shard's string index.
+ */
+struct bsr_slot
+{
+  struct bk_str_registry_element *	bss_bsre; ///< Element, or NULL if empty
+  u_int32_t				bss_hash; ///< Hash of element string
+};
+
+
+
+/**
+ * @name bsr_shard
+ * One lock stripe of the registry: the index of the strings which hash
+ * to it, the arena their copies live in, and released elements and
+ * copies kept for reuse.  Elements never move to another shard, so the shard of an
+ * element found by id can be locked and then revalidated.
+ */
+struct bsr_shard
+{
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_t			bsh_lock; ///< Shard lock
+#endif /* BK_USING_PTHREADS */
+  struct bsr_slot *			bsh_slots; ///< Open addressed index
+  u_int					bsh_mask; ///< Index slots minus one
+  u_int					bsh_count; ///< Elements in index
+  char *				bsh_chunks; ///< String arena chunks (linked through first word)
+  char *				bsh_next; ///< Next free byte in current chunk
+  size_t				bsh_left; ///< Bytes left in current chunk
+  char *				bsh_strfree[BSR_STRMAX / BSR_STRALIGN]; ///< Released copies by size class (linked through first word)
+  struct bk_str_registry_element *	bsh_free; ///< Released elements
+} __attribute__((aligned(64)));
+
 
 
 /**
@@ -31,11 +93,11 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 struct bk_str_registry
 {
   bk_flags				bsr_flags; ///< Everyone needs flags. (NB Shares flags space with bk_str_registry_element
-  struct bk_str_registry_element **	bsr_registry; ///< Array of registry items.
+  struct bk_str_registry_element **	bsr_segs[BSR_SEGS]; ///< Id to element segments
   u_int					bsr_next_index;	///< The next registry index to assign.
-  u_int					bsr_registrysz;	///< The current allocated size of the registry.
+  struct bsr_shard *			bsr_shards; ///< Lock stripes
 #ifdef BK_USING_PTHREADS
-  pthread_mutex_t			bsr_lock; ///< Insert lock
+  pthread_mutex_t			bsr_lock; ///< Id assignment lock
 #endif /* BK_USING_PTHREADS */
 };
 
@@ -50,11 +112,10 @@ struct bk_str_registry_element
   bk_flags		bsre_flags;		///< Everyone needs flags. (NB Shares flag space with bk_str_registry)
   const char *		bsre_str;		///< The saved string.
   bk_str_id_t		bsre_id;		///< The id of this string.
-  u_int			bsre_ref;		///< Reference count
-#ifdef BK_USING_PTHREADS
-  pthread_mutex_t	bsre_lock;		///< Registry Lock
-#endif /* BK_USING_PTHREADS */
-
+  u_int			bsre_ref;		///< Reference count (shard lock)
+  u_int32_t		bsre_hash;		///< Hash of string
+  u_int			bsre_shard;		///< Shard, fixed for life of element
+  struct bk_str_registry_element *bsre_next;	///< Next released element
 };
 
 
@@ -85,8 +146,327 @@ struct bk_str_registry_element
  */
 #define LIMITNOTREACHED	(!limit || (limit > 1 && limit--))
 
-static struct bk_str_registry_element *bsre_create(bk_s B, const char *str, bk_flags flags);
-static void bsre_destroy(bk_s B, struct bk_str_registry_element *bsre);
+
+
+/**
+ * @name tokenize_class
+ * A set of bytes which end a run of ordinary characters for
+ * bk_string_tokenize_spans.  Besides the byte table, a set whose bytes
+ * have at most eight distinct high nibbles is kept as a pair of nibble
+ * tables: byte b is in the set iff lo[b & 15] & hi[b >> 4] is nonzero,
+ * which a vector byte shuffle can test sixteen or thirty-two bytes at a
+ * time.
+ */
+struct tokenize_class
+{
+  u_char		tc_class[256];		///< TOKENIZE_C_* bits of each byte, zero if ordinary
+  u_char		tc_lo[16];		///< High nibble groups, by low nibble
+  u_char		tc_hi[16];		///< High nibble group, by high nibble
+  int			tc_vector;		///< Set fits in the nibble tables
+};
+#define TOKENIZE_C_SPLIT	0x01		///< Split character
+#define TOKENIZE_C_SQUOTE	0x02		///< Single quote
+#define TOKENIZE_C_DQUOTE	0x04		///< Double quote
+#define TOKENIZE_C_BSLASH	0x08		///< Backslash
+#define TOKENIZE_SPLITON_MAX	32		///< Longest split set which is cached
+#define TOKENIZE_BSLASH_FLAGS	(BK_STRING_TOKENIZE_BACKSLASH|BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_CHAR|BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_OCT) ///< Flags which make backslash special
+#define TOKENIZE_CLASS_FLAGS	(BK_STRING_TOKENIZE_SINGLEQUOTE|BK_STRING_TOKENIZE_DOUBLEQUOTE|TOKENIZE_BSLASH_FLAGS) ///< Flags the classes depend on
+
+
+
+/**
+ * @name bk_strtok_scan
+ * Character classes for bk_string_tokenize_spans, kept in the bk_strtok
+ * so that a loop tokenizing with the same separators builds them once.
+ */
+struct bk_strtok_scan
+{
+  struct tokenize_class	bts_base;		///< Stops outside quotes
+  struct tokenize_class	bts_dquote;		///< Stops inside double quotes
+  bk_flags		bts_flags;		///< TOKENIZE_CLASS_FLAGS built for
+  char			bts_spliton[TOKENIZE_SPLITON_MAX]; ///< Split characters built for
+};
+
+
+
+/**
+ * @name tokenize_tok
+ * Token being collected by bk_string_tokenize_spans.  It stays a pointer
+ * into the source as long as it is one contiguous run of source bytes,
+ * and is copied to the arena at the first byte which breaks that.
+ */
+struct tokenize_tok
+{
+  const char *		tt_ptr;			///< Token text so far
+  size_t		tt_len;			///< Length of token text
+  char *		tt_out;			///< Next free byte of arena
+  int			tt_copied;		///< Token text is in arena
+};
+
+static struct bk_str_registry_element *bsre_create(bk_s B, struct bk_str_registry *bsr, const char *str, u_int32_t hash, bk_flags flags);
+static void bsre_release(bk_s B, struct bk_str_registry *bsr, struct bk_str_registry_element *bsre);
+static struct bk_str_registry_element **bsr_idslot(struct bk_str_registry *bsr, bk_str_id_t id, int create);
+static struct bk_str_registry_element *bsr_byid(struct bk_str_registry *bsr, bk_str_id_t id);
+static struct bk_str_registry_element *bsr_find(struct bk_str_registry *bsr, const char *str, u_int32_t hash);
+static int bsr_index_add(struct bsr_shard *shard, struct bk_str_registry_element *bsre);
+static void bsr_index_del(struct bsr_shard *shard, struct bk_str_registry_element *bsre);
+static struct bk_str_registry_element *bsr_lockbyid(bk_s B, struct bk_str_registry *bsr, bk_str_id_t id);
+static int bsr_assign(bk_s B, struct bk_str_registry *bsr, struct bk_str_registry_element *bsre, bk_str_id_t id);
+static char **tokenize_split_spans(bk_s B, const char *src, u_int limit, const char *spliton, bk_flags flags);
+static int tokenize_spans(bk_s B, struct bk_strtok *bst, const struct bk_strtok_scan *bts, const char *src, size_t len, u_int limit, const char *spliton, bk_flags flags);
+static void tokenize_scan_init(struct bk_strtok_scan *bts, const char *spliton, bk_flags flags);
+static void tokenize_class_init(struct tokenize_class *tc);
+static const char *tokenize_scan(const struct tokenize_class *tc, const char *p, const char *end);
+#ifdef TOKENIZE_X86
+static const char *tokenize_scan_ssse3(const struct tokenize_class *tc, const char *p, const char *end);
+static const char *tokenize_scan_avx2(const struct tokenize_class *tc, const char *p, const char *end);
+#endif /* TOKENIZE_X86 */
+static const char *tokenize_bslash(struct tokenize_tok *tt, const char *p, const char *end, bk_flags flags);
+static void tokenize_append(struct tokenize_tok *tt, const char *ptr, size_t len);
+static void tokenize_appendc(struct tokenize_tok *tt, u_char c);
+
+
+/**
+ * @name BK_HASH_V4
+ *
+ * A wyhash-style hash built on 64x64->128 bit multiply-and-fold.  The
+ * key is taken as little-endian 8 byte words; each 16 byte chunk is
+ * mixed into one of four independent lanes (chunk number mod 4), so long
+ * keys keep four multiplies in flight instead of one serial chain.  The
+ * last 0-15 bytes, zero padded, and the length are folded in at the end.
+ * Keys shorter than 16 bytes cost two multiplies.
+ *
+ * The string form finds the terminating NUL while it hashes, reading
+ * aligned words (which never cross a page) and shifting them into
+ * string order, so it needs no separate strlen pass and gives exactly the
+ * same answer as the buffer form over the same bytes.
+ */
+// @{
+#define H4_S0	0xa0761d6478bd642fULL		///< wyhash secret 0
+#define H4_S1	0xe7037ed1a0b428dbULL		///< wyhash secret 1
+#define H4_S2	0x8ebc6af09c88c6e3ULL		///< wyhash secret 2
+#define H4_S3	0x589965cc75374cc3ULL		///< wyhash secret 3
+#define H4_ONES	0x0101010101010101ULL		///< Low bit of each byte
+#define H4_HIGHS 0x8080808080808080ULL		///< High bit of each byte
+#define H4_HASZERO(w) (((w) - H4_ONES) & ~(w) & H4_HIGHS) ///< Nonzero if some byte of w is zero, lowest set bit marks the first
+
+
+
+/**
+ * Multiply and fold 128 bit product
+ *
+ * @param a multiplicand
+ * @param b multiplier
+ * @return <i>low ^ high</i> halves of a*b
+ */
+static inline u_int64_t h4_mix(u_int64_t a, u_int64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = (unsigned __int128)a * b;
+
+  return((u_int64_t)r ^ (u_int64_t)(r >> 64));
+#else
+  u_int64_t alo = a & 0xffffffffULL, ahi = a >> 32;
+  u_int64_t blo = b & 0xffffffffULL, bhi = b >> 32;
+  u_int64_t lolo = alo * blo, hilo = ahi * blo, lohi = alo * bhi, hihi = ahi * bhi;
+  u_int64_t cross = (lolo >> 32) + (hilo & 0xffffffffULL) + lohi;
+
+  return(((cross << 32) | (lolo & 0xffffffffULL)) ^ (hihi + (hilo >> 32) + (cross >> 32)));
+#endif /* __SIZEOF_INT128__ */
+}
+
+
+
+/**
+ * Read an 8 byte little-endian word
+ *
+ * @param p bytes
+ * @return <i>word</i>
+ */
+static inline u_int64_t h4_read64(const u_char *p)
+{
+  u_int64_t w;
+
+  memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif /* big endian */
+  return(w);
+}
+
+
+
+/**
+ * Read up to 8 bytes as a zero padded little-endian word
+ *
+ * @param p bytes
+ * @param len number of bytes (0-8)
+ * @return <i>word</i>
+ */
+static inline u_int64_t h4_readpartial(const u_char *p, size_t len)
+{
+  u_int32_t lo, hi;
+
+  // Overlapping reads put the same bytes in the same places, so OR is exact
+  if (len >= 4)
+  {
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + len - 4, sizeof(hi));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap32(lo);
+    hi = __builtin_bswap32(hi);
+#endif /* big endian */
+    return((u_int64_t)lo | ((u_int64_t)hi << (8 * (len - 4))));
+  }
+  if (len)
+    return((u_int64_t)p[0] | ((u_int64_t)p[len / 2] << (8 * (len / 2))) | ((u_int64_t)p[len - 1] << (8 * (len - 1))));
+  return(0);
+}
+
+
+
+/**
+ * Final mixing shared by both forms
+ *
+ * @param lane Lane state
+ * @param chunks Number of 16 byte chunks mixed into the lanes
+ * @param a First tail word
+ * @param b Second tail word
+ * @param len Length of key
+ * @return <i>32 bit hash</i>
+ */
+static inline u_int h4_final(const u_int64_t *lane, size_t chunks, u_int64_t a, u_int64_t b, u_int64_t len)
+{
+  u_int64_t h = H4_S0;
+
+  if (chunks)
+    h = h4_mix(lane[0] ^ H4_S1, lane[1] ^ H4_S2) ^ h4_mix(lane[2] ^ H4_S0, lane[3] ^ H4_S1);	// Never zero for an untouched lane
+
+  h = h4_mix(a ^ H4_S1, b ^ h);
+  h = h4_mix(h ^ len ^ H4_S2, H4_S3);
+  return((u_int)(h ^ (h >> 32)));
+}
+
+
+
+/**
+ * BK_HASH_V4 of a buffer
+ *
+ * @param key bytes
+ * @param len length
+ * @return <i>hash</i>
+ */
+static u_int h4_buf(const void *key, size_t len)
+{
+  const u_char *p = key;
+  u_int64_t lane[4] = { H4_S0, H4_S1, H4_S2, H4_S3 };
+  size_t chunks = len / 16, c = 0;
+  size_t tail = len % 16;
+
+  // Whole 64 byte stripes, one chunk per lane
+  for (; c + 4 <= chunks; c += 4, p += 64)
+  {
+    lane[0] = h4_mix(h4_read64(p) ^ H4_S1, h4_read64(p + 8) ^ lane[0]);
+    lane[1] = h4_mix(h4_read64(p + 16) ^ H4_S1, h4_read64(p + 24) ^ lane[1]);
+    lane[2] = h4_mix(h4_read64(p + 32) ^ H4_S1, h4_read64(p + 40) ^ lane[2]);
+    lane[3] = h4_mix(h4_read64(p + 48) ^ H4_S1, h4_read64(p + 56) ^ lane[3]);
+  }
+  for (; c < chunks; c++, p += 16)
+    lane[c & 3] = h4_mix(h4_read64(p) ^ H4_S1, h4_read64(p + 8) ^ lane[c & 3]);
+
+  if (tail > 8)
+    return(h4_final(lane, chunks, h4_read64(p), h4_readpartial(p + 8, tail - 8), len));
+  return(h4_final(lane, chunks, h4_readpartial(p, tail), 0, len));
+}
+
+
+
+/**
+ * BK_HASH_V4 of a NUL terminated string, in one pass.
+ *
+ * Reading whole aligned words past the terminator is safe (they cannot
+ * span a page) but upsets memory checkers, so those builds, and
+ * big-endian machines, hash the string as a buffer instead.  Words are
+ * loaded with memcpy rather than through a u_int64_t pointer, which
+ * would break the aliasing rules for the caller's char array.
+ *
+ * @param k string
+ * @return <i>hash</i>
+ */
+#if defined(__SANITIZE_ADDRESS__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+static u_int h4_str(const char *k)
+{
+  return(h4_buf(k, strlen(k)));
+}
+#else
+static u_int h4_str(const char *k)
+{
+  u_int64_t lane[4], r0 = H4_S0, r1 = H4_S1, r2 = H4_S2, r3 = H4_S3, t;
+  u_int off = (u_long)k & 7;
+  const u_char *ap = (const u_char *)k - off;
+  u_int64_t cur, next = 0, w, pending = 0, zero;
+  size_t chunks = 0, words = 0;
+  u_int z;
+
+  // Bytes before the string in the first word must not look like its end
+  cur = h4_read64(ap) | (off ? (1ULL << (8 * off)) - 1 : 0);
+  ap += 8;
+
+  while (1)
+  {
+    if (!off)
+      w = cur;
+    else
+    {
+      // Only fetch the next word if the string continues into it
+      if (!H4_HASZERO(cur))
+      {
+	next = h4_read64(ap);
+	ap += 8;
+      }
+      else
+	next = 0;
+      w = (cur >> (8 * off)) | (next << (64 - 8 * off));
+    }
+
+    if ((zero = H4_HASZERO(w)))
+      break;
+
+    if (words++ & 1)
+    {
+      // r0 is always the lane of the next chunk; rotating keeps them all in registers
+      t = h4_mix(pending ^ H4_S1, w ^ r0);
+      r0 = r1; r1 = r2; r2 = r3; r3 = t;
+      chunks++;
+    }
+    else
+      pending = w;
+
+    if (off)
+      cur = next;
+    else
+    {
+      cur = h4_read64(ap);
+      ap += 8;
+    }
+  }
+
+  lane[chunks & 3] = r0;
+  lane[(chunks + 1) & 3] = r1;
+  lane[(chunks + 2) & 3] = r2;
+  lane[(chunks + 3) & 3] = r3;
+
+  // Keep only the bytes before the terminator
+  z = __builtin_ctzll(zero) / 8;
+  w &= z ? ~0ULL >> (64 - 8 * z) : 0;
+
+  if (words & 1)
+    return(h4_final(lane, chunks, pending, w, words * 8 + z));
+  return(h4_final(lane, chunks, w, 0, words * 8 + z));
+}
+#endif /* sanitizer or big endian */
+// @}
+
 
 
 /**
@@ -105,6 +485,7 @@ static void bsre_destroy(bk_s B, struct bk_str_registry_element *bsre);
  *	BK_HASH_V1 use traditional, but slowish hashing function
  *	BK_HASH_V2 use Jenkins-hash, slow hasher producing better distribution (but poorly understood)
  *	BK_HASH_V3 use murmurhash, faster (but requires two passes) and good  (default)
+ *	BK_HASH_V4 use wyhash-style multiply hash, fastest (single pass) and good
  *	@return <i>hash</i> of number
  */
 u_int
@@ -242,6 +623,10 @@ bk_strhash(const char *k, bk_flags flags)
     mix(a,b,h);
 #undef mix
   }
+  else if (BK_FLAG_ISSET(flags, BK_HASH_V4))
+  {
+    h = h4_str(k);
+  }
   else						// V3 murmurhash, now the default
   {
     h = murmurhash2a_allret(k, strlen(k));
@@ -275,6 +660,7 @@ bk_strhash(const char *k, bk_flags flags)
  *	BK_HASH_V1 use traditional, but slower hashing function
  *	BK_HASH_V2 IS NOT AVAILABLE
  *	BK_HASH_V3 use murmurhash, fast and good (default)
+ *	BK_HASH_V4 use wyhash-style multiply hash, fastest on long buffers; same value as bk_strhash gives the same bytes
  *	@return <i>hash</i> of number
  */
 u_int
@@ -313,6 +699,10 @@ bk_bufhash(const bk_vptr *b, bk_flags flags)
       break;
     }
   }
+  else if (BK_FLAG_ISSET(flags, BK_HASH_V4))
+  {
+    h = h4_buf(b->ptr, b->len);
+  }
   else						// V3 murmurhash, now the default
   {
     h = murmurhash2a_allret(b->ptr, b->len);
@@ -534,6 +924,7 @@ char *bk_string_printbuf(bk_s B, const char *intro, const char *prefix, const bk
  *
  *	@return <i>NULL</i> on call failure, allocation failure, other failure
  *	@return <br><i>null terminated array of token strings</i> on success.
+ *	@see bk_string_tokenize_spans to tokenize without allocating.
  */
 char **bk_string_tokenize_split(bk_s B, const char *src, u_int limit, const char *spliton, const char *braces, const dict_h kvht_vardb, const char **variabledb, bk_flags flags)
 {
@@ -561,6 +952,10 @@ char **bk_string_tokenize_split(bk_s B, const char *src, u_int limit, const char
 
   bk_debug_printf_and(B, 1, "Tokenizing ``%s'' with limit %d and flags %x\n",src,limit,flags);
 
+  // Without variables or braces the span tokenizer does the same job
+  if (!kvht_vardb && !variabledb && (!braces || !*braces))
+    BK_RETURN(B, tokenize_split_spans(B, src, limit, spliton, flags));
+
   if (!(tokenx = bk_memx_create(B, sizeof(char), TOKENIZE_STR_FIRST, TOKENIZE_STR_INCR, 0)) ||
       !(splitx = bk_memx_create(B, sizeof(char *), TOKENIZE_FIRST, TOKENIZE_INCR, 0)))
   {
@@ -1240,132 +1635,776 @@ void bk_string_tokenize_destroy(bk_s B, char **tokenized)
 
 
 /**
- * Rip a string -- terminate it at the first occurrence of the terminator characters.,
- * Typically used with vertical whitespace to nuke the \r\n stuff.
+ * Split a buffer into tokens without copying them.  This understands the
+ * same flags, and finds the same tokens, as bk_string_tokenize_split,
+ * except that there are no braces or variables; but rather than an array
+ * of new strings, the tokens are left in @a bst as pointers into @a src.
+ * Only a token whose text was changed by quoting or backslashes is
+ * copied, into an arena which is sized to the source up front.  The
+ * token array and arena are kept in @a bst and reused by the next call,
+ * so a loop tokenizing line after line allocates only while they grow.
  *
- * THREADS: MT-SAFE
+ * The source is @a len bytes and need not be NUL terminated; a NUL in it
+ * is an ordinary character.  Runs of ordinary characters are found with
+ * vector scans where the CPU has them.
+ *
+ * THREADS: MT-SAFE (as long as bst is thread private)
  *
  *	@param B BAKA Thread/global state
- *	@param string String to examine and change
- *	@param terminators String containing characters to terminate source at, on first occurrence--if NULL use vertical whitespace.
- *	@param flags Fun for the future
- *	@return <i>NULL</i> on failure
- *	@return <br><i>modified string</i> on success
+ *	@param bst Tokenizer state, zeroed before first use
+ *	@param src Source buffer
+ *	@param len Length of source
+ *	@param limit Maximum number of tokens to generate--last token contains "rest" of string.  Zero for unlimited.
+ *	@param spliton The string containing the character(s) which separate tokens (NULL for whitespace)
+ *	@param flags BK_STRING_TOKENIZE_* as for bk_string_tokenize_split
+ *	@return <i>-1</i> on call failure, allocation failure
+ *	@return <br><i>number of tokens</i> (also in bst->bst_count) on success;
+ *	the tokens are valid until the next call, or until @a src changes
+ *	@see bk_string_tokenize_spans_free
  */
-char *bk_string_rip(bk_s B, char *string, const char *terminators, bk_flags flags)
+int bk_string_tokenize_spans(bk_s B, struct bk_strtok *bst, const char *src, size_t len, u_int limit, const char *spliton, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_strtok_scan *bts;
 
-  if (!string)
+  if (!bst || (!src && len))
   {
     bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
-    BK_RETURN(B, NULL);
+    BK_RETURN(B, -1);
   }
 
-  if (!terminators) terminators = BK_VWHITESPACE;
+  if (!spliton)
+    spliton = BK_WHITESPACE;
 
-  /* Write zero at either first terminator character, or at the trailing \0 */
-  *(string + strcspn(string,terminators)) = 0;
-  BK_RETURN(B, string);
+  if (!(bts = bst->bst_scan))
+  {
+    if (!BK_MALLOC(bts))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate tokenizer classes: %s\n", strerror(errno));
+      BK_RETURN(B, -1);
+    }
+    bst->bst_scan = bts;
+    tokenize_scan_init(bts, spliton, flags);
+  }
+  else if (bts->bts_flags != (flags & TOKENIZE_CLASS_FLAGS) || strlen(spliton) >= sizeof(bts->bts_spliton) ||
+	   strcmp(bts->bts_spliton, spliton))
+  {
+    tokenize_scan_init(bts, spliton, flags);
+  }
+
+  BK_RETURN(B, tokenize_spans(B, bst, bts, src, len, limit, spliton, flags));
 }
 
 
 
 /**
- * Quote a string, with double quotes, for printing, and subsequent split'ing,
- * and returning a newly allocated string which should be free'd by the caller.
- *
- * split should get the following flags to decode
- * BK_STRING_TOKENIZE_DOUBLEQUOTE|BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_OCT
+ * Release the storage held by a bk_strtok, leaving it ready for reuse.
  *
- * THREADS: MT-SAFE
+ * THREADS: MT-SAFE (as long as bst is thread private)
  *
  *	@param B BAKA Thread/global state
- *	@param src Source string to convert
- *	@param needquote Characters which need backslash quoting (double quote if NULL)
- *	@param flags BK_STRING_QUOTE_NULLOK will convert NULL @a src into BK_NULLSTR.  BK_STRING_QUOTE_NONPRINT will quote non-printable characters.
- *	@return <i>NULL</i> on call failure, allocation failure, other failure
- *	@return <br><i>quoted src</i> on success (you must free)
+ *	@param bst Tokenizer state
+ *	@see bk_string_tokenize_spans
  */
-char *bk_string_quote(bk_s B, const char *src, const char *needquote, bk_flags flags)
+void bk_string_tokenize_spans_free(bk_s B, struct bk_strtok *bst)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  char *ret = NULL;
-  struct bk_memx *outputx;
-  char scratch[16];
 
-  if (!src)
+  if (!bst)
   {
-    if (BK_FLAG_ISSET(flags, BK_STRING_QUOTE_NULLOK))
-    {
-      if (!(ret = strdup(BK_NULLSTR)))
-	bk_error_printf(B, BK_ERR_ERR, "Could not allocate space for NULL\n");
-    }
-    else
-      bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
-
-    BK_RETURN(B, ret);		/* "NULL" or NULL */
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_VRETURN(B);
   }
 
-  if (!needquote) needquote = "\"";
+  if (bst->bst_tokens)
+    free(bst->bst_tokens);
+  if (bst->bst_arena)
+    free(bst->bst_arena);
+  if (bst->bst_scan)
+    free(bst->bst_scan);
+  memset(bst, 0, sizeof(*bst));
 
-  if (!(outputx = bk_memx_create(B, sizeof(char), strlen(src)+5, TOKENIZE_STR_INCR, 0)))
-  {
-    bk_error_printf(B, BK_ERR_ERR, "Could not create expandable output space for quotation\n");
-    BK_RETURN(B, NULL);
-  }
+  BK_VRETURN(B);
+}
 
-  for(;*src;src++)
-  {
-    if (*src == '\\' || strchr(needquote, *src) || (BK_FLAG_ISSET(flags, BK_STRING_QUOTE_NONPRINT)?!isprint(*src):0))
-    {						/* Must convert to octal  */
-      snprintf(scratch,sizeof(scratch),"\\0%o",(u_char)*src);
-      if (!(ret = bk_memx_get(B, outputx, strlen(scratch), NULL, BK_MEMX_GETNEW)))
-      {
-	bk_error_printf(B, BK_ERR_ERR, "Could not extend array for additional character\n");
-	goto error;
-      }
-      memcpy(ret,scratch,strlen(scratch));
-    }
-    else
-    {						/* Normal, just stick in */
-      if (!(ret = bk_memx_get(B, outputx, 1, NULL, BK_MEMX_GETNEW)))
-      {
-	bk_error_printf(B, BK_ERR_ERR, "Could not extend array for additional character\n");
-	goto error;
-      }
-      *ret = *src;
-    }
-  }
 
-  if (!(ret = bk_memx_get(B, outputx, 1, NULL, BK_MEMX_GETNEW)))
+
+/**
+ * bk_string_tokenize_split for a string with no braces or variables:
+ * find the tokens as spans and copy each one out.
+ *
+ *	@param B BAKA Thread/global state
+ *	@param src Source string
+ *	@param limit Maximum number of tokens, zero for unlimited
+ *	@param spliton Split characters, NULL for whitespace
+ *	@param flags BK_STRING_TOKENIZE_*
+ *	@return <i>NULL</i> on allocation failure
+ *	@return <br><i>null terminated array of token strings</i> on success.
+ */
+static char **tokenize_split_spans(bk_s B, const char *src, u_int limit, const char *spliton, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_strtok bst;
+  struct bk_strtok_scan bts;
+  char **ret = NULL;
+  int count, i;
+
+  memset(&bst, 0, sizeof(bst));
+
+  if (!spliton)
+    spliton = BK_WHITESPACE;
+  tokenize_scan_init(&bts, spliton, flags);
+
+  if ((count = tokenize_spans(B, &bst, &bts, src, strlen(src), limit, spliton, flags)) < 0)
+    goto error;
+
+  if (!BK_CALLOC_LEN(ret, (count + 1) * sizeof(*ret)))
   {
-    bk_error_printf(B, BK_ERR_ERR, "Could not extend array for additional character\n");
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate token array: %s\n", strerror(errno));
     goto error;
   }
-  *ret = 0;
 
-  if (!(ret = bk_memx_get(B, outputx, 0, NULL, 0)))
+  for (i = 0; i < count; i++)
   {
-    bk_error_printf(B, BK_ERR_ERR, "Could not obtain output string\n");
-    goto error;
+    if (!BK_MALLOC_LEN(ret[i], bst.bst_tokens[i].bss_len + 1))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not duplicate token: %s\n", strerror(errno));
+      goto error;
+    }
+    memcpy(ret[i], bst.bst_tokens[i].bss_ptr, bst.bst_tokens[i].bss_len);
+    ret[i][bst.bst_tokens[i].bss_len] = '\0';
   }
-  bk_memx_destroy(B, outputx, BK_MEMX_PRESERVE_ARRAY);
 
+  bk_string_tokenize_spans_free(B, &bst);
   BK_RETURN(B, ret);
 
  error:
-  if (outputx)
-    bk_memx_destroy(B, outputx, 0);
-
+  if (ret)
+    bk_string_tokenize_destroy(B, ret);
+  bk_string_tokenize_spans_free(B, &bst);
   BK_RETURN(B, NULL);
 }
 
 
 
 /**
- * Bounded strlen. Return the length the of a string but go no further than
- * the bound. NB: This function returns a @a ssize_t not a @a size_t as per
+ * The tokenizer proper, following the state machine of
+ * bk_string_tokenize_split (including its handling of the limit) but
+ * consuming whole runs of ordinary characters at a time.
+ *
+ *	@param B BAKA Thread/global state
+ *	@param bst Tokenizer state to fill in
+ *	@param bts Character classes for @a spliton and @a flags
+ *	@param src Source buffer
+ *	@param len Length of source
+ *	@param limit Maximum number of tokens, zero for unlimited
+ *	@param spliton Split characters
+ *	@param flags BK_STRING_TOKENIZE_*
+ *	@return <i>-1</i> on allocation failure
+ *	@return <br><i>number of tokens</i> on success
+ */
+static int tokenize_spans(bk_s B, struct bk_strtok *bst, const struct bk_strtok_scan *bts, const char *src, size_t len, u_int limit, const char *spliton, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const u_char *class = bts->bts_base.tc_class;
+  const char *p = src, *end = src + len, *q;
+  struct tokenize_tok tt;
+  struct bk_strspan *span;
+  u_int state = S_BASE;
+  size_t size;
+  void *tmp;
+  u_char c;
+
+  bst->bst_count = 0;
+
+  // Unquoting never makes a token longer, so the arena cannot overflow
+  if (len > bst->bst_arenasize)
+  {
+    size = MAX(len, bst->bst_arenasize * 2);
+    if (!(tmp = realloc(bst->bst_arena, size)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate token arena: %s\n", strerror(errno));
+      BK_RETURN(B, -1);
+    }
+    bst->bst_arena = tmp;
+    bst->bst_arenasize = size;
+  }
+
+  if (BK_FLAG_ISSET(flags, BK_STRING_TOKENIZE_SKIPLEADING))
+  {
+    while (p < end && (class[(u_char)*p] & TOKENIZE_C_SPLIT))
+      p++;
+  }
+
+  // As for bk_string_tokenize_split, only an empty source has no tokens
+  if (BK_FLAG_ISCLEAR(flags, BK_STRING_TOKENIZE_WANT_EMPTY_TOKEN) && !len)
+    BK_RETURN(B, 0);
+
+  tt.tt_ptr = p;
+  tt.tt_len = 0;
+  tt.tt_out = bst->bst_arena;
+  tt.tt_copied = 0;
+
+  for (;;)
+  {
+    if (INSTATE(S_SPLIT))
+    {
+      if (p == end)
+      {
+	// <TRICKY>The end counts against the limit as a separator would</TRICKY>
+	if (LIMITNOTREACHED)
+	  break;
+	GOSTATE(S_BASE);
+	continue;
+      }
+
+      if ((class[(u_char)*p] & TOKENIZE_C_SPLIT) && LIMITNOTREACHED)
+      {
+	p++;
+	if (BK_FLAG_ISSET(flags, BK_STRING_TOKENIZE_MULTISPLIT))
+	  continue;
+	goto tokenizeme;			// Multiple separators are additional tokens
+      }
+
+      GOSTATE(S_BASE);
+    }
+
+    if (INSTATE(S_BASE))
+    {
+      q = tokenize_scan(&bts->bts_base, p, end);
+      tokenize_append(&tt, p, q - p);
+      if ((p = q) == end)
+	goto tokenizeme;
+
+      c = class[(u_char)*p];
+      if ((c & TOKENIZE_C_SPLIT) && LIMITNOTREACHED)
+      {
+	p++;
+	GOSTATE(S_SPLIT);
+	goto tokenizeme;
+      }
+      if (c & TOKENIZE_C_SQUOTE)
+      {
+	p++;
+	GOSTATE(S_SQUOTE);
+	continue;
+      }
+      if (c & TOKENIZE_C_DQUOTE)
+      {
+	p++;
+	GOSTATE(S_DQUOTE);
+	continue;
+      }
+      if (c & TOKENIZE_C_BSLASH)
+      {
+	if (!(p = tokenize_bslash(&tt, p, end, flags)))
+	  goto tokenizeme;
+	continue;
+      }
+
+      // Separator past the limit
+      tokenize_append(&tt, p, 1);
+      p++;
+      continue;
+    }
+
+    if (INSTATE(S_SQUOTE))
+    {
+      if (p == end)
+      {
+	bk_error_printf(B, BK_ERR_NOTICE, "Unexpected end-of-string inside a single quote\n");
+	goto tokenizeme;
+      }
+      if (!(q = memchr(p, '\'', end - p)))
+	q = end;
+      tokenize_append(&tt, p, q - p);
+      if ((p = q) < end)
+      {
+	p++;
+	GOSTATE(S_BASE);
+      }
+      continue;
+    }
+
+    if (INSTATE(S_DQUOTE))
+    {
+      if (p == end)
+      {
+	bk_error_printf(B, BK_ERR_NOTICE, "Unexpected end-of-string inside a double quote\n");
+	goto tokenizeme;
+      }
+      q = tokenize_scan(&bts->bts_dquote, p, end);
+      tokenize_append(&tt, p, q - p);
+      if ((p = q) == end)
+	continue;
+      if (*p == '"')
+      {
+	p++;
+	GOSTATE(S_BASE);
+	continue;
+      }
+      if (!(p = tokenize_bslash(&tt, p, end, flags)))
+	goto tokenizeme;
+      continue;
+    }
+
+    bk_error_printf(B, BK_ERR_ERR, "Should never reach here (%x)\n", state);
+    BK_RETURN(B, -1);
+
+  tokenizeme:
+    if (bst->bst_count == bst->bst_size)
+    {
+      size = bst->bst_size ? bst->bst_size * 2 : TOKENIZE_FIRST;
+      if (!(tmp = realloc(bst->bst_tokens, size * sizeof(*bst->bst_tokens))))
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not extend array for additional token slot: %s\n", strerror(errno));
+	BK_RETURN(B, -1);
+      }
+      bst->bst_tokens = tmp;
+      bst->bst_size = size;
+    }
+
+    span = &bst->bst_tokens[bst->bst_count++];
+    span->bss_ptr = tt.tt_ptr;
+    span->bss_len = tt.tt_len;
+
+    if (tt.tt_copied)
+      tt.tt_out += tt.tt_len;
+    tt.tt_ptr = p;
+    tt.tt_len = 0;
+    tt.tt_copied = 0;
+
+    if (!p || (p == end && !INSTATE(S_SPLIT)))
+      break;
+  }
+
+  BK_RETURN(B, bst->bst_count);
+}
+
+
+
+/**
+ * Build the character classes for a set of split characters and flags.
+ *
+ *	@param bts Classes to fill in
+ *	@param spliton Split characters
+ *	@param flags BK_STRING_TOKENIZE_*
+ */
+static void tokenize_scan_init(struct bk_strtok_scan *bts, const char *spliton, bk_flags flags)
+{
+  const u_char *s;
+
+  memset(bts->bts_base.tc_class, 0, sizeof(bts->bts_base.tc_class));
+  memset(bts->bts_dquote.tc_class, 0, sizeof(bts->bts_dquote.tc_class));
+
+  for (s = (const u_char *)spliton; *s; s++)
+    bts->bts_base.tc_class[*s] |= TOKENIZE_C_SPLIT;
+  if (BK_FLAG_ISSET(flags, BK_STRING_TOKENIZE_SINGLEQUOTE))
+    bts->bts_base.tc_class['\''] |= TOKENIZE_C_SQUOTE;
+  if (BK_FLAG_ISSET(flags, BK_STRING_TOKENIZE_DOUBLEQUOTE))
+    bts->bts_base.tc_class['"'] |= TOKENIZE_C_DQUOTE;
+  if (flags & TOKENIZE_BSLASH_FLAGS)
+  {
+    bts->bts_base.tc_class['\\'] |= TOKENIZE_C_BSLASH;
+    bts->bts_dquote.tc_class['\\'] |= TOKENIZE_C_BSLASH;
+  }
+  bts->bts_dquote.tc_class['"'] |= TOKENIZE_C_DQUOTE;
+
+  tokenize_class_init(&bts->bts_base);
+  tokenize_class_init(&bts->bts_dquote);
+
+  bts->bts_flags = flags & TOKENIZE_CLASS_FLAGS;
+  if (strlen(spliton) < sizeof(bts->bts_spliton))
+    strcpy(bts->bts_spliton, spliton);
+  else
+    bts->bts_spliton[0] = '\0';			// Never matches, since spliton is too long
+}
+
+
+
+/**
+ * Build the nibble tables for a class from its byte table.  Each distinct
+ * high nibble in the set gets one of eight group bits.
+ *
+ *	@param tc Class whose byte table is filled in
+ */
+static void tokenize_class_init(struct tokenize_class *tc)
+{
+  u_int b, groups = 0;
+
+  memset(tc->tc_lo, 0, sizeof(tc->tc_lo));
+  memset(tc->tc_hi, 0, sizeof(tc->tc_hi));
+  tc->tc_vector = 1;
+
+  for (b = 0; b < 256; b++)
+  {
+    if (!tc->tc_class[b])
+      continue;
+
+    if (!tc->tc_hi[b >> 4])
+    {
+      if (groups == 8)
+      {
+	tc->tc_vector = 0;
+	return;
+      }
+      tc->tc_hi[b >> 4] = 1 << groups++;
+    }
+    tc->tc_lo[b & 15] |= tc->tc_hi[b >> 4];
+  }
+}
+
+
+
+/**
+ * Find the next byte of a class.
+ *
+ *	@param tc Class
+ *	@param p Start of search
+ *	@param end End of search
+ *	@return <i>first byte in class</i>, or @a end if none
+ */
+static const char *tokenize_scan(const struct tokenize_class *tc, const char *p, const char *end)
+{
+#ifdef TOKENIZE_X86
+  if (tc->tc_vector && end - p >= 16)
+  {
+    if (end - p >= 32 && __builtin_cpu_supports("avx2"))
+      return tokenize_scan_avx2(tc, p, end);
+    if (__builtin_cpu_supports("ssse3"))
+      return tokenize_scan_ssse3(tc, p, end);
+  }
+#endif /* TOKENIZE_X86 */
+
+  for (; p < end && !tc->tc_class[(u_char)*p]; p++)
+    ;
+
+  return p;
+}
+
+
+
+#ifdef TOKENIZE_X86
+/**
+ * Find the next byte of a class sixteen bytes at a time with SSSE3.
+ *
+ *	@param tc Class, which must fit the nibble tables
+ *	@param p Start of search
+ *	@param end End of search
+ *	@return <i>first byte in class</i>, or @a end if none
+ */
+__attribute__((target("ssse3")))
+static const char *tokenize_scan_ssse3(const struct tokenize_class *tc, const char *p, const char *end)
+{
+  const __m128i lo = _mm_loadu_si128((const __m128i *)tc->tc_lo);
+  const __m128i hi = _mm_loadu_si128((const __m128i *)tc->tc_hi);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i v, m;
+  u_int bits;
+
+  for (; end - p >= 16; p += 16)
+  {
+    v = _mm_loadu_si128((const __m128i *)p);
+    m = _mm_and_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)),
+		      _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    if ((bits = _mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128())) ^ 0xffff))
+      return p + __builtin_ctz(bits);
+  }
+
+  for (; p < end && !tc->tc_class[(u_char)*p]; p++)
+    ;
+
+  return p;
+}
+
+
+
+/**
+ * Find the next byte of a class thirty-two bytes at a time with AVX2.
+ *
+ *	@param tc Class, which must fit the nibble tables
+ *	@param p Start of search
+ *	@param end End of search
+ *	@return <i>first byte in class</i>, or @a end if none
+ */
+__attribute__((target("avx2")))
+static const char *tokenize_scan_avx2(const struct tokenize_class *tc, const char *p, const char *end)
+{
+  const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tc->tc_lo));
+  const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tc->tc_hi));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i v, m;
+  u_int bits;
+
+  for (; end - p >= 32; p += 32)
+  {
+    v = _mm256_loadu_si256((const __m256i *)p);
+    m = _mm256_and_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)),
+			 _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    if ((bits = ~(u_int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, _mm256_setzero_si256()))))
+      return p + __builtin_ctz(bits);
+  }
+
+  for (; p < end && !tc->tc_class[(u_char)*p]; p++)
+    ;
+
+  return p;
+}
+#endif /* TOKENIZE_X86 */
+
+
+
+/**
+ * Handle a backslash as bk_string_tokenize_split would.
+ *
+ *	@param tt Token being collected
+ *	@param p The backslash
+ *	@param end End of source
+ *	@param flags BK_STRING_TOKENIZE_*
+ *	@return <i>NULL</i> if a quoting backslash ends the source, which ends the token
+ *	@return <br><i>next character to process</i> otherwise
+ */
+static const char *tokenize_bslash(struct tokenize_tok *tt, const char *p, const char *end, bk_flags flags)
+{
+  const char *q = p + 1, *startseq;
+  u_char newchar = 0;
+  int max;
+
+  /* ANSI-C backslash sequences? (\0 is intentionally not supported) */
+  if (q < end && BK_FLAG_ISSET(flags, BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_CHAR))
+  {
+    switch (*q)
+    {
+    case 'n': newchar = '\n'; break;
+    case 'r': newchar = '\r'; break;
+    case 't': newchar = '\t'; break;
+    case 'v': newchar = '\b'; break;
+    case 'f': newchar = '\f'; break;
+    case 'b': newchar = '\b'; break;
+    case 'a': newchar = '\a'; break;
+    }
+
+    if (newchar)
+    {
+      tokenize_appendc(tt, newchar);
+      return q + 1;
+    }
+  }
+
+  /* Octal interpretation\077: up to three more digits if the first is 0-3, else two */
+  if (q < end && *q == '0' && BK_FLAG_ISSET(flags, BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_OCT))
+  {
+    startseq = q++;
+    max = (q < end && *q >= '0' && *q <= '3') ? 3 : 2;
+    for (; q < end && q - startseq <= max && *q >= '0' && *q <= '7'; q++)
+      ;
+    for (; startseq < q; startseq++)
+      newchar = newchar * 8 + (*startseq - '0');
+    tokenize_appendc(tt, newchar);
+    return q;
+  }
+
+  /* Generic\ quoting, where the end of the source wins over the backslash */
+  if (BK_FLAG_ISSET(flags, BK_STRING_TOKENIZE_BACKSLASH))
+  {
+    if (q == end)
+      return NULL;
+    tokenize_append(tt, q, 1);
+    return q + 1;
+  }
+
+  // Not a quoting backslash after all, so it is part of the token
+  tokenize_append(tt, p, 1);
+  return q;
+}
+
+
+
+/**
+ * Add source bytes to a token, copying the token to the arena if they
+ * do not follow the token in the source.
+ *
+ *	@param tt Token being collected
+ *	@param ptr Source bytes
+ *	@param len Number of bytes
+ */
+static void tokenize_append(struct tokenize_tok *tt, const char *ptr, size_t len)
+{
+  if (!len)
+    return;
+
+  if (!tt->tt_copied)
+  {
+    if (!tt->tt_len)
+    {
+      tt->tt_ptr = ptr;
+      tt->tt_len = len;
+      return;
+    }
+    if (tt->tt_ptr + tt->tt_len == ptr)
+    {
+      tt->tt_len += len;
+      return;
+    }
+    memcpy(tt->tt_out, tt->tt_ptr, tt->tt_len);
+    tt->tt_ptr = tt->tt_out;
+    tt->tt_copied = 1;
+  }
+
+  memcpy(tt->tt_out + tt->tt_len, ptr, len);
+  tt->tt_len += len;
+}
+
+
+
+/**
+ * Add a byte which is not in the source to a token, copying the token
+ * to the arena.
+ *
+ *	@param tt Token being collected
+ *	@param c Byte to add
+ */
+static void tokenize_appendc(struct tokenize_tok *tt, u_char c)
+{
+  if (!tt->tt_copied)
+  {
+    memcpy(tt->tt_out, tt->tt_ptr, tt->tt_len);
+    tt->tt_ptr = tt->tt_out;
+    tt->tt_copied = 1;
+  }
+
+  tt->tt_out[tt->tt_len++] = c;
+}
+
+
+
+/**
+ * Rip a string -- terminate it at the first occurrence of the terminator characters.,
+ * Typically used with vertical whitespace to nuke the \r\n stuff.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/global state
+ *	@param string String to examine and change
+ *	@param terminators String containing characters to terminate source at, on first occurrence--if NULL use vertical whitespace.
+ *	@param flags Fun for the future
+ *	@return <i>NULL</i> on failure
+ *	@return <br><i>modified string</i> on success
+ */
+char *bk_string_rip(bk_s B, char *string, const char *terminators, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+
+  if (!string)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if (!terminators) terminators = BK_VWHITESPACE;
+
+  /* Write zero at either first terminator character, or at the trailing \0 */
+  *(string + strcspn(string,terminators)) = 0;
+  BK_RETURN(B, string);
+}
+
+
+
+/**
+ * Quote a string, with double quotes, for printing, and subsequent split'ing,
+ * and returning a newly allocated string which should be free'd by the caller.
+ *
+ * split should get the following flags to decode
+ * BK_STRING_TOKENIZE_DOUBLEQUOTE|BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_OCT
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA Thread/global state
+ *	@param src Source string to convert
+ *	@param needquote Characters which need backslash quoting (double quote if NULL)
+ *	@param flags BK_STRING_QUOTE_NULLOK will convert NULL @a src into BK_NULLSTR.  BK_STRING_QUOTE_NONPRINT will quote non-printable characters.
+ *	@return <i>NULL</i> on call failure, allocation failure, other failure
+ *	@return <br><i>quoted src</i> on success (you must free)
+ */
+char *bk_string_quote(bk_s B, const char *src, const char *needquote, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  char *ret = NULL;
+  struct bk_memx *outputx;
+  char scratch[16];
+
+  if (!src)
+  {
+    if (BK_FLAG_ISSET(flags, BK_STRING_QUOTE_NULLOK))
+    {
+      if (!(ret = strdup(BK_NULLSTR)))
+	bk_error_printf(B, BK_ERR_ERR, "Could not allocate space for NULL\n");
+    }
+    else
+      bk_error_printf(B, BK_ERR_ERR, "Invalid arguments\n");
+
+    BK_RETURN(B, ret);		/* "NULL" or NULL */
+  }
+
+  if (!needquote) needquote = "\"";
+
+  if (!(outputx = bk_memx_create(B, sizeof(char), strlen(src)+5, TOKENIZE_STR_INCR, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create expandable output space for quotation\n");
+    BK_RETURN(B, NULL);
+  }
+
+  for(;*src;src++)
+  {
+    if (*src == '\\' || strchr(needquote, *src) || (BK_FLAG_ISSET(flags, BK_STRING_QUOTE_NONPRINT)?!isprint(*src):0))
+    {						/* Must convert to octal  */
+      snprintf(scratch,sizeof(scratch),"\\0%o",(u_char)*src);
+      if (!(ret = bk_memx_get(B, outputx, strlen(scratch), NULL, BK_MEMX_GETNEW)))
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not extend array for additional character\n");
+	goto error;
+      }
+      memcpy(ret,scratch,strlen(scratch));
+    }
+    else
+    {						/* Normal, just stick in */
+      if (!(ret = bk_memx_get(B, outputx, 1, NULL, BK_MEMX_GETNEW)))
+      {
+	bk_error_printf(B, BK_ERR_ERR, "Could not extend array for additional character\n");
+	goto error;
+      }
+      *ret = *src;
+    }
+  }
+
+  if (!(ret = bk_memx_get(B, outputx, 1, NULL, BK_MEMX_GETNEW)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not extend array for additional character\n");
+    goto error;
+  }
+  *ret = 0;
+
+  if (!(ret = bk_memx_get(B, outputx, 0, NULL, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not obtain output string\n");
+    goto error;
+  }
+  bk_memx_destroy(B, outputx, BK_MEMX_PRESERVE_ARRAY);
+
+  BK_RETURN(B, ret);
+
+ error:
+  if (outputx)
+    bk_memx_destroy(B, outputx, 0);
+
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Bounded strlen. Return the length the of a string but go no further than
+ * the bound. NB: This function returns a @a ssize_t not a @a size_t as per
  * @a strlen(3).
  *
  * This is so it can return <i>-1</i> when there is no NUL, even at s[max].
@@ -2046,250 +3085,630 @@ bk_string_unique_string(bk_s B, char *buf, u_int len, bk_flags flags)
   char *p = buf;
   u_int32_t val;
 
-  if (!buf)
+  if (!buf)
+  {
+    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  // <TODO>Figure out some way to allow use of global random pool</TODO>
+  if (!(ri = bk_truerand_init(B, 0, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize random state\n");
+    goto error;
+  }
+
+  while(len)
+  {
+    int curlen;
+    int eos_space;
+
+    if (len > sizeof(val)*2)
+    {
+      curlen = sizeof(val)*2;
+      eos_space = 1;
+    }
+    else
+    {
+      curlen = MIN(len, sizeof(val)*2);
+      eos_space = 0;
+    }
+
+    val = bk_truerand_getword(B, ri, NULL, 0);
+
+    snprintf(p, curlen + eos_space, "%08x", val);
+
+    len -= curlen;
+    p += curlen;
+  }
+
+  bk_truerand_destroy(B, ri);
+  BK_RETURN(B,0);
+
+ error:
+  if (ri)
+    bk_truerand_destroy(B, ri);
+  BK_RETURN(B,-1);
+}
+
+
+
+/**
+ * Search a region of memory for any of a set of characters (naively)
+ *
+ * THREADS: MT-SAFE
+ *
+ * @param B Baka thread/global environment
+ * @param s Memory range we are searching
+ * @param accept Characters we are searching for
+ * @return <i>NULL</i> if character set does not appear, or other error
+ * @return <BR><i>pointer to first match</i> if character set does appear
+ */
+void *bk_mempbrk(bk_s B, bk_vptr *s, bk_vptr *acceptset)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  void *ret = NULL;
+  u_int cntr;
+
+  for (cntr = 0; cntr < s->len; cntr++)
+  {
+    if (memchr(acceptset->ptr, ((char *)s->ptr)[cntr], acceptset->len))
+    {
+      ret = (char *)s->ptr + cntr;
+      break;
+    }
+  }
+
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * Initialize the string registry.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@return <i>NULL</i> on failure.<br>
+ *	@return a new @a bk_str_registry on success.
+ */
+bk_str_registry_t
+bk_string_registry_init(bk_s B)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_str_registry *bsr = NULL;
+  struct bsr_shard *shard;
+  int cnt;
+
+  if (!(BK_CALLOC(bsr)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate string registry: %s\n", strerror(errno));
+    goto error;
+  }
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_init(&bsr->bsr_lock, NULL);
+#endif /* BK_USING_PTHREADS */
+
+  if ((errno = posix_memalign((void **)&bsr->bsr_shards, __alignof__(struct bsr_shard), sizeof(*bsr->bsr_shards) * BSR_SHARDS)))
+  {
+    bsr->bsr_shards = NULL;
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate string registry shards: %s\n", strerror(errno));
+    goto error;
+  }
+  memset(bsr->bsr_shards, 0, sizeof(*bsr->bsr_shards) * BSR_SHARDS);
+
+  for (cnt = 0; cnt < BSR_SHARDS; cnt++)
+  {
+    shard = bsr->bsr_shards + cnt;
+#ifdef BK_USING_PTHREADS
+    pthread_mutex_init(&shard->bsh_lock, NULL);
+#endif /* BK_USING_PTHREADS */
+    shard->bsh_mask = BSR_MINSLOTS - 1;
+  }
+
+  for (cnt = 0; cnt < BSR_SHARDS; cnt++)
+  {
+    if (!(bsr->bsr_shards[cnt].bsh_slots = calloc(BSR_MINSLOTS, sizeof(struct bsr_slot))))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not allocate initial chunk for string registry: %s\n", strerror(errno));
+      goto error;
+    }
+  }
+
+  // We purposefully leave 0 unregistered. We *could* program around this, but why bother?
+  bsr->bsr_next_index = 1;
+
+  BK_RETURN(B,bsr);
+
+ error:
+  if (bsr)
+    bk_string_registry_destroy(B, bsr);
+  BK_RETURN(B,NULL);
+}
+
+
+
+/**
+ * Destroy a string registry
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bsr The registry to fully destroy.
+ */
+void
+bk_string_registry_destroy(bk_s B, bk_str_registry_t bsr)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_str_registry_element *bsre;
+  struct bsr_shard *shard;
+  size_t cnt, segsize;
+  char *chunk;
+  int seg;
+
+  if (!bsr)
+  {
+    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
+    BK_VRETURN(B);
+  }
+
+  for (seg = 0; seg < BSR_SEGS; seg++)
+  {
+    if (!bsr->bsr_segs[seg])
+      continue;
+
+    segsize = (size_t)1 << (seg + BSR_SEG0_BITS);
+    for (cnt = 0; cnt < segsize; cnt++)
+    {
+      if ((bsre = bsr->bsr_segs[seg][cnt]))
+      {
+	if (BK_FLAG_ISSET(bsre->bsre_flags, BK_STR_REGISTRY_FLAG_COPY_STR) && strlen(bsre->bsre_str) >= BSR_STRMAX)
+	  free((char *)bsre->bsre_str);
+	free(bsre);
+      }
+    }
+    free(bsr->bsr_segs[seg]);
+  }
+
+  if (bsr->bsr_shards)
+  {
+    for (cnt = 0; cnt < BSR_SHARDS; cnt++)
+    {
+      shard = bsr->bsr_shards + cnt;
+
+      while ((bsre = shard->bsh_free))
+      {
+	shard->bsh_free = bsre->bsre_next;
+	free(bsre);
+      }
+
+      while ((chunk = shard->bsh_chunks))
+      {
+	shard->bsh_chunks = *(char **)chunk;
+	free(chunk);
+      }
+
+      if (shard->bsh_slots)
+	free(shard->bsh_slots);
+#ifdef BK_USING_PTHREADS
+      pthread_mutex_destroy(&shard->bsh_lock);
+#endif /* BK_USING_PTHREADS */
+    }
+    free(bsr->bsr_shards);
+  }
+
+#ifdef BK_USING_PTHREADS
+  pthread_mutex_destroy(&bsr->bsr_lock);
+#endif /* BK_USING_PTHREADS */
+
+  free(bsr);
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Create a bsre, reusing a released one from the shard if possible.
+ * Short copied strings are carved out of the shard's arena, reusing
+ * the space of released copies of the same size class; long ones are
+ * allocated on their own.
+ *
+ * THREADS: REENTRANT (shard must be locked)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bsr The registry.
+ *	@param str The string.
+ *	@param hash Hash of string (selects the shard).
+ *	@param flags BK_STR_REGISTRY_FLAG_COPY_STR to copy string.
+ *	@return <i>NULL</i> on failure.<br>
+ *	@return <i>new element</i> on success.
+ */
+static struct bk_str_registry_element *
+bsre_create(bk_s B, struct bk_str_registry *bsr, const char *str, u_int32_t hash, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bsr_shard *shard = bsr->bsr_shards + BSR_SHARD(hash);
+  struct bk_str_registry_element *bsre = NULL;
+  size_t len, size;
+  char *copy, *chunk;
+  u_int class;
+
+  if (!str)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, NULL);
+  }
+
+  if ((bsre = shard->bsh_free))
+  {
+    // bsre_shard is already ours, and bsr_lockbyid may be reading it unlocked
+    shard->bsh_free = bsre->bsre_next;
+    bsre->bsre_next = NULL;
+    bsre->bsre_id = 0;
+  }
+  else if (!(BK_CALLOC(bsre)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate bsre: %s\n", strerror(errno));
+    BK_RETURN(B, NULL);
+  }
+  else
+  {
+    bsre->bsre_shard = BSR_SHARD(hash);
+  }
+
+  bsre->bsre_hash = hash;
+  bsre->bsre_flags = flags;
+  bsre->bsre_ref = 0;
+
+  if (BK_FLAG_ISSET(flags, BK_STR_REGISTRY_FLAG_COPY_STR))
+  {
+    len = strlen(str) + 1;
+
+    if (len > BSR_STRMAX)
+    {
+      if (!(copy = malloc(len)))
+	goto error;
+    }
+    else if ((copy = shard->bsh_strfree[class = BSR_STRCLASS(len)]))
+    {
+      shard->bsh_strfree[class] = *(char **)copy;
+    }
+    else
+    {
+      size = (class + 1) * BSR_STRALIGN;
+      if (size > shard->bsh_left)
+      {
+	if (!(chunk = malloc(BSR_CHUNKSIZE)))
+	  goto error;
+	*(char **)chunk = shard->bsh_chunks;
+	shard->bsh_chunks = chunk;
+	shard->bsh_next = chunk + sizeof(char *);
+	shard->bsh_left = BSR_CHUNKSIZE - sizeof(char *);
+      }
+      copy = shard->bsh_next;
+      shard->bsh_next += size;
+      shard->bsh_left -= size;
+    }
+
+    memcpy(copy, str, len);
+    bsre->bsre_str = copy;
+  }
+  else
+  {
+    bsre->bsre_str = str;
+  }
+
+  BK_RETURN(B,bsre);
+
+ error:
+  bk_error_printf(B, BK_ERR_ERR, "Could not copy string: %s\n", strerror(errno));
+  bsre_release(B, bsr, bsre);
+  BK_RETURN(B,NULL);
+}
+
+
+
+/**
+ * Release a bsre which is no longer indexed or assigned an id to its
+ * shard for reuse, along with the space of its copied string.  Elements
+ * are only freed with the registry, so one found by id without the
+ * shard lock is always safe to revalidate.
+ *
+ * THREADS: REENTRANT (shard must be locked)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param bsr The registry.
+ *	@param bsre The structure to release.
+ */
+static void
+bsre_release(bk_s B, struct bk_str_registry *bsr, struct bk_str_registry_element *bsre)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bsr_shard *shard;
+  size_t len;
+  char *copy;
+
+  if (!bsr || !bsre)
   {
     bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
-    BK_RETURN(B, -1);
+    BK_VRETURN(B);
   }
 
-  // <TODO>Figure out some way to allow use of global random pool</TODO>
-  if (!(ri = bk_truerand_init(B, 0, 0)))
-  {
-    bk_error_printf(B, BK_ERR_ERR, "Could not initialize random state\n");
-    goto error;
-  }
+  shard = bsr->bsr_shards + bsre->bsre_shard;
 
-  while(len)
+  if (BK_FLAG_ISSET(bsre->bsre_flags, BK_STR_REGISTRY_FLAG_COPY_STR) && (copy = (char *)bsre->bsre_str))
   {
-    int curlen;
-    int eos_space;
-
-    if (len > sizeof(val)*2)
+    if ((len = strlen(copy) + 1) > BSR_STRMAX)
     {
-      curlen = sizeof(val)*2;
-      eos_space = 1;
+      free(copy);
     }
     else
     {
-      curlen = MIN(len, sizeof(val)*2);
-      eos_space = 0;
+      *(char **)copy = shard->bsh_strfree[BSR_STRCLASS(len)];
+      shard->bsh_strfree[BSR_STRCLASS(len)] = copy;
     }
+  }
+  bsre->bsre_str = NULL;
+  bsre->bsre_next = shard->bsh_free;
+  shard->bsh_free = bsre;
+  BK_VRETURN(B);
+}
 
-    val = bk_truerand_getword(B, ri, NULL, 0);
 
-    snprintf(p, curlen + eos_space, "%08x", val);
 
-    len -= curlen;
-    p += curlen;
-  }
+/**
+ * Find the pointer to the element for an id.  Id segments double in
+ * size so the segment is just the top bit of the (offset) id.
+ *
+ * THREADS: MT-SAFE (creation requires bsr_lock)
+ *
+ *	@param bsr The registry.
+ *	@param id The id.
+ *	@param create Allocate the segment if it does not exist.
+ *	@return <i>NULL</i> if segment does not exist or cannot be allocated.<br>
+ *	@return <i>element pointer</i> on success.
+ */
+static struct bk_str_registry_element **
+bsr_idslot(struct bk_str_registry *bsr, bk_str_id_t id, int create)
+{
+  u_int64_t idx = (u_int64_t)id + (1 << BSR_SEG0_BITS);
+  int seg = 63 - __builtin_clzll(idx) - BSR_SEG0_BITS;
+  struct bk_str_registry_element **segp;
 
-  bk_truerand_destroy(B, ri);
-  BK_RETURN(B,0);
+  if (!(segp = BK_ATOMIC_LOAD(&bsr->bsr_segs[seg])))
+  {
+    if (!create || !(segp = calloc((size_t)1 << (seg + BSR_SEG0_BITS), sizeof(*segp))))
+      return(NULL);
+    BK_ATOMIC_STORE(&bsr->bsr_segs[seg], segp);
+  }
 
- error:
-  if (ri)
-    bk_truerand_destroy(B, ri);
-  BK_RETURN(B,-1);
+  return(segp + (idx - ((u_int64_t)1 << (seg + BSR_SEG0_BITS))));
 }
 
 
 
 /**
- * Search a region of memory for any of a set of characters (naively)
+ * Look up the element for an id without locking.
  *
  * THREADS: MT-SAFE
  *
- * @param B Baka thread/global environment
- * @param s Memory range we are searching
- * @param accept Characters we are searching for
- * @return <i>NULL</i> if character set does not appear, or other error
- * @return <BR><i>pointer to first match</i> if character set does appear
+ *	@param bsr The registry.
+ *	@param id The id.
+ *	@return <i>NULL</i> if there is none.<br>
+ *	@return <i>element</i> on success.
  */
-void *bk_mempbrk(bk_s B, bk_vptr *s, bk_vptr *acceptset)
+static struct bk_str_registry_element *
+bsr_byid(struct bk_str_registry *bsr, bk_str_id_t id)
 {
-  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  void *ret = NULL;
-  u_int cntr;
+  struct bk_str_registry_element **slot;
 
-  for (cntr = 0; cntr < s->len; cntr++)
-  {
-    if (memchr(acceptset->ptr, ((char *)s->ptr)[cntr], acceptset->len))
-    {
-      ret = (char *)s->ptr + cntr;
-      break;
-    }
-  }
+  if (!id || !(slot = bsr_idslot(bsr, id, 0)))
+    return(NULL);
 
-  BK_RETURN(B, ret);
+  return(BK_ATOMIC_LOAD(slot));
 }
 
 
 
 /**
- * Initialize the string registry.
+ * Look up the element for an id and lock its shard.  The element is
+ * rechecked once the shard is locked, in case it was deleted meanwhile.
  *
  * THREADS: MT-SAFE
  *
  *	@param B BAKA thread/global state.
- *	@return <i>NULL</i> on failure.<br>
- *	@return a new @a bk_str_registry on success.
+ *	@param bsr The registry.
+ *	@param id The id.
+ *	@return <i>NULL</i> if there is none.<br>
+ *	@return <i>element</i> with its shard locked on success.
  */
-bk_str_registry_t
-bk_string_registry_init(bk_s B)
+static struct bk_str_registry_element *
+bsr_lockbyid(bk_s B, struct bk_str_registry *bsr, bk_str_id_t id)
 {
-  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  struct bk_str_registry *bsr = NULL;
+  struct bk_str_registry_element *bsre;
+  struct bsr_shard *shard;
 
-  if (!(BK_CALLOC(bsr)))
+  while ((bsre = bsr_byid(bsr, id)))
   {
-    bk_error_printf(B, BK_ERR_ERR, "Could not allocate string registry: %s\n", strerror(errno));
-    goto error;
+    shard = bsr->bsr_shards + bsre->bsre_shard;
+    BK_SIMPLE_LOCK(B, &shard->bsh_lock);
+    if (bsr_byid(bsr, id) == bsre && bsre->bsre_id == id)
+      return(bsre);
+    BK_SIMPLE_UNLOCK(B, &shard->bsh_lock);
   }
 
-  if (!(BK_MALLOC_LEN(bsr->bsr_registry, (sizeof(*bsr->bsr_registry) * 1024))))
+  return(NULL);
+}
+
+
+
+/**
+ * Find the element for a string in its shard index.
+ *
+ * THREADS: REENTRANT (shard must be locked)
+ *
+ *	@param bsr The registry.
+ *	@param str The string.
+ *	@param hash Hash of string.
+ *	@return <i>NULL</i> if not present.<br>
+ *	@return <i>element</i> on success.
+ */
+static struct bk_str_registry_element *
+bsr_find(struct bk_str_registry *bsr, const char *str, u_int32_t hash)
+{
+  struct bsr_shard *shard = bsr->bsr_shards + BSR_SHARD(hash);
+  struct bsr_slot *slot;
+  u_int pos;
+
+  for (pos = hash & shard->bsh_mask; (slot = shard->bsh_slots + pos)->bss_bsre; pos = (pos + 1) & shard->bsh_mask)
   {
-    bk_error_printf(B, BK_ERR_ERR, "Could not allocate initial chunk for string registry: %s\n", strerror(errno));
-    goto error;
+    if (slot->bss_hash == hash && BK_STREQ(slot->bss_bsre->bsre_str, str))
+      return(slot->bss_bsre);
   }
-  bsr->bsr_registrysz = 1024;
-  // We purposefully leave 0 unregistered. We *could* program around this, but why bother?
-  bsr->bsr_next_index = 1;
-  bsr->bsr_registry[0] = NULL;
-
-  BK_RETURN(B,bsr);
 
- error:
-  if (bsr)
-    bk_string_registry_destroy(B, bsr);
-  BK_RETURN(B,NULL);
+  return(NULL);
 }
 
 
 
 /**
- * Destroy a string registry
+ * Add an element to its shard index, doubling the index at 3/4 full.
  *
- * THREADS: MT-SAFE
+ * THREADS: REENTRANT (shard must be locked)
  *
- *	@param B BAKA thread/global state.
- *	@param bsr The registry to fully destroy.
+ *	@param shard The element's shard.
+ *	@param bsre The element.
+ *	@return <i>-1</i> on allocation failure.<br>
+ *	@return <i>0</i> on success.
  */
-void
-bk_string_registry_destroy(bk_s B, bk_str_registry_t bsr)
+static int
+bsr_index_add(struct bsr_shard *shard, struct bk_str_registry_element *bsre)
 {
-  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  u_int cnt;
+  struct bsr_slot *slots, *old;
+  u_int mask, pos, cnt;
 
-  if (!bsr)
+  if ((shard->bsh_count + 1) * 4 > (shard->bsh_mask + 1) * 3)
   {
-    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
-    BK_VRETURN(B);
-  }
+    mask = shard->bsh_mask * 2 + 1;
+    if (!(slots = calloc(mask + 1, sizeof(*slots))))
+      return(-1);
 
-  if (bsr->bsr_registry)
-  {
-    for(cnt = 0; cnt < bsr->bsr_next_index; cnt++)
+    old = shard->bsh_slots;
+    for (cnt = 0; cnt <= shard->bsh_mask; cnt++)
     {
-      if (bsr->bsr_registry[cnt])
-	bsre_destroy(B, bsr->bsr_registry[cnt]);
+      if (!old[cnt].bss_bsre)
+	continue;
+      for (pos = old[cnt].bss_hash & mask; slots[pos].bss_bsre; pos = (pos + 1) & mask)
+	; // Void
+      slots[pos] = old[cnt];
     }
 
-    free(bsr->bsr_registry);
+    free(old);
+    shard->bsh_slots = slots;
+    shard->bsh_mask = mask;
   }
 
-  free(bsr);
-  BK_VRETURN(B);
+  for (pos = bsre->bsre_hash & shard->bsh_mask; shard->bsh_slots[pos].bss_bsre; pos = (pos + 1) & shard->bsh_mask)
+    ; // Void
+
+  shard->bsh_slots[pos].bss_bsre = bsre;
+  shard->bsh_slots[pos].bss_hash = bsre->bsre_hash;
+  shard->bsh_count++;
+  return(0);
 }
 
 
 
 /**
- * Create a bsre
+ * Remove an element from its shard index, if present.  Later members of
+ * the probe cluster are shifted back over the hole, so no tombstones.
  *
- * THREADS: MT-SAFE
+ * THREADS: REENTRANT (shard must be locked)
  *
- *	@param B BAKA thread/global state.
- *	@return <i>-1</i> on failure.<br>
- *	@return <i>0</i> on success.
+ *	@param shard The element's shard.
+ *	@param bsre The element.
  */
-static struct bk_str_registry_element *
-bsre_create(bk_s B, const char *str, bk_flags flags)
+static void
+bsr_index_del(struct bsr_shard *shard, struct bk_str_registry_element *bsre)
 {
-  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  struct bk_str_registry_element *bsre = NULL;
-
-  if (!str)
-  {
-    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
-    BK_RETURN(B, NULL);
-  }
+  struct bsr_slot *slots = shard->bsh_slots;
+  u_int mask = shard->bsh_mask;
+  u_int pos, next, home;
 
-  if (!(BK_CALLOC(bsre)))
+  for (pos = bsre->bsre_hash & mask; slots[pos].bss_bsre != bsre; pos = (pos + 1) & mask)
   {
-    bk_error_printf(B, BK_ERR_ERR, "Could not allocate bsre: %s\n", strerror(errno));
-    goto error;
+    if (!slots[pos].bss_bsre)
+      return;
   }
-#ifdef BK_USING_PTHREADS
-  pthread_mutex_init(&bsre->bsre_lock, NULL);
-#endif /* BK_USING_PTHREADS */
 
-  if (BK_FLAG_ISSET(flags, BK_STR_REGISTRY_FLAG_COPY_STR))
+  for (next = (pos + 1) & mask; slots[next].bss_bsre; next = (next + 1) & mask)
   {
-    if (!(bsre->bsre_str = strdup(str)))
+    home = slots[next].bss_hash & mask;
+    // Move it if the hole is between its home and where it is now
+    if (((next - home) & mask) >= ((next - pos) & mask))
     {
-      bk_error_printf(B, BK_ERR_ERR, "Could not strdup string: %s\n", strerror(errno));
-      goto error;
+      slots[pos] = slots[next];
+      pos = next;
     }
   }
-  else
-  {
-    bsre->bsre_str = str;
-  }
-
-  bsre->bsre_flags = flags;
-  bsre->bsre_ref = 0;
-
-  BK_RETURN(B,bsre);
 
- error:
-  if (bsre)
-    bsre_destroy(B, bsre);
-  BK_RETURN(B,NULL);
+  slots[pos].bss_bsre = NULL;
+  shard->bsh_count--;
 }
 
 
 
 /**
- * Destroy a bsre
+ * Give a new element an id--the next one, or a forced one--and make it
+ * visible to id lookups.
  *
- * THREADS: MT-SAFE
+ * THREADS: REENTRANT (element's shard must be locked)
  *
  *	@param B BAKA thread/global state.
- *	@param bsre The structure to destroy.
+ *	@param bsr The registry.
+ *	@param bsre The element.
+ *	@param id The id, or 0 for the next one.
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
  */
-static void
-bsre_destroy(bk_s B, struct bk_str_registry_element *bsre)
+static int
+bsr_assign(bk_s B, struct bk_str_registry *bsr, struct bk_str_registry_element *bsre, bk_str_id_t id)
 {
-  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_str_registry_element **slot;
 
-  if (!bsre)
+  BK_SIMPLE_LOCK(B, &bsr->bsr_lock);
+
+  if (!id && !(id = bsr->bsr_next_index))
   {
-    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
-    BK_VRETURN(B);
+    bk_error_printf(B, BK_ERR_ERR, "String registry ids exhausted\n");
+    goto error;
   }
 
-  if (BK_FLAG_ISSET(bsre->bsre_flags, BK_STR_REGISTRY_FLAG_COPY_STR) &&
-      bsre->bsre_str)
+  if (!(slot = bsr_idslot(bsr, id, 1)))
   {
-    free((void *)bsre->bsre_str);
+    bk_error_printf(B, BK_ERR_ERR, "Could not expand string registry: %s\n", strerror(errno));
+    goto error;
   }
 
-#ifdef BK_USING_PTHREADS
-  pthread_mutex_destroy(&bsre->bsre_lock);
-#endif /* BK_USING_PTHREADS */
+  if (*slot)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Registry id %d was registered concurrently\n", id);
+    goto error;
+  }
 
-  free(bsre);
-  BK_VRETURN(B);
+  bsre->bsre_id = id;
+  BK_ATOMIC_STORE(slot, bsre);
+
+  if (id >= bsr->bsr_next_index)
+    BK_ATOMIC_STORE(&bsr->bsr_next_index, id + 1);
+
+  BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
+  return(0);
+
+ error:
+  BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
+  return(-1);
 }
 
 
@@ -2312,8 +3731,10 @@ bk_str_id_t
 bk_string_registry_idbystr(bk_s B, bk_str_registry_t bsr, const char *str, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  struct bk_str_registry_element *bsre = NULL;
-  u_int cnt;
+  struct bk_str_registry_element *bsre;
+  struct bsr_shard *shard;
+  bk_str_id_t id = 0;
+  u_int32_t hash;
 
   if (!bsr || !str)
   {
@@ -2321,14 +3742,50 @@ bk_string_registry_idbystr(bk_s B, bk_str_registry_t bsr, const char *str, bk_fl
     BK_RETURN(B, 0);
   }
 
-  for (cnt = 0; cnt < bsr->bsr_next_index; cnt++)
+  hash = BSR_HASH(str);
+  shard = bsr->bsr_shards + BSR_SHARD(hash);
+
+  BK_SIMPLE_LOCK(B, &shard->bsh_lock);
+  if ((bsre = bsr_find(bsr, str, hash)))
+    id = bsre->bsre_id;
+  BK_SIMPLE_UNLOCK(B, &shard->bsh_lock);
+
+  BK_RETURN(B, id);
+}
+
+
+
+/**
+ * Retrieve the string for an id without "registering" it.  This is a
+ * lock-free array lookup, so the same caution as for
+ * bk_string_registry_idbystr() applies: the string is only good while
+ * someone holds a reference on it.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param handle the registry handle to use.
+ *	@param id The id to look up.
+ *	@param flags Flags for future use.
+ *	@return <i>NULL</i> if id is not registered.<br>
+ *	@return <i>saved string</i> on success.
+ */
+const char *
+bk_string_registry_strbyid(bk_s B, bk_str_registry_t bsr, bk_str_id_t id, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_str_registry_element *bsre;
+
+  if (!bsr)
   {
-    bsre = bsr->bsr_registry[cnt];
-    if (bsre && BK_STREQ(bsre->bsre_str, str))
-      BK_RETURN(B, bsre->bsre_id);
+    bk_error_printf(B, BK_ERR_ERR,"Illegal arguments\n");
+    BK_RETURN(B, NULL);
   }
 
-  BK_RETURN(B, 0);
+  if (!(bsre = bsr_byid(bsr, id)))
+    BK_RETURN(B, NULL);
+
+  BK_RETURN(B, bsre->bsre_str);
 }
 
 
@@ -2336,8 +3793,7 @@ bk_string_registry_idbystr(bk_s B, bk_str_registry_t bsr, const char *str, bk_fl
 /**
  * Delete a string from the registry
  *
- * THREADS: MT-SAFE (assuming different handle)
- * THREADS: THREAD-REENTRANT (otherwise)
+ * THREADS: MT-SAFE
  *
  *	@param B BAKA thread/global state.
  *	@param handle The handle on the registry.
@@ -2350,8 +3806,7 @@ int
 bk_string_registry_delete_str(bk_s B, bk_str_registry_t bsr, const char *str, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  struct bk_str_registry_element *bsre;
-  u_int cnt;
+  bk_str_id_t id;
 
   if (!bsr || !str)
   {
@@ -2359,14 +3814,14 @@ bk_string_registry_delete_str(bk_s B, bk_str_registry_t bsr, const char *str, bk
     BK_RETURN(B, -1);
   }
 
-  for(cnt = 0; cnt < bsr->bsr_next_index; cnt++)
+  if (!(id = bk_string_registry_idbystr(B, bsr, str, flags)))
   {
-    bsre = bsr->bsr_registry[cnt];
-    if (bsre && BK_STREQ(bsre->bsre_str, str))
-      break;
+    bk_error_printf(B, BK_ERR_WARN, "Registry element %s either does not exist or has already been deleted\n", str);
+    // We call this success.
+    BK_RETURN(B,0);
   }
 
-  BK_RETURN(B,bk_string_registry_delete_id(B, bsr, cnt, flags));
+  BK_RETURN(B,bk_string_registry_delete_id(B, bsr, id, flags));
 }
 
 
@@ -2374,6 +3829,8 @@ bk_string_registry_delete_str(bk_s B, bk_str_registry_t bsr, const char *str, bk
 /**
  * Delete a registry object via its id.
  *
+ * THREADS: MT-SAFE
+ *
  *	@param B BAKA thread/global state.
  *	@param handle The handle on the registry.
  *	@param id The index of the entry to delete
@@ -2386,7 +3843,7 @@ bk_string_registry_delete_id(bk_s B, bk_str_registry_t bsr, bk_str_id_t id, bk_f
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
   struct bk_str_registry_element *bsre;
-  int ret;
+  struct bsr_shard *shard;
 
   if (!bsr || !id) // id == 0 is reserved and never assigned.
   {
@@ -2394,32 +3851,29 @@ bk_string_registry_delete_id(bk_s B, bk_str_registry_t bsr, bk_str_id_t id, bk_f
     BK_RETURN(B, -1);
   }
 
-  if (id >= bsr->bsr_next_index || !(bsre = bsr->bsr_registry[id]))
+  if (!(bsre = bsr_lockbyid(B, bsr, id)))
   {
     bk_error_printf(B, BK_ERR_WARN, "Registry element %d either does not exist or has already been deleted\n", id);
     // We call this success.
     BK_RETURN(B,0);
   }
+  shard = bsr->bsr_shards + bsre->bsre_shard;
 
-  BK_SIMPLE_LOCK(B, &bsre->bsre_lock);
-
-  ret = --bsre->bsre_ref;
-
-  BK_SIMPLE_UNLOCK(B, &bsre->bsre_lock);
-
-  if (ret > 0)
+  if (bsre->bsre_ref > 1)
   {
     /* Someone is still using this, so we're done */
+    bsre->bsre_ref--;
+    BK_SIMPLE_UNLOCK(B, &shard->bsh_lock);
     BK_RETURN(B,0);
   }
 
   bk_debug_printf_and(B, 1, "%d !=> %s\n", bsre->bsre_id, bsre->bsre_str);
 
-  bsre_destroy(B, bsre);
+  bsr_index_del(shard, bsre);
 
   BK_SIMPLE_LOCK(B, &bsr->bsr_lock);
 
-  bsr->bsr_registry[id] = NULL;
+  BK_ATOMIC_STORE(bsr_idslot(bsr, id, 0), NULL);
   /*
    * If we're actually deleting the entry with the highest index then we
    * actually "recover" the space (by descrementing next_index). We *only*
@@ -2436,11 +3890,15 @@ bk_string_registry_delete_id(bk_s B, bk_str_registry_t bsr, bk_str_id_t id, bk_f
    */
 
   if (id == bsr->bsr_next_index-1)
-    while (!bsr->bsr_registry[id--])
-      bsr->bsr_next_index--;
+    while (bsr->bsr_next_index > 1 && !bsr_byid(bsr, bsr->bsr_next_index - 1))
+      BK_ATOMIC_STORE(&bsr->bsr_next_index, bsr->bsr_next_index - 1);
 
   BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
 
+  bsre_release(B, bsr, bsre);
+
+  BK_SIMPLE_UNLOCK(B, &shard->bsh_lock);
+
   BK_RETURN(B,0);
 }
 
@@ -2450,23 +3908,22 @@ bk_string_registry_delete_id(bk_s B, bk_str_registry_t bsr, bk_str_id_t id, bk_f
  * Obtain the ID of a string which has been inserted into the
  * registry.
  *
- * This is kinda, err, slow if there are many items in the list.
- *
- * Update: Well it's only slow if you have use @a name. If you already know
- * the @a id, meaning someone else has registered the string and you are
- * only "taking out a lock" on it, then this function is pretty darn
- * fast. If you do not know the @a id, you pass 0 (which is reserved as
- * never used by the registry); if you pass in *both* @a name and @a id, @a
- * id will be preferred as it (to reiterate) is much faster.
+ * If you already know the @a id, meaning someone else has registered the
+ * string and you are only "taking out a lock" on it, pass it in and it is
+ * found directly; if you do not know the @a id, you pass 0 (which is
+ * reserved as never used by the registry) and the string is looked up by
+ * hash.  Only the registry shard the string hashes to is locked, so
+ * threads interning different strings proceed in parallel.  If you pass
+ * in *both* @a name and @a id, @a id will be preferred.
  *
- * THREADS: MT-SAFE (assuming different handle)
- * THREADS: THREAD-REENTRANT (otherwise)
+ * THREADS: MT-SAFE
  *
  *	@param B BAKA thread/global state.
  *	@param handle The registry to search within.
  *	@param str The string to search for.
  *	@param id The id to use.
- *	@param flags BK_STR_REGISTRY_FLAG_COPY_STR to copy string arg<br>
+ *	@param flags BK_STR_REGISTRY_FLAG_COPY_STR to copy string arg (into
+ *	the registry's string arena)<br>
  *	BK_STR_REGISTRY_FLAG_FORCE to force insertion when string is already
  *	present in, or if non-zero id is absent from, registry
  *	@return <i>0</i> on FAILURE (!! NB THIS IS NOT NORMAL FOR LIBBK !!).<br>
@@ -2476,9 +3933,10 @@ bk_str_id_t
 bk_string_registry_insert(bk_s B, bk_str_registry_t bsr, const char *str, bk_str_id_t id, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  struct bk_str_registry_element *bsre = NULL;
-  int locked = 0;
+  struct bk_str_registry_element *bsre = NULL, *created = NULL;
+  struct bsr_shard *shard = NULL;
   int forced = BK_FLAG_ISSET(flags, BK_STR_REGISTRY_FLAG_FORCE);
+  u_int32_t hash;
 
   if (!bsr || !(str || id))
   {
@@ -2486,125 +3944,68 @@ bk_string_registry_insert(bk_s B, bk_str_registry_t bsr, const char *str, bk_str
     BK_RETURN(B, 0);
   }
 
-  BK_SIMPLE_LOCK(B, &bsr->bsr_lock);
-  locked = 1;
-
-  // if forced and non-zero id, set next index to one more than max(id,next)
-  if ((id >= bsr->bsr_next_index) && forced)
+  if (id && (bsre = bsr_lockbyid(B, bsr, id)))
   {
-    u_int i = bsr->bsr_next_index;
-
-    bsr->bsr_next_index = id + 1;
-
-    while (i < bsr->bsr_registrysz && i <= id)
-      bsr->bsr_registry[i++] = NULL;
+    shard = bsr->bsr_shards + bsre->bsre_shard;
   }
-
-  /*
-   * Assuming that we're not just updating an existing node and charging right
-   * ahead with allocating more space for an insert if needed may be a touch
-   * aggressive, but it results in at *most* one extra realloc(3).
-   */
-  if (bsr->bsr_next_index >= bsr->bsr_registrysz)
+  else if (id && (!forced || !str))
   {
-    struct bk_str_registry_element **tmp;
-    u_int i = bsr->bsr_registrysz;
-
-    bsr->bsr_registrysz = bsr->bsr_next_index + 1024;
-    if (!(tmp = realloc(bsr->bsr_registry, sizeof(*bsr->bsr_registry)
-			* (bsr->bsr_registrysz))))
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Could not expand string registry: %s\n", strerror(errno));
-      goto error;
-    }
-    bsr->bsr_registry = tmp;
-
-    while (i < bsr->bsr_next_index)
-      bsr->bsr_registry[i++] = NULL;
+    bk_error_printf(B, BK_ERR_ERR, "Registry object %d does not exist or has been deleted\n", id);
+    BK_RETURN(B,0);
   }
-
-  if (!id)
+  else
   {
-    u_int cnt;
+    hash = BSR_HASH(str);
+    shard = bsr->bsr_shards + BSR_SHARD(hash);
+    BK_SIMPLE_LOCK(B, &shard->bsh_lock);
 
-    // search for existing entry (unless forced)
-    if (!forced)
+    // search for existing entry (unless forced or forcing an id)
+    if (id || forced || !(bsre = bsr_find(bsr, str, hash)))
     {
-      for(cnt = 0; cnt < bsr->bsr_next_index; cnt++)
+      if (!(bsre = created = bsre_create(B, bsr, str, hash, flags)))
       {
-	bsre = bsr->bsr_registry[cnt];
-	if (bsre && BK_STREQ(str, bsre->bsre_str))
-	  break;
+	bk_error_printf(B, BK_ERR_ERR, "Could not create string registry element\n");
+	goto error;
       }
-    }
-    else			// allocate next id if FORCE flag is passed
-      cnt = bsr->bsr_next_index;
 
-    if (cnt == bsr->bsr_next_index)
-    {
-      if (!(bsre = bsre_create(B, str, flags)))
+      if (bsr_index_add(shard, bsre) < 0)
       {
-	bk_error_printf(B, BK_ERR_ERR, "Could not create string registry element\n");
+	bk_error_printf(B, BK_ERR_ERR, "Could not expand string registry index: %s\n", strerror(errno));
 	goto error;
       }
-      bsre->bsre_id = bsr->bsr_next_index;
-      bsr->bsr_registry[bsr->bsr_next_index] = bsre;
-      bsr->bsr_next_index++;
+
+      if (bsr_assign(B, bsr, bsre, id) < 0)
+	goto error;
 
       bk_debug_printf_and(B, 1, "%d ==> %s\n", bsre->bsre_id, bsre->bsre_str);
     }
   }
-  else if (id >= bsr->bsr_next_index || (!(bsre = bsr->bsr_registry[id])
-					 && !forced))
-  {
-    bk_error_printf(B, BK_ERR_ERR, "Registry object %d does not exist or has been deleted\n", id);
-    BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
-    BK_RETURN(B,0);
-  }
-  else if (forced && !bsre)
-  {
-    if (!(bsre = bsre_create(B, str, flags)))
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Could not create string registry element\n");
-      goto error;
-    }
-    bsre->bsre_id = id;
-    bsr->bsr_registry[id] = bsre;
-
-    bk_debug_printf_and(B, 1, "%d ==> %s\n", bsre->bsre_id, bsre->bsre_str);
-  }
-
-  // Lock the bsre before releasing the bsr which contains it.
-  BK_SIMPLE_LOCK(B, &bsre->bsre_lock);
-
-  BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
-  locked = 0;
 
   bsre->bsre_ref++;
-
-  BK_SIMPLE_UNLOCK(B, &bsre->bsre_lock);
+  id = bsre->bsre_id;
 
   if (str && !BK_STREQ(str, bsre->bsre_str))
   {
     bk_error_printf(B, BK_ERR_ERR, "Registry id %d ==> %s (not %s!)\n",
 		    bsre->bsre_id, bsre->bsre_str, str);
-    goto error;
+    BK_SIMPLE_UNLOCK(B, &shard->bsh_lock);
+    bk_string_registry_delete_id(B, bsr, id, 0);
+    BK_RETURN(B,0);
   }
 
-  BK_RETURN(B,bsre->bsre_id);
+  BK_SIMPLE_UNLOCK(B, &shard->bsh_lock);
+
+  BK_RETURN(B,id);
 
  error:
-  if (bsre)
+  if (created)
   {
-    // If we've inserted id, do a full delete, otherwise just nuke the bsre element.
-    if (bsre->bsre_id)
-      bk_string_registry_delete_id(B, bsr, bsre->bsre_id, 0);
-    else
-      bsre_destroy(B, bsre);
+    bsr_index_del(shard, created);
+    bsre_release(B, bsr, created);
   }
 
-  if (locked)
-    BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
+  if (shard)
+    BK_SIMPLE_UNLOCK(B, &shard->bsh_lock);
 
   BK_RETURN(B,0);
 }
@@ -2615,6 +4016,8 @@ bk_string_registry_insert(bk_s B, bk_str_registry_t bsr, const char *str, bk_str
  * This is exactly like calling bk_string_registry_insert() with the @a id
  * > 0 and @a str == NULL, but it <em>returns</em> a string.
  *
+ * THREADS: MT-SAFE
+ *
  *	@Param B BAKA thread/global state.
  *	@param handle The registry to search within.
  *	@param id The id to search for.
@@ -2627,6 +4030,7 @@ bk_string_registry_register_by_id(bk_s B, bk_str_registry_t bsr, bk_str_id_t id,
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
   struct bk_str_registry_element *bsre = NULL;
+  const char *str;
 
   if (!bsr || !id)
   {
@@ -2634,27 +4038,20 @@ bk_string_registry_register_by_id(bk_s B, bk_str_registry_t bsr, bk_str_id_t id,
     BK_RETURN(B, NULL);
   }
 
-  BK_SIMPLE_LOCK(B, &bsr->bsr_lock);
-
-  if (id >= bsr->bsr_next_index || !(bsre = bsr->bsr_registry[id]))
+  if (!(bsre = bsr_lockbyid(B, bsr, id)))
   {
     bk_error_printf(B, BK_ERR_ERR, "Registry object %d does not exist or has been deleted\n", id);
-    BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
     BK_RETURN(B, NULL);
   }
 
-  // Lock the bsre before releasing the bsr which contains it.
-  BK_SIMPLE_LOCK(B, &bsre->bsre_lock);
-
-  BK_SIMPLE_UNLOCK(B, &bsr->bsr_lock);
-
   bsre->bsre_ref++;
+  str = bsre->bsre_str;
 
-  BK_SIMPLE_UNLOCK(B, &bsre->bsre_lock);
+  BK_SIMPLE_UNLOCK(B, &bsr->bsr_shards[bsre->bsre_shard].bsh_lock);
 
-  bk_debug_printf_and(B, 1, "%d ==> %s\n", id, bsre->bsre_str);
+  bk_debug_printf_and(B, 1, "%d ==> %s\n", id, str);
 
-  BK_RETURN(B, bsre->bsre_str);
+  BK_RETURN(B, str);
 }
 
 
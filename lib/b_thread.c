@@ -937,6 +937,9 @@ static void *bk_thread_continue(void *opaque)
 
   free(opaque);
 
+  if (BK_GENERAL_PROFILE(B))
+    bk_profile_thread_start(B, BK_GENERAL_PROFILE(B), 0);
+
 #ifdef HAVE_PTHREAD_SET_NAME_NP
   // what the hell, might as well...
   pthread_set_name_np(pthread_self(), (char *)BK_BT_THREADNAME(B));
@@ -18,6 +18,13 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 /**
  * @file
  * All of the support routines for dealing with times.
+ *
+ * ISO times for years 1000 through 9999 are converted without the C
+ * library: dates are turned to and from day numbers arithmetically
+ * (after Howard Hinnant's civil_from_days), formatting reuses the
+ * "YYYY-mm-ddTHH:MM:" prefix cached in the thread state for as long as
+ * the minute (or date) stays the same, and the fixed layout
+ * "yyyy-mm-ddThh:mm:ss" is checked a word at a time when parsing.
  */
 
 #include <libbk.h>
@@ -49,6 +56,29 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 #define BK_MILLISEC   (BK_MICROSEC*1000)
 
 #define MONTHS	   12
+#define TIME_ISO_MAX	48			///< Room for any ISO time bk_time_iso_format makes, and more than any the fixed layout parse takes
+#define TIME_ISO_FIRST	(-30610224000LL)	///< 1000-01-01T00:00:00Z, the first time with a four digit year
+#define TIME_ISO_LAST	253402300799LL		///< 9999-12-31T23:59:59Z
+#define TIME_ZEROS	0x3030303030303030ULL	///< '0' in each byte
+#define TIME_LOWS	0x7f7f7f7f7f7f7f7fULL	///< Low seven bits of each byte
+#define TIME_HIGHS	0x8080808080808080ULL	///< High bit of each byte
+#define TIME_TENS	0x7676767676767676ULL	///< Carries into the high bit of each byte of ten or more
+#define TIME_DATE_DIGITS  0x00ffff00ffffffffULL	///< Digits of "yyyy-mm-"
+#define TIME_DATE_SEPS	  0x2d00002d00000000ULL	///< Dashes of "yyyy-mm-"
+#define TIME_DAY_DIGITS	  0xffff00ffff00ffffULL	///< Digits of "ddThh:mm" (also of "hh:mm:ss")
+#define TIME_DAY_SEPS	  0x00003a0000000000ULL	///< Colon of "ddThh:mm"
+#define TIME_DAY_SEPMASK  0x0000ff0000000000ULL	///< Colon byte of "ddThh:mm"
+#define TIME_CLOCK_SEPS	  0x00003a00003a0000ULL	///< Colons of "hh:mm:ss"
+#define TIME_BYTE(w, i)	((u_int)((w) >> (8 * (i))) & 0xff) ///< Byte i of a word, first byte in the low bits
+#define TIME_NOTDIGIT(x) (((((x) & TIME_LOWS) + TIME_TENS) | (x)) & TIME_HIGHS) ///< High bit of each byte of x ^ TIME_ZEROS which was not a digit
+
+
+
+static size_t time_iso_format(bk_s B, char *str, const struct timespec *timep, bk_flags flags);
+static void time_iso_datetime(bk_s B, char *str, time_t sec);
+static const char *time_iso_parse_fixed(const char *p, const char *end, struct timespec *date, bk_flags flags);
+static int64_t time_days(int64_t year, u_int month, int day);
+static void time_civil(int64_t days, int64_t *yearp, u_int *monthp, u_int *dayp);
 
 
 
@@ -87,16 +117,7 @@ size_t
 bk_time_iso_format(bk_s B, char *str, size_t max, const struct timespec *timep, bk_flags *out_flagsp, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  // the size of the array is that of base output "YYYY-mm-ddTHH:MM:SSZ\0" for no apparent reason
-  static const char FORMAT_WITH_T[21] = "%Y-%m-%dT%H:%M:%S";
-  static const char FORMAT_NO_T[21] = "%Y-%m-%d %H:%M:%S";
-  const char *format;
-  const char *Z;
-  int precision;
-  unsigned fraction = 0;
-  struct timespec ts;
-  struct tm *tp;
-  struct tm t;
+  char tmp[TIME_ISO_MAX];
   size_t len;
 
   if (!timep || !str)
@@ -105,22 +126,120 @@ bk_time_iso_format(bk_s B, char *str, size_t max, const struct timespec *timep,
     BK_RETURN(B, 0);
   }
 
-  ts = *timep;
-
   if (out_flagsp)
     *out_flagsp = 0;
 
-  if (BK_FLAG_ISCLEAR(flags, BK_TIME_FORMAT_FLAG_NO_TZ))
+  // Format in place if there is certainly room
+  if (max >= TIME_ISO_MAX)
+    BK_RETURN(B, time_iso_format(B, str, timep, flags));
+
+  if (!(len = time_iso_format(B, tmp, timep, flags)))
+    BK_RETURN(B, 0);
+
+  if (len >= max)
   {
-    format = FORMAT_WITH_T;
-    Z = "Z";
+    if (out_flagsp)
+      BK_FLAG_SET(*out_flagsp, BK_TIME_FORMAT_OUTFLAG_TRUNCATED);
+    BK_RETURN(B, 0);
   }
-  else
+
+  memcpy(str, tmp, len + 1);
+
+  BK_RETURN(B, len);
+}
+
+
+
+/**
+ * Format an array of ISO times into a buffer, each followed by a
+ * delimiter (such as '\n', or '\0' to make strings); see
+ * bk_time_iso_format.  The thread state caches the date and time
+ * prefix, so times close together are cheapest.
+ *
+ * Formatting stops when the next time will not fit, with *used saying
+ * how much of the buffer was filled, so the times can be written out a
+ * buffer at a time.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param buf Buffer for output
+ *	@param max Size of buffer
+ *	@param times Times to format
+ *	@param count Number of times
+ *	@param delim Character to follow each time
+ *	@param used Copy-out bytes of buffer used (may be NULL)
+ *	@param flags BK_TIME_FORMAT_FLAG_NO_TZ
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>number</i> of times formatted on success.
+ */
+ssize_t
+bk_time_iso_format_batch(bk_s B, char *buf, size_t max, const struct timespec *times, size_t count, int delim, size_t *used, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  char tmp[TIME_ISO_MAX];
+  size_t off = 0, len, n;
+
+  if (!buf || !times)
   {
-    format = FORMAT_NO_T;
-    Z = "";
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
   }
 
+  for (n = 0; n < count; n++)
+  {
+    if (max - off > TIME_ISO_MAX)
+    {
+      if (!(len = time_iso_format(B, buf + off, &times[n], flags)))
+	goto error;
+    }
+    else
+    {
+      if (!(len = time_iso_format(B, tmp, &times[n], flags)))
+	goto error;
+      if (len >= max - off)
+	break;
+      memcpy(buf + off, tmp, len);
+    }
+
+    off += len;
+    buf[off++] = delim;
+  }
+
+  if (used)
+    *used = off;
+
+  BK_RETURN(B, n);
+
+ error:
+  if (used)
+    *used = off;
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Format an ISO time into a buffer of at least TIME_ISO_MAX bytes.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param str Buffer for output
+ *	@param timep Time to format
+ *	@param flags BK_TIME_FORMAT_FLAG_NO_TZ
+ *	@return <i>0</i> on failure.<br>
+ *	@return number of bytes (not including terminating NUL) on success.
+ */
+static size_t
+time_iso_format(bk_s B, char *str, const struct timespec *timep, bk_flags flags)
+{
+  int precision;
+  u_int nsec;
+  struct timespec ts;
+  struct tm t;
+  size_t len;
+
+  ts = *timep;
+
   /*
    * <TRICKY>Don't use BK_TS_RECTIFY here; tv_nsec <em>must</em> be
    * non-negative for correct output.</TRICKY>
@@ -132,8 +251,8 @@ bk_time_iso_format(bk_s B, char *str, size_t max, const struct timespec *timep,
   }
   else if (ts.tv_nsec < 0)
   {
-    int add = 1 - (ts.tv_nsec / RESOLUTION);
-    ts.tv_sec += add;
+    int add = (RESOLUTION - 1 - ts.tv_nsec) / RESOLUTION;
+    ts.tv_sec -= add;
     ts.tv_nsec += add * RESOLUTION;
   }
 
@@ -144,69 +263,57 @@ bk_time_iso_format(bk_s B, char *str, size_t max, const struct timespec *timep,
     // <BUG ID="862">Guessing precision is stupid since even us/ms/sec boundries do occur </BUG>
 
     if (ts.tv_nsec % BK_MICROSEC)
-    {
-      fraction = ts.tv_nsec;
       precision = 9;
-    }
     else if (ts.tv_nsec % BK_MILLISEC)
-    {
-      fraction = ts.tv_nsec / BK_MICROSEC;
       precision = 6;
-    }
     else
-    {
-      fraction = ts.tv_nsec / BK_MILLISEC;
       precision = 3;				// what Java wants to see
-    }
   }
 
-  if (sizeof(FORMAT_WITH_T) + 2 + precision > max)	// check space in advance
+  if ((int64_t)ts.tv_sec >= TIME_ISO_FIRST && (int64_t)ts.tv_sec <= TIME_ISO_LAST)
   {
-    if (out_flagsp)
-      BK_FLAG_SET(*out_flagsp, BK_TIME_FORMAT_OUTFLAG_TRUNCATED);
-    BK_RETURN(B, 0);
+    time_iso_datetime(B, str, ts.tv_sec);
+    if (BK_FLAG_ISSET(flags, BK_TIME_FORMAT_FLAG_NO_TZ))
+      str[10] = ' ';
+    len = 19;
   }
-
-  if (!(tp = gmtime_r(&ts.tv_sec, &t)))
+  else
   {
-    bk_error_printf(B, BK_ERR_ERR, "Could not convert timespec to UTC: %s\n", strerror(errno));
-    BK_RETURN(B, 0);
-  }
+    if (!gmtime_r(&ts.tv_sec, &t))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not convert timespec to UTC: %s\n", strerror(errno));
+      return(0);
+    }
 
-  if (!(len = strftime(str, max - 1 - precision, format, tp)))
-  {
-    if (out_flagsp)
-      BK_FLAG_SET(*out_flagsp, BK_TIME_FORMAT_OUTFLAG_TRUNCATED);
-    BK_RETURN(B, 0);
+    if (!(len = strftime(str, TIME_ISO_MAX - 12, BK_FLAG_ISSET(flags, BK_TIME_FORMAT_FLAG_NO_TZ) ? "%Y-%m-%d %H:%M:%S" : "%Y-%m-%dT%H:%M:%S", &t)))
+      return(0);
   }
 
   if (precision)
-    len += snprintf(&str[len], max - len, ".%0*u%s", precision, fraction, Z);
-  else
   {
-    strcat(&str[len], Z);
-    len++;
+    /*
+     * Milli- and microseconds are the leading digits of nanoseconds, so
+     * write all nine (there is room) and keep what is wanted.
+     */
+    nsec = ts.tv_nsec;
+    str[len++] = '.';
+    str[len] = '0' + nsec / 100000000;
+    str[len + 1] = '0' + nsec / 10000000 % 10;
+    str[len + 2] = '0' + nsec / 1000000 % 10;
+    str[len + 3] = '0' + nsec / 100000 % 10;
+    str[len + 4] = '0' + nsec / 10000 % 10;
+    str[len + 5] = '0' + nsec / 1000 % 10;
+    str[len + 6] = '0' + nsec / 100 % 10;
+    str[len + 7] = '0' + nsec / 10 % 10;
+    str[len + 8] = '0' + nsec % 10;
+    len += precision;
   }
 
-  BK_RETURN(B, len);
-}
-
-
+  if (BK_FLAG_ISCLEAR(flags, BK_TIME_FORMAT_FLAG_NO_TZ))
+    str[len++] = 'Z';
+  str[len] = '\0';
 
-/**
- * Is this non-fully-qualified (e.g. struct tm) year a leap year?
- *
- * THREADS: MT-SAFE
- *
- * @param y Year number
- * @return <i>1</i> if it is a leap year<br>
- * @return <i>0</i> if it is not a leap year
- */
-static int
-is_leap(unsigned y)
-{
-    y += 1900;
-    return (y % 4) == 0 && ((y % 100) != 0 || (y % 400) == 0);
+  return(len);
 }
 
 
@@ -233,13 +340,10 @@ time_t
 bk_timegm(bk_s B, struct tm *timep, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  static const unsigned ndays[2][MONTHS] =
-    { {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31},
-      {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31} };
   time_t res = 0;
+  int64_t secs;
   int year;
   int month;
-  int i;
 
   if (!timep)
   {
@@ -253,28 +357,11 @@ bk_timegm(bk_s B, struct tm *timep, bk_flags flags)
   else
 #endif /* HAVE_TIMEGM */
   {
-    // normalize months to avoid long loops, array bounds overflow
-    year = timep->tm_year;
-    month = timep->tm_mon;
-    if (month > MONTHS)
-    {
-      i = 1 - (month / MONTHS);
-      year += i;
-      month += i * MONTHS;
-    }
-    if (month < 0)
-    {
-      i = 1 - (month / MONTHS);
-      year += i;
-      month += i * MONTHS;
-    }
-
     /*
      * Don't bother with time before 1970, or after 2105 (32bit)/20000
-     * (64bit); this not only prevents long ("infinite") loops
-     * counting years, it allows us to check for overflow on 32bits,
-     * as unsigned 32 bit time_t wraps in 2106, but signed 32 bit
-     * time_t will wrap in 2038.  Also note the year 20000 includes
+     * (64bit); this allows us to check for overflow on 32bits, as
+     * unsigned 32 bit time_t wraps in 2106, but signed 32 bit time_t
+     * will wrap in 2038.  Also note the year 20000 includes
      * BK_MAX_TIME_T at year 17420 or thereabouts, but not support
      * 64bit LONG_MAX). Of course, this all goes out the window if you
      * set tm_mday to INT_MAX, but whatever.
@@ -287,44 +374,21 @@ bk_timegm(bk_s B, struct tm *timep, bk_flags flags)
       BK_RETURN(B, -1);
 #endif
 
-    year = timep->tm_year;
-
-    /* Count down by 400 years for large values of year, starting at 2000 */
-    if (year >= 100)
-    {
-      // Rebase to year 2000
-      res = 10957;
-      year -= 100;
-      for (;year >= 400; year -= 400)
-      {
-	res += 146097;
-      }
-
-      // At this point, res is the number of days since 1970 to the closest (lower) multiple of 400 years
-      // At this point, year is the number of years after the multiple of 400 years
-
-      // Count up from the multiple--we use 2000 (a multiple of 400) as a base for convenience
-      for (i = 0; i < year; ++i)
-	res += is_leap(i+100) ? 366 : 365;
-    }
-    else
+    // normalize months into the year
+    year = timep->tm_year + timep->tm_mon / MONTHS;
+    month = timep->tm_mon % MONTHS;
+    if (month < 0)
     {
-      for (i = 70; i < timep->tm_year; ++i)
-	res += is_leap(i) ? 366 : 365;
+      year--;
+      month += MONTHS;
     }
 
-    for (i = 0; i < timep->tm_mon; ++i)
-      res += ndays[is_leap(timep->tm_year)][i];
-
-    res += timep->tm_mday - 1;
-    res *= 24;
-    res += timep->tm_hour;
-    res *= 60;
-    res += timep->tm_min;
-    res *= 60;
-    res += timep->tm_sec;
+    // The days and the times of day are linear, so need no normalizing
+    secs = time_days(year + 1900, month + 1, 1) + timep->tm_mday - 1;
+    secs = ((secs * 24 + timep->tm_hour) * 60 + timep->tm_min) * 60 + timep->tm_sec;
+    res = secs;
 
-    if (res < 0)				// signed time_t overflow
+    if (res < 0 || res != secs)			// signed time_t overflow
       BK_RETURN(B, -1);
   }
 
@@ -412,6 +476,7 @@ bk_time_iso_parse(bk_s B, const char *string, struct timespec *date, bk_flags fl
   unsigned long decimal = 0;
   char sep;
   int utc = BK_FLAG_ISSET(flags, BK_TIME_FORMAT_FLAG_NO_TZ);
+  size_t len;
 
   if (!string || !date)
   {
@@ -419,6 +484,11 @@ bk_time_iso_parse(bk_s B, const char *string, struct timespec *date, bk_flags fl
     BK_RETURN(B, -1);
   }
 
+  // The usual layout in UTC needs none of what follows
+  if ((len = strnlen(string, TIME_ISO_MAX)) < TIME_ISO_MAX &&
+      (fraction = time_iso_parse_fixed(string, string + len, date, flags)))
+    BK_RETURN(B, *fraction ? 1 : 0);
+
   memset(&t, 0, sizeof(t));
 #ifdef USE_STRPTIME
   /*
@@ -528,6 +598,75 @@ bk_time_iso_parse(bk_s B, const char *string, struct timespec *date, bk_flags fl
 
 
 
+/**
+ * Parse a buffer of ISO times separated by a delimiter (such as '\n')
+ * into an array; see bk_time_iso_parse.  The buffer need not be null
+ * terminated, and a delimiter at the very end of the buffer is allowed.
+ * Each time must fill its field.
+ *
+ * Parsing stops after count times, with *used saying how much of the
+ * buffer they (and the delimiter after the last) took, so a large buffer
+ * can be parsed a piece at a time.
+ *
+ * THREADS: MT-SAFE (as long as setlocale is not called)
+ *
+ *	@param B BAKA thread/global state.
+ *	@param buf Buffer of times
+ *	@param len Length of buffer
+ *	@param delim Character separating times
+ *	@param times Copy-out times
+ *	@param count Size of times array
+ *	@param used Copy-out bytes of buffer parsed, or offset of bad time on error (may be NULL)
+ *	@param flags BK_TIME_FORMAT_FLAG_NO_TZ to take times without Z as UTC
+ *	@return <i>-1</i> on a malformed time.<br>
+ *	@return <i>number</i> of times parsed otherwise.
+ */
+ssize_t
+bk_time_iso_parse_batch(bk_s B, const char *buf, size_t len, int delim, struct timespec *times, size_t count, size_t *used, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  const char *p = buf, *end = buf + len, *field;
+  char tmp[TIME_ISO_MAX];
+  size_t n;
+
+  if (!buf || !times)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (n = 0; n < count && p < end; n++)
+  {
+    if (!(field = memchr(p, delim, end - p)))
+      field = end;
+
+    // Other layouts go the long way, which needs a string
+    if (time_iso_parse_fixed(p, field, &times[n], flags) != field)
+    {
+      if ((size_t)(field - p) >= sizeof(tmp))
+	goto error;
+      memcpy(tmp, p, field - p);
+      tmp[field - p] = '\0';
+      if (bk_time_iso_parse(B, tmp, &times[n], flags) != 0)
+	goto error;
+    }
+
+    p = field < end ? field + 1 : end;
+  }
+
+  if (used)
+    *used = p - buf;
+
+  BK_RETURN(B, n);
+
+ error:
+  if (used)
+    *used = p - buf;
+  BK_RETURN(B, -1);
+}
+
+
+
 /**
  * Format an "NTP-style" date and time specification.
  *
@@ -768,3 +907,200 @@ bk_time_duration_parse(bk_s B, const char *string, time_t *duration, bk_flags fl
  error:
   BK_RETURN(B, -1);
 }
+
+
+
+/**
+ * Write the date and time (to the second) of an ISO time with a four
+ * digit year, reusing as much of the last one the thread formatted as
+ * is the same.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param str Buffer for "YYYY-mm-ddTHH:MM:SS" (not NUL terminated)
+ *	@param sec Time, from TIME_ISO_FIRST to TIME_ISO_LAST
+ */
+static void
+time_iso_datetime(bk_s B, char *str, time_t sec)
+{
+  struct bk_time_cache nocache, *btc = B ? BK_BT_TIMECACHE(B) : &nocache;
+  int64_t minute, day, year;
+  u_int second, hm, month, mday;
+
+  minute = (int64_t)sec / 60 - ((int64_t)sec % 60 < 0);
+  second = (int64_t)sec - minute * 60;
+
+  if (!B)
+    nocache.btc_valid = 0;
+
+  if (!btc->btc_valid || btc->btc_minute != minute)
+  {
+    day = minute / 1440 - (minute % 1440 < 0);
+
+    if (!btc->btc_valid || btc->btc_day != day)
+    {
+      time_civil(day, &year, &month, &mday);
+      btc->btc_prefix[0] = '0' + year / 1000;
+      btc->btc_prefix[1] = '0' + year / 100 % 10;
+      btc->btc_prefix[2] = '0' + year / 10 % 10;
+      btc->btc_prefix[3] = '0' + year % 10;
+      btc->btc_prefix[4] = '-';
+      btc->btc_prefix[5] = '0' + month / 10;
+      btc->btc_prefix[6] = '0' + month % 10;
+      btc->btc_prefix[7] = '-';
+      btc->btc_prefix[8] = '0' + mday / 10;
+      btc->btc_prefix[9] = '0' + mday % 10;
+      btc->btc_prefix[10] = 'T';
+      btc->btc_day = day;
+    }
+
+    hm = minute - day * 1440;
+    btc->btc_prefix[11] = '0' + hm / 600;
+    btc->btc_prefix[12] = '0' + hm / 60 % 10;
+    btc->btc_prefix[13] = ':';
+    btc->btc_prefix[14] = '0' + hm % 60 / 10;
+    btc->btc_prefix[15] = '0' + hm % 10;
+    btc->btc_prefix[16] = ':';
+    btc->btc_minute = minute;
+    btc->btc_valid = 1;
+  }
+
+  memcpy(str, btc->btc_prefix, sizeof(btc->btc_prefix));
+  str[17] = '0' + second / 10;
+  str[18] = '0' + second % 10;
+}
+
+
+
+/**
+ * Parse the usual layout of ISO time, "yyyy-mm-ddThh:mm:ss" (or with a
+ * space for the T), then optional fractional seconds and Z, in UTC.
+ * The fixed part is checked and split into digits a word at a time.
+ * Anything else (other layouts, local time, odd fractions, years before
+ * 1970) is left for the general code in bk_time_iso_parse.
+ *
+ *	@param p Start of time
+ *	@param end End of string
+ *	@param date Copy-out time
+ *	@param flags BK_TIME_FORMAT_FLAG_NO_TZ to take a time without Z as UTC
+ *	@return <i>NULL</i> if not in this layout
+ *	@return <br><i>pointer</i> past the time
+ */
+static const char *
+time_iso_parse_fixed(const char *p, const char *end, struct timespec *date, bk_flags flags)
+{
+  static const u_int scale[] = { 1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1 };
+  u_int64_t w0, w1, w2;
+  u_int year, month, nsec = 0;
+  const char *digits;
+  int64_t secs;
+
+  if (end - p < 19 || (p[10] != 'T' && p[10] != ' '))
+    return(NULL);
+
+  // "yyyy-mm-", "ddThh:mm", and "hh:mm:ss"
+  memcpy(&w0, p, sizeof(w0));
+  memcpy(&w1, p + 8, sizeof(w1));
+  memcpy(&w2, p + 11, sizeof(w2));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w0 = __builtin_bswap64(w0);
+  w1 = __builtin_bswap64(w1);
+  w2 = __builtin_bswap64(w2);
+#endif /* big endian */
+
+  if ((w0 & ~TIME_DATE_DIGITS) != TIME_DATE_SEPS || (w1 & TIME_DAY_SEPMASK) != TIME_DAY_SEPS ||
+      (w2 & ~TIME_DAY_DIGITS) != TIME_CLOCK_SEPS)
+    return(NULL);
+
+  // Digits become their values, and anything else ten or more
+  w0 ^= TIME_ZEROS;
+  w1 ^= TIME_ZEROS;
+  w2 ^= TIME_ZEROS;
+  if ((TIME_NOTDIGIT(w0) & TIME_DATE_DIGITS) | (TIME_NOTDIGIT(w1) & TIME_DAY_DIGITS) | (TIME_NOTDIGIT(w2) & TIME_DAY_DIGITS))
+    return(NULL);
+
+  year = TIME_BYTE(w0, 0) * 1000 + TIME_BYTE(w0, 1) * 100 + TIME_BYTE(w0, 2) * 10 + TIME_BYTE(w0, 3);
+  month = TIME_BYTE(w0, 5) * 10 + TIME_BYTE(w0, 6);
+  if (year < 1970 || month < 1 || month > MONTHS)
+    return(NULL);
+
+  // Like bk_timegm, the day and time of day may overflow into the next
+  secs = time_days(year, month, 1) + TIME_BYTE(w1, 0) * 10 + TIME_BYTE(w1, 1) - 1;
+  secs = secs * 86400 + (TIME_BYTE(w2, 0) * 10 + TIME_BYTE(w2, 1)) * 3600 +
+    (TIME_BYTE(w2, 3) * 10 + TIME_BYTE(w2, 4)) * 60 + TIME_BYTE(w2, 6) * 10 + TIME_BYTE(w2, 7);
+
+  p += 19;
+
+  if (p < end && (*p == '.' || *p == ','))
+  {
+    for (digits = ++p; p < end && p - digits < 10 && (u_int)(*p - '0') < 10; p++)
+      nsec = nsec * 10 + (*p - '0');
+    if (p == digits || p - digits > 9)
+      return(NULL);
+    nsec *= scale[p - digits];
+  }
+
+  if (p < end && (*p == 'Z' || *p == 'z'))
+    p++;
+  else if (BK_FLAG_ISCLEAR(flags, BK_TIME_FORMAT_FLAG_NO_TZ))
+    return(NULL);
+
+  if ((time_t)secs != secs)
+    return(NULL);
+
+  date->tv_sec = secs;
+  date->tv_nsec = nsec;
+
+  return(p);
+}
+
+
+
+/**
+ * Days since the epoch of a (proleptic Gregorian) date.  Years start in
+ * March here, so the leap day comes last, and a 400 year era always has
+ * the same number of days.
+ *
+ *	@param year Year
+ *	@param month Month, 1 to 12
+ *	@param day Day of month (may be out of range, for days before or after)
+ *	@return <i>days</i> since 1970-01-01
+ */
+static int64_t
+time_days(int64_t year, u_int month, int day)
+{
+  int64_t era, doy;
+  u_int yoe;
+
+  year -= month <= 2;
+  era = (year >= 0 ? year : year - 399) / 400;
+  yoe = year - era * 400;				// [0, 399]
+  doy = (int64_t)((153 * (month > 2 ? month - 3 : month + 9) + 2) / 5) + day - 1;
+  return(era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468);
+}
+
+
+
+/**
+ * Date of a day since the epoch; the inverse of time_days.
+ *
+ *	@param days Days since 1970-01-01
+ *	@param yearp Copy-out year
+ *	@param monthp Copy-out month, 1 to 12
+ *	@param dayp Copy-out day of month
+ */
+static void
+time_civil(int64_t days, int64_t *yearp, u_int *monthp, u_int *dayp)
+{
+  int64_t era;
+  u_int doe, yoe, doy, mp;
+
+  days += 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  doe = days - era * 146097;				// [0, 146096]
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *dayp = doy - (153 * mp + 2) / 5 + 1;
+  *monthp = mp < 10 ? mp + 3 : mp - 9;
+  *yearp = yoe + era * 400 + (*monthp <= 2);
+}
@@ -18,13 +18,92 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 /**
  * @file
  * All of the support routines for dealing with urls.
+ *
+ * bk_url_parse_spans finds the same parts as bk_url_parse without
+ * allocating anything.  It classifies the URL 64 bytes at a time into a
+ * bitmask of the delimiters (with AVX2 where the CPU has it), so each
+ * search for the end of a part just skips to the next delimiter bit
+ * instead of looking at every byte again.
  */
 #include <libbk.h>
 #include "libbk_internal.h"
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define URL_X86						///< Can select x86 instructions at run time
+#include <immintrin.h>
+#endif /* x86 */
 
 
 #define PARAM_DELIM ';'
 
+#define URL_BLOCK	64				///< Bytes of URL classified at a time
+#define URL_CLASSES	7				///< Number of delimiter classes (one bit each)
+#define URL_COLON	0x01				///< ':' delimiter class
+#define URL_SLASH	0x02				///< '/' delimiter class
+#define URL_QUERY	0x04				///< '?' delimiter class
+#define URL_HASH	0x08				///< '#' delimiter class
+#define URL_LBRACKET	0x10				///< '[' delimiter class
+#define URL_RBRACKET	0x20				///< ']' delimiter class
+#define URL_AT		0x40				///< '@' delimiter class
+
+#define URL_PART_SCHEME		0			///< Index of scheme for url_reconstruct
+#define URL_PART_AUTHORITY	1			///< Index of authority for url_reconstruct
+#define URL_PART_PATH		2			///< Index of path for url_reconstruct
+#define URL_PART_QUERY		3			///< Index of query for url_reconstruct
+#define URL_PART_FRAGMENT	4			///< Index of fragment for url_reconstruct
+#define URL_PARTS		5			///< Number of parts for url_reconstruct
+
+/// Set a span to run from start to end
+#define URL_SPAN(span, start, end) do { (span).bup_off = (start); (span).bup_len = (end) - (start); } while (0)
+
+
+
+/**
+ * Delimiters of a URL being parsed, found a block at a time.
+ */
+struct url_scan
+{
+  const char *		us_url;			///< URL being parsed
+  size_t		us_len;			///< Length of URL
+  size_t		us_block;		///< Offset of block in us_masks (-1 if none)
+  u_int64_t		us_masks[URL_CLASSES];	///< Bit for each delimiter of each class in block
+  bk_flags		us_flags;		///< Everyone needs flags
+#define URL_SCAN_AVX2		0x1		///< Classify with AVX2
+};
+
+
+
+/// Delimiter class of each character (0 for the rest)
+static const u_char url_class[256] =
+{
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, URL_HASH, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, URL_SLASH,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, URL_COLON, 0, 0, 0, 0, URL_QUERY,
+  URL_AT, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, URL_LBRACKET, 0, URL_RBRACKET, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+
+
+static int url_authority(struct url_scan *us, struct bk_url_spans *bus);
+static inline size_t url_find(struct url_scan *us, size_t pos, size_t end, u_char set);
+static void url_classify(struct url_scan *us, size_t block);
+#ifdef URL_X86
+static void url_classify_avx2(const u_char *p, u_int64_t *masks);
+#endif /* URL_X86 */
+static size_t url_unescape(char *dst, const char *src, size_t len);
+static char *url_reconstruct(bk_s B, const struct bk_strspan *parts, bk_flags sections);
+
 
 #define STORE_URL_ELEMENT(B, mode, element, start, end)			  \
 do {									  \
@@ -412,6 +491,131 @@ bk_url_parse(bk_s B, const char *url, bk_url_parse_mode_e mode, bk_flags flags)
 
 
 
+/**
+ * Parse a url into spans of the string, without allocating or copying
+ * anything; see bk_url_parse.  The parts found are the same as with
+ * bk_url_parse (including its fuzzy logic unless BK_URL_FLAG_STRICT_PARSE
+ * is set), except that user and password information before an '@' in
+ * the authority is split out as bk_url_parse_authority does, and a
+ * fragment after an empty query is not lost.
+ *
+ * The url need not be NUL terminated.  Parts are not unescaped; use
+ * bk_url_unescape_inplace on them if the string may be changed.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param url Url to parse.
+ *	@param len Length of url.
+ *	@param bus Copy-out spans of the parts of url.
+ *	@param flags BK_URL_FLAG_STRICT_PARSE
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+int
+bk_url_parse_spans(bk_s B, const char *url, size_t len, struct bk_url_spans *bus, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct url_scan us;
+  size_t start, end, host;
+
+  if (!url || !bus || (u_int32_t)len != len)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, -1);
+  }
+
+  memset(bus, 0, sizeof(*bus));
+  us.us_url = url;
+  us.us_len = len;
+  us.us_block = (size_t)-1;
+  us.us_flags = 0;
+#ifdef URL_X86
+  if (__builtin_cpu_supports("avx2"))
+    BK_FLAG_SET(us.us_flags, URL_SCAN_AVX2);
+#endif /* URL_X86 */
+
+  // The inclusion of [ is compliant with rfc2732 ipv6 literal address parsing
+  start = 0;
+  end = url_find(&us, 0, len, URL_COLON | URL_SLASH | URL_QUERY | URL_HASH | URL_LBRACKET);
+  if (end < len && url[end] == ':' && end > 0)
+  {
+    URL_SPAN(bus->bus_scheme, 0, end);
+    BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_SCHEME);
+    start = end + 1;
+  }
+
+  if (len - start >= 2 && url[start] == '/' && url[start + 1] == '/')
+  {
+    start += 2;
+    end = url_find(&us, start, len, URL_SLASH | URL_QUERY | URL_HASH);
+    URL_SPAN(bus->bus_authority, start, end);
+    if (end > start)
+    {
+      BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_AUTHORITY);
+      if (url_authority(&us, bus) < 0)
+	goto error;
+    }
+    start = end;
+  }
+
+  end = url_find(&us, start, len, URL_QUERY | URL_HASH);
+  if (end > start)
+  {
+    URL_SPAN(bus->bus_path, start, end);
+    BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_PATH);
+    start = end;
+  }
+
+  if (start < len && url[start] == '?')
+  {
+    end = url_find(&us, ++start, len, URL_HASH);
+    if (end > start)
+    {
+      URL_SPAN(bus->bus_query, start, end);
+      BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_QUERY);
+    }
+    start = end;
+  }
+
+  if (start < len && url[start] == '#' && ++start < len)
+  {
+    URL_SPAN(bus->bus_fragment, start, len);
+    BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_FRAGMENT);
+  }
+
+  // Promote the first component of a relative path to authority, as bk_url_parse does
+  if (BK_FLAG_ISCLEAR(flags, BK_URL_FLAG_STRICT_PARSE) &&
+      BK_FLAG_ISCLEAR(bus->bus_flags, BK_URL_FLAG_AUTHORITY) &&
+      BK_FLAG_ISSET(bus->bus_flags, BK_URL_FLAG_PATH) && url[bus->bus_path.bup_off] != '/')
+  {
+    start = bus->bus_path.bup_off;
+    end = start + bus->bus_path.bup_len;
+    host = url_find(&us, start, end, URL_SLASH);
+    URL_SPAN(bus->bus_authority, start, host);
+    BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_AUTHORITY);
+
+    if (host < end)
+      URL_SPAN(bus->bus_path, host, end);
+    else
+    {
+      memset(&bus->bus_path, 0, sizeof(bus->bus_path));
+      BK_FLAG_CLEAR(bus->bus_flags, BK_URL_FLAG_PATH);
+    }
+
+    if (url_authority(&us, bus) < 0)
+      goto error;
+  }
+
+  BK_RETURN(B, 0);
+
+ error:
+  bk_error_printf(B, BK_ERR_ERR, "Malformed ipv6 address\n");
+  BK_RETURN(B, -1);
+}
+
+
+
 /**
  * Create a url structure and clean it out.
  *
@@ -547,40 +751,48 @@ bk_url_unescape_len(bk_s B, const char *component, size_t len)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
   char *expanded;
-  char *copy;
 
   if (!component)				// handle this gracefully
     BK_RETURN(B, calloc(1,1));
 
+  len = strnlen(component, len);
   if (!(expanded = malloc(len + 1))) // may be a bit too big, ok
   {
     bk_error_printf(B, BK_ERR_ERR, "could not allocate unescaped URL component\n");
     BK_RETURN(B, NULL);
   }
 
-  for (copy = expanded; *component && len--; copy++, component++)
-  {
-    if (*component == '%' && isxdigit(component[1]) && isxdigit(component[2]))
-    {
-      char convert[3];
-      int val;
-      convert[0] = component[1];
-      convert[1] = component[2];
-      convert[2] = '\0';
-      // escaped control characters are silently omitted
-      if (!iscntrl((val = strtoul(convert, NULL, 16))))
-      {
-	*copy = val;
-	component += 2;				// advance over hex digits
-	continue;
-      }						// else fall through
-    }
+  expanded[url_unescape(expanded, component, len)] = '\0';
+  BK_RETURN(B, expanded);
+}
+
+
+
+/**
+ * Expand % escapes in a component of URL in place, as bk_url_unescape_len
+ * does.  The component shrinks by two bytes for each escape expanded; it
+ * is not NUL terminated, so it may be (say) a span of a URL from
+ * bk_url_parse_spans, whose length should then be set to the result.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param component The url component
+ *	@param len Length of url component
+ *	@return <i>length</i> of unescaped component
+ */
+size_t
+bk_url_unescape_inplace(bk_s B, char *component, size_t len)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
 
-    *copy = *component;				// default action
+  if (!component)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, 0);
   }
 
-  *copy = '\0';					// finish expanded
-  BK_RETURN(B, expanded);
+  BK_RETURN(B, url_unescape(component, component, len));
 }
 
 
@@ -918,7 +1130,8 @@ bk_url_authority_destroy(bk_s B, struct bk_url_authority *bua)
 
 /**
  * Reconstruct a URL from its parts, allowing the caller to specify those
- * parts in which s/he is interested. Returns a malloc(3)'ed string.
+ * parts in which s/he is interested. Returns a malloc(3)'ed string.  The
+ * scheme is required, and it and any authority are always included.
  *
  * <WARNING id="1178">Although the handling of non-generic URLs has been
  * improved, this function may still generate incorrect URLs for non-generic
@@ -938,10 +1151,7 @@ char *
 bk_url_reconstruct(bk_s B, struct bk_url *bu, bk_flags sections, bk_flags flags)
 {
   BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
-  char *url = NULL;
-  char *tmp;
-  int len, tmp_len;
-  char *insert;
+  struct bk_strspan parts[URL_PARTS];
 
   if (!bu || !BK_URL_SCHEME_DATA(bu))
   {
@@ -949,81 +1159,358 @@ bk_url_reconstruct(bk_s B, struct bk_url *bu, bk_flags sections, bk_flags flags)
     BK_RETURN(B, NULL);
   }
 
-  // Space for scheme and "://" and NUL
-  len = strlen(BK_URL_SCHEME_DATA(bu)) + 4;
+#define URL_PART(part, element)						\
+  do {									\
+    if (((part).bss_ptr = BK_URL_DATA(bu, (element))))			\
+      (part).bss_len = BK_URL_LEN(bu, (element));			\
+  } while (0)
 
-  if (!(BK_MALLOC_LEN(url, len)))
+  memset(parts, 0, sizeof(parts));
+  URL_PART(parts[URL_PART_SCHEME], bu->bu_scheme);
+  URL_PART(parts[URL_PART_AUTHORITY], bu->bu_authority);
+  URL_PART(parts[URL_PART_PATH], bu->bu_path);
+  URL_PART(parts[URL_PART_QUERY], bu->bu_query);
+  URL_PART(parts[URL_PART_FRAGMENT], bu->bu_fragment);
+
+#undef URL_PART
+
+  BK_RETURN(B, url_reconstruct(B, parts, sections));
+}
+
+
+
+/**
+ * Reconstruct a URL from the spans of its parts found by
+ * bk_url_parse_spans; see bk_url_reconstruct.
+ *
+ * THREADS: MT-SAFE
+ *
+ *	@param B BAKA thread/global state.
+ *	@param url The url the spans are of
+ *	@param bus The parsed url
+ *	@param sections A bit field containing a list of the desired sections
+ *	@param flags Flags for future use.
+ *	@return <i>NULL</i> on failure.<br>
+ *	@return <i>url string</i> on success.
+ */
+char *
+bk_url_reconstruct_spans(bk_s B, const char *url, const struct bk_url_spans *bus, bk_flags sections, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_strspan parts[URL_PARTS];
+
+  if (!url || !bus || BK_FLAG_ISCLEAR(bus->bus_flags, BK_URL_FLAG_SCHEME))
   {
-    bk_error_printf(B, BK_ERR_ERR, "Could not allocate space for scheme: %s\n", strerror(errno));
-    goto error;
+    bk_error_printf(B, BK_ERR_ERR, "Illegal arguments\n");
+    BK_RETURN(B, NULL);
   }
 
-  if (!BK_URL_AUTHORITY_DATA(bu))
-    snprintf(url, len, "%s:", BK_URL_SCHEME_DATA(bu));
-  else
-  {
-    snprintf(url, len, "%s://", BK_URL_SCHEME_DATA(bu));
+#define URL_PART(part, span, present)					\
+  do {									\
+    if (present)							\
+    {									\
+      (part).bss_ptr = BK_URL_SPAN_DATA(url, (span));			\
+      (part).bss_len = BK_URL_SPAN_LEN(span);				\
+    }									\
+  } while (0)
+
+  memset(parts, 0, sizeof(parts));
+  URL_PART(parts[URL_PART_SCHEME], bus->bus_scheme, 1);
+  URL_PART(parts[URL_PART_AUTHORITY], bus->bus_authority, bus->bus_authority.bup_off || BK_FLAG_ISSET(bus->bus_flags, BK_URL_FLAG_AUTHORITY));
+  URL_PART(parts[URL_PART_PATH], bus->bus_path, BK_FLAG_ISSET(bus->bus_flags, BK_URL_FLAG_PATH));
+  URL_PART(parts[URL_PART_QUERY], bus->bus_query, BK_FLAG_ISSET(bus->bus_flags, BK_URL_FLAG_QUERY));
+  URL_PART(parts[URL_PART_FRAGMENT], bus->bus_fragment, BK_FLAG_ISSET(bus->bus_flags, BK_URL_FLAG_FRAGMENT));
+
+#undef URL_PART
+
+  BK_RETURN(B, url_reconstruct(B, parts, sections));
+}
+
+
+
+/**
+ * Find the user, password, host, and service in the authority of a url
+ * being parsed into spans.  This is done as soon as the authority is
+ * found, while its block of the url is still classified.
+ *
+ *	@param us Scan state
+ *	@param bus Spans of url (authority set)
+ *	@return <i>-1</i> on a malformed ipv6 address.<br>
+ *	@return <i>0</i> on success.
+ */
+static int url_authority(struct url_scan *us, struct bk_url_spans *bus)
+{
+  const char *url = us->us_url;
+  size_t start, end, host, host_end, serv, at;
 
-    tmp_len = strlen(BK_URL_AUTHORITY_DATA(bu));
-    if (!(tmp = realloc(url, len + tmp_len)))
+  start = bus->bus_authority.bup_off;
+  end = start + bus->bus_authority.bup_len;
+
+  if ((at = url_find(us, start, end, URL_AT)) < end)
+  {
+    serv = url_find(us, start, at, URL_COLON);
+    URL_SPAN(bus->bus_user, start, serv);
+    BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_USER);
+    if (serv < at)
     {
-      bk_error_printf(B, BK_ERR_ERR, "Could not realloc space for athority section: %s\n", strerror(errno));
-      goto error;
+      URL_SPAN(bus->bus_pass, serv + 1, at);
+      BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_PASS);
     }
-    url = tmp;
-    insert = url + strlen(url);
-    snprintf(insert, tmp_len+1, "%s", BK_URL_AUTHORITY_DATA(bu));
-    len += tmp_len;
+    start = at + 1;
   }
 
+  if (start < end && url[start] == '[')
+  {
+    // ipv6 address (we're mandating square brackets around ipv6's).
+    host = start + 1;
+    if ((host_end = url_find(us, host, end, URL_RBRACKET)) == end)
+      return(-1);
+    serv = url_find(us, host_end, end, URL_COLON);
+  }
+  else
+  {
+    host = start;
+    host_end = serv = url_find(us, start, end, URL_COLON);
+  }
 
-  if (BK_FLAG_ISSET(sections, BK_URL_FLAG_PATH) &&  BK_URL_PATH_DATA(bu))
+  if (host_end > host)
   {
-    tmp_len = strlen(BK_URL_PATH_DATA(bu));
-    if (!(tmp = realloc(url, len + tmp_len)))
-    {
-      bk_error_printf(B, BK_ERR_ERR, "Could not realloc space for path section: %s\n", strerror(errno));
-      goto error;
-    }
-    url = tmp;
-    insert = url + strlen(url);
-    snprintf(insert, tmp_len+1, "%s", BK_URL_PATH_DATA(bu));
-    len += tmp_len;
+    URL_SPAN(bus->bus_host, host, host_end);
+    BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_HOST);
   }
 
-  if (BK_FLAG_ISSET(sections, BK_URL_FLAG_QUERY) &&  BK_URL_QUERY_DATA(bu))
+  if (serv < end)
   {
-    tmp_len = strlen(BK_URL_QUERY_DATA(bu)) + 1;
-    if (!(tmp = realloc(url, len + tmp_len)))
+    URL_SPAN(bus->bus_serv, serv + 1, end);
+    BK_FLAG_SET(bus->bus_flags, BK_URL_FLAG_SERV);
+  }
+
+  return(0);
+}
+
+
+
+/**
+ * Find the next delimiter of a set in part of a URL.  The set is
+ * usually constant, so combining the masks of its classes inlines to a
+ * few ORs.
+ *
+ *	@param us Scan state
+ *	@param pos Where to start looking
+ *	@param end Where to stop looking
+ *	@param set Delimiter classes to look for
+ *	@return <i>offset</i> of delimiter, or end if none
+ */
+static inline size_t url_find(struct url_scan *us, size_t pos, size_t end, u_char set)
+{
+  u_int64_t mask;
+  size_t block;
+
+  while (pos < end)
+  {
+    block = pos & ~(size_t)(URL_BLOCK - 1);
+    if (block != us->us_block)
+      url_classify(us, block);
+
+    // Spelled out so a constant set folds away; gcc will not unroll a loop
+    mask = 0;
+    if (set & URL_COLON) mask |= us->us_masks[0];
+    if (set & URL_SLASH) mask |= us->us_masks[1];
+    if (set & URL_QUERY) mask |= us->us_masks[2];
+    if (set & URL_HASH) mask |= us->us_masks[3];
+    if (set & URL_LBRACKET) mask |= us->us_masks[4];
+    if (set & URL_RBRACKET) mask |= us->us_masks[5];
+    if (set & URL_AT) mask |= us->us_masks[6];
+
+    if ((mask &= ~0ULL << (pos - block)))
+      return(MIN(block + __builtin_ctzll(mask), end));
+
+    pos = block + URL_BLOCK;
+  }
+
+  return(end);
+}
+
+
+
+/**
+ * Find the delimiters of each class in a block of a URL.
+ *
+ *	@param us Scan state
+ *	@param block Offset of block (a multiple of URL_BLOCK)
+ */
+static void url_classify(struct url_scan *us, size_t block)
+{
+  const u_char *p = (const u_char *)us->us_url + block;
+  size_t n = MIN(URL_BLOCK, us->us_len - block), i;
+  u_char tmp[URL_BLOCK];
+  u_char c;
+
+  us->us_block = block;
+
+#ifdef URL_X86
+  if (BK_FLAG_ISSET(us->us_flags, URL_SCAN_AVX2))
+  {
+    if (n < URL_BLOCK)
     {
-      bk_error_printf(B, BK_ERR_ERR, "Could not realloc space for query section: %s\n", strerror(errno));
-      goto error;
+      memset(tmp, 0, sizeof(tmp));
+      memcpy(tmp, p, n);
+      p = tmp;
     }
-    url = tmp;
-    insert = url + strlen(url);
-    snprintf(insert, tmp_len+1, "?%s", BK_URL_QUERY_DATA(bu));
-    len += tmp_len;
+    url_classify_avx2(p, us->us_masks);
+    return;
   }
+#endif /* URL_X86 */
+
+  memset(us->us_masks, 0, sizeof(us->us_masks));
+  for (i = 0; i < n; i++)
+    if ((c = url_class[p[i]]))
+      us->us_masks[__builtin_ctz(c)] |= 1ULL << i;
+}
 
-  if (BK_FLAG_ISSET(sections, BK_URL_FLAG_FRAGMENT) &&  BK_URL_FRAGMENT_DATA(bu))
+
+
+#ifdef URL_X86
+/**
+ * Find the delimiters of each class in 64 bytes with AVX2.
+ *
+ *	@param p Data
+ *	@param masks Copy-out bit for each delimiter of each class
+ */
+__attribute__((target("avx2")))
+static void url_classify_avx2(const u_char *p, u_int64_t *masks)
+{
+  static const char delims[URL_CLASSES] = { ':', '/', '?', '#', '[', ']', '@' };
+  const __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+  const __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+  __m256i c;
+  int i;
+
+  for (i = 0; i < URL_CLASSES; i++)
   {
-    tmp_len = strlen(BK_URL_FRAGMENT_DATA(bu)) + 1;
-    if (!(tmp = realloc(url, len + tmp_len)))
+    c = _mm256_set1_epi8(delims[i]);
+    masks[i] = (u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, c)) |
+      (u_int64_t)(u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, c)) << 32;
+  }
+}
+#endif /* URL_X86 */
+
+
+
+/**
+ * Expand % escapes (see bk_url_unescape_len), copying everything between
+ * them a run at a time.  The output may be the input.
+ *
+ *	@param dst Output (room for len bytes)
+ *	@param src Url component
+ *	@param len Length of url component
+ *	@return <i>length</i> of output
+ */
+static size_t url_unescape(char *dst, const char *src, size_t len)
+{
+  const char *end = src + len, *pct;
+  char *out = dst;
+  int hi, lo, val;
+
+#define URL_HEX(c) ((u_int)((c) - '0') < 10 ? (c) - '0' : (u_int)(((c) | 0x20) - 'a') < 6 ? ((c) | 0x20) - 'a' + 10 : -1)
+
+  while ((pct = memchr(src, '%', end - src)))
+  {
+    if (out != src)
+      memmove(out, src, pct - src);
+    out += pct - src;
+    src = pct;
+
+    // escaped control characters are silently omitted
+    if (end - src >= 3 && (hi = URL_HEX(src[1])) >= 0 && (lo = URL_HEX(src[2])) >= 0 &&
+	!iscntrl((val = hi << 4 | lo)))
     {
-      bk_error_printf(B, BK_ERR_ERR, "Could not realloc space for fragment section: %s\n", strerror(errno));
-      goto error;
+      *out++ = val;
+      src += 3;
     }
-    url = tmp;
-    insert = url + strlen(url);
-    snprintf(insert, tmp_len+1, "#%s", BK_URL_FRAGMENT_DATA(bu));
-    len += tmp_len;
+    else
+      *out++ = *src++;
   }
 
-  BK_RETURN(B,url);
+#undef URL_HEX
 
- error:
-  if (url)
-    free(url);
+  if (out != src)
+    memmove(out, src, end - src);
+  out += end - src;
 
-  BK_RETURN(B,NULL);
+  return(out - dst);
+}
+
+
+
+/**
+ * Put a URL back together from its parts; see bk_url_reconstruct.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param parts Scheme, authority, path, query and fragment (NULL if absent)
+ *	@param sections A bit field containing a list of the desired sections
+ *	@return <i>NULL</i> on failure.<br>
+ *	@return <i>url string</i> on success.
+ */
+static char *url_reconstruct(bk_s B, const struct bk_strspan *parts, bk_flags sections)
+{
+  const struct bk_strspan *authority = &parts[URL_PART_AUTHORITY];
+  const struct bk_strspan *path = BK_FLAG_ISSET(sections, BK_URL_FLAG_PATH) ? &parts[URL_PART_PATH] : NULL;
+  const struct bk_strspan *query = BK_FLAG_ISSET(sections, BK_URL_FLAG_QUERY) ? &parts[URL_PART_QUERY] : NULL;
+  const struct bk_strspan *fragment = BK_FLAG_ISSET(sections, BK_URL_FLAG_FRAGMENT) ? &parts[URL_PART_FRAGMENT] : NULL;
+  size_t len;
+  char *url, *p;
+
+  // Space for scheme and ":" and NUL, then "//" before authority, "?" before query, and "#" before fragment
+  len = parts[URL_PART_SCHEME].bss_len + 2;
+  if (authority->bss_ptr)
+    len += authority->bss_len + 2;
+  if (path && path->bss_ptr)
+    len += path->bss_len;
+  if (query && query->bss_ptr)
+    len += query->bss_len + 1;
+  if (fragment && fragment->bss_ptr)
+    len += fragment->bss_len + 1;
+
+  if (!(BK_MALLOC_LEN(url, len)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate space for url: %s\n", strerror(errno));
+    return(NULL);
+  }
+
+  memcpy(url, parts[URL_PART_SCHEME].bss_ptr, parts[URL_PART_SCHEME].bss_len);
+  p = url + parts[URL_PART_SCHEME].bss_len;
+  *p++ = ':';
+
+  if (authority->bss_ptr)
+  {
+    *p++ = '/';
+    *p++ = '/';
+    memcpy(p, authority->bss_ptr, authority->bss_len);
+    p += authority->bss_len;
+  }
+
+  if (path && path->bss_ptr)
+  {
+    memcpy(p, path->bss_ptr, path->bss_len);
+    p += path->bss_len;
+  }
+
+  if (query && query->bss_ptr)
+  {
+    *p++ = '?';
+    memcpy(p, query->bss_ptr, query->bss_len);
+    p += query->bss_len;
+  }
+
+  if (fragment && fragment->bss_ptr)
+  {
+    *p++ = '#';
+    memcpy(p, fragment->bss_ptr, fragment->bss_len);
+    p += fragment->bss_len;
+  }
+
+  *p = '\0';
+
+  return(url);
 }
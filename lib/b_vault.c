@@ -17,6 +17,9 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 #include <libbk.h>
 #include "libbk_internal.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 
 
 /**
@@ -44,6 +47,82 @@ static ht_val vault_key_hash(void *a);
 
 
 
+/**
+ * @name Defines: flatvault
+ * Layout of the open addressed flat vault.  The table is an array of
+ * control bytes, probed FV_GROUP at a time, and a parallel array of
+ * slots.  A full slot's control byte holds seven bits of its hash, so
+ * nearly all non-matching slots are rejected without touching the slot
+ * array, let alone the key.
+ */
+// @{
+#define FV_GROUP		16		///< Control bytes compared at once
+#define FV_EMPTY		0x80		///< Slot never used since last rehash
+#define FV_DELETED		0xfe		///< Slot emptied by delete (tombstone)
+#define FV_FULL(c)		(!((c) & 0x80))	///< Control byte of a full slot
+#define FV_H1(h)		(((u_int32_t)(h) >> 7) | ((u_int32_t)(h) << 25)) ///< Hash bits selecting the group (all 32; the control bits only past 2^25 groups)
+#define FV_H2(h)		((u_int8_t)((h) & 0x7f)) ///< Hash bits kept in control byte
+#define FV_MINSLOTS		FV_GROUP	///< Smallest table
+#define FV_MAXLOAD(n)		((n) - (n) / 8)	///< Full plus deleted slots allowed
+#define FV_HASH(k)		bk_strhash((k), BK_HASH_V4)
+// @}
+
+
+
+/**
+ * Flat vault slot.  The hash is kept next to the node pointer so that
+ * growing never rehashes the keys and so that most mismatches on the
+ * control byte are rejected without touching the node or its key.
+ */
+struct fv_slot
+{
+  struct bk_vault_node *fs_node;		///< User node
+  u_int32_t		fs_hash;		///< Full hash of key
+};
+
+
+
+/**
+ * Flat vault
+ */
+struct bk_flatvault
+{
+  u_int8_t *		bfv_ctrl;		///< Control bytes, one per slot
+  struct fv_slot *	bfv_slots;		///< Slots
+  u_int32_t		bfv_nslots;		///< Number of slots (power of two)
+  u_int32_t		bfv_count;		///< Number of full slots
+  u_int32_t		bfv_used;		///< Number of full plus deleted slots
+  int			bfv_errno;		///< Last error (DICT_E*)
+  const char *		bfv_reason;		///< Last error reason
+  bk_flags		bfv_flags;		///< Everyone needs flags
+};
+
+
+
+/**
+ * Flat vault iterator
+ */
+struct fv_iter
+{
+  int			fi_pos;			///< Next slot to examine
+  enum dict_direction	fi_dir;			///< Direction of iteration
+};
+
+
+
+static int fv_alloc(struct bk_flatvault *fv, u_int32_t nslots);
+static int fv_rehash(struct bk_flatvault *fv, u_int32_t nslots);
+static inline u_int fv_match(const u_int8_t *ctrl, u_int8_t val);
+static inline u_int fv_match_free(const u_int8_t *ctrl);
+static int fv_find(struct bk_flatvault *fv, const char *key, u_int32_t hash);
+static int fv_place(struct bk_flatvault *fv, u_int32_t hash);
+static int fv_slotof(struct bk_flatvault *fv, struct bk_vault_node *node);
+static int fv_scan(struct bk_flatvault *fv, int pos, int dir);
+static int fv_error(struct bk_flatvault *fv, int err, const char *reason);
+static const char *fv_create_reason = "No error"; ///< Error reason when there is no vault
+
+
+
 
 
 /**
@@ -432,6 +511,513 @@ int bk_dllvault_destroyhelp(bk_vault_t V)
 
 
 
+/**
+ * Create an open addressed flat vault.  This is a drop-in alternative to
+ * bk_vault_create() for vaults which are searched far more often than
+ * they are iterated: the nodes are the same struct bk_vault_node, keys
+ * are unique, and the bk_flatvault_* functions take the same arguments
+ * and return the same values as the bk_vault_* wrappers.  Instead of
+ * chained CLC buckets, the table is a flat array probed a group of
+ * control bytes at a time (using SSE2 where available), which costs
+ * 17 bytes per slot with no per-entry allocation.
+ *
+ * Iteration order is table order.  The current object may be deleted
+ * while iterating, but inserting may grow the table and so invalidates
+ * any iteration in progress.
+ *
+ * This is a separate family, like bk_bstvault_* and bk_dllvault_*, rather
+ * than a bk_vault_create() option.  A bk_vault_t is a CLC dict_h, and the
+ * bk_vault_* operations are macros straight onto ht_*, so a non-CLC
+ * table could only sit behind them by adding a dispatch to every
+ * existing vault call.
+ *
+ * THREADS: MT-SAFE (different vaults)
+ *
+ *	@param B BAKA thread/global state
+ *	@param table_entries Optional number of entries expected (0 for default)
+ *	@param flags Reserved
+ *	@return <i>NULL</i> on call failure, allocation failure, etc
+ *	@return <br><i>allocated vault</i> on success.
+ */
+bk_flatvault_t bk_flatvault_create(bk_s B, int table_entries, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "libbk");
+  struct bk_flatvault *fv = NULL;
+  u_int32_t nslots = FV_MINSLOTS;
+
+  while (table_entries > 0 && FV_MAXLOAD(nslots) < (u_int32_t)table_entries && nslots < (1U << 30))
+    nslots <<= 1;
+
+  if (!BK_CALLOC(fv))
+  {
+    fv_create_reason = "Out of memory";
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate flat vault: %s\n", strerror(errno));
+    goto error;
+  }
+
+  fv->bfv_flags = flags;
+  fv->bfv_reason = "No error";
+
+  if (fv_alloc(fv, nslots) < 0)
+  {
+    fv_create_reason = "Out of memory";
+    bk_error_printf(B, BK_ERR_ERR, "Could not allocate flat vault table of %u slots\n", nslots);
+    goto error;
+  }
+
+  BK_RETURN(B, fv);
+
+ error:
+  if (fv)
+    bk_flatvault_destroy(fv);
+  BK_RETURN(B, NULL);
+}
+
+
+
+/**
+ * Destroy a flat vault.  The nodes are not freed.
+ *
+ *	@param V Flat vault
+ */
+void bk_flatvault_destroy(bk_flatvault_t V)
+{
+  if (!V)
+    return;
+
+  if (V->bfv_ctrl)
+    free(V->bfv_ctrl);
+  if (V->bfv_slots)
+    free(V->bfv_slots);
+  free(V);
+}
+
+
+
+/**
+ * Insert a node into a flat vault, returning any node which already has
+ * the same key.
+ *
+ *	@param V Flat vault
+ *	@param obj struct bk_vault_node to insert
+ *	@param oldobj Optional copy-out of existing node with same key
+ *	@return <i>DICT_OK</i> on success
+ *	@return <i>DICT_ERR</i> on failure or if the key already exists
+ */
+int bk_flatvault_insert_uniq(bk_flatvault_t V, dict_obj obj, dict_obj *oldobj)
+{
+  struct bk_vault_node *node = obj;
+  u_int32_t hash, nslots;
+  int pos;
+
+  if (oldobj)
+    *oldobj = NULL;
+
+  if (!V || !node || !node->key)
+    return(fv_error(V, DICT_ERR, "Invalid arguments"));
+
+  hash = FV_HASH(node->key);
+
+  if ((pos = fv_find(V, node->key, hash)) >= 0)
+  {
+    if (oldobj)
+      *oldobj = V->bfv_slots[pos].fs_node;
+    return(fv_error(V, DICT_EEXISTS, "Key already exists"));
+  }
+
+  if (V->bfv_used >= FV_MAXLOAD(V->bfv_nslots))
+  {
+    nslots = V->bfv_nslots;
+
+    // Mostly tombstones: rebuild at the same size to reclaim them
+    if (V->bfv_count >= FV_MAXLOAD(nslots) / 2)
+    {
+      if (nslots >= (1U << 30))
+	return(fv_error(V, DICT_ENOMEM, "Vault is at maximum size"));
+      nslots <<= 1;
+    }
+
+    if (fv_rehash(V, nslots) < 0)
+      return(fv_error(V, DICT_ENOMEM, "Out of memory"));
+  }
+
+  pos = fv_place(V, hash);
+  if (V->bfv_ctrl[pos] == FV_EMPTY)
+    V->bfv_used++;
+  V->bfv_ctrl[pos] = FV_H2(hash);
+  V->bfv_slots[pos].fs_node = node;
+  V->bfv_slots[pos].fs_hash = hash;
+  V->bfv_count++;
+
+  return(DICT_OK);
+}
+
+
+
+/**
+ * Insert a node into a flat vault.
+ *
+ *	@param V Flat vault
+ *	@param obj struct bk_vault_node to insert
+ *	@return <i>DICT_OK</i> on success
+ *	@return <i>DICT_ERR</i> on failure or if the key already exists
+ */
+int bk_flatvault_insert(bk_flatvault_t V, dict_obj obj)
+{
+  return(bk_flatvault_insert_uniq(V, obj, NULL));
+}
+
+
+
+/**
+ * Find the node with a key in a flat vault.
+ *
+ *	@param V Flat vault
+ *	@param key Key string
+ *	@return <i>NULL</i> if not found
+ *	@return <br><i>node</i> on success
+ */
+dict_obj bk_flatvault_search(bk_flatvault_t V, dict_key key)
+{
+  int pos;
+
+  if (!V || !key)
+    return(NULL);
+
+  if ((pos = fv_find(V, key, FV_HASH(key))) < 0)
+    return(NULL);
+
+  return(V->bfv_slots[pos].fs_node);
+}
+
+
+
+/**
+ * Remove a node from a flat vault.  The node is not freed.
+ *
+ *	@param V Flat vault
+ *	@param obj Node to remove
+ *	@return <i>DICT_OK</i> on success
+ *	@return <i>DICT_ERR</i> on failure or if the node is not in the vault
+ */
+int bk_flatvault_delete(bk_flatvault_t V, dict_obj obj)
+{
+  int pos;
+
+  if (!V || !obj)
+    return(fv_error(V, DICT_ERR, "Invalid arguments"));
+
+  if ((pos = fv_slotof(V, obj)) < 0)
+    return(fv_error(V, DICT_ERR, "Object not in vault"));
+
+  /*
+   * No probe sequence ever continued past a group which still has an
+   * empty slot, so the slot can be made empty again.  Otherwise some
+   * other key may be beyond it and it must be left as a tombstone.
+   */
+  if (fv_match(V->bfv_ctrl + (pos & ~(FV_GROUP - 1)), FV_EMPTY))
+  {
+    V->bfv_ctrl[pos] = FV_EMPTY;
+    V->bfv_used--;
+  }
+  else
+  {
+    V->bfv_ctrl[pos] = FV_DELETED;
+  }
+  V->bfv_slots[pos].fs_node = NULL;
+  V->bfv_count--;
+
+  return(DICT_OK);
+}
+
+
+
+/**
+ * Return the first node in a flat vault (in table order).
+ *
+ *	@param V Flat vault
+ *	@return <i>NULL</i> if empty
+ *	@return <br><i>node</i> otherwise
+ */
+dict_obj bk_flatvault_minimum(bk_flatvault_t V)
+{
+  int pos;
+
+  if (!V || (pos = fv_scan(V, 0, 1)) < 0)
+    return(NULL);
+
+  return(V->bfv_slots[pos].fs_node);
+}
+
+
+
+/**
+ * Return the last node in a flat vault (in table order).
+ *
+ *	@param V Flat vault
+ *	@return <i>NULL</i> if empty
+ *	@return <br><i>node</i> otherwise
+ */
+dict_obj bk_flatvault_maximum(bk_flatvault_t V)
+{
+  int pos;
+
+  if (!V || (pos = fv_scan(V, V->bfv_nslots - 1, -1)) < 0)
+    return(NULL);
+
+  return(V->bfv_slots[pos].fs_node);
+}
+
+
+
+/**
+ * Return the node after a node in a flat vault (in table order).
+ *
+ *	@param V Flat vault
+ *	@param obj Node in the vault
+ *	@return <i>NULL</i> if there is none or obj is not in the vault
+ *	@return <br><i>node</i> otherwise
+ */
+dict_obj bk_flatvault_successor(bk_flatvault_t V, dict_obj obj)
+{
+  int pos;
+
+  if (!V || !obj || (pos = fv_slotof(V, obj)) < 0 || (pos = fv_scan(V, pos + 1, 1)) < 0)
+    return(NULL);
+
+  return(V->bfv_slots[pos].fs_node);
+}
+
+
+
+/**
+ * Return the node before a node in a flat vault (in table order).
+ *
+ *	@param V Flat vault
+ *	@param obj Node in the vault
+ *	@return <i>NULL</i> if there is none or obj is not in the vault
+ *	@return <br><i>node</i> otherwise
+ */
+dict_obj bk_flatvault_predecessor(bk_flatvault_t V, dict_obj obj)
+{
+  int pos;
+
+  if (!V || !obj || (pos = fv_slotof(V, obj)) < 0 || (pos = fv_scan(V, pos - 1, -1)) < 0)
+    return(NULL);
+
+  return(V->bfv_slots[pos].fs_node);
+}
+
+
+
+/**
+ * Start iterating over a flat vault.
+ *
+ *	@param V Flat vault
+ *	@param dir DICT_FROM_START or DICT_FROM_END
+ *	@return <i>NULL</i> on allocation failure
+ *	@return <br><i>iterator</i> to pass to bk_flatvault_nextobj() and bk_flatvault_iterate_done()
+ */
+dict_iter bk_flatvault_iterate(bk_flatvault_t V, enum dict_direction dir)
+{
+  struct fv_iter *iter = NULL;
+
+  if (!V)
+    return(NULL);
+
+  if (!BK_MALLOC(iter))
+  {
+    fv_error(V, DICT_ENOMEM, "Out of memory");
+    return(NULL);
+  }
+
+  iter->fi_dir = dir;
+  iter->fi_pos = (dir == DICT_FROM_END) ? (int)V->bfv_nslots - 1 : 0;
+
+  return(iter);
+}
+
+
+
+/**
+ * Return the next node of an iteration.
+ *
+ *	@param V Flat vault
+ *	@param it Iterator from bk_flatvault_iterate()
+ *	@return <i>NULL</i> when done
+ *	@return <br><i>node</i> otherwise
+ */
+dict_obj bk_flatvault_nextobj(bk_flatvault_t V, dict_iter it)
+{
+  struct fv_iter *iter = it;
+  int dir, pos;
+
+  if (!V || !iter)
+    return(NULL);
+
+  dir = (iter->fi_dir == DICT_FROM_END) ? -1 : 1;
+
+  if ((pos = fv_scan(V, iter->fi_pos, dir)) < 0)
+  {
+    iter->fi_pos = (dir < 0) ? -1 : (int)V->bfv_nslots;
+    return(NULL);
+  }
+
+  iter->fi_pos = pos + dir;
+  return(V->bfv_slots[pos].fs_node);
+}
+
+
+
+/**
+ * Finish an iteration.
+ *
+ *	@param V Flat vault
+ *	@param it Iterator from bk_flatvault_iterate()
+ */
+void bk_flatvault_iterate_done(bk_flatvault_t V, dict_iter it)
+{
+  if (it)
+    free(it);
+}
+
+
+
+/**
+ * Describe the last error on a flat vault.
+ *
+ *	@param V Flat vault, or NULL for the last creation failure
+ *	@param errnop Optional copy-out of the DICT_E* error code
+ *	@return <i>reason</i> string
+ */
+char *bk_flatvault_error_reason(bk_flatvault_t V, int *errnop)
+{
+  if (!V)
+  {
+    if (errnop)
+      *errnop = DICT_ENOMEM;
+    return((char *)fv_create_reason);
+  }
+
+  if (errnop)
+    *errnop = V->bfv_errno;
+  return((char *)V->bfv_reason);
+}
+
+
+
+/**
+ * Insert a pointer into the flat vault indexed by string.  The "string"
+ * is donated to the vault and will only be returned if you use the
+ * non-helper routines.
+ *
+ *	@param V Flat vault
+ *	@param string Donated string/key
+ *	@param ptr Pointer to value
+ *	@return <i>0</i> on success
+ *	@return <i>-1</i> on failure
+ */
+int bk_flatvault_inserthelp(bk_flatvault_t V, const char *string, void *ptr)
+{
+  struct bk_vault_node *node = NULL;
+
+  if (!V || !string)
+    return(-1);
+
+  if (!(node = malloc(sizeof(*node))))
+    return(-1);
+
+  node->key = string;
+  node->value = ptr;
+
+  if (bk_flatvault_insert(V, node) != DICT_OK)
+  {
+    free(node);
+    return(-1);
+  }
+  return(0);
+}
+
+
+
+/**
+ * Search for a key, returning the value
+ *
+ *	@param V Flat vault
+ *	@param string String/key
+ *	@return <i>value</i> on success
+ *	@return <i>NULL</i> on failure
+ */
+void *bk_flatvault_searchhelp(bk_flatvault_t V, const char *string)
+{
+  struct bk_vault_node *node = NULL;
+
+  if (!V || !string)
+    return(NULL);
+
+  if (!(node = bk_flatvault_search(V, (dict_key)string)))
+    return(NULL);
+
+  return(node->value);
+}
+
+
+
+/**
+ * Delete the vault node for a key
+ *
+ *	@param V Flat vault
+ *	@param string Key
+ *	@return <i>DICT_OK</i> on success
+ *	@return <i>DICT_ERR</i> on failure
+ */
+int bk_flatvault_deletehelp(bk_flatvault_t V, const char *string)
+{
+  struct bk_vault_node *node = NULL;
+
+  if (!V || !string)
+    return(DICT_ERR);
+
+  if (!(node = bk_flatvault_search(V, (dict_key)string)))
+    return(DICT_ERR);
+
+  return(bk_flatvault_delete(V, node));
+}
+
+
+
+/**
+ * Destroy the vault, freeing every key, value, and node.
+ *
+ *	@param V Flat vault
+ *	@return <i>DICT_OK</i> on success
+ *	@return <i>DICT_ERR</i> on failure
+ */
+int bk_flatvault_destroyhelp(bk_flatvault_t V)
+{
+  struct bk_vault_node *node;
+  u_int32_t pos;
+
+  if (!V)
+    return(DICT_ERR);
+
+  // Walk the table directly; repeated minimum/delete would be quadratic
+  for (pos = 0; pos < V->bfv_nslots; pos++)
+  {
+    if (!FV_FULL(V->bfv_ctrl[pos]))
+      continue;
+    node = V->bfv_slots[pos].fs_node;
+    free((void *)node->key);
+    free(node->value);
+    free(node);
+  }
+
+  bk_flatvault_destroy(V);
+  return(DICT_OK);
+}
+
+
+
 /**
  * CLC functions for vault
  */
@@ -456,3 +1042,259 @@ static ht_val vault_key_hash(void *a)
   return(bk_strhash(a, 0));
 }
 // @}
+
+
+
+
+/**
+ * Bitmask of the control bytes of a group equal to a value.
+ *
+ *	@param ctrl First control byte of the (aligned) group
+ *	@param val Control byte to look for
+ *	@return <i>bitmask</i> with bit i set if ctrl[i] == val
+ */
+static inline u_int fv_match(const u_int8_t *ctrl, u_int8_t val)
+{
+#if defined(__SSE2__)
+  return(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)ctrl), _mm_set1_epi8((char)val))));
+#else
+  u_int mask = 0;
+  int i;
+
+  for (i = 0; i < FV_GROUP; i++)
+    mask |= (u_int)(ctrl[i] == val) << i;
+  return(mask);
+#endif /* __SSE2__ */
+}
+
+
+
+/**
+ * Bitmask of the empty or deleted control bytes of a group, which are
+ * the ones with the high bit set.
+ *
+ *	@param ctrl First control byte of the (aligned) group
+ *	@return <i>bitmask</i> with bit i set if slot i is not full
+ */
+static inline u_int fv_match_free(const u_int8_t *ctrl)
+{
+#if defined(__SSE2__)
+  return(_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl)));
+#else
+  u_int mask = 0;
+  int i;
+
+  for (i = 0; i < FV_GROUP; i++)
+    mask |= (u_int)(ctrl[i] >> 7) << i;
+  return(mask);
+#endif /* __SSE2__ */
+}
+
+
+
+/**
+ * Allocate an empty table for a flat vault.  The old table, if any, is
+ * not freed.
+ *
+ *	@param fv Flat vault
+ *	@param nslots Number of slots (power of two, at least FV_GROUP)
+ *	@return <i>0</i> on success
+ *	@return <i>-1</i> on allocation failure (vault unchanged)
+ */
+static int fv_alloc(struct bk_flatvault *fv, u_int32_t nslots)
+{
+  u_int8_t *ctrl = NULL;
+  struct fv_slot *slots = NULL;
+
+  if (posix_memalign((void **)&ctrl, FV_GROUP, nslots))
+    return(-1);
+
+  if (!(slots = malloc(nslots * sizeof(*slots))))
+  {
+    free(ctrl);
+    return(-1);
+  }
+
+  memset(ctrl, FV_EMPTY, nslots);
+  fv->bfv_ctrl = ctrl;
+  fv->bfv_slots = slots;
+  fv->bfv_nslots = nslots;
+  fv->bfv_count = 0;
+  fv->bfv_used = 0;
+  return(0);
+}
+
+
+
+/**
+ * Move every node of a flat vault to a new table, dropping tombstones.
+ * The stored hashes are reused so no key is looked at.
+ *
+ *	@param fv Flat vault
+ *	@param nslots Number of slots in new table
+ *	@return <i>0</i> on success
+ *	@return <i>-1</i> on allocation failure (vault unchanged)
+ */
+static int fv_rehash(struct bk_flatvault *fv, u_int32_t nslots)
+{
+  u_int8_t *octrl = fv->bfv_ctrl;
+  struct fv_slot *oslots = fv->bfv_slots;
+  u_int32_t onslots = fv->bfv_nslots, ocount = fv->bfv_count, ous = fv->bfv_used;
+  u_int32_t i;
+  int pos;
+
+  if (fv_alloc(fv, nslots) < 0)
+  {
+    fv->bfv_ctrl = octrl;
+    fv->bfv_slots = oslots;
+    fv->bfv_nslots = onslots;
+    fv->bfv_count = ocount;
+    fv->bfv_used = ous;
+    return(-1);
+  }
+
+  for (i = 0; i < onslots; i++)
+  {
+    if (!FV_FULL(octrl[i]))
+      continue;
+    pos = fv_place(fv, oslots[i].fs_hash);
+    fv->bfv_ctrl[pos] = octrl[i];
+    fv->bfv_slots[pos] = oslots[i];
+  }
+  fv->bfv_count = fv->bfv_used = ocount;
+
+  free(octrl);
+  free(oslots);
+  return(0);
+}
+
+
+
+/**
+ * Find the slot holding a key.  Groups are probed in triangular order,
+ * which visits every group of a power of two table.
+ *
+ *	@param fv Flat vault
+ *	@param key Key to find
+ *	@param hash FV_HASH of key
+ *	@return <i>slot number</i> on success
+ *	@return <i>-1</i> if not found
+ */
+static int fv_find(struct bk_flatvault *fv, const char *key, u_int32_t hash)
+{
+  u_int32_t gmask = fv->bfv_nslots / FV_GROUP - 1;
+  u_int32_t group = FV_H1(hash) & gmask;
+  u_int32_t step;
+  struct fv_slot *slot;
+  const u_int8_t *ctrl;
+  u_int match;
+  int pos;
+
+  for (step = 1; step <= gmask + 1; step++)
+  {
+    ctrl = fv->bfv_ctrl + group * FV_GROUP;
+    match = fv_match(ctrl, FV_H2(hash));
+    while (match)
+    {
+      pos = group * FV_GROUP + __builtin_ctz(match);
+      slot = fv->bfv_slots + pos;
+      if (slot->fs_hash == hash && (slot->fs_node->key == key || !strcmp(slot->fs_node->key, key)))
+	return(pos);
+      match &= match - 1;
+    }
+
+    // A group with an empty slot ends every probe sequence through it
+    if (fv_match(ctrl, FV_EMPTY))
+      return(-1);
+
+    group = (group + step) & gmask;
+  }
+
+  return(-1);
+}
+
+
+
+/**
+ * Find the slot a new key with this hash should go in: the first empty
+ * or deleted slot on its probe sequence.  There must be one, which the
+ * load factor guarantees.
+ *
+ *	@param fv Flat vault
+ *	@param hash FV_HASH of key
+ *	@return <i>slot number</i>
+ */
+static int fv_place(struct bk_flatvault *fv, u_int32_t hash)
+{
+  u_int32_t gmask = fv->bfv_nslots / FV_GROUP - 1;
+  u_int32_t group = FV_H1(hash) & gmask;
+  u_int32_t step;
+  u_int match;
+
+  for (step = 1; !(match = fv_match_free(fv->bfv_ctrl + group * FV_GROUP)); step++)
+    group = (group + step) & gmask;
+
+  return(group * FV_GROUP + __builtin_ctz(match));
+}
+
+
+
+/**
+ * Find the slot holding a particular node.
+ *
+ *	@param fv Flat vault
+ *	@param node Node to find
+ *	@return <i>slot number</i> on success
+ *	@return <i>-1</i> if that node is not in the vault
+ */
+static int fv_slotof(struct bk_flatvault *fv, struct bk_vault_node *node)
+{
+  int pos;
+
+  if (!node->key || (pos = fv_find(fv, node->key, FV_HASH(node->key))) < 0 || fv->bfv_slots[pos].fs_node != node)
+    return(-1);
+
+  return(pos);
+}
+
+
+
+/**
+ * Find the next full slot starting at a slot.
+ *
+ *	@param fv Flat vault
+ *	@param pos First slot to examine
+ *	@param dir <i>1</i> to scan forward, <i>-1</i> to scan backward
+ *	@return <i>slot number</i> on success
+ *	@return <i>-1</i> if there are no more full slots
+ */
+static int fv_scan(struct bk_flatvault *fv, int pos, int dir)
+{
+  for (; pos >= 0 && pos < (int)fv->bfv_nslots; pos += dir)
+  {
+    if (FV_FULL(fv->bfv_ctrl[pos]))
+      return(pos);
+  }
+
+  return(-1);
+}
+
+
+
+/**
+ * Record an error on a flat vault.
+ *
+ *	@param fv Flat vault (may be NULL)
+ *	@param err DICT_E* error code
+ *	@param reason Static description
+ *	@return <i>DICT_ERR</i> always
+ */
+static int fv_error(struct bk_flatvault *fv, int err, const char *reason)
+{
+  if (fv)
+  {
+    fv->bfv_errno = err;
+    fv->bfv_reason = reason;
+  }
+  return(DICT_ERR);
+}
@@ -52,16 +52,23 @@ struct program_config
   const char *		pc_bloomfile;		///< The bloom filter file
   int32_t		pc_hashen;		///< Number of hash filters
   int64_t		pc_bloomsize;		///< Size of bloom filter
+  int32_t		pc_benchkeys;		///< Number of keys for benchmark
+  int			pc_threads;		///< Threads for bulk load (0 for one per CPU)
+  const char *		pc_unionfile;		///< Bloom filter to merge in
   bk_flags		pc_flags;		///< Flags are fun!
 #define PC_VERBOSE	0x001			///< Verbose output
 #define PC_BINARY	0x002			///< Input is binary on stdin, not a string on command line
 #define PC_ADD		0x004			///< Add hashen, not check
+#define PC_BLOCKED	0x008			///< Use cache-blocked layout
+#define PC_LINES	0x010			///< Input on stdin is one key per line
 };
 
 
 
 static int proginit(bk_s B, struct program_config *pc, int argc, char **argv);
 static void progrun(bk_s B, struct program_config *pc, int argc, char **argv);
+static void progbench(bk_s B, struct program_config *pc);
+static void proglines(bk_s B, struct program_config *pc, char *buf, u_int len);
 
 
 
@@ -98,6 +105,11 @@ main(int argc, char **argv, char **envp)
     {"add", 'a', POPT_ARG_NONE, NULL, 'a', N_("Add object to bloom filter"), NULL },
     {"numhash", 'h', POPT_ARG_STRING, NULL, 'h', N_("Number of hashes used in bloom filter"), N_("number") },
     {"size", 'm', POPT_ARG_STRING, NULL, 'm', N_("Size of bloom filter, in bits"), N_("bitsize") },
+    {"blocked", 'B', POPT_ARG_NONE, NULL, 'B', N_("Use cache-blocked bloom filter layout"), NULL },
+    {"lines", 'l', POPT_ARG_NONE, NULL, 'l', N_("Input on stdin is one key per line"), NULL },
+    {"threads", 't', POPT_ARG_INT, NULL, 't', N_("Threads for bulk load of lines (default one per CPU)"), N_("count") },
+    {"union", 'u', POPT_ARG_STRING, NULL, 'u', N_("Merge this bloom filter (same size and hashes) into the bloom file"), N_("file") },
+    {"benchmark", 0, POPT_ARG_STRING, NULL, 0x1003, N_("Measure throughput of both layouts with this many keys"), N_("keys") },
     POPT_AUTOHELP
     POPT_TABLEEND
   };
@@ -201,6 +213,22 @@ main(int argc, char **argv, char **envp)
     case 'a':					// add
       BK_FLAG_SET(pc->pc_flags, PC_ADD);
       break;
+    case 'B':					// blocked
+      BK_FLAG_SET(pc->pc_flags, PC_BLOCKED);
+      break;
+    case 'l':					// lines
+      BK_FLAG_SET(pc->pc_flags, PC_LINES);
+      break;
+    case 't':					// threads
+      pc->pc_threads = atoi(poptGetOptArg(optCon));
+      break;
+    case 'u':					// union
+      pc->pc_unionfile = poptGetOptArg(optCon);
+      BK_FLAG_SET(pc->pc_flags, PC_ADD);
+      break;
+    case 0x1003:				// benchmark
+      pc->pc_benchkeys = atoi(poptGetOptArg(optCon));
+      break;
     }
   }
 
@@ -215,6 +243,18 @@ main(int argc, char **argv, char **envp)
     for (; argv[argc]; argc++)
       ; // Void
 
+  if (pc->pc_benchkeys > 0 && !getopterr && c >= -1)
+  {
+    // Sensible defaults for ~1% false positives
+    if (pc->pc_hashen < 1)
+      pc->pc_hashen = 7;
+    if (pc->pc_bloomsize < 1)
+      pc->pc_bloomsize = (int64_t)pc->pc_benchkeys * 10;
+    progbench(B, pc);
+    poptFreeContext(optCon);
+    bk_exit(B, 0);
+  }
+
   if (c < -1 || getopterr || !pc->pc_bloomfile || pc->pc_hashen < 1 || pc->pc_bloomsize < 1 || argc > 1)
   {
     if (c < -1)
@@ -259,7 +299,7 @@ static int proginit(bk_s B, struct program_config *pc, int argc, char **argv)
     BK_RETURN(B, -1);
   }
 
-  if (!(pc->pc_bloom = bk_bloomfilter_create(B, pc->pc_hashen, pc->pc_bloomsize, pc->pc_bloomfile, BK_BLOOMFILTER_CREATABLE|(BK_FLAG_ISSET(pc->pc_flags, PC_ADD)?BK_BLOOMFILTER_WRITABLE:0))))
+  if (!(pc->pc_bloom = bk_bloomfilter_create(B, pc->pc_hashen, pc->pc_bloomsize, pc->pc_bloomfile, BK_BLOOMFILTER_CREATABLE|(BK_FLAG_ISSET(pc->pc_flags, PC_ADD)?BK_BLOOMFILTER_WRITABLE:0)|(BK_FLAG_ISSET(pc->pc_flags, PC_BLOCKED)?BK_BLOOMFILTER_BLOCKED:0))))
     bk_die(B, 254, stderr, _("Could not open bloom filter\n"), 1);
 
   BK_RETURN(B, 0);
@@ -288,6 +328,18 @@ static void progrun(bk_s B, struct program_config *pc, int argc, char **argv)
     BK_VRETURN(B);
   }
 
+  if (pc->pc_unionfile)
+  {
+    struct bk_bloomfilter *other;
+
+    if (!(other = bk_bloomfilter_create(B, pc->pc_hashen, pc->pc_bloomsize, pc->pc_unionfile, BK_FLAG_ISSET(pc->pc_flags, PC_BLOCKED)?BK_BLOOMFILTER_BLOCKED:0)))
+      bk_die(B, 254, stderr, _("Could not open bloom filter to merge\n"), 1);
+    if (bk_bloomfilter_union(B, pc->pc_bloom, other) < 0)
+      bk_die(B, 254, stderr, _("Could not merge bloom filters\n"), 1);
+    bk_bloomfilter_destroy(B, other);
+    BK_VRETURN(B);
+  }
+
   if (argc)
   {
     buf = argv[0];
@@ -314,7 +366,11 @@ static void progrun(bk_s B, struct program_config *pc, int argc, char **argv)
     }
   }
 
-  if (BK_FLAG_ISSET(pc->pc_flags, PC_ADD))
+  if (BK_FLAG_ISSET(pc->pc_flags, PC_LINES))
+  {
+    proglines(B, pc, buf, len);
+  }
+  else if (BK_FLAG_ISSET(pc->pc_flags, PC_ADD))
   {
     if (bk_bloomfilter_add(B, pc->pc_bloom, buf, len) < 0)
       bk_die(B, 254, stderr, _("Could not add key\n"), 1);
@@ -352,3 +408,184 @@ static void progrun(bk_s B, struct program_config *pc, int argc, char **argv)
 
   BK_VRETURN(B);
 }
+
+
+
+/**
+ * Add or check many newline separated keys at once.  Adding uses the
+ * threaded bulk loader; checking prints the keys which are present.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ *	@param buf Input keys (modified)
+ *	@param len Length of input
+ */
+static void proglines(bk_s B, struct program_config *pc, char *buf, u_int len)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  const void **keys = NULL;
+  int *lens = NULL;
+  u_char *results = NULL;
+  int64_t n = 0, max = 0, i;
+  char *cur, *end, *nl;
+  int present;
+
+  for (cur = buf, end = buf + len; cur < end; cur++)
+    if (*cur == '\n')
+      max++;
+  max++;
+
+  if (!BK_MALLOC_LEN(keys, sizeof(*keys) * max) || !BK_MALLOC_LEN(lens, sizeof(*lens) * max))
+    bk_die(B, 254, stderr, _("Could not allocate key list\n"), 1);
+
+  for (cur = buf; cur < end; cur = nl + 1)
+  {
+    if (!(nl = memchr(cur, '\n', end - cur)))
+      nl = end;
+    if (nl > cur)
+    {
+      keys[n] = cur;
+      lens[n++] = nl - cur;
+    }
+  }
+
+  if (BK_FLAG_ISSET(pc->pc_flags, PC_ADD))
+  {
+    if (bk_bloomfilter_add_bulk(B, pc->pc_bloom, keys, lens, n, pc->pc_threads, 0) < 0)
+      bk_die(B, 254, stderr, _("Could not add keys\n"), 1);
+    if (BK_FLAG_ISSET(pc->pc_flags, PC_VERBOSE))
+      printf("Added %lld keys, %lld bits set\n", (long long)n, (long long)bk_bloomfilter_popcount(B, pc->pc_bloom));
+  }
+  else
+  {
+    if (!BK_MALLOC_LEN(results, n + 1))
+      bk_die(B, 254, stderr, _("Could not allocate results\n"), 1);
+
+    for (i = 0; i < n; i += INT_MAX)
+      if ((present = bk_bloomfilter_is_present_batch(B, pc->pc_bloom, keys + i, lens + i, MIN(n - i, INT_MAX), results + i)) < 0)
+	bk_die(B, 254, stderr, _("Could not lookup keys\n"), 1);
+
+    for (i = 0; i < n; i++)
+      if (results[i])
+	printf("%.*s\n", lens[i], (const char *)keys[i]);
+
+    free(results);
+  }
+
+  free(lens);
+  free(keys);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Report the rate of one benchmark phase
+ *
+ *	@param what Phase name
+ *	@param start When the phase started
+ *	@param keys Number of keys processed
+ */
+static void benchreport(const char *what, struct timeval *start, int32_t keys)
+{
+  struct timeval end, delta;
+  double secs;
+
+  gettimeofday(&end, NULL);
+  BK_TV_SUB(&delta, &end, start);
+  secs = BK_TV2F(&delta);
+  printf("  %-24s %8.3f s  %10.2f Mkeys/s\n", what, secs, secs > 0 ? keys / secs / 1000000.0 : 0.0);
+  gettimeofday(start, NULL);
+}
+
+
+
+/**
+ * Measure insert and lookup throughput of the classic and cache-blocked
+ * layouts, one key at a time and in prefetching batches.  If a bloom file
+ * was named the filters are mmapped from it (it is recreated for each
+ * layout), which is how multi-GB filters are normally used.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct bk_bloomfilter *bf, *bulk;
+  const void **keys = NULL;
+  int *lens = NULL;
+  char *keybuf = NULL;
+  u_char *results = NULL;
+  struct timeval start;
+  int32_t n = pc->pc_benchkeys;
+  int32_t i, hits;
+  int layout;
+#define KEYLEN 16
+
+  if (!BK_MALLOC_LEN(keys, sizeof(*keys) * n * 2) || !BK_MALLOC_LEN(lens, sizeof(*lens) * n * 2) ||
+      !BK_MALLOC_LEN(keybuf, (size_t)KEYLEN * n * 2) || !BK_MALLOC_LEN(results, n * 2))
+    bk_die(B, 254, stderr, _("Could not allocate benchmark keys\n"), 1);
+
+  // First n keys are inserted, second n are used to measure false positives
+  for (i = 0; i < n * 2; i++)
+  {
+    snprintf(keybuf + (size_t)i * KEYLEN, KEYLEN, "key%012d", i);
+    keys[i] = keybuf + (size_t)i * KEYLEN;
+    lens[i] = KEYLEN - 1;
+  }
+
+  for (layout = 0; layout < 2; layout++)
+  {
+    if (pc->pc_bloomfile)
+      unlink(pc->pc_bloomfile);
+
+    if (!(bf = bk_bloomfilter_create(B, pc->pc_hashen, pc->pc_bloomsize, pc->pc_bloomfile, BK_BLOOMFILTER_CREATABLE|(layout?BK_BLOOMFILTER_BLOCKED:0))))
+      bk_die(B, 254, stderr, _("Could not create bloom filter\n"), 1);
+
+    printf("%s layout, %d keys, %lld bits, %d hashes\n", layout?"Blocked":"Classic", n, (long long)pc->pc_bloomsize, pc->pc_hashen);
+    gettimeofday(&start, NULL);
+
+    if (bk_bloomfilter_add_batch(B, bf, keys, lens, n) < 0)
+      bk_die(B, 254, stderr, _("Could not add keys\n"), 1);
+    benchreport("batch add", &start, n);
+
+    // Bulk load into a fresh in-memory filter; it must match bit for bit
+    if (!(bulk = bk_bloomfilter_create(B, pc->pc_hashen, pc->pc_bloomsize, NULL, BK_BLOOMFILTER_WRITABLE|(layout?BK_BLOOMFILTER_BLOCKED:0))))
+      bk_die(B, 254, stderr, _("Could not create bloom filter\n"), 1);
+    gettimeofday(&start, NULL);
+    if (bk_bloomfilter_add_bulk(B, bulk, keys, lens, n, pc->pc_threads, 0) < 0)
+      bk_die(B, 254, stderr, _("Could not bulk add keys\n"), 1);
+    benchreport("bulk add (threaded)", &start, n);
+    if (bk_bloomfilter_popcount(B, bulk) != bk_bloomfilter_popcount(B, bf) ||
+	bk_bloomfilter_intersect(B, bulk, bf) < 0 || bk_bloomfilter_popcount(B, bulk) != bk_bloomfilter_popcount(B, bf))
+      printf("  ERROR: bulk load does not match batch add\n");
+    bk_bloomfilter_destroy(B, bulk);
+    gettimeofday(&start, NULL);
+
+    for (i = 0, hits = 0; i < n; i++)
+      hits += bk_bloomfilter_is_present(B, bf, keys[i], lens[i]);
+    benchreport("lookup (single)", &start, n);
+    if (hits != n)
+      printf("  ERROR: only %d of %d inserted keys found\n", hits, n);
+
+    if ((hits = bk_bloomfilter_is_present_batch(B, bf, keys, lens, n, results)) != n)
+      printf("  ERROR: only %d of %d inserted keys found in batch\n", hits, n);
+    benchreport("lookup (batch)", &start, n);
+
+    hits = bk_bloomfilter_is_present_batch(B, bf, keys + n, lens + n, n, results + n);
+    benchreport("absent lookup (batch)", &start, n);
+    printf("  %-24s %8.4f%%\n", "false positive rate", n ? 100.0 * hits / n : 0.0);
+
+    bk_bloomfilter_destroy(B, bf);
+  }
+
+  free(results);
+  free(keybuf);
+  free(lens);
+  free(keys);
+
+  BK_VRETURN(B);
+#undef KEYLEN
+}
@@ -96,6 +96,7 @@ struct program_config
 static int proginit(bk_s B, struct program_config *pc, char **argv, int argc);
 static void progrun(bk_s B, struct program_config *pc);
 static int replace_ip(bk_s B, struct in_addr *addr, struct program_config *pc, bk_flags flags);
+static void update_cksums(bk_s B, struct baka_iphdr *pkt_ip, size_t caplen, u_int32_t old_src, u_int32_t old_dst);
 
 
 
@@ -388,14 +389,18 @@ static void progrun(bk_s B, struct program_config *pc)
   {
     struct baka_etherhdr *pkt_eth = (struct baka_etherhdr *)pkt_data;
     struct baka_iphdr *pkt_ip;
+    u_int32_t old_src, old_dst;
 
-    if (pkt_header.len < sizeof(*pkt_eth) + (sizeof(*pkt_ip)))
+    // Everything past the captured bytes is garbage, whatever the wire length
+    if (pkt_header.caplen < sizeof(*pkt_eth) + (sizeof(*pkt_ip)))
       continue;
 
     if (pkt_eth->pkt_eth_ltype != ip_ltype)
       continue;
 
     pkt_ip = (struct baka_iphdr *)(pkt_data+sizeof(*pkt_eth));
+    old_src = pkt_ip->pkt_ip_src;
+    old_dst = pkt_ip->pkt_ip_dst;
 
     if (replace_ip(B, (struct in_addr *)&pkt_ip->pkt_ip_src, pc, 0) < 0)
     {
@@ -409,6 +414,9 @@ static void progrun(bk_s B, struct program_config *pc)
       goto error;
     }
 
+    if (pkt_ip->pkt_ip_src != old_src || pkt_ip->pkt_ip_dst != old_dst)
+      update_cksums(B, pkt_ip, pkt_header.caplen - sizeof(*pkt_eth), old_src, old_dst);
+
     pcap_dump((u_char *)out_pcap, &pkt_header, pkt_data);
   }
 
@@ -458,3 +466,60 @@ replace_ip(bk_s B, struct in_addr *addr, struct program_config *pc, bk_flags fla
   }
   BK_RETURN(B, 0);
 }
+
+
+
+/**
+ * Fix up the checksums covering the addresses of a rewritten packet:
+ * the IP header's, and the TCP or UDP one (whose pseudo-header includes
+ * them).  Only the change is applied, so the payload is never read.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param pkt_ip IP header, with new addresses
+ *	@param caplen Bytes captured from IP header on
+ *	@param old_src Source address before rewrite
+ *	@param old_dst Destination address before rewrite
+ */
+static void
+update_cksums(bk_s B, struct baka_iphdr *pkt_ip, size_t caplen, u_int32_t old_src, u_int32_t old_dst)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"iprewrite");
+  size_t hlen = pkt_ip->pkt_ip_hdr_len * 4;
+  u_int16_t *l4sum;
+
+  pkt_ip->pkt_ip_checksum = bk_in_cksum_update32(pkt_ip->pkt_ip_checksum, old_src, pkt_ip->pkt_ip_src);
+  pkt_ip->pkt_ip_checksum = bk_in_cksum_update32(pkt_ip->pkt_ip_checksum, old_dst, pkt_ip->pkt_ip_dst);
+
+  // Only the first fragment has the transport header
+  if (ntohs(pkt_ip->pkt_ip_frag_offset) & BAKA_IPHDR_OFFMASK)
+    BK_VRETURN(B);
+
+  switch (pkt_ip->pkt_ip_proto)
+  {
+  case IPPROTO_TCP:
+    if (caplen < hlen + sizeof(struct baka_tcphdr))
+      BK_VRETURN(B);
+    l4sum = &((struct baka_tcphdr *)((char *)pkt_ip + hlen))->pkt_tcp_checksum;
+    break;
+
+  case IPPROTO_UDP:
+    if (caplen < hlen + sizeof(struct baka_udphdr))
+      BK_VRETURN(B);
+    l4sum = &((struct baka_udphdr *)((char *)pkt_ip + hlen))->pkt_udp_checksum;
+    // Zero means the sender did not compute one
+    if (!*l4sum)
+      BK_VRETURN(B);
+    break;
+
+  default:
+    BK_VRETURN(B);
+  }
+
+  *l4sum = bk_in_cksum_update32(*l4sum, old_src, pkt_ip->pkt_ip_src);
+  *l4sum = bk_in_cksum_update32(*l4sum, old_dst, pkt_ip->pkt_ip_dst);
+
+  if (!*l4sum && pkt_ip->pkt_ip_proto == IPPROTO_UDP)
+    *l4sum = 0xffff;
+
+  BK_VRETURN(B);
+}
@@ -57,6 +57,8 @@ struct program_config
 
 static void progrun(bk_s B, struct program_config *pc);
 static void test_present(bk_s B, struct bk_bloomfilter *bf, const char *key, int expectation);
+static int test_counting(bk_s B);
+static int test_scalable(bk_s B, const char *filename);
 
 
 
@@ -238,6 +240,9 @@ static void progrun(bk_s B, struct program_config *pc)
   test_present(B, bf, paypal, 1);
   test_present(B, bf, google, 0);
 
+  if (test_counting(B) < 0 || test_scalable(B, NULL) < 0 || test_scalable(B, "/tmp/bloom.scalable") < 0)
+    exit(1);
+
   printf("All tests passed\n");
 
   bk_bloomfilter_destroy(B, bf);
@@ -257,3 +262,141 @@ static void test_present(bk_s B, struct bk_bloomfilter *bf, const char *key, int
     bk_error_printf(B, BK_ERR_ERR, "bk_bloomfilter_is_present test failed for \"%s\". Expected %d, got %d.\n", key, expectation, ret);
   }
 }
+
+
+
+
+/**
+ * Add keys to a counting filter, remove half of them, and make sure the
+ * other half are all still there.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@return <i>0</i> Success
+ *	@return <br><i>-1</i> Test failure
+ */
+static int test_counting(bk_s B)
+{
+  struct bk_countingbloom *cb;
+  char key[32];
+  int i, present = 0;
+
+  if (!(cb = bk_countingbloom_create(B, 7, 100000, NULL, BK_BLOOMFILTER_WRITABLE)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "countingbloom init failed\n");
+    return(-1);
+  }
+
+  for (i = 0; i < 10000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    bk_countingbloom_add(B, cb, key, strlen(key));
+  }
+
+  for (i = 0; i < 5000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    if (bk_countingbloom_remove(B, cb, key, strlen(key)) != 1)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "bk_countingbloom_remove failed for \"%s\"\n", key);
+      goto error;
+    }
+    present += bk_countingbloom_is_present(B, cb, key, strlen(key));
+  }
+
+  for (; i < 10000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    if (bk_countingbloom_is_present(B, cb, key, strlen(key)) != 1)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "bk_countingbloom_is_present false negative for \"%s\"\n", key);
+      goto error;
+    }
+  }
+
+  // Removed keys may still be false positives, but not many of them
+  if (present > 250)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "%d of 5000 removed keys still present\n", present);
+    goto error;
+  }
+
+  bk_countingbloom_destroy(B, cb);
+  return(0);
+
+ error:
+  bk_countingbloom_destroy(B, cb);
+  return(-1);
+}
+
+
+
+/**
+ * Overfill a scalable filter so it must grow, then check there are no
+ * false negatives and the false positive rate is held.  With a filename
+ * the filter is closed and reopened read-only first.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param filename File to keep the filter in, or NULL
+ *	@return <i>0</i> Success
+ *	@return <br><i>-1</i> Test failure
+ */
+static int test_scalable(bk_s B, const char *filename)
+{
+  struct bk_scalablebloom *sb;
+  char key[32];
+  int i, fp = 0;
+
+  if (filename)
+    unlink(filename);
+
+  if (!(sb = bk_scalablebloom_create(B, 1000, 0.01, filename, BK_BLOOMFILTER_CREATABLE)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "scalablebloom init failed\n");
+    return(-1);
+  }
+
+  for (i = 0; i < 50000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    bk_scalablebloom_add(B, sb, key, strlen(key));
+  }
+
+  if (filename)
+  {
+    bk_scalablebloom_destroy(B, sb);
+    if (!(sb = bk_scalablebloom_create(B, 1, 0.5, filename, 0)))
+    {
+      bk_error_printf(B, BK_ERR_ERR, "scalablebloom reopen failed\n");
+      return(-1);
+    }
+  }
+
+  for (i = 0; i < 50000; i++)
+  {
+    snprintf(key, sizeof(key), "key%d", i);
+    if (bk_scalablebloom_is_present(B, sb, key, strlen(key)) != 1)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "bk_scalablebloom_is_present false negative for \"%s\"\n", key);
+      goto error;
+    }
+  }
+
+  for (i = 0; i < 50000; i++)
+  {
+    snprintf(key, sizeof(key), "absent%d", i);
+    fp += bk_scalablebloom_is_present(B, sb, key, strlen(key));
+  }
+
+  if (fp > 500)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Scalable bloom filter false positive rate %d/50000 exceeds target\n", fp);
+    goto error;
+  }
+
+  bk_scalablebloom_destroy(B, sb);
+  return(0);
+
+ error:
+  bk_scalablebloom_destroy(B, sb);
+  return(-1);
+}
@@ -0,0 +1,420 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Check bk_in_cksum and the incremental checksum update against a
+ * simple RFC 1071 sum, and optionally benchmark them.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_BUFSIZE	      70000		///< Random data for functional test
+#define TEST_ROUNDS	      5000		///< Random buffers checked
+#define BENCH_MAXBUF	      (64*1024)		///< Largest buffer size benchmarked
+#define BENCH_PACKET	      1500		///< Packet size for update benchmark
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_benchmb;		///< Megabytes to checksum per measurement
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static u_int16_t simple_cksum(const u_char *buf, size_t len);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Compare checksum speeds"), N_("megabytes") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_benchmb = atoi(poptGetOptArg(optCon));
+      if (pc->pc_benchmb < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_benchmb)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Checksum random data split into random pieces at random alignments,
+ * and make random changes to it which are applied to the checksum
+ * incrementally.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  u_char *buf, *data, field[8];
+  u_int16_t ref, cksum;
+  u_int32_t oldaddr, newaddr;
+  bk_vptr vec[5];
+  size_t len, piece, off;
+  int i, v, bad = 0;
+
+  if (!(buf = malloc(TEST_BUFSIZE + 64)))
+    bk_die(B, 1, stderr, _("Could not allocate test data\n"), BK_WARNDIE_WANTDETAILS);
+  for (i = 0; i < TEST_BUFSIZE + 64; i++)
+    buf[i] = random();
+
+  for (i = 0; i < TEST_ROUNDS; i++)
+  {
+    data = buf + random() % 64;
+    len = i < 1000 ? i : random() % TEST_BUFSIZE;
+    ref = htons(simple_cksum(data, len));
+
+    // Up to four pieces of any length, odd ones included (but not 0, which ends the list)
+    for (off = 0, v = 0; v < 4 && off < len; v++, off += piece)
+    {
+      piece = (v == 3) ? len - off : MIN(len - off, (size_t)(random() % (len / 2 + 1)) + 1);
+      vec[v].ptr = data + off;
+      vec[v].len = piece;
+    }
+    vec[v].ptr = NULL;
+    vec[v].len = 0;
+
+    if ((cksum = bk_in_cksum(B, vec, len)) != ref)
+    {
+      fprintf(stderr, "Checksum of %zu bytes in %d pieces is %04x, expected %04x\n", len, v, cksum, ref);
+      bad++;
+    }
+
+    if (len < sizeof(field) + 2)
+      continue;
+
+    // Change an address-sized field, then any other even-sized one
+    off = random() % ((len - sizeof(oldaddr)) / 2) * 2;
+    memcpy(&oldaddr, data + off, sizeof(oldaddr));
+    newaddr = random();
+    memcpy(data + off, &newaddr, sizeof(newaddr));
+    ref = htons(simple_cksum(data, len));
+    if ((cksum = bk_in_cksum_update32(cksum, oldaddr, newaddr)) != ref)
+    {
+      fprintf(stderr, "Address update of %zu bytes is %04x, expected %04x\n", len, cksum, ref);
+      bad++;
+    }
+
+    piece = (random() % (sizeof(field) / 2) + 1) * 2;
+    off = random() % ((len - piece) / 2) * 2;
+    memcpy(field, data + off, piece);
+    for (v = 0; v < (int)piece; v++)
+      data[off + v] = random();
+    ref = htons(simple_cksum(data, len));
+    if ((cksum = bk_in_cksum_update(cksum, field, data + off, piece)) != ref)
+    {
+      fprintf(stderr, "%zu byte update of %zu bytes is %04x, expected %04x\n", piece, len, cksum, ref);
+      bad++;
+    }
+  }
+
+  if (bad)
+  {
+    fprintf(stderr, "%d checksum errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+  free(buf);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Time the simple sum and bk_in_cksum on buffers from 16 bytes to
+ * 64KB, then full recomputation against an address update for a
+ * 1500 byte packet.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  size_t total = (size_t)pc->pc_benchmb * 1024 * 1024;
+  struct timeval start, end, delta;
+  size_t size, done, count;
+  u_int32_t sum = 0;
+  bk_vptr vec[2];
+  u_char *buf;
+
+  if (!(buf = malloc(BENCH_MAXBUF)))
+    bk_die(B, 1, stderr, _("Could not allocate benchmark data\n"), BK_WARNDIE_WANTDETAILS);
+  memset(buf, 0x5a, BENCH_MAXBUF);
+  vec[1].ptr = NULL;
+  vec[1].len = 0;
+
+  printf("%-16s", "GB/s");
+  for (size = 16; size <= BENCH_MAXBUF; size *= 4)
+    printf(" %8zu", size);
+  printf("\n");
+
+#define BENCHCKSUM(name, expr)								\
+  do {											\
+    printf("%-16s", name);								\
+    for (size = 16; size <= BENCH_MAXBUF; size *= 4)					\
+    {											\
+      vec[0].ptr = buf;									\
+      vec[0].len = size;								\
+      gettimeofday(&start, NULL);							\
+      for (done = 0; done < total; done += size)					\
+      {											\
+	buf[0] = done;									\
+	sum += expr;									\
+      }											\
+      gettimeofday(&end, NULL);								\
+      BK_TV_SUB(&delta, &end, &start);							\
+      printf(" %8.2f", done / BK_TV2F(&delta) / 1e9);					\
+    }											\
+    printf("\n");									\
+  } while (0)
+
+  BENCHCKSUM("simple", simple_cksum(buf, size));
+  BENCHCKSUM("bk_in_cksum", bk_in_cksum(B, vec, size));
+
+  count = total / BENCH_PACKET;
+  vec[0].len = BENCH_PACKET;
+
+  gettimeofday(&start, NULL);
+  for (done = 0; done < count; done++)
+  {
+    buf[0] = done;
+    sum += bk_in_cksum(B, vec, BENCH_PACKET);
+  }
+  gettimeofday(&end, NULL);
+  BK_TV_SUB(&delta, &end, &start);
+  printf("%-16s %8.2f Mpkt/s\n", "recompute", count / BK_TV2F(&delta) / 1e6);
+
+  gettimeofday(&start, NULL);
+  for (done = 0; done < count; done++)
+    sum = bk_in_cksum_update32(sum, done, done + 1);
+  gettimeofday(&end, NULL);
+  BK_TV_SUB(&delta, &end, &start);
+  printf("%-16s %8.2f Mpkt/s\n", "update32", count / BK_TV2F(&delta) / 1e6);
+
+  // Keep the compiler from discarding the work
+  if (sum == 0x12345678)
+    printf("\n");
+  free(buf);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * The Internet checksum straight from RFC 1071, on big-endian words.
+ *
+ *	@param buf Data
+ *	@param len Length of data
+ *	@return <i>checksum</i> in host order
+ */
+static u_int16_t simple_cksum(const u_char *buf, size_t len)
+{
+  u_int32_t sum = 0;
+  size_t i;
+
+  for (i = 0; i + 1 < len; i += 2)
+    sum += (buf[i] << 8) | buf[i + 1];
+  if (len & 1)
+    sum += buf[len - 1] << 8;
+
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return ~sum & 0xffff;
+}
@@ -34,7 +34,9 @@ struct global_structure
 
 
 int proginit(bk_s B);
-void progrun(bk_s B, const char *file);
+void progrun(bk_s B, const char *file, const char *key);
+static int reload_check(bk_s B);
+static int reload_write(bk_s B, const char *filename, const char *contents);
 
 
 
@@ -103,7 +105,12 @@ main(int argc, char **argv, char **envp)
     bk_die(B,254,stderr,"Could not perform program initialization\n",0);
   }
 
-  progrun(B, argv?argv[0]:NULL);
+  if (reload_check(B) < 0)
+  {
+    bk_die(B,1,stderr,"Configuration reload check failed\n",0);
+  }
+
+  progrun(B, argv?argv[0]:NULL, (argv && argv[0])?argv[1]:NULL);
   bk_exit(B,0);
   abort();
   BK_RETURN(B,255);				/* Insight is stupid */
@@ -126,7 +133,7 @@ int proginit(bk_s B)
 /*
  * Normal processing
  */
-void progrun(bk_s B, const char *extra)
+void progrun(bk_s B, const char *extra, const char *key)
 {
   BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
 
@@ -140,9 +147,198 @@ void progrun(bk_s B, const char *extra)
   if (extra)
   {
     struct bk_config *conf = bk_config_init(B, extra, NULL, 0);
-    if (conf)
-      bk_config_print(B, conf, stdout);
+    const char *value = NULL;
+    u_int32_t generation;
+
+    if (!conf)
+      BK_VRETURN(B);
+
+    bk_config_print(B, conf, stdout);
+
+    if (key)
+      value = bk_config_getnext(B, conf, key, NULL);
+
+    // Reload underneath a pending iteration, which must carry on regardless
+    generation = bk_config_generation(B, conf);
+    if (bk_config_reinit(B, conf) < 0)
+      fprintf(stderr, "Could not reinit %s\n", extra);
+    else if (bk_config_generation(B, conf) == generation)
+      fprintf(stderr, "Generation did not change across reinit\n");
+
+    for (; value; value = bk_config_getnext(B, conf, key, value))
+      printf("%s: %s\n", key, value);
+
+    printf("Reclaimed %d snapshots\n", bk_config_reclaim(B, conf, 0));
+    bk_config_destroy(B, conf);
   }
 
   BK_VRETURN(B);
 }
+
+
+
+/*
+ * Readers must see reloaded values, pending iterations must carry on
+ * across the reload, and values handed out before any number of reloads
+ * must stay valid until bk_config_reclaim() releases the old snapshots.
+ */
+static int reload_check(bk_s B)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  char filename[] = "/tmp/test_configXXXXXX";
+  struct bk_config *conf = NULL;
+  const char *value, *first;
+  u_int32_t generation;
+  int fd, cnt;
+
+  if ((fd = mkstemp(filename)) < 0)
+  {
+    fprintf(stderr, "Could not create temporary config: %s\n", strerror(errno));
+    BK_RETURN(B, -1);
+  }
+  close(fd);
+
+  if (reload_write(B, filename, "alpha = one\nbeta = x\nbeta = y\n") < 0)
+    goto error;
+
+  if (!(conf = bk_config_init(B, filename, NULL, 0)))
+  {
+    fprintf(stderr, "Could not load %s\n", filename);
+    goto error;
+  }
+
+  if (!(first = bk_config_getnext(B, conf, "alpha", NULL)) || strcmp(first, "one"))
+  {
+    fprintf(stderr, "Initial alpha is %s, not one\n", first?first:"(null)");
+    goto error;
+  }
+
+  if (!(value = bk_config_getnext(B, conf, "beta", NULL)) || strcmp(value, "x"))
+  {
+    fprintf(stderr, "Initial beta is %s, not x\n", value?value:"(null)");
+    goto error;
+  }
+
+  generation = bk_config_generation(B, conf);
+  if (reload_write(B, filename, "alpha = two\nbeta = x\nbeta = z\n") < 0)
+    goto error;
+
+  if (bk_config_reinit(B, conf) < 0)
+  {
+    fprintf(stderr, "Could not reinit %s\n", filename);
+    goto error;
+  }
+
+  if (bk_config_generation(B, conf) == generation)
+  {
+    fprintf(stderr, "Generation did not change across reinit\n");
+    goto error;
+  }
+
+  // The beta iteration started before the reload continues in the new values
+  if (!(value = bk_config_getnext(B, conf, "beta", value)) || strcmp(value, "z"))
+  {
+    fprintf(stderr, "Reloaded beta after x is %s, not z\n", value?value:"(null)");
+    goto error;
+  }
+
+  if (!(value = bk_config_getnext(B, conf, "alpha", NULL)) || strcmp(value, "two"))
+  {
+    fprintf(stderr, "Reloaded alpha is %s, not two\n", value?value:"(null)");
+    goto error;
+  }
+
+  // A file which can no longer be read must leave the previous values in place
+  unlink(filename);
+  if (bk_config_reinit(B, conf) == 0)
+  {
+    fprintf(stderr, "Reinit of a missing file succeeded\n");
+    goto error;
+  }
+
+  if (!(value = bk_config_getnext(B, conf, "alpha", NULL)) || strcmp(value, "two"))
+  {
+    fprintf(stderr, "Alpha after failed reinit is %s, not two\n", value?value:"(null)");
+    goto error;
+  }
+
+  if (reload_write(B, filename, "alpha = three\n") < 0)
+    goto error;
+
+  for (cnt = 0; cnt < 8; cnt++)
+  {
+    if (bk_config_reinit(B, conf) < 0)
+    {
+      fprintf(stderr, "Could not reinit %s\n", filename);
+      goto error;
+    }
+  }
+
+  if (!(value = bk_config_getnext(B, conf, "alpha", NULL)) || strcmp(value, "three"))
+  {
+    fprintf(stderr, "Alpha after repeated reinit is %s, not three\n", value?value:"(null)");
+    goto error;
+  }
+
+  if (bk_config_delete_key(B, conf, "alpha") < 0 || bk_config_getnext(B, conf, "alpha", NULL))
+  {
+    fprintf(stderr, "Deleted key alpha is still visible\n");
+    goto error;
+  }
+
+  // The very first value must survive all of the reloads above
+  if (strcmp(first, "one"))
+  {
+    fprintf(stderr, "Initial alpha changed to %s across reloads\n", first);
+    goto error;
+  }
+
+  // Nobody is reading, so every replaced snapshot (one per change) goes now
+  if ((cnt = bk_config_reclaim(B, conf, 0)) != 10)
+  {
+    fprintf(stderr, "Reclaimed %d replaced snapshots, not 10\n", cnt);
+    goto error;
+  }
+
+  if ((cnt = bk_config_reclaim(B, conf, 0)) != 0)
+  {
+    fprintf(stderr, "Reclaimed %d snapshots twice\n", cnt);
+    goto error;
+  }
+
+  bk_config_destroy(B, conf);
+  unlink(filename);
+  BK_RETURN(B, 0);
+
+ error:
+  if (conf)
+    bk_config_destroy(B, conf);
+  unlink(filename);
+  BK_RETURN(B, -1);
+}
+
+
+
+/*
+ * Replace the contents of a config file.
+ */
+static int reload_write(bk_s B, const char *filename, const char *contents)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  FILE *fp;
+
+  if (!(fp = fopen(filename, "w")))
+  {
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    BK_RETURN(B, -1);
+  }
+
+  fputs(contents, fp);
+  if (fclose(fp) != 0)
+  {
+    fprintf(stderr, "Could not write %s: %s\n", filename, strerror(errno));
+    BK_RETURN(B, -1);
+  }
+
+  BK_RETURN(B, 0);
+}
@@ -0,0 +1,374 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Check every CRC-32 and CRC-32C method against the byte-at-a-time
+ * table code and known values, and optionally report the speed of each
+ * over a range of buffer sizes.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_BUFSIZE	      70000		///< Random data for functional test
+#define TEST_ROUNDS	      5000		///< Random buffers checked per CRC
+#define BENCH_MAXBUF	      (512*1024)	///< Largest buffer size benchmarked
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_benchmb;		///< Megabytes to checksum per measurement
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+
+
+
+/**
+ * The CRC methods, for reports
+ */
+static const struct crcmethod
+{
+  const char	*cm_name;			///< Name to print
+  bk_flags	cm_flags;			///< Flags for bk_crc_method
+} Methods[] =
+{
+  { "crc32 byte",	BK_CRC_METHOD_BYTE },
+  { "crc32 slice8",	BK_CRC_METHOD_SLICE8 },
+  { "crc32 slice16",	BK_CRC_METHOD_SLICE16 },
+  { "crc32 clmul",	BK_CRC_METHOD_CLMUL },
+  { "crc32c byte",	BK_CRC_32C|BK_CRC_METHOD_BYTE },
+  { "crc32c slice8",	BK_CRC_32C|BK_CRC_METHOD_SLICE8 },
+  { "crc32c slice16",	BK_CRC_32C|BK_CRC_METHOD_SLICE16 },
+  { "crc32c sse4.2",	BK_CRC_32C|BK_CRC_METHOD_HW },
+};
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Report the speed of each CRC method"), N_("megabytes") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_benchmb = atoi(poptGetOptArg(optCon));
+      if (pc->pc_benchmb < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_benchmb)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Check the known CRC-32 and CRC-32C of "123456789", then compare
+ * every method this CPU has with the byte-at-a-time code on random
+ * data at random lengths and alignments.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  u_char *buf;
+  u_int32_t seed, ref32, ref32c, ref, crc;
+  size_t off, len;
+  u_int m;
+  int i, bad = 0;
+
+  if (!(buf = malloc(TEST_BUFSIZE)))
+    bk_die(B, 1, stderr, _("Could not allocate test data\n"), BK_WARNDIE_WANTDETAILS);
+  for (i = 0; i < TEST_BUFSIZE; i++)
+    buf[i] = random();
+
+  if ((bk_crc32(0xffffffff, "123456789", 9) ^ 0xffffffff) != 0xcbf43926 ||
+      (bk_crc32c(0xffffffff, "123456789", 9) ^ 0xffffffff) != 0xe3069283)
+  {
+    fprintf(stderr, "Check values are wrong\n");
+    bad++;
+  }
+
+  for (i = 0; i < TEST_ROUNDS; i++)
+  {
+    // Every short length, then random ones
+    off = random() % 64;
+    len = i < 512 ? i / 2 : random() % (TEST_BUFSIZE - 64);
+    seed = random();
+    ref32 = bk_crc_method(seed, buf + off, len, BK_CRC_METHOD_BYTE);
+    ref32c = bk_crc_method(seed, buf + off, len, BK_CRC_32C|BK_CRC_METHOD_BYTE);
+
+    for (m = 0; m < sizeof(Methods) / sizeof(*Methods); m++)
+    {
+      ref = BK_FLAG_ISSET(Methods[m].cm_flags, BK_CRC_32C) ? ref32c : ref32;
+      crc = bk_crc_method(seed, buf + off, len, Methods[m].cm_flags);
+      if (crc != ref)
+      {
+	fprintf(stderr, "%s of %zu bytes gave %08x, expected %08x\n", Methods[m].cm_name, len, crc, ref);
+	bad++;
+      }
+    }
+
+    if (bk_crc32(seed, buf + off, len) != ref32 || bk_crc32c(seed, buf + off, len) != ref32c)
+    {
+      fprintf(stderr, "Default CRC of %zu bytes is wrong\n", len);
+      bad++;
+    }
+  }
+
+  if (bad)
+  {
+    fprintf(stderr, "%d CRC errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+  free(buf);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Time each method this CPU has on buffers from 16 bytes to 512KB, with
+ * the same total amount of data for every size.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  size_t total = (size_t)pc->pc_benchmb * 1024 * 1024;
+  struct timeval start, end, delta;
+  bk_flags have32, have32c;
+  size_t size, done;
+  u_int32_t crc = 0;
+  u_char *buf;
+  u_int m;
+
+  if (!(buf = malloc(BENCH_MAXBUF)))
+    bk_die(B, 1, stderr, _("Could not allocate benchmark data\n"), BK_WARNDIE_WANTDETAILS);
+  memset(buf, 0x5a, BENCH_MAXBUF);
+
+  have32 = bk_crc_methods(0);
+  have32c = bk_crc_methods(BK_CRC_32C);
+
+  printf("%-16s", "GB/s");
+  for (size = 16; size <= BENCH_MAXBUF; size *= 8)
+    printf(" %9zu", size);
+  printf("\n");
+
+  for (m = 0; m < sizeof(Methods) / sizeof(*Methods); m++)
+  {
+    if (BK_FLAG_ISCLEAR(Methods[m].cm_flags & ~BK_CRC_32C, BK_FLAG_ISSET(Methods[m].cm_flags, BK_CRC_32C) ? have32c : have32))
+      continue;
+
+    printf("%-16s", Methods[m].cm_name);
+    for (size = 16; size <= BENCH_MAXBUF; size *= 8)
+    {
+      gettimeofday(&start, NULL);
+      for (done = 0; done < total; done += size)
+	crc = bk_crc_method(crc, buf, size, Methods[m].cm_flags);
+      gettimeofday(&end, NULL);
+      BK_TV_SUB(&delta, &end, &start);
+      printf(" %9.2f", done / BK_TV2F(&delta) / 1e9);
+    }
+    printf("\n");
+  }
+
+  // Keep the compiler from discarding the work
+  if (crc == 0x12345678)
+    printf("\n");
+  free(buf);
+
+  BK_VRETURN(B);
+}
@@ -0,0 +1,777 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Check the CSV reader with known input, and with random records written
+ * by the CSV writer and read back in random sized pieces, directly and
+ * through an ioh and a polling io, and optionally time them.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_ROUNDS	      200		///< Random files written and read back
+#define TEST_RECORDS	      500		///< Records in each random file
+#define MAXFIELDS	      8			///< Most fields in a random record
+#define MAXFIELDLEN	      40		///< Longest random field
+#define BENCH_COUNT	      100000		///< Records parsed per measurement
+#define IOH_ROUNDS	      50		///< Rounds between reads through an ioh
+#define IOH_OUTMAX	      128		///< Output an ioh queues before the writer finds it full
+#define IOH_TRIES	      5000		///< Milliseconds to wait for an ioh
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_bench;		///< Measurements of each kind
+};
+
+
+
+/**
+ * A record written, or expected to be read
+ */
+struct record
+{
+  u_int			r_nfields;		///< Number of fields
+  struct bk_strspan	r_fields[MAXFIELDS];	///< Fields
+};
+
+
+
+/**
+ * What the reader callback checks against
+ */
+struct expect
+{
+  const struct record *	e_records;		///< Records expected
+  u_int			e_nrecords;		///< Number of records expected
+  u_int			e_next;			///< Next record expected
+  int			e_bad;			///< Records not as expected
+  int			e_done;			///< End of input seen
+  char			e_text[256];		///< Known input: records read, as text
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static int check_record(bk_s B, void *opaque, const struct bk_strspan *fields, u_int nfields);
+static int text_record(bk_s B, void *opaque, const struct bk_strspan *fields, u_int nfields);
+static int count_record(bk_s B, void *opaque, const struct bk_strspan *fields, u_int nfields);
+static void check_ioh(bk_s B, const struct record *records, char delim, int *bad);
+static void check_polling(bk_s B, const char *text, size_t len, const struct record *records, char delim, int *bad);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Time parsing and writing"), N_("rounds") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_bench = atoi(poptGetOptArg(optCon));
+      if (pc->pc_bench < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_bench)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+
+
+
+/**
+ * Check the reader with known input, the writer's quoting, and random
+ * records written out and read back in random sized pieces.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const struct
+  {
+    const char *	in;			// Input
+    char		delim;			// Field delimiter
+    const char *	out;			// Records read, fields ended by | and records by ;
+  } known[] =
+  {
+    { "a,b,c\n", ',', "a|b|c|;" },
+    { "a,b,c", ',', "a|b|c|;" },
+    { "a,\"b,c\",d\r\nx\r\n", ',', "a|b,c|d|;x|;" },
+    { "\"x\"\"y\",\"\"\"\"\n", ',', "x\"y|\"|;" },
+    { "\n\r\n\na\n\n", ',', "a|;" },
+    { ",\n,,\n", ',', "||;|||;" },
+    { "\"\"\n\"\"", ',', "|;|;" },
+    { "\"two\nlines\",z\n", ',', "two\nlines|z|;" },
+    { "ab\"c,d\"e,f\n", ',', "abc,de|f|;" },
+    { "\"open,to the end\n", ',', "open,to the end\n|;" },
+    { "a;b,c\tx\n", ';', "a|b,c\tx|;" },
+    { "a\tb\t\"c\td\"\n", '\t', "a|b|c\td|;" },
+    { "\"0123456789012345678901234567890123456789012345678901234567890\",\"0123456789\"\"012345678901234567890123456789012345678901234567890123456789\"\n", ',',
+      "0123456789012345678901234567890123456789012345678901234567890|0123456789\"012345678901234567890123456789012345678901234567890123456789|;" },
+  };
+  static const char alphabet[] = "aaaabbbccdd  ,;\t|\"\"\r\n";
+  static const struct record failed[] = { { 1, { { "a", 1 } } } };
+  struct bk_csv_writer *csw;
+  struct record *records;
+  struct expect exp;
+  struct bk_csv *csv;
+  char *text, *fields, *p;
+  size_t len, off, n, i;
+  int bad = 0, round, fd;
+  char delim;
+  u_int f;
+
+  memset(&exp, 0, sizeof(exp));
+
+  for (i = 0; i < sizeof(known) / sizeof(*known); i++)
+  {
+    // All at once, then a byte at a time, each with and without AVX2
+    for (round = 0; round < 4; round++)
+    {
+      exp.e_text[0] = '\0';
+      exp.e_done = 0;
+      if (!(csv = bk_csv_create(B, known[i].delim, text_record, &exp, round & 2 ? BK_CSV_PORTABLE : 0)))
+	bk_die(B, 1, stderr, _("Could not create CSV reader\n"), BK_WARNDIE_WANTDETAILS);
+      len = strlen(known[i].in);
+      for (off = 0; off < len; off += n)
+      {
+	n = round & 1 ? 1 : len;
+	if (bk_csv_parse(B, csv, known[i].in + off, n, 0) < 0)
+	  break;
+      }
+      if (bk_csv_parse(B, csv, NULL, 0, BK_CSV_FINAL) < 0 || !exp.e_done || strcmp(exp.e_text, known[i].out))
+      {
+	fprintf(stderr, "\"%s\" read as \"%s\", not \"%s\"\n", known[i].in, exp.e_text, known[i].out);
+	bad++;
+      }
+      bk_csv_destroy(B, csv);
+    }
+  }
+
+  // The callback stops parsing until the end of the input
+  memset(&exp, 0, sizeof(exp));
+  exp.e_records = failed;
+  exp.e_nrecords = 1;
+  if (!(csv = bk_csv_create(B, ',', check_record, &exp, 0)))
+    bk_die(B, 1, stderr, _("Could not create CSV reader\n"), BK_WARNDIE_WANTDETAILS);
+  if (bk_csv_parse(B, csv, "a\nb\nc\n", 6, 0) != -1 || bk_csv_parse(B, csv, "d\n", 2, 0) != -1 ||
+      bk_csv_parse(B, csv, NULL, 0, BK_CSV_FINAL) != -1 || exp.e_bad != 1 || exp.e_done)
+  {
+    fprintf(stderr, "Callback failure did not stop parsing\n");
+    bad++;
+  }
+  bk_csv_destroy(B, csv);
+
+  records = malloc(TEST_RECORDS * sizeof(*records));
+  fields = malloc(TEST_RECORDS * MAXFIELDS * MAXFIELDLEN);
+  text = malloc(TEST_RECORDS * MAXFIELDS * (MAXFIELDLEN * 2 + 3));
+  if (!records || !fields || !text)
+    bk_die(B, 1, stderr, _("Could not allocate test data\n"), BK_WARNDIE_WANTDETAILS);
+
+  // Only fields which need it are quoted
+  {
+    static const struct bk_strspan quoting[] = { { "plain", 5 }, { "has,comma", 9 }, { "has \"quote\"", 11 }, { "", 0 }, { "cr\r", 3 } };
+    static const char quoted[] = "plain,\"has,comma\",\"has \"\"quote\"\"\",,\"cr\r\"\n\"\"\n";
+
+    fd = fileno(tmpfile());
+    if (!(csw = bk_csv_writer_create(B, NULL, NULL, fd, ',', 0, 0)))
+      bk_die(B, 1, stderr, _("Could not create CSV writer\n"), BK_WARNDIE_WANTDETAILS);
+    if (bk_csv_write(B, csw, quoting, 5, 0) != 0 || bk_csv_write(B, csw, quoting + 3, 1, 0) != 0 ||
+	bk_csv_writer_flush(B, csw, 0) != 0 || pread(fd, text, sizeof(quoted), 0) != sizeof(quoted) - 1 ||
+	memcmp(text, quoted, sizeof(quoted) - 1))
+    {
+      fprintf(stderr, "Fields quoted wrongly\n");
+      bad++;
+    }
+    bk_csv_writer_destroy(B, csw);
+    close(fd);
+  }
+
+  for (round = 0; round < TEST_ROUNDS; round++)
+  {
+    delim = ",;\t|"[random() % 4];
+
+    for (i = 0, p = fields; i < TEST_RECORDS; i++)
+    {
+      records[i].r_nfields = random() % MAXFIELDS + 1;
+      for (f = 0; f < records[i].r_nfields; f++)
+      {
+	records[i].r_fields[f].bss_ptr = p;
+	records[i].r_fields[f].bss_len = random() % 4 ? random() % 8 : random() % (MAXFIELDLEN + 1);
+	for (n = 0; n < records[i].r_fields[f].bss_len; n++)
+	  *p++ = alphabet[random() % (sizeof(alphabet) - 1)];
+      }
+    }
+
+    // Written through a buffer of random size
+    fd = fileno(tmpfile());
+    if (!(csw = bk_csv_writer_create(B, NULL, NULL, fd, delim, random() % 300 + 1, 0)))
+      bk_die(B, 1, stderr, _("Could not create CSV writer\n"), BK_WARNDIE_WANTDETAILS);
+    for (i = 0; i < TEST_RECORDS; i++)
+    {
+      if (bk_csv_write(B, csw, records[i].r_fields, records[i].r_nfields, 0) != 0)
+      {
+	fprintf(stderr, "Could not write record %d\n", (int)i);
+	bad++;
+      }
+    }
+    bk_csv_writer_destroy(B, csw);
+    len = lseek(fd, 0, SEEK_END);
+    if (pread(fd, text, len, 0) != (ssize_t)len)
+      bk_die(B, 1, stderr, _("Could not read back CSV output\n"), BK_WARNDIE_WANTDETAILS);
+    close(fd);
+
+    // Sometimes without the last newline
+    if (round % 2)
+      len--;
+
+    // Read back in pieces of random size, half the time without AVX2
+    memset(&exp, 0, sizeof(exp));
+    exp.e_records = records;
+    exp.e_nrecords = TEST_RECORDS;
+    if (!(csv = bk_csv_create(B, delim, check_record, &exp, round % 4 >= 2 ? BK_CSV_PORTABLE : 0)))
+      bk_die(B, 1, stderr, _("Could not create CSV reader\n"), BK_WARNDIE_WANTDETAILS);
+    for (off = 0; off < len; off += n)
+    {
+      n = random() % 3 ? random() % 100 + 1 : random() % 5000 + 1;
+      n = MIN(n, len - off);
+      if (bk_csv_parse(B, csv, text + off, n, off + n == len && random() % 2 ? BK_CSV_FINAL : 0) < 0)
+	break;
+    }
+    if (!exp.e_done)
+      bk_csv_parse(B, csv, NULL, 0, BK_CSV_FINAL);
+    bk_csv_destroy(B, csv);
+
+    if (exp.e_bad || exp.e_next != TEST_RECORDS || !exp.e_done)
+    {
+      fprintf(stderr, "Random CSV read back wrongly (delimiter %d, %u records read)\n", delim, exp.e_next);
+      bad++;
+    }
+
+    if (round % IOH_ROUNDS == 0)
+    {
+      check_ioh(B, records, delim, &bad);
+      check_polling(B, text, len, records, delim, &bad);
+    }
+  }
+
+  free(text);
+  free(fields);
+  free(records);
+
+  if (bad)
+  {
+    fprintf(stderr, "%d CSV errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Time reading and writing CSV records, and splitting the same lines
+ * with bk_string_tokenize.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct timeval start, end, delta;
+  struct bk_csv_writer *csw;
+  struct bk_strspan fields[8];
+  struct bk_strtok bst;
+  struct bk_csv *csv;
+  char *text, *p, *line, **tokens;
+  size_t bytes, sum = 0, off;
+  u_int count = 0;
+  int i, r, fd;
+
+#define BENCHCSV(name, expr)								\
+  do {											\
+    double best = 0;									\
+											\
+    for (r = 0; r < pc->pc_bench; r++)							\
+    {											\
+      gettimeofday(&start, NULL);							\
+      expr;										\
+      gettimeofday(&end, NULL);								\
+      BK_TV_SUB(&delta, &end, &start);							\
+      if (!r || BK_TV2F(&delta) < best)							\
+	best = BK_TV2F(&delta);								\
+    }											\
+    printf("%-28s %8.2f M records/s %8.1f MB/s\n", name, BENCH_COUNT / best / 1e6, bytes / best / 1e6); \
+  } while (0)
+
+  memset(&bst, 0, sizeof(bst));
+  text = malloc(BENCH_COUNT * 256);
+  line = malloc(256);
+  if (!text || !line)
+    bk_die(B, 1, stderr, _("Could not allocate benchmark data\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (i = 0, p = text; i < BENCH_COUNT; i++)
+  {
+    p += sprintf(p, "%ld,\"Person %ld, Jr.\",user%ld@example.com,%ld.%02ld,\"said \"\"hi\"\" %ld\",2020-10-%02ld,%s\n",
+		 random() % 1000000, random() % 10000, random() % 10000, random() % 1000, random() % 100,
+		 random() % 100, random() % 28 + 1, random() % 2 ? "yes" : "no");
+  }
+  bytes = p - text;
+
+  if (!(csv = bk_csv_create(B, ',', count_record, &count, 0)))
+    bk_die(B, 1, stderr, _("Could not create CSV reader\n"), BK_WARNDIE_WANTDETAILS);
+
+  BENCHCSV("tokenize_split", for (p = text; p < text + bytes; p = strchr(p, '\n') + 1)
+	   {
+	     memcpy(line, p, strchr(p, '\n') - p);
+	     line[strchr(p, '\n') - p] = '\0';
+	     tokens = bk_string_tokenize_split(B, line, 0, ",", NULL, NULL, NULL, BK_STRING_TOKENIZE_DOUBLEQUOTE);
+	     sum += tokens[1][0];
+	     bk_string_tokenize_destroy(B, tokens);
+	   });
+  BENCHCSV("tokenize_spans", for (p = text; p < text + bytes; p = strchr(p, '\n') + 1)
+	   {
+	     bk_string_tokenize_spans(B, &bst, p, strchr(p, '\n') - p, 0, ",", BK_STRING_TOKENIZE_DOUBLEQUOTE);
+	     sum += bst.bst_tokens[1].bss_len;
+	   });
+  BENCHCSV("bk_csv_parse", bk_csv_parse(B, csv, text, bytes, BK_CSV_FINAL));
+  BENCHCSV("bk_csv_parse 4k pieces", for (off = 0; off < bytes; off += 4096) bk_csv_parse(B, csv, text + off, MIN(4096, bytes - off), 0));
+
+  // Write the same records, to nowhere
+  for (i = 0; i < 8; i++)
+  {
+    fields[i].bss_ptr = i % 2 ? "Person 1234, Jr." : "user1234@example.com";
+    fields[i].bss_len = strlen(fields[i].bss_ptr);
+  }
+  bytes = BENCH_COUNT * (8 * 21 + 4 * 2);
+  if ((fd = open("/dev/null", O_WRONLY)) < 0 || !(csw = bk_csv_writer_create(B, NULL, NULL, fd, ',', 0, 0)))
+    bk_die(B, 1, stderr, _("Could not create CSV writer\n"), BK_WARNDIE_WANTDETAILS);
+  BENCHCSV("bk_csv_write", for (i = 0; i < BENCH_COUNT; i++) bk_csv_write(B, csw, fields, 8, 0));
+  bk_csv_writer_destroy(B, csw);
+  close(fd);
+
+  // Keep the compiler from discarding the work
+  if (sum == 0x12 && count == 0x34)
+    printf("\n");
+
+  bk_csv_destroy(B, csv);
+  bk_string_tokenize_spans_free(B, &bst);
+  free(line);
+  free(text);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Reader callback: check a record against the one expected.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param opaque Expected records
+ *	@param fields Fields read
+ *	@param nfields Number of fields read
+ *	@return <i>-1</i> if not as expected
+ *	@return <br><i>0</i> if as expected
+ */
+static int check_record(bk_s B, void *opaque, const struct bk_strspan *fields, u_int nfields)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct expect *exp = opaque;
+  const struct record *r;
+  u_int f;
+
+  if (!nfields)
+  {
+    exp->e_done = 1;
+    BK_RETURN(B, 0);
+  }
+
+  if (exp->e_next >= exp->e_nrecords)
+    goto bad;
+
+  r = &exp->e_records[exp->e_next++];
+  if (nfields != r->r_nfields)
+    goto bad;
+
+  for (f = 0; f < nfields; f++)
+  {
+    if (fields[f].bss_len != r->r_fields[f].bss_len || memcmp(fields[f].bss_ptr, r->r_fields[f].bss_ptr, fields[f].bss_len))
+      goto bad;
+  }
+
+  BK_RETURN(B, 0);
+
+ bad:
+  exp->e_bad++;
+  BK_RETURN(B, -1);
+}
+
+
+
+/**
+ * Reader callback: add a record to the text of those read.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param opaque Records read
+ *	@param fields Fields read
+ *	@param nfields Number of fields read
+ *	@return <i>0</i> always
+ */
+static int text_record(bk_s B, void *opaque, const struct bk_strspan *fields, u_int nfields)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct expect *exp = opaque;
+  size_t len = strlen(exp->e_text);
+  u_int f;
+
+  if (!nfields)
+    exp->e_done = 1;
+
+  for (f = 0; f < nfields; f++)
+    len += snprintf(exp->e_text + len, sizeof(exp->e_text) - MIN(len, sizeof(exp->e_text)), "%.*s|", (int)fields[f].bss_len, fields[f].bss_ptr);
+  if (nfields)
+    snprintf(exp->e_text + len, sizeof(exp->e_text) - MIN(len, sizeof(exp->e_text)), ";");
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Reader callback: count records.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param opaque Count
+ *	@param fields Fields read
+ *	@param nfields Number of fields read
+ *	@return <i>0</i> always
+ */
+static int count_record(bk_s B, void *opaque, const struct bk_strspan *fields, u_int nfields)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+
+  (*(u_int *)opaque) += fields ? fields[0].bss_len : 0;
+
+  BK_RETURN(B, 0);
+}
+
+
+
+/**
+ * Write records to an ioh with a CSV writer, without letting the ioh
+ * drain until they are all collected, and read them back over a
+ * socketpair with bk_csv_ioh_handler.  The same handler frees what the
+ * writer wrote.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param records TEST_RECORDS records to write
+ *	@param delim Field delimiter
+ *	@param bad Error count to increment
+ */
+static void check_ioh(bk_s B, const struct record *records, char delim, int *bad)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct bk_csv_writer *csw;
+  struct bk_ioh *wioh, *rioh = NULL;
+  struct bk_run *run;
+  struct expect exp;
+  struct bk_csv *csv;
+  int sv[2], tries, ret, full = 0;
+  u_int i;
+
+  memset(&exp, 0, sizeof(exp));
+  exp.e_records = records;
+  exp.e_nrecords = TEST_RECORDS;
+  if (!(run = bk_run_init(B, 0)) || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+      !(csv = bk_csv_create(B, delim, check_record, &exp, 0)))
+    bk_die(B, 1, stderr, _("Could not create CSV reader\n"), BK_WARNDIE_WANTDETAILS);
+
+  if (!(wioh = bk_ioh_init(B, NULL, -1, sv[0], bk_csv_ioh_handler, csv, 0, 0, IOH_OUTMAX, run, BK_IOH_STREAM|BK_IOH_RAW)) ||
+      !(rioh = bk_ioh_init(B, NULL, sv[1], -1, bk_csv_ioh_handler, csv, 0, 0, 0, run, BK_IOH_STREAM|BK_IOH_RAW)) ||
+      !(csw = bk_csv_writer_create(B, wioh, NULL, -1, delim, 256, 0)))
+    bk_die(B, 1, stderr, _("Could not create CSV ioh\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (i = 0; i < TEST_RECORDS; i++)
+  {
+    if ((ret = bk_csv_write(B, csw, records[i].r_fields, records[i].r_nfields, 0)) < 0)
+    {
+      fprintf(stderr, "Could not write record %u to ioh\n", i);
+      (*bad)++;
+      break;
+    }
+    full += ret;
+  }
+
+  for (tries = 0; tries < IOH_TRIES && bk_csv_writer_flush(B, csw, 0) > 0; tries++)
+  {
+    bk_run_once(B, run, BK_RUN_ONCE_FLAG_DONT_BLOCK);
+    usleep(1000);
+  }
+  bk_csv_writer_destroy(B, csw);
+  bk_ioh_close(B, wioh, 0);
+
+  for (; tries < IOH_TRIES && !exp.e_done; tries++)
+  {
+    bk_run_once(B, run, BK_RUN_ONCE_FLAG_DONT_BLOCK);
+    usleep(1000);
+  }
+
+  if (!full || exp.e_bad || exp.e_next != TEST_RECORDS || !exp.e_done)
+  {
+    fprintf(stderr, "CSV read back wrongly through ioh (output full %d times, %u records read)\n", full, exp.e_next);
+    (*bad)++;
+  }
+
+  bk_ioh_close(B, rioh, BK_IOH_ABORT);
+  bk_run_destroy(B, run);
+  bk_csv_destroy(B, csv);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Read CSV text back over a socketpair with bk_csv_polling_read.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param text CSV text
+ *	@param len Length of text
+ *	@param records TEST_RECORDS records expected
+ *	@param delim Field delimiter
+ *	@param bad Error count to increment
+ */
+static void check_polling(bk_s B, const char *text, size_t len, const struct record *records, char delim, int *bad)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct bk_polling_io *bpi;
+  bk_ioh_status_e status = BkIohStatusNoStatus;
+  struct bk_ioh *ioh;
+  struct bk_run *run;
+  struct expect exp;
+  struct bk_csv *csv;
+  int sv[2], tries, ret = 0;
+
+  memset(&exp, 0, sizeof(exp));
+  exp.e_records = records;
+  exp.e_nrecords = TEST_RECORDS;
+  if (!(run = bk_run_init(B, 0)) || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+      !(csv = bk_csv_create(B, delim, check_record, &exp, 0)))
+    bk_die(B, 1, stderr, _("Could not create CSV reader\n"), BK_WARNDIE_WANTDETAILS);
+
+  if (write(sv[0], text, len) != (ssize_t)len)
+    bk_die(B, 1, stderr, _("Could not write CSV text\n"), BK_WARNDIE_WANTDETAILS);
+  close(sv[0]);
+
+  if (!(ioh = bk_ioh_init(B, NULL, sv[1], -1, NULL, NULL, 0, 0, 0, run, BK_IOH_STREAM|BK_IOH_RAW)) ||
+      !(bpi = bk_polling_io_create(B, ioh, 0)))
+    bk_die(B, 1, stderr, _("Could not create CSV polling io\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (tries = 0; tries < IOH_TRIES && (ret = bk_csv_polling_read(B, csv, bpi, &status, 1000, 0)) == 0; tries++)
+    ; // Void
+
+  if (ret <= 0 || status != BkIohStatusIohReadEOF || exp.e_bad || exp.e_next != TEST_RECORDS || !exp.e_done)
+  {
+    fprintf(stderr, "CSV read back wrongly through polling io (%u records read)\n", exp.e_next);
+    (*bad)++;
+  }
+
+  bk_polling_io_close(B, bpi, 0);
+  bk_run_destroy(B, run);
+  bk_csv_destroy(B, csv);
+
+  BK_VRETURN(B);
+}
@@ -0,0 +1,657 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Check the digest engine against published test vectors, check that
+ * streamed, portable, multi-buffer, and ioh filter digests all agree,
+ * and optionally benchmark them.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_BUFSIZE	      40000		///< Random data for functional test
+#define TEST_ROUNDS	      300		///< Random buffers checked for each algorithm
+#define TEST_MULTI	      37		///< Messages digested at once
+#define BENCH_BUFSIZE	      (1024*1024)	///< Size of buffer benchmarked
+#define BENCH_SMALL	      1024		///< Size of small messages benchmarked
+#define FILTER_LEN	      TEST_BUFSIZE	///< Data sent through the ioh filter
+#define FILTER_TRIES	      5000		///< Milliseconds to wait for the ioh filter test
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_benchmb;		///< Megabytes to digest per measurement
+};
+
+
+
+/**
+ * One end of the ioh filter test
+ */
+struct filter_end
+{
+  struct bk_ioh		*fe_ioh;		///< The ioh (NULL once closed)
+  struct bk_digest	*fe_digest;		///< Digest the filter keeps
+  u_char		 fe_final[BK_DIGEST_MAXLEN];	///< Digest finished when the ioh closed
+  char			*fe_buf;		///< Data read
+  size_t		 fe_len;		///< Data read so far
+  int			 fe_eof;		///< End of file seen
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static void hex(const u_char *digest, int len, char *out);
+static void checkfilter(bk_s B, const u_char *data, bk_flags closeflags, int *bad);
+static void filter_handler(bk_s B, bk_vptr *data, void *opaque, struct bk_ioh *ioh, bk_ioh_status_e state_flags);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Measure digest speeds"), N_("megabytes") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_benchmb = atoi(poptGetOptArg(optCon));
+      if (pc->pc_benchmb < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_benchmb)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Check published test vectors, then random data of random lengths:
+ * whole, streamed in random pieces, and many messages at once, each
+ * compared with the portable code.  Finish with digests kept by ioh
+ * filters.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const struct
+  {
+    int		alg;				// Algorithm
+    const char *msg;				// Message, repeated; NULL for i%251 pattern
+    size_t	len;				// Repetitions or length of pattern
+    const char *digest;				// Expected digest
+  } vectors[] =
+  {
+    // RFC 1321
+    { BK_DIGEST_MD5, "", 1, "d41d8cd98f00b204e9800998ecf8427e" },
+    { BK_DIGEST_MD5, "abc", 1, "900150983cd24fb0d6963f7d28e17f72" },
+    { BK_DIGEST_MD5, "message digest", 1, "f96b697d7cb7938d525a2f31aaf161d0" },
+    { BK_DIGEST_MD5, "1234567890", 8, "57edf4a22be3c955ac49da2e2107b67a" },
+    // FIPS 180-4 examples
+    { BK_DIGEST_SHA256, "", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { BK_DIGEST_SHA256, "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { BK_DIGEST_SHA256, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { BK_DIGEST_SHA256, "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    // BLAKE3 reference test vectors
+    { BK_DIGEST_BLAKE3, "abc", 1, "6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85" },
+    { BK_DIGEST_BLAKE3, NULL, 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+    { BK_DIGEST_BLAKE3, NULL, 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+    { BK_DIGEST_BLAKE3, NULL, 63, "e9bc37a594daad83be9470df7f7b3798297c3d834ce80ba85d6e207627b7db7b" },
+    { BK_DIGEST_BLAKE3, NULL, 64, "4eed7141ea4a5cd4b788606bd23f46e212af9cacebacdc7d1f4c6dc7f2511b98" },
+    { BK_DIGEST_BLAKE3, NULL, 65, "de1e5fa0be70df6d2be8fffd0e99ceaa8eb6e8c93a63f2d8d1c30ecb6b263dee" },
+    { BK_DIGEST_BLAKE3, NULL, 1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+    { BK_DIGEST_BLAKE3, NULL, 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+    { BK_DIGEST_BLAKE3, NULL, 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+    { BK_DIGEST_BLAKE3, NULL, 2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+    { BK_DIGEST_BLAKE3, NULL, 2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+    { BK_DIGEST_BLAKE3, NULL, 3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+    { BK_DIGEST_BLAKE3, NULL, 3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+    { BK_DIGEST_BLAKE3, NULL, 5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833" },
+    { BK_DIGEST_BLAKE3, NULL, 8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+    { BK_DIGEST_BLAKE3, NULL, 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+    { BK_DIGEST_BLAKE3, NULL, 16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4" },
+    { BK_DIGEST_BLAKE3, NULL, 31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+    { BK_DIGEST_BLAKE3, NULL, 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+  };
+  static const int algs[] = { BK_DIGEST_MD5, BK_DIGEST_SHA256, BK_DIGEST_BLAKE3 };
+  u_char digest[BK_DIGEST_MAXLEN], ref[BK_DIGEST_MAXLEN], *buf, *data, *multi, *multiref;
+  char str[BK_DIGEST_MAXLEN * 2 + 1];
+  bk_vptr msgs[TEST_MULTI];
+  struct bk_digest *bd;
+  size_t len, off, piece, i;
+  int v, a, dlen, bad = 0, round;
+
+  if (!(buf = malloc(TEST_BUFSIZE * 26)))
+    bk_die(B, 1, stderr, _("Could not allocate test data\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (v = 0; v < (int)(sizeof(vectors) / sizeof(*vectors)); v++)
+  {
+    if (vectors[v].msg)
+    {
+      // Streaming the repetitions also covers messages too big to want in memory
+      if (!(bd = bk_digest_create(B, vectors[v].alg, 0)))
+	bk_die(B, 1, stderr, _("Could not create digest\n"), BK_WARNDIE_WANTDETAILS);
+      for (i = 0; i < vectors[v].len; i++)
+	bk_digest_update(B, bd, vectors[v].msg, strlen(vectors[v].msg));
+      dlen = bk_digest_final(B, bd, digest);
+      bk_digest_destroy(B, bd);
+    }
+    else
+    {
+      for (i = 0; i < vectors[v].len; i++)
+	buf[i] = i % 251;
+      dlen = bk_digest_buffer(B, vectors[v].alg, buf, vectors[v].len, digest, 0);
+    }
+
+    hex(digest, dlen, str);
+    if (strcmp(str, vectors[v].digest))
+    {
+      fprintf(stderr, "Test vector %d gave %s, expected %s\n", v, str, vectors[v].digest);
+      bad++;
+    }
+
+    if (!vectors[v].msg)
+    {
+      bk_digest_buffer(B, vectors[v].alg, buf, vectors[v].len, digest, BK_DIGEST_PORTABLE);
+      hex(digest, dlen, str);
+      if (strcmp(str, vectors[v].digest))
+      {
+	fprintf(stderr, "Portable test vector %d gave %s, expected %s\n", v, str, vectors[v].digest);
+	bad++;
+      }
+    }
+  }
+
+  for (i = 0; i < TEST_BUFSIZE * 26; i++)
+    buf[i] = random();
+
+  for (a = 0; a < (int)(sizeof(algs) / sizeof(*algs)); a++)
+  {
+    if (!(bd = bk_digest_create(B, algs[a], 0)))
+      bk_die(B, 1, stderr, _("Could not create digest\n"), BK_WARNDIE_WANTDETAILS);
+    dlen = bk_digest_length(B, algs[a]);
+
+    for (round = 0; round < TEST_ROUNDS; round++)
+    {
+      data = buf + random() % 64;
+      len = round < 100 ? (size_t)round * 11 : (size_t)random() % (TEST_BUFSIZE * 25);
+      bk_digest_buffer(B, algs[a], data, len, ref, BK_DIGEST_PORTABLE);
+
+      bk_digest_buffer(B, algs[a], data, len, digest, 0);
+      if (memcmp(digest, ref, dlen))
+      {
+	fprintf(stderr, "Algorithm %d digest of %zu bytes differs from portable code\n", algs[a], len);
+	bad++;
+      }
+
+      for (off = 0; off < len; off += piece)
+      {
+	piece = random() % 4 ? (size_t)random() % 2000 : (size_t)random() % (len - off + 1);
+	piece = MIN(piece, len - off);
+	bk_digest_update(B, bd, data + off, piece);
+      }
+      bk_digest_final(B, bd, digest);
+      if (memcmp(digest, ref, dlen))
+      {
+	fprintf(stderr, "Algorithm %d streamed digest of %zu bytes differs\n", algs[a], len);
+	bad++;
+      }
+    }
+
+    bk_digest_destroy(B, bd);
+
+    // Very different lengths, so lanes finish at different times
+    multi = malloc(TEST_MULTI * dlen);
+    multiref = malloc(TEST_MULTI * dlen);
+    if (!multi || !multiref)
+      bk_die(B, 1, stderr, _("Could not allocate digests\n"), BK_WARNDIE_WANTDETAILS);
+    for (round = 0; round < 20; round++)
+    {
+      for (v = 0; v < TEST_MULTI; v++)
+      {
+	msgs[v].ptr = buf + random() % TEST_BUFSIZE;
+	msgs[v].len = random() % 8 ? random() % 200 : random() % TEST_BUFSIZE;
+	bk_digest_buffer(B, algs[a], msgs[v].ptr, msgs[v].len, multiref + v * dlen, BK_DIGEST_PORTABLE);
+      }
+      v = round % TEST_MULTI + 1;
+      bk_digest_multi(B, algs[a], msgs, v, multi, 0);
+      if (memcmp(multi, multiref, v * dlen))
+      {
+	fprintf(stderr, "Algorithm %d digest of %d messages differs\n", algs[a], v);
+	bad++;
+      }
+    }
+    free(multiref);
+    free(multi);
+  }
+
+  // The digests must be complete whether or not the ioh closes its descriptors
+  checkfilter(B, buf, 0, &bad);
+  checkfilter(B, buf, BK_IOH_DONTCLOSEFDS, &bad);
+
+  if (bad)
+  {
+    fprintf(stderr, "%d digest errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+  free(buf);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Time each algorithm on a large buffer with and without the portable
+ * code, then MD5 of many small messages one at a time and all at once.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const struct
+  {
+    int		alg;				// Algorithm
+    const char *name;				// Name to print
+  } algs[] = { { BK_DIGEST_MD5, "MD5" }, { BK_DIGEST_SHA256, "SHA-256" }, { BK_DIGEST_BLAKE3, "BLAKE3" } };
+  size_t total = (size_t)pc->pc_benchmb * 1024 * 1024;
+  struct timeval start, end, delta;
+  u_char *buf, *digests, sum = 0;
+  size_t done, count, i;
+  bk_vptr *msgs;
+  int a;
+
+  count = BENCH_BUFSIZE / BENCH_SMALL;
+  buf = malloc(BENCH_BUFSIZE);
+  digests = malloc(count * BK_DIGEST_MAXLEN);
+  msgs = malloc(count * sizeof(*msgs));
+  if (!buf || !digests || !msgs)
+    bk_die(B, 1, stderr, _("Could not allocate benchmark data\n"), BK_WARNDIE_WANTDETAILS);
+  for (i = 0; i < BENCH_BUFSIZE; i++)
+    buf[i] = random();
+  for (i = 0; i < count; i++)
+  {
+    msgs[i].ptr = buf + i * BENCH_SMALL;
+    msgs[i].len = BENCH_SMALL;
+  }
+
+#define BENCHDIGEST(name, expr)								\
+  do {											\
+    gettimeofday(&start, NULL);								\
+    for (done = 0; done < total; done += BENCH_BUFSIZE)					\
+    {											\
+      expr;										\
+      sum += digests[0];								\
+    }											\
+    gettimeofday(&end, NULL);								\
+    BK_TV_SUB(&delta, &end, &start);							\
+    printf("%-24s %10.1f MB/s\n", name, done / BK_TV2F(&delta) / 1e6);			\
+  } while (0)
+
+  for (a = 0; a < (int)(sizeof(algs) / sizeof(*algs)); a++)
+  {
+    char name[64];
+
+    snprintf(name, sizeof(name), "%s portable", algs[a].name);
+    BENCHDIGEST(name, bk_digest_buffer(B, algs[a].alg, buf, BENCH_BUFSIZE, digests, BK_DIGEST_PORTABLE));
+    BENCHDIGEST(algs[a].name, bk_digest_buffer(B, algs[a].alg, buf, BENCH_BUFSIZE, digests, 0));
+  }
+
+  BENCHDIGEST("MD5 1KB messages", for (i = 0; i < count; i++) bk_digest_buffer(B, BK_DIGEST_MD5, msgs[i].ptr, BENCH_SMALL, digests, 0));
+  BENCHDIGEST("MD5 1KB multi-buffer", bk_digest_multi(B, BK_DIGEST_MD5, msgs, count, digests, 0));
+
+  // Keep the compiler from discarding the work
+  if (sum == 0x12 && total == 1)
+    printf("\n");
+  free(msgs);
+  free(digests);
+  free(buf);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Convert a digest to hex.
+ *
+ *	@param digest Digest
+ *	@param len Length of digest
+ *	@param out Copy-out NUL terminated string, 2*len+1 bytes
+ */
+static void hex(const u_char *digest, int len, char *out)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    snprintf(out + i * 2, 3, "%02x", digest[i]);
+}
+
+
+
+/**
+ * Send data over a socketpair from an ioh which digests what it writes
+ * to one which digests what it reads, while a reply goes back the
+ * other way undigested.  Then close the writing end and check both
+ * digests, finished as each ioh closed, match the data.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param data Data to send (FILTER_LEN bytes)
+ *	@param closeflags Flags for closing the writing end
+ *	@param bad Error count to increment
+ */
+static void checkfilter(bk_s B, const u_char *data, bk_flags closeflags, int *bad)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static char reply[] = "Undigested reply";
+  u_char ref[BK_DIGEST_MAXLEN];
+  struct filter_end wr, rd;
+  struct bk_run *run;
+  bk_vptr sent, back;
+  int sv[2], tries;
+
+  memset(&wr, 0, sizeof(wr));
+  memset(&rd, 0, sizeof(rd));
+  if (!(run = bk_run_init(B, 0)) || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+      !(wr.fe_buf = malloc(FILTER_LEN)) || !(rd.fe_buf = malloc(FILTER_LEN)) ||
+      !(wr.fe_digest = bk_digest_create(B, BK_DIGEST_SHA256, 0)) ||
+      !(rd.fe_digest = bk_digest_create(B, BK_DIGEST_SHA256, 0)))
+    bk_die(B, 1, stderr, _("Could not allocate filter test\n"), BK_WARNDIE_WANTDETAILS);
+
+  if (!(wr.fe_ioh = bk_ioh_init(B, NULL, sv[0], sv[0], filter_handler, &wr, 4096, 0, 0, run, BK_IOH_STREAM|BK_IOH_RAW)) ||
+      !(rd.fe_ioh = bk_ioh_init(B, NULL, sv[1], sv[1], filter_handler, &rd, 4096, 0, 0, run, BK_IOH_STREAM|BK_IOH_RAW)) ||
+      bk_digest_ioh_filter(B, wr.fe_ioh, NULL, wr.fe_digest, 0) < 0 ||
+      bk_digest_ioh_filter(B, rd.fe_ioh, rd.fe_digest, NULL, 0) < 0)
+    bk_die(B, 1, stderr, _("Could not create filtered ioh\n"), BK_WARNDIE_WANTDETAILS);
+
+  sent.ptr = (void *)data;
+  sent.len = FILTER_LEN;
+  back.ptr = reply;
+  back.len = sizeof(reply) - 1;
+  if (bk_ioh_write(B, wr.fe_ioh, &sent, 0) < 0 || bk_ioh_write(B, rd.fe_ioh, &back, 0) < 0)
+    bk_die(B, 1, stderr, _("Could not write to filtered ioh\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (tries = 0; tries < FILTER_TRIES && wr.fe_len < back.len; tries++)
+  {
+    bk_run_once(B, run, BK_RUN_ONCE_FLAG_DONT_BLOCK);
+    usleep(1000);
+  }
+
+  bk_ioh_close(B, wr.fe_ioh, closeflags);
+
+  for (; tries < FILTER_TRIES && (wr.fe_ioh || rd.fe_ioh); tries++)
+  {
+    bk_run_once(B, run, BK_RUN_ONCE_FLAG_DONT_BLOCK);
+    if (!wr.fe_ioh && sv[0] >= 0 && BK_FLAG_ISSET(closeflags, BK_IOH_DONTCLOSEFDS))
+    {
+      close(sv[0]);
+      sv[0] = -1;
+    }
+    usleep(1000);
+  }
+
+  bk_digest_buffer(B, BK_DIGEST_SHA256, data, FILTER_LEN, ref, 0);
+
+  if (wr.fe_ioh || memcmp(wr.fe_final, ref, bk_digest_length(B, BK_DIGEST_SHA256)) ||
+      wr.fe_len != back.len || memcmp(wr.fe_buf, reply, back.len))
+  {
+    fprintf(stderr, "Digest of data written to ioh (close flags %x) differs\n", closeflags);
+    (*bad)++;
+  }
+
+  if (rd.fe_ioh || !rd.fe_eof || rd.fe_len != FILTER_LEN || memcmp(rd.fe_final, ref, bk_digest_length(B, BK_DIGEST_SHA256)))
+  {
+    fprintf(stderr, "Digest of %zu bytes read from ioh (close flags %x) differs\n", rd.fe_len, closeflags);
+    (*bad)++;
+  }
+
+  if (wr.fe_ioh)
+    bk_ioh_close(B, wr.fe_ioh, BK_IOH_ABORT);
+  if (rd.fe_ioh)
+    bk_ioh_close(B, rd.fe_ioh, BK_IOH_ABORT);
+  if (sv[0] >= 0 && BK_FLAG_ISSET(closeflags, BK_IOH_DONTCLOSEFDS))
+    close(sv[0]);
+  bk_run_destroy(B, run);
+  bk_digest_destroy(B, wr.fe_digest);
+  bk_digest_destroy(B, rd.fe_digest);
+  free(wr.fe_buf);
+  free(rd.fe_buf);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * ioh handler for the filter test: collect what is read, close at end
+ * of file, and finish the digest once the ioh is closing.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param data Data read
+ *	@param opaque Test end
+ *	@param ioh The ioh
+ *	@param state_flags What happened
+ */
+static void filter_handler(bk_s B, bk_vptr *data, void *opaque, struct bk_ioh *ioh, bk_ioh_status_e state_flags)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct filter_end *fe = opaque;
+
+  switch (state_flags)
+  {
+  case BkIohStatusReadComplete:
+    for (; data && data->ptr; data++)
+    {
+      if (fe->fe_len + data->len <= FILTER_LEN)
+	memcpy(fe->fe_buf + fe->fe_len, data->ptr, data->len);
+      fe->fe_len += data->len;
+    }
+    break;
+
+  case BkIohStatusIohReadEOF:
+  case BkIohStatusIohReadError:
+    fe->fe_eof = (state_flags == BkIohStatusIohReadEOF);
+    bk_ioh_close(B, ioh, 0);
+    break;
+
+  case BkIohStatusIohClosing:
+    bk_digest_final(B, fe->fe_digest, fe->fe_final);
+    fe->fe_ioh = NULL;
+    break;
+
+  default:
+    break;
+  }
+
+  BK_VRETURN(B);
+}
@@ -30,7 +30,8 @@ struct global_structure
 {
   bk_flags	gs_flags;
   int		gs_sysloglevel;
-} Global = { 0, BK_ERR_NONE };
+  const char   *gs_profile;
+} Global = { 0, BK_ERR_NONE, NULL };
 
 
 enum command
@@ -41,6 +42,7 @@ enum command
   badreturn,
   funon,
   funoff,
+  flipdebug,
 };
 
 
@@ -69,6 +71,7 @@ main(int argc, char **argv, char **envp)
     {"debug", 'd', POPT_ARG_NONE, NULL, 'd', "Turn on debugging", NULL },
     {"syslog-level", 's', POPT_ARG_INT, NULL, 's', "Syslog level (default 0=debug)", NULL },
     {"no-seatbelts", 'n', POPT_ARG_NONE, NULL, 'n', "Sealtbelts off & speed up", NULL },
+    {"profile", 'p', POPT_ARG_STRING, NULL, 'p', "Write folded sampling profile of the noop loop to file", "file" },
     POPT_AUTOHELP
     POPT_TABLEEND
   };
@@ -96,6 +99,9 @@ main(int argc, char **argv, char **envp)
       BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
       FUN_ON = 0;
       break;
+    case 'p':
+      Global.gs_profile = poptGetOptArg(optCon);
+      break;
     case 's':
       arg = poptGetOptArg(optCon);
       Global.gs_sysloglevel = BK_ERR_DEBUG - atoi(arg ? arg : "0");
@@ -155,6 +161,8 @@ void progrun(bk_s B)
 {
   BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
   int x;
+  struct bk_profile *bp = NULL;
+  FILE *fh;
 
   recurse(B, 9, badreturn);
   recurse(B, 9, trace);
@@ -167,9 +175,24 @@ void progrun(bk_s B)
   recurse(B, 9, funon);
   if (FUN_ON)
     bk_fun_set(B, BK_FUN_ON, 0);
+  if (Global.gs_profile && !(bp = bk_profile_create(B, 997, 0, 0)))
+    fprintf(stderr, "Could not create profiler\n");
   for(x=0;x<9999;x++)
+  {
     recurse(B, 999, noop);
+    if (bp && !(x % 100))
+      bk_profile_collect(B, bp, 0);
+  }
+  if (bp)
+  {
+    if (!(fh = fopen(Global.gs_profile, "w")) || bk_profile_dump(B, bp, fh, 0) < 0)
+      fprintf(stderr, "Could not write profile to %s\n", Global.gs_profile);
+    if (fh)
+      fclose(fh);
+    bk_profile_destroy(B, bp);
+  }
   recurse(B, 999, resetdebug);
+  recurse(B, 9, flipdebug);
 
   BK_VRETURN(B);
 }
@@ -224,6 +247,18 @@ void recurse2(bk_s B, int levels, enum command cmd)
       if (FUN_ON)
 	bk_fun_set(B, BK_FUN_OFF, 0);
       break;
+    case flipdebug:
+      // Debug level changes must be seen by frames already on the stack
+      if (FUN_ON && BK_GENERAL_FLAG_ISDEBUGON(B))
+      {
+	bk_debug_set(B, BK_GENERAL_DEBUG(B), __FUNCTION__, 0x80);
+	if (!bk_debug_and(B, 0x80))
+	  fprintf(stderr, "Runtime debug level change not noticed\n");
+	bk_debug_set(B, BK_GENERAL_DEBUG(B), __FUNCTION__, 0);
+	if (bk_debug_and(B, 0x80))
+	  fprintf(stderr, "Runtime debug level reset not noticed\n");
+      }
+      break;
     }
 
   if (cmd == badreturn)
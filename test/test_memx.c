@@ -0,0 +1,441 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Test both growth modes of bk_memx, and optionally benchmark them on
+ * a stream of appends consumed from the front.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_BYTES	      300000		///< Bytes streamed in functional test
+#define BENCH_RECORD	      1500		///< Size of each append in benchmark
+#define BENCH_CHUNK	      65536		///< Growth increment and consume size in benchmark
+#define BENCH_WINDOW	      (256*1024)	///< Smallest backlog buffered before benchmark consumes
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_benchmb;		///< Megabytes to stream in benchmark
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static int memxcheck(bk_s B, struct bk_memx *bm, size_t first, size_t count);
+static void progbench(bk_s B, struct program_config *pc);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Compare segmented and realloc append-and-consume speed"), N_("megabytes") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_benchmb = atoi(poptGetOptArg(optCon));
+      if (pc->pc_benchmb < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_benchmb)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Stream a pattern through an ordinary and a segmented memx in uneven
+ * appends and lops, checking the contents of both as it goes.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct bk_memx *bm, *sm = NULL;
+  char data[1000], *first, *elem;
+  size_t head = 0, tail = 0, used, alloc;
+  u_int len, count, segs;
+  int i, bad = 0;
+
+  if (!(bm = bk_memx_create(B, 1, 16, 100, 0)) ||
+      !(sm = bk_memx_create(B, 1, 16, 100, BK_MEMX_SEGMENTED)))
+    bk_die(B, 1, stderr, _("Could not create memx\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (i = 0; tail < TEST_BYTES; i++)
+  {
+    // Appends both smaller and larger than the chunk size
+    len = (i * 37) % (i % 5 ? 90 : sizeof(data)) + 1;
+    for (count = 0; count < len; count++)
+      data[count] = (tail + count) % 251;
+
+    first = bk_memx_get(B, sm, 0, NULL, 0);
+    elem = bk_memx_new(B, sm, len, NULL, 0);
+    if (!elem || bk_memx_append(B, bm, data, len, 0) < 0)
+      bk_die(B, 1, stderr, _("Could not append\n"), BK_WARNDIE_WANTDETAILS);
+    memcpy(elem, data, len);
+    tail += len;
+
+    // Segmented elements never move
+    if (head < tail - len && first != bk_memx_get(B, sm, 0, NULL, 0))
+    {
+      fprintf(stderr, "Segmented memx moved its first element\n");
+      bad++;
+    }
+
+    if (i % 7 == 3)
+    {
+      len = (tail - head) * (i % 3 + 1) / 4;
+      if (bk_memx_lop(B, bm, len, 0) < 0 || bk_memx_lop(B, sm, len, 0) < 0)
+	bad++;
+      head += len;
+    }
+
+    if (i % 50 == 0)
+      bad += memxcheck(B, bm, head, tail - head) + memxcheck(B, sm, head, tail - head);
+  }
+
+  // Removing the tail needs to free segments
+  len = (tail - head) / 2;
+  if (bk_memx_trunc(B, bm, len, 0) < 0 || bk_memx_trunc(B, sm, len, 0) < 0)
+    bad++;
+  tail = head + len;
+  bad += memxcheck(B, bm, head, len) + memxcheck(B, sm, head, len);
+
+  // Consuming everything leaves one empty segment to start over with
+  if (bk_memx_lop(B, sm, len, 0) < 0 || bk_memx_lop(B, sm, 1, 0) == 0 ||
+      bk_memx_segment(B, sm, 0, NULL, 0) || bk_memx_info(B, sm, NULL, NULL, &alloc, &used, NULL, NULL, 0) < 0 ||
+      used || !alloc)
+  {
+    fprintf(stderr, "Segmented memx is not empty after consuming everything\n");
+    bad++;
+  }
+  elem = bk_memx_new(B, sm, 3, NULL, 0);
+  if (!elem || bk_memx_get(B, sm, 0, NULL, 0) != elem || bk_memx_get(B, sm, 3, NULL, 0) != elem + 3)
+    bad++;
+
+  for (segs = 0; bk_memx_segment(B, bm, segs, NULL, 0); segs++)
+    ; // Void
+  if (segs != 1 || bk_memx_addstr(B, sm, "no", 0) == 0)
+    bad++;
+
+  if (bad)
+  {
+    fprintf(stderr, "%d memx errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+
+  bk_memx_destroy(B, bm, 0);
+  bk_memx_destroy(B, sm, 0);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Check that a byte memx holds the test pattern, through indexing, the
+ * segment walk, and the iovec export.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param bm memx to check
+ *	@param first Stream offset of first byte in memx
+ *	@param count Bytes which should be in memx
+ *	@return <i>number of errors</i>
+ */
+static int memxcheck(bk_s B, struct bk_memx *bm, size_t first, size_t count)
+{
+  struct iovec iov[64];
+  size_t off, total = 0;
+  u_int segs, n;
+  int bad = 0, iovcnt;
+  char *elem;
+
+  for (off = 0; off < count; off += off % 3 + 1)
+  {
+    if (!(elem = bk_memx_get(B, bm, off, NULL, 0)) || *elem != (char)((first + off) % 251))
+    {
+      fprintf(stderr, "Element %zu is wrong\n", off);
+      return(1);
+    }
+  }
+
+  for (segs = 0; (elem = bk_memx_segment(B, bm, segs, &n, 0)); segs++)
+  {
+    if (!n || *elem != (char)((first + total) % 251) || elem[n-1] != (char)((first + total + n - 1) % 251))
+      bad++;
+    total += n;
+  }
+
+  iovcnt = bk_memx_iovec(B, bm, iov, 64, 0);
+  if (total != count || iovcnt != (int)MIN(segs, 64) ||
+      (iovcnt > 0 && iov[0].iov_base != bk_memx_get(B, bm, 0, NULL, 0)))
+  {
+    fprintf(stderr, "Segments hold %zu bytes in %u pieces (%d iov), expected %zu\n", total, segs, iovcnt, count);
+    bad++;
+  }
+
+  return(bad);
+}
+
+
+
+/**
+ * Stream the requested amount of data through each kind of memx, in
+ * 1500 byte appends, writing out (via the segment list) and lopping
+ * 64KB whenever more than a window is buffered.  Each pass uses a
+ * window 16 times larger; the cost of the realloc mode's lop grows with
+ * it, so past a few MB that mode is not worth waiting for.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  size_t total = (size_t)pc->pc_benchmb * 1024 * 1024;
+  size_t window, done, used = 0;
+  struct timeval start, end, delta;
+  struct bk_memx *bm;
+  char record[BENCH_RECORD], *elem;
+  u_long sum;
+  u_int n, cur;
+  int mode, pass;
+  void *seg;
+
+  memset(record, 'x', sizeof(record));
+
+  for (pass = 0, window = BENCH_WINDOW; pass < 2; pass++, window *= 16)
+  {
+    printf("%zu MB, consuming beyond %zu KB buffered\n", total >> 20, window >> 10);
+
+    for (mode = 0; mode < 2; mode++)
+    {
+      gettimeofday(&start, NULL);
+      if (!(bm = bk_memx_create(B, 1, BENCH_CHUNK, BENCH_CHUNK, mode ? BK_MEMX_SEGMENTED : 0)))
+	bk_die(B, 1, stderr, _("Could not create memx\n"), BK_WARNDIE_WANTDETAILS);
+
+      for (done = 0, sum = 0; done < total || used; )
+      {
+	if (done < total)
+	{
+	  if (!(elem = bk_memx_new(B, bm, BENCH_RECORD, &cur, 0)))
+	    bk_die(B, 1, stderr, _("Could not append\n"), BK_WARNDIE_WANTDETAILS);
+	  memcpy(elem, record, BENCH_RECORD);
+	  done += BENCH_RECORD;
+	  used = cur;
+	}
+	else
+	{
+	  bk_memx_info(B, bm, NULL, NULL, NULL, &used, NULL, NULL, 0);
+	}
+
+	// Stand-in for write(2): touch the start of the data to be consumed
+	if (used > window || (done >= total && used))
+	{
+	  if ((seg = bk_memx_segment(B, bm, 0, &n, 0)))
+	    sum += *(char *)seg;
+	  bk_memx_lop(B, bm, MIN(used, BENCH_CHUNK), 0);
+	  used -= MIN(used, BENCH_CHUNK);
+	}
+      }
+
+      gettimeofday(&end, NULL);
+      BK_TV_SUB(&delta, &end, &start);
+      printf("  %-10s %8.3f s  %8.2f MB/s\n", mode ? "segmented" : "realloc", BK_TV2F(&delta),
+	     (total >> 20) / BK_TV2F(&delta));
+      if (sum != (done + BENCH_CHUNK - 1) / BENCH_CHUNK * 'x')
+	bk_die(B, 1, stderr, _("Consumed the wrong data\n"), BK_WARNDIE_WANTDETAILS);
+      bk_memx_destroy(B, bm, 0);
+    }
+  }
+
+  BK_VRETURN(B);
+}
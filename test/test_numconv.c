@@ -0,0 +1,603 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Check the bk_string_ato* number conversions, one at a time and in
+ * batches, against the C library, and optionally time them.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_ROUNDS	      200000		///< Random numbers checked of each kind
+#define TEST_BATCH	      1000		///< Numbers in each batch checked
+#define BENCH_COUNT	      100000		///< Numbers converted per measurement
+#define NUMLEN		      64		///< Longest number printed
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_bench;		///< Measurements of each conversion
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static u_int64_t random64(void);
+static double random_double(void);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Time conversions"), N_("rounds") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_bench = atoi(poptGetOptArg(optCon));
+      if (pc->pc_bench < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_bench)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Check conversions with known answers, then random numbers printed by
+ * the C library, converted one at a time and in batches.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const struct
+  {
+    const char *	str;			// String to convert
+    bk_flags		flags;			// Conversion flags
+    int			ret;			// Expected return
+    int64_t		value;			// Expected value
+  } ints[] =
+  {
+    { "0", 0, 0, 0 },
+    { "  42\t", 0, 0, 42 },
+    { "-17", 0, 0, -17 },
+    { "", 0, 1, 0 },
+    { "0x", 0, 1, 0 },
+    { "58foo", 0, 1, 58 },
+    { "0x58foo", 0, 1, 0x58f },
+    { "010", 0, 0, 8 },
+    { "08", 0, 0, 8 },
+    { "010", BK_STRING_ATOI_FLAG_DEC, 0, 10 },
+    { "ff", BK_STRING_ATOI_FLAG_HEX, 0, 255 },
+    { "Hello", 0, -1, 0 },
+    { "- 1", 0, -1, 0 },
+    { "0000000000000000000000000000000000001", 0, 0, 1 },
+    { "9223372036854775807", 0, 0, INT64_MAX },
+    { "-9223372036854775808", 0, 0, INT64_MIN },
+    { "9223372036854775808", 0, -1, 0 },
+    { "0x7fffffffffffffff", 0, 0, INT64_MAX },
+    { "0xABCDEFabcdef1234", 0, -1, 0 },
+    { "0x0abcdefABCDEF123", 0, 0, 0x0abcdefabcdef123LL },
+    { "0777777777777777777777", 0, 0, INT64_MAX },
+    { "01000000000000000000000", 0, -1, 0 },
+  };
+  static const struct
+  {
+    const char *	str;			// String to convert
+    int			ret;			// Expected return
+    double		value;			// Expected value
+  } doubles[] =
+  {
+    { "0", 0, 0.0 },
+    { " 1.5 ", 0, 1.5 },
+    { "-.25", 0, -0.25 },
+    { "1e3x", 1, 1000.0 },
+    { "1e", 1, 1.0 },
+    { "0x10", 0, 16.0 },
+    { "1e400", -1, 0 },
+    { "1e-400", -1, 0 },
+    { ".", -1, 0 },
+    { "9007199254740993", 0, 9007199254740992.0 },
+    { "2.2250738585072011e-308", 0, 2.2250738585072011e-308 },
+    { "4.9406564584124654e-324", 0, 4.9406564584124654e-324 },
+    { "1.7976931348623157e308", 0, 1.7976931348623157e308 },
+    { "0.1000000000000000055511151231257827021181583404541015625", 0, 0.1 },
+  };
+  char str[NUMLEN], *buf, *p;
+  u_int64_t *u64s, *u64out;
+  double *dbls, *dblout, d, ref;
+  int64_t *i64s, *i64out, i64;
+  size_t used, off, n, i;
+  int bad = 0, round, ret;
+  u_int64_t u64;
+  ssize_t got;
+  float f, fref;
+
+  // The C library, which is checked against, must use '.' too
+  setlocale(LC_NUMERIC, "C");
+
+  for (i = 0; i < sizeof(ints) / sizeof(*ints); i++)
+  {
+    i64 = 0;
+    ret = bk_string_atoi64(B, ints[i].str, &i64, ints[i].flags);
+    if (ret != ints[i].ret || (ret >= 0 && i64 != ints[i].value))
+    {
+      fprintf(stderr, "\"%s\" gave %d and %lld\n", ints[i].str, ret, (long long)i64);
+      bad++;
+    }
+  }
+
+  for (i = 0; i < sizeof(doubles) / sizeof(*doubles); i++)
+  {
+    d = 0;
+    ret = bk_string_atod(B, doubles[i].str, &d, 0);
+    if (ret != doubles[i].ret || (ret >= 0 && d != doubles[i].value))
+    {
+      fprintf(stderr, "\"%s\" gave %d and %.17g\n", doubles[i].str, ret, d);
+      bad++;
+    }
+  }
+
+  for (round = 0; round < TEST_ROUNDS; round++)
+  {
+    u64 = random64() >> (random() % 64);
+
+    snprintf(str, sizeof(str), "%llu", (unsigned long long)u64);
+    if (bk_string_atou64(B, str, &u64, 0) != 0 || strtoull(str, NULL, 10) != u64)
+    {
+      fprintf(stderr, "\"%s\" converted wrongly\n", str);
+      bad++;
+    }
+
+    snprintf(str, sizeof(str), "%#llx", (unsigned long long)u64);
+    if (u64 && (bk_string_atou64(B, str, &u64, 0) != 0 || strtoull(str, NULL, 16) != u64))
+    {
+      fprintf(stderr, "\"%s\" converted wrongly\n", str);
+      bad++;
+    }
+
+    snprintf(str, sizeof(str), "%lld", (long long)u64);
+    if (bk_string_atoi64(B, str, &i64, 0) != 0 || (u_int64_t)i64 != u64)
+    {
+      fprintf(stderr, "\"%s\" converted wrongly\n", str);
+      bad++;
+    }
+
+    // One more digit must not fit
+    if (u64 >= UINT64_MAX / 10)
+    {
+      snprintf(str, sizeof(str), "%llu7", (unsigned long long)u64);
+      if (bk_string_atou64(B, str, &u64, 0) >= 0)
+      {
+	fprintf(stderr, "\"%s\" did not overflow\n", str);
+	bad++;
+      }
+    }
+
+    d = random_double();
+    switch (random() % 3)
+    {
+    case 0:
+      snprintf(str, sizeof(str), "%.*g", (int)(random() % 17) + 1, d);
+      break;
+    case 1:
+      snprintf(str, sizeof(str), "%.*e", (int)(random() % 25), d);
+      break;
+    default:
+      snprintf(str, sizeof(str), "%.*f", (int)(random() % 10), fmod(d, 1e12));
+      break;
+    }
+
+    errno = 0;
+    ref = strtod(str, NULL);
+    if (errno != ERANGE && (bk_string_atod(B, str, &d, 0) != 0 || memcmp(&d, &ref, sizeof(d))))
+    {
+      fprintf(stderr, "\"%s\" converted to %.17g, not %.17g\n", str, d, ref);
+      bad++;
+    }
+
+    errno = 0;
+    fref = strtof(str, NULL);
+    if (errno != ERANGE && isfinite(fref) && (fref == 0.0 || fabsf(fref) >= FLT_MIN) &&
+	(bk_string_atof(B, str, &f, 0) != 0 || memcmp(&f, &fref, sizeof(f))))
+    {
+      fprintf(stderr, "\"%s\" converted to %.9g, not %.9g\n", str, f, fref);
+      bad++;
+    }
+  }
+
+  u64s = malloc(TEST_BATCH * sizeof(*u64s));
+  u64out = malloc(TEST_BATCH * sizeof(*u64out));
+  i64s = malloc(TEST_BATCH * sizeof(*i64s));
+  i64out = malloc(TEST_BATCH * sizeof(*i64out));
+  dbls = malloc(TEST_BATCH * sizeof(*dbls));
+  dblout = malloc(TEST_BATCH * sizeof(*dblout));
+  buf = malloc(TEST_BATCH * NUMLEN);
+  if (!u64s || !u64out || !i64s || !i64out || !dbls || !dblout || !buf)
+    bk_die(B, 1, stderr, _("Could not allocate test data\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (round = 0; round < 20; round++)
+  {
+    // Unsigned, with blanks around some, converted in random sized pieces
+    for (i = 0, p = buf; i < TEST_BATCH; i++)
+    {
+      u64s[i] = random64() >> (random() % 64);
+      p += sprintf(p, "%s%llu%s\n", random() % 4 ? "" : " \t", (unsigned long long)u64s[i], random() % 4 ? "" : " ");
+    }
+    for (off = n = 0; n < TEST_BATCH; off += used, n += got)
+    {
+      if ((got = bk_string_atou64_batch(B, buf + off, p - buf - off, '\n', u64out + n, random() % 100 + 1, &used, 0)) <= 0)
+	break;
+    }
+    if (n != TEST_BATCH || off != (size_t)(p - buf) || memcmp(u64s, u64out, TEST_BATCH * sizeof(*u64s)))
+    {
+      fprintf(stderr, "Unsigned batch converted wrongly\n");
+      bad++;
+    }
+
+    // Signed, in hex, all at once, without a final delimiter
+    for (i = 0, p = buf; i < TEST_BATCH; i++)
+    {
+      i64s[i] = (int64_t)(random64() >> 1) >> (random() % 63);
+      if (random() % 2)
+	i64s[i] = -i64s[i];
+      p += sprintf(p, "%s%llx,", i64s[i] < 0 ? "-" : "", (unsigned long long)(i64s[i] < 0 ? 0 - (u_int64_t)i64s[i] : (u_int64_t)i64s[i]));
+    }
+    if (bk_string_atoi64_batch(B, buf, p - buf - 1, ',', i64out, TEST_BATCH, &used, BK_STRING_ATOI_FLAG_HEX) != TEST_BATCH ||
+	used != (size_t)(p - buf - 1) || memcmp(i64s, i64out, TEST_BATCH * sizeof(*i64s)))
+    {
+      fprintf(stderr, "Signed batch converted wrongly\n");
+      bad++;
+    }
+
+    // Floating point, including some the C library has to do
+    for (i = 0, p = buf; i < TEST_BATCH; i++)
+    {
+      if (random() % 50)
+      {
+	dbls[i] = random_double();
+	p += sprintf(p, "%.17g;", dbls[i]);
+      }
+      else
+      {
+	dbls[i] = INFINITY;
+	p += sprintf(p, "inf;");
+      }
+    }
+    if (bk_string_atod_batch(B, buf, p - buf, ';', dblout, TEST_BATCH, &used, BK_STRING_ATOD_FLAG_ALLOW_INF) != TEST_BATCH ||
+	used != (size_t)(p - buf) || memcmp(dbls, dblout, TEST_BATCH * sizeof(*dbls)))
+    {
+      fprintf(stderr, "Floating point batch converted wrongly\n");
+      bad++;
+    }
+  }
+
+  // A bad number stops the batch and says where it is
+  if (bk_string_atou64_batch(B, "1,2, x,4", 8, ',', u64out, TEST_BATCH, &used, 0) != -1 || used != 4 ||
+      bk_string_atou64_batch(B, "1,2,,4", 6, ',', u64out, TEST_BATCH, &used, 0) != -1 || used != 4 ||
+      bk_string_atoi64_batch(B, "1,9223372036854775808", 21, ',', i64out, TEST_BATCH, &used, 0) != -1 || used != 2 ||
+      bk_string_atod_batch(B, "1.5,2.5e999", 11, ',', dblout, TEST_BATCH, &used, 0) != -1 || used != 4)
+  {
+    fprintf(stderr, "Bad numbers in batches not caught\n");
+    bad++;
+  }
+
+  free(buf);
+  free(dblout);
+  free(dbls);
+  free(i64out);
+  free(i64s);
+  free(u64out);
+  free(u64s);
+
+  if (bad)
+  {
+    fprintf(stderr, "%d conversion errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Time conversions of integers and floating point numbers, against the
+ * C library, and in batches.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  char (*decs)[NUMLEN], (*hexes)[NUMLEN], (*dbls)[NUMLEN], *decbuf, *dblbuf, *p, *q;
+  struct timeval start, end, delta;
+  u_int64_t *u64s, u64, sum = 0;
+  double *doubles, d, dsum = 0;
+  int i, r;
+
+#define BENCHNUM(name, expr)								\
+  do {											\
+    double best = 0;									\
+											\
+    for (r = 0; r < pc->pc_bench; r++)							\
+    {											\
+      gettimeofday(&start, NULL);							\
+      expr;										\
+      gettimeofday(&end, NULL);								\
+      BK_TV_SUB(&delta, &end, &start);							\
+      if (!r || BK_TV2F(&delta) < best)							\
+	best = BK_TV2F(&delta);								\
+    }											\
+    printf("%-28s %8.1f M/s\n", name, BENCH_COUNT / best / 1e6);			\
+  } while (0)
+
+  decs = malloc(BENCH_COUNT * sizeof(*decs));
+  hexes = malloc(BENCH_COUNT * sizeof(*hexes));
+  dbls = malloc(BENCH_COUNT * sizeof(*dbls));
+  decbuf = malloc(BENCH_COUNT * NUMLEN);
+  dblbuf = malloc(BENCH_COUNT * NUMLEN);
+  u64s = malloc(BENCH_COUNT * sizeof(*u64s));
+  doubles = malloc(BENCH_COUNT * sizeof(*doubles));
+  if (!decs || !hexes || !dbls || !decbuf || !dblbuf || !u64s || !doubles)
+    bk_die(B, 1, stderr, _("Could not allocate benchmark data\n"), BK_WARNDIE_WANTDETAILS);
+
+  p = decbuf;
+  q = dblbuf;
+  for (i = 0; i < BENCH_COUNT; i++)
+  {
+    u64 = random64() >> (random() % 64);
+    snprintf(decs[i], NUMLEN, "%llu", (unsigned long long)u64);
+    snprintf(hexes[i], NUMLEN, "%llx", (unsigned long long)u64);
+    snprintf(dbls[i], NUMLEN, "%.*g", random() % 2 ? 17 : 6, random_double());
+    p += sprintf(p, "%s,", decs[i]);
+    q += sprintf(q, "%s,", dbls[i]);
+  }
+
+  BENCHNUM("strtoull", for (i = 0; i < BENCH_COUNT; i++) sum += strtoull(decs[i], NULL, 10));
+  BENCHNUM("bk_string_atou64", for (i = 0; i < BENCH_COUNT; i++) { bk_string_atou64(B, decs[i], &u64, 0); sum += u64; });
+  BENCHNUM("bk_string_atou64_batch", bk_string_atou64_batch(B, decbuf, p - decbuf, ',', u64s, BENCH_COUNT, NULL, 0));
+  BENCHNUM("strtoull hex", for (i = 0; i < BENCH_COUNT; i++) sum += strtoull(hexes[i], NULL, 16));
+  BENCHNUM("bk_string_atou64 hex", for (i = 0; i < BENCH_COUNT; i++) { bk_string_atou64(B, hexes[i], &u64, BK_STRING_ATOI_FLAG_HEX); sum += u64; });
+  BENCHNUM("strtod", for (i = 0; i < BENCH_COUNT; i++) dsum += strtod(dbls[i], NULL));
+  BENCHNUM("bk_string_atod", for (i = 0; i < BENCH_COUNT; i++) { bk_string_atod(B, dbls[i], &d, 0); dsum += d; });
+  BENCHNUM("bk_string_atod_batch", bk_string_atod_batch(B, dblbuf, q - dblbuf, ',', doubles, BENCH_COUNT, NULL, 0));
+
+  // Keep the compiler from discarding the work
+  if (sum == 0x12 && dsum == 0.5)
+    printf("\n");
+
+  free(doubles);
+  free(u64s);
+  free(dblbuf);
+  free(decbuf);
+  free(dbls);
+  free(hexes);
+  free(decs);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Random 64-bit number.
+ *
+ *	@return <i>number</i>
+ */
+static u_int64_t random64(void)
+{
+  return(((u_int64_t)random() << 42) ^ ((u_int64_t)random() << 21) ^ (u_int64_t)random());
+}
+
+
+
+/**
+ * Random finite double, from anywhere in the range.
+ *
+ *	@return <i>number</i>
+ */
+static double random_double(void)
+{
+  u_int64_t bits;
+  double d;
+
+  do
+  {
+    bits = random64();
+    memcpy(&d, &bits, sizeof(d));
+  } while (!isfinite(d));
+
+  return(d);
+}
@@ -50,14 +50,42 @@ struct global_structure
 struct program_config
 {
   struct bk_pnode      *pc_pn;			///< Patricia Trie
+  int			pc_benchroutes;		///< Routes for lookup benchmark
+  int			pc_benchwidth;		///< Address width for lookup benchmark
   bk_flags		pc_flags;		///< Flags are fun!
 #define PC_VERBOSE	0x001			///< Verbose output
+#define PC_ARENA	0x002			///< Allocate tree from an arena
 };
 
 
 
 static int proginit(bk_s B, struct program_config *pc, int argc, char **argv);
 static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static void progrcu(bk_s B, struct program_config *pc);
+#ifdef BK_USING_PTHREADS
+static void *rcu_reader(bk_s B, void *opaque);
+#endif /* BK_USING_PTHREADS */
+
+
+
+#define RCU_ROUTES	20000			///< Route pool for lock-free tree tests
+#define RCU_UPDATES	200000			///< Updates applied by lock-free tree tests
+#define RCU_READERS	4			///< Reader threads for lock-free tree tests
+
+/**
+ * Route pool and reader state for the lock-free tree tests
+ */
+struct rcu_test
+{
+  struct bk_prcu       *rt_tree;		///< Tree under test
+  u_char		rt_keys[RCU_ROUTES][4];	///< IPv4 prefixes
+  u_short		rt_lens[RCU_ROUTES];	///< Prefix lengths
+  int			rt_stop;		///< Readers should finish
+  int			rt_running;		///< Readers not yet finished
+  int64_t		rt_lookups;		///< Lookups done by readers
+  int			rt_bad;			///< Lookups returning a non-covering route
+};
 
 
 
@@ -89,6 +117,9 @@ main(int argc, char **argv, char **envp)
     {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
     {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
     {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Benchmark lookups in a random route table of this size"), N_("routes") },
+    {"ipv6", '6', POPT_ARG_NONE, NULL, '6', N_("Benchmark IPv6 instead of IPv4 routes"), NULL },
+    {"arena", 'a', POPT_ARG_NONE, NULL, 'a', N_("Allocate the tree from an arena"), NULL },
 
     POPT_AUTOHELP
     POPT_TABLEEND
@@ -176,6 +207,15 @@ main(int argc, char **argv, char **envp)
     case 0x1002:				// profiling
       bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
       break;
+    case 'b':					// benchmark
+      pc->pc_benchroutes = atoi(poptGetOptArg(optCon));
+      break;
+    case '6':					// ipv6
+      pc->pc_benchwidth = 128;
+      break;
+    case 'a':					// arena
+      BK_FLAG_SET(pc->pc_flags, PC_ARENA);
+      break;
     default:
       getopterr++;
       break;
@@ -209,7 +249,13 @@ main(int argc, char **argv, char **envp)
     bk_die(B, 254, stderr, _("Could not perform program initialization\n"), BK_FLAG_ISSET(pc->pc_flags, PC_VERBOSE)?BK_WARNDIE_WANTDETAILS:0);
   }
 
-  progrun(B, pc);
+  if (pc->pc_benchroutes > 0)
+    progbench(B, pc);
+  else
+  {
+    progrun(B, pc);
+    progrcu(B, pc);
+  }
 
   poptFreeContext(optCon);
   bk_exit(B, 0);
@@ -236,7 +282,10 @@ static int proginit(bk_s B, struct program_config *pc, int argc, char **argv)
     BK_RETURN(B, -1);
   }
 
-  pc->pc_pn = bk_patricia_create(B);
+  if (BK_FLAG_ISSET(pc->pc_flags, PC_ARENA))
+    pc->pc_pn = bk_patricia_create_arena(B, 0, 0);
+  else
+    pc->pc_pn = bk_patricia_create(B);
 
   BK_RETURN(B, 0);
 }
@@ -483,3 +532,325 @@ static void progrun(bk_s B, struct program_config *pc)
 
   BK_VRETURN(B);
 }
+
+
+
+
+/**
+ * Benchmark longest-prefix lookups of random addresses in a table of
+ * random routes (lengths spread over /8-/32, or /16-/64 for IPv6), with
+ * the plain tree, the compiled tree and compiled batch lookups, and check
+ * they all agree.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  int width = pc->pc_benchwidth ? pc->pc_benchwidth : 32;
+  int bytes = width / 8;
+  int nkeys = 1000000;
+  struct bk_pcompiled *bpc;
+  struct bk_pnode *loaded;
+  struct timeval start, end, delta;
+  size_t flatlen;
+  void *flat;
+  u_char route[16], *keys = NULL;
+  const u_char **keyp = NULL;
+  void **expect = NULL, **results = NULL;
+  int i, j, len, bad = 0;
+
+  if (!(keys = malloc(nkeys * bytes)) || !(keyp = malloc(nkeys * sizeof(*keyp))) ||
+      !(expect = malloc(nkeys * sizeof(*expect))) || !(results = malloc(nkeys * sizeof(*results))))
+    bk_die(B, 1, stderr, _("Could not allocate benchmark keys\n"), BK_WARNDIE_WANTDETAILS);
+
+#define BENCHREPORT(what)											\
+  do {														\
+    gettimeofday(&end, NULL);											\
+    BK_TV_SUB(&delta, &end, &start);										\
+    printf("%-24s %8.3f s  %8.2f Mlookups/s\n", what, BK_TV2F(&delta), nkeys / BK_TV2F(&delta) / 1000000.0);	\
+    gettimeofday(&start, NULL);											\
+  } while (0)
+
+#define STEPREPORT(what)											\
+  do {														\
+    gettimeofday(&end, NULL);											\
+    BK_TV_SUB(&delta, &end, &start);										\
+    printf("%-24s %8.3f s\n", what, BK_TV2F(&delta));								\
+    gettimeofday(&start, NULL);											\
+  } while (0)
+
+  printf("%d IPv%d routes, %d lookups\n", pc->pc_benchroutes, width == 32 ? 4 : 6, nkeys);
+  srandom(1);
+  gettimeofday(&start, NULL);
+  for (i = 0; i < pc->pc_benchroutes; i++)
+  {
+    len = width == 32 ? 8 + random() % 25 : 16 + random() % 49;
+    for (j = 0; j < bytes; j++)
+    {
+      route[j] = random();
+      if (j * 8 >= len)
+	route[j] = 0;
+      else if (j * 8 + 8 > len)
+	route[j] &= 0xff << (8 - (len - j * 8));
+    }
+    if (bk_patricia_insert(B, pc->pc_pn, route, len, (void *)(long)(i + 1), NULL) < 0)
+      bk_die(B, 1, stderr, _("Could not insert\n"), BK_WARNDIE_WANTDETAILS);
+  }
+  STEPREPORT(BK_FLAG_ISSET(pc->pc_flags, PC_ARENA) ? "build (arena)" : "build");
+
+  for (i = 0; i < nkeys; i++)
+  {
+    for (j = 0; j < bytes; j++)
+      keys[i * bytes + j] = random();
+    keyp[i] = keys + i * bytes;
+  }
+
+  if ((bpc = bk_patricia_compile(B, pc->pc_pn, width, BK_PATRICIA_REVERSE)))
+    bk_die(B, 1, stderr, _("Compiled a reversed-key tree\n"), 0);
+
+  gettimeofday(&start, NULL);
+  if (!(bpc = bk_patricia_compile(B, pc->pc_pn, width, 0)))
+    bk_die(B, 1, stderr, _("Could not compile tree\n"), BK_WARNDIE_WANTDETAILS);
+  STEPREPORT("compile");
+
+  for (i = 0; i < nkeys; i++)
+    expect[i] = bk_patricia_search(B, pc->pc_pn, (u_char *)keyp[i], width, BK_PATRICIA_PREFIX);
+  BENCHREPORT("patricia");
+
+  for (i = 0; i < nkeys; i++)
+    results[i] = bk_patricia_compiled_search(B, bpc, keyp[i]);
+  BENCHREPORT("compiled");
+  for (i = 0; i < nkeys; i++)
+    if (results[i] != expect[i])
+      bad++;
+
+  gettimeofday(&start, NULL);
+  bk_patricia_compiled_search_batch(B, bpc, keyp, nkeys, results);
+  BENCHREPORT("compiled batch");
+  for (i = 0; i < nkeys; i++)
+    if (results[i] != expect[i])
+      bad++;
+
+  bk_patricia_compiled_destroy(B, bpc);
+
+  gettimeofday(&start, NULL);
+  if (!(flat = bk_patricia_serialize(B, pc->pc_pn, NULL, NULL, &flatlen, 0)))
+    bk_die(B, 1, stderr, _("Could not serialize tree\n"), BK_WARNDIE_WANTDETAILS);
+  STEPREPORT("serialize");
+  if (!(loaded = bk_patricia_deserialize(B, flat, flatlen, NULL, NULL, 0)))
+    bk_die(B, 1, stderr, _("Could not deserialize tree\n"), BK_WARNDIE_WANTDETAILS);
+  STEPREPORT("deserialize");
+  printf("%-24s %8llu bytes\n", "flat size", (unsigned long long)flatlen);
+  free(flat);
+  for (i = 0; i < nkeys; i++)
+    if (bk_patricia_search(B, loaded, (u_char *)keyp[i], width, BK_PATRICIA_PREFIX) != expect[i])
+      bad++;
+
+  gettimeofday(&start, NULL);
+  bk_patricia_destroy(pc->pc_pn, NULL);
+  STEPREPORT(BK_FLAG_ISSET(pc->pc_flags, PC_ARENA) ? "destroy (arena)" : "destroy");
+  bk_patricia_destroy(loaded, NULL);
+  STEPREPORT("destroy (deserialized)");
+  free(results);
+  free(expect);
+  free(keyp);
+  free(keys);
+
+  if (bad)
+  {
+    fprintf(stderr, "%d compiled or deserialized lookups disagree with bk_patricia_search\n", bad);
+    exit(1);
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+
+/**
+ * Check that a route returned by a lookup covers the key
+ *
+ *	@param rt Route pool
+ *	@param route Data returned (index plus one)
+ *	@param key Key looked up
+ *	@return <i>1</i> if route is absent or covers key
+ */
+static int rcu_covers(struct rcu_test *rt, void *route, u_char *key)
+{
+  int r = (long)route - 1;
+  int b;
+
+  if (!route)
+    return(1);
+  if (r < 0 || r >= RCU_ROUTES)
+    return(0);
+  for (b = 0; b < rt->rt_lens[r]; b++)
+    if (((rt->rt_keys[r][b/8] ^ key[b/8]) >> (7 - b%8)) & 1)
+      return(0);
+  return(1);
+}
+
+
+
+#ifdef BK_USING_PTHREADS
+/**
+ * Look up random addresses until told to stop
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param opaque Route pool
+ *	@return <i>NULL</i>
+ */
+static void *rcu_reader(bk_s B, void *opaque)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct rcu_test *rt = opaque;
+  struct bk_prcu_reader *bprr;
+  unsigned int seed = (unsigned int)(long)&bprr;
+  u_char key[4];
+  int64_t lookups = 0;
+  int j;
+
+  if ((bprr = bk_patricia_rcu_reader_register(B, rt->rt_tree)))
+  {
+    while (!BK_ATOMIC_LOAD(&rt->rt_stop))
+    {
+      for (j = 0; j < 4; j++)
+	key[j] = rand_r(&seed);
+      if (!rcu_covers(rt, bk_patricia_rcu_search(B, rt->rt_tree, bprr, key, 32, BK_PATRICIA_PREFIX), key))
+	BK_ATOMIC_ADD(&rt->rt_bad, 1);
+      lookups++;
+    }
+    bk_patricia_rcu_reader_unregister(B, rt->rt_tree, bprr);
+  }
+
+  BK_ATOMIC_ADD(&rt->rt_lookups, lookups);
+  BK_ATOMIC_ADD(&rt->rt_running, -1);
+  BK_RETURN(B, NULL);
+}
+#endif /* BK_USING_PTHREADS */
+
+
+
+/**
+ * Churn a lock-free tree and a plain tree with the same random updates,
+ * with reader threads searching the lock-free one throughout, and check
+ * that readers only ever see covering routes, that a snapshot taken
+ * before the churn is unchanged by it, and that both trees agree at the
+ * end.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrcu(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct rcu_test *rt = NULL;
+  struct bk_pnode *plain = NULL, *initial = NULL, *snap;
+  struct bk_prcu_reader *bprr = NULL;
+  struct timeval start, end, delta;
+  char *present = NULL;
+  u_char key[4];
+  int i, j, r, len, bad = 0;
+
+  if (!BK_CALLOC(rt) || !(present = calloc(RCU_ROUTES, 1)) || !(plain = bk_patricia_create(B)) || !(initial = bk_patricia_create(B)) ||
+      !(rt->rt_tree = bk_patricia_rcu_create(B, 0)) || !(bprr = bk_patricia_rcu_reader_register(B, rt->rt_tree)))
+    bk_die(B, 1, stderr, _("Could not set up lock-free tree test\n"), BK_WARNDIE_WANTDETAILS);
+
+  srandom(2);
+  for (i = 0; i < RCU_ROUTES; i++)
+  {
+    len = rt->rt_lens[i] = 8 + random() % 25;
+    for (j = 0; j < 4; j++)
+    {
+      rt->rt_keys[i][j] = random();
+      if (j * 8 >= len)
+	rt->rt_keys[i][j] = 0;
+      else if (j * 8 + 8 > len)
+	rt->rt_keys[i][j] &= 0xff << (8 - (len - j * 8));
+    }
+  }
+
+  // Half the pool, then a snapshot which must survive the churn intact
+  for (i = 0; i < RCU_ROUTES; i += 2)
+  {
+    bk_patricia_rcu_insert(B, rt->rt_tree, rt->rt_keys[i], rt->rt_lens[i], (void *)(long)(i + 1), NULL);
+    bk_patricia_insert(B, plain, rt->rt_keys[i], rt->rt_lens[i], (void *)(long)(i + 1), NULL);
+    bk_patricia_insert(B, initial, rt->rt_keys[i], rt->rt_lens[i], (void *)(long)(i + 1), NULL);
+    present[i] = 1;
+  }
+  snap = bk_patricia_rcu_read_enter(rt->rt_tree, bprr);
+
+#ifdef BK_USING_PTHREADS
+  for (i = 0; i < RCU_READERS; i++)
+  {
+    BK_ATOMIC_ADD(&rt->rt_running, 1);
+    if (!bk_general_thread_create(B, "rcu reader", rcu_reader, rt, 0))
+      BK_ATOMIC_ADD(&rt->rt_running, -1);
+  }
+#endif /* BK_USING_PTHREADS */
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < RCU_UPDATES; i++)
+  {
+    r = random() % RCU_ROUTES;
+    if (present[r])
+    {
+      bk_patricia_rcu_delete(B, rt->rt_tree, rt->rt_keys[r], rt->rt_lens[r]);
+      bk_patricia_delete(B, plain, rt->rt_keys[r], rt->rt_lens[r]);
+      present[r] = 0;
+    }
+    else
+    {
+      void *old = NULL;
+
+      bk_patricia_rcu_insert(B, rt->rt_tree, rt->rt_keys[r], rt->rt_lens[r], (void *)(long)(r + 1), &old);
+      bk_patricia_insert(B, plain, rt->rt_keys[r], rt->rt_lens[r], (void *)(long)(r + 1), NULL);
+      if (old)					// Same prefix reached from another pool entry
+	present[(long)old - 1] = 0;
+      present[r] = 1;
+    }
+  }
+  gettimeofday(&end, NULL);
+
+  BK_ATOMIC_STORE(&rt->rt_stop, 1);
+  while (BK_ATOMIC_LOAD(&rt->rt_running) > 0)
+    usleep(1000);
+
+  BK_TV_SUB(&delta, &end, &start);
+  printf("lock-free tree: %.0f updates/s, %lld concurrent lookups\n", RCU_UPDATES / BK_TV2F(&delta), (long long)rt->rt_lookups);
+
+  // The snapshot still holds exactly the original half of the pool
+  for (i = 0; i < RCU_ROUTES; i++)
+    if (bk_patricia_search(B, snap, rt->rt_keys[i], rt->rt_lens[i], BK_PATRICIA_PREFIX) != bk_patricia_search(B, initial, rt->rt_keys[i], rt->rt_lens[i], BK_PATRICIA_PREFIX))
+      bad++;
+  bk_patricia_rcu_read_exit(rt->rt_tree, bprr);
+
+  for (i = 0; i < 100000; i++)
+  {
+    for (j = 0; j < 4; j++)
+      key[j] = random();
+    if (bk_patricia_rcu_search(B, rt->rt_tree, bprr, key, 32, BK_PATRICIA_PREFIX) != bk_patricia_search(B, plain, key, 32, BK_PATRICIA_PREFIX))
+      bad++;
+  }
+  for (i = 0; i < RCU_ROUTES; i++)
+    if (bk_patricia_rcu_search(B, rt->rt_tree, bprr, rt->rt_keys[i], rt->rt_lens[i], 0) != bk_patricia_search(B, plain, rt->rt_keys[i], rt->rt_lens[i], 0))
+      bad++;
+
+  bk_patricia_rcu_reader_unregister(B, rt->rt_tree, bprr);
+  bk_patricia_rcu_destroy(B, rt->rt_tree, NULL);
+  bk_patricia_destroy(plain, NULL);
+  bk_patricia_destroy(initial, NULL);
+  free(present);
+
+  if (bad || rt->rt_bad)
+  {
+    fprintf(stderr, "Lock-free tree: %d lookups disagree with plain tree, %d concurrent lookups returned a non-covering route\n", bad, rt->rt_bad);
+    exit(1);
+  }
+  free(rt);
+
+  BK_VRETURN(B);
+}
@@ -0,0 +1,517 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Check bk_slurp on files, descriptors, stdio handles, and pipes, read
+ * and mapped, and optionally time how long it takes to load a file.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_BUFSIZE	      300000		///< Largest file checked
+#define BENCH_ROUNDS	      5			///< Loads timed for each method
+#define OLD_WASTAGE	      8192		///< Growth step bk_slurp used to take
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_benchmb;		///< Megabytes in file loaded
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static int check(bk_s B, const char *what, bk_vptr *data, const u_char *expect, size_t len, bk_flags flags);
+static bk_vptr *old_slurp(const char *filename);
+static int make_file(bk_s B, char *name, const u_char *data, size_t len);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Time loading a file"), N_("megabytes") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_benchmb = atoi(poptGetOptArg(optCon));
+      if (pc->pc_benchmb < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_benchmb)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Slurp files of awkward sizes every way there is, with and without
+ * mapping and termination, and check what comes back.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const size_t sizes[] = { 0, 1, 100, 4095, 4096, 8191, 8192, 8193, 65537, TEST_BUFSIZE };
+  static const bk_flags modes[] = { 0, BK_SLURP_NULL_TERMINATE, BK_SLURP_MMAP, BK_SLURP_MMAP | BK_SLURP_NULL_TERMINATE };
+  u_char *buf, *twice;
+  char name[64];
+  size_t len, off;
+  int s, m, fd, fds[2], bad = 0;
+  bk_flags flags;
+  ssize_t ret;
+  pid_t pid;
+  FILE *FH;
+
+  buf = malloc(TEST_BUFSIZE);
+  twice = malloc(TEST_BUFSIZE * 2);
+  if (!buf || !twice)
+    bk_die(B, 1, stderr, _("Could not allocate test data\n"), BK_WARNDIE_WANTDETAILS);
+  for (off = 0; off < TEST_BUFSIZE; off++)
+    buf[off] = random();
+
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(*sizes)); s++)
+  {
+    len = sizes[s];
+    if (make_file(B, name, buf, len) < 0)
+      bk_die(B, 1, stderr, _("Could not create test file\n"), BK_WARNDIE_WANTDETAILS);
+    memcpy(twice, buf, len);
+    memcpy(twice + len, buf, len);
+
+    for (m = 0; m < (int)(sizeof(modes) / sizeof(*modes)); m++)
+    {
+      flags = modes[m];
+
+      bad += check(B, "filename", bk_slurp(B, NULL, -1, name, -1, flags), buf, len, flags);
+
+      if ((fd = open(name, O_RDONLY)) < 0)
+	bk_die(B, 1, stderr, _("Could not open test file\n"), BK_WARNDIE_WANTDETAILS);
+      bad += check(B, "fd", bk_slurp(B, NULL, fd, NULL, -1, flags), buf, len, flags);
+
+      if (!(FH = fopen(name, "r")))
+	bk_die(B, 1, stderr, _("Could not open test file\n"), BK_WARNDIE_WANTDETAILS);
+      bad += check(B, "FILE", bk_slurp(B, FH, -1, NULL, -1, flags), buf, len, flags);
+
+      // Slurping starts where the descriptor is, not at the start of the file
+      if (len > 10)
+      {
+	if ((fd = open(name, O_RDONLY)) < 0 || lseek(fd, 10, SEEK_SET) != 10)
+	  bk_die(B, 1, stderr, _("Could not open test file\n"), BK_WARNDIE_WANTDETAILS);
+	bad += check(B, "offset fd", bk_slurp(B, NULL, fd, NULL, -1, flags), buf + 10, len - 10, flags);
+      }
+
+      // Every source given is read, one after the other
+      if (!(FH = fopen(name, "r")))
+	bk_die(B, 1, stderr, _("Could not open test file\n"), BK_WARNDIE_WANTDETAILS);
+      bad += check(B, "FILE and filename", bk_slurp(B, FH, -1, name, -1, flags), twice, len * 2, flags);
+
+      // A pipe has no size, so its buffer must grow; make it grow often
+      if (pipe(fds) < 0)
+	bk_die(B, 1, stderr, _("Could not create pipe\n"), BK_WARNDIE_WANTDETAILS);
+      if ((pid = fork()) < 0)
+	bk_die(B, 1, stderr, _("Could not fork\n"), BK_WARNDIE_WANTDETAILS);
+      if (!pid)
+      {
+	close(fds[0]);
+	for (off = 0; off < len; off += ret)
+	{
+	  if ((ret = write(fds[1], buf + off, MIN(len - off, (size_t)1000))) < 0)
+	    _exit(1);
+	}
+	_exit(0);
+      }
+      close(fds[1]);
+      bad += check(B, "pipe", bk_slurp(B, NULL, fds[0], NULL, 100, flags), buf, len, flags);
+      waitpid(pid, NULL, 0);
+    }
+
+    unlink(name);
+  }
+
+  free(twice);
+  free(buf);
+
+  if (bad)
+  {
+    fprintf(stderr, "%d slurp errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Time loading a file (and looking at each page of it) the way
+ * bk_slurp used to, by reading, and by mapping.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const char *methods[] = { "8KB growth steps (old)", "bk_slurp", "bk_slurp mmap" };
+  size_t len = (size_t)pc->pc_benchmb * 1024 * 1024, i;
+  struct timeval start, end, delta;
+  double best = 0;
+  u_char *buf, sum = 0;
+  bk_vptr *data;
+  char name[64];
+  int m, r;
+
+  if (!(buf = malloc(len)))
+    bk_die(B, 1, stderr, _("Could not allocate benchmark data\n"), BK_WARNDIE_WANTDETAILS);
+  for (i = 0; i < len; i++)
+    buf[i] = random();
+  if (make_file(B, name, buf, len) < 0)
+    bk_die(B, 1, stderr, _("Could not create benchmark file\n"), BK_WARNDIE_WANTDETAILS);
+  free(buf);
+
+  for (m = 0; m < (int)(sizeof(methods) / sizeof(*methods)); m++)
+  {
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+      gettimeofday(&start, NULL);
+      if (m == 0)
+	data = old_slurp(name);
+      else
+	data = bk_slurp(B, NULL, -1, name, -1, m == 2 ? BK_SLURP_MMAP : 0);
+      if (!data)
+	bk_die(B, 1, stderr, _("Could not load benchmark file\n"), BK_WARNDIE_WANTDETAILS);
+
+      // Touch every page, as any caller would
+      for (i = 0; i < data->len; i += 4096)
+	sum += ((u_char *)data->ptr)[i];
+
+      if (m == 0)
+      {
+	free(data->ptr);
+	free(data);
+      }
+      else
+	bk_slurp_free(B, data);
+      gettimeofday(&end, NULL);
+
+      BK_TV_SUB(&delta, &end, &start);
+      if (!r || BK_TV2F(&delta) < best)
+	best = BK_TV2F(&delta);
+    }
+    printf("%-24s %10.2f ms %10.1f MB/s\n", methods[m], best * 1000, len / best / 1e6);
+  }
+
+  // Keep the compiler from discarding the work
+  if (sum == 0x12 && len == 1)
+    printf("\n");
+  unlink(name);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Check slurped data against what it should be, and release it.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param what Description of how it was slurped
+ *	@param data Slurped data
+ *	@param expect Expected contents
+ *	@param len Expected length
+ *	@param flags Flags given to bk_slurp
+ *	@return <i>0</i> if the data is right
+ *	@return <br><i>1</i> otherwise
+ */
+static int check(bk_s B, const char *what, bk_vptr *data, const u_char *expect, size_t len, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  int bad = 0;
+
+  if (!data)
+  {
+    fprintf(stderr, "Slurp of %zu bytes by %s (flags %#x) failed\n", len, what, flags);
+    BK_RETURN(B, 1);
+  }
+
+  if (data->len != len || memcmp(data->ptr, expect, len))
+  {
+    fprintf(stderr, "Slurp of %zu bytes by %s (flags %#x) returned %u wrong bytes\n", len, what, flags, data->len);
+    bad = 1;
+  }
+  else if (BK_FLAG_ISSET(flags, BK_SLURP_NULL_TERMINATE) && ((char *)data->ptr)[len])
+  {
+    fprintf(stderr, "Slurp of %zu bytes by %s (flags %#x) is not terminated\n", len, what, flags);
+    bad = 1;
+  }
+
+  bk_slurp_free(B, data);
+
+  BK_RETURN(B, bad);
+}
+
+
+
+/**
+ * Load a file by growing the buffer a fixed step at a time, as bk_slurp
+ * used to, for comparison.
+ *
+ *	@param filename File to load
+ *	@return <i>NULL</i> on failure
+ *	@return <br><i>data</i> to be freed on success
+ */
+static bk_vptr *old_slurp(const char *filename)
+{
+  bk_vptr *ret;
+  size_t size = 0;
+  ssize_t bytes;
+  void *tmp;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return NULL;
+  if (!BK_CALLOC(ret))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  for (;;)
+  {
+    size += OLD_WASTAGE - (size - ret->len);
+    if (!(tmp = realloc(ret->ptr, size)))
+      break;
+    ret->ptr = tmp;
+    if ((bytes = read(fd, (char *)ret->ptr + ret->len, size - ret->len)) <= 0)
+      break;
+    ret->len += bytes;
+  }
+
+  close(fd);
+  return ret;
+}
+
+
+
+/**
+ * Create a temporary file with the given contents.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param name Copy-out name of file, at least 64 bytes
+ *	@param data Contents of file
+ *	@param len Length of contents
+ *	@return <i>-1</i> on failure
+ *	@return <br><i>0</i> on success
+ */
+static int make_file(bk_s B, char *name, const u_char *data, size_t len)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  ssize_t ret;
+  size_t off;
+  int fd;
+
+  snprintf(name, 64, "/tmp/test_slurp.XXXXXX");
+  if ((fd = mkstemp(name)) < 0)
+    BK_RETURN(B, -1);
+
+  for (off = 0; off < len; off += ret)
+  {
+    if ((ret = write(fd, data + off, len - off)) < 0)
+    {
+      close(fd);
+      unlink(name);
+      BK_RETURN(B, -1);
+    }
+  }
+
+  close(fd);
+  BK_RETURN(B, 0);
+}
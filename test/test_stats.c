@@ -58,12 +58,16 @@ struct program_config
 {
   bk_flags		pc_flags;		///< Flags are fun!
 #define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_metricsport;		///< Check the metrics server on this port
 };
 
 
 
 static int proginit(bk_s B, struct program_config *pc, int argc, char **argv);
 static void progrun(bk_s B, struct program_config *pc);
+static int metrics_stdout(bk_s B, void *opaque, const char *buf, size_t len, bk_flags flags);
+static int metrics_check(bk_s B, struct program_config *pc);
+static int metrics_fetch(bk_s B, struct bk_run *run, int port, char *buf, size_t len);
 
 
 
@@ -95,6 +99,7 @@ main(int argc, char **argv, char **envp)
     {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
     {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
     {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"metrics-port", 'm', POPT_ARG_INT, NULL, 'm', N_("Check the metrics server on this local port (and the next) and exit"), N_("port") },
 
     {"long-arg-only", 0, POPT_ARG_NONE, NULL, 1, N_("An example of a long argument without a shortcut"), NULL },
     {NULL, 's', POPT_ARG_NONE, NULL, 2, N_("An example of a short argument without a longcut"), NULL },
@@ -185,6 +190,9 @@ main(int argc, char **argv, char **envp)
     case 0x1002:				// profiling
       bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
       break;
+    case 'm':					// metrics-port
+      pc->pc_metricsport = atoi(poptGetOptArg(optCon));
+      break;
     default:
       getopterr++;
       break;
@@ -224,6 +232,13 @@ main(int argc, char **argv, char **envp)
     bk_die(B, 254, stderr, _("Could not perform program initialization\n"), BK_FLAG_ISSET(pc->pc_flags, PC_VERBOSE)?BK_WARNDIE_WANTDETAILS:0);
   }
 
+  if (pc->pc_metricsport)
+  {
+    c = metrics_check(B, pc);
+    poptFreeContext(optCon);
+    bk_exit(B, c < 0);
+  }
+
   progrun(B, pc);
 
   poptFreeContext(optCon);
@@ -275,6 +290,9 @@ static void progrun(bk_s B, struct program_config *pc)
 {
   BK_ENTRY(B, __FUNCTION__,__FILE__,"test-stats");
   bk_dynamic_stats_h stats_list;
+  bk_dynamic_stat_h handle = NULL;
+  bk_dynamic_stat_h fhandle = NULL, dhandle = NULL;
+  bk_dynamic_stat_value_u value;
   int cnt = 0;
   char *xml = NULL;
 #ifdef NEED_TRAVERSE
@@ -328,6 +346,38 @@ static void progrun(bk_s B, struct program_config *pc)
     goto error;
   }
 
+  if (bk_dynamic_stat_register_simple(B, stats_list, "handle", 0, 0, DynamicStatsValueTypeUInt64, DynamicStatsAccessTypeDirect, NULL, NULL, NULL, &handle, 0))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not register the handle stat\n");
+    goto error;
+  }
+
+  if (bk_dynamic_stat_register_simple(B, stats_list, "float", 0, 0, DynamicStatsValueTypeFloat, DynamicStatsAccessTypeDirect, NULL, NULL, NULL, &fhandle, 0) ||
+      bk_dynamic_stat_register_simple(B, stats_list, "double", 0, 0, DynamicStatsValueTypeDouble, DynamicStatsAccessTypeDirect, NULL, NULL, NULL, &dhandle, 0))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not register the float stats\n");
+    goto error;
+  }
+
+  if (bk_dynamic_stat_handle_set(B, fhandle, 0, 1.5) < 0 ||
+      bk_dynamic_stat_handle_set(B, dhandle, 0, 2.25) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not set by handle\n");
+    goto error;
+  }
+
+  if (bk_dynamic_stat_get(B, stats_list, "float", 0, NULL, &value, NULL, NULL, NULL, 0) < 0 || value.bdsv_float != 1.5)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Float stat set by handle reads back wrong\n");
+    goto error;
+  }
+
+  if (bk_dynamic_stat_get(B, stats_list, "double", 0, NULL, &value, NULL, NULL, NULL, 0) < 0 || value.bdsv_double != 2.25)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Double stat set by handle reads back wrong\n");
+    goto error;
+  }
+
   while(1)
   {
     sleep(1);
@@ -345,6 +395,12 @@ static void progrun(bk_s B, struct program_config *pc)
       goto error;
     }
 
+    if (bk_dynamic_stat_handle_increment(B, handle, 0, (u_int64_t)1000) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not increment by handle\n");
+      goto error;
+    }
+
     if (!(xml = bk_dynamic_stats_XML_create(B, stats_list, 0, "", 0)))
     {
       bk_error_printf(B, BK_ERR_ERR, "Could not obtain stats XML\n");
@@ -353,6 +409,13 @@ static void progrun(bk_s B, struct program_config *pc)
     printf("%s\n", xml);
     free(xml);
     xml = NULL;
+
+    if (bk_dynamic_stats_openmetrics(B, stats_list, 0, "test_", metrics_stdout, NULL, 0) != 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not obtain stats OpenMetrics\n");
+      goto error;
+    }
+    printf("# EOF\n");
   }
 
  error:
@@ -360,3 +423,206 @@ static void progrun(bk_s B, struct program_config *pc)
     free(xml);
   BK_VRETURN(B);
 }
+
+
+
+/**
+ * OpenMetrics output callback which just prints
+ *
+ *	@param B BAKA thread/global state.
+ *	@param opaque Unused
+ *	@param buf Exposition text
+ *	@param len Length of @a buf
+ *	@param flags Flags for future use.
+ *	@return <i>0</i> always
+ */
+static int
+metrics_stdout(bk_s B, void *opaque, const char *buf, size_t len, bk_flags flags)
+{
+  fwrite(buf, 1, len, stdout);
+  return(0);
+}
+
+
+
+/**
+ * Run two metrics servers and check what they serve: one with the
+ * default budget, which must send a complete exposition with sanitized
+ * names, and one with a tiny budget, which must cut the response off
+ * before "# EOF".
+ *
+ *	@param B BAKA thread/global state.
+ *	@param pc Program configuration
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>0</i> on success.
+ */
+static int
+metrics_check(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"test-stats");
+  struct bk_run *run = NULL;
+  bk_dynamic_stats_h stats_list = NULL;
+  struct bk_metrics_server *full = NULL, *tiny = NULL;
+  char url[64];
+  char buf[65536];
+  int len;
+  int ret = -1;
+
+  if (!(run = bk_run_init(B, 0)) || !(stats_list = bk_dynamic_stats_create(B, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not create run loop or stats list\n");
+    goto error;
+  }
+
+  if (bk_dynamic_stat_register_with_value_simple(B, stats_list, "gauge.value", 0, 0, DynamicStatsValueTypeInt32, DynamicStatsAccessTypeDirect, NULL, NULL, NULL, NULL, 0, (int32_t)42))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not register gauge\n");
+    goto error;
+  }
+
+  snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", pc->pc_metricsport);
+  if (!(full = bk_metrics_server_create(B, run, url, NULL, stats_list, 0, NULL, "test-", 0, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not start metrics server on %s\n", url);
+    goto error;
+  }
+
+  snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", pc->pc_metricsport + 1);
+  if (!(tiny = bk_metrics_server_create(B, run, url, NULL, stats_list, 0, NULL, "test-", 200, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not start metrics server on %s\n", url);
+    goto error;
+  }
+
+  if ((len = metrics_fetch(B, run, pc->pc_metricsport, buf, sizeof(buf))) < 0)
+    goto error;
+
+  if (BK_FLAG_ISSET(pc->pc_flags, PC_VERBOSE))
+    fwrite(buf, 1, len, stdout);
+
+  if (strncmp(buf, "HTTP/1.0 200 OK\r\n", 17) ||
+      !strstr(buf, "\r\n\r\n# TYPE test_gauge_value gauge\ntest_gauge_value 42\n") ||
+      !strstr(buf, "\ntest_metrics_scrapes_total 0\n") ||
+      len < 6 || strcmp(buf + len - 6, "# EOF\n"))
+  {
+    fprintf(stderr, "Metrics server response is wrong:\n%s\n", buf);
+    goto error;
+  }
+
+  if ((len = metrics_fetch(B, run, pc->pc_metricsport + 1, buf, sizeof(buf))) < 0)
+    goto error;
+
+  if (strncmp(buf, "HTTP/1.0 200 OK\r\n", 17) || len > 200 || strstr(buf, "# EOF"))
+  {
+    fprintf(stderr, "Metrics server did not truncate response:\n%s\n", buf);
+    goto error;
+  }
+
+  printf("metrics server ok\n");
+  ret = 0;
+
+ error:
+  if (tiny)
+    bk_metrics_server_destroy(B, tiny);
+  if (full)
+    bk_metrics_server_destroy(B, full);
+  if (stats_list)
+    bk_dynamic_stats_destroy(B, stats_list);
+  if (run)
+    bk_run_destroy(B, run);
+  BK_RETURN(B, ret);
+}
+
+
+
+/**
+ * Fetch /metrics from a local port, running the server's loop until the
+ * server closes the connection.
+ *
+ *	@param B BAKA thread/global state.
+ *	@param run Run loop the server is on
+ *	@param port Local port
+ *	@param buf Response buffer (NUL terminated)
+ *	@param len Size of @a buf
+ *	@return <i>-1</i> on failure.<br>
+ *	@return <i>length of response</i> on success.
+ */
+static int
+metrics_fetch(bk_s B, struct bk_run *run, int port, char *buf, size_t len)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"test-stats");
+  static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+  struct sockaddr_in sin;
+  size_t used = 0;
+  ssize_t cnt = -1;
+  int tries;
+  int fd = -1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // The listener may only appear once the loop has run
+  for (tries = 0; ; tries++)
+  {
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not create socket: %s\n", strerror(errno));
+      goto error;
+    }
+
+    if (!connect(fd, (struct sockaddr *)&sin, sizeof(sin)))
+      break;
+
+    if (errno != ECONNREFUSED || tries >= 100)
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not connect to metrics server: %s\n", strerror(errno));
+      goto error;
+    }
+    close(fd);
+    fd = -1;
+    bk_run_once(B, run, BK_RUN_ONCE_FLAG_DONT_BLOCK);
+    usleep(10000);
+  }
+
+  if (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not send metrics request: %s\n", strerror(errno));
+    goto error;
+  }
+
+  for (tries = 0; tries < 1000 && used < len - 1; tries++)
+  {
+    bk_run_once(B, run, BK_RUN_ONCE_FLAG_DONT_BLOCK);
+
+    if ((cnt = read(fd, buf + used, len - 1 - used)) == 0)
+      break;
+
+    if (cnt > 0)
+      used += cnt;
+    else if (errno == EAGAIN || errno == EINTR)
+      usleep(1000);
+    else
+    {
+      bk_error_printf(B, BK_ERR_ERR, "Could not read metrics response: %s\n", strerror(errno));
+      goto error;
+    }
+  }
+
+  if (cnt)
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Metrics server did not finish its response\n");
+    goto error;
+  }
+
+  buf[used] = '\0';
+  close(fd);
+  BK_RETURN(B, used);
+
+ error:
+  if (fd >= 0)
+    close(fd);
+  BK_RETURN(B, -1);
+}
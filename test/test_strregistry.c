@@ -0,0 +1,462 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Test the string registry, and optionally time concurrent interning
+ * with increasing numbers of threads.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_STRS	      50000		///< Strings in functional test
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_benchstrs;		///< Number of strings to benchmark with
+  int			pc_maxthreads;		///< Most benchmark threads
+};
+
+
+
+/**
+ * State shared by benchmark threads
+ */
+struct bench_run
+{
+  bk_str_registry_t	br_reg;			///< Registry being filled
+  char **		br_strs;		///< Strings to intern
+  int			br_nstrs;		///< Number of strings
+  int			br_nthreads;		///< Number of threads
+  int			br_next;		///< Next thread number
+  int			br_go;			///< Start flag
+  int			br_running;		///< Threads not yet done
+  int			br_bad;			///< Wrong results seen
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+#ifdef BK_USING_PTHREADS
+static void *bench_thread(bk_s B, void *opaque);
+#endif /* BK_USING_PTHREADS */
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Time concurrent interning with 1 to 32 threads"), N_("strings") },
+    {"threads", 't', POPT_ARG_INT, NULL, 't', N_("Maximum benchmark threads"), N_("threads") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+  pc->pc_maxthreads = 32;
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_benchstrs = atoi(poptGetOptArg(optCon));
+      if (pc->pc_benchstrs < 1)
+	getopterr++;
+      break;
+    case 't':					// threads
+      pc->pc_maxthreads = atoi(poptGetOptArg(optCon));
+      if (pc->pc_maxthreads < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_benchstrs)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Check interning, reference counting, forced ids, and both lookups.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  bk_str_registry_t reg;
+  bk_str_id_t id, top;
+  char buf[64];
+  char *fixed = "not copied";
+  int i, bad = 0;
+
+  if (!(reg = bk_string_registry_init(B)))
+    bk_die(B, 1, stderr, _("Could not create string registry\n"), BK_WARNDIE_WANTDETAILS);
+
+  // Ids are handed out densely from 1, and the arena copy is what is kept
+  for (i = 0; i < TEST_STRS; i++)
+  {
+    snprintf(buf, sizeof(buf), "attribute-%d", i);
+    if (bk_string_registry_insert(B, reg, buf, 0, BK_STR_REGISTRY_FLAG_COPY_STR) != (bk_str_id_t)i + 1)
+      bad++;
+  }
+  memset(buf, 0, sizeof(buf));
+
+  for (i = 0; i < TEST_STRS; i++)
+  {
+    snprintf(buf, sizeof(buf), "attribute-%d", i);
+    if (bk_string_registry_idbystr(B, reg, buf, 0) != (bk_str_id_t)i + 1 ||
+	!bk_string_registry_strbyid(B, reg, i + 1, 0) || strcmp(bk_string_registry_strbyid(B, reg, i + 1, 0), buf) ||
+	bk_string_registry_insert(B, reg, buf, 0, BK_STR_REGISTRY_FLAG_COPY_STR) != (bk_str_id_t)i + 1)
+      bad++;
+  }
+
+  // Every string now has two references; one delete leaves them in place
+  for (i = 0; i < TEST_STRS; i += 2)
+  {
+    snprintf(buf, sizeof(buf), "attribute-%d", i);
+    if (bk_string_registry_delete_str(B, reg, buf, 0) < 0 || bk_string_registry_delete_id(B, reg, i + 1, 0) < 0)
+      bad++;
+  }
+
+  for (i = 0; i < TEST_STRS; i++)
+  {
+    snprintf(buf, sizeof(buf), "attribute-%d", i);
+    if ((bk_string_registry_idbystr(B, reg, buf, 0) != 0) != (i % 2) ||
+	(bk_string_registry_strbyid(B, reg, i + 1, 0) != NULL) != (i % 2))
+      bad++;
+  }
+
+  if (bk_string_registry_strbyid(B, reg, 0, 0) || bk_string_registry_strbyid(B, reg, TEST_STRS + 1, 0))
+    bad++;
+
+  // Uncopied strings keep the caller's pointer; register_by_id takes a reference
+  top = TEST_STRS + 1;
+  if (bk_string_registry_insert(B, reg, fixed, 0, 0) != top ||
+      bk_string_registry_strbyid(B, reg, top, 0) != fixed ||
+      bk_string_registry_register_by_id(B, reg, top, 0) != fixed)
+    bad++;
+
+  // Forced insertion of a duplicate gets a new id; forced ids skip ahead
+  if ((id = bk_string_registry_insert(B, reg, fixed, 0, BK_STR_REGISTRY_FLAG_FORCE)) != top + 1 ||
+      bk_string_registry_insert(B, reg, "far away", 100000000, BK_STR_REGISTRY_FLAG_FORCE) != 100000000 ||
+      bk_string_registry_insert(B, reg, "wrong", 100000000, 0) != 0 ||
+      bk_string_registry_insert(B, reg, NULL, 100000001, 0) != 0 ||
+      strcmp(bk_string_registry_strbyid(B, reg, 100000000, 0), "far away"))
+    bad++;
+
+  // Deleting the top ids gives them back
+  if (bk_string_registry_delete_id(B, reg, 100000000, 0) < 0 || bk_string_registry_delete_id(B, reg, id, 0) < 0 ||
+      bk_string_registry_insert(B, reg, "reused", 0, BK_STR_REGISTRY_FLAG_COPY_STR) != id)
+    bad++;
+
+  bk_string_registry_destroy(B, reg);
+
+  if (bad)
+  {
+    fprintf(stderr, "%d string registry errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+
+  BK_VRETURN(B);
+}
+
+
+
+#ifdef BK_USING_PTHREADS
+/**
+ * Intern every benchmark string, starting at a different place in the
+ * list for each thread so they race on the same strings, and check that
+ * the id maps back to the string.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param opaque Benchmark run
+ *	@return <i>NULL</i>
+ */
+static void *bench_thread(bk_s B, void *opaque)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct bench_run *br = opaque;
+  int me = BK_ATOMIC_ADD(&br->br_next, 1) - 1;
+  int i, s, bad = 0;
+  bk_str_id_t id;
+
+  while (!BK_ATOMIC_LOAD(&br->br_go))
+    sched_yield();
+
+  for (i = 0, s = (long)br->br_nstrs * me / br->br_nthreads; i < br->br_nstrs; i++, s = (s + 1 == br->br_nstrs) ? 0 : s + 1)
+  {
+    id = bk_string_registry_insert(B, br->br_reg, br->br_strs[s], 0, BK_STR_REGISTRY_FLAG_COPY_STR);
+    if (!id || strcmp(bk_string_registry_strbyid(B, br->br_reg, id, 0), br->br_strs[s]))
+      bad++;
+  }
+
+  BK_ATOMIC_ADD(&br->br_bad, bad);
+  BK_ATOMIC_ADD(&br->br_running, -1);
+  BK_RETURN(B, NULL);
+}
+#endif /* BK_USING_PTHREADS */
+
+
+
+/**
+ * Time interning a set of strings from 1, 2, 4, ... threads at once.
+ * Every thread interns every string, so most calls find an existing
+ * entry, as when parsers intern field names.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+#ifdef BK_USING_PTHREADS
+  struct bench_run br;
+  struct timeval start, end, delta;
+  char buf[64];
+  int i, nthreads;
+
+  memset(&br, 0, sizeof(br));
+  br.br_nstrs = pc->pc_benchstrs;
+  if (!(br.br_strs = calloc(br.br_nstrs, sizeof(*br.br_strs))))
+    bk_die(B, 1, stderr, _("Could not allocate benchmark strings\n"), BK_WARNDIE_WANTDETAILS);
+
+  srandom(1);
+  for (i = 0; i < br.br_nstrs; i++)
+  {
+    snprintf(buf, sizeof(buf), "field.%lx.%d", random(), i);
+    if (!(br.br_strs[i] = strdup(buf)))
+      bk_die(B, 1, stderr, _("Could not allocate benchmark strings\n"), BK_WARNDIE_WANTDETAILS);
+  }
+
+  printf("%d strings, each interned by every thread\n", br.br_nstrs);
+  for (nthreads = 1; nthreads <= pc->pc_maxthreads; nthreads *= 2)
+  {
+    if (!(br.br_reg = bk_string_registry_init(B)))
+      bk_die(B, 1, stderr, _("Could not create string registry\n"), BK_WARNDIE_WANTDETAILS);
+
+    br.br_nthreads = nthreads;
+    br.br_next = 0;
+    br.br_go = 0;
+    for (i = 0; i < nthreads; i++)
+    {
+      BK_ATOMIC_ADD(&br.br_running, 1);
+      if (!bk_general_thread_create(B, "intern", bench_thread, &br, 0))
+	bk_die(B, 1, stderr, _("Could not create thread\n"), BK_WARNDIE_WANTDETAILS);
+    }
+
+    while (BK_ATOMIC_LOAD(&br.br_next) < nthreads)
+      usleep(1000);
+    gettimeofday(&start, NULL);
+    BK_ATOMIC_STORE(&br.br_go, 1);
+    while (BK_ATOMIC_LOAD(&br.br_running) > 0)
+      usleep(100);
+    gettimeofday(&end, NULL);
+
+    // Racing threads must still have agreed on one id per string
+    for (i = 0; i < br.br_nstrs; i++)
+    {
+      bk_str_id_t id = bk_string_registry_idbystr(B, br.br_reg, br.br_strs[i], 0);
+
+      if (!id || id > (bk_str_id_t)br.br_nstrs || strcmp(bk_string_registry_strbyid(B, br.br_reg, id, 0), br.br_strs[i]))
+	br.br_bad++;
+    }
+
+    BK_TV_SUB(&delta, &end, &start);
+    printf("%2d threads %8.3f s  %8.2f Minterns/s\n", nthreads, BK_TV2F(&delta), (double)nthreads * br.br_nstrs / BK_TV2F(&delta) / 1000000.0);
+    bk_string_registry_destroy(B, br.br_reg);
+  }
+
+  for (i = 0; i < br.br_nstrs; i++)
+    free(br.br_strs[i]);
+  free(br.br_strs);
+
+  if (br.br_bad)
+  {
+    fprintf(stderr, "%d wrong string registry results\n", br.br_bad);
+    exit(1);
+  }
+#else
+  printf("Thread scaling benchmark requires threads\n");
+#endif /* BK_USING_PTHREADS */
+
+  BK_VRETURN(B);
+}
@@ -24,6 +24,8 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 
 #define ERRORQUEUE_DEPTH 32			///< Default depth
+#define CHECK_COUNT 20000			///< Random times checked
+#define BENCH_COUNT 100000			///< Times per measurement
 
 /**
  * Information of international importance to everyone
@@ -44,12 +46,15 @@ struct program_config
 {
   int z;
   int pc_format_flags;
+  int pc_bench;					///< Measurements of each kind
 };
 
 
 
 int proginit(bk_s B, struct program_config *pconfig);
 void progrun(bk_s B, struct program_config *pconfig);
+int progcheck(bk_s B, struct program_config *pconfig);
+void progbench(bk_s B, struct program_config *pconfig);
 
 
 
@@ -77,6 +82,7 @@ main(int argc, char **argv, char **envp)
   {
     {"debug", 'd', POPT_ARG_NONE, NULL, 'd', "Turn on debugging", NULL },
     {"notz", 0, POPT_ARG_NONE, NULL, 1, "Don't print T or Z in iso format", NULL},
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', "Time iso formatting and parsing", "rounds"},
     POPT_AUTOHELP
     POPT_TABLEEND
   };
@@ -109,6 +115,11 @@ main(int argc, char **argv, char **envp)
     case 0x1:
       pconfig->pc_format_flags |= BK_TIME_FORMAT_FLAG_NO_TZ;
       break;
+    case 'b':
+      pconfig->pc_bench = atoi(poptGetOptArg(optCon));
+      if (pconfig->pc_bench < 1)
+	getopterr++;
+      break;
     default:
       getopterr++;
       break;
@@ -130,6 +141,15 @@ main(int argc, char **argv, char **envp)
     bk_die(B,254,stderr,"Could not perform program initialization\n",0);
   }
 
+  if (progcheck(B, pconfig) < 0)
+    bk_exit(B, 1);
+
+  if (pconfig->pc_bench)
+  {
+    progbench(B, pconfig);
+    BK_RETURN(B,0);
+  }
+
   progrun(B, pconfig);
   BK_RETURN(B,0);
 }
@@ -312,3 +332,362 @@ void progrun(bk_s B, struct program_config *pconfig)
 
   BK_VRETURN(B);
 }
+
+
+
+/**
+ * Format a time the way libbk always has (with gmtime and strftime).
+ *
+ *	@param str Output buffer
+ *	@param max Size of buffer
+ *	@param ts Time, with tv_nsec in range
+ *	@param flags BK_TIME_FORMAT_FLAG_NO_TZ
+ */
+static void ref_iso_format(char *str, size_t max, const struct timespec *ts, bk_flags flags)
+{
+  struct tm t;
+  size_t len;
+
+  gmtime_r(&ts->tv_sec, &t);
+  len = strftime(str, max, BK_FLAG_ISSET(flags, BK_TIME_FORMAT_FLAG_NO_TZ) ? "%Y-%m-%d %H:%M:%S" : "%Y-%m-%dT%H:%M:%S", &t);
+
+  if (ts->tv_nsec % 1000)
+    len += snprintf(str + len, max - len, ".%09ld", (long)ts->tv_nsec);
+  else if (ts->tv_nsec % 1000000)
+    len += snprintf(str + len, max - len, ".%06ld", (long)ts->tv_nsec / 1000);
+  else if (ts->tv_nsec)
+    len += snprintf(str + len, max - len, ".%03ld", (long)ts->tv_nsec / 1000000);
+
+  if (BK_FLAG_ISCLEAR(flags, BK_TIME_FORMAT_FLAG_NO_TZ))
+    snprintf(str + len, max - len, "Z");
+}
+
+
+
+/**
+ * A random time, mostly in this century, with a fraction which is
+ * sometimes whole milli- or microseconds.
+ *
+ *	@param ts Copy-out time
+ */
+static void random_time(struct timespec *ts)
+{
+  switch (random() % 4)
+  {
+  case 0:					// any year from 1 to 9999
+    ts->tv_sec = (time_t)(((int64_t)random() << 16 ^ random()) % 315537897600LL) - 62135596800LL;
+    break;
+  case 1:					// far beyond 9999
+    ts->tv_sec = (time_t)(((int64_t)random() << 16 ^ random()) % 3000000000000LL) + 253402300800LL;
+    break;
+  default:
+    ts->tv_sec = 1500000000 + random() % 1000000000;
+    break;
+  }
+
+  switch (random() % 4)
+  {
+  case 0:
+    ts->tv_nsec = 0;
+    break;
+  case 1:
+    ts->tv_nsec = random() % 1000 * 1000000;
+    break;
+  case 2:
+    ts->tv_nsec = random() % 1000000 * 1000;
+    break;
+  default:
+    ts->tv_nsec = random() % 1000000000;
+    break;
+  }
+}
+
+
+
+/**
+ * Check iso formatting and parsing against the C library, over random
+ * times.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pconfig Program configuration
+ *	@return <i>0</i> Success
+ *	@return <br><i>-1</i> Some check failed
+ */
+int progcheck(bk_s B, struct program_config *pconfig)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const struct { time_t sec; long nsec; const char *iso; } odd[] =
+  {
+    { -1, 0, "1969-12-31T23:59:59Z" },
+    { -60, 0, "1969-12-31T23:59:00Z" },
+    { -3600, 0, "1969-12-31T23:00:00Z" },
+    { 10, 1500000000, "1970-01-01T00:00:11.500Z" },
+    { 10, -1, "1970-01-01T00:00:09.999999999Z" },
+    { 10, -2000000000, "1970-01-01T00:00:08Z" },
+  };
+  static const char *layouts[] =
+  {
+    "2002-6-22T18:46:12Z", "2002-06-22T18:46:12.Z", "2002-06-22T18:46:12.1234567890Z",
+    "1969-12-31T23:59:59Z", "2002-06-22X18:46:12Z", "2002-06-22T18:46:1Z",
+  };
+  char scratch[64], expect[128], *buf;
+  struct timespec ts, ts2, *times, *times2;
+  struct tm t;
+  bk_flags flags, out;
+  size_t len, used, off;
+  ssize_t n;
+  u_int i, j;
+  int errors = 0, ret, ret2;
+
+  for (i = 0; i < sizeof(odd) / sizeof(*odd); i++)
+  {
+    // Each odd time is formatted against an empty cache
+    BK_BT_TIMECACHE(B)->btc_valid = 0;
+    ts.tv_sec = odd[i].sec;
+    ts.tv_nsec = odd[i].nsec;
+    if (!bk_time_iso_format(B, scratch, sizeof(scratch), &ts, NULL, 0) || !BK_STREQ(scratch, odd[i].iso))
+    {
+      fprintf(stderr, "%ld.%ld formatted as %s, not %s\n", (long)odd[i].sec, odd[i].nsec, scratch, odd[i].iso);
+      errors++;
+    }
+  }
+
+  // Short buffers must not be overrun
+  ts.tv_sec = 1024749972;
+  ts.tv_nsec = 12000000;
+  for (i = 0; i < 30; i++)
+  {
+    memset(scratch, '#', sizeof(scratch));
+    len = bk_time_iso_format(B, scratch, i, &ts, &out, 0);
+    if (scratch[i] != '#' || (i > 24) != (len == 24) || (i > 24) == !!BK_FLAG_ISSET(out, BK_TIME_FORMAT_OUTFLAG_TRUNCATED))
+    {
+      fprintf(stderr, "Formatting into %u bytes got %u\n", i, (u_int)len);
+      errors++;
+    }
+  }
+
+  // Layouts which the general parser handles (or not) the same way
+  for (i = 0; i < sizeof(layouts) / sizeof(*layouts); i++)
+  {
+    snprintf(scratch, sizeof(scratch), " %s", layouts[i]);
+    ret = bk_time_iso_parse(B, layouts[i], &ts, 0);
+    ret2 = bk_time_iso_parse(B, scratch, &ts2, 0);
+    if (ret != ret2 || (ret >= 0 && (ts.tv_sec != ts2.tv_sec || ts.tv_nsec != ts2.tv_nsec)))
+    {
+      fprintf(stderr, "Parse of %s differs: %d %ld.%09ld and %d %ld.%09ld\n", layouts[i],
+	      ret, (long)ts.tv_sec, ts.tv_nsec, ret2, (long)ts2.tv_sec, ts2.tv_nsec);
+      errors++;
+    }
+  }
+
+  for (i = 0; i < CHECK_COUNT; i++)
+  {
+    random_time(&ts);
+    flags = random() % 2 ? BK_TIME_FORMAT_FLAG_NO_TZ : 0;
+
+    ref_iso_format(expect, sizeof(expect), &ts, flags);
+    len = bk_time_iso_format(B, scratch, sizeof(scratch), &ts, NULL, flags);
+    if (len != strlen(expect) || !BK_STREQ(scratch, expect))
+    {
+      fprintf(stderr, "%ld.%09ld formatted as %s, not %s\n", (long)ts.tv_sec, ts.tv_nsec, scratch, expect);
+      errors++;
+      continue;
+    }
+
+    if (ts.tv_sec < 0 || ts.tv_sec >= 253402300800LL)
+      continue;
+
+    // Times without Z are local, unless told otherwise
+    if (bk_time_iso_parse(B, scratch, &ts2, flags) != 0 || ts2.tv_sec != ts.tv_sec || ts2.tv_nsec != ts.tv_nsec)
+    {
+      fprintf(stderr, "%s parsed as %ld.%09ld\n", scratch, (long)ts2.tv_sec, ts2.tv_nsec);
+      errors++;
+    }
+
+    // The leading space sends this through the general parser
+    snprintf(expect, sizeof(expect), " %s", scratch);
+    if (bk_time_iso_parse(B, expect, &ts2, flags) != 0 || ts2.tv_sec != ts.tv_sec || ts2.tv_nsec != ts.tv_nsec)
+    {
+      fprintf(stderr, "%s parsed the long way as %ld.%09ld\n", scratch, (long)ts2.tv_sec, ts2.tv_nsec);
+      errors++;
+    }
+
+    // Days past the end of the month, and so on, run into the next
+    gmtime_r(&ts.tv_sec, &t);
+    t.tm_mon = random() % 24 - 6;
+    t.tm_mday = random() % 40;
+    t.tm_hour = random() % 30;
+    if (t.tm_year + t.tm_mon / 12 <= 70)
+      continue;
+    ts2.tv_sec = bk_timegm(B, &t, 0);
+    if (ts2.tv_sec != timegm(&t))
+    {
+      fprintf(stderr, "bk_timegm of %s with month %d day %d hour %d differs\n", scratch, t.tm_mon, t.tm_mday, t.tm_hour);
+      errors++;
+    }
+  }
+
+  times = malloc(CHECK_COUNT * sizeof(*times));
+  times2 = malloc(CHECK_COUNT * sizeof(*times2));
+  buf = malloc(CHECK_COUNT * 48);
+  if (!times || !times2 || !buf)
+  {
+    fprintf(stderr, "Could not allocate check data\n");
+    BK_RETURN(B, -1);
+  }
+
+  for (i = 0; i < CHECK_COUNT; i++)
+  {
+    random_time(&times[i]);
+    if (times[i].tv_sec < 0 || times[i].tv_sec >= 253402300800LL)
+      times[i].tv_sec = 1500000000 + i;
+  }
+
+  // A buffer at a time, then parsed back a few at a time
+  for (i = 0, off = 0; i < CHECK_COUNT; i += n, off += used)
+  {
+    if ((n = bk_time_iso_format_batch(B, buf + off, MIN(1000, CHECK_COUNT * 48 - off), times + i, CHECK_COUNT - i, '\n', &used, 0)) < 1)
+    {
+      fprintf(stderr, "Batch format stopped at %u\n", i);
+      BK_RETURN(B, -1);
+    }
+  }
+
+  for (i = 0, len = 0; i < CHECK_COUNT; i += n, len += used)
+  {
+    if ((n = bk_time_iso_parse_batch(B, buf + len, off - len, '\n', times2 + i, MIN(random() % 100 + 1, CHECK_COUNT - i), &used, 0)) < 1)
+    {
+      fprintf(stderr, "Batch parse stopped at %u\n", i);
+      BK_RETURN(B, -1);
+    }
+  }
+
+  for (i = 0, j = 0; i < CHECK_COUNT; i++)
+  {
+    if (times[i].tv_sec != times2[i].tv_sec || times[i].tv_nsec != times2[i].tv_nsec)
+      j++;
+  }
+  if (j || len != off)
+  {
+    fprintf(stderr, "Batch round trip changed %u times\n", j);
+    errors++;
+  }
+
+  // Other layouts are parsed too, and bad times found
+  len = snprintf(buf, 128, "2002-06-22T18:46:12Z,2002-6-22T18:46:12.5Z,2002-06-22 18:46:12,2002-06-22T18:46:12Zjunk");
+  if (bk_time_iso_parse_batch(B, buf, len, ',', times2, 4, &used, BK_TIME_FORMAT_FLAG_NO_TZ) != -1 || used != 63 ||
+      times2[0].tv_sec != 1024771572 || times2[1].tv_sec != 1024771572 || times2[1].tv_nsec != 500000000 ||
+      times2[2].tv_sec != 1024771572 || bk_time_iso_parse_batch(B, buf, len, ',', times2, 3, &used, 0) != 3 || used != 63)
+  {
+    fprintf(stderr, "Batch parse of mixed layouts failed\n");
+    errors++;
+  }
+
+  free(times);
+  free(times2);
+  free(buf);
+
+  BK_RETURN(B, errors ? -1 : 0);
+}
+
+
+
+/**
+ * Time iso formatting and parsing, one at a time and in batches, against
+ * the C library.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pconfig Program configuration
+ */
+void progbench(bk_s B, struct program_config *pconfig)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct timeval start, end, delta;
+  struct timespec *times, *times2;
+  char *buf, *p, *digits;
+  struct tm t;
+  size_t len, used, sum = 0;
+  u_int i, year, mon, mday, hour, min, sec;
+  int r, n;
+  u_long frac;
+
+#define BENCHTIME(name, expr)								\
+  do {											\
+    double best = 0;									\
+											\
+    for (r = 0; r < pconfig->pc_bench; r++)						\
+    {											\
+      gettimeofday(&start, NULL);							\
+      expr;										\
+      gettimeofday(&end, NULL);								\
+      BK_TV_SUB(&delta, &end, &start);							\
+      if (!r || BK_TV2F(&delta) < best)							\
+	best = BK_TV2F(&delta);								\
+    }											\
+    printf("%-32s %8.1f ns/time\n", name, best * 1e9 / BENCH_COUNT);			\
+  } while (0)
+
+  times = malloc(BENCH_COUNT * sizeof(*times));
+  times2 = malloc(BENCH_COUNT * sizeof(*times2));
+  buf = malloc(BENCH_COUNT * 48);
+  if (!times || !times2 || !buf)
+    bk_die(B, 1, stderr, "Could not allocate benchmark data\n", BK_WARNDIE_WANTDETAILS);
+
+  // Like a log: each time a little after the last
+  times[0].tv_sec = 1600000000;
+  times[0].tv_nsec = 0;
+  for (i = 1; i < BENCH_COUNT; i++)
+  {
+    times[i].tv_nsec = times[i - 1].tv_nsec + random() % 50000000 * 1000;
+    times[i].tv_sec = times[i - 1].tv_sec + times[i].tv_nsec / 1000000000;
+    times[i].tv_nsec %= 1000000000;
+  }
+
+  BENCHTIME("gmtime+strftime", for (i = 0; i < BENCH_COUNT; i++)
+	    {
+	      gmtime_r(&times[i].tv_sec, &t);
+	      len = strftime(buf, 48, "%Y-%m-%dT%H:%M:%S", &t);
+	      sum += len + snprintf(buf + len, 48 - len, ".%06ldZ", times[i].tv_nsec / 1000);
+	    });
+  BENCHTIME("bk_time_iso_format", for (i = 0; i < BENCH_COUNT; i++) sum += bk_time_iso_format(B, buf, 48, &times[i], NULL, 0));
+  BENCHTIME("bk_time_iso_format_batch", bk_time_iso_format_batch(B, buf, BENCH_COUNT * 48, times, BENCH_COUNT, '\n', &used, 0));
+
+  // Parsing uses what the batch left in the buffer
+  BENCHTIME("sscanf+timegm", for (p = buf, i = 0; i < BENCH_COUNT; i++, p += len + 1)
+	    {
+	      len = strchr(p, '\n') - p;
+	      p[len] = '\0';
+	      sscanf(p, "%4u-%2u-%2uT%2u:%2u:%2u%n", &year, &mon, &mday, &hour, &min, &sec, &n);
+	      memset(&t, 0, sizeof(t));
+	      t.tm_year = year - 1900;
+	      t.tm_mon = mon - 1;
+	      t.tm_mday = mday;
+	      t.tm_hour = hour;
+	      t.tm_min = min;
+	      t.tm_sec = sec;
+	      times2[i].tv_sec = timegm(&t);
+	      frac = 0;
+	      if (p[n] == '.')
+		for (frac = strtoul(p + n + 1, &digits, 10), n = digits - p - n - 1; n < 9; n++)
+		  frac *= 10;
+	      times2[i].tv_nsec = frac;
+	      p[len] = '\n';
+	    });
+  BENCHTIME("bk_time_iso_parse", for (p = buf, i = 0; i < BENCH_COUNT; i++, p += len + 1)
+	    {
+	      len = strchr(p, '\n') - p;
+	      p[len] = '\0';
+	      bk_time_iso_parse(B, p, &times2[i], 0);
+	      p[len] = '\n';
+	    });
+  BENCHTIME("bk_time_iso_parse_batch", bk_time_iso_parse_batch(B, buf, used, '\n', times2, BENCH_COUNT, NULL, 0));
+
+  if (memcmp(times, times2, BENCH_COUNT * sizeof(*times)))
+    printf("Parsed times differ from formatted ones\n");
+
+  free(times);
+  free(times2);
+  free(buf);
+
+  BK_VRETURN(B);
+}
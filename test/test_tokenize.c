@@ -0,0 +1,463 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Check that bk_string_tokenize_spans finds the same tokens as the
+ * general bk_string_tokenize_split, without copying those it need not,
+ * and optionally time the two.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_ROUNDS	      200000		///< Random strings checked
+#define TEST_MAXLEN	      64		///< Longest random string
+#define BENCH_COUNT	      100000		///< Lines tokenized per measurement
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_bench;		///< Measurements of each tokenizer
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static int compare(bk_s B, const char *src, u_int limit, const char *spliton, bk_flags flags, const struct bk_strtok *bst, char **tokens);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Time tokenizers"), N_("rounds") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_bench = atoi(poptGetOptArg(optCon));
+      if (pc->pc_bench < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_bench)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Check tokens with known answers, then random strings tokenized by the
+ * span tokenizer, by bk_string_tokenize_split, and by its general state
+ * machine (which an empty variable database forces it to use).
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const struct
+  {
+    const char *	src;			// String to tokenize
+    u_int		limit;			// Token limit
+    const char *	spliton;		// Split characters
+    bk_flags		flags;			// Tokenize flags
+    u_int		count;			// Expected number of tokens
+    const char *	tokens;			// Expected tokens, each followed by |
+  } known[] =
+  {
+    { "a b  c", 0, NULL, BK_STRING_TOKENIZE_SIMPLE, 3, "a|b|c|" },
+    { "a:b::c:", 0, ":", 0, 4, "a|b||c|" },
+    { "  lead", 0, " ", BK_STRING_TOKENIZE_SKIPLEADING, 1, "lead|" },
+    { "   ", 0, " ", BK_STRING_TOKENIZE_SKIPLEADING, 1, "|" },
+    { "", 0, " ", 0, 0, "" },
+    { "", 0, " ", BK_STRING_TOKENIZE_WANT_EMPTY_TOKEN, 1, "|" },
+    { "'One two' \"three  four!\"", 0, " ", BK_STRING_TOKENIZE_SINGLEQUOTE|BK_STRING_TOKENIZE_DOUBLEQUOTE, 2, "One two|three  four!|" },
+    { "'One two' \"three  four!\"", 4, " ", 0, 4, "'One|two'|\"three| four!\"|" },
+    { "'One two' \"three  four!\"", 5, " ", 0, 5, "'One|two'|\"three||four!\"|" },
+    { "\\n \\t \\0106 \\q", 0, " ", BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_CHAR|BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_OCT, 4, "\n|\t|F|\\q|" },
+    { "\"Hello\\\" World\" x\\ y", 0, " ", BK_STRING_TOKENIZE_DOUBLEQUOTE|BK_STRING_TOKENIZE_BACKSLASH, 2, "Hello\" World|x y|" },
+    { "a\\", 0, " ", BK_STRING_TOKENIZE_BACKSLASH, 1, "a|" },
+    { "'open", 0, " ", BK_STRING_TOKENIZE_SINGLEQUOTE, 1, "open|" },
+  };
+  static const char *splitons[] =
+  {
+    " ", " \t", ":", ",;", "\351",
+    "\001\021\041\061\101\121\141\161\201",	// Too many high nibbles for a vector scan
+  };
+  static const char alphabet[] = "ab \t:,;'\"\\0n7\351";
+  static const char *novars[] = { NULL };
+  const bk_flags randflags[] =
+  {
+    BK_STRING_TOKENIZE_MULTISPLIT, BK_STRING_TOKENIZE_SINGLEQUOTE, BK_STRING_TOKENIZE_DOUBLEQUOTE,
+    BK_STRING_TOKENIZE_BACKSLASH, BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_CHAR,
+    BK_STRING_TOKENIZE_BACKSLASH_INTERPOLATE_OCT, BK_STRING_TOKENIZE_SKIPLEADING,
+    BK_STRING_TOKENIZE_WANT_EMPTY_TOKEN,
+  };
+  struct bk_strtok bst;
+  char src[TEST_MAXLEN + 1], expect[TEST_MAXLEN * 2], *p, **tokens;
+  const char *spliton, *line;
+  int bad = 0, round, cnt;
+  bk_flags flags;
+  u_int limit, j;
+  size_t i, len;
+
+  memset(&bst, 0, sizeof(bst));
+
+  for (i = 0; i < sizeof(known) / sizeof(*known); i++)
+  {
+    cnt = bk_string_tokenize_spans(B, &bst, known[i].src, strlen(known[i].src), known[i].limit, known[i].spliton, known[i].flags);
+    for (j = 0, p = expect; cnt > 0 && j < (u_int)cnt; j++)
+    {
+      memcpy(p, bst.bst_tokens[j].bss_ptr, bst.bst_tokens[j].bss_len);
+      p += bst.bst_tokens[j].bss_len;
+      *p++ = '|';
+    }
+    *p = '\0';
+    if (cnt != (int)known[i].count || strcmp(expect, known[i].tokens))
+    {
+      fprintf(stderr, "\"%s\" gave %d tokens \"%s\"\n", known[i].src, cnt, expect);
+      bad++;
+    }
+  }
+
+  // Plain tokens, and a quoted one which is a single run, stay in the source
+  line = "GET /index.html 200 'quoted text' a'b c'd";
+  if (bk_string_tokenize_spans(B, &bst, line, strlen(line), 0, " ", BK_STRING_TOKENIZE_SINGLEQUOTE) != 5 ||
+      bst.bst_tokens[0].bss_ptr != line || bst.bst_tokens[2].bss_ptr != line + 16 ||
+      bst.bst_tokens[3].bss_ptr != line + 21 || bst.bst_tokens[3].bss_len != 11 ||
+      (bst.bst_tokens[4].bss_ptr >= line && bst.bst_tokens[4].bss_ptr < line + strlen(line)) ||
+      bst.bst_tokens[4].bss_len != 5 || memcmp(bst.bst_tokens[4].bss_ptr, "ab cd", 5))
+  {
+    fprintf(stderr, "Tokens were not left in the source\n");
+    bad++;
+  }
+
+  for (round = 0; round < TEST_ROUNDS; round++)
+  {
+    len = random() % (TEST_MAXLEN + 1);
+    for (i = 0; i < len; i++)
+      src[i] = (random() % 2) ? 'a' : alphabet[random() % (sizeof(alphabet) - 1)];
+    src[len] = '\0';
+
+    spliton = splitons[random() % (sizeof(splitons) / sizeof(*splitons))];
+    limit = (random() % 2) ? 0 : random() % 5;
+    for (flags = 0, j = 0; j < sizeof(randflags) / sizeof(*randflags); j++)
+      if (random() % 2)
+	flags |= randflags[j];
+
+    if (bk_string_tokenize_spans(B, &bst, src, len, limit, spliton, flags) < 0)
+    {
+      fprintf(stderr, "Could not tokenize \"%s\"\n", src);
+      bad++;
+      continue;
+    }
+
+    if (!(tokens = bk_string_tokenize_split(B, src, limit, spliton, NULL, NULL, novars, flags)))
+      bk_die(B, 1, stderr, _("Could not tokenize\n"), BK_WARNDIE_WANTDETAILS);
+    bad += compare(B, src, limit, spliton, flags, &bst, tokens);
+    bk_string_tokenize_destroy(B, tokens);
+
+    if (!(tokens = bk_string_tokenize_split(B, src, limit, spliton, NULL, NULL, NULL, flags)))
+      bk_die(B, 1, stderr, _("Could not tokenize\n"), BK_WARNDIE_WANTDETAILS);
+    bad += compare(B, src, limit, spliton, flags, &bst, tokens);
+    bk_string_tokenize_destroy(B, tokens);
+  }
+
+  bk_string_tokenize_spans_free(B, &bst);
+
+  if (bad)
+  {
+    fprintf(stderr, "%d tokenization errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Time tokenizing web server log lines with the general
+ * bk_string_tokenize_split, with bk_string_tokenize_split as it
+ * normally runs, and with bk_string_tokenize_spans.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const char *novars[] = { NULL };
+  struct timeval start, end, delta;
+  struct bk_strtok bst;
+  char (*lines)[256], **tokens;
+  size_t bytes = 0, sum = 0;
+  int i, r;
+
+#define BENCHTOK(name, expr)								\
+  do {											\
+    double best = 0;									\
+											\
+    for (r = 0; r < pc->pc_bench; r++)							\
+    {											\
+      gettimeofday(&start, NULL);							\
+      for (i = 0; i < BENCH_COUNT; i++)							\
+      {											\
+	expr;										\
+      }											\
+      gettimeofday(&end, NULL);								\
+      BK_TV_SUB(&delta, &end, &start);							\
+      if (!r || BK_TV2F(&delta) < best)							\
+	best = BK_TV2F(&delta);								\
+    }											\
+    printf("%-28s %8.2f M lines/s %8.1f MB/s\n", name, BENCH_COUNT / best / 1e6, bytes / best / 1e6); \
+  } while (0)
+
+  memset(&bst, 0, sizeof(bst));
+  if (!(lines = malloc(BENCH_COUNT * sizeof(*lines))))
+    bk_die(B, 1, stderr, _("Could not allocate benchmark data\n"), BK_WARNDIE_WANTDETAILS);
+
+  for (i = 0; i < BENCH_COUNT; i++)
+  {
+    bytes += snprintf(lines[i], sizeof(lines[i]), "10.%ld.%ld.%ld - user%ld [10/Oct/2020:13:%02ld:%02ld -0700] \"GET /dir%ld/page%ld.html HTTP/1.1\" 200 %ld \"http://example.com/ref%ld\" \"Mozilla/5.0 (X11; Linux x86_64)\"",
+		      random() % 256, random() % 256, random() % 256, random() % 1000, random() % 60, random() % 60,
+		      random() % 100, random() % 10000, random() % 100000, random() % 1000);
+  }
+
+  BENCHTOK("general tokenize_split", tokens = bk_string_tokenize_split(B, lines[i], 0, NULL, NULL, NULL, novars, BK_STRING_TOKENIZE_NORMAL); sum += tokens[3][0]; bk_string_tokenize_destroy(B, tokens));
+  BENCHTOK("bk_string_tokenize_split", tokens = bk_string_tokenize_split(B, lines[i], 0, NULL, NULL, NULL, NULL, BK_STRING_TOKENIZE_NORMAL); sum += tokens[3][0]; bk_string_tokenize_destroy(B, tokens));
+  BENCHTOK("bk_string_tokenize_spans", bk_string_tokenize_spans(B, &bst, lines[i], strlen(lines[i]), 0, NULL, BK_STRING_TOKENIZE_NORMAL); sum += bst.bst_tokens[3].bss_len);
+
+  // Keep the compiler from discarding the work
+  if (sum == 0x12)
+    printf("\n");
+
+  bk_string_tokenize_spans_free(B, &bst);
+  free(lines);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Compare the tokens found as spans with those of bk_string_tokenize_split
+ * (where a NUL made by an octal escape ends the string).
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param src String tokenized
+ *	@param limit Token limit
+ *	@param spliton Split characters
+ *	@param flags Tokenize flags
+ *	@param bst Span tokens
+ *	@param tokens Split tokens
+ *	@return <i>0</i> if the same
+ *	@return <br><i>1</i> if different
+ */
+static int compare(bk_s B, const char *src, u_int limit, const char *spliton, bk_flags flags, const struct bk_strtok *bst, char **tokens)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  const struct bk_strspan *span;
+  const char *nul;
+  size_t len;
+  u_int i;
+
+  for (i = 0; i < bst->bst_count && tokens[i]; i++)
+  {
+    span = &bst->bst_tokens[i];
+    len = (nul = memchr(span->bss_ptr, '\0', span->bss_len)) ? (size_t)(nul - span->bss_ptr) : span->bss_len;
+    if (strlen(tokens[i]) != len || memcmp(tokens[i], span->bss_ptr, len))
+      break;
+  }
+
+  if (i == bst->bst_count && !tokens[i])
+    BK_RETURN(B, 0);
+
+  fprintf(stderr, "\"%s\" split on \"%s\" with limit %u and flags %x differs at token %u\n", src, spliton, limit, flags, i);
+  BK_RETURN(B, 1);
+}
@@ -24,6 +24,8 @@ static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.
 
 
 #define ERRORQUEUE_DEPTH 32			///< Default depth
+#define CHECK_COUNT 20000			///< Random urls checked
+#define BENCH_COUNT 100000			///< Urls per measurement
 
 /**
  * Information of international importance to everyone
@@ -43,12 +45,15 @@ struct global_structure
 struct program_config
 {
   bk_url_parse_mode_e pc_parse_mode;
+  int pc_bench;					///< Measurements of each kind
 };
 
 
 
 int proginit(bk_s B, struct program_config *pconfig);
 void progrun(bk_s B, struct program_config *pconfig);
+int progcheck(bk_s B, struct program_config *pconfig);
+void progbench(bk_s B, struct program_config *pconfig);
 
 
 
@@ -79,6 +84,7 @@ main(int argc, char **argv, char **envp)
     {"vptr-copy", 'c', POPT_ARG_NONE, NULL, 'c', "Use Vptr Copy mode", NULL },
     {"str-null", 'n', POPT_ARG_NONE, NULL, 'n', "Use string NULL mode", NULL },
     {"str-empty", 'e', POPT_ARG_NONE, NULL, 'e', "Use string empty mode", NULL },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', "Time url parsing", "rounds" },
     POPT_AUTOHELP
     POPT_TABLEEND
   };
@@ -122,6 +128,11 @@ main(int argc, char **argv, char **envp)
     case 'e':
       pconfig->pc_parse_mode = BkUrlParseStrEmpty;
       break;
+    case 'b':
+      pconfig->pc_bench = atoi(poptGetOptArg(optCon));
+      if (pconfig->pc_bench < 1)
+	getopterr++;
+      break;
     default:
       getopterr++;
       break;
@@ -143,7 +154,13 @@ main(int argc, char **argv, char **envp)
     bk_die(B,254,stderr,"Could not perform program initialization\n",0);
   }
 
-  progrun(B, pconfig);
+  if (progcheck(B, pconfig) < 0)
+    bk_exit(B, 1);
+
+  if (pconfig->pc_bench)
+    progbench(B, pconfig);
+  else
+    progrun(B, pconfig);
   bk_exit(B,0);
   abort();
   return(255);
@@ -315,3 +332,289 @@ void progrun(bk_s B, struct program_config *pconfig)
 
   BK_VRETURN(B);
 }
+
+
+
+/**
+ * Whether a span found by bk_url_parse_spans is the element found by
+ * bk_url_parse in vptr mode.
+ *
+ *	@param url Url parsed
+ *	@param bu Url parsed by bk_url_parse
+ *	@param element Element of bu
+ *	@param bus Spans of url
+ *	@param span Span of bus
+ *	@param flag BK_URL_FLAG_* for element and span
+ *	@return <i>1</i> if the same
+ *	@return <br><i>0</i> if not
+ */
+static int same_part(const char *url, struct bk_url *bu, union bk_url_element_u *element, struct bk_url_spans *bus, struct bk_url_span *span, bk_flags flag)
+{
+  if (BK_FLAG_ISSET(bu->bu_flags, flag) != BK_FLAG_ISSET(bus->bus_flags, flag))
+    return(0);
+
+  if (BK_FLAG_ISCLEAR(bus->bus_flags, flag))
+    return(1);
+
+  return((char *)element->bue_vptr.ptr == BK_URL_SPAN_DATA(url, *span) && element->bue_vptr.len == BK_URL_SPAN_LEN(*span));
+}
+
+
+
+/**
+ * Check bk_url_parse_spans against bk_url_parse and
+ * bk_url_parse_authority for one url.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param url Url to check
+ *	@param flags Flags for parse
+ *	@return <i>0</i> Same
+ *	@return <br><i>-1</i> Different
+ */
+static int check_url(bk_s B, const char *url, bk_flags flags)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct bk_url_authority *bua = NULL;
+  struct bk_url_spans bus;
+  struct bk_url *bu;
+  char *auth, *s1 = NULL, *s2 = NULL;
+  int ret, userinfo, errors = 0;
+
+  bu = bk_url_parse(B, url, BkUrlParseVptr, flags);
+  ret = bk_url_parse_spans(B, url, strlen(url), &bus, flags);
+
+  // bk_url_parse takes user information as part of the host
+  userinfo = bu && BK_FLAG_ISSET(bu->bu_flags, BK_URL_FLAG_AUTHORITY) &&
+    memchr(bu->bu_authority.bue_vptr.ptr, '@', bu->bu_authority.bue_vptr.len);
+
+  // An '@' can hide a bad ipv6 address from one or the other
+  if (!bu != (ret < 0))
+  {
+    if (!strchr(url, '@'))
+      errors++;
+    goto done;
+  }
+
+  if (!bu)
+    goto done;
+
+  if (!same_part(url, bu, &bu->bu_scheme, &bus, &bus.bus_scheme, BK_URL_FLAG_SCHEME) ||
+      !same_part(url, bu, &bu->bu_authority, &bus, &bus.bus_authority, BK_URL_FLAG_AUTHORITY) ||
+      !same_part(url, bu, &bu->bu_path, &bus, &bus.bus_path, BK_URL_FLAG_PATH) ||
+      !same_part(url, bu, &bu->bu_query, &bus, &bus.bus_query, BK_URL_FLAG_QUERY) ||
+      !same_part(url, bu, &bu->bu_fragment, &bus, &bus.bus_fragment, BK_URL_FLAG_FRAGMENT))
+    errors++;
+
+  if (!userinfo && strncmp(BK_URL_SPAN_DATA(url, bus.bus_authority), "[]", 2) &&
+      (!same_part(url, bu, &bu->bu_host, &bus, &bus.bus_host, BK_URL_FLAG_HOST) ||
+       !same_part(url, bu, &bu->bu_serv, &bus, &bus.bus_serv, BK_URL_FLAG_SERV)))
+    errors++;
+
+  // The user information and host must be as bk_url_parse_authority finds them
+  if (userinfo && !strchr(url, '[') && (auth = bk_strndup(B, BK_URL_SPAN_DATA(url, bus.bus_authority), BK_URL_SPAN_LEN(bus.bus_authority))))
+  {
+    if (!(bua = bk_url_parse_authority(B, auth, 0)) ||
+	!bua->bua_user || strlen(bua->bua_user) != BK_URL_SPAN_LEN(bus.bus_user) ||
+	strncmp(bua->bua_user, BK_URL_SPAN_DATA(url, bus.bus_user), BK_URL_SPAN_LEN(bus.bus_user)) ||
+	!bua->bua_pass != BK_FLAG_ISCLEAR(bus.bus_flags, BK_URL_FLAG_PASS) ||
+	(bua->bua_pass && (strlen(bua->bua_pass) != BK_URL_SPAN_LEN(bus.bus_pass) ||
+			   strncmp(bua->bua_pass, BK_URL_SPAN_DATA(url, bus.bus_pass), BK_URL_SPAN_LEN(bus.bus_pass)))) ||
+	strlen(bua->bua_host) != BK_URL_SPAN_LEN(bus.bus_host) ||
+	strncmp(bua->bua_host, BK_URL_SPAN_DATA(url, bus.bus_host), BK_URL_SPAN_LEN(bus.bus_host)) ||
+	!bua->bua_port != BK_FLAG_ISCLEAR(bus.bus_flags, BK_URL_FLAG_SERV))
+      errors++;
+    if (bua)
+      bk_url_authority_destroy(B, bua);
+    free(auth);
+  }
+
+  if (BK_FLAG_ISSET(bus.bus_flags, BK_URL_FLAG_SCHEME))
+  {
+    s1 = bk_url_reconstruct(B, bu, BK_URL_FLAG_ALL, 0);
+    s2 = bk_url_reconstruct_spans(B, url, &bus, BK_URL_FLAG_ALL, 0);
+    if (!s1 || !s2 || strcmp(s1, s2))
+      errors++;
+    free(s1);
+    free(s2);
+  }
+
+ done:
+  if (bu)
+    bk_url_destroy(B, bu);
+  if (errors)
+    fprintf(stderr, "Url spans of %s (flags %x) differ\n", url, flags);
+  BK_RETURN(B, errors ? -1 : 0);
+}
+
+
+
+/**
+ * Check span parsing and in place unescaping against the allocating
+ * versions, over the urls in test_url.dat and random ones.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pconfig Program configuration
+ *	@return <i>0</i> Success
+ *	@return <br><i>-1</i> Some check failed
+ */
+int progcheck(bk_s B, struct program_config *pconfig)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  static const char *urls[] =
+  {
+    "http://www/baz", "file:/foo", "file://foo:80/baz", "file://foo", "file://", "file:///etc/passwd",
+    "w3:80", ":20/foo/%20bar/baz", "/foo/bar/baz", "foo:baz", "//foo/baz", "proto:////foo.bar.baz:80/path",
+    "proto:/http://foo.bar.baz:80/path", "/http://foo.bar.baz:80/path%2fpath%", "foo.bar.gaz",
+    "//foo/bar:baz", "//foo/bar?baz", "//foo?bar:baz", "//foo:bar?baz", "foo/bar:baz", "foo/bar?baz",
+    "foo?bar:baz", "", "[1:2:3:4:5:6:7:8]/foobar", "[1:2:3:4:5:6:7:8/foobar]", "[1:2:3:4:5:6:7:8]:23/foobar",
+    "tcp://[1:2:3:4:5:6:7:8]/foobar", "tcp://[1:2:3:4:5:6:7:8]:23/foobar", "tcp://[1:2:3:4::6]:23/special/address",
+    "http://user:pw@www.example.com:8080/a/b;c=d?e=f&g=h#frag", "http://user@[::1]:80/", "https://@host/",
+    "http://www.example.com/a/very/long/path/which/goes/on/past/the/first/block/of/sixty/four/bytes?and=a&query=too#end",
+  };
+  static const char pieces[] = "ab:/?#[]@%2F.";
+  struct bk_url_spans bus;
+  char url[256], copy[256], *expanded, *p;
+  size_t len;
+  u_int i, j;
+  int errors = 0;
+
+  for (i = 0; i < sizeof(urls) / sizeof(*urls); i++)
+  {
+    errors -= check_url(B, urls[i], 0);
+    errors -= check_url(B, urls[i], BK_URL_FLAG_STRICT_PARSE);
+  }
+
+  // The spans of the user information and host
+  if (bk_url_parse_spans(B, urls[29], strlen(urls[29]), &bus, 0) < 0 ||
+      BK_URL_SPAN_LEN(bus.bus_user) != 4 || BK_URL_SPAN_LEN(bus.bus_pass) != 2 ||
+      BK_URL_SPAN_LEN(bus.bus_host) != 15 || strncmp(BK_URL_SPAN_DATA(urls[29], bus.bus_serv), "8080", BK_URL_SPAN_LEN(bus.bus_serv)) ||
+      bk_url_parse_spans(B, urls[30], strlen(urls[30]), &bus, 0) < 0 ||
+      strncmp(BK_URL_SPAN_DATA(urls[30], bus.bus_host), "::1]", 4) || BK_URL_SPAN_LEN(bus.bus_host) != 3)
+  {
+    fprintf(stderr, "User information spans wrong\n");
+    errors++;
+  }
+
+  // A fragment after an empty query (which bk_url_parse loses)
+  if (bk_url_parse_spans(B, "http://a/b?#c", 13, &bus, 0) < 0 ||
+      BK_FLAG_ISSET(bus.bus_flags, BK_URL_FLAG_QUERY) || bus.bus_fragment.bup_off != 12)
+  {
+    fprintf(stderr, "Fragment after empty query wrong\n");
+    errors++;
+  }
+
+  for (i = 0; i < CHECK_COUNT; i++)
+  {
+    len = random() % 100;
+    for (j = 0; j < len; j++)
+      url[j] = random() % 2 ? 'a' + random() % 26 : pieces[random() % (sizeof(pieces) - 1)];
+    url[len] = '\0';
+
+    // bk_url_parse loses a fragment after an empty query
+    if (!strstr(url, "?#"))
+      errors -= check_url(B, url, random() % 2 ? BK_URL_FLAG_STRICT_PARSE : 0);
+
+    memcpy(copy, url, len + 1);
+    if (!(expanded = bk_url_unescape_len(B, url, len)))
+      BK_RETURN(B, -1);
+    j = bk_url_unescape_inplace(B, copy, len);
+    if (j != strlen(expanded) || memcmp(copy, expanded, j))
+    {
+      fprintf(stderr, "Unescape of %s in place differs\n", url);
+      errors++;
+    }
+    free(expanded);
+  }
+
+  // Only what is asked for is unescaped, and the rest left alone
+  strcpy(url, "a%41%2%%42%1f%7e%GZ%4");
+  if (!(p = bk_url_unescape_len(B, url, 12)) || strcmp(p, "aA%2%B%1") ||
+      bk_url_unescape_inplace(B, url, strlen(url)) != 15 || strncmp(url, "aA%2%B%1f~%GZ%4", 15))
+  {
+    fprintf(stderr, "Unescape of %s wrong\n", "a%41%2%%42%1f%7e%GZ%4");
+    errors++;
+  }
+  free(p);
+
+  BK_RETURN(B, errors ? -1 : 0);
+}
+
+
+
+/**
+ * Time url parsing with allocation and with spans.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pconfig Program configuration
+ */
+void progbench(bk_s B, struct program_config *pconfig)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  struct timeval start, end, delta;
+  struct bk_url_authority *bua;
+  struct bk_url_spans bus;
+  struct bk_url *bu;
+  char **urls, *p, *q;
+  size_t bytes = 0, sum = 0;
+  u_int i;
+  int r;
+
+#define BENCHURL(name, expr)								\
+  do {											\
+    double best = 0;									\
+											\
+    for (r = 0; r < pconfig->pc_bench; r++)						\
+    {											\
+      gettimeofday(&start, NULL);							\
+      for (i = 0; i < BENCH_COUNT; i++)							\
+      {											\
+	expr;										\
+      }											\
+      gettimeofday(&end, NULL);								\
+      BK_TV_SUB(&delta, &end, &start);							\
+      if (!r || BK_TV2F(&delta) < best)							\
+	best = BK_TV2F(&delta);								\
+    }											\
+    printf("%-32s %8.1f ns/url %8.1f MB/s\n", name, best * 1e9 / BENCH_COUNT, bytes / best / 1e6); \
+  } while (0)
+
+  if (!(urls = malloc(BENCH_COUNT * sizeof(*urls))))
+    bk_die(B, 1, stderr, "Could not allocate benchmark data\n", BK_WARNDIE_WANTDETAILS);
+
+  // What a proxy sees
+  for (i = 0; i < BENCH_COUNT; i++)
+  {
+    if (!(urls[i] = malloc(256)))
+      bk_die(B, 1, stderr, "Could not allocate benchmark data\n", BK_WARNDIE_WANTDETAILS);
+    bytes += snprintf(urls[i], 256, "http://%s%ld.example.com:%ld/api/v%ld/items/%ld?session=%lx&q=caf%%C3%%A9+%ld#top",
+		      random() % 4 ? "" : "user:secret@", random() % 1000, random() % 2 ? 80 : 8080 + random() % 10,
+		      random() % 3, random(), random(), random() % 100);
+  }
+
+  BENCHURL("bk_url_parse (strings)", bu = bk_url_parse(B, urls[i], BkUrlParseStrNULL, 0);
+	   sum += strlen(bu->bu_path.bue_str);
+	   bk_url_destroy(B, bu));
+  BENCHURL("bk_url_parse + authority", bu = bk_url_parse(B, urls[i], BkUrlParseStrNULL, 0);
+	   bua = bk_url_parse_authority(B, bu->bu_authority.bue_str, 0);
+	   p = bk_url_unescape(B, bu->bu_query.bue_str);
+	   sum += strlen(bua->bua_host) + strlen(p);
+	   free(p);
+	   bk_url_authority_destroy(B, bua);
+	   bk_url_destroy(B, bu));
+  BENCHURL("bk_url_parse (vptrs)", bu = bk_url_parse(B, urls[i], BkUrlParseVptr, 0);
+	   sum += bu->bu_path.bue_vptr.len;
+	   bk_url_destroy(B, bu));
+  BENCHURL("bk_url_parse_spans", bk_url_parse_spans(B, urls[i], strlen(urls[i]), &bus, 0);
+	   sum += bus.bus_path.bup_len);
+
+  // Unescaping in place changes the urls, so this goes last
+  BENCHURL("bk_url_parse_spans + unescape", bk_url_parse_spans(B, urls[i], strlen(urls[i]), &bus, 0);
+	   q = (char *)BK_URL_SPAN_DATA(urls[i], bus.bus_query);
+	   sum += bk_url_unescape_inplace(B, q, BK_URL_SPAN_LEN(bus.bus_query)) + bus.bus_host.bup_len);
+
+  for (i = 0; i < BENCH_COUNT; i++)
+    free(urls[i]);
+  free(urls);
+
+  BK_VRETURN(B);
+}
@@ -0,0 +1,513 @@
+#if !defined(lint)
+static const char libbk__copyright[] __attribute__((unused)) = "Copyright © 2003-2019";
+static const char libbk__contact[] __attribute__((unused)) = "<projectbaka@baka.org>";
+#endif /* not lint */
+/*
+ * ++Copyright BAKA++
+ *
+ * Copyright © 2003-2019 The Authors. All rights reserved.
+ *
+ * This source code is licensed to you under the terms of the file
+ * LICENSE.TXT in this release for further details.
+ *
+ * Send e-mail to <projectbaka@baka.org> for further information.
+ *
+ * - -Copyright BAKA- -
+ */
+
+/**
+ * @file
+ *
+ * Test the flat vault against the CLC hash vault, and optionally
+ * benchmark the two.
+ */
+#include <libbk.h>
+#include <libbk_i18n.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif /* __GLIBC__ */
+
+
+#define STD_LOCALEDIR_KEY     "LOCALEDIR"	///< Key in bkconfig to find the locale translation files
+#define STD_LOCALEDIR_ENV     "BAKA_HOME"	///< Key in Environment to find base of locale directory
+#define STD_LOCALEDIR_DEF     "/usr/local/baka"	///< Default base of where locale directory might be found
+#define STD_LOCALEDIR_SUB     "locale"		///< Sub-component from install base where locale might be found
+#define ERRORQUEUE_DEPTH      32		///< Default error queue depth
+#define TEST_KEYS	      20000		///< Keys in functional test
+
+
+
+/**
+ * Information of international importance to everyone
+ * which cannot be passed around.
+ */
+struct global_structure
+{
+} Global;
+
+
+
+/**
+ * Information about basic program runtime configuration
+ * which must be passed around.
+ */
+struct program_config
+{
+  bk_flags		pc_flags;		///< Flags are fun!
+#define PC_VERBOSE	0x001			///< Verbose output
+  int			pc_benchkeys;		///< Number of keys to benchmark with
+};
+
+
+
+static void progrun(bk_s B, struct program_config *pc);
+static void progbench(bk_s B, struct program_config *pc);
+static struct bk_vault_node *mknodes(bk_s B, int nkeys, const char *fmt);
+static size_t heapinuse(void);
+
+
+
+/**
+ * Program entry point
+ *
+ *	@param argc Number of argv elements
+ *	@param argv Program name and arguments
+ *	@param envp Program environment
+ *	@return <i>0</i> Success
+ *	@return <br><i>254</i> Initialization failed
+ */
+int
+main(int argc, char **argv, char **envp)
+{
+  bk_s B = NULL;				/* Baka general structure */
+  BK_ENTRY_MAIN(B, __FUNCTION__, __FILE__, "SIMPLE");
+
+  int c;
+  int getopterr = 0;
+  int debug_level = 0;
+  char i18n_localepath[_POSIX_PATH_MAX];
+  char *i18n_locale;
+  struct program_config Pconfig, *pc = NULL;
+  poptContext optCon = NULL;
+  struct poptOption optionsTable[] =
+  {
+    {"debug", 'd', POPT_ARG_NONE, NULL, 'd', N_("Turn on debugging"), NULL },
+    {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', N_("Turn on verbose message"), NULL },
+    {"no-seatbelts", 0, POPT_ARG_NONE, NULL, 0x1000, N_("Sealtbelts off & speed up"), NULL },
+    {"seatbelts", 0, POPT_ARG_NONE, NULL, 0x1001, N_("Enable function tracing"), NULL },
+    {"profiling", 0, POPT_ARG_STRING, NULL, 0x1002, N_("Enable and write profiling data"), N_("filename") },
+    {"benchmark", 'b', POPT_ARG_INT, NULL, 'b', N_("Compare flat and hash vault speed and memory"), N_("keys") },
+
+    POPT_AUTOHELP
+    POPT_TABLEEND
+  };
+
+  if (!(B=bk_general_init(argc, &argv, &envp, BK_ENV_GWD(NULL, "BK_ENV_CONF_APP", BK_APP_CONF), NULL, ERRORQUEUE_DEPTH, LOG_LOCAL0, 0)))
+  {
+    fprintf(stderr,"Could not perform basic initialization\n");
+    exit(254);
+  }
+  bk_fun_reentry(B);
+
+  // Enable error output
+  bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_ERR,
+		  BK_ERR_ERR, BK_ERROR_CONFIG_FH |
+		  BK_ERROR_CONFIG_SYSLOGTHRESHOLD | BK_ERROR_CONFIG_HILO_PIVOT);
+
+  // i18n stuff
+  setlocale(LC_ALL, "");
+  if (!(i18n_locale = BK_GWD(B, STD_LOCALEDIR_KEY, NULL)))
+  {
+    i18n_locale = i18n_localepath;
+    snprintf(i18n_localepath, sizeof(i18n_localepath), "%s/%s", BK_ENV_GWD(B, STD_LOCALEDIR_ENV,STD_LOCALEDIR_DEF), STD_LOCALEDIR_SUB);
+  }
+  bindtextdomain(BK_GENERAL_PROGRAM(B), i18n_locale);
+  textdomain(BK_GENERAL_PROGRAM(B));
+  for (c = 0; optionsTable[c].longName || optionsTable[c].shortName; c++)
+  {
+    if (optionsTable[c].descrip) (*((char **)&(optionsTable[c].descrip)))=_(optionsTable[c].descrip);
+    if (optionsTable[c].argDescrip) (*((char **)&(optionsTable[c].argDescrip)))=_(optionsTable[c].argDescrip);
+  }
+
+  pc = &Pconfig;
+  memset(pc, 0, sizeof(*pc));
+
+  if (!(optCon = poptGetContext(NULL, argc, (const char **)argv, optionsTable, 0)))
+  {
+    bk_error_printf(B, BK_ERR_ERR, "Could not initialize options processing\n");
+    bk_exit(B, 254);
+  }
+
+  while ((c = poptGetNextOpt(optCon)) >= 0)
+  {
+    switch (c)
+    {
+    case 'd':					// debug
+      if (!debug_level)
+      {
+	// Set up debugging, from config file
+	bk_general_debug_config(B, stderr, BK_ERR_NONE, 0);
+	bk_debug_printf(B, "Debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 1)
+      {
+	/*
+	 * Enable output of error and higher error logs (this can be
+	 * annoying so require -dd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_ERR, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Extra debugging on\n");
+	debug_level++;
+      }
+      else if (debug_level == 2)
+      {
+	/*
+	 * Enable output of all levels of bk_error logs (this can be
+	 * very annoying so require -ddd)
+	 */
+	bk_error_config(B, BK_GENERAL_ERROR(B), 0, stderr, BK_ERR_NONE, BK_ERR_DEBUG, BK_ERROR_CONFIG_FH | BK_ERROR_CONFIG_HILO_PIVOT | BK_ERROR_CONFIG_SYSLOGTHRESHOLD);
+	bk_debug_printf(B, "Super-extra debugging on\n");
+	debug_level++;
+      }
+      break;
+    case 'v':					// verbose
+      BK_FLAG_SET(pc->pc_flags, PC_VERBOSE);
+      bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
+      break;
+    case 0x1000:				// no-seatbelts
+      BK_FLAG_CLEAR(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1001:				// seatbelts
+      BK_FLAG_SET(BK_GENERAL_FLAGS(B), BK_BGFLAGS_FUNON);
+      break;
+    case 0x1002:				// profiling
+      bk_general_funstat_init(B, (char *)poptGetOptArg(optCon), 0);
+      break;
+    case 'b':					// benchmark
+      pc->pc_benchkeys = atoi(poptGetOptArg(optCon));
+      if (pc->pc_benchkeys < 1)
+	getopterr++;
+      break;
+    default:
+      getopterr++;
+      break;
+    }
+  }
+
+  /*
+   * Reprocess so that argc and argv contain the remaining command
+   * line arguments (note argv[0] is an argument, not the program
+   * name).  argc remains the number of elements in the argv array.
+   */
+  argv = (char **)poptGetArgs(optCon);
+  argc = 0;
+  if (argv)
+    for (; argv[argc]; argc++)
+      ; // Void
+
+  if (c < -1 || getopterr)
+  {
+    if (c < -1)
+    {
+      fprintf(stderr, "%s\n", poptStrerror(c));
+    }
+    poptPrintUsage(optCon, stderr, 0);
+    bk_exit(B, 254);
+  }
+
+  progrun(B, pc);
+
+  if (pc->pc_benchkeys)
+    progbench(B, pc);
+
+  poptFreeContext(optCon);
+  bk_exit(B, 0);
+  return(255);					// Stupid INSIGHT stuff.
+}
+
+
+
+/**
+ * Exercise every flat vault operation and check the results against a
+ * CLC hash vault holding the same nodes.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progrun(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  bk_flatvault_t fv = NULL;
+  bk_vault_t hv = NULL;
+  struct bk_vault_node *nodes = NULL, dup, *node, *old;
+  dict_iter iter;
+  char *seen = NULL;
+  int i, cnt, bad = 0;
+
+  if (!(nodes = mknodes(B, TEST_KEYS, "key%d")) || !(seen = calloc(TEST_KEYS, 1)) ||
+      !(fv = bk_flatvault_create(B, 0, 0)) || !(hv = bk_vault_create(B, 0, 0, 0)))
+    bk_die(B, 1, stderr, _("Could not set up vault test\n"), BK_WARNDIE_WANTDETAILS);
+
+  // Starts at minimum size, so this grows the table many times
+  for (i = 0; i < TEST_KEYS; i++)
+  {
+    if (bk_flatvault_insert(fv, &nodes[i]) != DICT_OK || bk_vault_insert(hv, &nodes[i]) != DICT_OK)
+    {
+      fprintf(stderr, "Insert of %s failed: %s\n", nodes[i].key, bk_flatvault_error_reason(fv, NULL));
+      bad++;
+    }
+  }
+
+  dup.key = nodes[17].key;
+  dup.value = NULL;
+  if (bk_flatvault_insert(fv, &dup) == DICT_OK ||
+      bk_flatvault_insert_uniq(fv, &dup, (dict_obj *)&old) == DICT_OK || old != &nodes[17])
+  {
+    fprintf(stderr, "Duplicate key was not rejected\n");
+    bad++;
+  }
+
+  for (i = 0; i < TEST_KEYS; i++)
+  {
+    if (bk_flatvault_search(fv, (dict_key)nodes[i].key) != bk_vault_search(hv, (dict_key)nodes[i].key) ||
+	bk_flatvault_searchhelp(fv, nodes[i].key) != nodes[i].value)
+    {
+      fprintf(stderr, "Search for %s disagrees\n", nodes[i].key);
+      bad++;
+    }
+  }
+
+  if (bk_flatvault_search(fv, "absent") || bk_flatvault_searchhelp(fv, "key"))
+  {
+    fprintf(stderr, "Found a key which was never inserted\n");
+    bad++;
+  }
+
+  // Delete every other key, half directly and half by helper
+  for (i = 0; i < TEST_KEYS; i += 2)
+  {
+    if ((i % 4 ? bk_flatvault_deletehelp(fv, nodes[i].key) : bk_flatvault_delete(fv, &nodes[i])) != DICT_OK ||
+	bk_vault_delete(hv, &nodes[i]) != DICT_OK)
+    {
+      fprintf(stderr, "Delete of %s failed\n", nodes[i].key);
+      bad++;
+    }
+  }
+
+  if (bk_flatvault_delete(fv, &nodes[0]) == DICT_OK || bk_flatvault_delete(fv, &dup) == DICT_OK)
+  {
+    fprintf(stderr, "Delete of a node not in the vault succeeded\n");
+    bad++;
+  }
+
+  // Iteration must see each remaining node exactly once, both ways
+  cnt = 0;
+  iter = bk_flatvault_iterate(fv, DICT_FROM_START);
+  while ((node = bk_flatvault_nextobj(fv, iter)))
+  {
+    i = node - nodes;
+    if (i < 0 || i >= TEST_KEYS || !(i & 1) || seen[i]++)
+      bad++;
+    cnt++;
+  }
+  bk_flatvault_iterate_done(fv, iter);
+
+  iter = bk_flatvault_iterate(fv, DICT_FROM_END);
+  while ((node = bk_flatvault_nextobj(fv, iter)))
+    if (--seen[node - nodes])
+      bad++;
+  bk_flatvault_iterate_done(fv, iter);
+
+  for (node = bk_flatvault_minimum(fv), i = 0; node; node = bk_flatvault_successor(fv, node))
+    i++;
+  for (node = bk_flatvault_maximum(fv); node; node = bk_flatvault_predecessor(fv, node))
+    i--;
+
+  if (cnt != TEST_KEYS / 2 || i != 0)
+  {
+    fprintf(stderr, "Iteration saw %d nodes (%d walk difference), expected %d\n", cnt, i, TEST_KEYS / 2);
+    bad++;
+  }
+
+  // Reinsert over the tombstones; deleting the iterator's node is allowed
+  for (i = 0; i < TEST_KEYS; i += 2)
+    if (bk_flatvault_insert(fv, &nodes[i]) != DICT_OK)
+      bad++;
+
+  iter = bk_flatvault_iterate(fv, DICT_FROM_START);
+  while ((node = bk_flatvault_nextobj(fv, iter)))
+    if ((node - nodes) % 3 == 0 && bk_flatvault_delete(fv, node) != DICT_OK)
+      bad++;
+  bk_flatvault_iterate_done(fv, iter);
+
+  for (i = 0; i < TEST_KEYS; i++)
+  {
+    if ((bk_flatvault_search(fv, (dict_key)nodes[i].key) != NULL) != (i % 3 != 0))
+    {
+      fprintf(stderr, "Key %s is in the wrong state after reinsert\n", nodes[i].key);
+      bad++;
+    }
+  }
+
+  if (bad)
+  {
+    fprintf(stderr, "%d flat vault errors\n", bad);
+    exit(1);
+  }
+
+  printf("All tests passed\n");
+
+  // The nodes are one array, so only the tables go
+  bk_flatvault_destroy(fv);
+  bk_vault_destroy(hv);
+  free((void *)nodes[0].key);
+  free(nodes);
+  free(seen);
+
+  // Exercise the helper API, which owns its keys and nodes
+  if (!(fv = bk_flatvault_create(B, 100, 0)) ||
+      bk_flatvault_inserthelp(fv, strdup("one"), strdup("1")) < 0 ||
+      bk_flatvault_inserthelp(fv, strdup("two"), strdup("2")) < 0 ||
+      strcmp(bk_flatvault_searchhelp(fv, "two"), "2") ||
+      bk_flatvault_destroyhelp(fv) != DICT_OK)
+  {
+    fprintf(stderr, "Flat vault helper test failed\n");
+    exit(1);
+  }
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Compare insert, hit, miss, and delete throughput, plus the heap used
+ * by the table itself, for the flat vault and the CLC hash vault.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pc Program configuration
+ */
+static void progbench(bk_s B, struct program_config *pc)
+{
+  BK_ENTRY(B, __FUNCTION__,__FILE__,"SIMPLE");
+  int nkeys = pc->pc_benchkeys;
+  struct bk_vault_node *nodes = NULL, *misses = NULL;
+  struct timeval start, end, delta;
+  bk_flatvault_t fv = NULL;
+  bk_vault_t hv = NULL;
+  size_t heap;
+  long found;
+  int i;
+
+  if (!(nodes = mknodes(B, nkeys, "/some/path/%x/key")) || !(misses = mknodes(B, nkeys, "/some/path/%x/miss")))
+    bk_die(B, 1, stderr, _("Could not allocate benchmark keys\n"), BK_WARNDIE_WANTDETAILS);
+
+#define BENCHREPORT(what)											\
+  do {														\
+    gettimeofday(&end, NULL);											\
+    BK_TV_SUB(&delta, &end, &start);										\
+    printf("%-24s %8.3f s  %8.2f Mops/s\n", what, BK_TV2F(&delta), nkeys / BK_TV2F(&delta) / 1000000.0);	\
+    gettimeofday(&start, NULL);											\
+  } while (0)
+
+#define BENCHVAULT(name, vault, create, pfx)									\
+  do {														\
+    printf("%s vault, %d keys\n", name, nkeys);								\
+    heap = heapinuse();												\
+    gettimeofday(&start, NULL);											\
+    if (!(vault = create))											\
+      bk_die(B, 1, stderr, _("Could not create vault\n"), BK_WARNDIE_WANTDETAILS);				\
+    for (i = 0; i < nkeys; i++)											\
+      if (pfx##_insert(vault, &nodes[i]) != DICT_OK)								\
+	bk_die(B, 1, stderr, _("Could not insert\n"), BK_WARNDIE_WANTDETAILS);					\
+    BENCHREPORT("  insert");											\
+    if (heapinuse() > heap)											\
+      printf("  %-22s %8.1f bytes/key\n", "memory", (double)(heapinuse() - heap) / nkeys);			\
+    gettimeofday(&start, NULL);											\
+    for (found = 0, i = 0; i < nkeys; i++)									\
+      found += pfx##_search(vault, (dict_key)nodes[i].key) != NULL;						\
+    BENCHREPORT("  search hit");										\
+    for (i = 0; i < nkeys; i++)											\
+      found -= pfx##_search(vault, (dict_key)misses[i].key) != NULL;						\
+    BENCHREPORT("  search miss");										\
+    for (i = 0; i < nkeys; i++)											\
+      if (pfx##_delete(vault, &nodes[i]) != DICT_OK)								\
+	found = -1;												\
+    BENCHREPORT("  delete");											\
+    if (found != nkeys)												\
+      bk_die(B, 1, stderr, _("Vault results are wrong\n"), BK_WARNDIE_WANTDETAILS);				\
+    pfx##_destroy(vault);											\
+  } while (0)
+
+  BENCHVAULT("Flat", fv, bk_flatvault_create(B, nkeys, 0), bk_flatvault);
+  BENCHVAULT("Hash", hv, bk_vault_create(B, nkeys, 0, 0), bk_vault);
+
+  free((void *)nodes[0].key);
+  free((void *)misses[0].key);
+  free(nodes);
+  free(misses);
+
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * Make an array of vault nodes whose keys are a format applied to the
+ * node number.  All keys share one buffer, starting at nodes[0].key.
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param nkeys Number of nodes
+ *	@param fmt printf format with one int conversion
+ *	@return <i>NULL</i> on allocation failure
+ *	@return <br><i>nodes</i> on success
+ */
+static struct bk_vault_node *mknodes(bk_s B, int nkeys, const char *fmt)
+{
+  struct bk_vault_node *nodes = NULL;
+  char *keys = NULL, *key;
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < nkeys; i++)
+    len += snprintf(NULL, 0, fmt, i) + 1;
+
+  if (!(nodes = malloc(nkeys * sizeof(*nodes))) || !(keys = malloc(len)))
+  {
+    free(nodes);
+    return(NULL);
+  }
+
+  for (key = keys, i = 0; i < nkeys; i++)
+  {
+    nodes[i].key = key;
+    nodes[i].value = (void *)(long)(i + 1);
+    key += sprintf(key, fmt, i) + 1;
+  }
+
+  return(nodes);
+}
+
+
+
+/**
+ * Bytes of heap in use, including large blocks which were mmapped, or 0
+ * if the C library cannot say.
+ *
+ *	@return <i>bytes</i> allocated
+ */
+static size_t heapinuse(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+
+  return(mi.uordblks + mi.hblkhd);
+#elif defined(__GLIBC__)
+  struct mallinfo mi = mallinfo();
+
+  return((u_int)mi.uordblks + (u_int)mi.hblkhd);
+#else
+  return(0);
+#endif /* __GLIBC__ */
+}
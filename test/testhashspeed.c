@@ -117,6 +117,11 @@ struct program_config
 
 
 
+static void hashcompare(bk_s B, struct program_config *pconfig);
+static int hashcompare_cmp(const void *a, const void *b);
+
+
+
 /**
  * Program entry point
  *
@@ -144,6 +149,7 @@ main(int argc, char **argv, char **envp)
     {"test", 'T', POPT_ARG_INT, NULL, 'T', "Set the generator test type", "test" },
     {"loops", 'l', POPT_ARG_INT, NULL, 'l', "Set the number of loops it runs", "test" },
     {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', "Turn on verbose message", NULL },
+    {"compare", 'c', POPT_ARG_NONE, NULL, 'c', "Compare bk_strhash/bk_bufhash algorithms across key lengths", NULL },
     POPT_AUTOHELP
     POPT_TABLEEND
   };
@@ -187,6 +193,10 @@ main(int argc, char **argv, char **envp)
       BK_FLAG_SET(pconfig->pc_flags, PC_VERBOSE);
       bk_error_config(B, BK_GENERAL_ERROR(B), ERRORQUEUE_DEPTH, stderr, BK_ERR_NONE, BK_ERR_ERR, 0);
       break;
+    case 'c':
+      hashcompare(B, pconfig);
+      bk_exit(B,0);
+      break;
     default:
       getopterr++;
       break;
@@ -232,6 +242,154 @@ main(int argc, char **argv, char **envp)
 }
 
 
+
+#define HC_KEYS		(1<<16)			///< Keys per timing pass (and buckets for distribution)
+#define HC_MAXLEN	1024			///< Longest key compared
+
+/**
+ * Compare the bk_strhash/bk_bufhash algorithms.  For each key length,
+ * time both functions over random keys and measure the distribution of
+ * sequential base 36 keys ("0001", "0002", ... padded to length), which
+ * is the traditional weak spot: a chi-square over 64K buckets of the low
+ * and of the high 16 bits (1.00 is ideal, well above is clustering) and
+ * the number of full 32 bit collisions (about 0.5 expected at 64K keys).
+ *
+ *	@param B BAKA Thread/Global configuration
+ *	@param pconfig Program configuration
+ */
+static void hashcompare(bk_s B, struct program_config *pconfig)
+{
+  BK_ENTRY(B, __FUNCTION__, __FILE__, "SIMPLE");
+  static const struct
+  {
+    const char *name;
+    bk_flags flags;
+  } algs[] = {
+    { "V1 K&R", BK_HASH_V1 },
+    { "V2 Jenkins", BK_HASH_V2 },
+    { "V3 murmur", BK_HASH_V3 },
+    { "V4 wyhash", BK_HASH_V4 },
+  };
+  static const u_int lens[] = { 4, 8, 16, 32, 64, 256, HC_MAXLEN };
+  char *keys = NULL, *key;
+  u_int *hashes = NULL, *counts = NULL;
+  u_int a, l, i, len, collisions;
+  u_int loops = MAX(pconfig->pc_loops, 10);
+  struct timeval start, end, delta;
+  double strns, bufns, chilo, chihi;
+  volatile u_int sink = 0;
+  bk_vptr buf;
+
+  if (!(keys = malloc(HC_KEYS * (HC_MAXLEN + 1))) || !(hashes = malloc(HC_KEYS * sizeof(*hashes))) || !(counts = malloc(HC_KEYS * sizeof(*counts))))
+  {
+    fprintf(stderr, "Could not allocate keys\n");
+    bk_exit(B, 1);
+  }
+
+  printf("%-12s %6s %10s %10s %8s %8s %6s\n", "algorithm", "keylen", "str ns", "buf ns", "chi lo", "chi hi", "coll");
+
+  for (l = 0; l < sizeof(lens)/sizeof(*lens); l++)
+  {
+    len = lens[l];
+
+    for (a = 0; a < sizeof(algs)/sizeof(*algs); a++)
+    {
+      // Speed: random printable keys
+      srandom(len);
+      for (i = 0; i < HC_KEYS; i++)
+      {
+	u_int j;
+
+	key = keys + i * (HC_MAXLEN + 1);
+	for (j = 0; j < len; j++)
+	  key[j] = 'A' + random() % 58;
+	key[len] = 0;
+      }
+
+      gettimeofday(&start, NULL);
+      for (i = 0; i < loops * HC_KEYS / len; i++)
+	sink += bk_strhash(keys + (i % HC_KEYS) * (HC_MAXLEN + 1), algs[a].flags);
+      gettimeofday(&end, NULL);
+      BK_TV_SUB(&delta, &end, &start);
+      strns = BK_TV2F(&delta) * 1e9 / (loops * HC_KEYS / len);
+
+      bufns = 0;
+      if (BK_FLAG_ISCLEAR(algs[a].flags, BK_HASH_V2))	// Not available for buffers
+      {
+	buf.len = len;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops * HC_KEYS / len; i++)
+	{
+	  buf.ptr = keys + (i % HC_KEYS) * (HC_MAXLEN + 1);
+	  sink += bk_bufhash(&buf, algs[a].flags);
+	}
+	gettimeofday(&end, NULL);
+	BK_TV_SUB(&delta, &end, &start);
+	bufns = BK_TV2F(&delta) * 1e9 / (loops * HC_KEYS / len);
+      }
+
+      // Distribution: sequential keys
+      for (i = 0; i < HC_KEYS; i++)
+      {
+	u_int v, p;
+
+	key = keys + i * (HC_MAXLEN + 1);
+	memset(key, '0', len);
+	key[len] = 0;
+	for (v = i + 1, p = len; v; v /= 36)
+	  key[--p] = "0123456789abcdefghijklmnopqrstuvwxyz"[v % 36];
+	hashes[i] = bk_strhash(key, algs[a].flags);
+      }
+
+      chilo = chihi = 0;
+      memset(counts, 0, HC_KEYS * sizeof(*counts));
+      for (i = 0; i < HC_KEYS; i++)
+	counts[hashes[i] & 0xffff]++;
+      for (i = 0; i < HC_KEYS; i++)
+	chilo += (counts[i] - 1.0) * (counts[i] - 1.0);
+      memset(counts, 0, HC_KEYS * sizeof(*counts));
+      for (i = 0; i < HC_KEYS; i++)
+	counts[hashes[i] >> 16]++;
+      for (i = 0; i < HC_KEYS; i++)
+	chihi += (counts[i] - 1.0) * (counts[i] - 1.0);
+
+      qsort(hashes, HC_KEYS, sizeof(*hashes), hashcompare_cmp);
+      for (collisions = 0, i = 1; i < HC_KEYS; i++)
+	if (hashes[i] == hashes[i-1])
+	  collisions++;
+
+      printf("%-12s %6u %10.2f ", algs[a].name, len, strns);
+      if (bufns)
+	printf("%10.2f ", bufns);
+      else
+	printf("%10s ", "-");
+      printf("%8.2f %8.2f %6u\n", chilo / HC_KEYS, chihi / HC_KEYS, collisions);
+    }
+  }
+
+  free(counts);
+  free(hashes);
+  free(keys);
+  BK_VRETURN(B);
+}
+
+
+
+/**
+ * qsort comparison of hash values
+ *
+ *	@param a First hash
+ *	@param b Second hash
+ *	@return <i>-1, 0, 1</i> ordering
+ */
+static int hashcompare_cmp(const void *a, const void *b)
+{
+  u_int x = *(const u_int *)a, y = *(const u_int *)b;
+
+  return((x > y) - (x < y));
+}
+
+
 /*
  ***********************************************************************
  ** md5.c -- the source code for MD5 routines                         **